@@ -2,10 +2,20 @@
 #include <stdlib.h>
 #include <unistd.h>
 
-#include <libfprint/fprint.h>
+#include <libfprint/fprint.hpp>
 
 int main (int argc, char **argv)
 {
 	fp_init ();
+
+	/* the binding compiles and its handles free nothing when empty */
+	fp::print print;
+	fp::gallery gallery = std::move (fp::gallery ());
+	std::vector<unsigned char> buf;
+
+	if (print || gallery || !buf.empty ())
+		return 1;
+
+	fp_exit ();
 	return 0;
 }
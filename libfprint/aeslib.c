@@ -20,6 +20,7 @@
 #define FP_COMPONENT "aeslib"
 
 #include <errno.h>
+#include <stdio.h>
 #include <string.h>
 
 #include <libusb.h>
@@ -31,19 +32,119 @@
 
 #define MAX_REGWRITES_PER_REQUEST	16
 
+/* batches of one aes_write_regv() call that may be on the wire at once,
+ * within a run of registers not divided by a zero */
+#define MAX_REGV_TRANSFERS_IN_FLIGHT	4
+
 #define BULK_TIMEOUT	4000
 #define EP_IN			(1 | LIBUSB_ENDPOINT_IN)
 #define EP_OUT			(2 | LIBUSB_ENDPOINT_OUT)
 
+/* idle transfers of a device, each with a buffer for
+ * MAX_REGWRITES_PER_REQUEST registers, kept from one register write to the
+ * next. A pool freed with transfers still on the wire is orphaned: it is
+ * detached from the device, and freed along with the last of them. */
+struct aes_regv_pool {
+	GPtrArray *idle;
+	unsigned int busy;
+	gboolean orphaned;
+};
+
+/* register tables are laid out as they go on the wire, reg then value, so
+ * batches are copied from them as they are */
+G_STATIC_ASSERT(sizeof(struct aes_regwrite) == 2);
+
 struct write_regv_data {
 	struct fp_img_dev *imgdev;
+	struct aes_regv_pool *pool;
 	unsigned int num_regs;
 	const struct aes_regwrite *regs;
 	unsigned int offset;
+	unsigned int in_flight;
+	int result;
 	aes_write_regv_cb callback;
 	void *user_data;
 };
 
+static struct aes_regv_pool *regv_pool_get(struct fp_img_dev *dev)
+{
+	struct aes_regv_pool *pool = dev->aes_regv_pool;
+
+	if (!pool) {
+		pool = dev->aes_regv_pool = g_malloc0(sizeof(*pool));
+		pool->idle = g_ptr_array_new();
+	}
+	return pool;
+}
+
+static void regv_transfer_free(struct libusb_transfer *transfer)
+{
+	g_free(transfer->buffer);
+	libusb_free_transfer(transfer);
+}
+
+static struct libusb_transfer *regv_transfer_get(struct aes_regv_pool *pool)
+{
+	struct libusb_transfer *transfer;
+
+	if (pool->idle->len > 0) {
+		transfer = g_ptr_array_remove_index_fast(pool->idle,
+			pool->idle->len - 1);
+	} else {
+		transfer = libusb_alloc_transfer(0);
+		if (!transfer)
+			return NULL;
+		transfer->buffer = g_malloc(MAX_REGWRITES_PER_REQUEST * 2);
+	}
+
+	pool->busy++;
+	return transfer;
+}
+
+/* the pool is freed here if it was orphaned and this was its last busy
+ * transfer */
+static void regv_transfer_put(struct aes_regv_pool *pool,
+	struct libusb_transfer *transfer)
+{
+	pool->busy--;
+	if (!pool->orphaned) {
+		g_ptr_array_add(pool->idle, transfer);
+		return;
+	}
+
+	regv_transfer_free(transfer);
+	if (pool->busy == 0) {
+		g_ptr_array_free(pool->idle, TRUE);
+		g_free(pool);
+	}
+}
+
+/* release the transfers kept by aes_write_regv(), for the driver's close
+ * routine. Register writes still pending, such as one issued without waiting
+ * for its completion, are left to finish without their callback. */
+void aes_regv_pool_free(struct fp_img_dev *dev)
+{
+	struct aes_regv_pool *pool = dev->aes_regv_pool;
+	unsigned int i;
+
+	if (!pool)
+		return;
+
+	for (i = 0; i < pool->idle->len; i++)
+		regv_transfer_free(g_ptr_array_index(pool->idle, i));
+	dev->aes_regv_pool = NULL;
+
+	if (pool->busy) {
+		fp_dbg("%u register writes still pending", pool->busy);
+		g_ptr_array_set_size(pool->idle, 0);
+		pool->orphaned = TRUE;
+		return;
+	}
+
+	g_ptr_array_free(pool->idle, TRUE);
+	g_free(pool);
+}
+
 static void continue_write_regv(struct write_regv_data *wdata);
 
 /* libusb bulk callback for regv write completion transfer. continues the
@@ -51,16 +152,25 @@ static void continue_write_regv(struct write_regv_data *wdata);
 static void write_regv_trf_complete(struct libusb_transfer *transfer)
 {
 	struct write_regv_data *wdata = transfer->user_data;
+	gboolean orphaned = wdata->pool->orphaned;
 
-	if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
-		wdata->callback(wdata->imgdev, -EIO, wdata->user_data);
-	else if (transfer->length != transfer->actual_length)
-		wdata->callback(wdata->imgdev, -EPROTO, wdata->user_data);
-	else
-		continue_write_regv(wdata);
+	if (wdata->result == 0) {
+		if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
+			wdata->result = -EIO;
+		else if (transfer->length != transfer->actual_length)
+			wdata->result = -EPROTO;
+	}
 
-	g_free(transfer->buffer);
-	libusb_free_transfer(transfer);
+	wdata->in_flight--;
+	regv_transfer_put(wdata->pool, transfer);
+
+	/* the device is closed, so the write is dropped quietly */
+	if (orphaned) {
+		if (wdata->in_flight == 0)
+			g_free(wdata);
+		return;
+	}
+	continue_write_regv(wdata);
 }
 
 /* write from wdata->offset to upper_bound (inclusive) of wdata->regs */
@@ -68,97 +178,171 @@ static int do_write_regv(struct write_regv_data *wdata, int upper_bound)
 {
 	unsigned int offset = wdata->offset;
 	unsigned int num = upper_bound - offset + 1;
-	size_t alloc_size = num * 2;
-	unsigned char *data = g_malloc(alloc_size);
-	unsigned int i;
-	size_t data_offset = 0;
-	struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+	struct libusb_transfer *transfer = regv_transfer_get(wdata->pool);
+	unsigned char *data;
 	int r;
 
-	if (!transfer) {
-		g_free(data);
+	if (!transfer)
 		return -ENOMEM;
-	}
 
-	for (i = offset; i < offset + num; i++) {
-		const struct aes_regwrite *regwrite = &wdata->regs[i];
-		data[data_offset++] = regwrite->reg;
-		data[data_offset++] = regwrite->value;
-	}
+	data = transfer->buffer;
+	memcpy(data, &wdata->regs[offset], num * 2);
 
 	libusb_fill_bulk_transfer(transfer, wdata->imgdev->udev, EP_OUT, data,
-		alloc_size, write_regv_trf_complete, wdata, BULK_TIMEOUT);
-	r = libusb_submit_transfer(transfer);
-	if (r < 0) {
-		g_free(data);
-		libusb_free_transfer(transfer);
-	}
+		num * 2, write_regv_trf_complete, wdata, BULK_TIMEOUT);
+	r = fpi_usb_submit_transfer(transfer);
+	if (r < 0)
+		regv_transfer_put(wdata->pool, transfer);
+	else
+		wdata->in_flight++;
 
 	return r;
 }
 
-/* write the next batch of registers to be written, or if there are no more,
- * indicate completion to the caller */
+/* submit the next batches of registers to be written, up to
+ * MAX_REGV_TRANSFERS_IN_FLIGHT of them, or once all of them completed (or one
+ * failed), indicate completion to the caller. The tables divide pulses, such
+ * as a reset bit being set then cleared, with zeros: the registers past a
+ * zero are only submitted once all those before it completed. */
 static void continue_write_regv(struct write_regv_data *wdata)
 {
-	unsigned int offset = wdata->offset;
-	unsigned int regs_remaining;
-	unsigned int limit;
-	unsigned int upper_bound;
-	int i;
-	int r;
+	while (wdata->result == 0 &&
+	       wdata->in_flight < MAX_REGV_TRANSFERS_IN_FLIGHT) {
+		unsigned int offset = wdata->offset;
+		unsigned int regs_remaining;
+		unsigned int limit;
+		unsigned int upper_bound;
+		unsigned int i;
+		int r;
 
-	/* skip all zeros and ensure there is still work to do */
-	while (TRUE) {
-		if (offset >= wdata->num_regs) {
-			fp_dbg("all registers written");
-			wdata->callback(wdata->imgdev, 0, wdata->user_data);
-			return;
-		}
-		if (wdata->regs[offset].reg)
+		/* wait for the batches before a zero to complete */
+		if (offset < wdata->num_regs && !wdata->regs[offset].reg
+				&& wdata->in_flight > 0)
 			break;
-		offset++;
-	}
 
-	wdata->offset = offset;
-	regs_remaining = wdata->num_regs - offset;
-	limit = MIN(regs_remaining, MAX_REGWRITES_PER_REQUEST);
-	upper_bound = offset + limit - 1;
+		/* skip all zeros and ensure there is still work to do */
+		while (offset < wdata->num_regs && !wdata->regs[offset].reg)
+			offset++;
+		wdata->offset = offset;
+		if (offset >= wdata->num_regs)
+			break;
+
+		regs_remaining = wdata->num_regs - offset;
+		limit = MIN(regs_remaining, MAX_REGWRITES_PER_REQUEST);
+		upper_bound = offset + limit - 1;
+
+		/* determine if we can write the entire of the regs at once, or if
+		 * there is a zero dividing things up */
+		for (i = offset; i <= upper_bound; i++)
+			if (!wdata->regs[i].reg) {
+				upper_bound = i - 1;
+				break;
+			}
 
-	/* determine if we can write the entire of the regs at once, or if there
-	 * is a zero dividing things up */
-	for (i = offset; i <= upper_bound; i++)
-		if (!wdata->regs[i].reg) {
-			upper_bound = i - 1;
+		r = do_write_regv(wdata, upper_bound);
+		if (r < 0) {
+			wdata->result = r;
 			break;
 		}
 
-	r = do_write_regv(wdata, upper_bound);
-	if (r < 0) {
-		wdata->callback(wdata->imgdev, r, wdata->user_data);
-		return;
+		wdata->offset = upper_bound + 1;
 	}
 
-	wdata->offset = upper_bound + 1;
+	if (wdata->in_flight == 0) {
+		struct fp_img_dev *dev = wdata->imgdev;
+		aes_write_regv_cb callback = wdata->callback;
+		void *user_data = wdata->user_data;
+		int result = wdata->result;
+
+		if (result == 0)
+			fp_dbg("all registers written");
+		g_free(wdata);
+		callback(dev, result, user_data);
+	}
 }
 
 /* write a load of registers to the device, combining multiple writes in a
  * single URB up to a limit. insert writes to non-existent register 0 to force
- * specific groups of writes to be separated by different URBs. */
+ * specific groups of writes to be separated by different URBs. the URBs are
+ * submitted in order, several at a time. */
 void aes_write_regv(struct fp_img_dev *dev, const struct aes_regwrite *regs,
 	unsigned int num_regs, aes_write_regv_cb callback, void *user_data)
 {
 	struct write_regv_data *wdata = g_malloc(sizeof(*wdata));
 	fp_dbg("write %d regs", num_regs);
 	wdata->imgdev = dev;
+	wdata->pool = regv_pool_get(dev);
 	wdata->num_regs = num_regs;
 	wdata->regs = regs;
 	wdata->offset = 0;
+	wdata->in_flight = 0;
+	wdata->result = 0;
 	wdata->callback = callback;
 	wdata->user_data = user_data;
 	continue_write_regv(wdata);
 }
 
+/* The drivers only count empty strips, which is what they always did. Setting
+ * LIBFPRINT_AES_SWIPE_END to "<end_blanks>,<end_percent>" overrides their
+ * count, and turns on the cut-off relative to the strongest strip, which is
+ * yet to be validated against recorded swipes. */
+void aes_swipe_init(struct aes_swipe *swipe, unsigned int end_blanks,
+	unsigned int end_percent)
+{
+	const char *env = g_getenv("LIBFPRINT_AES_SWIPE_END");
+
+	if (env) {
+		unsigned int blanks, percent;
+
+		if (sscanf(env, "%u,%u", &blanks, &percent) == 2 && blanks > 0
+				&& percent < 100) {
+			end_blanks = blanks;
+			end_percent = percent;
+		} else {
+			fp_warn("ignoring LIBFPRINT_AES_SWIPE_END=%s", env);
+		}
+	}
+
+	swipe->end_blanks = end_blanks;
+	swipe->end_percent = end_percent;
+	aes_swipe_reset(swipe);
+}
+
+void aes_swipe_reset(struct aes_swipe *swipe)
+{
+	swipe->blanks = 0;
+	swipe->peak_sum = 0;
+}
+
+/* Takes the histogram sum of the next strip of a swipe, the number of
+ * pixels dark enough to be ridges, and tells whether the strip is to be
+ * kept for assembly, is blank and to be dropped, or ends the swipe. Blank
+ * strips never reach the assembly: those before the finger, those left
+ * behind by a fast swipe once the finger is gone, nor the odd one in the
+ * middle. With end_percent set, strips far below the largest sum of the
+ * swipe count as blank too, as the sums fall sharply once the finger leaves
+ * the sensor, and the swipe ends without waiting for it to be entirely
+ * clear. */
+enum aes_strip_verdict aes_swipe_push(struct aes_swipe *swipe, int sum)
+{
+	gboolean blank = sum <= 0;
+
+	if (!blank && swipe->end_percent
+			&& (gint64) sum * 100 < (gint64) swipe->peak_sum * swipe->end_percent)
+		blank = TRUE;
+
+	if (blank) {
+		swipe->blanks++;
+		return swipe->blanks >= swipe->end_blanks ?
+			AES_STRIP_END : AES_STRIP_SKIP;
+	}
+
+	swipe->blanks = 0;
+	if (sum > swipe->peak_sum)
+		swipe->peak_sum = sum;
+	return AES_STRIP_KEEP;
+}
+
 unsigned char aes_get_pixel(struct fpi_frame_asmbl_ctx *ctx,
 					  struct fpi_frame *frame,
 					  unsigned int x,
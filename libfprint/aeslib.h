@@ -35,6 +35,32 @@ typedef void (*aes_write_regv_cb)(struct fp_img_dev *dev, int result,
 
 void aes_write_regv(struct fp_img_dev *dev, const struct aes_regwrite *regs,
 	unsigned int num_regs, aes_write_regv_cb callback, void *user_data);
+void aes_regv_pool_free(struct fp_img_dev *dev);
+
+/* Tells the end of a swipe from the histogram sums of its strips, see
+ * aes_swipe_push() */
+struct aes_swipe {
+	/* blank strips in a row which end the swipe */
+	unsigned int end_blanks;
+	/* once the finger was seen, a strip whose sum is below this percentage
+	 * of the largest sum of the swipe counts as blank, 0 to only count
+	 * empty strips */
+	unsigned int end_percent;
+
+	unsigned int blanks;
+	int peak_sum;
+};
+
+enum aes_strip_verdict {
+	AES_STRIP_KEEP,
+	AES_STRIP_SKIP,
+	AES_STRIP_END,
+};
+
+void aes_swipe_init(struct aes_swipe *swipe, unsigned int end_blanks,
+	unsigned int end_percent);
+void aes_swipe_reset(struct aes_swipe *swipe);
+enum aes_strip_verdict aes_swipe_push(struct aes_swipe *swipe, int sum);
 
 unsigned char aes_get_pixel(struct fpi_frame_asmbl_ctx *ctx,
 			    struct fpi_frame *frame,
@@ -0,0 +1,145 @@
+/*
+ * Allocation accounting for libfprint
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Built with alloc_stats, libfprint defines malloc(), calloc() and
+ * realloc() on top of the C library's, so that every allocation of the
+ * process goes through it: glib's, the NBIS code's and the drivers' alike.
+ * The code of each subsystem runs within a scope, see
+ * fpi_alloc_scope_push(), and the allocations made on a thread within a
+ * scope are added to the counters of its subsystem. Allocations of the
+ * application itself are made outside of any scope and are not counted.
+ *
+ * The scope is a plain thread-local variable rather than a GPrivate, which
+ * would allocate on its first use, from within malloc(). */
+
+#include <config.h>
+#include <errno.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "fp_internal.h"
+
+#if defined(ENABLE_ALLOC_STATS) && defined(__GLIBC__)
+#define ALLOC_STATS_SUPPORTED 1
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+/* the subsystem plus one, 0 outside of any scope */
+static __thread int alloc_scope __attribute__((tls_model("initial-exec")));
+
+static struct fp_alloc_stats alloc_stats;
+
+static void count_alloc(size_t size)
+{
+	int scope = alloc_scope;
+
+	if (!scope)
+		return;
+	__atomic_add_fetch(&alloc_stats.allocs[scope - 1], 1,
+		__ATOMIC_RELAXED);
+	__atomic_add_fetch(&alloc_stats.bytes[scope - 1], size,
+		__ATOMIC_RELAXED);
+}
+
+API_EXPORTED void *malloc(size_t size)
+{
+	count_alloc(size);
+	return __libc_malloc(size);
+}
+
+API_EXPORTED void *calloc(size_t nmemb, size_t size)
+{
+	count_alloc(nmemb * size);
+	return __libc_calloc(nmemb, size);
+}
+
+API_EXPORTED void *realloc(void *ptr, size_t size)
+{
+	count_alloc(size);
+	return __libc_realloc(ptr, size);
+}
+
+int fpi_alloc_scope_push(enum fp_alloc_subsystem subsystem)
+{
+	int prev = alloc_scope;
+
+	alloc_scope = subsystem + 1;
+	return prev;
+}
+
+void fpi_alloc_scope_pop(int prev)
+{
+	alloc_scope = prev;
+}
+#endif
+
+/**
+ * fp_get_alloc_stats:
+ * @stats: an output location for the statistics
+ *
+ * Get the number of memory allocations made by each subsystem of libfprint,
+ * and the number of bytes they asked for, since libfprint was loaded or
+ * since the last call to fp_reset_alloc_stats(). Reallocations count as
+ * allocations of their new size. This can be polled at any time and from
+ * any thread, for example to check that a steady stream of captures and
+ * matches no longer allocates.
+ *
+ * Allocations are only counted if libfprint was built with the alloc_stats
+ * option, which replaces the allocator functions of the C library for the
+ * whole process.
+ *
+ * Returns: 0 on success, or -ENOTSUP if libfprint was built without
+ * allocation accounting
+ */
+API_EXPORTED int fp_get_alloc_stats(struct fp_alloc_stats *stats)
+{
+#ifdef ALLOC_STATS_SUPPORTED
+	int i;
+
+	for (i = 0; i < FP_ALLOC_NUM_SUBSYSTEMS; i++) {
+		stats->allocs[i] = __atomic_load_n(&alloc_stats.allocs[i],
+			__ATOMIC_RELAXED);
+		stats->bytes[i] = __atomic_load_n(&alloc_stats.bytes[i],
+			__ATOMIC_RELAXED);
+	}
+	return 0;
+#else
+	memset(stats, 0, sizeof(*stats));
+	return -ENOTSUP;
+#endif
+}
+
+/**
+ * fp_reset_alloc_stats:
+ *
+ * Reset the statistics returned by fp_get_alloc_stats() to zero.
+ */
+API_EXPORTED void fp_reset_alloc_stats(void)
+{
+#ifdef ALLOC_STATS_SUPPORTED
+	int i;
+
+	for (i = 0; i < FP_ALLOC_NUM_SUBSYSTEMS; i++) {
+		__atomic_store_n(&alloc_stats.allocs[i], 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&alloc_stats.bytes[i], 0, __ATOMIC_RELAXED);
+	}
+#endif
+}
@@ -30,46 +30,119 @@
 #include "fp_internal.h"
 #include "assembling.h"
 
-static unsigned int calc_error(struct fpi_frame_asmbl_ctx *ctx,
-			       struct fpi_frame *first_frame,
-			       struct fpi_frame *second_frame,
-			       int dx,
-			       int dy)
+/* The two 8-bit pixels packed in each byte of FPI_FRAME_LAYOUT_AES4, the
+ * even row first */
+#define AES4_PAIR(b) { ((b) & 0xf) * 17, ((b) >> 4) * 17 }
+#define AES4_PAIRS4(b) AES4_PAIR(b), AES4_PAIR((b) + 1), \
+	AES4_PAIR((b) + 2), AES4_PAIR((b) + 3)
+#define AES4_PAIRS16(b) AES4_PAIRS4(b), AES4_PAIRS4((b) + 4), \
+	AES4_PAIRS4((b) + 8), AES4_PAIRS4((b) + 12)
+#define AES4_PAIRS64(b) AES4_PAIRS16(b), AES4_PAIRS16((b) + 16), \
+	AES4_PAIRS16((b) + 32), AES4_PAIRS16((b) + 48)
+
+static const unsigned char aes4_pairs[256][2] = {
+	AES4_PAIRS64(0), AES4_PAIRS64(64), AES4_PAIRS64(128), AES4_PAIRS64(192),
+};
+
+/* Unpacks a frame of FPI_FRAME_LAYOUT_AES4 into width * height 8-bit
+ * pixels, one row after the other. The FP_IMG_V_FLIPPED, FP_IMG_H_FLIPPED
+ * and FP_IMG_COLORS_INVERTED bits of flags are undone on the way, so that
+ * the pixels come out in their final orientation without another pass. */
+void fpi_aes4_unpack(const unsigned char *in, unsigned int width,
+		     unsigned int height, unsigned char *out,
+		     unsigned int flags)
 {
-	unsigned int width, height;
-	unsigned int x1, y1, x2, y2, err, i, j;
+	unsigned char invert = flags & FP_IMG_COLORS_INVERTED ? 0xff : 0;
+	ptrdiff_t xstep = 1, ystep = width;
+	unsigned int x, y;
+
+	if (flags & FP_IMG_H_FLIPPED) {
+		out += width - 1;
+		xstep = -1;
+	}
+	if (flags & FP_IMG_V_FLIPPED) {
+		out += (size_t) (height - 1) * width;
+		ystep = -(ptrdiff_t) width;
+	}
+
+	for (x = 0; x < width; x++) {
+		unsigned char *p = out + x * xstep;
 
-	width = ctx->frame_width - (dx > 0 ? dx : -dx);
-	height = ctx->frame_height - dy;
+		for (y = 0; y + 1 < height; y += 2) {
+			const unsigned char *pair = aes4_pairs[*in++];
 
-	y1 = 0;
-	y2 = dy;
-	i = 0;
-	err = 0;
-	do {
-		x1 = dx < 0 ? 0 : dx;
-		x2 = dx < 0 ? -dx : 0;
-		j = 0;
+			p[0] = pair[0] ^ invert;
+			p[ystep] = pair[1] ^ invert;
+			p += 2 * ystep;
+		}
+		/* as aes_get_pixel(), an odd last row reads the byte starting
+		 * the next column */
+		if (y < height)
+			*p = aes4_pairs[*in][0] ^ invert;
+	}
+}
+
+/* A frame seen as rows of 8-bit pixels */
+struct frame_rows {
+	const unsigned char *data;
+	unsigned int stride;
+};
+
+/* Gets the pixels of a frame as rows. Unless the frame already stores them
+ * that way they are unpacked into buf, which must hold
+ * frame_width * frame_height pixels. */
+static void get_frame_rows(struct fpi_frame_asmbl_ctx *ctx,
+			   struct fpi_frame *frame,
+			   unsigned char *buf,
+			   struct frame_rows *rows)
+{
+	unsigned int width = ctx->frame_width;
+	unsigned int height = ctx->frame_height;
+	unsigned int x, y;
+
+	switch (ctx->layout) {
+	case FPI_FRAME_LAYOUT_LINEAR8:
+		rows->data = frame->data;
+		rows->stride = ctx->stride ? ctx->stride : width;
+		return;
+	case FPI_FRAME_LAYOUT_AES4:
+		fpi_aes4_unpack(frame->data, width, height, buf, 0);
+		break;
+	default:
+		for (y = 0; y < height; y++)
+			for (x = 0; x < width; x++)
+				buf[y * width + x] = ctx->get_pixel(ctx, frame, x, y);
+		break;
+	}
 
-		do {
-			unsigned char v1, v2;
+	rows->data = buf;
+	rows->stride = width;
+}
 
+static unsigned int calc_error(const struct frame_rows *first,
+			       const struct frame_rows *second,
+			       unsigned int frame_width,
+			       unsigned int frame_height,
+			       int dx,
+			       int dy)
+{
+	unsigned int width, height;
+	unsigned int i, err = 0;
+	const unsigned char *p1, *p2;
 
-			v1 = ctx->get_pixel(ctx, first_frame, x1, y1);
-			v2 = ctx->get_pixel(ctx, second_frame, x2, y2);
-			err += v1 > v2 ? v1 - v2 : v2 - v1;
-			j++;
-			x1++;
-			x2++;
+	width = frame_width - (dx > 0 ? dx : -dx);
+	height = frame_height - dy;
 
-		} while (j < width);
-		i++;
-		y1++;
-		y2++;
-	} while (i < height);
+	p1 = first->data + (dx < 0 ? 0 : dx);
+	p2 = second->data + dy * second->stride + (dx < 0 ? -dx : 0);
+	for (i = 0; i < height; i++) {
+		err += fpi_simd->row_sad(p1, p2, width);
+		p1 += first->stride;
+		p2 += second->stride;
+	}
 
 	/* Normalize error */
-	err *= (ctx->frame_height * ctx->frame_width);
+	err *= (frame_height * frame_width);
 	err /= (height * width);
 
 	if (err == 0)
@@ -78,96 +151,496 @@ static unsigned int calc_error(struct fpi_frame_asmbl_ctx *ctx,
 	return err;
 }
 
+/* Averages each 2x2 block of a frame into one pixel of out */
+static void downsample_frame(const struct frame_rows *rows,
+			     unsigned int frame_width,
+			     unsigned int frame_height,
+			     unsigned char *out)
+{
+	unsigned int x, y;
+	unsigned int width = frame_width / 2;
+	unsigned int height = frame_height / 2;
+
+	for (y = 0; y < height; y++) {
+		const unsigned char *r0 = rows->data + 2 * y * rows->stride;
+		const unsigned char *r1 = r0 + rows->stride;
+
+		for (x = 0; x < width; x++) {
+			unsigned int sum;
+
+			sum = r0[2 * x] + r0[2 * x + 1] +
+			      r1[2 * x] + r1[2 * x + 1];
+			out[y * width + x] = (sum + 2) / 4;
+		}
+	}
+}
+
+/* A frame being compared during movement estimation */
+struct asmbl_frame {
+	struct fpi_frame *frame;
+	struct frame_rows rows;
+	/* rows unpacked from the frame, for layouts that need it */
+	unsigned char *buf;
+	/* the rows downsampled by 2, for coarse searching */
+	struct frame_rows coarse;
+};
+
+/* Offsets tried by find_overlap(), and the search window around each
+ * coarse candidate when refining */
+#define OVERLAP_MIN_DY		2
+#define OVERLAP_MAX_DX		8
+#define COARSE_CANDIDATES	3
+#define REFINE_RADIUS		2
+
+/* Coarse searching needs frames tall enough to have a few rows left once
+ * downsampled */
+#define COARSE_MIN_HEIGHT	8
+
+/* Tries the offsets within radius of (cx, cy) on the full frames, keeping
+ * the best one in *dx, *dy and *min_error */
+static void refine_overlap(struct fpi_frame_asmbl_ctx *ctx,
+			   struct asmbl_frame *first,
+			   struct asmbl_frame *second,
+			   int cx, int cy, int radius,
+			   int *best_dx, int *best_dy,
+			   unsigned int *min_error)
+{
+	int dx, dy;
+	unsigned int err;
+
+	for (dy = cy - radius; dy <= cy + radius; dy++) {
+		if (dy < OVERLAP_MIN_DY || dy >= (int) ctx->frame_height)
+			continue;
+		for (dx = cx - radius; dx <= cx + radius; dx++) {
+			if (dx < -OVERLAP_MAX_DX || dx >= OVERLAP_MAX_DX)
+				continue;
+			err = calc_error(&first->rows, &second->rows,
+				ctx->frame_width, ctx->frame_height, dx, dy);
+			if (err < *min_error) {
+				*min_error = err;
+				*best_dx = dx;
+				*best_dy = dy;
+			}
+		}
+	}
+}
+
+/* Estimates the offset on the downsampled frames first, then looks
+ * around the best few coarse offsets, and around the offset found for the
+ * previous pair of frames if there is one, on the full frames. */
+static unsigned int find_overlap_coarse_to_fine(struct fpi_frame_asmbl_ctx *ctx,
+				struct asmbl_frame *first,
+				struct asmbl_frame *second,
+				const int *hint_dx, const int *hint_dy,
+				int *delta_x, int *delta_y)
+{
+	unsigned int cwidth = ctx->frame_width / 2;
+	unsigned int cheight = ctx->frame_height / 2;
+	unsigned int cand_err[COARSE_CANDIDATES];
+	int cand_dx[COARSE_CANDIDATES], cand_dy[COARSE_CANDIDATES];
+	int ncand = 0;
+	int dx, dy, i, best_dx = 0, best_dy = OVERLAP_MIN_DY;
+	unsigned int err, min_error;
+
+	for (dy = OVERLAP_MIN_DY / 2; dy < (int) cheight; dy++) {
+		for (dx = -OVERLAP_MAX_DX / 2; dx < OVERLAP_MAX_DX / 2; dx++) {
+			err = calc_error(&first->coarse, &second->coarse,
+				cwidth, cheight, dx, dy);
+
+			/* keep the candidates sorted, best first */
+			if (ncand == COARSE_CANDIDATES &&
+			    err >= cand_err[ncand - 1])
+				continue;
+			if (ncand < COARSE_CANDIDATES)
+				ncand++;
+			for (i = ncand - 1; i > 0 && cand_err[i - 1] > err; i--) {
+				cand_err[i] = cand_err[i - 1];
+				cand_dx[i] = cand_dx[i - 1];
+				cand_dy[i] = cand_dy[i - 1];
+			}
+			cand_err[i] = err;
+			cand_dx[i] = dx;
+			cand_dy[i] = dy;
+		}
+	}
+
+	min_error = 255 * ctx->frame_height * ctx->frame_width;
+	if (hint_dx)
+		refine_overlap(ctx, first, second, *hint_dx, *hint_dy, 1,
+			&best_dx, &best_dy, &min_error);
+	for (i = 0; i < ncand; i++)
+		refine_overlap(ctx, first, second,
+			2 * cand_dx[i], 2 * cand_dy[i], REFINE_RADIUS,
+			&best_dx, &best_dy, &min_error);
+
+	*delta_x = -best_dx;
+	*delta_y = best_dy;
+	return min_error;
+}
+
 /* This function is rather CPU-intensive. It's better to use hardware
  * to detect movement direction when possible.
  */
-static void find_overlap(struct fpi_frame_asmbl_ctx *ctx,
-			 struct fpi_frame *first_frame,
-			 struct fpi_frame *second_frame,
-			 unsigned int *min_error)
+static unsigned int find_overlap(struct fpi_frame_asmbl_ctx *ctx,
+			 struct asmbl_frame *first,
+			 struct asmbl_frame *second,
+			 int *delta_x, int *delta_y)
 {
 	int dx, dy;
-	unsigned int err;
-	*min_error = 255 * ctx->frame_height * ctx->frame_width;
+	unsigned int err, min_error;
+	min_error = 255 * ctx->frame_height * ctx->frame_width;
+	*delta_x = 0;
+	*delta_y = OVERLAP_MIN_DY;
 
 	/* Seeking in horizontal and vertical dimensions,
 	 * for horizontal dimension we'll check only 8 pixels
 	 * in both directions. For vertical direction diff is
 	 * rarely less than 2, so start with it.
 	 */
-	for (dy = 2; dy < ctx->frame_height; dy++) {
-		for (dx = -8; dx < 8; dx++) {
-			err = calc_error(ctx, first_frame, second_frame,
-				dx, dy);
-			if (err < *min_error) {
-				*min_error = err;
-				second_frame->delta_x = -dx;
-				second_frame->delta_y = dy;
+	for (dy = OVERLAP_MIN_DY; dy < ctx->frame_height; dy++) {
+		for (dx = -OVERLAP_MAX_DX; dx < OVERLAP_MAX_DX; dx++) {
+			err = calc_error(&first->rows, &second->rows,
+				ctx->frame_width, ctx->frame_height, dx, dy);
+			if (err < min_error) {
+				min_error = err;
+				*delta_x = -dx;
+				*delta_y = dy;
 			}
 		}
 	}
+
+	return min_error;
+}
+
+/* The last two frames of a sequence, ready to be compared */
+struct frame_window {
+	struct asmbl_frame frames[2];
+	struct asmbl_frame *prev;
+	struct asmbl_frame *cur;
+	gboolean coarse;
+};
+
+static void frame_window_init(struct fpi_frame_asmbl_ctx *ctx,
+			      struct frame_window *window)
+{
+	int i;
+
+	memset(window, 0, sizeof(*window));
+	window->prev = &window->frames[0];
+	window->cur = &window->frames[1];
+	window->coarse = ctx->search == FPI_FRAME_SEARCH_COARSE_TO_FINE &&
+		ctx->frame_height >= COARSE_MIN_HEIGHT;
+
+	for (i = 0; i < 2; i++) {
+		if (ctx->layout != FPI_FRAME_LAYOUT_LINEAR8)
+			window->frames[i].buf = g_malloc(ctx->frame_width *
+				ctx->frame_height);
+		if (window->coarse) {
+			window->frames[i].coarse.data = g_malloc(
+				(ctx->frame_width / 2) * (ctx->frame_height / 2));
+			window->frames[i].coarse.stride = ctx->frame_width / 2;
+		}
+	}
+}
+
+static void frame_window_clear(struct frame_window *window)
+{
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		g_free(window->frames[i].buf);
+		g_free((unsigned char *) window->frames[i].coarse.data);
+	}
+}
+
+/* Makes frame the current one, and the current one the previous one,
+ * unpacking and downsampling its pixels as needed */
+static void frame_window_push(struct fpi_frame_asmbl_ctx *ctx,
+			      struct frame_window *window,
+			      struct fpi_frame *frame)
+{
+	struct asmbl_frame *f = window->prev;
+
+	window->prev = window->cur;
+	window->cur = f;
+
+	f->frame = frame;
+	get_frame_rows(ctx, frame, f->buf, &f->rows);
+	if (window->coarse)
+		downsample_frame(&f->rows, ctx->frame_width,
+			ctx->frame_height, (unsigned char *) f->coarse.data);
+}
+
+/* Overlap search along a sequence of frames, in one direction */
+struct overlap_search {
+	gboolean reverse;
+	gboolean have_hint;
+	int hint_dx;
+	int hint_dy;
+	unsigned long long total_error;
+};
+
+/* Finds the delta between the previous and the current frame of window.
+ * Going forward it belongs to the previous frame, in reverse to the
+ * current one. */
+static void search_pair(struct fpi_frame_asmbl_ctx *ctx,
+			struct overlap_search *search,
+			struct frame_window *window,
+			int *delta_x, int *delta_y)
+{
+	struct asmbl_frame *first, *second;
+	unsigned int min_error;
+
+	if (search->reverse) {
+		first = window->prev;
+		second = window->cur;
+	} else {
+		first = window->cur;
+		second = window->prev;
+	}
+
+	if (window->coarse)
+		min_error = find_overlap_coarse_to_fine(ctx, first, second,
+			search->have_hint ? &search->hint_dx : NULL,
+			&search->hint_dy, delta_x, delta_y);
+	else
+		min_error = find_overlap(ctx, first, second, delta_x, delta_y);
+
+	/* the offset searched for, before any reversal */
+	search->hint_dx = -*delta_x;
+	search->hint_dy = *delta_y;
+	search->have_hint = TRUE;
+
+	if (search->reverse) {
+		*delta_x = -*delta_x;
+		*delta_y = -*delta_y;
+	}
+	search->total_error += min_error;
+}
+
+/* The hint of each search comes from the pair of frames before it. The
+ * chain of hints restarts every MOVEMENT_CHUNK_PAIRS pairs, so that chunks
+ * of pairs can be searched on different threads and still give the same
+ * deltas. */
+#define MOVEMENT_CHUNK_PAIRS	16
+
+/* A movement estimation pass shared out between threads */
+struct movement_job {
+	struct fpi_frame_asmbl_ctx *ctx;
+	struct fpi_frame **frames;
+	size_t num_frames;
+	gboolean reverse;
+	int num_chunks;
+	int next_chunk;
+	unsigned long long *chunk_errors;
+};
+
+static gpointer movement_worker(gpointer data)
+{
+	struct movement_job *job = data;
+	struct frame_window window;
+	struct fpi_frame *frame;
+	size_t pair, last;
+	int chunk, dx, dy;
+
+	frame_window_init(job->ctx, &window);
+	while ((chunk = g_atomic_int_add(&job->next_chunk, 1)) < job->num_chunks) {
+		struct overlap_search search = { 0 };
+
+		search.reverse = job->reverse;
+		pair = (size_t) chunk * MOVEMENT_CHUNK_PAIRS;
+		last = MIN(pair + MOVEMENT_CHUNK_PAIRS, job->num_frames - 1);
+
+		frame_window_push(job->ctx, &window, job->frames[pair]);
+		for (; pair < last; pair++) {
+			frame_window_push(job->ctx, &window,
+				job->frames[pair + 1]);
+			search_pair(job->ctx, &search, &window, &dx, &dy);
+			frame = job->reverse ? window.cur->frame :
+				window.prev->frame;
+			frame->delta_x = dx;
+			frame->delta_y = dy;
+		}
+		job->chunk_errors[chunk] = search.total_error;
+	}
+	frame_window_clear(&window);
+
+	return NULL;
 }
 
 static unsigned int do_movement_estimation(struct fpi_frame_asmbl_ctx *ctx,
-			    GSList *stripes, size_t num_stripes,
+			    struct fpi_frame **stripes, size_t num_stripes,
 			    gboolean reverse)
 {
-	GSList *list_entry = stripes;
+	struct movement_job job;
 	GTimer *timer;
-	int frame = 1;
-	struct fpi_frame *prev_stripe = list_entry->data;
-	unsigned int min_error;
+	GThread **threads;
+	unsigned int nr_threads, i;
 	/* Max error is width * height * 255, for AES2501 which has the largest
 	 * sensor its 192*16*255 = 783360. So for 32bit value it's ~5482 frame before
 	 * we might get int overflow. Use 64bit value here to prevent integer overflow
 	 */
 	unsigned long long total_error = 0;
+	int chunk;
 
-	list_entry = g_slist_next(list_entry);
+	if (num_stripes < 2)
+		return 0;
 
 	timer = g_timer_new();
-	do {
-		struct fpi_frame *cur_stripe = list_entry->data;
+	job.ctx = ctx;
+	job.num_frames = num_stripes;
+	job.reverse = reverse;
+	job.num_chunks = (num_stripes - 2) / MOVEMENT_CHUNK_PAIRS + 1;
+	job.next_chunk = 0;
+	job.frames = stripes;
+	job.chunk_errors = g_malloc(job.num_chunks * sizeof(*job.chunk_errors));
+
+	nr_threads = fpi_get_assemble_threads();
+	if (nr_threads > job.num_chunks)
+		nr_threads = job.num_chunks;
 
-		if (reverse) {
-			find_overlap(ctx, prev_stripe, cur_stripe, &min_error);
-			cur_stripe->delta_y = -cur_stripe->delta_y;
-			cur_stripe->delta_x = -cur_stripe->delta_x;
+	/* the calling thread takes part in the search as well */
+	threads = g_alloca(sizeof(*threads) * (nr_threads + 1));
+	for (i = 1; i < nr_threads; i++) {
+		threads[i] = fpi_thread_try_new("fp-assemble",
+			movement_worker, &job);
+		if (!threads[i]) {
+			fp_warn("could not create assembling thread %u", i);
+			break;
 		}
-		else
-			find_overlap(ctx, cur_stripe, prev_stripe, &min_error);
-		total_error += min_error;
+	}
+	nr_threads = i;
 
-		frame++;
-		prev_stripe = cur_stripe;
-		list_entry = g_slist_next(list_entry);
+	movement_worker(&job);
+	for (i = 1; i < nr_threads; i++)
+		g_thread_join(threads[i]);
 
-	} while (frame < num_stripes);
+	for (chunk = 0; chunk < job.num_chunks; chunk++)
+		total_error += job.chunk_errors[chunk];
+	g_free(job.chunk_errors);
 
 	g_timer_stop(timer);
-	fp_dbg("calc delta completed in %f secs", g_timer_elapsed(timer, NULL));
+	fp_dbg("calc delta completed in %f secs with %u threads",
+		g_timer_elapsed(timer, NULL), nr_threads);
 	g_timer_destroy(timer);
 
 	return total_error / num_stripes;
 }
 
-void fpi_do_movement_estimation(struct fpi_frame_asmbl_ctx *ctx,
-			    GSList *stripes, size_t num_stripes)
+/* Rows compared by frame_repeats(), one in this many */
+#define DUP_ROW_STEP	4
+
+/* Whether frame shows the same as prev, the finger resting or moving too
+ * slowly for it to add anything to the image: the mean squared difference
+ * of every DUP_ROW_STEP-th row is under ctx->dup_threshold. That costs a
+ * fraction of the search for the offset between them, which the frame is
+ * then spared along with its blit. */
+static gboolean frame_repeats(struct fpi_frame_asmbl_ctx *ctx,
+			      struct fpi_frame *prev,
+			      struct fpi_frame *frame)
 {
+	unsigned int width = ctx->frame_width;
+	unsigned int height = ctx->frame_height;
+	unsigned int stride = ctx->stride ? ctx->stride : width;
+	unsigned int x, y, rows = 0;
+	guint64 sumsq = 0;
+
+	for (y = 0; y < height; y += DUP_ROW_STEP, rows++) {
+		if (ctx->layout == FPI_FRAME_LAYOUT_LINEAR8) {
+			sumsq += fpi_simd->sq_diff(prev->data + y * stride,
+				frame->data + y * stride, width);
+			continue;
+		}
+		for (x = 0; x < width; x++) {
+			int dev = (int) ctx->get_pixel(ctx, prev, x, y) -
+				(int) ctx->get_pixel(ctx, frame, x, y);
+
+			sumsq += dev * dev;
+		}
+	}
+
+	return sumsq < (guint64) ctx->dup_threshold * rows * width;
+}
+
+/* Drops the frames repeating the last one kept, see frame_repeats() */
+static void drop_repeated_frames(struct fpi_frame_asmbl_ctx *ctx,
+				 GPtrArray *frames)
+{
+	struct fpi_frame **stripes = (struct fpi_frame **) frames->pdata;
+	size_t i, kept = 1;
+
+	if (!ctx->dup_threshold || frames->len < 2)
+		return;
+
+	for (i = 1; i < frames->len; i++)
+		if (!frame_repeats(ctx, stripes[kept - 1], stripes[i]))
+			stripes[kept++] = stripes[i];
+	fp_dbg("dropped %zu repeated frames of %u", frames->len - kept,
+		frames->len);
+	g_ptr_array_set_size(frames, kept);
+}
+
+static void movement_estimation(struct fpi_frame_asmbl_ctx *ctx,
+				struct fpi_frame **stripes, size_t num_stripes)
+{
+	int *forward_deltas;
 	int err, rev_err;
+	size_t i;
+	int scope = fpi_alloc_scope_push(FP_ALLOC_ASSEMBLING);
+
 	err = do_movement_estimation(ctx, stripes, num_stripes, FALSE);
+
+	/* Keep the forward deltas, so they don't have to be searched for
+	 * again if they win */
+	forward_deltas = g_malloc(2 * num_stripes * sizeof(int));
+	for (i = 0; i < num_stripes; i++) {
+		forward_deltas[2 * i] = stripes[i]->delta_x;
+		forward_deltas[2 * i + 1] = stripes[i]->delta_y;
+	}
+
 	rev_err = do_movement_estimation(ctx, stripes, num_stripes, TRUE);
 	fp_dbg("errors: %d rev: %d", err, rev_err);
+
+	/* Going forward, the delta is stored on the first frame of each pair,
+	 * so the last frame keeps the one of the reverse pass */
 	if (err < rev_err) {
-		do_movement_estimation(ctx, stripes, num_stripes, FALSE);
+		for (i = 0; i + 1 < num_stripes; i++) {
+			stripes[i]->delta_x = forward_deltas[2 * i];
+			stripes[i]->delta_y = forward_deltas[2 * i + 1];
+		}
 	}
+	g_free(forward_deltas);
+	fpi_alloc_scope_pop(scope);
 }
 
+static struct fpi_frame **frames_from_list(GSList *stripes, size_t stripes_len)
+{
+	struct fpi_frame **frames = g_malloc(stripes_len * sizeof(*frames));
+	size_t i;
+
+	for (i = 0; i < stripes_len; i++, stripes = g_slist_next(stripes))
+		frames[i] = stripes->data;
+
+	return frames;
+}
+
+void fpi_do_movement_estimation(struct fpi_frame_asmbl_ctx *ctx,
+			    GSList *stripes, size_t num_stripes)
+{
+	struct fpi_frame **frames = frames_from_list(stripes, num_stripes);
+
+	movement_estimation(ctx, frames, num_stripes);
+	g_free(frames);
+}
+
+/* buf is scratch space for get_frame_rows() */
 static inline void aes_blit_stripe(struct fpi_frame_asmbl_ctx *ctx,
 				   struct fp_img *img,
 				   struct fpi_frame *stripe,
+				   unsigned char *buf,
 				   int x, int y)
 {
+	struct frame_rows rows;
 	unsigned int ix, iy;
 	unsigned int fx, fy;
 	unsigned int width, height;
@@ -210,48 +683,37 @@ static inline void aes_blit_stripe(struct fpi_frame_asmbl_ctx *ctx,
 	if ((iy + height) > img->height)
 		height = img->height - iy;
 
-	for (; fy < height; fy++, iy++) {
-		if (x < 0) {
-			ix = 0;
-			fx = -x;
-		} else {
-			ix = x;
-			fx = 0;
-		}
-		for (; fx < width; fx++, ix++) {
-			img->data[ix + (iy * img->width)] = ctx->get_pixel(ctx, stripe, fx, fy);
-		}
-	}
+	if (fx >= width)
+		return;
+
+	get_frame_rows(ctx, stripe, buf, &rows);
+	for (; fy < height; fy++, iy++)
+		memcpy(img->data + ix + (iy * img->width),
+		       rows.data + fy * rows.stride + fx, width - fx);
 }
 
-struct fp_img *fpi_assemble_frames(struct fpi_frame_asmbl_ctx *ctx,
-			    GSList *stripes, size_t stripes_len)
+static struct fp_img *assemble_frames(struct fpi_frame_asmbl_ctx *ctx,
+				      struct fpi_frame **stripes,
+				      size_t stripes_len)
 {
-	GSList *stripe;
 	struct fp_img *img;
 	int height = 0;
 	int i, y, x;
 	gboolean reverse = FALSE;
 	struct fpi_frame *fpi_frame;
+	unsigned char *buf = NULL;
+	int scope = fpi_alloc_scope_push(FP_ALLOC_ASSEMBLING);
 
 	BUG_ON(stripes_len == 0);
 	BUG_ON(ctx->image_width < ctx->frame_width);
 
-	/* Calculate height */
-	i = 0;
-	stripe = stripes;
-
 	/* No offset for 1st image */
-	fpi_frame = stripe->data;
-	fpi_frame->delta_x = 0;
-	fpi_frame->delta_y = 0;
-	do {
-		fpi_frame = stripe->data;
+	stripes[0]->delta_x = 0;
+	stripes[0]->delta_y = 0;
 
-		height += fpi_frame->delta_y;
-		i++;
-		stripe = g_slist_next(stripe);
-	} while (i < stripes_len);
+	/* Calculate height */
+	for (i = 0; i < stripes_len; i++)
+		height += stripes[i]->delta_y;
 
 	fp_dbg("height is %d", height);
 
@@ -271,79 +733,380 @@ struct fp_img *fpi_assemble_frames(struct fpi_frame_asmbl_ctx *ctx,
 	img->height = height;
 
 	/* Assemble stripes */
-	i = 0;
-	stripe = stripes;
 	y = reverse ? (height - ctx->frame_height) : 0;
 	x = (ctx->image_width - ctx->frame_width) / 2;
+	if (ctx->layout != FPI_FRAME_LAYOUT_LINEAR8)
+		buf = g_malloc(ctx->frame_width * ctx->frame_height);
 
-	do {
-		fpi_frame = stripe->data;
+	for (i = 0; i < stripes_len; i++) {
+		fpi_frame = stripes[i];
 
 		if(reverse) {
 			y += fpi_frame->delta_y;
 			x += fpi_frame->delta_x;
 		}
 
-		aes_blit_stripe(ctx, img, fpi_frame, x, y);
+		aes_blit_stripe(ctx, img, fpi_frame, buf, x, y);
 
 		if(!reverse) {
 			y += fpi_frame->delta_y;
 			x += fpi_frame->delta_x;
 		}
+	}
 
-		stripe = g_slist_next(stripe);
-		i++;
-	} while (i < stripes_len);
+	g_free(buf);
+	fpi_alloc_scope_pop(scope);
+	return img;
+}
+
+struct fp_img *fpi_assemble_frames(struct fpi_frame_asmbl_ctx *ctx,
+			    GSList *stripes, size_t stripes_len)
+{
+	struct fpi_frame **frames;
+	struct fp_img *img;
+
+	BUG_ON(stripes_len == 0);
+
+	frames = frames_from_list(stripes, stripes_len);
+	img = assemble_frames(ctx, frames, stripes_len);
+	g_free(frames);
 
 	return img;
 }
 
-static int cmpint(const void *p1, const void *p2, gpointer data)
+/* Frames are carved out of blocks of this many */
+#define FRAME_SLAB_BLOCK_FRAMES	64
+
+struct fpi_frame_slab {
+	size_t frame_size;
+	/* bytes from one frame to the next, header included */
+	size_t frame_stride;
+	/* frames handed out since the last reset, in order */
+	GPtrArray *frames;
+	GPtrArray *blocks;
+};
+
+/* Creates a slab of frames with frame_size bytes of data each */
+struct fpi_frame_slab *fpi_frame_slab_new(size_t frame_size)
 {
-	int a = *((int *)p1);
-	int b = *((int *)p2);
-	if (a < b)
-		return -1;
-	else if (a == b)
-		return 0;
-	else
-		return 1;
+	struct fpi_frame_slab *slab = g_malloc0(sizeof(*slab));
+	size_t align = sizeof(struct fpi_frame);
+
+	slab->frame_size = frame_size;
+	slab->frame_stride = (sizeof(struct fpi_frame) + frame_size +
+			      align - 1) / align * align;
+	slab->frames = g_ptr_array_new();
+	slab->blocks = g_ptr_array_new_with_free_func(g_free);
+
+	return slab;
+}
+
+void fpi_frame_slab_free(struct fpi_frame_slab *slab)
+{
+	if (!slab)
+		return;
+
+	g_ptr_array_free(slab->frames, TRUE);
+	g_ptr_array_free(slab->blocks, TRUE);
+	g_free(slab);
+}
+
+/* Releases all frames at once, keeping their memory for the next swipe */
+void fpi_frame_slab_reset(struct fpi_frame_slab *slab)
+{
+	g_ptr_array_set_size(slab->frames, 0);
+}
+
+/* Hands out the next frame, with no delta, after those taken so far */
+struct fpi_frame *fpi_frame_slab_alloc(struct fpi_frame_slab *slab)
+{
+	size_t n = slab->frames->len;
+	unsigned char *block;
+	struct fpi_frame *frame;
+
+	if (n == slab->blocks->len * FRAME_SLAB_BLOCK_FRAMES)
+		g_ptr_array_add(slab->blocks, g_malloc(slab->frame_stride *
+			FRAME_SLAB_BLOCK_FRAMES));
+
+	block = g_ptr_array_index(slab->blocks, n / FRAME_SLAB_BLOCK_FRAMES);
+	frame = (struct fpi_frame *) (block + slab->frame_stride *
+		(n % FRAME_SLAB_BLOCK_FRAMES));
+	frame->delta_x = 0;
+	frame->delta_y = 0;
+	g_ptr_array_add(slab->frames, frame);
+
+	return frame;
+}
+
+size_t fpi_frame_slab_len(struct fpi_frame_slab *slab)
+{
+	return slab->frames->len;
+}
+
+/* Frames repeating the one before them are dropped from the slab first,
+ * if ctx sets a dup_threshold */
+void fpi_do_movement_estimation_slab(struct fpi_frame_asmbl_ctx *ctx,
+				     struct fpi_frame_slab *slab)
+{
+	drop_repeated_frames(ctx, slab->frames);
+	movement_estimation(ctx, (struct fpi_frame **) slab->frames->pdata,
+		slab->frames->len);
+}
+
+struct fp_img *fpi_assemble_frames_slab(struct fpi_frame_asmbl_ctx *ctx,
+					struct fpi_frame_slab *slab)
+{
+	return assemble_frames(ctx, (struct fpi_frame **) slab->frames->pdata,
+		slab->frames->len);
+}
+
+/* Deltas of one frame of a stream, as each direction would store them */
+struct asmbl_stream_deltas {
+	int forward_x;
+	int forward_y;
+	int reverse_x;
+	int reverse_y;
+};
+
+struct fpi_asmbl_stream {
+	struct fpi_frame_asmbl_ctx *ctx;
+	struct frame_window window;
+	struct overlap_search forward;
+	struct overlap_search reverse;
+	/* pushed frames, in order */
+	struct fpi_frame_slab *frames;
+	GArray *deltas;
+};
+
+/* Creates a stream assembling frames of frame_size bytes described by ctx,
+ * which must not change until the stream is freed */
+struct fpi_asmbl_stream *fpi_asmbl_stream_new(struct fpi_frame_asmbl_ctx *ctx,
+					      size_t frame_size)
+{
+	struct fpi_asmbl_stream *stream = g_malloc0(sizeof(*stream));
+
+	stream->ctx = ctx;
+	stream->frames = fpi_frame_slab_new(frame_size);
+	frame_window_init(ctx, &stream->window);
+	stream->reverse.reverse = TRUE;
+	stream->deltas = g_array_new(FALSE, TRUE,
+		sizeof(struct asmbl_stream_deltas));
+
+	return stream;
+}
+
+/* Drops the frames pushed so far, so the stream can take a new capture */
+void fpi_asmbl_stream_reset(struct fpi_asmbl_stream *stream)
+{
+	fpi_frame_slab_reset(stream->frames);
+	g_array_set_size(stream->deltas, 0);
+	memset(&stream->forward, 0, sizeof(stream->forward));
+	memset(&stream->reverse, 0, sizeof(stream->reverse));
+	stream->reverse.reverse = TRUE;
+}
+
+void fpi_asmbl_stream_free(struct fpi_asmbl_stream *stream)
+{
+	if (!stream)
+		return;
+
+	fpi_asmbl_stream_reset(stream);
+	frame_window_clear(&stream->window);
+	fpi_frame_slab_free(stream->frames);
+	g_array_free(stream->deltas, TRUE);
+	g_free(stream);
+}
+
+static void stream_push(struct fpi_asmbl_stream *stream,
+			const unsigned char *data)
+{
+	struct asmbl_stream_deltas *deltas;
+	size_t n = fpi_frame_slab_len(stream->frames);
+	struct fpi_frame *frame = fpi_frame_slab_alloc(stream->frames);
+
+	memcpy(frame->data, data, stream->frames->frame_size);
+	if (n > 0 && stream->ctx->dup_threshold &&
+	    frame_repeats(stream->ctx,
+		    g_ptr_array_index(stream->frames->frames, n - 1), frame)) {
+		/* hand the frame back to the slab */
+		g_ptr_array_set_size(stream->frames->frames, n);
+		return;
+	}
+	frame_window_push(stream->ctx, &stream->window, frame);
+	g_array_set_size(stream->deltas, n + 1);
+	if (n == 0)
+		return;
+
+	if ((n - 1) % MOVEMENT_CHUNK_PAIRS == 0) {
+		stream->forward.have_hint = FALSE;
+		stream->reverse.have_hint = FALSE;
+	}
+
+	deltas = &g_array_index(stream->deltas, struct asmbl_stream_deltas, n - 1);
+	search_pair(stream->ctx, &stream->forward, &stream->window,
+		&deltas->forward_x, &deltas->forward_y);
+	deltas = &g_array_index(stream->deltas, struct asmbl_stream_deltas, n);
+	search_pair(stream->ctx, &stream->reverse, &stream->window,
+		&deltas->reverse_x, &deltas->reverse_y);
 }
 
+/* Appends a copy of the frame data to the stream. Its offset to the
+ * previous frame is searched for in both directions right away, so that
+ * little is left to do once the last frame is in. A frame repeating the
+ * previous one is dropped if the context sets a dup_threshold. */
+void fpi_asmbl_stream_push(struct fpi_asmbl_stream *stream,
+			   const unsigned char *data)
+{
+	int scope = fpi_alloc_scope_push(FP_ALLOC_ASSEMBLING);
+
+	stream_push(stream, data);
+	fpi_alloc_scope_pop(scope);
+}
+
+size_t fpi_asmbl_stream_len(struct fpi_asmbl_stream *stream)
+{
+	return fpi_frame_slab_len(stream->frames);
+}
+
+/* Picks the direction of the swipe and assembles the frames pushed so
+ * far, as fpi_do_movement_estimation() and fpi_assemble_frames() would,
+ * then empties the stream */
+struct fp_img *fpi_asmbl_stream_assemble(struct fpi_asmbl_stream *stream)
+{
+	struct asmbl_stream_deltas *deltas;
+	struct fpi_frame *frame;
+	struct fp_img *img;
+	size_t i, n = fpi_frame_slab_len(stream->frames);
+	int err, rev_err;
+	gboolean forward;
+
+	BUG_ON(n == 0);
+
+	err = stream->forward.total_error / n;
+	rev_err = stream->reverse.total_error / n;
+	fp_dbg("errors: %d rev: %d", err, rev_err);
+	forward = err < rev_err;
+
+	/* Each direction leaves the delta of the frame it never stores to
+	 * as the other one found it */
+	deltas = &g_array_index(stream->deltas, struct asmbl_stream_deltas, 0);
+	deltas[0].reverse_x = deltas[0].forward_x;
+	deltas[0].reverse_y = deltas[0].forward_y;
+	deltas[n - 1].forward_x = deltas[n - 1].reverse_x;
+	deltas[n - 1].forward_y = deltas[n - 1].reverse_y;
+
+	for (i = 0; i < n; i++) {
+		frame = g_ptr_array_index(stream->frames->frames, i);
+		frame->delta_x = forward ? deltas[i].forward_x : deltas[i].reverse_x;
+		frame->delta_y = forward ? deltas[i].forward_y : deltas[i].reverse_y;
+	}
+
+	img = fpi_assemble_frames_slab(stream->ctx, stream->frames);
+	fpi_asmbl_stream_reset(stream);
+
+	return img;
+}
+
+/* Allocates room for max_lines lines of line_size bytes */
+struct fpi_line_store *fpi_line_store_new(unsigned line_size,
+					  size_t max_lines)
+{
+	struct fpi_line_store *store = g_malloc0(sizeof(*store));
+
+	store->line_size = line_size;
+	store->max_lines = max_lines;
+	store->data = g_malloc(line_size * max_lines);
+
+	return store;
+}
+
+void fpi_line_store_free(struct fpi_line_store *store)
+{
+	if (!store)
+		return;
+
+	g_free(store->data);
+	g_free(store);
+}
+
+/* Copies a line after the last one. Returns FALSE, leaving the store
+ * as it is, when it is full. */
+gboolean fpi_line_store_append(struct fpi_line_store *store,
+			       const unsigned char *line)
+{
+	if (store->num_lines >= store->max_lines)
+		return FALSE;
+
+	memcpy(fpi_line_store_get(store, store->num_lines), line,
+	       store->line_size);
+	store->num_lines++;
+
+	return TRUE;
+}
+
+/* Offsets are small integers, so the window is kept as a histogram and the
+ * median bin is moved along as lines enter and leave the window, instead of
+ * sorting the window for every output element */
 static void median_filter(int *data, int size, int filtersize)
 {
-	int i;
-	int *result = (int *)g_malloc0(size*sizeof(int));
-	int *sortbuf = (int *)g_malloc0(filtersize*sizeof(int));
+	int half = (filtersize - 1) / 2;
+	int i, lo, hi, med = 0, below = 0;
+	int first = 0, last = -1;
+	int *result, *hist;
+
+	if (size <= 0)
+		return;
+
+	lo = hi = data[0];
+	for (i = 1; i < size; i++) {
+		lo = MIN(lo, data[i]);
+		hi = MAX(hi, data[i]);
+	}
+
+	result = g_malloc(size * sizeof(int));
+	hist = g_malloc0((hi - lo + 1) * sizeof(int));
 	for (i = 0; i < size; i++) {
-		int i1 = i - (filtersize-1)/2;
-		int i2 = i + (filtersize-1)/2;
-		if (i1 < 0)
-			i1 = 0;
-		if (i2 >= size)
-			i2 = size-1;
-		g_memmove(sortbuf, data+i1, (i2-i1+1)*sizeof(int));
-		g_qsort_with_data(sortbuf, i2-i1+1, sizeof(int), cmpint, NULL);
-		result[i] = sortbuf[(i2-i1+1)/2];
+		int i1 = MAX(i - half, 0);
+		int i2 = MIN(i + half, size - 1);
+		int k = (i2 - i1 + 1) / 2;
+
+		/* below counts the values of the window under bin med */
+		while (last < i2) {
+			int v = data[++last] - lo;
+			hist[v]++;
+			if (v < med)
+				below++;
+		}
+		while (first < i1) {
+			int v = data[first++] - lo;
+			hist[v]--;
+			if (v < med)
+				below--;
+		}
+
+		/* same element as sorting the window and taking index k */
+		while (below > k)
+			below -= hist[--med];
+		while (below + hist[med] <= k)
+			below += hist[med++];
+		result[i] = lo + med;
 	}
-	memmove(data, result, size*sizeof(int));
+	memmove(data, result, size * sizeof(int));
 	g_free(result);
-	g_free(sortbuf);
+	g_free(hist);
 }
 
 static void interpolate_lines(struct fpi_line_asmbl_ctx *ctx,
-			      GSList *line1, float y1, GSList *line2,
+			      struct fpi_line_store *lines,
+			      size_t line1, float y1, size_t line2,
 			      float y2, unsigned char *output, float yi, int size)
 {
 	int i;
 	unsigned char p1, p2;
 
-	if (!line1 || !line2)
-		return;
-
 	for (i = 0; i < size; i++) {
-		p1 = ctx->get_pixel(ctx, line1, i);
-		p2 = ctx->get_pixel(ctx, line2, i);
+		p1 = ctx->get_pixel(ctx, lines, line1, i);
+		p2 = ctx->get_pixel(ctx, lines, line2, i);
 		output[i] = (float)p1
 			    + (yi - y1)/(y2 - y1)*(p2 - p1);
 	}
@@ -353,21 +1116,23 @@ static int min(int a, int b) {return (a < b) ? a : b; }
 
 /* Rescale image to account for variable swiping speed */
 struct fp_img *fpi_assemble_lines(struct fpi_line_asmbl_ctx *ctx,
-				  GSList *lines, size_t lines_len)
+				  struct fpi_line_store *lines)
 {
+	/* first, the buffers below are the assembling's */
+	int scope = fpi_alloc_scope_push(FP_ALLOC_ASSEMBLING);
 	/* Number of output lines per distance between two scanners */
 	int i;
-	GSList *row1, *row2;
+	size_t lines_len = lines->num_lines;
 	float y = 0.0;
 	int line_ind = 0;
 	int *offsets = (int *)g_malloc0((lines_len / 2) * sizeof(int));
+	int *devs = g_malloc(ctx->max_search_offset * sizeof(int));
 	unsigned char *output = g_malloc0(ctx->line_width * ctx->max_height);
 	struct fp_img *img;
 
 	fp_dbg("%llu", g_get_real_time());
 
-	row1 = lines;
-	for (i = 0; (i < lines_len - 1) && row1; i += 2) {
+	for (i = 0; i < lines_len - 1; i += 2) {
 		int bestmatch = i;
 		int bestdiff = 0;
 		int j, firstrow, lastrow;
@@ -375,22 +1140,23 @@ struct fp_img *fpi_assemble_lines(struct fpi_line_asmbl_ctx *ctx,
 		firstrow = i + 1;
 		lastrow = min(i + ctx->max_search_offset, lines_len - 1);
 
-		row2 = g_slist_next(row1);
+		if (ctx->get_deviations)
+			ctx->get_deviations(ctx, lines, i, firstrow, lastrow,
+				devs);
+		else
+			for (j = firstrow; j <= lastrow; j++)
+				devs[j - firstrow] = ctx->get_deviation(ctx,
+					lines, i, j);
+
 		for (j = firstrow; j <= lastrow; j++) {
-			int diff = ctx->get_deviation(ctx,
-					row1,
-					row2);
+			int diff = devs[j - firstrow];
 			if ((j == firstrow) || (diff < bestdiff)) {
 				bestdiff = diff;
 				bestmatch = j;
 			}
-			row2 = g_slist_next(row2);
 		}
 		offsets[i / 2] = bestmatch - i;
 		fp_dbg("%d", offsets[i / 2]);
-		row1 = g_slist_next(row1);
-		if (row1)
-			row1 = g_slist_next(row1);
 	}
 
 	median_filter(offsets, (lines_len / 2) - 1, ctx->median_filter_size);
@@ -398,17 +1164,16 @@ struct fp_img *fpi_assemble_lines(struct fpi_line_asmbl_ctx *ctx,
 	fp_dbg("offsets_filtered: %llu", g_get_real_time());
 	for (i = 0; i <= (lines_len / 2) - 1; i++)
 		fp_dbg("%d", offsets[i]);
-	row1 = lines;
-	for (i = 0; i < lines_len - 1; i++, row1 = g_slist_next(row1)) {
+	for (i = 0; i < lines_len - 1; i++) {
 		int offset = offsets[i/2];
 		if (offset > 0) {
 			float ynext = y + (float)ctx->resolution / offset;
 			while (line_ind < ynext) {
 				if (line_ind > ctx->max_height - 1)
 					goto out;
-				interpolate_lines(ctx,
-					row1, y,
-					g_slist_next(row1),
+				interpolate_lines(ctx, lines,
+					i, y,
+					i + 1,
 					ynext,
 					output + line_ind * ctx->line_width,
 					line_ind,
@@ -425,6 +1190,8 @@ out:
 	img->flags = FP_IMG_V_FLIPPED;
 	g_memmove(img->data, output, ctx->line_width * line_ind);
 	g_free(offsets);
+	g_free(devs);
 	g_free(output);
+	fpi_alloc_scope_pop(scope);
 	return img;
 }
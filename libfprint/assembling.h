@@ -30,22 +30,110 @@ struct fpi_frame {
 	unsigned char data[0];
 };
 
+/* How fpi_do_movement_estimation() looks for the offset between frames */
+enum fpi_frame_search {
+	/* try every offset on the full frames */
+	FPI_FRAME_SEARCH_EXHAUSTIVE = 0,
+	/* try every offset on frames downsampled by 2, then refine the best
+	 * few, and the offset found for the previous frame, on the full
+	 * frames */
+	FPI_FRAME_SEARCH_COARSE_TO_FINE,
+};
+
+/* How the pixels of a frame are stored in its data, so they can be read
+ * without going through get_pixel() */
+enum fpi_frame_layout {
+	/* unknown, only get_pixel() can read a pixel */
+	FPI_FRAME_LAYOUT_CALLBACK = 0,
+	/* one byte per pixel, rows of stride bytes, as elan_get_pixel() */
+	FPI_FRAME_LAYOUT_LINEAR8,
+	/* two 4-bit pixels per byte, column after column and the lower nibble
+	 * holding the even row, as aes_get_pixel() */
+	FPI_FRAME_LAYOUT_AES4,
+};
+
 struct fpi_frame_asmbl_ctx {
 	unsigned frame_width;
 	unsigned frame_height;
 	unsigned image_width;
+	enum fpi_frame_search search;
+	enum fpi_frame_layout layout;
+	/* bytes from one row to the next for FPI_FRAME_LAYOUT_LINEAR8,
+	 * 0 for frame_width */
+	unsigned stride;
+	/* mean squared difference of the pixels of every few rows under which
+	 * a frame repeats the one before it, and is dropped before movement
+	 * estimation, 0 to keep all frames */
+	unsigned dup_threshold;
 	unsigned char (*get_pixel)(struct fpi_frame_asmbl_ctx *ctx,
 				   struct fpi_frame *frame,
 				   unsigned x,
 				   unsigned y);
 };
 
+void fpi_aes4_unpack(const unsigned char *in, unsigned int width,
+		     unsigned int height, unsigned char *out,
+		     unsigned int flags);
+
 void fpi_do_movement_estimation(struct fpi_frame_asmbl_ctx *ctx,
 			    GSList *stripes, size_t stripes_len);
 
 struct fp_img *fpi_assemble_frames(struct fpi_frame_asmbl_ctx *ctx,
 			    GSList *stripes, size_t stripes_len);
 
+/* Frames of one size, handed out in order from large blocks and released
+ * all at once, which also serves as the list of frames of a swipe */
+struct fpi_frame_slab;
+
+struct fpi_frame_slab *fpi_frame_slab_new(size_t frame_size);
+void fpi_frame_slab_free(struct fpi_frame_slab *slab);
+void fpi_frame_slab_reset(struct fpi_frame_slab *slab);
+struct fpi_frame *fpi_frame_slab_alloc(struct fpi_frame_slab *slab);
+size_t fpi_frame_slab_len(struct fpi_frame_slab *slab);
+
+void fpi_do_movement_estimation_slab(struct fpi_frame_asmbl_ctx *ctx,
+				     struct fpi_frame_slab *slab);
+struct fp_img *fpi_assemble_frames_slab(struct fpi_frame_asmbl_ctx *ctx,
+					struct fpi_frame_slab *slab);
+
+/* Assembles frames as they are captured, see fpi_asmbl_stream_push() */
+struct fpi_asmbl_stream;
+
+struct fpi_asmbl_stream *fpi_asmbl_stream_new(struct fpi_frame_asmbl_ctx *ctx,
+					      size_t frame_size);
+void fpi_asmbl_stream_free(struct fpi_asmbl_stream *stream);
+void fpi_asmbl_stream_reset(struct fpi_asmbl_stream *stream);
+void fpi_asmbl_stream_push(struct fpi_asmbl_stream *stream,
+			   const unsigned char *data);
+size_t fpi_asmbl_stream_len(struct fpi_asmbl_stream *stream);
+struct fp_img *fpi_asmbl_stream_assemble(struct fpi_asmbl_stream *stream);
+
+/* Lines of a swipe, one after the other in a single buffer */
+struct fpi_line_store {
+	/* bytes per line, including any header the device sends */
+	unsigned line_size;
+	size_t max_lines;
+	size_t num_lines;
+	unsigned char *data;
+};
+
+struct fpi_line_store *fpi_line_store_new(unsigned line_size,
+					  size_t max_lines);
+void fpi_line_store_free(struct fpi_line_store *store);
+gboolean fpi_line_store_append(struct fpi_line_store *store,
+			       const unsigned char *line);
+
+static inline unsigned char *fpi_line_store_get(struct fpi_line_store *store,
+						size_t line)
+{
+	return store->data + line * store->line_size;
+}
+
+static inline void fpi_line_store_reset(struct fpi_line_store *store)
+{
+	store->num_lines = 0;
+}
+
 struct fpi_line_asmbl_ctx {
 	unsigned line_width;
 	unsigned max_height;
@@ -53,13 +141,20 @@ struct fpi_line_asmbl_ctx {
 	unsigned median_filter_size;
 	unsigned max_search_offset;
 	int (*get_deviation)(struct fpi_line_asmbl_ctx *ctx,
-			     GSList *line1, GSList *line2);
+			     struct fpi_line_store *lines,
+			     size_t line1, size_t line2);
+	/* optional, stores get_deviation() of line against each of the
+	 * lines first to last in devs */
+	void (*get_deviations)(struct fpi_line_asmbl_ctx *ctx,
+			       struct fpi_line_store *lines, size_t line,
+			       size_t first, size_t last, int *devs);
 	unsigned char (*get_pixel)(struct fpi_line_asmbl_ctx *ctx,
-				   GSList *line,
+				   struct fpi_line_store *lines,
+				   size_t line,
 				   unsigned x);
 };
 
 struct fp_img *fpi_assemble_lines(struct fpi_line_asmbl_ctx *ctx,
-				  GSList *lines, size_t lines_len);
+				  struct fpi_line_store *lines);
 
 #endif
@@ -21,6 +21,7 @@
 
 #include <config.h>
 #include <errno.h>
+#include <string.h>
 #include <glib.h>
 
 #include "fp_internal.h"
@@ -31,7 +32,9 @@ void fpi_drvcb_open_complete(struct fp_dev *dev, int status)
 	fp_dbg("status %d", status);
 	BUG_ON(dev->state != DEV_STATE_INITIALIZING);
 	dev->state = (status) ? DEV_STATE_ERROR : DEV_STATE_INITIALIZED;
+	g_mutex_lock(&opened_devices_lock);
 	opened_devices = g_slist_prepend(opened_devices, dev);
+	g_mutex_unlock(&opened_devices_lock);
 	if (dev->open_cb)
 		dev->open_cb(dev, status, dev->open_cb_data);
 }
@@ -53,10 +56,15 @@ API_EXPORTED int fp_async_dev_open(struct fp_dscv_dev *ddev, fp_dev_open_cb call
 	int r;
 
 	fp_dbg("");
-	r = libusb_open(ddev->udev, &udevh);
-	if (r < 0) {
-		fp_err("usb_open failed, error %d", r);
-		return r;
+	if (!ddev->udev) {
+		/* a virtual device, drivers of those do not touch USB */
+		udevh = NULL;
+	} else {
+		r = libusb_open(ddev->udev, &udevh);
+		if (r < 0) {
+			fp_err("usb_open failed, error %d", r);
+			return r;
+		}
 	}
 
 	dev = g_malloc0(sizeof(*dev));
@@ -76,7 +84,8 @@ API_EXPORTED int fp_async_dev_open(struct fp_dscv_dev *ddev, fp_dev_open_cb call
 	r = drv->open(dev, ddev->driver_data);
 	if (r) {
 		fp_err("device initialisation failed, driver=%s", drv->name);
-		libusb_close(udevh);
+		if (udevh)
+			libusb_close(udevh);
 		g_free(dev);
 	}
 
@@ -89,7 +98,8 @@ void fpi_drvcb_close_complete(struct fp_dev *dev)
 	fp_dbg("");
 	BUG_ON(dev->state != DEV_STATE_DEINITIALIZING);
 	dev->state = DEV_STATE_DEINITIALIZED;
-	libusb_close(dev->udev);
+	if (dev->udev)
+		libusb_close(dev->udev);
 	if (dev->close_cb)
 		dev->close_cb(dev, dev->close_cb_data);
 	g_free(dev);
@@ -106,9 +116,11 @@ API_EXPORTED void fp_async_dev_close(struct fp_dev *dev,
 {
 	struct fp_driver *drv = dev->drv;
 
+	g_mutex_lock(&opened_devices_lock);
 	if (g_slist_index(opened_devices, (gconstpointer) dev) == -1)
 		fp_err("device %p not in opened list!", dev);
 	opened_devices = g_slist_remove(opened_devices, (gconstpointer) dev);
+	g_mutex_unlock(&opened_devices_lock);
 
 	dev->close_cb = callback;
 	dev->close_cb_data = user_data;
@@ -378,8 +390,12 @@ API_EXPORTED int fp_async_identify_start(struct fp_dev *dev,
 		return -ENOTSUP;
 	dev->state = DEV_STATE_IDENTIFY_STARTING;
 	dev->identify_cb = callback;
+	dev->identify_topk_cb = NULL;
+	dev->identify_score_cb = NULL;
 	dev->identify_cb_data = user_data;
 	dev->identify_gallery = gallery;
+	dev->identify_topk = 0;
+	memset(&dev->identify_budget, 0, sizeof(dev->identify_budget));
 
 	r = drv->identify_start(dev);
 	if (r < 0) {
@@ -390,6 +406,115 @@ API_EXPORTED int fp_async_identify_start(struct fp_dev *dev,
 	return r;
 }
 
+/**
+ * fp_async_identify_topk_start:
+ * @dev: the device to perform the scan.
+ * @gallery: %NULL-terminated array of pointers to the prints to identify
+ * against.
+ * @k: the maximum number of candidates to report.
+ * @callback: function to call with the result of the scan.
+ * @user_data: user data to pass to @callback.
+ *
+ * Starts a top-K identification. Rather than stopping at the first matching
+ * print, the whole gallery is compared against the scan and the @k best
+ * scoring prints are passed to @callback, best first. The result is
+ * fp_verify_result#FP_VERIFY_MATCH if the best of them reached the device's
+ * matching threshold. The matches array is only valid for the duration of
+ * the callback. Stop the operation with fp_async_identify_stop().
+ *
+ * Only imaging devices support top-K identification.
+ *
+ * Returns: 0 on success, non-zero on error
+ */
+API_EXPORTED int fp_async_identify_topk_start(struct fp_dev *dev,
+	struct fp_print_data **gallery, size_t k, fp_identify_topk_cb callback,
+	void *user_data)
+{
+	return fp_async_identify_budget_start(dev, gallery, k, NULL, NULL,
+		callback, user_data);
+}
+
+/**
+ * fp_async_identify_budget_start:
+ * @dev: the device to perform the scan.
+ * @gallery: %NULL-terminated array of pointers to the prints to identify
+ * against.
+ * @k: the maximum number of candidates to report.
+ * @budget: the limits of the comparisons, or %NULL for none.
+ * @score_cb: function to call with the score of each print as it is
+ * compared, or %NULL.
+ * @callback: function to call with the result of the scan.
+ * @user_data: user data to pass to @score_cb and @callback.
+ *
+ * Starts a top-K identification, like fp_async_identify_topk_start(), which
+ * stops comparing once @budget is exhausted: @callback then gets the @k best
+ * of the prints compared so far. The time limit is checked between prints,
+ * so the last comparisons can take a little longer.
+ *
+ * Meanwhile @score_cb is called with the score of each print compared, in
+ * no particular order as the gallery is compared on several threads. The
+ * match is only valid for the duration of the call. Scores are reported
+ * from the thread handling events, before @callback is called.
+ *
+ * Stopping the operation with fp_async_identify_stop() abandons the
+ * comparisons in progress, rather than waiting for them to finish.
+ *
+ * Only imaging devices support budgeted identification.
+ *
+ * Returns: 0 on success, non-zero on error
+ */
+API_EXPORTED int fp_async_identify_budget_start(struct fp_dev *dev,
+	struct fp_print_data **gallery, size_t k,
+	const struct fp_identify_budget *budget, fp_identify_score_cb score_cb,
+	fp_identify_topk_cb callback, void *user_data)
+{
+	struct fp_driver *drv = dev->drv;
+	int r;
+
+	fp_dbg("k=%zd", k);
+	if (!drv->identify_start || drv->type != DRIVER_IMAGING)
+		return -ENOTSUP;
+	if (k == 0)
+		return -EINVAL;
+	dev->state = DEV_STATE_IDENTIFY_STARTING;
+	dev->identify_cb = NULL;
+	dev->identify_topk_cb = callback;
+	dev->identify_score_cb = score_cb;
+	dev->identify_cb_data = user_data;
+	dev->identify_gallery = gallery;
+	dev->identify_topk = k;
+	if (budget)
+		dev->identify_budget = *budget;
+	else
+		memset(&dev->identify_budget, 0, sizeof(dev->identify_budget));
+
+	r = drv->identify_start(dev);
+	if (r < 0) {
+		fp_err("identify_start failed with error %d", r);
+		dev->identify_topk_cb = NULL;
+		dev->identify_score_cb = NULL;
+		dev->state = DEV_STATE_ERROR;
+	}
+	return r;
+}
+
+static void identify_report(struct fp_dev *dev, int result,
+	size_t match_offset, struct fp_img *img)
+{
+	if (dev->identify_topk_cb)
+		dev->identify_topk_cb(dev, result, dev->identify_matches,
+			dev->identify_nr_matches, img, dev->identify_cb_data);
+	else if (dev->identify_cb)
+		dev->identify_cb(dev, result, match_offset, img,
+			dev->identify_cb_data);
+	else
+		fp_dbg("ignoring identify result as no callback is subscribed");
+
+	g_free(dev->identify_matches);
+	dev->identify_matches = NULL;
+	dev->identify_nr_matches = 0;
+}
+
 /* Driver-lib: identification has started, expect results soon */
 void fpi_drvcb_identify_started(struct fp_dev *dev, int status)
 {
@@ -401,8 +526,7 @@ void fpi_drvcb_identify_started(struct fp_dev *dev, int status)
 			fp_dbg("adjusted to %d", status);
 		}
 		dev->state = DEV_STATE_ERROR;
-		if (dev->identify_cb)
-			dev->identify_cb(dev, status, 0, NULL, dev->identify_cb_data);
+		identify_report(dev, status, 0, NULL);
 	} else {
 		dev->state = DEV_STATE_IDENTIFYING;
 	}
@@ -419,10 +543,16 @@ void fpi_drvcb_report_identify_result(struct fp_dev *dev, int result,
 			|| result == FP_VERIFY_MATCH)
 		dev->state = DEV_STATE_IDENTIFY_DONE;
 
-	if (dev->identify_cb)
-		dev->identify_cb(dev, result, match_offset, img, dev->identify_cb_data);
-	else
-		fp_dbg("ignoring verify result as no callback is subscribed");
+	identify_report(dev, result, match_offset, img);
+}
+
+/* Drivers report the score of a gallery print while identifying, see
+ * fp_async_identify_budget_start() */
+void fpi_drvcb_report_identify_score(struct fp_dev *dev,
+	const struct fp_identify_match *match)
+{
+	if (dev->state == DEV_STATE_IDENTIFYING && dev->identify_score_cb)
+		dev->identify_score_cb(dev, match, dev->identify_cb_data);
 }
 
 /**
@@ -446,6 +576,11 @@ API_EXPORTED int fp_async_identify_stop(struct fp_dev *dev,
 
 	dev->state = DEV_STATE_IDENTIFY_STOPPING;
 	dev->identify_cb = NULL;
+	dev->identify_topk_cb = NULL;
+	dev->identify_score_cb = NULL;
+	g_free(dev->identify_matches);
+	dev->identify_matches = NULL;
+	dev->identify_nr_matches = 0;
 	dev->identify_stop_cb = callback;
 	dev->identify_stop_cb_data = user_data;
 
@@ -542,6 +677,20 @@ void fpi_drvcb_report_capture_result(struct fp_dev *dev, int result,
 		fp_dbg("ignoring capture result as no callback is subscribed");
 }
 
+/* Imaging devices call this for each frame of a capture stream, which goes on
+ * capturing afterwards */
+void fpi_drvcb_report_capture_frame(struct fp_dev *dev, struct fp_img *img)
+{
+	fp_dbg("");
+	if (dev->state != DEV_STATE_CAPTURING || !dev->capture_cb) {
+		fp_dbg("dropping frame as the stream is over");
+		fp_img_free(img);
+		return;
+	}
+
+	dev->capture_cb(dev, FP_CAPTURE_COMPLETE, img, dev->capture_cb_data);
+}
+
 /* Drivers call this when capture has stopped */
 void fpi_drvcb_capture_stopped(struct fp_dev *dev)
 {
@@ -591,3 +740,77 @@ API_EXPORTED int fp_async_capture_stop(struct fp_dev *dev,
 	}
 	return r;
 }
+
+/**
+ * fp_async_capture_stream_start:
+ * @dev: the imaging device to capture from.
+ * @max_queued: how many frames can wait for the application, at least 1.
+ * @flags: a combination of #fp_capture_stream_flags.
+ * @callback: function to call with each frame.
+ * @user_data: user data to pass to @callback.
+ *
+ * Starts capturing images continuously. Unlike repeated calls to
+ * fp_async_capture_start(), the device stays in its capture state from one
+ * image to the next, for as long as the finger is on the sensor, and goes
+ * back to waiting for a finger when it is removed.
+ *
+ * Each image is passed to @callback with the
+ * fp_capture_result#FP_CAPTURE_COMPLETE result and belongs to the
+ * application, which frees it with fp_img_free().
+ * Only one frame is handed out at a time: the next one is passed once the
+ * application called fp_async_capture_stream_ack(), which it can do from
+ * @callback. Images captured meanwhile are queued, up to @max_queued of
+ * them. When the queue is full, the stream stops taking images from the
+ * sensor until the application catches up, or drops the oldest queued image
+ * if @flags contains %FP_CAPTURE_STREAM_DROP_OLDEST.
+ *
+ * A negative result passed to @callback ends the stream. Stop it with
+ * fp_async_capture_stop(), which drops the images still queued.
+ *
+ * Returns: 0 on success, -EINVAL if @max_queued is 0, -ENOTSUP if @dev is
+ * not an imaging device, or another negative error code.
+ */
+API_EXPORTED int fp_async_capture_stream_start(struct fp_dev *dev,
+	unsigned int max_queued, unsigned int flags, fp_capture_cb callback,
+	void *user_data)
+{
+	int r;
+
+	fp_dbg("");
+	if (dev->drv->type != DRIVER_IMAGING)
+		return -ENOTSUP;
+	if (max_queued == 0)
+		return -EINVAL;
+
+	dev->state = DEV_STATE_CAPTURE_STARTING;
+	dev->capture_cb = callback;
+	dev->capture_cb_data = user_data;
+	dev->unconditional_capture = 0;
+
+	r = fpi_imgdev_capture_stream_start(dev->priv, max_queued, flags);
+	if (r < 0) {
+		dev->capture_cb = NULL;
+		dev->state = DEV_STATE_ERROR;
+		fp_err("failed to start capture stream, error %d", r);
+	}
+	return r;
+}
+
+/**
+ * fp_async_capture_stream_ack:
+ * @dev: the device streaming images.
+ *
+ * Tells a capture stream started with fp_async_capture_stream_start() that
+ * the application is ready for the next frame. Like the rest of the
+ * asynchronous API, this must be called from the thread handling libfprint
+ * events.
+ *
+ * Returns: 0 on success, or -EINVAL if no frame is waiting for an
+ * acknowledgement.
+ */
+API_EXPORTED int fp_async_capture_stream_ack(struct fp_dev *dev)
+{
+	if (dev->drv->type != DRIVER_IMAGING)
+		return -EINVAL;
+	return fpi_imgdev_capture_stream_ack(dev->priv);
+}
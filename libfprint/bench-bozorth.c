@@ -0,0 +1,478 @@
+/*
+ * Bozorth3 matcher micro-benchmark
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Matches every probe against every gallery sample and times the four
+ * Bozorth3 stages separately. The samples are either read from stored print
+ * files (as written by fp_print_data_save() or fp_print_data_get_data()), in
+ * which case each sample is matched against all the others, or generated:
+ * random gallery samples with a perturbed copy of each as probe. */
+
+#include <config.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <glib.h>
+
+#include "fp_internal.h"
+#include "nbis/include/bozorth.h"
+
+enum bench_stage {
+	STAGE_PROBE_INIT,
+	STAGE_GALLERY_INIT,
+	STAGE_MATCH,
+	STAGE_MATCH_SCORE,
+	NR_STAGES,
+};
+
+static const char *stage_names[NR_STAGES] = {
+	"bozorth_probe_init",
+	"bozorth_gallery_init",
+	"bz_match",
+	"bz_match_score",
+};
+
+static gint nr_synthetic = 100;
+static gint nr_minutiae = 40;
+static gint nr_threads = 1;
+static gint nr_rounds = 1;
+static gint seed = 1;
+
+static GOptionEntry entries[] = {
+	{ "synthetic", 'n', 0, G_OPTION_ARG_INT, &nr_synthetic,
+		"Number of synthetic samples, if no print files are given", "N" },
+	{ "minutiae", 'm', 0, G_OPTION_ARG_INT, &nr_minutiae,
+		"Minutiae per synthetic sample", "M" },
+	{ "threads", 't', 0, G_OPTION_ARG_INT, &nr_threads,
+		"Worker threads, each with its own matcher context", "T" },
+	{ "rounds", 'r', 0, G_OPTION_ARG_INT, &nr_rounds,
+		"Number of times to repeat the whole run", "R" },
+	{ "seed", 's', 0, G_OPTION_ARG_INT, &seed,
+		"Seed for the synthetic samples", "S" },
+	{ NULL }
+};
+
+/* Latencies of one stage, in nanoseconds */
+struct latencies {
+	gint64 *ns;
+	gsize len;
+	gsize alloc;
+};
+
+struct bench {
+	struct xyt_struct **probes;
+	struct xyt_struct **gallery;
+	gsize nr_probes;
+	gsize nr_gallery;
+	/* with stored prints, probe i should not be matched against itself */
+	gboolean skip_self;
+	gint next_probe;
+	GMutex lock;
+	struct latencies stages[NR_STAGES];
+	guint64 comparisons;
+};
+
+static gint64 now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (gint64) ts.tv_sec * G_GINT64_CONSTANT(1000000000) + ts.tv_nsec;
+}
+
+static void latencies_add(struct latencies *l, gint64 ns)
+{
+	if (l->len == l->alloc) {
+		l->alloc = l->alloc ? l->alloc * 2 : 1024;
+		l->ns = g_renew(gint64, l->ns, l->alloc);
+	}
+	l->ns[l->len++] = ns;
+}
+
+static void latencies_merge(struct latencies *into, struct latencies *from)
+{
+	gsize i;
+
+	for (i = 0; i < from->len; i++)
+		latencies_add(into, from->ns[i]);
+	g_free(from->ns);
+}
+
+static int cmp_ns(const void *a, const void *b)
+{
+	gint64 x = *(const gint64 *) a;
+	gint64 y = *(const gint64 *) b;
+
+	return (x > y) - (x < y);
+}
+
+static gint64 percentile(struct latencies *l, int pct)
+{
+	gsize i;
+
+	if (l->len == 0)
+		return 0;
+	i = (l->len * pct + 99) / 100;
+	if (i > 0)
+		i--;
+	return l->ns[i];
+}
+
+static guint32 rnd_state;
+
+static int rnd(int n)
+{
+	rnd_state = rnd_state * 1103515245 + 12345;
+	return (rnd_state >> 8) % n;
+}
+
+static int cmp_minutia(const void *a, const void *b)
+{
+	const int *x = a;
+	const int *y = b;
+
+	if (x[0] != y[0])
+		return x[0] - y[0];
+	return x[1] - y[1];
+}
+
+/* Fills xyt with random minutiae, or with a jittered copy of most of base's,
+ * sorted like fpi_img_minutiae_to_xyt() sorts them. */
+static void make_synthetic(struct xyt_struct *xyt, int n,
+	const struct xyt_struct *base)
+{
+	int c[MAX_BOZORTH_MINUTIAE][3];
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (base && i < base->nrows && rnd(10) < 8) {
+			int t = base->thetacol[i] + rnd(11) - 5;
+			if (t > 180)
+				t -= 360;
+			if (t <= -180)
+				t += 360;
+			c[i][0] = base->xcol[i] + rnd(7) - 3;
+			c[i][1] = base->ycol[i] + rnd(7) - 3;
+			c[i][2] = t;
+		} else {
+			c[i][0] = rnd(300);
+			c[i][1] = rnd(400);
+			c[i][2] = rnd(360) - 179;
+		}
+	}
+	qsort(c, n, sizeof(c[0]), cmp_minutia);
+
+	xyt->nrows = n;
+	for (i = 0; i < n; i++) {
+		xyt->xcol[i] = c[i][0];
+		xyt->ycol[i] = c[i][1];
+		xyt->thetacol[i] = c[i][2];
+	}
+}
+
+/* Appends the minutiae sections of an FP3 print to samples */
+static int load_fp3_samples(const char *path, const unsigned char *p,
+	gsize left, GPtrArray *samples)
+{
+	while (left >= sizeof(struct fpi_print_data_section_fp3)) {
+		struct fpi_print_data_section_fp3 *section =
+			(struct fpi_print_data_section_fp3 *) p;
+		guint32 len = GUINT32_FROM_LE(section->length);
+
+		left -= sizeof(*section);
+		if (len > left) {
+			fprintf(stderr, "%s: corrupted print\n", path);
+			return -EINVAL;
+		}
+
+		if (section->type == FP3_SECTION_MINUTIAE) {
+			struct xyt_struct *xyt;
+			guint16 v = 0;
+			int i;
+
+			if (len >= 2) {
+				memcpy(&v, section->data, sizeof(v));
+				v = GUINT16_FROM_LE(v);
+			}
+			if (len < 2 || v > MAX_BOZORTH_MINUTIAE || len != 2u + v * 6) {
+				fprintf(stderr, "%s: corrupted print\n", path);
+				return -EINVAL;
+			}
+
+			xyt = g_new0(struct xyt_struct, 1);
+			xyt->nrows = v;
+			for (i = 0; i < xyt->nrows; i++) {
+				const unsigned char *t = section->data + 2 + i * 6;
+				gint16 c[3];
+
+				memcpy(c, t, sizeof(c));
+				xyt->xcol[i] = (gint16) GUINT16_FROM_LE(c[0]);
+				xyt->ycol[i] = (gint16) GUINT16_FROM_LE(c[1]);
+				xyt->thetacol[i] = (gint16) GUINT16_FROM_LE(c[2]);
+			}
+			g_ptr_array_add(samples, xyt);
+		}
+
+		p += sizeof(*section) + len;
+		left -= len;
+	}
+	return 0;
+}
+
+/* Appends the NBIS samples of a stored print file to samples */
+static int load_print_file(const char *path, GPtrArray *samples)
+{
+	struct fpi_print_data_fp2 *raw;
+	GError *err = NULL;
+	gchar *contents;
+	gsize length, left;
+	unsigned char *p;
+	int r = 0;
+
+	if (!g_file_get_contents(path, &contents, &length, &err)) {
+		fprintf(stderr, "%s: %s\n", path, err->message);
+		g_error_free(err);
+		return -EIO;
+	}
+
+	raw = (struct fpi_print_data_fp2 *) contents;
+	if (length < sizeof(*raw) || (strncmp(raw->prefix, "FP2", 3) != 0
+			&& strncmp(raw->prefix, "FP3", 3) != 0)) {
+		fprintf(stderr, "%s: not a stored print\n", path);
+		r = -EINVAL;
+		goto out;
+	}
+	if (raw->data_type != PRINT_DATA_NBIS_MINUTIAE) {
+		fprintf(stderr, "%s: not an NBIS minutiae print\n", path);
+		r = -EINVAL;
+		goto out;
+	}
+
+	p = raw->data;
+	left = length - sizeof(*raw);
+	if (strncmp(raw->prefix, "FP3", 3) == 0) {
+		r = load_fp3_samples(path, p, left, samples);
+		goto out;
+	}
+
+	while (left >= sizeof(struct fpi_print_data_item_fp2)) {
+		struct fpi_print_data_item_fp2 *item =
+			(struct fpi_print_data_item_fp2 *) p;
+		guint32 item_len = GUINT32_FROM_LE(item->length);
+		struct xyt_struct *xyt;
+
+		left -= sizeof(*item);
+		if (item_len > left || item_len < sizeof(*xyt)) {
+			fprintf(stderr, "%s: corrupted print\n", path);
+			r = -EINVAL;
+			goto out;
+		}
+
+		xyt = g_new(struct xyt_struct, 1);
+		memcpy(xyt, item->data, sizeof(*xyt));
+		g_ptr_array_add(samples, xyt);
+
+		p += sizeof(*item) + item_len;
+		left -= item_len;
+	}
+
+out:
+	g_free(contents);
+	return r;
+}
+
+static gpointer bench_worker(gpointer data)
+{
+	struct bench *b = data;
+	struct latencies stages[NR_STAGES];
+	struct bz_ctx *ctx;
+	guint64 comparisons = 0;
+	int s;
+
+	ctx = bz_ctx_new();
+	if (!ctx) {
+		fprintf(stderr, "out of memory\n");
+		return NULL;
+	}
+	memset(stages, 0, sizeof(stages));
+
+	while (TRUE) {
+		gint i = g_atomic_int_add(&b->next_probe, 1);
+		struct xyt_struct *pstruct;
+		gint64 t0, t1;
+		int probe_len;
+		gsize j;
+
+		if (i >= (gint) b->nr_probes)
+			break;
+		pstruct = b->probes[i];
+
+		t0 = now_ns();
+		probe_len = bozorth_probe_init_ctx(ctx, pstruct);
+		latencies_add(&stages[STAGE_PROBE_INIT], now_ns() - t0);
+
+		for (j = 0; j < b->nr_gallery; j++) {
+			struct xyt_struct *gstruct = b->gallery[j];
+			int gallery_len, np;
+
+			if (b->skip_self && j == (gsize) i)
+				continue;
+
+			t0 = now_ns();
+			gallery_len = bozorth_gallery_init_ctx(ctx, gstruct);
+			t1 = now_ns();
+			latencies_add(&stages[STAGE_GALLERY_INIT], t1 - t0);
+
+			np = bz_match_ctx(ctx, probe_len, gallery_len);
+			t0 = now_ns();
+			latencies_add(&stages[STAGE_MATCH], t0 - t1);
+
+			bz_match_score_ctx(ctx, np, pstruct, gstruct);
+			latencies_add(&stages[STAGE_MATCH_SCORE], now_ns() - t0);
+			comparisons++;
+		}
+	}
+
+	g_mutex_lock(&b->lock);
+	for (s = 0; s < NR_STAGES; s++)
+		latencies_merge(&b->stages[s], &stages[s]);
+	b->comparisons += comparisons;
+	g_mutex_unlock(&b->lock);
+
+	bz_ctx_free(ctx);
+	return NULL;
+}
+
+static void bench_run(struct bench *b)
+{
+	GThread **threads = g_new0(GThread *, nr_threads);
+	int i;
+
+	b->next_probe = 0;
+	for (i = 1; i < nr_threads; i++)
+		threads[i] = g_thread_new("bench-bozorth", bench_worker, b);
+	bench_worker(b);
+	for (i = 1; i < nr_threads; i++)
+		g_thread_join(threads[i]);
+	g_free(threads);
+}
+
+static void bench_report(struct bench *b, gint64 elapsed_ns)
+{
+	int s;
+
+	printf("%" G_GUINT64_FORMAT " comparisons in %.3f s on %d thread(s): "
+		"%.1f comparisons/s\n", b->comparisons, elapsed_ns / 1e9,
+		nr_threads, b->comparisons / (elapsed_ns / 1e9));
+	printf("%-22s %10s %10s %10s\n", "stage", "calls", "p50 us", "p99 us");
+	for (s = 0; s < NR_STAGES; s++) {
+		struct latencies *l = &b->stages[s];
+
+		qsort(l->ns, l->len, sizeof(*l->ns), cmp_ns);
+		printf("%-22s %10" G_GSIZE_FORMAT " %10.2f %10.2f\n",
+			stage_names[s], l->len, percentile(l, 50) / 1e3,
+			percentile(l, 99) / 1e3);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	GOptionContext *context;
+	GError *err = NULL;
+	GPtrArray *samples;
+	struct bench b;
+	gint64 t0, elapsed;
+	int i, r = 0;
+
+	context = g_option_context_new("[PRINT-FILE...]");
+	g_option_context_set_summary(context,
+		"Times the stages of the Bozorth3 fingerprint matcher.");
+	g_option_context_add_main_entries(context, entries, NULL);
+	if (!g_option_context_parse(context, &argc, &argv, &err)) {
+		fprintf(stderr, "%s\n", err->message);
+		g_error_free(err);
+		return 1;
+	}
+	g_option_context_free(context);
+
+	if (nr_threads < 1 || nr_rounds < 1 || nr_synthetic < 1 ||
+	    nr_minutiae < 1 || nr_minutiae > MAX_BOZORTH_MINUTIAE) {
+		fprintf(stderr, "invalid arguments\n");
+		return 1;
+	}
+
+	memset(&b, 0, sizeof(b));
+	g_mutex_init(&b.lock);
+	samples = g_ptr_array_new_with_free_func(g_free);
+
+	if (argc > 1) {
+		/* every stored sample against every other one */
+		for (i = 1; i < argc; i++) {
+			r = load_print_file(argv[i], samples);
+			if (r < 0)
+				goto out;
+		}
+		b.nr_probes = b.nr_gallery = samples->len;
+		b.probes = b.gallery = (struct xyt_struct **) samples->pdata;
+		b.skip_self = TRUE;
+	} else {
+		rnd_state = seed;
+		for (i = 0; i < nr_synthetic; i++) {
+			struct xyt_struct *g = g_new(struct xyt_struct, 1);
+			struct xyt_struct *p = g_new(struct xyt_struct, 1);
+
+			make_synthetic(g, nr_minutiae, NULL);
+			make_synthetic(p, nr_minutiae, g);
+			g_ptr_array_add(samples, g);
+			g_ptr_array_add(samples, p);
+		}
+		/* gallery samples at even indices, their probes at odd ones */
+		b.nr_probes = b.nr_gallery = nr_synthetic;
+		b.gallery = g_new(struct xyt_struct *, nr_synthetic);
+		b.probes = g_new(struct xyt_struct *, nr_synthetic);
+		for (i = 0; i < nr_synthetic; i++) {
+			b.gallery[i] = samples->pdata[2 * i];
+			b.probes[i] = samples->pdata[2 * i + 1];
+		}
+	}
+
+	if (b.nr_probes < (b.skip_self ? 2 : 1)) {
+		fprintf(stderr, "not enough samples to compare\n");
+		r = -EINVAL;
+		goto out;
+	}
+
+	t0 = now_ns();
+	for (i = 0; i < nr_rounds; i++)
+		bench_run(&b);
+	elapsed = now_ns() - t0;
+	bench_report(&b, elapsed);
+
+out:
+	for (i = 0; i < NR_STAGES; i++)
+		g_free(b.stages[i].ns);
+	if (!b.skip_self) {
+		g_free(b.gallery);
+		g_free(b.probes);
+	}
+	g_ptr_array_free(samples, TRUE);
+	g_mutex_clear(&b.lock);
+	return r < 0 ? 1 : 0;
+}
@@ -0,0 +1,245 @@
+/*
+ * Helpers shared by the benchmarks
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <glib.h>
+
+#include "bench-common.h"
+
+gint64 bench_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (gint64) ts.tv_sec * G_GINT64_CONSTANT(1000000000) + ts.tv_nsec;
+}
+
+static guint32 rnd_state;
+
+void bench_seed(guint32 seed)
+{
+	rnd_state = seed;
+}
+
+int bench_rnd(int n)
+{
+	rnd_state = rnd_state * 1103515245 + 12345;
+	return (rnd_state >> 8) % n;
+}
+
+/* Draws a whorl of ridges around a random centre, with noise and a blank
+ * margin, roughly what a press sensor returns. */
+struct fp_img *bench_make_synthetic(int width, int height)
+{
+	struct fp_img *img = fpi_img_new(width * height);
+	double freq = 0.55 + bench_rnd(20) / 100.0;
+	double cx = width / 3 + bench_rnd(width / 3 + 1);
+	double cy = height / 3 + bench_rnd(height / 3 + 1);
+	double wx = 0.01 + bench_rnd(30) / 1000.0;
+	double wy = 0.01 + bench_rnd(30) / 1000.0;
+	int x, y;
+
+	img->width = width;
+	img->height = height;
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < width; x++) {
+			double dx = x - cx;
+			double dy = y - cy;
+			double r = sqrt(dx * dx + dy * dy) + 8 * sin(x * wx) +
+				5 * cos(y * wy);
+			int v = 128 + 90 * sin(r * freq) + bench_rnd(40) - 20;
+
+			if (x < width / 12 || x >= width - width / 12 ||
+			    y < height / 24)
+				v = 255;
+			img->data[y * width + x] = CLAMP(v, 0, 255);
+		}
+	}
+	return img;
+}
+
+/* Skips whitespace and comments, then reads one header value */
+static int pgm_header_value(const gchar **p, const gchar *end)
+{
+	int v = 0;
+
+	while (*p < end) {
+		if (**p == '#') {
+			while (*p < end && **p != '\n')
+				(*p)++;
+		} else if (g_ascii_isspace(**p)) {
+			(*p)++;
+		} else {
+			break;
+		}
+	}
+	if (*p == end || !g_ascii_isdigit(**p))
+		return -1;
+	while (*p < end && g_ascii_isdigit(**p)) {
+		if (v > 65535)
+			return -1;
+		v = v * 10 + (**p - '0');
+		(*p)++;
+	}
+	return v;
+}
+
+static struct fp_img *load_pgm_file(const char *path, uint16_t flags)
+{
+	struct fp_img *img = NULL;
+	GError *err = NULL;
+	gchar *contents;
+	const gchar *p, *end;
+	gsize length;
+	int width, height, maxval;
+
+	if (!g_file_get_contents(path, &contents, &length, &err)) {
+		fprintf(stderr, "%s: %s\n", path, err->message);
+		g_error_free(err);
+		return NULL;
+	}
+
+	p = contents;
+	end = contents + length;
+	if (length < 2 || strncmp(p, "P5", 2) != 0) {
+		fprintf(stderr, "%s: not a binary PGM file\n", path);
+		goto out;
+	}
+	p += 2;
+	width = pgm_header_value(&p, end);
+	height = pgm_header_value(&p, end);
+	maxval = pgm_header_value(&p, end);
+	if (width <= 0 || height <= 0 || maxval != 255 || p == end ||
+	    !g_ascii_isspace(*p)) {
+		fprintf(stderr, "%s: unsupported PGM header\n", path);
+		goto out;
+	}
+	p++;
+	if ((gsize) (end - p) < (gsize) width * height) {
+		fprintf(stderr, "%s: truncated image\n", path);
+		goto out;
+	}
+
+	img = fpi_img_new(width * height);
+	img->width = width;
+	img->height = height;
+	img->flags |= flags;
+	memcpy(img->data, p, width * height);
+
+out:
+	g_free(contents);
+	return img;
+}
+
+static int cmp_path(gconstpointer a, gconstpointer b)
+{
+	return strcmp(*(const char * const *) a, *(const char * const *) b);
+}
+
+/* Lists path itself, or the files of a directory whose names end with
+ * suffix, in name order */
+GPtrArray *bench_list_files(const char *path, const char *suffix)
+{
+	GPtrArray *names = g_ptr_array_new_with_free_func(g_free);
+	GError *err = NULL;
+	const gchar *name;
+	GDir *dir;
+
+	if (!g_file_test(path, G_FILE_TEST_IS_DIR)) {
+		g_ptr_array_add(names, g_strdup(path));
+		return names;
+	}
+
+	dir = g_dir_open(path, 0, &err);
+	if (!dir) {
+		fprintf(stderr, "%s: %s\n", path, err->message);
+		g_error_free(err);
+		g_ptr_array_free(names, TRUE);
+		return NULL;
+	}
+	while ((name = g_dir_read_name(dir)) != NULL)
+		if (g_str_has_suffix(name, suffix))
+			g_ptr_array_add(names, g_build_filename(path, name, NULL));
+	g_dir_close(dir);
+	g_ptr_array_sort(names, cmp_path);
+	return names;
+}
+
+int bench_load_path(const char *path, GPtrArray *images, uint16_t flags)
+{
+	struct fp_img *img;
+	GPtrArray *names;
+	guint i;
+	int r = 0;
+
+	names = bench_list_files(path, ".pgm");
+	if (!names)
+		return -EIO;
+
+	for (i = 0; i < names->len && r == 0; i++) {
+		img = load_pgm_file(names->pdata[i], flags);
+		if (img)
+			g_ptr_array_add(images, img);
+		else
+			r = -EINVAL;
+	}
+	g_ptr_array_free(names, TRUE);
+	return r;
+}
+
+struct fp_img *bench_copy_image(struct fp_img *src)
+{
+	struct fp_img *img = fpi_img_new(src->length);
+
+	img->width = src->width;
+	img->height = src->height;
+	img->flags = src->flags;
+	memcpy(img->data, src->data, src->length);
+	return img;
+}
+
+/* Another capture of the same finger: shifted by a few pixels, with new
+ * noise */
+struct fp_img *bench_perturb_image(struct fp_img *src)
+{
+	struct fp_img *img = bench_copy_image(src);
+	int dx = bench_rnd(7) - 3;
+	int dy = bench_rnd(7) - 3;
+	int x, y;
+
+	for (y = 0; y < img->height; y++) {
+		for (x = 0; x < img->width; x++) {
+			int sx = x - dx;
+			int sy = y - dy;
+			int v = 255;
+
+			if (sx >= 0 && sx < src->width && sy >= 0 &&
+			    sy < src->height)
+				v = src->data[sy * src->width + sx] +
+					bench_rnd(30) - 15;
+			img->data[y * img->width + x] = CLAMP(v, 0, 255);
+		}
+	}
+	return img;
+}
@@ -0,0 +1,43 @@
+/*
+ * Helpers shared by the benchmarks
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __BENCH_COMMON_H__
+#define __BENCH_COMMON_H__
+
+#include <glib.h>
+
+#include "fp_internal.h"
+
+gint64 bench_now_ns(void);
+
+/* A small deterministic generator, so that runs with the same seed
+ * generate the same images */
+void bench_seed(guint32 seed);
+int bench_rnd(int n);
+
+struct fp_img *bench_make_synthetic(int width, int height);
+struct fp_img *bench_copy_image(struct fp_img *src);
+struct fp_img *bench_perturb_image(struct fp_img *src);
+
+GPtrArray *bench_list_files(const char *path, const char *suffix);
+
+/* Loads a PGM file (as written by fp_img_save_to_file()), or every .pgm
+ * file of a directory in name order, setting flags on every image */
+int bench_load_path(const char *path, GPtrArray *images, uint16_t flags);
+
+#endif
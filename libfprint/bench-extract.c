@@ -0,0 +1,514 @@
+/*
+ * Minutiae extraction benchmark
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Runs every image through standardization, minutiae detection and
+ * conversion to print data, and reports the throughput, the time spent in
+ * each extraction stage and the peak memory use. The images are either read
+ * from PGM files (as written by fp_img_save_to_file()), given one by one or
+ * as directories of them, or generated: noisy synthetic ridge patterns.
+ *
+ * With --devices, it instead simulates 1 to D devices verifying at the same
+ * time, each on its own thread as imaging devices process their images, and
+ * reports how the verifications per second scale with the device count.
+ *
+ * With --budgets, it compares prints kept to each given number of minutiae
+ * instead: every image is enrolled, and matched against a shifted, newly
+ * noised copy of itself and against every other image. The report gives the
+ * match time and the genuine and impostor match rates for each budget. */
+
+#include <config.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "fp_internal.h"
+#include "bench-common.h"
+#include "nbis/include/bozorth.h"
+
+/* the default Bozorth3 threshold of imaging devices */
+#define MATCH_THRESHOLD 40
+
+static const char *stage_names[FP_EXTRACT_NUM_STAGES] = {
+	"setup",
+	"initial_maps",
+	"interpolate",
+	"binarize",
+	"detect",
+	"remove",
+	"ridge_count",
+	"quality",
+	"xyt",
+};
+
+static gint nr_synthetic = 20;
+static gint synthetic_width = 256;
+static gint synthetic_height = 360;
+static gint nr_threads = 1;
+static gint nr_extract_threads = 1;
+static gint nr_rounds = 1;
+static gint seed = 1;
+static gboolean partial = FALSE;
+static gint nr_devices = 0;
+static gboolean pin_devices = FALSE;
+static gchar *budgets = NULL;
+
+static GOptionEntry entries[] = {
+	{ "synthetic", 'n', 0, G_OPTION_ARG_INT, &nr_synthetic,
+		"Number of synthetic images, if no PGM files are given", "N" },
+	{ "width", 'W', 0, G_OPTION_ARG_INT, &synthetic_width,
+		"Width of the synthetic images", "W" },
+	{ "height", 'H', 0, G_OPTION_ARG_INT, &synthetic_height,
+		"Height of the synthetic images", "H" },
+	{ "threads", 't', 0, G_OPTION_ARG_INT, &nr_threads,
+		"Worker threads, each extracting a different image", "T" },
+	{ "extract-threads", 'e', 0, G_OPTION_ARG_INT, &nr_extract_threads,
+		"Threads used within each extraction, 0 for one per CPU", "E" },
+	{ "rounds", 'r', 0, G_OPTION_ARG_INT, &nr_rounds,
+		"Number of times to repeat the whole run", "R" },
+	{ "seed", 's', 0, G_OPTION_ARG_INT, &seed,
+		"Seed for the synthetic images", "S" },
+	{ "partial", 'p', 0, G_OPTION_ARG_NONE, &partial,
+		"Treat the images as partial, like swipe sensors do", NULL },
+	{ "devices", 'd', 0, G_OPTION_ARG_INT, &nr_devices,
+		"Verify the images on 1 to D simulated devices at once", "D" },
+	{ "pin", 'P', 0, G_OPTION_ARG_NONE, &pin_devices,
+		"Pin the thread of each simulated device to its own CPU", NULL },
+	{ "budgets", 'b', 0, G_OPTION_ARG_STRING, &budgets,
+		"Compare the accuracy of comma-separated minutiae budgets",
+		"N,..." },
+	{ NULL }
+};
+
+struct bench {
+	struct fp_img **images;
+	gsize nr_images;
+	gint next_image;
+	GMutex lock;
+	guint64 minutiae;
+	guint64 failures;
+	guint64 xyt_usecs;
+};
+
+/* A simulated device verifies every image against the print enrolled from
+ * it, extraction included, as the processing worker of a device does */
+struct bench_device {
+	struct bench *b;
+	struct fp_print_data **enrolled;
+	int cpu;
+	guint64 verifications;
+	guint64 matches;
+};
+
+static struct fp_img_driver bench_driver = {
+	.driver = {
+		.id = 0xbe,
+		.name = "bench",
+		.full_name = "Simulated device",
+		.type = DRIVER_IMAGING,
+	},
+};
+
+static struct fp_dev bench_dev = {
+	.drv = &bench_driver.driver,
+};
+
+static struct fp_img_dev bench_imgdev = {
+	.dev = &bench_dev,
+};
+
+/* Extracts from a private copy of the image, so that every round starts
+ * from an image without minutiae. */
+static gpointer bench_worker(gpointer data)
+{
+	struct bench *b = data;
+	unsigned char xyt[sizeof(struct xyt_struct)];
+	guint64 minutiae = 0, failures = 0, xyt_usecs = 0;
+
+	while (TRUE) {
+		gint i = g_atomic_int_add(&b->next_image, 1);
+		struct fp_img *src, *img;
+		gint64 t0;
+		int r;
+
+		if (i >= (gint) b->nr_images)
+			break;
+		src = b->images[i];
+		img = fpi_img_new(src->length);
+		img->width = src->width;
+		img->height = src->height;
+		img->flags = src->flags;
+		memcpy(img->data, src->data, src->length);
+
+		fp_img_standardize(img);
+		r = fpi_img_detect_minutiae(img);
+		if (r < 0) {
+			failures++;
+		} else {
+			minutiae += r;
+			t0 = bench_now_ns();
+			fpi_img_minutiae_to_xyt(img->minutiae, img->width,
+				img->height, bench_driver.max_minutiae, xyt);
+			xyt_usecs += (bench_now_ns() - t0) / 1000;
+		}
+		fp_img_free(img);
+	}
+
+	g_mutex_lock(&b->lock);
+	b->minutiae += minutiae;
+	b->failures += failures;
+	b->xyt_usecs += xyt_usecs;
+	g_mutex_unlock(&b->lock);
+	return NULL;
+}
+
+static void bench_run(struct bench *b)
+{
+	GThread **threads = g_new0(GThread *, nr_threads);
+	int i;
+
+	b->next_image = 0;
+	for (i = 1; i < nr_threads; i++)
+		threads[i] = g_thread_new("bench-extract", bench_worker, b);
+	bench_worker(b);
+	for (i = 1; i < nr_threads; i++)
+		g_thread_join(threads[i]);
+	g_free(threads);
+}
+
+static gpointer bench_device_worker(gpointer data)
+{
+	struct bench_device *d = data;
+	struct bench *b = d->b;
+	gsize i;
+	int round;
+
+	if (d->cpu >= 0 && fpi_set_thread_cpu(d->cpu) < 0)
+		fprintf(stderr, "could not pin a device to CPU %d\n", d->cpu);
+
+	for (round = 0; round < nr_rounds; round++) {
+		for (i = 0; i < b->nr_images; i++) {
+			struct fp_img *img;
+			struct fp_print_data *print;
+			int r;
+
+			if (!d->enrolled[i])
+				continue;
+			img = bench_copy_image(b->images[i]);
+			fp_img_standardize(img);
+			r = fpi_img_to_print_data(&bench_imgdev, img, &print);
+			fp_img_free(img);
+			if (r < 0)
+				continue;
+			r = fpi_img_compare_print_data(d->enrolled[i], print,
+				MATCH_THRESHOLD);
+			if (r >= MATCH_THRESHOLD)
+				d->matches++;
+			d->verifications++;
+			fp_print_data_free(print);
+		}
+	}
+	return NULL;
+}
+
+static void bench_devices(struct bench *b)
+{
+	struct fp_print_data **enrolled = g_new0(struct fp_print_data *,
+		b->nr_images);
+	GThread **threads = g_new0(GThread *, nr_devices);
+	struct bench_device *devices = g_new0(struct bench_device,
+		nr_devices);
+	long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	double single = 0;
+	gsize i;
+	int k, j;
+
+	for (i = 0; i < b->nr_images; i++) {
+		struct fp_img *img = bench_copy_image(b->images[i]);
+
+		fp_img_standardize(img);
+		if (fpi_img_to_print_data(&bench_imgdev, img, &enrolled[i]) < 0)
+			enrolled[i] = NULL;
+		fp_img_free(img);
+	}
+
+	printf("%-8s %14s %12s %16s %8s\n", "devices", "verifications",
+		"seconds", "verifications/s", "scaling");
+	for (k = 1; k <= nr_devices; k++) {
+		guint64 verifications = 0, matches = 0;
+		gint64 t0 = bench_now_ns();
+		double seconds, rate;
+
+		for (j = 0; j < k; j++) {
+			devices[j].b = b;
+			devices[j].enrolled = enrolled;
+			devices[j].cpu = pin_devices && nr_cpus > 0 ?
+				j % nr_cpus : -1;
+			devices[j].verifications = 0;
+			devices[j].matches = 0;
+			threads[j] = g_thread_new("bench-device",
+				bench_device_worker, &devices[j]);
+		}
+		for (j = 0; j < k; j++) {
+			g_thread_join(threads[j]);
+			verifications += devices[j].verifications;
+			matches += devices[j].matches;
+		}
+
+		seconds = (bench_now_ns() - t0) / 1e9;
+		rate = verifications / seconds;
+		if (k == 1)
+			single = rate;
+		printf("%-8d %14" G_GUINT64_FORMAT " %12.3f %16.1f %7.2fx\n",
+			k, verifications, seconds, rate,
+			single > 0 ? rate / single : 0.0);
+		if (matches != verifications)
+			printf("  %" G_GUINT64_FORMAT " verification(s) did not "
+				"match\n", verifications - matches);
+	}
+
+	for (i = 0; i < b->nr_images; i++)
+		fp_print_data_free(enrolled[i]);
+	g_free(enrolled);
+	g_free(threads);
+	g_free(devices);
+}
+
+static struct fp_print_data **budget_prints(struct fp_img **images,
+	gsize nr_images, guint64 *minutiae)
+{
+	struct fp_print_data **prints = g_new0(struct fp_print_data *,
+		nr_images);
+	gsize i;
+
+	for (i = 0; i < nr_images; i++) {
+		if (fpi_img_to_print_data(&bench_imgdev, images[i],
+				&prints[i]) < 0) {
+			prints[i] = NULL;
+			continue;
+		}
+		*minutiae += ((struct xyt_struct *)
+			fpi_print_data_get_item(prints[i], 0)->data)->nrows;
+	}
+	return prints;
+}
+
+static void budget_prints_free(struct fp_print_data **prints, gsize n)
+{
+	gsize i;
+
+	for (i = 0; i < n; i++)
+		fp_print_data_free(prints[i]);
+	g_free(prints);
+}
+
+static int bench_budgets(struct bench *b)
+{
+	struct fp_img **enroll_imgs = g_new0(struct fp_img *, b->nr_images);
+	struct fp_img **probe_imgs = g_new0(struct fp_img *, b->nr_images);
+	gchar **tokens = g_strsplit(budgets, ",", -1);
+	gsize i, j;
+	int k, r = 0;
+
+	/* minutiae are detected once, fpi_img_to_print_data() reuses them
+	 * for every budget */
+	bench_seed(seed);
+	for (i = 0; i < b->nr_images; i++) {
+		enroll_imgs[i] = bench_copy_image(b->images[i]);
+		probe_imgs[i] = bench_perturb_image(b->images[i]);
+		fp_img_standardize(enroll_imgs[i]);
+		fp_img_standardize(probe_imgs[i]);
+		fpi_img_detect_minutiae(enroll_imgs[i]);
+		fpi_img_detect_minutiae(probe_imgs[i]);
+	}
+
+	printf("%-8s %12s %12s %12s %12s\n", "budget", "minutiae",
+		"us/match", "genuine %", "impostor %");
+	for (k = 0; tokens[k]; k++) {
+		struct fp_print_data **enrolled, **probes;
+		guint64 minutiae = 0, matches = 0, genuine = 0, genuine_ok = 0;
+		guint64 impostor = 0, impostor_ok = 0;
+		gchar *end;
+		gint64 t0, elapsed;
+		long budget = strtol(tokens[k], &end, 10);
+
+		if (end == tokens[k] || *end != '\0' || budget < 1) {
+			fprintf(stderr, "invalid budget '%s'\n", tokens[k]);
+			r = -EINVAL;
+			break;
+		}
+		bench_driver.max_minutiae = budget;
+		enrolled = budget_prints(enroll_imgs, b->nr_images, &minutiae);
+		probes = budget_prints(probe_imgs, b->nr_images, &minutiae);
+
+		t0 = bench_now_ns();
+		for (i = 0; i < b->nr_images; i++) {
+			for (j = 0; j < b->nr_images; j++) {
+				gboolean match;
+
+				if (!enrolled[i] || !probes[j])
+					continue;
+				match = fpi_img_compare_print_data(enrolled[i],
+					probes[j], MATCH_THRESHOLD) >=
+					MATCH_THRESHOLD;
+				matches++;
+				if (i == j) {
+					genuine++;
+					genuine_ok += match;
+				} else {
+					impostor++;
+					impostor_ok += match;
+				}
+			}
+		}
+		elapsed = bench_now_ns() - t0;
+
+		printf("%-8ld %12.1f %12.2f %12.2f %12.3f\n", budget,
+			(double) minutiae / (2 * b->nr_images),
+			matches ? elapsed / 1e3 / matches : 0.0,
+			genuine ? 100.0 * genuine_ok / genuine : 0.0,
+			impostor ? 100.0 * impostor_ok / impostor : 0.0);
+		budget_prints_free(enrolled, b->nr_images);
+		budget_prints_free(probes, b->nr_images);
+	}
+	bench_driver.max_minutiae = 0;
+
+	for (i = 0; i < b->nr_images; i++) {
+		fp_img_free(enroll_imgs[i]);
+		fp_img_free(probe_imgs[i]);
+	}
+	g_free(enroll_imgs);
+	g_free(probe_imgs);
+	g_strfreev(tokens);
+	return r;
+}
+
+static void bench_report(struct bench *b, gint64 elapsed_ns)
+{
+	struct fp_extract_stats stats;
+	struct rusage usage;
+	guint64 images;
+	int s;
+
+	fp_get_extract_stats(&stats);
+	stats.usecs[FP_EXTRACT_STAGE_XYT] = b->xyt_usecs;
+	images = (guint64) b->nr_images * nr_rounds;
+
+	printf("%" G_GUINT64_FORMAT " images in %.3f s on %d thread(s): "
+		"%.1f images/s, %.1f minutiae/image, %" G_GUINT64_FORMAT
+		" failed\n", images, elapsed_ns / 1e9, nr_threads,
+		images / (elapsed_ns / 1e9),
+		stats.images ? (double) b->minutiae / stats.images : 0.0,
+		b->failures);
+	printf("%-14s %12s %12s\n", "stage", "total ms", "ms/image");
+	for (s = 0; s < FP_EXTRACT_NUM_STAGES; s++)
+		printf("%-14s %12.2f %12.3f\n", stage_names[s],
+			stats.usecs[s] / 1e3,
+			stats.images ? stats.usecs[s] / 1e3 / stats.images : 0.0);
+
+	if (getrusage(RUSAGE_SELF, &usage) == 0)
+		printf("peak RSS %ld KiB\n", usage.ru_maxrss);
+}
+
+int main(int argc, char **argv)
+{
+	GOptionContext *context;
+	GError *err = NULL;
+	GPtrArray *images;
+	struct bench b;
+	gint64 t0, elapsed;
+	int i, r = 0;
+
+	context = g_option_context_new("[PGM-FILE|DIRECTORY...]");
+	g_option_context_set_summary(context,
+		"Times the stages of fingerprint minutiae extraction.");
+	g_option_context_add_main_entries(context, entries, NULL);
+	if (!g_option_context_parse(context, &argc, &argv, &err)) {
+		fprintf(stderr, "%s\n", err->message);
+		g_error_free(err);
+		return 1;
+	}
+	g_option_context_free(context);
+
+	if (nr_threads < 1 || nr_extract_threads < 0 || nr_rounds < 1 ||
+	    nr_devices < 0 ||
+	    nr_synthetic < 1 || synthetic_width < 64 || synthetic_height < 64 ||
+	    synthetic_width > 4096 || synthetic_height > 4096) {
+		fprintf(stderr, "invalid arguments\n");
+		return 1;
+	}
+	fp_set_extract_threads(nr_extract_threads);
+
+	memset(&b, 0, sizeof(b));
+	g_mutex_init(&b.lock);
+	images = g_ptr_array_new_with_free_func((GDestroyNotify) fp_img_free);
+
+	if (argc > 1) {
+		for (i = 1; i < argc; i++) {
+			r = bench_load_path(argv[i], images,
+				partial ? FP_IMG_PARTIAL : 0);
+			if (r < 0)
+				goto out;
+		}
+	} else {
+		bench_seed(seed);
+		for (i = 0; i < nr_synthetic; i++) {
+			struct fp_img *img = bench_make_synthetic(
+				synthetic_width, synthetic_height);
+
+			if (partial)
+				img->flags |= FP_IMG_PARTIAL;
+			g_ptr_array_add(images, img);
+		}
+	}
+
+	if (images->len == 0) {
+		fprintf(stderr, "no images to extract\n");
+		r = -EINVAL;
+		goto out;
+	}
+	b.images = (struct fp_img **) images->pdata;
+	b.nr_images = images->len;
+
+	if (nr_devices) {
+		bench_devices(&b);
+		goto out;
+	}
+	if (budgets) {
+		r = bench_budgets(&b);
+		goto out;
+	}
+
+	fp_reset_extract_stats();
+	t0 = bench_now_ns();
+	for (i = 0; i < nr_rounds; i++)
+		bench_run(&b);
+	elapsed = bench_now_ns() - t0;
+	bench_report(&b, elapsed);
+
+out:
+	g_ptr_array_free(images, TRUE);
+	g_mutex_clear(&b.lock);
+	fpi_img_exit();
+	g_free(budgets);
+	return r < 0 ? 1 : 0;
+}
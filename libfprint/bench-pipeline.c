@@ -0,0 +1,831 @@
+/*
+ * End-to-end image pipeline benchmark
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Runs recorded captures through what an imaging device does with a
+ * captured image, offline: assembling the image for swipe sensors, then the
+ * steps of the processing job of imgdev.c (sanitizing, standardizing, the
+ * quality check and print extraction), verification against a print
+ * enrolled from the first captures, and identification against galleries
+ * of growing size. Timings, latency percentiles and allocation counts are
+ * written as JSON, so that runs can be compared between releases.
+ *
+ * Captures come in three families, each from files or directories of them:
+ *  - area sensors: PGM images, as written by fp_img_save_to_file()
+ *  - AES strips (.strips): a "FPS1 <width> <height>\n" header followed by
+ *    the frames of one swipe, 4 bits per pixel as AES sensors send them
+ *  - line sensors (.lines): a "FPL1 <width> <resolution>\n" header followed
+ *    by the 8-bit lines of one swipe
+ * Every file of a family is taken as a capture of the same finger. Without
+ * any, each family is generated from perturbed copies of a synthetic
+ * finger. Galleries are filled with prints of randomly placed minutiae
+ * around the enrolled print. */
+
+#include <config.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "fp_internal.h"
+#include "assembling.h"
+#include "bench-common.h"
+#include "nbis/include/bozorth.h"
+
+/* the defaults of imgdev.c */
+#define MATCH_THRESHOLD		40
+#define QUALITY_THRESHOLD	5
+#define MIN_MINUTIAE		10
+
+#define SYNTHETIC_WIDTH		192
+#define SYNTHETIC_HEIGHT	288
+#define STRIP_HEIGHT		16
+#define LINE_MAX_HEIGHT		1024
+
+static gint nr_captures = 25;
+static gint nr_enroll = 5;
+static gint nr_identify = 5;
+static gint seed = 1;
+static gchar *gallery_sizes = NULL;
+static gchar **area_paths = NULL;
+static gchar **strip_paths = NULL;
+static gchar **line_paths = NULL;
+static gchar *output_path = NULL;
+
+static GOptionEntry entries[] = {
+	{ "area", 'a', 0, G_OPTION_ARG_FILENAME_ARRAY, &area_paths,
+		"PGM captures of an area sensor, or directories of them",
+		"PATH" },
+	{ "strips", 's', 0, G_OPTION_ARG_FILENAME_ARRAY, &strip_paths,
+		"AES strip recordings, or directories of them", "PATH" },
+	{ "lines", 'l', 0, G_OPTION_ARG_FILENAME_ARRAY, &line_paths,
+		"Line sensor recordings, or directories of them", "PATH" },
+	{ "captures", 'n', 0, G_OPTION_ARG_INT, &nr_captures,
+		"Number of synthetic captures per family", "N" },
+	{ "enroll", 'e', 0, G_OPTION_ARG_INT, &nr_enroll,
+		"Number of captures enrolled, the others are verified", "N" },
+	{ "identify", 'i', 0, G_OPTION_ARG_INT, &nr_identify,
+		"Number of captures identified against each gallery", "N" },
+	{ "galleries", 'g', 0, G_OPTION_ARG_STRING, &gallery_sizes,
+		"Comma-separated gallery sizes (default 100,1000,10000)",
+		"N,..." },
+	{ "seed", 'S', 0, G_OPTION_ARG_INT, &seed,
+		"Seed for the synthetic captures and galleries", "S" },
+	{ "output", 'o', 0, G_OPTION_ARG_FILENAME, &output_path,
+		"Write the JSON report to a file rather than stdout", "FILE" },
+	{ NULL }
+};
+
+#if defined(ENABLE_ALLOC_STATS) && defined(__GLIBC__)
+/* libfprint already wraps the allocator, and counts what it allocates */
+static void get_allocs(guint64 *count, guint64 *bytes)
+{
+	struct fp_alloc_stats stats;
+	int i;
+
+	fp_get_alloc_stats(&stats);
+	*count = 0;
+	*bytes = 0;
+	for (i = 0; i < FP_ALLOC_NUM_SUBSYSTEMS; i++) {
+		*count += stats.allocs[i];
+		*bytes += stats.bytes[i];
+	}
+}
+#elif defined(__GLIBC__)
+/* Every allocation of the process, glib's included, goes through these
+ * wrappers of the C library allocator. */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static guint64 nr_allocs;
+static guint64 alloc_bytes;
+
+static void count_alloc(size_t size)
+{
+	__atomic_add_fetch(&nr_allocs, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&alloc_bytes, size, __ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size)
+{
+	count_alloc(size);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	count_alloc(nmemb * size);
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	count_alloc(size);
+	return __libc_realloc(ptr, size);
+}
+
+static void get_allocs(guint64 *count, guint64 *bytes)
+{
+	*count = __atomic_load_n(&nr_allocs, __ATOMIC_RELAXED);
+	*bytes = __atomic_load_n(&alloc_bytes, __ATOMIC_RELAXED);
+}
+#else
+static void get_allocs(guint64 *count, guint64 *bytes)
+{
+	*count = 0;
+	*bytes = 0;
+}
+#endif
+
+static struct fp_img_driver bench_driver = {
+	.driver = {
+		.id = 0xbe,
+		.name = "bench",
+		.full_name = "Simulated device",
+		.type = DRIVER_IMAGING,
+	},
+};
+
+static struct fp_dev bench_dev = {
+	.drv = &bench_driver.driver,
+};
+
+static struct fp_img_dev bench_imgdev = {
+	.dev = &bench_dev,
+};
+
+enum family {
+	FAMILY_AREA,
+	FAMILY_STRIPS,
+	FAMILY_LINES,
+	NR_FAMILIES,
+};
+
+static const char *family_names[NR_FAMILIES] = {
+	"area",
+	"strips",
+	"lines",
+};
+
+/* One swipe or press, as the driver receives it */
+struct capture {
+	struct fp_img *img;
+	struct fpi_frame_asmbl_ctx frame_ctx;
+	GSList *frames;
+	size_t nr_frames;
+	struct fpi_line_asmbl_ctx line_ctx;
+	struct fpi_line_store *lines;
+};
+
+static void capture_free(struct capture *c)
+{
+	fp_img_free(c->img);
+	g_slist_free_full(c->frames, g_free);
+	fpi_line_store_free(c->lines);
+	g_free(c);
+}
+
+/* Timings and allocations of one step, over every time it ran */
+struct stage {
+	const char *name;
+	GArray *nsecs;
+	guint64 allocs;
+	guint64 bytes;
+	guint64 failures;
+	/* of the current run, see stage_begin() */
+	gint64 t0;
+	guint64 allocs0;
+	guint64 bytes0;
+};
+
+static void stage_init(struct stage *s, const char *name)
+{
+	memset(s, 0, sizeof(*s));
+	s->name = name;
+	s->nsecs = g_array_new(FALSE, FALSE, sizeof(gint64));
+}
+
+static void stage_begin(struct stage *s)
+{
+	get_allocs(&s->allocs0, &s->bytes0);
+	s->t0 = bench_now_ns();
+}
+
+static void stage_end(struct stage *s, gboolean ok)
+{
+	gint64 elapsed = bench_now_ns() - s->t0;
+	guint64 allocs, bytes;
+
+	get_allocs(&allocs, &bytes);
+	g_array_append_val(s->nsecs, elapsed);
+	s->allocs += allocs - s->allocs0;
+	s->bytes += bytes - s->bytes0;
+	if (!ok)
+		s->failures++;
+}
+
+static int cmp_nsecs(gconstpointer a, gconstpointer b)
+{
+	gint64 x = *(const gint64 *) a;
+	gint64 y = *(const gint64 *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile_usecs(GArray *sorted, int pct)
+{
+	guint i;
+
+	if (sorted->len == 0)
+		return 0;
+	i = MIN((sorted->len * pct + 99) / 100, sorted->len) - 1;
+	return g_array_index(sorted, gint64, i) / 1e3;
+}
+
+static void stage_report(struct stage *s, GString *json, gboolean last)
+{
+	guint64 total = 0;
+	guint n = s->nsecs->len;
+	guint i;
+
+	g_array_sort(s->nsecs, cmp_nsecs);
+	for (i = 0; i < n; i++)
+		total += g_array_index(s->nsecs, gint64, i);
+
+	g_string_append_printf(json,
+		"        \"%s\": { \"count\": %u, \"failures\": %"
+		G_GUINT64_FORMAT ", \"per_second\": %.2f, "
+		"\"p50_us\": %.1f, \"p90_us\": %.1f, \"p99_us\": %.1f, "
+		"\"max_us\": %.1f, \"allocs_per_op\": %.1f, "
+		"\"bytes_per_op\": %.0f }%s\n",
+		s->name, n, s->failures, total ? n / (total / 1e9) : 0.0,
+		percentile_usecs(s->nsecs, 50), percentile_usecs(s->nsecs, 90),
+		percentile_usecs(s->nsecs, 99), percentile_usecs(s->nsecs, 100),
+		n ? (double) s->allocs / n : 0.0,
+		n ? (double) s->bytes / n : 0.0, last ? "" : ",");
+	g_array_free(s->nsecs, TRUE);
+}
+
+static unsigned char strip_get_pixel(struct fpi_frame_asmbl_ctx *ctx,
+	struct fpi_frame *frame, unsigned x, unsigned y)
+{
+	unsigned char v = frame->data[x * (ctx->frame_height >> 1) + (y >> 1)];
+
+	return (y % 2 ? v >> 4 : v & 0xf) * 17;
+}
+
+static int line_get_deviation(struct fpi_line_asmbl_ctx *ctx,
+	struct fpi_line_store *lines, size_t line1, size_t line2)
+{
+	return fpi_mean_sq_diff_norm(fpi_line_store_get(lines, line1),
+		fpi_line_store_get(lines, line2), ctx->line_width);
+}
+
+static unsigned char line_get_pixel(struct fpi_line_asmbl_ctx *ctx,
+	struct fpi_line_store *lines, size_t line, unsigned x)
+{
+	return fpi_line_store_get(lines, line)[x];
+}
+
+static struct capture *capture_new_strips(unsigned width, unsigned height)
+{
+	struct capture *c = g_malloc0(sizeof(*c));
+
+	c->frame_ctx.frame_width = width;
+	c->frame_ctx.frame_height = height;
+	c->frame_ctx.image_width = width + width / 2;
+	c->frame_ctx.search = FPI_FRAME_SEARCH_COARSE_TO_FINE;
+	c->frame_ctx.layout = FPI_FRAME_LAYOUT_AES4;
+	c->frame_ctx.get_pixel = strip_get_pixel;
+	return c;
+}
+
+static struct capture *capture_new_lines(unsigned width, unsigned resolution,
+	size_t max_lines)
+{
+	struct capture *c = g_malloc0(sizeof(*c));
+
+	c->line_ctx.line_width = width;
+	c->line_ctx.max_height = LINE_MAX_HEIGHT;
+	c->line_ctx.resolution = resolution;
+	c->line_ctx.median_filter_size = 25;
+	c->line_ctx.max_search_offset = 30;
+	c->line_ctx.get_deviation = line_get_deviation;
+	c->line_ctx.get_pixel = line_get_pixel;
+	c->lines = fpi_line_store_new(width, max_lines);
+	return c;
+}
+
+/* Cuts a swipe over an image into overlapping 4-bit frames, a few rows
+ * apart */
+static struct capture *strips_from_image(struct fp_img *img)
+{
+	struct capture *c = capture_new_strips(img->width, STRIP_HEIGHT);
+	size_t frame_size = img->width * STRIP_HEIGHT / 2;
+	int top, x, y;
+
+	for (top = 0; top + STRIP_HEIGHT <= img->height;
+	     top += 3 + bench_rnd(4)) {
+		struct fpi_frame *frame = g_malloc0(sizeof(*frame) +
+			frame_size);
+
+		for (x = 0; x < img->width; x++)
+			for (y = 0; y < STRIP_HEIGHT; y++) {
+				unsigned char v = img->data[(top + y) *
+					img->width + x] / 17;
+
+				frame->data[x * (STRIP_HEIGHT / 2) + y / 2] |=
+					y % 2 ? v << 4 : v;
+			}
+		c->frames = g_slist_prepend(c->frames, frame);
+		c->nr_frames++;
+	}
+	c->frames = g_slist_reverse(c->frames);
+	return c;
+}
+
+/* Swipes over an image line after line */
+static struct capture *lines_from_image(struct fp_img *img)
+{
+	struct capture *c = capture_new_lines(img->width, 1, img->height);
+	int y;
+
+	for (y = 0; y < img->height; y++)
+		fpi_line_store_append(c->lines, img->data + y * img->width);
+	return c;
+}
+
+static gboolean read_header(const gchar **p, const gchar *end,
+	const char *magic, int nr_values, int *values)
+{
+	gchar *next;
+	int i;
+
+	if ((gsize) (end - *p) < strlen(magic) ||
+	    strncmp(*p, magic, strlen(magic)) != 0)
+		return FALSE;
+	*p += strlen(magic);
+	for (i = 0; i < nr_values; i++) {
+		long v = strtol(*p, &next, 10);
+
+		if (next == *p || v <= 0 || v > 4096)
+			return FALSE;
+		values[i] = v;
+		*p = next;
+	}
+	if (*p == end || **p != '\n')
+		return FALSE;
+	(*p)++;
+	return TRUE;
+}
+
+static struct capture *load_recording(const char *path, enum family family)
+{
+	struct capture *c = NULL;
+	GError *err = NULL;
+	gchar *contents;
+	const gchar *p, *end;
+	gsize length;
+	int values[2];
+
+	if (!g_file_get_contents(path, &contents, &length, &err)) {
+		fprintf(stderr, "%s: %s\n", path, err->message);
+		g_error_free(err);
+		return NULL;
+	}
+	p = contents;
+	end = contents + length;
+
+	if (family == FAMILY_STRIPS) {
+		size_t frame_size;
+
+		if (!read_header(&p, end, "FPS1", 2, values) || values[1] % 2)
+			goto bad;
+		c = capture_new_strips(values[0], values[1]);
+		frame_size = values[0] * values[1] / 2;
+		for (; (gsize) (end - p) >= frame_size; p += frame_size) {
+			struct fpi_frame *frame = g_malloc0(sizeof(*frame) +
+				frame_size);
+
+			memcpy(frame->data, p, frame_size);
+			c->frames = g_slist_prepend(c->frames, frame);
+			c->nr_frames++;
+		}
+		c->frames = g_slist_reverse(c->frames);
+		if (c->nr_frames == 0)
+			goto bad;
+	} else {
+		if (!read_header(&p, end, "FPL1", 2, values))
+			goto bad;
+		c = capture_new_lines(values[0], values[1],
+			(end - p) / values[0]);
+		for (; end - p >= values[0]; p += values[0])
+			fpi_line_store_append(c->lines,
+				(const unsigned char *) p);
+		if (c->lines->num_lines < 2)
+			goto bad;
+	}
+	g_free(contents);
+	return c;
+
+bad:
+	fprintf(stderr, "%s: not a %s recording\n", path,
+		family_names[family]);
+	if (c)
+		capture_free(c);
+	g_free(contents);
+	return NULL;
+}
+
+static int load_family(enum family family, gchar **paths,
+	GPtrArray *captures)
+{
+	static const char *suffixes[NR_FAMILIES] = {
+		".pgm", ".strips", ".lines",
+	};
+	int i;
+	guint j;
+
+	for (i = 0; paths[i]; i++) {
+		GPtrArray *names;
+		int r = 0;
+
+		if (family == FAMILY_AREA) {
+			GPtrArray *images = g_ptr_array_new();
+
+			r = bench_load_path(paths[i], images, 0);
+			for (j = 0; j < images->len; j++) {
+				struct capture *c = g_malloc0(sizeof(*c));
+
+				c->img = images->pdata[j];
+				g_ptr_array_add(captures, c);
+			}
+			g_ptr_array_free(images, TRUE);
+			if (r < 0)
+				return r;
+			continue;
+		}
+
+		names = bench_list_files(paths[i], suffixes[family]);
+		if (!names)
+			return -EIO;
+		for (j = 0; j < names->len && r == 0; j++) {
+			struct capture *c = load_recording(names->pdata[j],
+				family);
+
+			if (c)
+				g_ptr_array_add(captures, c);
+			else
+				r = -EINVAL;
+		}
+		g_ptr_array_free(names, TRUE);
+		if (r < 0)
+			return r;
+	}
+	return 0;
+}
+
+static void synthesize_family(enum family family, GPtrArray *captures)
+{
+	struct fp_img *finger = bench_make_synthetic(SYNTHETIC_WIDTH,
+		SYNTHETIC_HEIGHT);
+	int i;
+
+	for (i = 0; i < nr_captures; i++) {
+		struct fp_img *img = bench_perturb_image(finger);
+		struct capture *c;
+
+		switch (family) {
+		case FAMILY_STRIPS:
+			c = strips_from_image(img);
+			fp_img_free(img);
+			break;
+		case FAMILY_LINES:
+			c = lines_from_image(img);
+			fp_img_free(img);
+			break;
+		default:
+			c = g_malloc0(sizeof(*c));
+			c->img = img;
+			break;
+		}
+		g_ptr_array_add(captures, c);
+	}
+	fp_img_free(finger);
+}
+
+/* What the driver hands to fpi_imgdev_image_captured() */
+static struct fp_img *capture_assemble(struct capture *c)
+{
+	if (c->img)
+		return bench_copy_image(c->img);
+	if (c->frames) {
+		fpi_do_movement_estimation(&c->frame_ctx, c->frames,
+			c->nr_frames);
+		return fpi_assemble_frames(&c->frame_ctx, c->frames,
+			c->nr_frames);
+	}
+	return fpi_assemble_lines(&c->line_ctx, c->lines);
+}
+
+/* The processing job of imgdev.c, up to the print: returns NULL where it
+ * would have asked for a retry */
+static struct fp_print_data *capture_extract(struct fp_img *img)
+{
+	struct fp_print_data *print;
+
+	if (!fpi_img_is_sane(img))
+		return NULL;
+	fp_img_standardize(img);
+	if (fpi_img_quality(img) < QUALITY_THRESHOLD)
+		return NULL;
+	if (fpi_img_to_print_data(&bench_imgdev, img, &print) < 0)
+		return NULL;
+	if (img->minutiae->num < MIN_MINUTIAE) {
+		fp_print_data_free(print);
+		return NULL;
+	}
+	return print;
+}
+
+/* A print of the same size as a sample of template, with its minutiae
+ * scattered at random */
+static struct fp_print_data *make_filler_print(struct fp_print_data *template)
+{
+	struct fp_print_data *print = fpi_print_data_new(&bench_dev);
+	unsigned int n;
+
+	print->type = PRINT_DATA_NBIS_MINUTIAE;
+	for (n = 0; n < template->nr_items; n++) {
+		struct xyt_struct *src = (struct xyt_struct *)
+			fpi_print_data_get_item(template, n)->data;
+		struct xyt_struct *xyt = (struct xyt_struct *)
+			fpi_print_data_add_item(print, sizeof(*xyt))->data;
+		int i, j;
+
+		xyt->nrows = src->nrows;
+		for (i = 0; i < xyt->nrows; i++) {
+			int x = bench_rnd(SYNTHETIC_WIDTH);
+			int y = bench_rnd(SYNTHETIC_HEIGHT);
+			int t = bench_rnd(360) - 179;
+
+			/* kept sorted by x, then y, as the matcher expects */
+			for (j = i; j > 0 && (xyt->xcol[j - 1] > x ||
+			     (xyt->xcol[j - 1] == x && xyt->ycol[j - 1] > y));
+			     j--) {
+				xyt->xcol[j] = xyt->xcol[j - 1];
+				xyt->ycol[j] = xyt->ycol[j - 1];
+				xyt->thetacol[j] = xyt->thetacol[j - 1];
+			}
+			xyt->xcol[j] = x;
+			xyt->ycol[j] = y;
+			xyt->thetacol[j] = t;
+		}
+	}
+	return print;
+}
+
+static void bench_identify(struct fp_print_data *enrolled,
+	struct fp_print_data **probes, int nr_probes, int size,
+	GString *json)
+{
+	struct fp_print_data **gallery = g_new0(struct fp_print_data *,
+		size + 1);
+	struct stage stage;
+	gchar *name = g_strdup_printf("identify_%d", size);
+	int i;
+
+	/* the genuine print halfway through, as identification stops at
+	 * the first match */
+	for (i = 0; i < size; i++)
+		gallery[i] = i == size / 2 ? enrolled :
+			make_filler_print(enrolled);
+	for (i = 0; i < size; i++)
+		fpi_img_prepare_print_data(gallery[i]);
+
+	stage_init(&stage, name);
+	for (i = 0; i < nr_probes; i++) {
+		size_t offset;
+		int r;
+
+		stage_begin(&stage);
+		r = fpi_img_compare_print_data_to_gallery(probes[i], gallery,
+			MATCH_THRESHOLD, &offset, NULL);
+		stage_end(&stage, r == FP_VERIFY_MATCH &&
+			offset == (size_t) size / 2);
+	}
+	stage_report(&stage, json, FALSE);
+
+	for (i = 0; i < size; i++)
+		if (i != size / 2)
+			fp_print_data_free(gallery[i]);
+	g_free(gallery);
+	g_free(name);
+}
+
+static void bench_family(enum family family, GPtrArray *captures,
+	int *sizes, GString *json, gboolean last)
+{
+	struct fp_print_data *enrolled = fpi_print_data_new(&bench_dev);
+	struct fp_print_data **probes = g_new0(struct fp_print_data *,
+		captures->len);
+	struct stage assemble, extract, verify, total;
+	int nr_probes = 0;
+	guint i;
+	int k;
+
+	stage_init(&assemble, "assemble");
+	stage_init(&extract, "extract");
+	stage_init(&verify, "verify");
+	stage_init(&total, "capture_to_verdict");
+	enrolled->type = PRINT_DATA_NBIS_MINUTIAE;
+
+	for (i = 0; i < captures->len; i++) {
+		struct capture *c = captures->pdata[i];
+		gboolean enrolling = enrolled->nr_items < (unsigned) nr_enroll;
+		struct fp_print_data *print;
+		struct fp_img *img;
+
+		stage_begin(&total);
+		stage_begin(&assemble);
+		img = capture_assemble(c);
+		stage_end(&assemble, img != NULL);
+		if (!img)
+			continue;
+
+		stage_begin(&extract);
+		print = capture_extract(img);
+		stage_end(&extract, print != NULL);
+		fp_img_free(img);
+		if (!print)
+			continue;
+
+		if (enrolling) {
+			struct fp_print_data_item *sample =
+				fpi_print_data_get_item(print, 0);
+
+			memcpy(fpi_print_data_add_item(enrolled,
+				sample->length)->data, sample->data,
+				sample->length);
+			fp_print_data_free(print);
+			continue;
+		}
+
+		stage_begin(&verify);
+		k = fpi_img_compare_print_data(enrolled, print,
+			MATCH_THRESHOLD);
+		stage_end(&verify, k >= MATCH_THRESHOLD);
+		stage_end(&total, k >= MATCH_THRESHOLD);
+		probes[nr_probes++] = print;
+	}
+
+	g_string_append_printf(json, "    \"%s\": {\n"
+		"      \"captures\": %u,\n      \"enrolled_samples\": %u,\n"
+		"      \"stages\": {\n", family_names[family], captures->len,
+		enrolled->nr_items);
+	if (family != FAMILY_AREA)
+		stage_report(&assemble, json, FALSE);
+	else
+		g_array_free(assemble.nsecs, TRUE);
+	stage_report(&extract, json, FALSE);
+	if (enrolled->nr_items > 0 && nr_probes > 0) {
+		for (k = 0; sizes[k]; k++)
+			bench_identify(enrolled, probes,
+				MIN(nr_probes, nr_identify), sizes[k], json);
+	}
+	stage_report(&verify, json, FALSE);
+	stage_report(&total, json, TRUE);
+	g_string_append_printf(json, "      }\n    }%s\n", last ? "" : ",");
+
+	for (k = 0; k < nr_probes; k++)
+		fp_print_data_free(probes[k]);
+	g_free(probes);
+	fp_print_data_free(enrolled);
+}
+
+static int *parse_sizes(const char *list)
+{
+	gchar **tokens = g_strsplit(list, ",", -1);
+	int *sizes = g_new0(int, g_strv_length(tokens) + 1);
+	int i;
+
+	for (i = 0; tokens[i]; i++) {
+		gchar *end;
+		long v = strtol(tokens[i], &end, 10);
+
+		if (end == tokens[i] || *end != '\0' || v < 1 || v > 1000000) {
+			fprintf(stderr, "invalid gallery size '%s'\n",
+				tokens[i]);
+			g_free(sizes);
+			sizes = NULL;
+			break;
+		}
+		sizes[i] = v;
+	}
+	g_strfreev(tokens);
+	return sizes;
+}
+
+int main(int argc, char **argv)
+{
+	GOptionContext *context;
+	GError *err = NULL;
+	GPtrArray *captures[NR_FAMILIES];
+	gchar **paths[NR_FAMILIES];
+	gboolean recorded;
+	GString *json;
+	int *sizes;
+	int f, r = 0;
+
+	context = g_option_context_new(NULL);
+	g_option_context_set_summary(context,
+		"Times the image pipeline from capture to verification and "
+		"identification.");
+	g_option_context_add_main_entries(context, entries, NULL);
+	if (!g_option_context_parse(context, &argc, &argv, &err)) {
+		fprintf(stderr, "%s\n", err->message);
+		g_error_free(err);
+		return 1;
+	}
+	g_option_context_free(context);
+
+	sizes = parse_sizes(gallery_sizes ? gallery_sizes : "100,1000,10000");
+	if (!sizes || nr_captures < 1 || nr_enroll < 1 || nr_identify < 0) {
+		fprintf(stderr, "invalid arguments\n");
+		return 1;
+	}
+
+	paths[FAMILY_AREA] = area_paths;
+	paths[FAMILY_STRIPS] = strip_paths;
+	paths[FAMILY_LINES] = line_paths;
+	recorded = area_paths || strip_paths || line_paths;
+	bench_seed(seed);
+	for (f = 0; f < NR_FAMILIES; f++) {
+		captures[f] = g_ptr_array_new_with_free_func(
+			(GDestroyNotify) capture_free);
+		if (paths[f])
+			r = load_family(f, paths[f], captures[f]);
+		else if (!recorded)
+			synthesize_family(f, captures[f]);
+		if (r < 0)
+			goto out;
+	}
+
+	json = g_string_new("{\n  \"benchmark\": \"pipeline\",\n");
+	g_string_append_printf(json, "  \"version\": \"%s\",\n"
+		"  \"allocations_counted\": %s,\n  \"families\": {\n",
+		LIBFPRINT_VERSION,
+#ifdef __GLIBC__
+		"true"
+#else
+		"false"
+#endif
+		);
+	for (f = 0; f < NR_FAMILIES; f++) {
+		int next;
+
+		if (captures[f]->len == 0)
+			continue;
+		for (next = f + 1; next < NR_FAMILIES; next++)
+			if (captures[next]->len > 0)
+				break;
+		bench_family(f, captures[f], sizes, json, next == NR_FAMILIES);
+	}
+	g_string_append(json, "  }\n}\n");
+
+	if (output_path) {
+		if (!g_file_set_contents(output_path, json->str, json->len,
+				&err)) {
+			fprintf(stderr, "%s: %s\n", output_path, err->message);
+			g_error_free(err);
+			r = -EIO;
+		}
+	} else {
+		fputs(json->str, stdout);
+	}
+	g_string_free(json, TRUE);
+
+out:
+	for (f = 0; f < NR_FAMILIES; f++)
+		g_ptr_array_free(captures[f], TRUE);
+	g_free(sizes);
+	fpi_img_exit();
+	return r < 0 ? 1 : 0;
+}
@@ -0,0 +1,341 @@
+/*
+ * Recording of the images scanned by a device
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* The images an imaging device scans can be written to a directory, see
+ * fp_dev_set_capture_dump(), to look into the false rejects of units in
+ * the field. The event loop only copies each image and queues it. A single
+ * writer thread, shared by all the devices, compresses the queued images
+ * to PNG and writes them, taking every image queued in the meantime at
+ * once.
+ *
+ * Images are dropped rather than delaying the device: once the files of a
+ * directory add up to its quota, and while the writer is behind by
+ * CAPTURE_DUMP_MAX_QUEUED images. Files already in the directory count
+ * towards the quota, and are never removed. */
+
+#define FP_COMPONENT "capturedump"
+
+#include <config.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <zlib.h>
+
+#include "fp_internal.h"
+
+/* Images waiting for the writer, from all devices, before new ones are
+ * dropped */
+#define CAPTURE_DUMP_MAX_QUEUED 16
+
+/* The recording of a device. The device holds a reference and so does
+ * every queued image, as they can outlive the device. */
+struct fpi_capture_dump {
+	gint refcount;
+	char *dir;
+	char *prefix;
+	guint64 quota;
+	/* bytes in the directory, and whether it was reported full, only
+	 * used by the writer once the recording is set up */
+	guint64 used;
+	gboolean full;
+	/* numbers the images of the device, on the event loop */
+	unsigned int seq;
+};
+
+struct dump_record {
+	struct fpi_capture_dump *dump;
+	char *name;
+	struct fp_img *img;
+};
+
+static GMutex dump_lock;
+static GThread *dump_thread;
+static GAsyncQueue *dump_queue;
+static gint dump_queued;
+
+/* asks the writer to stop once it wrote what was queued before */
+static struct dump_record dump_stop_record;
+
+static void put_be32(guint8 *buf, guint32 val)
+{
+	buf[0] = val >> 24;
+	buf[1] = val >> 16;
+	buf[2] = val >> 8;
+	buf[3] = val;
+}
+
+static void png_add_chunk(GByteArray *png, const char *type,
+	const guint8 *data, guint32 len)
+{
+	guint8 be[4];
+	uLong crc;
+
+	put_be32(be, len);
+	g_byte_array_append(png, be, 4);
+	g_byte_array_append(png, (const guint8 *) type, 4);
+	crc = crc32(0, (const Bytef *) type, 4);
+	if (len) {
+		g_byte_array_append(png, data, len);
+		crc = crc32(crc, data, len);
+	}
+	put_be32(be, crc);
+	g_byte_array_append(png, be, 4);
+}
+
+/* An 8-bit greyscale PNG, each row but the first stored as its difference
+ * with the one above ("Up" filter), as the ridges run across many rows. */
+static GByteArray *png_encode(const struct fp_img *img)
+{
+	static const guint8 signature[8] = {
+		0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n',
+	};
+	size_t width = img->width, height = img->height;
+	size_t raw_len = height * (width + 1);
+	guint8 *raw = g_malloc(raw_len);
+	uLongf z_len = compressBound(raw_len);
+	guint8 *z = g_malloc(z_len);
+	guint8 ihdr[13];
+	GByteArray *png = NULL;
+	size_t x, y;
+	int r;
+
+	for (y = 0; y < height; y++) {
+		const unsigned char *row = img->data + y * width;
+		const unsigned char *above = y ? row - width : NULL;
+		guint8 *out = raw + y * (width + 1);
+
+		out[0] = above ? 2 : 0;
+		for (x = 0; x < width; x++)
+			out[x + 1] = above ? row[x] - above[x] : row[x];
+	}
+
+	r = compress2(z, &z_len, raw, raw_len, Z_DEFAULT_COMPRESSION);
+	if (r != Z_OK) {
+		fp_err("compression failed, error %d", r);
+		goto out;
+	}
+
+	put_be32(ihdr, width);
+	put_be32(ihdr + 4, height);
+	ihdr[8] = 8;	/* bit depth */
+	ihdr[9] = 0;	/* greyscale */
+	ihdr[10] = 0;	/* deflate */
+	ihdr[11] = 0;	/* adaptive filtering */
+	ihdr[12] = 0;	/* not interlaced */
+
+	png = g_byte_array_sized_new(sizeof(signature) + z_len + 64);
+	g_byte_array_append(png, signature, sizeof(signature));
+	png_add_chunk(png, "IHDR", ihdr, sizeof(ihdr));
+	png_add_chunk(png, "IDAT", z, z_len);
+	png_add_chunk(png, "IEND", NULL, 0);
+
+out:
+	g_free(raw);
+	g_free(z);
+	return png;
+}
+
+static void record_free(struct dump_record *record)
+{
+	fpi_capture_dump_unref(record->dump);
+	fp_img_free(record->img);
+	g_free(record->name);
+	g_free(record);
+}
+
+static void record_write(struct dump_record *record)
+{
+	struct fpi_capture_dump *dump = record->dump;
+	GByteArray *png = png_encode(record->img);
+	GError *err = NULL;
+	char *path;
+
+	if (!png)
+		return;
+
+	if (dump->quota && dump->used + png->len > dump->quota) {
+		if (!dump->full)
+			fp_warn("%s is full, dropping further images",
+				dump->dir);
+		dump->full = TRUE;
+		g_byte_array_free(png, TRUE);
+		return;
+	}
+
+	path = g_build_filename(dump->dir, record->name, NULL);
+	if (g_file_set_contents(path, (const gchar *) png->data, png->len,
+			&err)) {
+		dump->used += png->len;
+		fp_dbg("written to '%s'", path);
+	} else {
+		fp_err("could not write '%s': %s", path, err->message);
+		g_error_free(err);
+	}
+	g_free(path);
+	g_byte_array_free(png, TRUE);
+}
+
+static gpointer dump_thread_func(gpointer data)
+{
+	struct dump_record *batch[CAPTURE_DUMP_MAX_QUEUED + 1];
+	gboolean stop = FALSE;
+
+	fpi_thread_drop_realtime();
+	while (!stop) {
+		unsigned int nr = 0, i;
+		struct dump_record *record = g_async_queue_pop(dump_queue);
+
+		/* take whatever else was queued meanwhile */
+		do {
+			if (record == &dump_stop_record) {
+				stop = TRUE;
+				break;
+			}
+			batch[nr++] = record;
+		} while (nr < G_N_ELEMENTS(batch) &&
+			 (record = g_async_queue_try_pop(dump_queue)));
+
+		for (i = 0; i < nr; i++) {
+			record_write(batch[i]);
+			record_free(batch[i]);
+		}
+		g_atomic_int_add(&dump_queued, -(gint) nr);
+	}
+	return NULL;
+}
+
+/* The sizes of the regular files directly in dir. */
+static guint64 dir_usage(const char *dir)
+{
+	GDir *d = g_dir_open(dir, 0, NULL);
+	const char *name;
+	guint64 used = 0;
+
+	if (!d)
+		return 0;
+	while ((name = g_dir_read_name(d))) {
+		char *path = g_build_filename(dir, name, NULL);
+		GStatBuf st;
+
+		if (g_stat(path, &st) == 0 && S_ISREG(st.st_mode))
+			used += st.st_size;
+		g_free(path);
+	}
+	g_dir_close(d);
+	return used;
+}
+
+int fpi_capture_dump_new(const char *dir, const char *prefix,
+	guint64 quota, struct fpi_capture_dump **ret)
+{
+	struct fpi_capture_dump *dump;
+
+	if (g_mkdir_with_parents(dir, 0700) < 0) {
+		int r = -errno;
+
+		fp_err("could not create '%s', errno=%d", dir, errno);
+		return r;
+	}
+
+	dump = g_malloc0(sizeof(*dump));
+	dump->refcount = 1;
+	dump->dir = g_strdup(dir);
+	dump->prefix = g_strdup(prefix);
+	dump->quota = quota;
+	dump->used = dir_usage(dir);
+	fp_dbg("recording to %s, %" G_GUINT64_FORMAT " bytes used", dir,
+		dump->used);
+	*ret = dump;
+	return 0;
+}
+
+void fpi_capture_dump_unref(struct fpi_capture_dump *dump)
+{
+	if (!dump || !g_atomic_int_dec_and_test(&dump->refcount))
+		return;
+
+	g_free(dump->dir);
+	g_free(dump->prefix);
+	g_free(dump);
+}
+
+/* Queues a copy of img, to be saved to a file named after the device, the
+ * time and tag, e.g. the outcome of the operation. */
+void fpi_capture_dump_add(struct fpi_capture_dump *dump,
+	const struct fp_img *img, const char *tag)
+{
+	struct dump_record *record;
+	struct fp_img *copy;
+
+	if (!img || !img->width || !img->height ||
+	    (size_t) img->width * img->height > img->length)
+		return;
+
+	g_mutex_lock(&dump_lock);
+	if (!dump_queue)
+		dump_queue = g_async_queue_new();
+	if (!dump_thread) {
+		dump_thread = g_thread_try_new("fp-dump", dump_thread_func,
+			NULL, NULL);
+		if (!dump_thread) {
+			g_mutex_unlock(&dump_lock);
+			fp_warn("could not create the image writer thread");
+			return;
+		}
+	}
+	g_mutex_unlock(&dump_lock);
+
+	if (g_atomic_int_add(&dump_queued, 1) >= CAPTURE_DUMP_MAX_QUEUED) {
+		g_atomic_int_add(&dump_queued, -1);
+		fp_dbg("writer behind, dropping image");
+		return;
+	}
+
+	copy = fpi_img_new(img->length);
+	copy->width = img->width;
+	copy->height = img->height;
+	copy->flags = img->flags;
+	memcpy(copy->data, img->data, img->length);
+
+	record = g_malloc(sizeof(*record));
+	record->dump = dump;
+	g_atomic_int_inc(&dump->refcount);
+	record->img = copy;
+	record->name = g_strdup_printf("%s-%" G_GINT64_FORMAT "-%u-%s.png",
+		dump->prefix, g_get_real_time() / 1000, dump->seq++, tag);
+	g_async_queue_push(dump_queue, record);
+}
+
+/* Waits for the queued images to be written, and stops the writer. */
+void fpi_capture_dump_exit(void)
+{
+	g_mutex_lock(&dump_lock);
+	if (dump_thread) {
+		g_async_queue_push(dump_queue, &dump_stop_record);
+		g_thread_join(dump_thread);
+		dump_thread = NULL;
+	}
+	if (dump_queue) {
+		g_async_queue_unref(dump_queue);
+		dump_queue = NULL;
+	}
+	g_mutex_unlock(&dump_lock);
+}
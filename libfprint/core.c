@@ -19,8 +19,16 @@
 
 #include <config.h>
 #include <errno.h>
+#ifdef HAVE_SCHED_SETAFFINITY
+#include <sched.h>
+#endif
+#ifdef HAVE_PTHREAD_SETSCHEDPARAM
+#include <pthread.h>
+#include <sched.h>
+#endif
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include <glib.h>
 #include <libusb.h>
@@ -29,8 +37,20 @@
 
 static int log_level = 0;
 static int log_level_fixed = 0;
+static unsigned int match_threads = 1;
+static unsigned int identify_candidates = 0;
+static enum fp_identify_order identify_order = FP_IDENTIFY_ORDER_GALLERY;
+static enum fp_identify_backend identify_backend = FP_IDENTIFY_BACKEND_CPU;
+static enum fp_prematch prematch = FP_PREMATCH_NONE;
+static int prematch_cutoff = 0;
+static unsigned int prematch_audit_interval = 0;
+static unsigned int extract_threads = 1;
+static unsigned int assemble_threads = 1;
+static char *virtual_image_source = NULL;
+static unsigned int virtual_image_rate = 0;
 
 libusb_context *fpi_usb_ctx = NULL;
+GMutex opened_devices_lock;
 GSList *opened_devices = NULL;
 
 /**
@@ -114,24 +134,32 @@ GSList *opened_devices = NULL;
  * verification) on some devices which do not provide images.
  */
 
-static GSList *registered_drivers = NULL;
+/* set by fp_init(); the drivers themselves are the static tables below */
+static gboolean drivers_registered = FALSE;
 
-void fpi_log(enum fpi_log_level level, const char *component,
-	const char *function, const char *format, ...)
+/* an id_table entry of a registered driver */
+struct driver_usb_id {
+	struct fp_driver *drv;
+	const struct usb_id *id;
+};
+
+/* the driver_usb_id entries matching each VID:PID, in a GArray, in the order
+ * find_supporting_driver() considers them. Built by the first discovery,
+ * under drivers_index_lock, and read without locking once published. */
+static GMutex drivers_index_lock;
+static GHashTable *drivers_by_usb_id = NULL;
+
+#define USB_ID_KEY(vendor, product) \
+	GUINT_TO_POINTER(((guint) (vendor) << 16) | (product))
+
+/* The stdio output of messages, either logged right away by fpi_log() or
+ * buffered and formatted later by log.c. */
+static void log_vwrite(enum fpi_log_level level, const char *component,
+	const char *function, const char *format, va_list args)
 {
-	va_list args;
 	FILE *stream = stdout;
 	const char *prefix;
 
-#ifndef ENABLE_DEBUG_LOGGING
-	if (!log_level)
-		return;
-	if (level == FPRINT_LOG_LEVEL_WARNING && log_level < 2)
-		return;
-	if (level == FPRINT_LOG_LEVEL_INFO && log_level < 3)
-		return;
-#endif
-
 	switch (level) {
 	case FPRINT_LOG_LEVEL_INFO:
 		prefix = "info";
@@ -156,22 +184,41 @@ void fpi_log(enum fpi_log_level level, const char *component,
 
 	fprintf(stream, "%s:%s [%s] ", component ? component : "fp", prefix,
 		function);
-
-	va_start (args, format);
 	vfprintf(stream, format, args);
-	va_end (args);
-
 	fprintf(stream, "\n");
 }
 
-static void register_driver(struct fp_driver *drv)
+void fpi_log_write(enum fpi_log_level level, const char *component,
+	const char *function, const char *format, ...)
 {
-	if (drv->id == 0) {
-		fp_err("not registering driver %s: driver ID is 0", drv->name);
+	va_list args;
+
+	va_start(args, format);
+	log_vwrite(level, component, function, format, args);
+	va_end(args);
+}
+
+void fpi_log(enum fpi_log_level level, const char *component,
+	const char *function, const char *format, ...)
+{
+	va_list args;
+
+#ifndef ENABLE_DEBUG_LOGGING
+	/* checked on every message, without taking a lock */
+	int max_level = g_atomic_int_get(&log_level);
+
+	if (!max_level)
 		return;
-	}
-	registered_drivers = g_slist_prepend(registered_drivers, (gpointer) drv);
-	fp_dbg("registered driver %s", drv->name);
+	if (level == FPRINT_LOG_LEVEL_WARNING && max_level < 2)
+		return;
+	if (level == FPRINT_LOG_LEVEL_INFO && max_level < 3)
+		return;
+#endif
+
+	va_start(args, format);
+	if (!fpi_log_record(level, component, function, format, args))
+		log_vwrite(level, component, function, format, args);
+	va_end(args);
 }
 
 static struct fp_driver * const primitive_drivers[] = {
@@ -236,24 +283,74 @@ static struct fp_img_driver * const img_drivers[] = {
 #ifdef ENABLE_ELAN
 	&elan_driver,
 #endif
+#ifdef ENABLE_VIRTUAL_IMAGE
+	&virtual_image_driver,
+#endif
 /*#ifdef ENABLE_FDU2000
 	&fdu2000_driver,
 #endif
 	*/
 };
 
+static void index_driver(GHashTable *index, struct fp_driver *drv)
+{
+	const struct usb_id *id;
+
+	if (drv->id == 0) {
+		fp_err("ignoring driver %s: driver ID is 0", drv->name);
+		return;
+	}
+
+	for (id = drv->id_table; id->vendor; id++) {
+		struct driver_usb_id entry = { drv, id };
+		gpointer key = USB_ID_KEY(id->vendor, id->product);
+		GArray *entries = g_hash_table_lookup(index, key);
+
+		if (!entries) {
+			entries = g_array_sized_new(FALSE, FALSE,
+				sizeof(struct driver_usb_id), 1);
+			g_hash_table_insert(index, key, entries);
+		}
+		g_array_append_val(entries, entry);
+	}
+}
+
+/* index the id tables of the drivers by VID:PID. The drivers registered last
+ * come first, then the order of each id_table is kept. Discoveries can run
+ * on several threads, the first one builds the index. */
+static GHashTable *index_drivers(void)
+{
+	GHashTable *index = g_atomic_pointer_get(&drivers_by_usb_id);
+	int i;
+
+	if (index)
+		return index;
+
+	g_mutex_lock(&drivers_index_lock);
+	index = drivers_by_usb_id;
+	if (!index) {
+		index = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+			NULL, (GDestroyNotify) g_array_unref);
+		for (i = (int) G_N_ELEMENTS(img_drivers) - 1; i >= 0; i--)
+			index_driver(index, &img_drivers[i]->driver);
+		for (i = (int) G_N_ELEMENTS(primitive_drivers) - 1; i >= 0; i--)
+			index_driver(index, primitive_drivers[i]);
+		g_atomic_pointer_set(&drivers_by_usb_id, index);
+	}
+	g_mutex_unlock(&drivers_index_lock);
+	return index;
+}
+
+/* the drivers are compiled in as static tables, registering them allocates
+ * nothing and the VID:PID index waits for the first discovery */
 static void register_drivers(void)
 {
 	unsigned int i;
 
-	for (i = 0; i < G_N_ELEMENTS(primitive_drivers); i++)
-		register_driver(primitive_drivers[i]);
+	for (i = 0; i < G_N_ELEMENTS(img_drivers); i++)
+		fpi_img_driver_setup(img_drivers[i]);
 
-	for (i = 0; i < G_N_ELEMENTS(img_drivers); i++) {
-		struct fp_img_driver *imgdriver = img_drivers[i];
-		fpi_img_driver_setup(imgdriver);
-		register_driver(&imgdriver->driver);
-	}
+	drivers_registered = TRUE;
 }
 
 API_EXPORTED struct fp_driver **fprint_get_drivers (void)
@@ -278,11 +375,13 @@ static struct fp_driver *find_supporting_driver(libusb_device *udev,
 	const struct usb_id **usb_id, uint32_t *devtype)
 {
 	int ret;
-	GSList *elem = registered_drivers;
 	struct libusb_device_descriptor dsc;
+	GArray *entries;
+	guint i;
 
 	const struct usb_id *best_usb_id;
 	struct fp_driver *best_drv;
+	struct fp_driver *done_drv = NULL;
 	uint32_t best_devtype;
 	int drv_score = 0;
 
@@ -295,39 +394,47 @@ static struct fp_driver *find_supporting_driver(libusb_device *udev,
 	best_drv = NULL;
 	best_devtype = 0;
 
-	do {
-		struct fp_driver *drv = elem->data;
+	entries = g_hash_table_lookup(index_drivers(),
+		USB_ID_KEY(dsc.idVendor, dsc.idProduct));
+	if (!entries)
+		return NULL;
+
+	for (i = 0; i < entries->len; i++) {
+		struct driver_usb_id *entry =
+			&g_array_index(entries, struct driver_usb_id, i);
+		struct fp_driver *drv = entry->drv;
+		const struct usb_id *id = entry->id;
 		uint32_t type = 0;
-		const struct usb_id *id;
-
-		for (id = drv->id_table; id->vendor; id++) {
-			if (dsc.idVendor == id->vendor && dsc.idProduct == id->product) {
-				if (drv->discover) {
-					int r = drv->discover(&dsc, &type);
-					if (r < 0)
-						fp_err("%s discover failed, code %d", drv->name, r);
-					if (r <= 0)
-						continue;
-					/* Has a discover function, and matched our device */
-					drv_score = 100;
-				} else {
-					/* Already got a driver as good */
-					if (drv_score >= 50)
-						continue;
-					drv_score = 50;
-				}
-				fp_dbg("driver %s supports USB device %04x:%04x",
-					drv->name, id->vendor, id->product);
-				best_usb_id = id;
-				best_drv = drv;
-				best_devtype = type;
-
-				/* We found the best possible driver */
-				if (drv_score == 100)
-					break;
-			}
+
+		/* the rest of the id_table of a driver which matched with its
+		 * discover function */
+		if (drv == done_drv)
+			continue;
+
+		if (drv->discover) {
+			int r = drv->discover(&dsc, &type);
+			if (r < 0)
+				fp_err("%s discover failed, code %d", drv->name, r);
+			if (r <= 0)
+				continue;
+			/* Has a discover function, and matched our device */
+			drv_score = 100;
+		} else {
+			/* Already got a driver as good */
+			if (drv_score >= 50)
+				continue;
+			drv_score = 50;
 		}
-	} while ((elem = g_slist_next(elem)));
+		fp_dbg("driver %s supports USB device %04x:%04x",
+			drv->name, id->vendor, id->product);
+		best_usb_id = id;
+		best_drv = drv;
+		best_devtype = type;
+
+		/* We found the best possible driver */
+		if (drv_score == 100)
+			done_drv = drv;
+	}
 
 	if (best_drv != NULL) {
 		fp_dbg("selected driver %s supports USB device %04x:%04x",
@@ -359,11 +466,289 @@ static struct fp_dscv_dev *discover_dev(libusb_device *udev)
 	return ddev;
 }
 
+static void dscv_dev_free(struct fp_dscv_dev *ddev)
+{
+	if (ddev->udev)
+		libusb_unref_device(ddev->udev);
+	g_free(ddev);
+}
+
+#ifdef HAVE_LIBUSB_HOTPLUG
+static struct fp_dscv_dev *dscv_dev_copy(struct fp_dscv_dev *ddev)
+{
+	struct fp_dscv_dev *copy = g_memdup(ddev, sizeof(*ddev));
+
+	libusb_ref_device(copy->udev);
+	return copy;
+}
+
+static fp_hotplug_cb hotplug_notifier = NULL;
+static void *hotplug_notifier_data = NULL;
+
+/* the supported devices plugged in, kept up to date by hotplug_cb() while a
+ * hotplug notifier is set. libusb calls hotplug_cb() from whichever thread
+ * handles its events, so hotplug_devs is only accessed with hotplug_lock
+ * held, which is never held while calling into libusb's hotplug API. */
+static GPtrArray *hotplug_devs = NULL;
+static GMutex hotplug_lock;
+static libusb_hotplug_callback_handle hotplug_handle;
+
+struct hotplug_event {
+	struct fp_dscv_dev *ddev;
+	enum fp_hotplug_event event;
+};
+
+/* libusb forbids opening devices from its hotplug callbacks, so the notifier
+ * is called once libusb handled its events */
+static void hotplug_notify(void *data)
+{
+	struct hotplug_event *ev = data;
+
+	if (hotplug_notifier)
+		hotplug_notifier(ev->ddev, ev->event, hotplug_notifier_data);
+	dscv_dev_free(ev->ddev);
+	g_free(ev);
+}
+
+static void hotplug_post(struct fp_dscv_dev *ddev, enum fp_hotplug_event event)
+{
+	struct hotplug_event *ev = g_malloc(sizeof(*ev));
+
+	ev->ddev = dscv_dev_copy(ddev);
+	ev->event = event;
+	fpi_poll_post(hotplug_notify, ev);
+}
+
+static int LIBUSB_CALL hotplug_cb(libusb_context *ctx, libusb_device *udev,
+	libusb_hotplug_event event, void *user_data)
+{
+	struct fp_dscv_dev *ddev;
+	guint i;
+
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+		ddev = discover_dev(udev);
+		if (!ddev)
+			return 0;
+		libusb_ref_device(udev);
+
+		g_mutex_lock(&hotplug_lock);
+		if (hotplug_devs) {
+			g_ptr_array_add(hotplug_devs, ddev);
+			hotplug_post(ddev, FP_HOTPLUG_ADDED);
+			ddev = NULL;
+		}
+		g_mutex_unlock(&hotplug_lock);
+
+		/* tracking stopped in the meantime */
+		if (ddev)
+			dscv_dev_free(ddev);
+		return 0;
+	}
+
+	g_mutex_lock(&hotplug_lock);
+	for (i = 0; hotplug_devs && i < hotplug_devs->len; i++) {
+		ddev = g_ptr_array_index(hotplug_devs, i);
+		if (ddev->udev != udev)
+			continue;
+		hotplug_post(ddev, FP_HOTPLUG_REMOVED);
+		g_ptr_array_remove_index_fast(hotplug_devs, i);
+		dscv_dev_free(ddev);
+		break;
+	}
+	g_mutex_unlock(&hotplug_lock);
+	return 0;
+}
+
+static void hotplug_stop(void)
+{
+	GPtrArray *devs;
+	gboolean tracking;
+	guint i;
+
+	g_mutex_lock(&hotplug_lock);
+	tracking = hotplug_devs != NULL;
+	g_mutex_unlock(&hotplug_lock);
+	if (!tracking)
+		return;
+
+	/* libusb may be running hotplug_cb() meanwhile, which needs the lock */
+	libusb_hotplug_deregister_callback(fpi_usb_ctx, hotplug_handle);
+
+	g_mutex_lock(&hotplug_lock);
+	devs = hotplug_devs;
+	hotplug_devs = NULL;
+	g_mutex_unlock(&hotplug_lock);
+	if (!devs)
+		return;
+
+	for (i = 0; i < devs->len; i++)
+		dscv_dev_free(g_ptr_array_index(devs, i));
+	g_ptr_array_free(devs, TRUE);
+}
+#endif
+
+/**
+ * fp_set_hotplug_notifier:
+ * @callback: the function to call when a supported device is plugged in or
+ * out, or %NULL to stop tracking the devices
+ * @user_data: the last argument of @callback
+ *
+ * Tracks the supported devices as they are plugged in and out, and reports
+ * them to @callback, starting with the devices already plugged in. While
+ * a notifier is set, fp_discover_devs() no longer scans the USB devices, and
+ * returns the devices tracked instead.
+ *
+ * The devices are tracked, and @callback is called, while libfprint handles
+ * its events, see fp_handle_events(). The discovered device given to
+ * @callback is only valid until it returns, but it can be opened with
+ * fp_async_dev_open() from there.
+ *
+ * Returns: 0 on success, -ENOTSUP if libusb does not support hotplug on this
+ * platform, or another negative error code.
+ */
+API_EXPORTED int fp_set_hotplug_notifier(fp_hotplug_cb callback,
+	void *user_data)
+{
+#ifdef HAVE_LIBUSB_HOTPLUG
+	GPtrArray *devs;
+	gboolean tracking;
+	int r;
+
+	hotplug_notifier = callback;
+	hotplug_notifier_data = user_data;
+	if (!callback) {
+		hotplug_stop();
+		return 0;
+	}
+	g_mutex_lock(&hotplug_lock);
+	tracking = hotplug_devs != NULL;
+	g_mutex_unlock(&hotplug_lock);
+	if (tracking)
+		return 0;
+
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		hotplug_notifier = NULL;
+		return -ENOTSUP;
+	}
+
+	/* the devices already plugged in are reported to hotplug_cb() before
+	 * this returns, so the lock is not held meanwhile */
+	g_mutex_lock(&hotplug_lock);
+	hotplug_devs = g_ptr_array_new();
+	g_mutex_unlock(&hotplug_lock);
+	r = libusb_hotplug_register_callback(fpi_usb_ctx,
+		LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+		LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT, LIBUSB_HOTPLUG_ENUMERATE,
+		LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+		LIBUSB_HOTPLUG_MATCH_ANY, hotplug_cb, NULL, &hotplug_handle);
+	if (r != LIBUSB_SUCCESS) {
+		fp_err("failed to register hotplug callback, error %d", r);
+		g_mutex_lock(&hotplug_lock);
+		devs = hotplug_devs;
+		hotplug_devs = NULL;
+		g_mutex_unlock(&hotplug_lock);
+		g_ptr_array_free(devs, TRUE);
+		hotplug_notifier = NULL;
+		return r;
+	}
+
+	return 0;
+#else
+	return -ENOTSUP;
+#endif
+}
+
+/* a copy of the devices tracked by fp_set_hotplug_notifier(), or NULL if
+ * they are not tracked */
+static struct fp_dscv_dev **hotplug_snapshot(void)
+{
+#ifdef HAVE_LIBUSB_HOTPLUG
+	struct fp_dscv_dev **list = NULL;
+	guint i;
+
+	g_mutex_lock(&hotplug_lock);
+	if (hotplug_devs) {
+		list = g_malloc(sizeof(*list) * (hotplug_devs->len + 1));
+		for (i = 0; i < hotplug_devs->len; i++)
+			list[i] = dscv_dev_copy(
+				g_ptr_array_index(hotplug_devs, i));
+		list[hotplug_devs->len] = NULL;
+	}
+	g_mutex_unlock(&hotplug_lock);
+	return list;
+#else
+	return NULL;
+#endif
+}
+
+/**
+ * fp_set_virtual_image_source:
+ * @source: a directory of binary PGM images, "unix:" followed by the path
+ * of a stream socket sending binary PGM images, or %NULL to remove the
+ * virtual device
+ * @rate: the number of captures per second, or 0 to capture back to back
+ *
+ * Adds a virtual imaging device to the devices returned by
+ * fp_discover_devs(), for testing and load generation. Once opened, it
+ * reports a finger placed, an image and the finger lifted @rate times per
+ * second for as long as it is enrolling, verifying, identifying or
+ * capturing. The images of a directory are loaded when the device is
+ * opened and handed out in turn, in the order of their names, while one
+ * image is read from a socket per capture.
+ *
+ * The virtual device can also be added by setting the LIBFPRINT_VIRTUAL_IMAGE
+ * environment variable to @source, and optionally LIBFPRINT_VIRTUAL_IMAGE_RATE
+ * to @rate, before fp_init() is called.
+ *
+ * Returns: 0 on success, or -ENOTSUP if libfprint was built without the
+ * virtual_image driver
+ */
+API_EXPORTED int fp_set_virtual_image_source(const char *source,
+	unsigned int rate)
+{
+#ifdef ENABLE_VIRTUAL_IMAGE
+	g_free(virtual_image_source);
+	virtual_image_source = g_strdup(source);
+	virtual_image_rate = rate;
+	return 0;
+#else
+	return -ENOTSUP;
+#endif
+}
+
+const char *fpi_get_virtual_image_source(unsigned int *rate)
+{
+	*rate = virtual_image_rate;
+	return virtual_image_source;
+}
+
+/* the virtual image device goes after the USB devices, when it is set up */
+static struct fp_dscv_dev **append_virtual_dev(struct fp_dscv_dev **list)
+{
+#ifdef ENABLE_VIRTUAL_IMAGE
+	struct fp_dscv_dev *ddev;
+	int len;
+
+	if (!virtual_image_source)
+		return list;
+
+	for (len = 0; list[len]; len++);
+	list = g_realloc(list, sizeof(*list) * (len + 2));
+	ddev = g_malloc0(sizeof(*ddev));
+	ddev->drv = &virtual_image_driver.driver;
+	list[len] = ddev;
+	list[len + 1] = NULL;
+#endif
+	return list;
+}
+
 /**
  * fp_discover_devs:
  *
  * Scans the system and returns a list of discovered devices. This is your
- * entry point into finding a fingerprint reader to operate.
+ * entry point into finding a fingerprint reader to operate. While a hotplug
+ * notifier is set with fp_set_hotplug_notifier(), the devices it tracks are
+ * returned without scanning the system.
  *
  * Returns: a %NULL-terminated list of discovered devices. Must be freed with
  * fp_dscv_devs_free() after use.
@@ -378,20 +763,21 @@ API_EXPORTED struct fp_dscv_dev **fp_discover_devs(void)
 	int r;
 	int i = 0;
 
-	if (registered_drivers == NULL)
+	if (!drivers_registered)
 		return NULL;
 
+	list = hotplug_snapshot();
+	if (list)
+		return append_virtual_dev(list);
+
 	r = libusb_get_device_list(fpi_usb_ctx, &devs);
 	if (r < 0) {
 		fp_err("couldn't enumerate USB devices, error %d", r);
 		return NULL;
 	}
 
-	/* Check each device against each driver, temporarily storing successfully
-	 * discovered devices in a GSList.
-	 *
-	 * Quite inefficient but excusable as we'll only be dealing with small
-	 * sets of drivers against small sets of USB devices */
+	/* Look up the drivers of each device by its VID:PID, temporarily storing
+	 * successfully discovered devices in a GSList. */
 	while ((udev = devs[i++]) != NULL) {
 		struct fp_dscv_dev *ddev = discover_dev(udev);
 		if (!ddev)
@@ -417,7 +803,7 @@ API_EXPORTED struct fp_dscv_dev **fp_discover_devs(void)
 	list[dscv_count] = NULL; /* NULL-terminate */
 
 	g_slist_free(tmplist);
-	return list;
+	return append_virtual_dev(list);
 }
 
 /**
@@ -435,10 +821,8 @@ API_EXPORTED void fp_dscv_devs_free(struct fp_dscv_dev **devs)
 	if (!devs)
 		return;
 
-	for (i = 0; devs[i]; i++) {
-		libusb_unref_device(devs[i]->udev);
-		g_free(devs[i]);
-	}
+	for (i = 0; devs[i]; i++)
+		dscv_dev_free(devs[i]);
 	g_free(devs);
 }
 
@@ -774,6 +1158,175 @@ API_EXPORTED int fp_dev_get_img_height(struct fp_dev *dev)
 	return fpi_imgdev_get_img_height(imgdev);
 }
 
+/**
+ * fp_dev_set_processing_cpu:
+ * @dev: the fingerprint device
+ * @cpu: the CPU to use, or -1 for any CPU
+ *
+ * Choose the CPU on which the images scanned by an imaging device are
+ * processed. Each imaging device processes its images on its own thread,
+ * away from the thread handling libfprint events, so that several devices
+ * can enroll, verify or identify at the same time. Pinning the threads of
+ * the devices to different CPUs keeps their working data in separate caches.
+ *
+ * This only applies to the images processed after the call. The default is
+ * -1, letting the system schedule the thread.
+ *
+ * Returns: 0 on success, -EINVAL for an invalid @cpu, or -ENOTSUP if the
+ * device is not an imaging device or the platform cannot pin threads.
+ */
+API_EXPORTED int fp_dev_set_processing_cpu(struct fp_dev *dev, int cpu)
+{
+	struct fp_img_dev *imgdev = dev_to_img_dev(dev);
+
+	if (!imgdev)
+		return -ENOTSUP;
+#ifdef HAVE_SCHED_SETAFFINITY
+	if (cpu < -1 || cpu >= CPU_SETSIZE)
+		return -EINVAL;
+#endif
+
+	return fpi_imgdev_set_processing_cpu(imgdev, cpu);
+}
+
+/**
+ * fp_dev_set_warm_session:
+ * @dev: the fingerprint device
+ * @idle_timeout_ms: how long the sensor stays active after an operation, in
+ * milliseconds, or 0 to deactivate it as soon as the operation stops
+ *
+ * Keep the sensor of an imaging device active between consecutive
+ * operations. Activating a sensor can take hundreds of milliseconds of USB
+ * traffic for some devices, which adds up when an application verifies or
+ * identifies one finger after the other.
+ *
+ * While the session is warm, stopping an enrollment, verification,
+ * identification or capture leaves the sensor active and completes
+ * immediately. The next operation starting within @idle_timeout_ms goes
+ * straight back to finger detection. Otherwise the sensor is deactivated
+ * once the timeout expires, or when the device is closed. A sensor which
+ * reported an error is always deactivated.
+ *
+ * Returns: 0 on success, or -ENOTSUP if the device is not an imaging device.
+ */
+API_EXPORTED int fp_dev_set_warm_session(struct fp_dev *dev,
+	unsigned int idle_timeout_ms)
+{
+	struct fp_img_dev *imgdev = dev_to_img_dev(dev);
+
+	if (!imgdev)
+		return -ENOTSUP;
+
+	fpi_imgdev_set_warm_session(imgdev, idle_timeout_ms);
+	return 0;
+}
+
+/**
+ * fp_dev_set_enroll_consolidation:
+ * @dev: the fingerprint device
+ * @enable: whether to consolidate the enroll stages
+ *
+ * Merge the samples scanned during the enrollment stages of an imaging
+ * device once the last stage completes. The samples which match each other
+ * are aligned and merged into one template, or two if they form separate
+ * groups, keeping the minutiae found on several of them. Samples matching
+ * none of the others are kept unchanged. Every verification of the
+ * enrolled print, and every comparison with it during identification, then
+ * runs the matcher once per template rather than once per stage.
+ *
+ * This applies to the enrollments completed after the call, and is off by
+ * default.
+ *
+ * Returns: 0 on success, or -ENOTSUP if the device is not an imaging device.
+ */
+API_EXPORTED int fp_dev_set_enroll_consolidation(struct fp_dev *dev,
+	int enable)
+{
+	struct fp_img_dev *imgdev = dev_to_img_dev(dev);
+
+	if (!imgdev)
+		return -ENOTSUP;
+
+	imgdev->consolidate_enroll = !!enable;
+	return 0;
+}
+
+/**
+ * fp_dev_set_capture_dump:
+ * @dev: the fingerprint device
+ * @dir: the directory to write the images to, created if needed, or %NULL
+ * to stop recording
+ * @quota: the size the files of @dir may add up to, in bytes, or 0 for no
+ * limit
+ *
+ * Record every image an imaging device scans for an enrollment stage, a
+ * verification, an identification or a capture, for instance to look into
+ * the false rejects of a unit in the field. Each image is written to @dir
+ * as a PNG file named after the driver, the time in milliseconds, a
+ * sequence number, the operation and its result, such as
+ * uru4000-1700000000000-3-verify-0.png for a verification which did not
+ * match.
+ *
+ * Images are compressed and written by a background thread, so recording
+ * does not hold up the device. Rather than waiting for the disk, images are
+ * dropped when the writer falls behind, and once the files of @dir, those
+ * already there included, add up to @quota. Files are never removed.
+ * fp_exit() waits for the queued images to be written.
+ *
+ * Returns: 0 on success, a negative error code if @dir could not be
+ * created, or -ENOTSUP if the device is not an imaging device or libfprint
+ * was built without the capture_dump option.
+ */
+API_EXPORTED int fp_dev_set_capture_dump(struct fp_dev *dev, const char *dir,
+	uint64_t quota)
+{
+#ifdef ENABLE_CAPTURE_DUMP
+	struct fp_img_dev *imgdev = dev_to_img_dev(dev);
+	struct fpi_capture_dump *dump = NULL;
+	int r;
+
+	if (!imgdev)
+		return -ENOTSUP;
+
+	if (dir) {
+		r = fpi_capture_dump_new(dir, dev->drv->name, quota, &dump);
+		if (r < 0)
+			return r;
+	}
+	fpi_capture_dump_unref(imgdev->capture_dump);
+	imgdev->capture_dump = dump;
+	return 0;
+#else
+	return -ENOTSUP;
+#endif
+}
+
+/**
+ * fp_dev_get_stats:
+ * @dev: the fingerprint device
+ * @stats: an output location for the statistics
+ *
+ * Get histograms of the latencies of the scans of an imaging device, from
+ * the finger touching the sensor to the verify or identify result, since it
+ * was opened or since the previous call, and reset them. Every scan is
+ * accounted for exactly once, even when this is called from another thread
+ * than the one handling libfprint events. Measuring only costs a few clock
+ * reads per scan, so applications can poll it for as long as they run.
+ *
+ * Returns: 0 on success, or -ENOTSUP if the device is not an imaging device.
+ */
+API_EXPORTED int fp_dev_get_stats(struct fp_dev *dev,
+	struct fp_dev_stats *stats)
+{
+	struct fp_img_dev *imgdev = dev_to_img_dev(dev);
+
+	if (!imgdev)
+		return -ENOTSUP;
+
+	fpi_imgdev_get_stats(imgdev, stats);
+	return 0;
+}
+
 /**
  * fp_set_debug:
  * @level: the verbosity level
@@ -808,10 +1361,323 @@ API_EXPORTED void fp_set_debug(int level)
 	if (log_level_fixed)
 		return;
 
-	log_level = level;
+	g_atomic_int_set(&log_level, level);
 	libusb_set_debug(fpi_usb_ctx, level);
 }
 
+/**
+ * fp_set_match_threads:
+ * @nr_threads: number of threads to use, or 0 to use one thread per online
+ * CPU
+ *
+ * Set the number of threads used to match a scanned print against a
+ * gallery of prints during identification, for example from
+ * fp_identify_finger(). The gallery is shared out between the threads,
+ * and the reported match offset is the same as it would be if the gallery
+ * was scanned sequentially.
+ *
+ * The default is 1, meaning that identification runs entirely within the
+ * thread handling libfprint events.
+ */
+API_EXPORTED void fp_set_match_threads(unsigned int nr_threads)
+{
+	match_threads = nr_threads;
+}
+
+/* a thread count setting of 0 means one thread per online CPU */
+static unsigned int threads_or_cpus(unsigned int nr_threads)
+{
+	long nr_cpus;
+
+	if (nr_threads)
+		return nr_threads;
+
+	nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return nr_cpus > 0 ? nr_cpus : 1;
+}
+
+gboolean fpi_thread_cpu_supported(void)
+{
+#ifdef HAVE_SCHED_SETAFFINITY
+	return TRUE;
+#else
+	return FALSE;
+#endif
+}
+
+/* Pin the calling thread to cpu, or let it run on any CPU the process may
+ * use if cpu is -1 */
+int fpi_set_thread_cpu(int cpu)
+{
+#ifdef HAVE_SCHED_SETAFFINITY
+	cpu_set_t set;
+
+	if (cpu < 0) {
+		if (sched_getaffinity(getpid(), sizeof(set), &set) < 0)
+			return -errno;
+	} else {
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+	}
+
+	/* 0 is the calling thread, not the whole process */
+	if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+		fp_dbg("failed to set the CPU of a thread to %d, errno=%d",
+			cpu, errno);
+		return -errno;
+	}
+	return 0;
+#else
+	return -ENOTSUP;
+#endif
+}
+
+/* Run the calling thread with the SCHED_FIFO policy at priority, or with
+ * the normal policy if priority is 0 */
+int fpi_set_thread_realtime(int priority)
+{
+#ifdef HAVE_PTHREAD_SETSCHEDPARAM
+	struct sched_param param = { .sched_priority = priority };
+	int r;
+
+	r = pthread_setschedparam(pthread_self(),
+		priority ? SCHED_FIFO : SCHED_OTHER, &param);
+	if (r) {
+		fp_dbg("failed to set the priority of a thread to %d, errno=%d",
+			priority, r);
+		return -r;
+	}
+	return 0;
+#else
+	return -ENOTSUP;
+#endif
+}
+
+/* Threads started from a real-time event thread, see
+ * fp_event_thread_set_realtime(), inherit its policy. Those doing heavy
+ * processing go back to the normal one, so that they do not hold up the
+ * event thread. */
+void fpi_thread_drop_realtime(void)
+{
+	if (fpi_get_event_thread_priority())
+		fpi_set_thread_realtime(0);
+}
+
+struct thread_start {
+	GThreadFunc func;
+	gpointer data;
+};
+
+static gpointer thread_start_func(gpointer data)
+{
+	struct thread_start start = *(struct thread_start *) data;
+
+	g_free(data);
+	fpi_thread_drop_realtime();
+	return start.func(start.data);
+}
+
+/* g_thread_try_new() for the helper threads of a job which the calling
+ * thread takes part in: the helpers run func with the normal policy, and
+ * leave the real-time one to the calling thread. */
+GThread *fpi_thread_try_new(const char *name, GThreadFunc func,
+	gpointer data)
+{
+	struct thread_start *start = g_malloc(sizeof(*start));
+	GThread *thread;
+
+	start->func = func;
+	start->data = data;
+	thread = g_thread_try_new(name, thread_start_func, start, NULL);
+	if (!thread)
+		g_free(start);
+	return thread;
+}
+
+unsigned int fpi_get_match_threads(void)
+{
+	return threads_or_cpus(match_threads);
+}
+
+/**
+ * fp_set_identify_candidates:
+ * @nr_candidates: number of gallery prints to match in full, or 0 to match
+ * every print
+ *
+ * Enable the candidate index for identification. Every print in the
+ * gallery is first ranked with a cheap comparison of minutiae-pair
+ * geometry, and only the @nr_candidates best ranked prints go through the
+ * full matcher, best ranked first. This bounds identification time on large
+ * galleries, at the risk of missing a genuine match that ranks poorly.
+ *
+ * When enabled, fp_identify_finger() reports the first match among the
+ * candidates in rank order rather than the lowest matching gallery offset.
+ * The index data for each print is saved next to it by
+ * fp_print_data_save() and read back by fp_print_data_load(). Prints kept
+ * in the packed store, see fp_set_print_store(), get no such file: their
+ * index data is rebuilt every time they are loaded.
+ *
+ * The default is 0, disabling the index.
+ */
+API_EXPORTED void fp_set_identify_candidates(unsigned int nr_candidates)
+{
+	identify_candidates = nr_candidates;
+}
+
+unsigned int fpi_get_identify_candidates(void)
+{
+	return identify_candidates;
+}
+
+/**
+ * fp_set_identify_order:
+ * @order: the order to match gallery prints in
+ *
+ * Choose the order in which fp_identify_finger() and the other identify
+ * functions go through a gallery. Identification stops at the first print
+ * that matches, so when a few users account for most identifications,
+ * matching their prints first saves most of the comparisons. Every print
+ * keeps track of the identifications it matched since it was loaded, which
+ * the adaptive orders rank the gallery by, in gallery order among equals.
+ * With the candidate index enabled, see fp_set_identify_candidates(), the
+ * selected candidates are ranked that way.
+ *
+ * Which scores count as a match does not change, but with an adaptive order
+ * the reported match is the first in that order rather than the lowest
+ * matching gallery offset. Top-K identification scans the whole gallery
+ * and is not affected.
+ *
+ * The default is %FP_IDENTIFY_ORDER_GALLERY.
+ */
+API_EXPORTED void fp_set_identify_order(enum fp_identify_order order)
+{
+	identify_order = order;
+}
+
+enum fp_identify_order fpi_get_identify_order(void)
+{
+	return identify_order;
+}
+
+/**
+ * fp_set_identify_backend:
+ * @backend: where to rank identification candidates
+ *
+ * Choose how the candidate index ranks a gallery, see
+ * fp_set_identify_candidates(). With %FP_IDENTIFY_BACKEND_OPENCL, an
+ * OpenCL device searches the compatible minutia-pair edges of the scanned
+ * print and every gallery print at once, and ranks the gallery by an
+ * approximation of the match score. The gallery is uploaded to the device
+ * on its first identification and kept there while the same prints are
+ * identified against. The best ranked candidates are then matched in full
+ * on the CPU as before, so the match scores do not change; only which
+ * prints make it to the full matcher does.
+ *
+ * If no OpenCL device can be used, the candidates are ranked on the CPU.
+ *
+ * The default is %FP_IDENTIFY_BACKEND_CPU.
+ *
+ * Returns: 0 on success, -ENOTSUP if libfprint was built without OpenCL
+ * support
+ */
+API_EXPORTED int fp_set_identify_backend(enum fp_identify_backend backend)
+{
+#ifndef HAVE_OPENCL
+	if (backend == FP_IDENTIFY_BACKEND_OPENCL)
+		return -ENOTSUP;
+#endif
+	identify_backend = backend;
+	return 0;
+}
+
+enum fp_identify_backend fpi_get_identify_backend(void)
+{
+	return identify_backend;
+}
+
+/**
+ * fp_set_prematch:
+ * @method: the descriptor to compare candidates with, or
+ * %FP_PREMATCH_NONE to match every candidate in full
+ * @cutoff: the lowest pre-match score, from 0 to 100, of a candidate that
+ * is matched in full
+ * @audit_interval: match one in every @audit_interval pruned candidates in
+ * full anyway, or 0 to never do so
+ *
+ * Enable the pre-match stage of identification. Before a gallery print goes
+ * through the full matcher, a compact descriptor of each of its samples is
+ * compared to that of the scanned print, and prints scoring below @cutoff
+ * are skipped. Descriptors are built the first time a print is identified
+ * against, or when a #fp_gallery is loaded. Top-K identification gives
+ * skipped prints a score of 0.
+ *
+ * A genuine print that scores below @cutoff is missed, so the cutoff trades
+ * identification time for false rejects. The audited candidates measure how
+ * often that happens, see fp_get_identify_stats().
+ *
+ * The default is %FP_PREMATCH_NONE.
+ */
+API_EXPORTED void fp_set_prematch(enum fp_prematch method, int cutoff,
+	unsigned int audit_interval)
+{
+	prematch = method;
+	prematch_cutoff = cutoff;
+	prematch_audit_interval = audit_interval;
+}
+
+enum fp_prematch fpi_get_prematch(int *cutoff, unsigned int *audit_interval)
+{
+	*cutoff = prematch_cutoff;
+	*audit_interval = prematch_audit_interval;
+	return prematch;
+}
+
+/**
+ * fp_set_extract_threads:
+ * @nr_threads: number of threads to use, or 0 to use one thread per online
+ * CPU
+ *
+ * Set the number of threads used to analyse the ridge flow of a scanned
+ * image and to look for its minutiae. The image is split into rows of
+ * blocks, then into stripes of pixels, which are shared out between the
+ * threads; the detected minutiae do not depend on the number of threads.
+ *
+ * The default is 1, meaning that detection runs entirely within the
+ * thread handling libfprint events.
+ */
+API_EXPORTED void fp_set_extract_threads(unsigned int nr_threads)
+{
+	extract_threads = nr_threads;
+}
+
+unsigned int fpi_get_extract_threads(void)
+{
+	return threads_or_cpus(extract_threads);
+}
+
+/**
+ * fp_set_assemble_threads:
+ * @nr_threads: number of threads to use, or 0 to use one thread per online
+ * CPU
+ *
+ * Set the number of threads used to estimate the movement between the
+ * frames of a swipe before they are assembled into an image. The pairs of
+ * consecutive frames are shared out between the threads; the assembled
+ * image does not depend on the number of threads.
+ *
+ * The default is 1, meaning that assembling runs entirely within the
+ * thread handling libfprint events.
+ */
+API_EXPORTED void fp_set_assemble_threads(unsigned int nr_threads)
+{
+	assemble_threads = nr_threads;
+}
+
+unsigned int fpi_get_assemble_threads(void)
+{
+	return threads_or_cpus(assemble_threads);
+}
+
 /**
  * fp_init:
  *
@@ -823,12 +1689,32 @@ API_EXPORTED void fp_set_debug(int level)
 API_EXPORTED int fp_init(void)
 {
 	char *dbg = getenv("LIBFPRINT_DEBUG");
+	gint64 start, usb_done, drivers_done, end;
 	int r;
 	fp_dbg("");
 
+	start = g_get_monotonic_time();
 	r = libusb_init(&fpi_usb_ctx);
 	if (r < 0)
 		return r;
+	usb_done = g_get_monotonic_time();
+
+#ifdef ENABLE_USB_REPLAY
+	r = fpi_usb_replay_init();
+	if (r < 0) {
+		libusb_exit(fpi_usb_ctx);
+		return r;
+	}
+#endif
+
+#ifdef ENABLE_VIRTUAL_IMAGE
+	if (g_getenv("LIBFPRINT_VIRTUAL_IMAGE")) {
+		const char *rate = g_getenv("LIBFPRINT_VIRTUAL_IMAGE_RATE");
+
+		fp_set_virtual_image_source(g_getenv("LIBFPRINT_VIRTUAL_IMAGE"),
+			rate ? atoi(rate) : 0);
+	}
+#endif
 
 	if (dbg) {
 		log_level = atoi(dbg);
@@ -838,8 +1724,16 @@ API_EXPORTED int fp_init(void)
 		}
 	}
 
+	fpi_simd_init();
 	register_drivers();
+	drivers_done = g_get_monotonic_time();
 	fpi_poll_init();
+	end = g_get_monotonic_time();
+
+	fp_dbg("started in %" G_GINT64_FORMAT "us: libusb %" G_GINT64_FORMAT
+		"us, drivers %" G_GINT64_FORMAT "us, events %" G_GINT64_FORMAT "us",
+		end - start, usb_done - start, drivers_done - usb_done,
+		end - drivers_done);
 	return 0;
 }
 
@@ -853,25 +1747,42 @@ API_EXPORTED int fp_init(void)
 API_EXPORTED void fp_exit(void)
 {
 	fp_dbg("");
+	fp_event_thread_stop();
+	fp_set_hotplug_notifier(NULL, NULL);
 
+	g_mutex_lock(&opened_devices_lock);
 	if (opened_devices) {
 		GSList *copy = g_slist_copy(opened_devices);
 		GSList *elem = copy;
 		fp_dbg("naughty app left devices open on exit!");
 
+		/* closing takes the device off the list */
+		g_mutex_unlock(&opened_devices_lock);
 		do
 			fp_dev_close((struct fp_dev *) elem->data);
 		while ((elem = g_slist_next(elem)));
+		g_mutex_lock(&opened_devices_lock);
 
 		g_slist_free(copy);
 		g_slist_free(opened_devices);
 		opened_devices = NULL;
 	}
+	g_mutex_unlock(&opened_devices_lock);
 
 	fpi_data_exit();
+#ifdef ENABLE_CAPTURE_DUMP
+	fpi_capture_dump_exit();
+#endif
+	fpi_img_exit();
+#ifdef ENABLE_USB_REPLAY
+	fpi_usb_replay_exit();
+#endif
 	fpi_poll_exit();
-	g_slist_free(registered_drivers);
-	registered_drivers = NULL;
+	fpi_log_exit();
+	if (drivers_by_usb_id)
+		g_hash_table_destroy(drivers_by_usb_id);
+	drivers_by_usb_id = NULL;
+	drivers_registered = FALSE;
 	libusb_exit(fpi_usb_ctx);
 }
 
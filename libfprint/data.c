@@ -19,6 +19,7 @@
 
 #include <config.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
@@ -29,6 +30,7 @@
 #include <glib/gstdio.h>
 
 #include "fp_internal.h"
+#include "nbis/include/bozorth.h"
 
 #define DIR_PERMS 0700
 
@@ -51,6 +53,9 @@
  */
 
 static char *base_store = NULL;
+static char *store_user = NULL; /* packed store in use if set */
+
+static void save_writer_stop(void);
 
 static void storage_setup(void)
 {
@@ -69,7 +74,64 @@ static void storage_setup(void)
 
 void fpi_data_exit(void)
 {
+	/* the pending completions run when the poll state is torn down */
+	save_writer_stop();
+	fpi_store_exit();
+	g_free(store_user);
+	store_user = NULL;
 	g_free(base_store);
+	base_store = NULL;
+}
+
+/**
+ * fp_set_print_store:
+ * @store: the format to keep saved prints in
+ * @user_key: with %FP_PRINT_STORE_PACKED, the user that saved, loaded and
+ * discovered prints belong to, or %NULL for the name of the current user.
+ * Ignored otherwise.
+ *
+ * Selects where fp_print_data_save(), fp_print_data_load(),
+ * fp_print_data_delete() and fp_discover_prints() keep prints. The default
+ * directory store uses one file per finger, which means one open per print
+ * when discovering them. The packed store keeps the prints of all users in
+ * the single file `~/.fprint/prints.db` and indexes it when first used, so
+ * that loading a print is a hash lookup and discovering prints needs a
+ * single open. Prints loaded from the packed store use their samples
+ * straight from a read-only mapping of the file, so loading a large gallery
+ * copies nothing and its pages are shared by every process that loads it.
+ * Prints are not migrated between the two stores.
+ *
+ * Returns: 0 on success, negative on error
+ */
+API_EXPORTED int fp_set_print_store(enum fp_print_store store,
+	const char *user_key)
+{
+	char *path;
+
+	if (store != FP_PRINT_STORE_DIRECTORY && store != FP_PRINT_STORE_PACKED)
+		return -EINVAL;
+	if (user_key && strlen(user_key) > 255)
+		return -EINVAL;
+
+	/* pending asynchronous saves go to the store they were made for */
+	save_writer_stop();
+	g_free(store_user);
+	store_user = NULL;
+	if (store == FP_PRINT_STORE_DIRECTORY) {
+		fpi_store_open(NULL);
+		return 0;
+	}
+
+	if (!base_store)
+		storage_setup();
+	if (!base_store)
+		return -ENOENT;
+
+	store_user = g_strdup(user_key ? user_key : g_get_user_name());
+	path = g_strconcat(base_store, ".db", NULL);
+	fpi_store_open(path);
+	g_free(path);
+	return 0;
 }
 
 #define FP_FINGER_IS_VALID(finger) \
@@ -108,55 +170,127 @@ static struct fp_print_data *print_data_new(uint16_t driver_id,
 	return data;
 }
 
-void fpi_print_data_item_free(struct fp_print_data_item *item)
+/* Minutiae are read in place as struct xyt_struct, so borrowed data must be
+ * aligned for its int members. Data kept with the print is aligned for
+ * anything a driver may store. */
+#define ITEM_ALIGN sizeof(int)
+#define SAMPLE_ALIGN 8
+#define SAMPLE_ROUND(len) (((len) + SAMPLE_ALIGN - 1) & ~(size_t) (SAMPLE_ALIGN - 1))
+
+static unsigned char *print_data_samples(struct fp_print_data_item *items,
+	unsigned int items_alloc)
 {
-	g_free(item);
+	return (unsigned char *) items
+		+ SAMPLE_ROUND(items_alloc * sizeof(*items));
 }
 
-struct fp_print_data_item *fpi_print_data_item_new(size_t length)
+/* Makes room for one more item with own bytes of data, moving the samples
+ * to a larger allocation if needed. */
+static void print_data_grow(struct fp_print_data *data, size_t own)
 {
-	struct fp_print_data_item *item = g_malloc0(sizeof(*item) + length);
-	item->length = length;
+	struct fp_print_data_item *items;
+	unsigned char *old_samples = NULL, *samples;
+	unsigned int items_alloc = data->items_alloc;
+	size_t samples_alloc = data->samples_alloc;
+	unsigned int i;
+
+	if (data->nr_items < items_alloc
+			&& data->samples_len + own <= samples_alloc)
+		return;
+
+	if (data->nr_items == items_alloc)
+		items_alloc = MAX(items_alloc * 2, 4);
+	if (data->samples_len + own > samples_alloc)
+		samples_alloc = MAX(samples_alloc * 2, data->samples_len + own);
+
+	items = g_malloc0(SAMPLE_ROUND(items_alloc * sizeof(*items))
+		+ samples_alloc);
+	samples = print_data_samples(items, items_alloc);
+	if (data->items) {
+		old_samples = print_data_samples(data->items, data->items_alloc);
+		memcpy(items, data->items, data->nr_items * sizeof(*items));
+		memcpy(samples, old_samples, data->samples_len);
+	}
+
+	/* the prepared matcher tables refer to the sample they were built
+	 * from, so they follow it */
+	for (i = 0; i < data->nr_items; i++) {
+		struct fp_print_data_item *item = &items[i];
+
+		if (item->map)
+			continue;
+		item->data = samples + (item->data - old_samples);
+		if (item->bz_gallery)
+			item->bz_gallery->gstruct = (struct xyt_struct *) item->data;
+	}
+
+	g_free(data->items);
+	data->items = items;
+	data->items_alloc = items_alloc;
+	data->samples_alloc = samples_alloc;
+}
+
+/* Appends a zeroed sample of length bytes to data. The returned item, and
+ * those that were already there, remain valid until the next sample is
+ * added. */
+struct fp_print_data_item *fpi_print_data_add_item(struct fp_print_data *data,
+	size_t length)
+{
+	struct fp_print_data_item *item;
+	size_t own = SAMPLE_ROUND(length);
 
+	print_data_grow(data, own);
+	item = &data->items[data->nr_items++];
+	item->length = length;
+	item->data = print_data_samples(data->items, data->items_alloc)
+		+ data->samples_len;
+	data->samples_len += own;
 	return item;
 }
 
+/* Appends a sample that is used in place from map, or copied if it isn't
+ * suitably aligned. */
+static void print_data_add_borrowed_item(struct fp_print_data *data,
+	GMappedFile *map, const unsigned char *sample, size_t length)
+{
+	struct fp_print_data_item *item;
+
+	if ((uintptr_t) sample % ITEM_ALIGN != 0) {
+		item = fpi_print_data_add_item(data, length);
+		memcpy(item->data, sample, length);
+		return;
+	}
+
+	print_data_grow(data, 0);
+	item = &data->items[data->nr_items++];
+	item->length = length;
+	item->map = g_mapped_file_ref(map);
+	item->data = (unsigned char *) sample;
+}
+
 struct fp_print_data *fpi_print_data_new(struct fp_dev *dev)
 {
 	return print_data_new(dev->drv->id, dev->devtype,
 		fpi_driver_get_data_type(dev->drv));
 }
 
-/**
- * fp_print_data_get_data:
- * @data: the stored print
- * @ret: output location for the data buffer. Must be freed with free()
- * after use.
-
- * Convert a stored print into a unified representation inside a data buffer.
- * You can then store this data buffer in any way that suits you, and load
- * it back at some later time using fp_print_data_from_data().
- *
- * Returns: the size of the freshly allocated buffer, or 0 on error.
- */
-API_EXPORTED size_t fp_print_data_get_data(struct fp_print_data *data,
+/* FP2 holds the samples in their in-memory, host endian layout, so that
+ * they can be used in place; see fpi_print_data_from_mapped(). */
+size_t fpi_print_data_get_fp2_data(struct fp_print_data *data,
 	unsigned char **ret)
 {
 	struct fpi_print_data_fp2 *out_data;
 	struct fpi_print_data_item_fp2 *out_item;
 	struct fp_print_data_item *item;
 	size_t buflen = 0;
-	GSList *list_item;
+	unsigned int i;
 	unsigned char *buf;
 
 	fp_dbg("");
 
-	list_item = data->prints;
-	while (list_item) {
-		item = list_item->data;
+	for (i = 0; i < data->nr_items; i++) {
 		buflen += sizeof(*out_item);
-		buflen += item->length;
-		list_item = g_slist_next(list_item);
+		buflen += data->items[i].length;
 	}
 
 	buflen += sizeof(*out_data);
@@ -171,21 +305,217 @@ API_EXPORTED size_t fp_print_data_get_data(struct fp_print_data *data,
 	out_data->devtype = GUINT32_TO_LE(data->devtype);
 	out_data->data_type = data->type;
 
-	list_item = data->prints;
-	while (list_item) {
-		item = list_item->data;
+	for (i = 0; i < data->nr_items; i++) {
+		item = &data->items[i];
 		out_item = (struct fpi_print_data_item_fp2 *)buf;
 		out_item->length = GUINT32_TO_LE(item->length);
 		/* FIXME: fp_print_data_item->data content is not endianess agnostic */
 		memcpy(out_item->data, item->data, item->length);
 		buf += sizeof(*out_item);
 		buf += item->length;
-		list_item = g_slist_next(list_item);
 	}
 
 	return buflen;
 }
 
+/* Where an FP3 representation is written. Writes past size are only
+ * counted, so that a first pass with no buffer gives the length. */
+struct fp3_out {
+	unsigned char *buf;
+	size_t size;
+	size_t len;
+};
+
+static void fp3_put(struct fp3_out *out, const void *p, size_t n)
+{
+	if (out->len + n <= out->size)
+		memcpy(out->buf + out->len, p, n);
+	out->len += n;
+}
+
+static void fp3_put_u16(struct fp3_out *out, guint16 v)
+{
+	v = GUINT16_TO_LE(v);
+	fp3_put(out, &v, sizeof(v));
+}
+
+static void fp3_put_u32(struct fp3_out *out, guint32 v)
+{
+	v = GUINT32_TO_LE(v);
+	fp3_put(out, &v, sizeof(v));
+}
+
+static void fp3_put_section(struct fp3_out *out, guint8 type, guint32 length)
+{
+	fp3_put(out, &type, 1);
+	fp3_put_u32(out, length);
+}
+
+static gboolean fp3_fits_s16(int v)
+{
+	return v >= G_MININT16 && v <= G_MAXINT16;
+}
+
+/* Writes a minutiae section for the sample, or returns FALSE if it can't
+ * be represented as one. */
+static gboolean fp3_put_minutiae(struct fp3_out *out,
+	struct fp_print_data_item *item)
+{
+	const struct xyt_struct *xyt = (const struct xyt_struct *) item->data;
+	int i;
+
+	if (item->length != sizeof(*xyt) || xyt->nrows < 0
+			|| xyt->nrows > MAX_BOZORTH_MINUTIAE)
+		return FALSE;
+	for (i = 0; i < xyt->nrows; i++)
+		if (!fp3_fits_s16(xyt->xcol[i]) || !fp3_fits_s16(xyt->ycol[i])
+				|| !fp3_fits_s16(xyt->thetacol[i]))
+			return FALSE;
+
+	fp3_put_section(out, FP3_SECTION_MINUTIAE, 2 + xyt->nrows * 6);
+	fp3_put_u16(out, xyt->nrows);
+	for (i = 0; i < xyt->nrows; i++) {
+		fp3_put_u16(out, (guint16) xyt->xcol[i]);
+		fp3_put_u16(out, (guint16) xyt->ycol[i]);
+		fp3_put_u16(out, (guint16) xyt->thetacol[i]);
+	}
+	return TRUE;
+}
+
+static void fp3_put_edges(struct fp3_out *out,
+	const struct bz_gallery *gallery)
+{
+	int i, j;
+
+	fp3_put_section(out, FP3_SECTION_EDGES,
+		4 + gallery->len * COLS_SIZE_2 * 4);
+	fp3_put_u32(out, gallery->len);
+	for (i = 0; i < gallery->len; i++)
+		for (j = 0; j < COLS_SIZE_2; j++)
+			fp3_put_u32(out, (guint32) gallery->colpt[i][j]);
+}
+
+static void fp3_put_print(struct fp3_out *out, struct fp_print_data *data,
+	unsigned int flags)
+{
+	struct fpi_print_data_fp2 hdr;
+	unsigned int i;
+
+	memcpy(hdr.prefix, "FP3", 3);
+	hdr.driver_id = GUINT16_TO_LE(data->driver_id);
+	hdr.devtype = GUINT32_TO_LE(data->devtype);
+	hdr.data_type = data->type;
+	fp3_put(out, &hdr, sizeof(hdr));
+
+	for (i = 0; i < data->nr_items; i++) {
+		struct fp_print_data_item *item = &data->items[i];
+		struct bz_gallery *gallery;
+
+		if (data->type != PRINT_DATA_NBIS_MINUTIAE
+				|| !fp3_put_minutiae(out, item)) {
+			/* FIXME: raw samples are not endianess agnostic */
+			fp3_put_section(out, FP3_SECTION_RAW, item->length);
+			fp3_put(out, item->data, item->length);
+			continue;
+		}
+
+		gallery = g_atomic_pointer_get(&item->bz_gallery);
+		if ((flags & FP_PRINT_DATA_EDGES) && gallery)
+			fp3_put_edges(out, gallery);
+	}
+}
+
+/**
+ * fp_print_data_export:
+ * @data: the stored print
+ * @flags: a bitwise combination of #fp_print_data_flags
+ * @ret: output location for the data buffer. Must be freed with free()
+ * after use.
+ *
+ * Like fp_print_data_get_data(), with optional extra content selected by
+ * @flags.
+ *
+ * Returns: the size of the freshly allocated buffer, or 0 on error.
+ */
+API_EXPORTED size_t fp_print_data_export(struct fp_print_data *data,
+	unsigned int flags, unsigned char **ret)
+{
+	struct fp3_out out = { NULL, 0, 0 };
+	int scope;
+
+	fp_dbg("flags %x", flags);
+
+	/* a print the tables could not be built for is exported without */
+	if (flags & FP_PRINT_DATA_EDGES)
+		fpi_img_prepare_print_data(data);
+
+	/* measure, then write, again if the tables appeared in between */
+	fp3_put_print(&out, data, flags);
+	scope = fpi_alloc_scope_push(FP_ALLOC_DATA);
+	do {
+		g_free(out.buf);
+		out.size = out.len;
+		out.buf = g_malloc(out.size);
+		out.len = 0;
+		fp3_put_print(&out, data, flags);
+	} while (out.len > out.size);
+	fpi_alloc_scope_pop(scope);
+
+	*ret = out.buf;
+	return out.len;
+}
+
+/**
+ * fp_print_data_export_to_buffer:
+ * @data: the stored print
+ * @flags: a bitwise combination of #fp_print_data_flags
+ * @buf: the buffer to write the data to, or %NULL if @size is 0
+ * @size: the size of @buf
+ *
+ * Like fp_print_data_export(), writing to a buffer owned by the caller
+ * rather than allocating one, so that prints can be serialized repeatedly
+ * into the same memory. Call with a @size of 0 to find out how much room
+ * is needed. If @buf turns out to be too small, its content is undefined.
+ *
+ * With #FP_PRINT_DATA_EDGES, the matcher's tables may be built by the
+ * first call, so the size it returns may grow once.
+ *
+ * Returns: the size of the data, which was only fully written to @buf if
+ * it is no larger than @size.
+ */
+API_EXPORTED size_t fp_print_data_export_to_buffer(
+	struct fp_print_data *data, unsigned int flags, unsigned char *buf,
+	size_t size)
+{
+	struct fp3_out out = { buf, size, 0 };
+
+	if (flags & FP_PRINT_DATA_EDGES)
+		fpi_img_prepare_print_data(data);
+
+	fp3_put_print(&out, data, flags);
+	return out.len;
+}
+
+/**
+ * fp_print_data_get_data:
+ * @data: the stored print
+ * @ret: output location for the data buffer. Must be freed with free()
+ * after use.
+
+ * Convert a stored print into a unified representation inside a data buffer.
+ * You can then store this data buffer in any way that suits you, and load
+ * it back at some later time using fp_print_data_from_data(). The
+ * representation only holds the minutiae actually found, in little endian
+ * order, so it can be moved between machines.
+ *
+ * Returns: the size of the freshly allocated buffer, or 0 on error.
+ */
+API_EXPORTED size_t fp_print_data_get_data(struct fp_print_data *data,
+	unsigned char **ret)
+{
+	return fp_print_data_export(data, 0, ret);
+}
+
 static struct fp_print_data *fpi_print_data_from_fp1_data(unsigned char *buf,
 	size_t buflen)
 {
@@ -197,23 +527,24 @@ static struct fp_print_data *fpi_print_data_from_fp1_data(unsigned char *buf,
 	print_data_len = buflen - sizeof(*raw);
 	data = print_data_new(GUINT16_FROM_LE(raw->driver_id),
 		GUINT32_FROM_LE(raw->devtype), raw->data_type);
-	item = fpi_print_data_item_new(print_data_len);
+	item = fpi_print_data_add_item(data, print_data_len);
 	/* FIXME: fp_print_data->data content is not endianess agnostic */
 	memcpy(item->data, raw->data, print_data_len);
-	data->prints = g_slist_prepend(data->prints, item);
 
 	return data;
 }
 
-static struct fp_print_data *fpi_print_data_from_fp2_data(unsigned char *buf,
-	size_t buflen)
+/* Items borrow from map if it is set, and are copied out of buf otherwise. */
+static struct fp_print_data *fpi_print_data_from_fp2_data(
+	const unsigned char *buf, size_t buflen, GMappedFile *map)
 {
 	size_t total_data_len, item_len;
 	struct fp_print_data *data;
 	struct fp_print_data_item *item;
-	struct fpi_print_data_fp2 *raw = (struct fpi_print_data_fp2 *) buf;
-	unsigned char *raw_buf;
-	struct fpi_print_data_item_fp2 *raw_item;
+	const struct fpi_print_data_fp2 *raw =
+		(const struct fpi_print_data_fp2 *) buf;
+	const unsigned char *raw_buf;
+	const struct fpi_print_data_item_fp2 *raw_item;
 
 	total_data_len = buflen - sizeof(*raw);
 	data = print_data_new(GUINT16_FROM_LE(raw->driver_id),
@@ -224,7 +555,7 @@ static struct fp_print_data *fpi_print_data_from_fp2_data(unsigned char *buf,
 			break;
 		total_data_len -= sizeof(*raw_item);
 
-		raw_item = (struct fpi_print_data_item_fp2 *)raw_buf;
+		raw_item = (const struct fpi_print_data_item_fp2 *)raw_buf;
 		item_len = GUINT32_FROM_LE(raw_item->length);
 		fp_dbg("item len %d, total_data_len %d", item_len, total_data_len);
 		if (total_data_len < item_len) {
@@ -233,16 +564,20 @@ static struct fp_print_data *fpi_print_data_from_fp2_data(unsigned char *buf,
 		}
 		total_data_len -= item_len;
 
-		item = fpi_print_data_item_new(item_len);
 		/* FIXME: fp_print_data->data content is not endianess agnostic */
-		memcpy(item->data, raw_item->data, item_len);
-		data->prints = g_slist_prepend(data->prints, item);
+		if (map) {
+			print_data_add_borrowed_item(data, map, raw_item->data,
+				item_len);
+		} else {
+			item = fpi_print_data_add_item(data, item_len);
+			memcpy(item->data, raw_item->data, item_len);
+		}
 
 		raw_buf += sizeof(*raw_item);
 		raw_buf += item_len;
 	}
 
-	if (g_slist_length(data->prints) == 0) {
+	if (data->nr_items == 0) {
 		fp_print_data_free(data);
 		data = NULL;
 	}
@@ -267,20 +602,180 @@ API_EXPORTED struct fp_print_data *fp_print_data_from_data(unsigned char *buf,
 	size_t buflen)
 {
 	struct fpi_print_data_fp2 *raw = (struct fpi_print_data_fp2 *) buf;
+	struct fp_print_data *data = NULL;
+	int scope;
 
 	fp_dbg("buffer size %zd", buflen);
 	if (buflen < sizeof(*raw))
 		return NULL;
 
+	scope = fpi_alloc_scope_push(FP_ALLOC_DATA);
 	if (strncmp(raw->prefix, "FP1", 3) == 0) {
-		return fpi_print_data_from_fp1_data(buf, buflen);
+		data = fpi_print_data_from_fp1_data(buf, buflen);
 	} else if (strncmp(raw->prefix, "FP2", 3) == 0) {
-		return fpi_print_data_from_fp2_data(buf, buflen);
+		data = fpi_print_data_from_fp2_data(buf, buflen, NULL);
+	} else if (strncmp(raw->prefix, "FP3", 3) == 0) {
+		data = fpi_print_data_from_fp3_data(buf, buflen);
 	} else {
 		fp_dbg("bad header prefix");
 	}
+	fpi_alloc_scope_pop(scope);
 
-	return NULL;
+	return data;
+}
+
+static guint16 fp3_get_u16(const unsigned char *p)
+{
+	guint16 v;
+	memcpy(&v, p, sizeof(v));
+	return GUINT16_FROM_LE(v);
+}
+
+static guint32 fp3_get_u32(const unsigned char *p)
+{
+	guint32 v;
+	memcpy(&v, p, sizeof(v));
+	return GUINT32_FROM_LE(v);
+}
+
+static struct fp_print_data_item *fp3_get_minutiae(const unsigned char *p,
+	size_t len, struct fp_print_data *data)
+{
+	struct fp_print_data_item *item;
+	struct xyt_struct *xyt;
+	unsigned int nrows, i;
+
+	if (len < 2)
+		return NULL;
+	nrows = fp3_get_u16(p);
+	if (nrows > MAX_BOZORTH_MINUTIAE || len != 2 + nrows * 6)
+		return NULL;
+	p += 2;
+
+	item = fpi_print_data_add_item(data, sizeof(*xyt));
+	xyt = (struct xyt_struct *) item->data;
+	xyt->nrows = nrows;
+	for (i = 0; i < nrows; i++, p += 6) {
+		xyt->xcol[i] = (gint16) fp3_get_u16(p);
+		xyt->ycol[i] = (gint16) fp3_get_u16(p + 2);
+		xyt->thetacol[i] = (gint16) fp3_get_u16(p + 4);
+	}
+	return item;
+}
+
+/* Attaches saved edge tables to a minutiae sample. The matcher indexes the
+ * minutiae with them, so rows that don't fit the sample are rejected. */
+static gboolean fp3_get_edges(struct fp_print_data_item *item,
+	const unsigned char *p, size_t len)
+{
+	struct xyt_struct *xyt = (struct xyt_struct *) item->data;
+	struct bz_gallery *gallery;
+	guint32 rows, i;
+
+	if (len < 4)
+		return FALSE;
+	rows = fp3_get_u32(p);
+	if (rows > FCOLS_SIZE_1 || len != 4 + rows * COLS_SIZE_2 * 4)
+		return FALSE;
+	p += 4;
+
+	gallery = bozorth_gallery_new(xyt, rows);
+	if (!gallery)
+		return FALSE;
+	for (i = 0; i < rows; i++) {
+		int *col = gallery->cols[i];
+		int j;
+
+		for (j = 0; j < COLS_SIZE_2; j++, p += 4)
+			col[j] = (gint32) fp3_get_u32(p);
+		if (col[0] < 0 || col[0] > DM * DM
+				|| col[1] < -180 || col[1] > 180
+				|| col[2] < -180 || col[2] > 180
+				|| col[3] < 1 || col[3] >= col[4]
+				|| col[4] > xyt->nrows
+				|| col[5] < -180 || col[5] > 580) {
+			bozorth_gallery_free(gallery);
+			return FALSE;
+		}
+	}
+
+	fpi_img_print_data_item_release(item);
+	item->bz_gallery = gallery;
+	return TRUE;
+}
+
+static struct fp_print_data *fpi_print_data_from_fp3_data(
+	const unsigned char *buf, size_t buflen)
+{
+	const struct fpi_print_data_fp2 *raw =
+		(const struct fpi_print_data_fp2 *) buf;
+	struct fp_print_data *data;
+	struct fp_print_data_item *minutiae = NULL;
+	const unsigned char *p = raw->data;
+	size_t left = buflen - sizeof(*raw);
+
+	data = print_data_new(GUINT16_FROM_LE(raw->driver_id),
+		GUINT32_FROM_LE(raw->devtype), raw->data_type);
+
+	while (left >= sizeof(struct fpi_print_data_section_fp3)) {
+		const struct fpi_print_data_section_fp3 *section =
+			(const struct fpi_print_data_section_fp3 *) p;
+		struct fp_print_data_item *item = NULL;
+		guint32 len = GUINT32_FROM_LE(section->length);
+
+		left -= sizeof(*section);
+		if (len > left) {
+			fp_err("corrupted fingerprint data");
+			break;
+		}
+
+		switch (section->type) {
+		case FP3_SECTION_RAW:
+			item = fpi_print_data_add_item(data, len);
+			memcpy(item->data, section->data, len);
+			minutiae = NULL;
+			break;
+		case FP3_SECTION_MINUTIAE:
+			if (data->type == PRINT_DATA_NBIS_MINUTIAE)
+				item = fp3_get_minutiae(section->data, len, data);
+			if (!item)
+				fp_err("bad minutiae section");
+			minutiae = item;
+			break;
+		case FP3_SECTION_EDGES:
+			/* only an accelerator, they are rebuilt if unusable */
+			if (!minutiae || !fp3_get_edges(minutiae, section->data, len))
+				fp_dbg("ignoring edge tables");
+			break;
+		default:
+			fp_dbg("skipping section type %d", section->type);
+			break;
+		}
+
+		p += sizeof(*section) + len;
+		left -= len;
+	}
+
+	if (data->nr_items == 0) {
+		fp_print_data_free(data);
+		data = NULL;
+	}
+
+	return data;
+}
+
+/* Like fp_print_data_from_data(), but for a buffer inside map that stays
+ * mapped for as long as the returned print refers to it. */
+struct fp_print_data *fpi_print_data_from_mapped(GMappedFile *map,
+	const unsigned char *buf, size_t buflen)
+{
+	const struct fpi_print_data_fp2 *raw =
+		(const struct fpi_print_data_fp2 *) buf;
+
+	if (buflen < sizeof(*raw) || strncmp(raw->prefix, "FP2", 3) != 0)
+		return fp_print_data_from_data((unsigned char *) buf, buflen);
+
+	return fpi_print_data_from_fp2_data(buf, buflen, map);
 }
 
 static char *get_path_to_storedir(uint16_t driver_id, uint32_t devtype)
@@ -314,6 +809,131 @@ static char *get_path_to_print(struct fp_dev *dev, enum fp_finger finger)
 	return __get_path_to_print(dev->drv->id, dev->devtype, finger);
 }
 
+#define CALIBRATION_MAGIC "FPC1"
+#define CALIBRATION_MAGIC_LEN 4
+
+/* The calibration cache of a device lives next to the print store, in
+ * calibration/<driver id>/<devtype>/<bus>-<port path>. Devices are told apart
+ * by the USB port they are plugged in, as reading their serial number would
+ * take a transfer. */
+static char *get_path_to_calibration(struct fp_dev *dev)
+{
+	libusb_device *udev;
+	uint8_t ports[7];
+	char idstr[5];
+	char devtypestr[9];
+	char *fprint_dir;
+	char *path;
+	GString *key;
+	int nr_ports;
+	int i;
+
+	if (!dev->udev)
+		return NULL;
+	if (!base_store)
+		storage_setup();
+	if (!base_store)
+		return NULL;
+
+	udev = libusb_get_device(dev->udev);
+	nr_ports = libusb_get_port_numbers(udev, ports, sizeof(ports));
+	if (nr_ports < 0)
+		return NULL;
+
+	key = g_string_new(NULL);
+	g_string_printf(key, "%d", libusb_get_bus_number(udev));
+	for (i = 0; i < nr_ports; i++)
+		g_string_append_printf(key, "%c%d", i ? '.' : '-', ports[i]);
+
+	g_snprintf(idstr, sizeof(idstr), "%04x", dev->drv->id);
+	g_snprintf(devtypestr, sizeof(devtypestr), "%08x", dev->devtype);
+
+	fprint_dir = g_path_get_dirname(base_store);
+	path = g_build_filename(fprint_dir, "calibration", idstr, devtypestr,
+		key->str, NULL);
+	g_free(fprint_dir);
+	g_string_free(key, TRUE);
+	return path;
+}
+
+/* Loads the len bytes of calibration a driver saved for this device with
+ * fpi_calibration_save(). The driver still has to check that they suit the
+ * sensor. Returns 0 on success, -ENOENT if there is none, or another negative
+ * error code. */
+int fpi_calibration_load(struct fp_dev *dev, void *data, size_t len)
+{
+	char *path = get_path_to_calibration(dev);
+	gchar *contents;
+	gsize length;
+	int r = 0;
+
+	if (!path)
+		return -ENOENT;
+
+	if (!g_file_get_contents(path, &contents, &length, NULL)) {
+		g_free(path);
+		return -ENOENT;
+	}
+
+	if (length != CALIBRATION_MAGIC_LEN + len ||
+	    memcmp(contents, CALIBRATION_MAGIC, CALIBRATION_MAGIC_LEN)) {
+		fp_dbg("ignoring bad calibration in %s", path);
+		r = -EILSEQ;
+	} else {
+		fp_dbg("loaded calibration from %s", path);
+		memcpy(data, contents + CALIBRATION_MAGIC_LEN, len);
+	}
+
+	g_free(contents);
+	g_free(path);
+	return r;
+}
+
+/* Saves calibration parameters for the next time the device is opened.
+ * Returns 0 on success, negative on error. */
+int fpi_calibration_save(struct fp_dev *dev, const void *data, size_t len)
+{
+	char *path = get_path_to_calibration(dev);
+	char *dirpath;
+	char *buf;
+	int r = 0;
+
+	if (!path)
+		return -ENOENT;
+
+	dirpath = g_path_get_dirname(path);
+	if (g_mkdir_with_parents(dirpath, DIR_PERMS) < 0) {
+		fp_err("couldn't create calibration directory");
+		r = -errno;
+		goto out;
+	}
+
+	buf = g_malloc(CALIBRATION_MAGIC_LEN + len);
+	memcpy(buf, CALIBRATION_MAGIC, CALIBRATION_MAGIC_LEN);
+	memcpy(buf + CALIBRATION_MAGIC_LEN, data, len);
+	if (!g_file_set_contents(path, buf, CALIBRATION_MAGIC_LEN + len,
+			NULL)) {
+		fp_err("couldn't save calibration to %s", path);
+		r = -EIO;
+	}
+	g_free(buf);
+
+out:
+	g_free(dirpath);
+	g_free(path);
+	return r;
+}
+
+/* Drops the calibration of the device, once the sensor rejected it */
+void fpi_calibration_forget(struct fp_dev *dev)
+{
+	char *path = get_path_to_calibration(dev);
+
+	if (path)
+		g_unlink(path);
+	g_free(path);
+}
+
 /**
  * fp_print_data_save:
  * @data: the stored print to save to disk
@@ -347,10 +967,22 @@ API_EXPORTED int fp_print_data_save(struct fp_print_data *data,
 
 	fp_dbg("save %s print from driver %04x", finger_num_to_str(finger),
 		data->driver_id);
-	len = fp_print_data_get_data(data, &buf);
+	/* the packed store is mapped and its samples used in place, so it
+	 * keeps them in their in-memory layout */
+	if (store_user)
+		len = fpi_print_data_get_fp2_data(data, &buf);
+	else
+		len = fp_print_data_get_data(data, &buf);
 	if (!len)
 		return -ENOMEM;
 
+	if (store_user) {
+		r = fpi_store_save(store_user, data->driver_id, data->devtype,
+			finger, buf, len, TRUE);
+		free(buf);
+		return r;
+	}
+
 	path = __get_path_to_print(data->driver_id, data->devtype, finger);
 	dirpath = g_path_get_dirname(path);
 	r = g_mkdir_with_parents(dirpath, DIR_PERMS);
@@ -365,15 +997,285 @@ API_EXPORTED int fp_print_data_save(struct fp_print_data *data,
 	g_file_set_contents(path, buf, len, &err);
 	free(buf);
 	g_free(dirpath);
-	g_free(path);
 	if (err) {
 		r = err->code;
 		fp_err("save failed: %s", err->message);
 		g_error_free(err);
+		g_free(path);
 		/* FIXME interpret error codes */
 		return r;
 	}
 
+	fpi_geohash_save(data, path);
+	g_free(path);
+	return 0;
+}
+
+/* Asynchronous saves are written by a single thread, which takes all the
+ * saves queued by the time it gets to them as one batch: the prints are
+ * written to temporary files, or appended to the packed store, then synced
+ * to the disk together, before each print replaces its old file at once. */
+
+#define SAVE_BATCH_MAX 64
+
+struct save_job {
+	struct fp_print_data *data;
+	enum fp_finger finger;
+	fp_print_data_save_cb callback;
+	void *user_data;
+	unsigned char *buf;
+	size_t len;
+	char *user;		/* packed store */
+	char *path;		/* directory store */
+	char *tmp_path;
+	int fd;
+	int result;
+};
+
+static GMutex save_lock;
+static GAsyncQueue *save_queue = NULL;
+static GThread *save_thread = NULL;
+static struct save_job save_stop_job;
+
+static void save_job_complete(void *data)
+{
+	struct save_job *job = data;
+
+	job->callback(job->data, job->result, job->user_data);
+	g_free(job->user);
+	g_free(job->path);
+	g_free(job);
+}
+
+/* Writes the print of a directory store job to a temporary file next to
+ * its destination, leaving the file open to be synced. */
+static int save_job_write(struct save_job *job)
+{
+	char *dirpath;
+	size_t done;
+	ssize_t r;
+
+	dirpath = g_path_get_dirname(job->path);
+	r = g_mkdir_with_parents(dirpath, DIR_PERMS);
+	g_free(dirpath);
+	if (r < 0) {
+		fp_err("couldn't create storage directory");
+		return -errno;
+	}
+
+	job->tmp_path = g_strconcat(job->path, ".XXXXXX", NULL);
+	job->fd = g_mkstemp_full(job->tmp_path, O_RDWR | O_CLOEXEC, 0600);
+	if (job->fd < 0) {
+		r = -errno;
+		fp_err("couldn't create %s", job->tmp_path);
+		g_free(job->tmp_path);
+		job->tmp_path = NULL;
+		return r;
+	}
+
+	for (done = 0; done < job->len; done += r) {
+		r = write(job->fd, job->buf + done, job->len - done);
+		if (r < 0 && errno == EINTR) {
+			r = 0;
+		} else if (r <= 0) {
+			r = r < 0 ? -errno : -ENOSPC;
+			fp_err("save to %s failed with error %d", job->tmp_path, r);
+			return r;
+		}
+	}
+	return 0;
+}
+
+static void save_batch(struct save_job **jobs, unsigned int nr_jobs)
+{
+	GHashTable *dirs;
+	GHashTableIter iter;
+	gboolean packed = FALSE;
+	gboolean synced = FALSE;
+	gpointer dirpath;
+	unsigned int i;
+	int r;
+
+	for (i = 0; i < nr_jobs; i++) {
+		struct save_job *job = jobs[i];
+
+		if (job->user) {
+			job->result = fpi_store_save(job->user, job->data->driver_id,
+				job->data->devtype, job->finger, job->buf, job->len,
+				FALSE);
+			packed |= job->result == 0;
+		} else {
+			job->result = save_job_write(job);
+		}
+	}
+
+	/* one sync for all the prints in the batch */
+	r = packed ? fpi_store_flush() : 0;
+#ifdef HAVE_SYNCFS
+	for (i = 0; i < nr_jobs; i++)
+		if (jobs[i]->result == 0 && jobs[i]->fd >= 0) {
+			synced = syncfs(jobs[i]->fd) == 0;
+			break;
+		}
+#endif
+
+	dirs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	for (i = 0; i < nr_jobs; i++) {
+		struct save_job *job = jobs[i];
+
+		if (job->user && job->result == 0)
+			job->result = r;
+		if (!job->tmp_path)
+			continue;
+
+		if (job->result == 0 && !synced && fsync(job->fd) < 0)
+			job->result = -errno;
+		if (job->result == 0 && g_rename(job->tmp_path, job->path) < 0)
+			job->result = -errno;
+		close(job->fd);
+		if (job->result < 0) {
+			g_unlink(job->tmp_path);
+		} else {
+			g_hash_table_add(dirs, g_path_get_dirname(job->path));
+			fpi_geohash_save(job->data, job->path);
+		}
+		g_free(job->tmp_path);
+		job->tmp_path = NULL;
+	}
+
+	/* and one per directory for the renames */
+	g_hash_table_iter_init(&iter, dirs);
+	while (g_hash_table_iter_next(&iter, &dirpath, NULL)) {
+		int fd = g_open(dirpath, O_RDONLY | O_DIRECTORY | O_CLOEXEC, 0);
+
+		if (fd < 0 || fsync(fd) < 0)
+			fp_warn("couldn't sync %s", (char *) dirpath);
+		if (fd >= 0)
+			close(fd);
+	}
+	g_hash_table_destroy(dirs);
+
+	for (i = 0; i < nr_jobs; i++) {
+		fp_dbg("saved %s print with result %d",
+			finger_num_to_str(jobs[i]->finger), jobs[i]->result);
+		free(jobs[i]->buf);
+		jobs[i]->buf = NULL;
+		fpi_poll_defer(save_job_complete, jobs[i]);
+	}
+}
+
+static gpointer save_thread_func(gpointer unused)
+{
+	struct save_job *jobs[SAVE_BATCH_MAX];
+	gboolean stop = FALSE;
+
+	fpi_thread_drop_realtime();
+	while (!stop) {
+		struct save_job *job = g_async_queue_pop(save_queue);
+		unsigned int nr_jobs = 0;
+
+		do {
+			if (job == &save_stop_job) {
+				stop = TRUE;
+				break;
+			}
+			jobs[nr_jobs++] = job;
+		} while (nr_jobs < SAVE_BATCH_MAX
+			&& (job = g_async_queue_try_pop(save_queue)));
+
+		if (nr_jobs)
+			save_batch(jobs, nr_jobs);
+	}
+	return NULL;
+}
+
+/* Waits for the queued saves to be written, and stops the writer. */
+static void save_writer_stop(void)
+{
+	g_mutex_lock(&save_lock);
+	if (save_thread) {
+		g_async_queue_push(save_queue, &save_stop_job);
+		g_thread_join(save_thread);
+		save_thread = NULL;
+	}
+	g_mutex_unlock(&save_lock);
+}
+
+/**
+ * fp_async_print_data_save:
+ * @data: the stored print to save to disk
+ * @finger: the finger that this print corresponds to
+ * @callback: the function to call once the print is saved, or saving it
+ * failed
+ * @user_data: data to pass to @callback
+ *
+ * Saves a stored print like fp_print_data_save() does, without waiting for
+ * the disk. The print is written by a background thread, which batches the
+ * saves made in the meantime so that they are synced to the disk together.
+ * A print replaces the one previously saved for the same finger and device
+ * type at once, so that a crash leaves either of them, never a partial
+ * print.
+ *
+ * @callback is called from the thread handling events, with 0 as result
+ * once the print is safely on disk, or with a negative error code. @data
+ * must not be used or freed until then. fp_exit() waits for the pending
+ * saves to be completed.
+ *
+ * Returns: 0 if the save was queued, negative on error
+ */
+API_EXPORTED int fp_async_print_data_save(struct fp_print_data *data,
+	enum fp_finger finger, fp_print_data_save_cb callback, void *user_data)
+{
+	struct save_job *job;
+	unsigned char *buf;
+	size_t len;
+
+	if (!FP_FINGER_IS_VALID(finger))
+		return -EINVAL;
+	if (!fpi_poll_can_defer())
+		return -ENOTSUP;
+	if (!base_store)
+		storage_setup();
+	if (!base_store)
+		return -ENOENT;
+
+	if (store_user)
+		len = fpi_print_data_get_fp2_data(data, &buf);
+	else
+		len = fp_print_data_get_data(data, &buf);
+	if (!len)
+		return -ENOMEM;
+
+	g_mutex_lock(&save_lock);
+	if (!save_queue)
+		save_queue = g_async_queue_new();
+	if (!save_thread) {
+		save_thread = g_thread_try_new("fp-save", save_thread_func, NULL,
+			NULL);
+		if (!save_thread) {
+			g_mutex_unlock(&save_lock);
+			free(buf);
+			return -ENOMEM;
+		}
+	}
+
+	job = g_malloc0(sizeof(*job));
+	job->data = data;
+	job->finger = finger;
+	job->callback = callback;
+	job->user_data = user_data;
+	job->buf = buf;
+	job->len = len;
+	job->fd = -1;
+	if (store_user)
+		job->user = g_strdup(store_user);
+	else
+		job->path = __get_path_to_print(data->driver_id, data->devtype,
+			finger);
+	fp_dbg("queue %s print from driver %04x", finger_num_to_str(finger),
+		data->driver_id);
+	g_async_queue_push(save_queue, job);
+	g_mutex_unlock(&save_lock);
 	return 0;
 }
 
@@ -423,6 +1325,37 @@ static int load_from_file(char *path, struct fp_print_data **data)
 	g_free(contents);
 	if (!fdata)
 		return -EIO;
+	fpi_geohash_load(fdata, path);
+	*data = fdata;
+	return 0;
+}
+
+static int load_from_store(const char *user, uint16_t driver_id,
+	uint32_t devtype, enum fp_finger finger, struct fp_print_data **data)
+{
+	GMappedFile *map;
+	const unsigned char *contents;
+	size_t length;
+	struct fp_print_data *fdata;
+	int scope;
+	int r;
+
+	fp_dbg("%s print of %s from store", finger_num_to_str(finger), user);
+	r = fpi_store_load(user, driver_id, devtype, finger, &map, &contents,
+		&length);
+	if (r < 0)
+		return r;
+
+	/* the samples are used straight from the mapping, which pages are
+	 * shared with any other process that loaded them */
+	scope = fpi_alloc_scope_push(FP_ALLOC_DATA);
+	fdata = fpi_print_data_from_mapped(map, contents, length);
+	fpi_alloc_scope_pop(scope);
+	g_mapped_file_unref(map);
+	if (!fdata)
+		return -EIO;
+	/* there are no sidecars next to packed prints */
+	fpi_geohash_load(fdata, NULL);
 	*data = fdata;
 	return 0;
 }
@@ -453,9 +1386,14 @@ API_EXPORTED int fp_print_data_load(struct fp_dev *dev,
 	if (!base_store)
 		storage_setup();
 
-	path = get_path_to_print(dev, finger);
-	r = load_from_file(path, &fdata);
-	g_free(path);
+	if (store_user) {
+		r = load_from_store(store_user, dev->drv->id, dev->devtype, finger,
+			&fdata);
+	} else {
+		path = get_path_to_print(dev, finger);
+		r = load_from_file(path, &fdata);
+		g_free(path);
+	}
 	if (r)
 		return r;
 
@@ -482,8 +1420,15 @@ API_EXPORTED int fp_print_data_delete(struct fp_dev *dev,
 	enum fp_finger finger)
 {
 	int r;
-	gchar *path = get_path_to_print(dev, finger);
+	gchar *path;
 
+	if (store_user) {
+		fp_dbg("remove finger %d of %s from store", finger, store_user);
+		return fpi_store_delete(store_user, dev->drv->id, dev->devtype,
+			finger);
+	}
+
+	path = get_path_to_print(dev, finger);
 	fp_dbg("remove finger %d at %s", finger, path);
 	r = g_unlink(path);
 	g_free(path);
@@ -512,6 +1457,9 @@ API_EXPORTED int fp_print_data_delete(struct fp_dev *dev,
 API_EXPORTED int fp_print_data_from_dscv_print(struct fp_dscv_print *print,
 	struct fp_print_data **data)
 {
+	if (print->user)
+		return load_from_store(print->user, print->driver_id,
+			print->devtype, print->finger, data);
 	return load_from_file(print->path, data);
 }
 
@@ -523,8 +1471,19 @@ API_EXPORTED int fp_print_data_from_dscv_print(struct fp_dscv_print *print,
  */
 API_EXPORTED void fp_print_data_free(struct fp_print_data *data)
 {
-	if (data)
-		g_slist_free_full(data->prints, (GDestroyNotify)fpi_print_data_item_free);
+	unsigned int i;
+
+	if (!data)
+		return;
+
+	for (i = 0; i < data->nr_items; i++) {
+		struct fp_print_data_item *item = &data->items[i];
+
+		fpi_img_print_data_item_release(item);
+		if (item->map)
+			g_mapped_file_unref(item->map);
+	}
+	g_free(data->items);
 	g_free(data);
 }
 
@@ -622,7 +1581,7 @@ static GSList *scan_dev_store_dir(char *devpath, uint16_t driver_id,
 		}
 
 		finger = (enum fp_finger) val;
-		print = g_malloc(sizeof(*print));
+		print = g_malloc0(sizeof(*print));
 		print->driver_id = driver_id;
 		print->devtype = devtype;
 		print->path = g_build_filename(devpath, ent, NULL);
@@ -696,6 +1655,11 @@ API_EXPORTED struct fp_dscv_print **fp_discover_prints(void)
 	if (!base_store)
 		storage_setup();
 
+	if (store_user) {
+		tmplist = fpi_store_discover(store_user, NULL);
+		goto out;
+	}
+
 	dir = g_dir_open(base_store, 0, &err);
 	if (!dir) {
 		fp_err("opendir %s failed: %s", base_store, err->message);
@@ -726,6 +1690,7 @@ API_EXPORTED struct fp_dscv_print **fp_discover_prints(void)
 	}
 
 	g_dir_close(dir);
+out:
 	tmplist_len = g_slist_length(tmplist);
 	list = g_malloc(sizeof(*list) * (tmplist_len + 1));
 	elem = tmplist;
@@ -755,8 +1720,10 @@ API_EXPORTED void fp_dscv_prints_free(struct fp_dscv_print **prints)
 		return;
 
 	for (i = 0; (print = prints[i]); i++) {
-		if (print)
+		if (print) {
 			g_free(print->path);
+			g_free(print->user);
+		}
 		g_free(print);
 	}
 	g_free(prints);
@@ -819,10 +1786,16 @@ API_EXPORTED enum fp_finger fp_dscv_print_get_finger(struct fp_dscv_print *print
 API_EXPORTED int fp_dscv_print_delete(struct fp_dscv_print *print)
 {
 	int r;
+
+	if (print->user)
+		return fpi_store_delete(print->user, print->driver_id,
+			print->devtype, print->finger);
+
 	fp_dbg("remove at %s", print->path);
 	r = g_unlink(print->path);
 	if (r < 0)
 		fp_dbg("unlink failed with error %d", r);
+	fpi_geohash_delete(print->path);
 
 	/* FIXME: cleanup empty directory */
 	return r;
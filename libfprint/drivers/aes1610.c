@@ -71,21 +71,25 @@ static int adjust_gain(unsigned char *buffer, int status);
 /* maximum number of frames to read during a scan */
 /* FIXME reduce substantially */
 #define MAX_FRAMES		350
+/* blank strips in a row after which the finger is gone */
+#define SWIPE_END_BLANKS	11
 
 /****** GENERAL FUNCTIONS ******/
 
 struct aes1610_dev {
 	uint8_t read_regs_retry_count;
-	GSList *strips;
-	size_t strips_len;
+	struct fpi_asmbl_stream *strips;
 	gboolean deactivating;
-	uint8_t blanks_count;
+	struct aes_swipe swipe;
 };
 
 static struct fpi_frame_asmbl_ctx assembling_ctx = {
 	.frame_width = FRAME_WIDTH,
 	.frame_height = FRAME_HEIGHT,
 	.image_width = IMAGE_WIDTH,
+	.layout = FPI_FRAME_LAYOUT_AES4,
+	/* one pixel in twenty a level apart */
+	.dup_threshold = 16,
 	.get_pixel = aes_get_pixel,
 };
 
@@ -149,7 +153,7 @@ static void generic_read_ignore_data(struct fpi_ssm *ssm, size_t bytes)
 	libusb_fill_bulk_transfer(transfer, ssm->dev->udev, EP_IN, data, bytes,
 		generic_ignore_data_cb, ssm, BULK_TIMEOUT);
 
-	r = libusb_submit_transfer(transfer);
+	r = fpi_usb_submit_transfer(transfer);
 	if (r < 0) {
 		g_free(data);
 		libusb_free_transfer(transfer);
@@ -242,7 +246,7 @@ static void finger_det_reqs_cb(struct fp_img_dev *dev, int result, void *user_da
 	libusb_fill_bulk_transfer(transfer, dev->udev, EP_IN, data, 19,
 		finger_det_data_cb, dev, BULK_TIMEOUT);
 
-	r = libusb_submit_transfer(transfer);
+	r = fpi_usb_submit_transfer(transfer);
 	if (r < 0) {
 		g_free(data);
 		libusb_free_transfer(transfer);
@@ -562,11 +566,11 @@ enum capture_states {
 
 static void capture_read_strip_cb(struct libusb_transfer *transfer)
 {
-	unsigned char *stripdata;
 	struct fpi_ssm *ssm = transfer->user_data;
 	struct fp_img_dev *dev = ssm->priv;
 	struct aes1610_dev *aesdev = dev->priv;
 	unsigned char *data = transfer->buffer;
+	enum aes_strip_verdict verdict;
 	int sum, i;
 
 	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
@@ -587,52 +591,29 @@ static void capture_read_strip_cb(struct libusb_transfer *transfer)
 		sum += data[i];
 	}
 
-	if (sum > 0) {
-		/* FIXME: would preallocating strip buffers be a decent optimization? */
-		struct fpi_frame *stripe = g_malloc(FRAME_WIDTH * (FRAME_HEIGHT / 2) + sizeof(struct fpi_frame));
-		stripe->delta_x = 0;
-		stripe->delta_y = 0;
-		stripdata = stripe->data;
-		memcpy(stripdata, data + 1, FRAME_WIDTH * (FRAME_HEIGHT / 2));
-		aesdev->strips = g_slist_prepend(aesdev->strips, stripe);
-		aesdev->strips_len++;
-		aesdev->blanks_count = 0;
-	}
-
-	if (sum < 0) {
-		fpi_ssm_mark_aborted(ssm, sum);
-		goto out;
-	}
 	fp_dbg("sum=%d", sum);
 
-	/* FIXME: 0 might be too low as a threshold */
-	/* FIXME: sometimes we get 0 in the middle of a scan, should we wait for
-	 * a few consecutive zeroes? */
-
-	/* If sum is 0 for a reasonable # of frames, finger has been removed */
-	if (sum == 0) {
-		aesdev->blanks_count++;
+	/* Blank strips, before the finger or after it, never reach the
+	 * assembly, and the swipe ends once the finger is gone */
+	verdict = aes_swipe_push(&aesdev->swipe, sum);
+	if (verdict == AES_STRIP_KEEP)
+		fpi_asmbl_stream_push(aesdev->strips, data + 1);
+	else
 		fp_dbg("got blank frame");
-	}
 
 	/* use histogram data above for gain calibration (0xbd, 0xbe, 0x29 and 0x2A ) */
 	adjust_gain(data, GAIN_STATUS_NORMAL);
 
 	/* stop capturing if MAX_FRAMES is reached */
-	if (aesdev->blanks_count > 10 || g_slist_length(aesdev->strips) >= MAX_FRAMES) {
+	if (verdict == AES_STRIP_END || fpi_asmbl_stream_len(aesdev->strips) >= MAX_FRAMES) {
 		struct fp_img *img;
 
-		fp_dbg("sending stop capture.... blanks=%d  frames=%d", aesdev->blanks_count, g_slist_length(aesdev->strips));
+		fp_dbg("sending stop capture.... blanks=%u  frames=%zu", aesdev->swipe.blanks, fpi_asmbl_stream_len(aesdev->strips));
 		/* send stop capture bits */
 		aes_write_regv(dev, capture_stop, G_N_ELEMENTS(capture_stop), stub_capture_stop_cb, NULL);
-		aesdev->strips = g_slist_reverse(aesdev->strips);
-		fpi_do_movement_estimation(&assembling_ctx, aesdev->strips, aesdev->strips_len);
-		img = fpi_assemble_frames(&assembling_ctx, aesdev->strips, aesdev->strips_len);
+		img = fpi_asmbl_stream_assemble(aesdev->strips);
 		img->flags |= FP_IMG_PARTIAL;
-		g_slist_free_full(aesdev->strips, g_free);
-		aesdev->strips = NULL;
-		aesdev->strips_len = 0;
-		aesdev->blanks_count = 0;
+		aes_swipe_reset(&aesdev->swipe);
 		fpi_imgdev_image_captured(dev, img);
 		fpi_imgdev_report_finger_status(dev, FALSE);
 		/* marking machine complete will re-trigger finger detection loop */
@@ -686,7 +667,7 @@ static void capture_run_state(struct fpi_ssm *ssm)
 		libusb_fill_bulk_transfer(transfer, dev->udev, EP_IN, data, 665,
 			capture_read_strip_cb, ssm, BULK_TIMEOUT);
 
-		r = libusb_submit_transfer(transfer);
+		r = fpi_usb_submit_transfer(transfer);
 		if (r < 0) {
 			g_free(data);
 			libusb_free_transfer(transfer);
@@ -797,16 +778,15 @@ static void complete_deactivation(struct fp_img_dev *dev)
 	 * maybe we can do this with a master reset, unconditionally? */
 
 	aesdev->deactivating = FALSE;
-	g_slist_free(aesdev->strips);
-	aesdev->strips = NULL;
-	aesdev->strips_len = 0;
-	aesdev->blanks_count = 0;
+	fpi_asmbl_stream_reset(aesdev->strips);
+	aes_swipe_reset(&aesdev->swipe);
 	fpi_imgdev_deactivate_complete(dev);
 }
 
 static int dev_init(struct fp_img_dev *dev, unsigned long driver_data)
 {
 	/* FIXME check endpoints */
+	struct aes1610_dev *aesdev;
 	int r;
 
 	r = libusb_claim_interface(dev->udev, 0);
@@ -815,14 +795,21 @@ static int dev_init(struct fp_img_dev *dev, unsigned long driver_data)
 		return r;
 	}
 
-	dev->priv = g_malloc0(sizeof(struct aes1610_dev));
+	aesdev = dev->priv = g_malloc0(sizeof(struct aes1610_dev));
+	aesdev->strips = fpi_asmbl_stream_new(&assembling_ctx,
+		FRAME_WIDTH * (FRAME_HEIGHT / 2));
+	aes_swipe_init(&aesdev->swipe, SWIPE_END_BLANKS, 0);
 	fpi_imgdev_open_complete(dev, 0);
 	return 0;
 }
 
 static void dev_deinit(struct fp_img_dev *dev)
 {
-	g_free(dev->priv);
+	struct aes1610_dev *aesdev = dev->priv;
+
+	fpi_asmbl_stream_free(aesdev->strips);
+	g_free(aesdev);
+	aes_regv_pool_free(dev);
 	libusb_release_interface(dev->udev, 0);
 	fpi_imgdev_close_complete(dev);
 }
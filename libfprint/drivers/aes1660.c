@@ -42,6 +42,7 @@ static struct fpi_frame_asmbl_ctx assembling_ctx = {
 	.frame_width = FRAME_WIDTH,
 	.frame_height = AESX660_FRAME_HEIGHT,
 	.image_width = IMAGE_WIDTH,
+	.layout = FPI_FRAME_LAYOUT_AES4,
 	.get_pixel = aes_get_pixel,
 };
 
@@ -66,6 +67,7 @@ static int dev_init(struct fp_img_dev *dev, unsigned long driver_data)
 	aesdev->start_imaging_cmd = (unsigned char *)aes1660_start_imaging_cmd;
 	aesdev->start_imaging_cmd_len = sizeof(aes1660_start_imaging_cmd);
 	aesdev->assembling_ctx = &assembling_ctx;
+	aesdev->strips = fpi_frame_slab_new(FRAME_WIDTH * AESX660_FRAME_HEIGHT / 2);
 	aesdev->extra_img_flags = FP_IMG_PARTIAL;
 
 	fpi_imgdev_open_complete(dev, 0);
@@ -76,6 +78,7 @@ static void dev_deinit(struct fp_img_dev *dev)
 {
 	struct aesX660_dev *aesdev = dev->priv;
 	g_free(aesdev->buffer);
+	fpi_frame_slab_free(aesdev->strips);
 	g_free(aesdev);
 	libusb_release_interface(dev->udev, 0);
 	fpi_imgdev_close_complete(dev);
@@ -63,21 +63,27 @@ static void complete_deactivation(struct fp_img_dev *dev);
 /* maximum number of frames to read during a scan */
 /* FIXME reduce substantially */
 #define MAX_FRAMES		150
+/* blank strips in a row after which the finger is gone */
+#define SWIPE_END_BLANKS	3
 
 /****** GENERAL FUNCTIONS ******/
 
 struct aes2501_dev {
 	uint8_t read_regs_retry_count;
-	GSList *strips;
-	size_t strips_len;
+	struct fpi_asmbl_stream *strips;
 	gboolean deactivating;
-	int no_finger_cnt;
+	struct aes_swipe swipe;
+	/* restarted for every finger */
+	struct fpi_ssm capture_ssm;
 };
 
 static struct fpi_frame_asmbl_ctx assembling_ctx = {
 	.frame_width = FRAME_WIDTH,
 	.frame_height = FRAME_HEIGHT,
 	.image_width = IMAGE_WIDTH,
+	.layout = FPI_FRAME_LAYOUT_AES4,
+	/* one pixel in twenty a level apart */
+	.dup_threshold = 16,
 	.get_pixel = aes_get_pixel,
 };
 
@@ -133,7 +139,7 @@ static void read_regs_rq_cb(struct fp_img_dev *dev, int result, void *user_data)
 	libusb_fill_bulk_transfer(transfer, dev->udev, EP_IN, data, 126,
 		read_regs_data_cb, rdata, BULK_TIMEOUT);
 
-	r = libusb_submit_transfer(transfer);
+	r = fpi_usb_submit_transfer(transfer);
 	if (r < 0) {
 		g_free(data);
 		libusb_free_transfer(transfer);
@@ -228,7 +234,7 @@ static void generic_read_ignore_data(struct fpi_ssm *ssm, size_t bytes)
 	libusb_fill_bulk_transfer(transfer, ssm->dev->udev, EP_IN, data, bytes,
 		generic_ignore_data_cb, ssm, BULK_TIMEOUT);
 
-	r = libusb_submit_transfer(transfer);
+	r = fpi_usb_submit_transfer(transfer);
 	if (r < 0) {
 		g_free(data);
 		libusb_free_transfer(transfer);
@@ -343,7 +349,7 @@ static void finger_det_reqs_cb(struct fp_img_dev *dev, int result,
 	libusb_fill_bulk_transfer(transfer, dev->udev, EP_IN, data, 20,
 		finger_det_data_cb, dev, BULK_TIMEOUT);
 
-	r = libusb_submit_transfer(transfer);
+	r = fpi_usb_submit_transfer(transfer);
 	if (r < 0) {
 		g_free(data);
 		libusb_free_transfer(transfer);
@@ -442,7 +448,6 @@ enum capture_states {
 
 static void capture_read_strip_cb(struct libusb_transfer *transfer)
 {
-	unsigned char *stripdata;
 	struct fpi_ssm *ssm = transfer->user_data;
 	struct fp_img_dev *dev = ssm->priv;
 	struct aes2501_dev *aesdev = dev->priv;
@@ -483,43 +488,27 @@ static void capture_read_strip_cb(struct libusb_transfer *transfer)
 	}
 	fp_dbg("ADREFHI is %.2x", strip_scan_reqs[4].value);
 
-	/* Sum is 0, maybe finger was removed? Wait for 3 empty frames
-	 * to ensure
-	 */
-	if (sum == 0) {
-		aesdev->no_finger_cnt++;
-		if (aesdev->no_finger_cnt == 3) {
-			struct fp_img *img;
-
-			aesdev->strips = g_slist_reverse(aesdev->strips);
-			fpi_do_movement_estimation(&assembling_ctx,
-					aesdev->strips, aesdev->strips_len);
-			img = fpi_assemble_frames(&assembling_ctx,
-						  aesdev->strips, aesdev->strips_len);
-			img->flags |= FP_IMG_PARTIAL;
-			g_slist_free_full(aesdev->strips, g_free);
-			aesdev->strips = NULL;
-			aesdev->strips_len = 0;
-			fpi_imgdev_image_captured(dev, img);
-			fpi_imgdev_report_finger_status(dev, FALSE);
-			/* marking machine complete will re-trigger finger detection loop */
-			fpi_ssm_mark_completed(ssm);
-		} else {
-			fpi_ssm_jump_to_state(ssm, CAPTURE_REQUEST_STRIP);
-		}
-	} else {
+	/* Blank strips are dropped, and a few in a row mean the finger was
+	 * removed */
+	switch (aes_swipe_push(&aesdev->swipe, sum)) {
+	case AES_STRIP_END: {
+		struct fp_img *img;
+
+		img = fpi_asmbl_stream_assemble(aesdev->strips);
+		img->flags |= FP_IMG_PARTIAL;
+		fpi_imgdev_image_captured(dev, img);
+		fpi_imgdev_report_finger_status(dev, FALSE);
+		/* marking machine complete will re-trigger finger detection loop */
+		fpi_ssm_mark_completed(ssm);
+		break;
+	}
+	case AES_STRIP_KEEP:
 		/* obtain next strip */
-		/* FIXME: would preallocating strip buffers be a decent optimization? */
-		struct fpi_frame *stripe = g_malloc(FRAME_WIDTH * FRAME_HEIGHT / 2 + sizeof(struct fpi_frame));
-		stripe->delta_x = 0;
-		stripe->delta_y = 0;
-		stripdata = stripe->data;
-		memcpy(stripdata, data + 1, 192*8);
-		aesdev->no_finger_cnt = 0;
-		aesdev->strips = g_slist_prepend(aesdev->strips, stripe);
-		aesdev->strips_len++;
-
+		fpi_asmbl_stream_push(aesdev->strips, data + 1);
+		/* fall through */
+	case AES_STRIP_SKIP:
 		fpi_ssm_jump_to_state(ssm, CAPTURE_REQUEST_STRIP);
+		break;
 	}
 
 out:
@@ -568,7 +557,7 @@ static void capture_run_state(struct fpi_ssm *ssm)
 		libusb_fill_bulk_transfer(transfer, dev->udev, EP_IN, data, 1705,
 			capture_read_strip_cb, ssm, BULK_TIMEOUT);
 
-		r = libusb_submit_transfer(transfer);
+		r = fpi_usb_submit_transfer(transfer);
 		if (r < 0) {
 			g_free(data);
 			libusb_free_transfer(transfer);
@@ -590,26 +579,22 @@ static void capture_sm_complete(struct fpi_ssm *ssm)
 		fpi_imgdev_session_error(dev, ssm->error);
 	else
 		start_finger_detection(dev);
-	fpi_ssm_free(ssm);
 }
 
 static void start_capture(struct fp_img_dev *dev)
 {
 	struct aes2501_dev *aesdev = dev->priv;
-	struct fpi_ssm *ssm;
 
 	if (aesdev->deactivating) {
 		complete_deactivation(dev);
 		return;
 	}
 
-	aesdev->no_finger_cnt = 0;
+	aes_swipe_reset(&aesdev->swipe);
 	/* Reset gain */
 	strip_scan_reqs[4].value = AES2501_ADREFHI_MAX_VALUE;
-	ssm = fpi_ssm_new(dev->dev, capture_run_state, CAPTURE_NUM_STATES);
 	fp_dbg("");
-	ssm->priv = dev;
-	fpi_ssm_start(ssm, capture_sm_complete);
+	fpi_ssm_start(&aesdev->capture_ssm, capture_sm_complete);
 }
 
 /****** INITIALIZATION/DEINITIALIZATION ******/
@@ -837,15 +822,14 @@ static void complete_deactivation(struct fp_img_dev *dev)
 	 * maybe we can do this with a master reset, unconditionally? */
 
 	aesdev->deactivating = FALSE;
-	g_slist_free(aesdev->strips);
-	aesdev->strips = NULL;
-	aesdev->strips_len = 0;
+	fpi_asmbl_stream_reset(aesdev->strips);
 	fpi_imgdev_deactivate_complete(dev);
 }
 
 static int dev_init(struct fp_img_dev *dev, unsigned long driver_data)
 {
 	/* FIXME check endpoints */
+	struct aes2501_dev *aesdev;
 	int r;
 
 	r = libusb_claim_interface(dev->udev, 0);
@@ -854,14 +838,24 @@ static int dev_init(struct fp_img_dev *dev, unsigned long driver_data)
 		return r;
 	}
 
-	dev->priv = g_malloc0(sizeof(struct aes2501_dev));
+	aesdev = dev->priv = g_malloc0(sizeof(struct aes2501_dev));
+	aesdev->strips = fpi_asmbl_stream_new(&assembling_ctx,
+		FRAME_WIDTH * FRAME_HEIGHT / 2);
+	fpi_ssm_init(&aesdev->capture_ssm, dev->dev, capture_run_state,
+		CAPTURE_NUM_STATES);
+	aesdev->capture_ssm.priv = dev;
+	aes_swipe_init(&aesdev->swipe, SWIPE_END_BLANKS, 0);
 	fpi_imgdev_open_complete(dev, 0);
 	return 0;
 }
 
 static void dev_deinit(struct fp_img_dev *dev)
 {
-	g_free(dev->priv);
+	struct aes2501_dev *aesdev = dev->priv;
+
+	fpi_asmbl_stream_free(aesdev->strips);
+	g_free(aesdev);
+	aes_regv_pool_free(dev);
 	libusb_release_interface(dev->udev, 0);
 	fpi_imgdev_close_complete(dev);
 }
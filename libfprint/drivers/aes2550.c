@@ -60,8 +60,7 @@ static void complete_deactivation(struct fp_img_dev *dev);
 #define IMAGE_WIDTH		(FRAME_WIDTH + (FRAME_WIDTH / 2))
 
 struct aes2550_dev {
-	GSList *strips;
-	size_t strips_len;
+	struct fpi_frame_slab *strips;
 	gboolean deactivating;
 	int heartbeat_cnt;
 };
@@ -70,6 +69,7 @@ static struct fpi_frame_asmbl_ctx assembling_ctx = {
 	.frame_width = FRAME_WIDTH,
 	.frame_height = FRAME_HEIGHT,
 	.image_width = IMAGE_WIDTH,
+	.layout = FPI_FRAME_LAYOUT_AES4,
 	.get_pixel = aes_get_pixel,
 };
 
@@ -144,7 +144,7 @@ static void finger_det_reqs_cb(struct libusb_transfer *t)
 	libusb_fill_bulk_transfer(transfer, dev->udev, EP_IN, data, AES2550_EP_IN_BUF_SIZE,
 		finger_det_data_cb, dev, BULK_TIMEOUT);
 
-	r = libusb_submit_transfer(transfer);
+	r = fpi_usb_submit_transfer(transfer);
 	if (r < 0) {
 		g_free(data);
 		libusb_free_transfer(transfer);
@@ -173,7 +173,7 @@ static void start_finger_detection(struct fp_img_dev *dev)
 	}
 	libusb_fill_bulk_transfer(transfer, dev->udev, EP_OUT, finger_det_reqs,
 		sizeof(finger_det_reqs), finger_det_reqs_cb, dev, BULK_TIMEOUT);
-	r = libusb_submit_transfer(transfer);
+	r = fpi_usb_submit_transfer(transfer);
 	if (r < 0) {
 		libusb_free_transfer(transfer);
 		fpi_imgdev_session_error(dev, r);
@@ -224,13 +224,11 @@ static int process_strip_data(struct fpi_ssm *ssm, unsigned char *data)
 	if (len != (AES2550_STRIP_SIZE - 3)) {
 		fp_dbg("Bogus frame len: %.4x\n", len);
 	}
-	stripe = g_malloc(FRAME_WIDTH * FRAME_HEIGHT / 2 + sizeof(struct fpi_frame)); /* 4 bits per pixel */
+	stripe = fpi_frame_slab_alloc(aesdev->strips);
 	stripe->delta_x = (int8_t)data[6];
 	stripe->delta_y = -(int8_t)data[7];
 	stripdata = stripe->data;
 	memcpy(stripdata, data + 33, FRAME_WIDTH * FRAME_HEIGHT / 2);
-	aesdev->strips = g_slist_prepend(aesdev->strips, stripe);
-	aesdev->strips_len++;
 
 	fp_dbg("deltas: %dx%d", stripe->delta_x, stripe->delta_y);
 
@@ -258,16 +256,12 @@ static void capture_set_idle_reqs_cb(struct libusb_transfer *transfer)
 
 	if ((transfer->status == LIBUSB_TRANSFER_COMPLETED) &&
 		(transfer->length == transfer->actual_length) &&
-		aesdev->strips_len) {
+		fpi_frame_slab_len(aesdev->strips)) {
 		struct fp_img *img;
 
-		aesdev->strips = g_slist_reverse(aesdev->strips);
-		img = fpi_assemble_frames(&assembling_ctx,
-					  aesdev->strips, aesdev->strips_len);
+		img = fpi_assemble_frames_slab(&assembling_ctx, aesdev->strips);
 		img->flags |= FP_IMG_PARTIAL;
-		g_slist_free_full(aesdev->strips, g_free);
-		aesdev->strips = NULL;
-		aesdev->strips_len = 0;
+		fpi_frame_slab_reset(aesdev->strips);
 		fpi_imgdev_image_captured(dev, img);
 		fpi_imgdev_report_finger_status(dev, FALSE);
 		/* marking machine complete will re-trigger finger detection loop */
@@ -346,7 +340,7 @@ static void capture_run_state(struct fpi_ssm *ssm)
 		}
 		libusb_fill_bulk_transfer(transfer, dev->udev, EP_OUT, capture_reqs,
 			sizeof(capture_reqs), capture_reqs_cb, ssm, BULK_TIMEOUT);
-		r = libusb_submit_transfer(transfer);
+		r = fpi_usb_submit_transfer(transfer);
 		if (r < 0) {
 			libusb_free_transfer(transfer);
 			fpi_ssm_mark_aborted(ssm, -ENOMEM);
@@ -367,7 +361,7 @@ static void capture_run_state(struct fpi_ssm *ssm)
 		libusb_fill_bulk_transfer(transfer, dev->udev, EP_IN, data, AES2550_EP_IN_BUF_SIZE,
 			capture_read_data_cb, ssm, BULK_TIMEOUT);
 
-		r = libusb_submit_transfer(transfer);
+		r = fpi_usb_submit_transfer(transfer);
 		if (r < 0) {
 			g_free(data);
 			libusb_free_transfer(transfer);
@@ -384,7 +378,7 @@ static void capture_run_state(struct fpi_ssm *ssm)
 		}
 		libusb_fill_bulk_transfer(transfer, dev->udev, EP_OUT, capture_set_idle_reqs,
 			sizeof(capture_set_idle_reqs), capture_set_idle_reqs_cb, ssm, BULK_TIMEOUT);
-		r = libusb_submit_transfer(transfer);
+		r = fpi_usb_submit_transfer(transfer);
 		if (r < 0) {
 			libusb_free_transfer(transfer);
 			fpi_ssm_mark_aborted(ssm, -ENOMEM);
@@ -506,7 +500,7 @@ static void activate_run_state(struct fpi_ssm *ssm)
 		}
 		libusb_fill_bulk_transfer(transfer, dev->udev, EP_OUT, init_reqs,
 			sizeof(init_reqs), init_reqs_cb, ssm, BULK_TIMEOUT);
-		r = libusb_submit_transfer(transfer);
+		r = fpi_usb_submit_transfer(transfer);
 		if (r < 0) {
 			libusb_free_transfer(transfer);
 			fpi_ssm_mark_aborted(ssm, -ENOMEM);
@@ -527,7 +521,7 @@ static void activate_run_state(struct fpi_ssm *ssm)
 		libusb_fill_bulk_transfer(transfer, dev->udev, EP_IN, data, AES2550_EP_IN_BUF_SIZE,
 			init_read_data_cb, ssm, BULK_TIMEOUT);
 
-		r = libusb_submit_transfer(transfer);
+		r = fpi_usb_submit_transfer(transfer);
 		if (r < 0) {
 			g_free(data);
 			libusb_free_transfer(transfer);
@@ -544,7 +538,7 @@ static void activate_run_state(struct fpi_ssm *ssm)
 		}
 		libusb_fill_bulk_transfer(transfer, dev->udev, EP_OUT, calibrate_reqs,
 			sizeof(calibrate_reqs), init_reqs_cb, ssm, BULK_TIMEOUT);
-		r = libusb_submit_transfer(transfer);
+		r = fpi_usb_submit_transfer(transfer);
 		if (r < 0) {
 			libusb_free_transfer(transfer);
 			fpi_ssm_mark_aborted(ssm, -ENOMEM);
@@ -565,7 +559,7 @@ static void activate_run_state(struct fpi_ssm *ssm)
 		libusb_fill_bulk_transfer(transfer, dev->udev, EP_IN, data, AES2550_EP_IN_BUF_SIZE,
 			calibrate_read_data_cb, ssm, BULK_TIMEOUT);
 
-		r = libusb_submit_transfer(transfer);
+		r = fpi_usb_submit_transfer(transfer);
 		if (r < 0) {
 			g_free(data);
 			libusb_free_transfer(transfer);
@@ -609,9 +603,7 @@ static void complete_deactivation(struct fp_img_dev *dev)
 	fp_dbg("");
 
 	aesdev->deactivating = FALSE;
-	g_slist_free(aesdev->strips);
-	aesdev->strips = NULL;
-	aesdev->strips_len = 0;
+	fpi_frame_slab_reset(aesdev->strips);
 	fpi_imgdev_deactivate_complete(dev);
 }
 
@@ -619,6 +611,7 @@ static int dev_init(struct fp_img_dev *dev, unsigned long driver_data)
 {
 	/* TODO check that device has endpoints we're using */
 	int r;
+	struct aes2550_dev *aesdev;
 
 	r = libusb_claim_interface(dev->udev, 0);
 	if (r < 0) {
@@ -626,14 +619,19 @@ static int dev_init(struct fp_img_dev *dev, unsigned long driver_data)
 		return r;
 	}
 
-	dev->priv = g_malloc0(sizeof(struct aes2550_dev));
+	dev->priv = aesdev = g_malloc0(sizeof(struct aes2550_dev));
+	/* 4 bits per pixel */
+	aesdev->strips = fpi_frame_slab_new(FRAME_WIDTH * FRAME_HEIGHT / 2);
 	fpi_imgdev_open_complete(dev, 0);
 	return 0;
 }
 
 static void dev_deinit(struct fp_img_dev *dev)
 {
-	g_free(dev->priv);
+	struct aes2550_dev *aesdev = dev->priv;
+
+	fpi_frame_slab_free(aesdev->strips);
+	g_free(aesdev);
 	libusb_release_interface(dev->udev, 0);
 	fpi_imgdev_close_complete(dev);
 }
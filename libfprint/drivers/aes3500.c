@@ -156,6 +156,7 @@ static void dev_deinit(struct fp_img_dev *dev)
 {
 	struct aes3k_dev *aesdev = dev->priv;
 	g_free(aesdev);
+	aes_regv_pool_free(dev);
 	libusb_release_interface(dev->udev, 0);
 	fpi_imgdev_close_complete(dev);
 }
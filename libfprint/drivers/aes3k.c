@@ -41,6 +41,7 @@
 #include <glib.h>
 #include <libusb.h>
 
+#include <assembling.h>
 #include <aeslib.h>
 #include <fp_internal.h>
 
@@ -52,20 +53,6 @@
 
 static void do_capture(struct fp_img_dev *dev);
 
-static void aes3k_assemble_image(unsigned char *input, size_t width, size_t height,
-	unsigned char *output)
-{
-	size_t row, column;
-
-	for (column = 0; column < width; column++) {
-		for (row = 0; row < height; row += 2) {
-			output[width * row + column] = (*input & 0x0f) * 17;
-			output[width * (row + 1) + column] = ((*input & 0xf0) >> 4) * 17;
-			input++;
-		}
-	}
-}
-
 static void img_cb(struct libusb_transfer *transfer)
 {
 	struct fp_img_dev *dev = transfer->user_data;
@@ -87,14 +74,19 @@ static void img_cb(struct libusb_transfer *transfer)
 
 	fpi_imgdev_report_finger_status(dev, TRUE);
 
+	/* the sensor sends the image upside down, mirrored and inverted; each
+	 * frame is unpacked straight to its final place, the last frame on
+	 * top, which leaves nothing for fp_img_standardize() to do */
 	tmp = fpi_img_new(aesdev->frame_width * aesdev->frame_width);
 	tmp->width = aesdev->frame_width;
 	tmp->height = aesdev->frame_width;
-	tmp->flags = FP_IMG_COLORS_INVERTED | FP_IMG_V_FLIPPED | FP_IMG_H_FLIPPED;
 	for (i = 0; i < aesdev->frame_number; i++) {
 		fp_dbg("frame header byte %02x", *ptr);
 		ptr++;
-		aes3k_assemble_image(ptr, aesdev->frame_width, AES3K_FRAME_HEIGHT, tmp->data + (i * aesdev->frame_width * AES3K_FRAME_HEIGHT));
+		fpi_aes4_unpack(ptr, aesdev->frame_width, AES3K_FRAME_HEIGHT,
+			tmp->data + ((aesdev->frame_number - 1 - i) *
+				aesdev->frame_width * AES3K_FRAME_HEIGHT),
+			FP_IMG_STANDARDIZATION_FLAGS);
 		ptr += aesdev->frame_size;
 	}
 
@@ -132,7 +124,7 @@ static void do_capture(struct fp_img_dev *dev)
 	libusb_fill_bulk_transfer(aesdev->img_trf, dev->udev, EP_IN, data,
 		aesdev->data_buflen, img_cb, dev, 0);
 
-	r = libusb_submit_transfer(aesdev->img_trf);
+	r = fpi_usb_submit_transfer(aesdev->img_trf);
 	if (r < 0) {
 		g_free(data);
 		libusb_free_transfer(aesdev->img_trf);
@@ -163,7 +155,7 @@ void aes3k_dev_deactivate(struct fp_img_dev *dev)
 	 * from deactivation, otherwise app may legally exit before we've
 	 * cleaned up */
 	if (aesdev->img_trf)
-		libusb_cancel_transfer(aesdev->img_trf);
+		fpi_usb_cancel_transfer(aesdev->img_trf);
 	fpi_imgdev_deactivate_complete(dev);
 }
 
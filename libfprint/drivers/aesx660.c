@@ -61,7 +61,7 @@ static void aesX660_send_cmd_timeout(struct fpi_ssm *ssm, const unsigned char *c
 	libusb_fill_bulk_transfer(transfer, dev->udev, EP_OUT,
 		(unsigned char *)cmd, cmd_len,
 		callback, ssm, timeout);
-	r = libusb_submit_transfer(transfer);
+	r = fpi_usb_submit_transfer(transfer);
 	if (r < 0) {
 		fp_dbg("failed to submit transfer\n");
 		libusb_free_transfer(transfer);
@@ -93,7 +93,7 @@ static void aesX660_read_response(struct fpi_ssm *ssm, size_t buf_len,
 		data, buf_len,
 		callback, ssm, BULK_TIMEOUT);
 
-	r = libusb_submit_transfer(transfer);
+	r = fpi_usb_submit_transfer(transfer);
 	if (r < 0) {
 		fp_dbg("Failed to submit rx transfer: %d\n", r);
 		g_free(data);
@@ -279,21 +279,20 @@ static int process_stripe_data(struct fpi_ssm *ssm, unsigned char *data)
 	struct fp_img_dev *dev = ssm->priv;
 	struct aesX660_dev *aesdev = dev->priv;
 
-	stripe = g_malloc(aesdev->assembling_ctx->frame_width * FRAME_HEIGHT / 2 + sizeof(struct fpi_frame)); /* 4 bpp */
-	stripdata = stripe->data;
-
 	fp_dbg("Processing frame %.2x %.2x", data[AESX660_IMAGE_OK_OFFSET],
 		data[AESX660_LAST_FRAME_OFFSET]);
 
-	stripe->delta_x = (int8_t)data[AESX660_FRAME_DELTA_X_OFFSET];
-	stripe->delta_y = -(int8_t)data[AESX660_FRAME_DELTA_Y_OFFSET];
-	fp_dbg("Offset to previous frame: %d %d", stripe->delta_x, stripe->delta_y);
+	fp_dbg("Offset to previous frame: %d %d",
+		(int8_t)data[AESX660_FRAME_DELTA_X_OFFSET],
+		-(int8_t)data[AESX660_FRAME_DELTA_Y_OFFSET]);
 
 	if (data[AESX660_IMAGE_OK_OFFSET] == AESX660_IMAGE_OK) {
+		stripe = fpi_frame_slab_alloc(aesdev->strips);
+		stripe->delta_x = (int8_t)data[AESX660_FRAME_DELTA_X_OFFSET];
+		stripe->delta_y = -(int8_t)data[AESX660_FRAME_DELTA_Y_OFFSET];
+		stripdata = stripe->data;
 		memcpy(stripdata, data + AESX660_IMAGE_OFFSET, aesdev->assembling_ctx->frame_width * FRAME_HEIGHT / 2);
 
-		aesdev->strips = g_slist_prepend(aesdev->strips, stripe);
-		aesdev->strips_len++;
 		return (data[AESX660_LAST_FRAME_OFFSET] & AESX660_LAST_FRAME_BIT);
 	} else {
 		return 0;
@@ -311,13 +310,9 @@ static void capture_set_idle_cmd_cb(struct libusb_transfer *transfer)
 		(transfer->length == transfer->actual_length)) {
 		struct fp_img *img;
 
-		aesdev->strips = g_slist_reverse(aesdev->strips);
-		img = fpi_assemble_frames(aesdev->assembling_ctx, aesdev->strips, aesdev->strips_len);
+		img = fpi_assemble_frames_slab(aesdev->assembling_ctx, aesdev->strips);
 		img->flags |= aesdev->extra_img_flags;
-		g_slist_foreach(aesdev->strips, (GFunc) g_free, NULL);
-		g_slist_free(aesdev->strips);
-		aesdev->strips = NULL;
-		aesdev->strips_len = 0;
+		fpi_frame_slab_reset(aesdev->strips);
 		fpi_imgdev_image_captured(dev, img);
 		fpi_imgdev_report_finger_status(dev, FALSE);
 		fpi_ssm_mark_completed(ssm);
@@ -402,7 +397,7 @@ static void capture_run_state(struct fpi_ssm *ssm)
 			capture_read_stripe_data_cb);
 	break;
 	case CAPTURE_SET_IDLE:
-		fp_dbg("Got %d frames\n", aesdev->strips_len);
+		fp_dbg("Got %zu frames\n", fpi_frame_slab_len(aesdev->strips));
 		aesX660_send_cmd(ssm, set_idle_cmd, sizeof(set_idle_cmd),
 			capture_set_idle_cmd_cb);
 	break;
@@ -615,7 +610,7 @@ void aesX660_dev_deactivate(struct fp_img_dev *dev)
 	struct aesX660_dev *aesdev = dev->priv;
 
 	if (aesdev->fd_data_transfer)
-		libusb_cancel_transfer(aesdev->fd_data_transfer);
+		fpi_usb_cancel_transfer(aesdev->fd_data_transfer);
 
 	aesdev->deactivating = TRUE;
 }
@@ -626,8 +621,6 @@ static void complete_deactivation(struct fp_img_dev *dev)
 	fp_dbg("");
 
 	aesdev->deactivating = FALSE;
-	g_slist_free(aesdev->strips);
-	aesdev->strips = NULL;
-	aesdev->strips_len = 0;
+	fpi_frame_slab_reset(aesdev->strips);
 	fpi_imgdev_deactivate_complete(dev);
 }
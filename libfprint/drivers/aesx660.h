@@ -44,8 +44,7 @@
 #define AESX660_FRAME_HEIGHT 8
 
 struct aesX660_dev {
-	GSList *strips;
-	size_t strips_len;
+	struct fpi_frame_slab *strips;
 	gboolean deactivating;
 	struct aesX660_cmd *init_seq;
 	size_t init_seq_len;
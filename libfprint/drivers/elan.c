@@ -67,14 +67,26 @@ static struct fpi_frame_asmbl_ctx assembling_ctx = {
 	.frame_width = 0,
 	.frame_height = 0,
 	.image_width = 0,
+	.search = FPI_FRAME_SEARCH_COARSE_TO_FINE,
+	.layout = FPI_FRAME_LAYOUT_LINEAR8,
+	/* pixels 4 levels apart on average */
+	.dup_threshold = 16,
 	.get_pixel = elan_get_pixel,
 };
 
+/* A frame with the background subtracted, as saved while capturing */
+struct elan_frame {
+	unsigned short min;
+	unsigned short max;
+	unsigned short data[0];
+};
+
 struct elan_dev {
 	/* device config */
 	unsigned short dev_type;
 	unsigned short fw_ver;
-	void (*process_frame) (unsigned short *raw_frame, GSList ** frames);
+	void (*process_frame) (struct elan_frame *raw_frame,
+			       struct fpi_frame_slab *frames);
 	/* end device config */
 
 	/* commands */
@@ -95,14 +107,12 @@ struct elan_dev {
 	unsigned char raw_frame_height;
 	int num_frames;
 	GSList *frames;
+	/* normalized frames, the frame size is fixed once the sensor
+	 * dimensions are known */
+	struct fpi_frame_slab *processed_frames;
 	/* end state */
 };
 
-int cmp_short(const void *a, const void *b)
-{
-	return (int)(*(short *)a - *(short *)b);
-}
-
 static void elan_dev_reset(struct elan_dev *elandev)
 {
 	fp_dbg("");
@@ -144,20 +154,99 @@ static void elan_save_frame(struct elan_dev *elandev, unsigned short *frame)
 	unsigned char frame_height = elandev->frame_height;
 	unsigned char raw_height = elandev->raw_frame_height;
 	unsigned char frame_margin = (raw_height - elandev->frame_height) / 2;
-	int frame_idx, raw_idx;
-
-	for (int y = 0; y < frame_height; y++)
-		for (int x = 0; x < frame_width; x++) {
-			if (elandev->dev_type & ELAN_NOT_ROTATED)
-				raw_idx = x + (y + frame_margin) * frame_width;
-			else
-				raw_idx = frame_margin + y + x * raw_height;
-			frame_idx = x + y * frame_width;
-			frame[frame_idx] =
-			    ((unsigned short *)elandev->last_read)[raw_idx];
+	unsigned short *raw = (unsigned short *)elandev->last_read;
+
+	if (elandev->dev_type & ELAN_NOT_ROTATED) {
+		memcpy(frame, raw + frame_margin * frame_width,
+		       frame_width * frame_height * sizeof(short));
+		return;
+	}
+
+	/* each raw column is a row of the frame, read it in order */
+	for (int x = 0; x < frame_width; x++) {
+		unsigned short *column = raw + frame_margin + x * raw_height;
+
+		for (int y = 0; y < frame_height; y++)
+			frame[x + y * frame_width] = column[y];
+	}
+}
+
+#if defined(__GNUC__) && !defined(ELAN_SCALAR)
+#define ELAN_VECTOR_LANES 8
+typedef unsigned short elan_u16v __attribute__((vector_size(ELAN_VECTOR_LANES * sizeof(short))));
+#endif
+
+/* Subtracts the background from frame, clamping at 0, and finds the
+ * minimum and maximum of the result in the same pass */
+static void elan_subtract_background(unsigned short *frame,
+				     const unsigned short *background,
+				     unsigned int frame_size,
+				     unsigned short *min, unsigned short *max)
+{
+	unsigned short lo = 0xffff, hi = 0;
+	unsigned int i = 0;
+
+#ifdef ELAN_VECTOR_LANES
+	if (frame_size >= ELAN_VECTOR_LANES) {
+		elan_u16v vlo, vhi;
+
+		memset(&vlo, 0xff, sizeof(vlo));
+		memset(&vhi, 0, sizeof(vhi));
+		for (; i + ELAN_VECTOR_LANES <= frame_size;
+		     i += ELAN_VECTOR_LANES) {
+			elan_u16v f, b, d, lt, gt;
+
+			memcpy(&f, frame + i, sizeof(f));
+			memcpy(&b, background + i, sizeof(b));
+			d = (f - b) & (elan_u16v)(f >= b);
+			memcpy(frame + i, &d, sizeof(d));
+
+			lt = (elan_u16v)(d < vlo);
+			gt = (elan_u16v)(d > vhi);
+			vlo = (d & lt) | (vlo & ~lt);
+			vhi = (d & gt) | (vhi & ~gt);
 		}
+		for (int k = 0; k < ELAN_VECTOR_LANES; k++) {
+			lo = MIN(lo, vlo[k]);
+			hi = MAX(hi, vhi[k]);
+		}
+	}
+#endif
+	for (; i < frame_size; i++) {
+		if (background[i] > frame[i])
+			frame[i] = 0;
+		else
+			frame[i] -= background[i];
+		lo = MIN(lo, frame[i]);
+		hi = MAX(hi, frame[i]);
+	}
+
+	*min = lo;
+	*max = hi;
+}
+
+/* Fills lut[0 .. to - from] with base + (x - from) * scale / (to - from)
+ * without a division per entry, last tells whether to is included */
+static void elan_fill_levels(unsigned char *lut, unsigned short from,
+			     unsigned short to, gboolean last,
+			     unsigned int base, unsigned int scale)
+{
+	unsigned int n = to - from + (last ? 1 : 0);
+	unsigned int range = to - from;
+	unsigned int x, q = 0, rem = 0;
+
+	for (x = 0; x < n; x++) {
+		lut[x] = base + q;
+		rem += scale;
+		while (range && rem >= range) {
+			rem -= range;
+			q++;
+		}
+	}
 }
 
+
+
 static void elan_save_background(struct elan_dev *elandev)
 {
 	fp_dbg("");
@@ -209,21 +298,17 @@ static int elan_save_img_frame(struct elan_dev *elandev)
 	fp_dbg("");
 
 	unsigned int frame_size = elandev->frame_width * elandev->frame_height;
-	unsigned short *frame = g_malloc(frame_size * sizeof(short));
-	elan_save_frame(elandev, frame);
-	unsigned int sum = 0;
-
-	for (int i = 0; i < frame_size; i++) {
-		if (elandev->background[i] > frame[i])
-			frame[i] = 0;
-		else
-			frame[i] -= elandev->background[i];
-		sum += frame[i];
-	}
-
-	if (sum == 0) {
+	struct elan_frame *frame =
+	    g_malloc(sizeof(*frame) + frame_size * sizeof(short));
+	elan_save_frame(elandev, frame->data);
+	elan_subtract_background(frame->data, elandev->background, frame_size,
+				 &frame->min, &frame->max);
+
+	/* all pixels are 0 */
+	if (frame->max == 0) {
 		fp_dbg
 		    ("frame darker that background; finger present during calibration?");
+		g_free(frame);
 		return -1;
 	}
 
@@ -232,53 +317,113 @@ static int elan_save_img_frame(struct elan_dev *elandev)
 	return 0;
 }
 
-static void elan_process_frame_linear(unsigned short *raw_frame,
-				      GSList ** frames)
+static void elan_process_frame_linear(struct elan_frame *raw_frame,
+				      struct fpi_frame_slab *frames)
 {
 	fp_dbg("");
 
 	unsigned int frame_size =
 	    assembling_ctx.frame_width * assembling_ctx.frame_height;
-	struct fpi_frame *frame =
-	    g_malloc(frame_size + sizeof(struct fpi_frame));
+	struct fpi_frame *frame = fpi_frame_slab_alloc(frames);
+	unsigned short min = raw_frame->min, max = raw_frame->max;
+
+	/* min and max were found while subtracting the background */
+	if (max == min) {
+		memset(frame->data, 0, frame_size);
+		return;
+	}
+
+	unsigned char *lut = g_malloc(max - min + 1);
+	elan_fill_levels(lut, min, max, TRUE, 0, 0xff);
+	for (int i = 0; i < frame_size; i++)
+		frame->data[i] = lut[raw_frame->data[i] - min];
+	g_free(lut);
+}
 
+/* Raw values are ordered as signed shorts, key flips the sign bit so that
+ * the order of the keys as unsigned numbers is the same */
+#define ELAN_LEVEL_KEY(px) ((unsigned short)((px) ^ 0x8000))
+
+/* Finds the values of rank 0, 30%, 65% and 100% of the frame, as sorting
+ * it would, with a histogram of the high bytes of the keys and then one
+ * of the low bytes within the bins holding the two middle ranks */
+static void elan_find_levels(unsigned short *raw_frame,
+			     unsigned int frame_size, unsigned short *levels)
+{
+	unsigned int ranks[2] = { frame_size * 3 / 10, frame_size * 65 / 100 };
+	unsigned int coarse[256] = { 0 };
+	unsigned int fine[2][256] = { { 0 } };
+	unsigned int bins[2], below[2];
 	unsigned short min = 0xffff, max = 0;
-	for (int i = 0; i < frame_size; i++) {
-		if (raw_frame[i] < min)
-			min = raw_frame[i];
-		if (raw_frame[i] > max)
-			max = raw_frame[i];
+	unsigned int i, k, count;
+
+	for (i = 0; i < frame_size; i++) {
+		unsigned short key = ELAN_LEVEL_KEY(raw_frame[i]);
+
+		coarse[key >> 8]++;
+		if (key < min)
+			min = key;
+		if (key > max)
+			max = key;
 	}
 
-	unsigned short px;
-	for (int i = 0; i < frame_size; i++) {
-		px = raw_frame[i];
-		px = (px - min) * 0xff / (max - min);
-		frame->data[i] = (unsigned char)px;
+	for (k = 0; k < 2; k++) {
+		for (bins[k] = 0, count = 0;
+		     count + coarse[bins[k]] <= ranks[k]; bins[k]++)
+			count += coarse[bins[k]];
+		below[k] = count;
+	}
+
+	for (i = 0; i < frame_size; i++) {
+		unsigned short key = ELAN_LEVEL_KEY(raw_frame[i]);
+
+		for (k = 0; k < 2; k++)
+			if ((key >> 8) == bins[k])
+				fine[k][key & 0xff]++;
 	}
 
-	*frames = g_slist_prepend(*frames, frame);
+	levels[0] = ELAN_LEVEL_KEY(min);
+	for (k = 0; k < 2; k++) {
+		unsigned int v;
+
+		for (v = 0, count = below[k]; count + fine[k][v] <= ranks[k]; v++)
+			count += fine[k][v];
+		levels[k + 1] = ELAN_LEVEL_KEY((bins[k] << 8) | v);
+	}
+	levels[3] = ELAN_LEVEL_KEY(max);
 }
 
-static void elan_process_frame_thirds(unsigned short *raw_frame,
-				      GSList ** frames)
+static void elan_process_frame_thirds(struct elan_frame *frame_in,
+				      struct fpi_frame_slab *frames)
 {
 	fp_dbg("");
 
+	unsigned short *raw_frame = frame_in->data;
 	unsigned int frame_size =
 	    assembling_ctx.frame_width * assembling_ctx.frame_height;
-	struct fpi_frame *frame =
-	    g_malloc(frame_size + sizeof(struct fpi_frame));
-
-	unsigned short lvl0, lvl1, lvl2, lvl3;
-	unsigned short *sorted = g_malloc(frame_size * sizeof(short));
-	memcpy(sorted, raw_frame, frame_size * sizeof(short));
-	qsort(sorted, frame_size, sizeof(short), cmp_short);
-	lvl0 = sorted[0];
-	lvl1 = sorted[frame_size * 3 / 10];
-	lvl2 = sorted[frame_size * 65 / 100];
-	lvl3 = sorted[frame_size - 1];
-	g_free(sorted);
+	struct fpi_frame *frame = fpi_frame_slab_alloc(frames);
+
+	unsigned short levels[4], lvl0, lvl1, lvl2, lvl3;
+	elan_find_levels(raw_frame, frame_size, levels);
+	lvl0 = levels[0];
+	lvl1 = levels[1];
+	lvl2 = levels[2];
+	lvl3 = levels[3];
+
+	/* When all values are on the same side of the sign bit every pixel
+	 * is between lvl0 and lvl3, so the mapping below only depends on the
+	 * value and can be tabulated once for the frame */
+	if (!((ELAN_LEVEL_KEY(lvl0) ^ ELAN_LEVEL_KEY(lvl3)) & 0x8000)) {
+		unsigned char *lut = g_malloc(lvl3 - lvl0 + 1);
+
+		elan_fill_levels(lut, lvl0, lvl1, FALSE, 0, 99);
+		elan_fill_levels(lut + lvl1 - lvl0, lvl1, lvl2, FALSE, 99, 56);
+		elan_fill_levels(lut + lvl2 - lvl0, lvl2, lvl3, TRUE, 155, 100);
+		for (int i = 0; i < frame_size; i++)
+			frame->data[i] = lut[raw_frame[i] - lvl0];
+		g_free(lut);
+		return;
+	}
 
 	unsigned short px;
 	for (int i = 0; i < frame_size; i++) {
@@ -291,8 +436,6 @@ static void elan_process_frame_thirds(unsigned short *raw_frame,
 			px = 155 + ((px - lvl2) * 100 / (lvl3 - lvl2));
 		frame->data[i] = (unsigned char)px;
 	}
-
-	*frames = g_slist_prepend(*frames, frame);
 }
 
 static void elan_submit_image(struct fp_img_dev *dev)
@@ -300,7 +443,6 @@ static void elan_submit_image(struct fp_img_dev *dev)
 	fp_dbg("");
 
 	struct elan_dev *elandev = dev->priv;
-	GSList *frames = NULL;
 	struct fp_img *img;
 
 	for (int i = 0; i < ELAN_SKIP_LAST_FRAMES; i++)
@@ -310,11 +452,18 @@ static void elan_submit_image(struct fp_img_dev *dev)
 	assembling_ctx.frame_width = elandev->frame_width;
 	assembling_ctx.frame_height = elandev->frame_height;
 	assembling_ctx.image_width = elandev->frame_width * 3 / 2;
+	if (!elandev->processed_frames)
+		elandev->processed_frames = fpi_frame_slab_new(
+			elandev->frame_width * elandev->frame_height);
+	/* raw frames are kept latest first */
+	elandev->frames = g_slist_reverse(elandev->frames);
 	g_slist_foreach(elandev->frames, (GFunc) elandev->process_frame,
-			&frames);
-	fpi_do_movement_estimation(&assembling_ctx, frames,
-				   elandev->num_frames);
-	img = fpi_assemble_frames(&assembling_ctx, frames, elandev->num_frames);
+			elandev->processed_frames);
+	fpi_do_movement_estimation_slab(&assembling_ctx,
+					elandev->processed_frames);
+	img = fpi_assemble_frames_slab(&assembling_ctx,
+				       elandev->processed_frames);
+	fpi_frame_slab_reset(elandev->processed_frames);
 
 	img->flags |= FP_IMG_PARTIAL;
 	fpi_imgdev_image_captured(dev, img);
@@ -401,7 +550,7 @@ static void elan_cmd_read(struct fpi_ssm *ssm)
 				  response_len, elan_cmd_cb, ssm,
 				  elandev->cmd_timeout);
 	transfer->flags = LIBUSB_TRANSFER_FREE_TRANSFER;
-	int r = libusb_submit_transfer(transfer);
+	int r = fpi_usb_submit_transfer(transfer);
 	if (r < 0)
 		fpi_ssm_mark_aborted(ssm, r);
 }
@@ -435,7 +584,7 @@ static void elan_run_cmd(struct fpi_ssm *ssm, const struct elan_cmd *cmd,
 				  cmd->cmd, ELAN_CMD_LEN, elan_cmd_cb, ssm,
 				  elandev->cmd_timeout);
 	transfer->flags = LIBUSB_TRANSFER_FREE_TRANSFER;
-	int r = libusb_submit_transfer(transfer);
+	int r = fpi_usb_submit_transfer(transfer);
 	if (r < 0)
 		fpi_ssm_mark_aborted(ssm, r);
 }
@@ -836,6 +985,7 @@ static void dev_deinit(struct fp_img_dev *dev)
 	struct elan_dev *elandev = dev->priv;
 
 	elan_dev_reset(elandev);
+	fpi_frame_slab_free(elandev->processed_frames);
 	g_free(elandev->background);
 	g_free(elandev);
 	libusb_release_interface(dev->udev, 0);
@@ -864,7 +1014,7 @@ static void elan_change_state(struct fp_img_dev *dev)
 	case IMGDEV_STATE_INACTIVE:
 		if (elandev->cur_transfer)
 			/* deactivation will complete in transfer callback */
-			libusb_cancel_transfer(elandev->cur_transfer);
+			fpi_usb_cancel_transfer(elandev->cur_transfer);
 		else
 			elan_deactivate(dev);
 		break;
@@ -212,7 +212,23 @@ struct etes603_dev {
 	uint8_t vrt;
 	uint8_t vrb;
 
+	/* Checking the tuning of the calibration cache */
+	uint8_t tunecheck_dcoffset;
+	unsigned int tuning_stale;
+
 	unsigned int is_active;
+
+	/* Waiting between the frames polled for a finger */
+	struct fpi_poll_backoff poll;
+	struct fpi_timeout poll_timeout;
+};
+
+/* Tuning saved in the calibration cache */
+struct etes603_tuning {
+	uint8_t gain;
+	uint8_t dcoffset;
+	uint8_t vrt;
+	uint8_t vrb;
 };
 
 static void m_start_fingerdetect(struct fp_img_dev *idev);
@@ -457,16 +473,68 @@ static void msg_set_mode_control(struct etes603_dev *dev, uint8_t mode)
 
 /* Processing functions */
 
+/*
+ * The two 8 bpp pixels of each 4 bpp byte, upper nibble first. 16 gray
+ * levels transform to 256 levels using << 4.
+ */
+#define UNPACK_4BPP(b)	{ (b) & 0xF0, ((b) & 0x0F) << 4 }
+#define UNPACK_4BPP_ROW(h) \
+	UNPACK_4BPP(h | 0x0), UNPACK_4BPP(h | 0x1), UNPACK_4BPP(h | 0x2), \
+	UNPACK_4BPP(h | 0x3), UNPACK_4BPP(h | 0x4), UNPACK_4BPP(h | 0x5), \
+	UNPACK_4BPP(h | 0x6), UNPACK_4BPP(h | 0x7), UNPACK_4BPP(h | 0x8), \
+	UNPACK_4BPP(h | 0x9), UNPACK_4BPP(h | 0xA), UNPACK_4BPP(h | 0xB), \
+	UNPACK_4BPP(h | 0xC), UNPACK_4BPP(h | 0xD), UNPACK_4BPP(h | 0xE), \
+	UNPACK_4BPP(h | 0xF)
+
+static const uint8_t unpack_4bpp[256][2] = {
+	UNPACK_4BPP_ROW(0x00), UNPACK_4BPP_ROW(0x10), UNPACK_4BPP_ROW(0x20),
+	UNPACK_4BPP_ROW(0x30), UNPACK_4BPP_ROW(0x40), UNPACK_4BPP_ROW(0x50),
+	UNPACK_4BPP_ROW(0x60), UNPACK_4BPP_ROW(0x70), UNPACK_4BPP_ROW(0x80),
+	UNPACK_4BPP_ROW(0x90), UNPACK_4BPP_ROW(0xA0), UNPACK_4BPP_ROW(0xB0),
+	UNPACK_4BPP_ROW(0xC0), UNPACK_4BPP_ROW(0xD0), UNPACK_4BPP_ROW(0xE0),
+	UNPACK_4BPP_ROW(0xF0),
+};
+
+/*
+ * Walk a 4bpp frame once, writing its 8bpp pixels to output and counting
+ * its gray levels in hist[16], either can be NULL.
+ */
+static void process_4bpp(const uint8_t *input, size_t size,
+	uint8_t *output, unsigned int hist[16])
+{
+	size_t i;
+
+	if (hist)
+		memset(hist, 0, 16 * sizeof(hist[0]));
+
+	if (output && hist) {
+		for (i = 0; i < size; i++) {
+			memcpy(output + 2 * i, unpack_4bpp[input[i]], 2);
+			hist[input[i] >> 4]++;
+			hist[input[i] & 0x0F]++;
+		}
+	} else if (output) {
+		for (i = 0; i < size; i++)
+			memcpy(output + 2 * i, unpack_4bpp[input[i]], 2);
+	} else if (hist) {
+		for (i = 0; i < size; i++) {
+			hist[input[i] >> 4]++;
+			hist[input[i] & 0x0F]++;
+		}
+	}
+}
+
 /*
  * Return the brightness of a 4bpp frame
  */
 static unsigned int process_get_brightness(uint8_t *f, size_t s)
 {
+	unsigned int hist[16];
 	unsigned int i, sum = 0;
-	for (i = 0; i < s; i++) {
-		sum += f[i] >> 4;
-		sum += f[i] & 0x0F;
-	}
+
+	process_4bpp(f, s, NULL, hist);
+	for (i = 0; i < 16; i++)
+		sum += i * hist[i];
 	return sum;
 }
 
@@ -475,19 +543,14 @@ static unsigned int process_get_brightness(uint8_t *f, size_t s)
  */
 static void process_hist(uint8_t *f, size_t s, float stat[5])
 {
+	unsigned int count[16];
 	float hist[16];
 	float black_mean, white_mean;
 	int i;
-	/* Clean histogram */
-	for (i = 0; i < 16; i++)
-		hist[i] = 0.0;
-	for (i = 0; i < s; i++) {
-		hist[f[i] >> 4]++;
-		hist[f[i] & 0x0F]++;
-	}
+	process_4bpp(f, s, NULL, count);
 	/* histogram average */
 	for (i = 0; i < 16; i++) {
-		hist[i] = hist[i] / (s * 2);
+		hist[i] = (float)count[i] / (s * 2);
 	}
 	/* Average black/white pixels (full black and full white pixels
 	 * are excluded). */
@@ -522,12 +585,7 @@ static int process_frame_empty(uint8_t *frame, size_t size)
 static void process_4to8_bpp(uint8_t *input, unsigned int input_size,
 	uint8_t *output)
 {
-	unsigned int i, j = 0;
-	for (i = 0; i < input_size; i++, j += 2) {
-		/* 16 gray levels transform to 256 levels using << 4 */
-		output[j] = input[i] & 0xF0;
-		output[j+1] = input[i] << 4;
-	}
+	process_4bpp(input, input_size, output, NULL);
 }
 
 /*
@@ -609,6 +667,18 @@ enum {
 	TUNEVRB_NUM_STATES
 };
 
+enum {
+	TUNECHECK_SET_REG2627_REQ,
+	TUNECHECK_SET_REG2627_ANS,
+	TUNECHECK_SET_DCOFFSET_REQ,
+	TUNECHECK_SET_DCOFFSET_ANS,
+	TUNECHECK_GET_FRAME_REQ,
+	TUNECHECK_GET_FRAME_ANS,
+	TUNECHECK_FINAL_SET_MODE_SLEEP_REQ,
+	TUNECHECK_FINAL_SET_MODE_SLEEP_ANS,
+	TUNECHECK_NUM_STATES
+};
+
 enum {
 	FGR_FPA_INIT_SET_MODE_SLEEP_REQ,
 	FGR_FPA_INIT_SET_MODE_SLEEP_ANS,
@@ -666,7 +736,7 @@ static int async_tx(struct fp_img_dev *idev, unsigned int ep, void *cb,
 	libusb_fill_bulk_transfer(transfer, idev->udev, ep, buffer, length,
 				  cb, cb_arg, BULK_TIMEOUT);
 
-	if (libusb_submit_transfer(transfer)) {
+	if (fpi_usb_submit_transfer(transfer)) {
 		libusb_free_transfer(transfer);
 		return -EIO;
 	}
@@ -859,6 +929,11 @@ static void m_capture_complete(struct fpi_ssm *ssm)
 	}
 }
 
+static void m_finger_poll_cb(void *data)
+{
+	fpi_ssm_jump_to_state(data, FGR_FPA_GET_FRAME_REQ);
+}
+
 static void m_finger_state(struct fpi_ssm *ssm)
 {
 	struct fp_img_dev *idev = ssm->priv;
@@ -938,8 +1013,12 @@ static void m_finger_state(struct fpi_ssm *ssm)
 		break;
 	case FGR_FPA_GET_FRAME_ANS:
 		if (process_frame_empty((uint8_t *)dev->ans, FRAME_SIZE)) {
-			fpi_ssm_jump_to_state(ssm, FGR_FPA_GET_FRAME_REQ);
+			/* Poll again, less often while the reader is idle */
+			if (fpi_poll_backoff_start(&dev->poll, &dev->poll_timeout,
+					m_finger_poll_cb, ssm) < 0)
+				goto err;
 		} else {
+			fpi_poll_backoff_activity(&dev->poll);
 			fpi_imgdev_report_finger_status(idev, TRUE);
 			fpi_ssm_mark_completed(ssm);
 		}
@@ -1147,6 +1226,12 @@ static void m_tunevrb_complete(struct fpi_ssm *ssm)
 
 	fpi_imgdev_activate_complete(idev, ssm->error != 0);
 	if (!ssm->error) {
+		struct etes603_dev *dev = idev->priv;
+		struct etes603_tuning tuning = {
+			dev->gain, dev->dcoffset, dev->vrt, dev->vrb
+		};
+
+		fpi_calibration_save(idev->dev, &tuning, sizeof(tuning));
 		fp_dbg("Tuning is done. Starting finger detection.");
 		m_start_fingerdetect(idev);
 	} else {
@@ -1386,15 +1471,156 @@ err:
 
 }
 
+static void m_start_tunedc(struct fp_img_dev *idev)
+{
+	struct fpi_ssm *ssm_tune;
+
+	ssm_tune = fpi_ssm_new(idev->dev, m_tunedc_state, TUNEDC_NUM_STATES);
+	ssm_tune->priv = idev;
+	fpi_ssm_start(ssm_tune, m_tunedc_complete);
+}
+
+/*
+ * This function checks that the tuning of the calibration cache still fits
+ * the sensor: as after m_tunedc_state(), the frame is almost black just below
+ * the DCoffset, and not any more one step lower.
+ */
+static void m_tunecheck_state(struct fpi_ssm *ssm)
+{
+	struct fp_img_dev *idev = ssm->priv;
+	struct etes603_dev *dev = idev->priv;
+	int empty;
+
+	if (dev->is_active == FALSE) {
+		fpi_ssm_mark_completed(ssm);
+		return;
+	}
+
+	switch (ssm->cur_state) {
+	case TUNECHECK_SET_REG2627_REQ:
+		fp_dbg("Checking cached tuning");
+		dev->tuning_stale = FALSE;
+		dev->tunecheck_dcoffset = dev->dcoffset - 1;
+		msg_set_regs(dev, 4, REG_26, 0x11, REG_27, 0x00);
+		if (async_tx(idev, EP_OUT, async_tx_cb, ssm))
+			goto err;
+		break;
+	case TUNECHECK_SET_REG2627_ANS:
+		if (msg_check_ok(dev))
+			goto err;
+		fpi_ssm_next_state(ssm);
+		break;
+	case TUNECHECK_SET_DCOFFSET_REQ:
+		msg_set_regs(dev, 2, REG_DCOFFSET, dev->tunecheck_dcoffset);
+		if (async_tx(idev, EP_OUT, async_tx_cb, ssm))
+			goto err;
+		break;
+	case TUNECHECK_SET_DCOFFSET_ANS:
+		if (msg_check_ok(dev))
+			goto err;
+		fpi_ssm_next_state(ssm);
+		break;
+	case TUNECHECK_GET_FRAME_REQ:
+		/* Same settings as the frames of m_tunedc_state() */
+		msg_get_frame(dev, 0x01, dev->gain, 0x15, 0x10);
+		if (async_tx(idev, EP_OUT, async_tx_cb, ssm))
+			goto err;
+		break;
+	case TUNECHECK_GET_FRAME_ANS:
+		empty = process_frame_empty((uint8_t *)dev->ans, FRAME_WIDTH);
+		if (dev->tunecheck_dcoffset + 1 == dev->dcoffset) {
+			if (!empty)
+				dev->tuning_stale = TRUE;
+			else if (dev->tunecheck_dcoffset > DCOFFSET_MIN) {
+				dev->tunecheck_dcoffset--;
+				fpi_ssm_jump_to_state(ssm,
+					TUNECHECK_SET_DCOFFSET_REQ);
+				break;
+			}
+		} else if (empty) {
+			dev->tuning_stale = TRUE;
+		}
+		fpi_ssm_next_state(ssm);
+		break;
+	case TUNECHECK_FINAL_SET_MODE_SLEEP_REQ:
+		msg_set_mode_control(dev, REG_MODE_SLEEP);
+		if (async_tx(idev, EP_OUT, async_tx_cb, ssm))
+			goto err;
+		break;
+	case TUNECHECK_FINAL_SET_MODE_SLEEP_ANS:
+		if (msg_check_ok(dev))
+			goto err;
+		fpi_ssm_mark_completed(ssm);
+		break;
+	default:
+		fp_err("Unknown state %d", ssm->cur_state);
+		goto err;
+		break;
+	}
+
+	return;
+err:
+	fpi_ssm_mark_aborted(ssm, -EIO);
+}
+
+static void m_tunecheck_complete(struct fpi_ssm *ssm)
+{
+	struct fp_img_dev *idev = ssm->priv;
+	struct etes603_dev *dev = idev->priv;
+
+	if (!ssm->error && dev->tuning_stale) {
+		fp_dbg("Cached tuning does not fit any more, tuning device...");
+		fpi_calibration_forget(idev->dev);
+		reset_param(dev);
+		m_start_tunedc(idev);
+	} else {
+		fpi_imgdev_activate_complete(idev, ssm->error != 0);
+		if (!ssm->error) {
+			fp_dbg("Cached tuning is good. Starting finger detection.");
+			m_start_fingerdetect(idev);
+		} else {
+			fp_err("Error while checking cached tuning");
+			dev->is_active = FALSE;
+			reset_param(dev);
+			fpi_imgdev_session_error(idev, -3);
+		}
+	}
+	fpi_ssm_free(ssm);
+}
+
+/* Use the tuning of the calibration cache, if there is a sane one */
+static gboolean load_tuning(struct fp_img_dev *idev)
+{
+	struct etes603_dev *dev = idev->priv;
+	struct etes603_tuning tuning;
+
+	if (fpi_calibration_load(idev->dev, &tuning, sizeof(tuning)) < 0)
+		return FALSE;
+	if (tuning.dcoffset <= DCOFFSET_MIN || tuning.dcoffset > DCOFFSET_MAX
+	    || tuning.vrt > VRT_MAX || tuning.vrb > VRB_MAX)
+		return FALSE;
+
+	dev->gain = tuning.gain;
+	dev->dcoffset = tuning.dcoffset;
+	dev->vrt = tuning.vrt;
+	dev->vrb = tuning.vrb;
+	return TRUE;
+}
+
 static void m_init_complete(struct fpi_ssm *ssm)
 {
 	struct fp_img_dev *idev = ssm->priv;
 	if (!ssm->error) {
-		struct fpi_ssm *ssm_tune;
-		ssm_tune = fpi_ssm_new(idev->dev, m_tunedc_state,
-					TUNEDC_NUM_STATES);
-		ssm_tune->priv = idev;
-		fpi_ssm_start(ssm_tune, m_tunedc_complete);
+		struct fpi_ssm *ssm_check;
+
+		if (!load_tuning(idev)) {
+			m_start_tunedc(idev);
+		} else {
+			ssm_check = fpi_ssm_new(idev->dev, m_tunecheck_state,
+						TUNECHECK_NUM_STATES);
+			ssm_check->priv = idev;
+			fpi_ssm_start(ssm_check, m_tunecheck_complete);
+		}
 	} else {
 		struct etes603_dev *dev = idev->priv;
 		fp_err("Error initializing the device");
@@ -1420,6 +1646,7 @@ static int dev_activate(struct fp_img_dev *idev, enum fp_imgdev_state state)
 
 	/* Reset info and data */
 	dev->is_active = TRUE;
+	fpi_poll_backoff_activity(&dev->poll);
 
 	if (dev->dcoffset == 0) {
 		fp_dbg("Tuning device...");
@@ -1447,6 +1674,13 @@ static void dev_deactivate(struct fp_img_dev *idev)
 	/* this can be called even if still activated. */
 	if (dev->is_active == TRUE) {
 		dev->is_active = FALSE;
+		/* let the finger detection waiting for its next poll end */
+		if (fpi_timeout_pending(&dev->poll_timeout)) {
+			struct fpi_ssm *ssm = dev->poll_timeout.data;
+
+			fpi_timeout_cancel(&dev->poll_timeout);
+			fpi_ssm_jump_to_state(ssm, FGR_FPA_GET_FRAME_REQ);
+		}
 		m_exit_start(idev);
 	}
 }
@@ -1462,6 +1696,7 @@ static int dev_open(struct fp_img_dev *idev, unsigned long driver_data)
 	dev->req = g_malloc(sizeof(struct egis_msg));
 	dev->ans = g_malloc(FE_SIZE);
 	dev->fp = g_malloc(FE_SIZE * 4);
+	fpi_poll_backoff_init(&dev->poll, 10, 500);
 
 	ret = libusb_claim_interface(idev->udev, 0);
 	if (ret != LIBUSB_SUCCESS) {
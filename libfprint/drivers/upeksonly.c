@@ -96,7 +96,7 @@ struct sonly_dev {
 	struct img_transfer_data *img_transfer_data;
 	int num_flying;
 
-	GSList *rows;
+	struct fpi_line_store *rows;
 	size_t num_rows;
 	unsigned char *rowbuf;
 	int rowbuf_offset;
@@ -118,26 +118,24 @@ struct sonly_dev {
 
 /* Calculade squared standand deviation of sum of two lines */
 static int upeksonly_get_deviation2(struct fpi_line_asmbl_ctx *ctx,
-			  GSList *line1, GSList *line2)
+			  struct fpi_line_store *lines, size_t line1, size_t line2)
 {
-	unsigned char *buf1 = line1->data, *buf2 = line2->data;
-	int res = 0, mean = 0, i;
-	for (i = 0; i < ctx->line_width; i+= 2)
-		mean += (int)buf1[i + 1] + (int)buf2[i];
-
-	mean /= (ctx->line_width / 2);
-
-	for (i = 0; i < ctx->line_width; i+= 2) {
-		int dev = (int)buf1[i + 1] + (int)buf2[i] - mean;
-		res += dev*dev;
-	}
-
-	return res / (ctx->line_width / 2);
+	return fpi_std_sq_dev_sum(fpi_line_store_get(lines, line1) + 1,
+		fpi_line_store_get(lines, line2), ctx->line_width / 2, 2);
 }
 
+static void upeksonly_get_deviations2(struct fpi_line_asmbl_ctx *ctx,
+			  struct fpi_line_store *lines, size_t line,
+			  size_t first, size_t last, int *devs)
+{
+	fpi_std_sq_dev_sum_batch(fpi_line_store_get(lines, line) + 1,
+		fpi_line_store_get(lines, first), lines->line_size,
+		last - first + 1, ctx->line_width / 2, 2, devs);
+}
 
 static unsigned char upeksonly_get_pixel(struct fpi_line_asmbl_ctx *ctx,
-				   GSList *row,
+				   struct fpi_line_store *lines,
+				   size_t row,
 				   unsigned x)
 {
 	unsigned char *buf;
@@ -151,10 +149,10 @@ static unsigned char upeksonly_get_pixel(struct fpi_line_asmbl_ctx *ctx,
 	else
 		return 0;
 	/* Each 2nd pixel is shifted 2 pixels down */
-	if ((!(x & 1)) && g_slist_next(row) && g_slist_next(g_slist_next(row)))
-		buf = g_slist_next(g_slist_next(row))->data;
+	if ((!(x & 1)) && row + 2 < lines->num_lines)
+		buf = fpi_line_store_get(lines, row + 2);
 	else
-		buf = row->data;
+		buf = fpi_line_store_get(lines, row);
 
 	return buf[offset];
 }
@@ -165,6 +163,7 @@ static struct fpi_line_asmbl_ctx assembling_ctx = {
 	.median_filter_size = 25,
 	.max_search_offset = 30,
 	.get_deviation = upeksonly_get_deviation2,
+	.get_deviations = upeksonly_get_deviations2,
 	.get_pixel = upeksonly_get_pixel,
 };
 
@@ -220,7 +219,7 @@ static void cancel_img_transfers(struct fp_img_dev *dev)
 		if (!idata->flying || idata->cancelling)
 			continue;
 		fp_dbg("cancelling transfer %d", i);
-		int r = libusb_cancel_transfer(sdev->img_transfer[i]);
+		int r = fpi_usb_cancel_transfer(sdev->img_transfer[i]);
 		if (r < 0)
 			fp_dbg("cancel failed error %d", r);
 		idata->cancelling = TRUE;
@@ -237,20 +236,15 @@ static void handoff_img(struct fp_img_dev *dev)
 	struct sonly_dev *sdev = dev->priv;
 	struct fp_img *img;
 
-	GSList *elem = sdev->rows;
-
-	if (!elem) {
+	if (!sdev->num_rows) {
 		fp_err("no rows?");
 		return;
 	}
 
-	sdev->rows = g_slist_reverse(sdev->rows);
-
 	fp_dbg("%d rows", sdev->num_rows);
-	img = fpi_assemble_lines(&assembling_ctx, sdev->rows, sdev->num_rows);
+	img = fpi_assemble_lines(&assembling_ctx, sdev->rows);
 
-	g_slist_free_full(sdev->rows, g_free);
-	sdev->rows = NULL;
+	fpi_line_store_reset(sdev->rows);
 
 	fpi_imgdev_image_captured(dev, img);
 	fpi_imgdev_report_finger_status(dev, FALSE);
@@ -266,7 +260,8 @@ static void row_complete(struct fp_img_dev *dev)
 	sdev->rowbuf_offset = -1;
 
 	if (sdev->num_rows > 0) {
-		unsigned char *lastrow = sdev->rows->data;
+		unsigned char *lastrow = fpi_line_store_get(sdev->rows,
+			sdev->num_rows - 1);
 		int std_sq_dev, mean_sq_diff;
 
 		std_sq_dev = fpi_std_sq_dev(sdev->rowbuf, sdev->img_width);
@@ -327,7 +322,7 @@ static void row_complete(struct fp_img_dev *dev)
 	switch (sdev->finger_state) {
 	case AWAIT_FINGER:
 		if (!sdev->num_rows) {
-			sdev->rows = g_slist_prepend(sdev->rows, sdev->rowbuf);
+			fpi_line_store_append(sdev->rows, sdev->rowbuf);
 			sdev->num_rows++;
 		} else {
 			return;
@@ -335,11 +330,10 @@ static void row_complete(struct fp_img_dev *dev)
 		break;
 	case FINGER_DETECTED:
 	case FINGER_REMOVED:
-		sdev->rows = g_slist_prepend(sdev->rows, sdev->rowbuf);
+		fpi_line_store_append(sdev->rows, sdev->rowbuf);
 		sdev->num_rows++;
 		break;
 	}
-	sdev->rowbuf = NULL;
 
 	if (sdev->num_rows >= MAX_ROWS) {
 		fp_dbg("row limit met");
@@ -409,7 +403,7 @@ static void handle_packet(struct fp_img_dev *dev, unsigned char *data)
 				/* If possible take the replacement data from last row */
 				if (sdev->num_rows > 1) {
 					int row_left = sdev->img_width - sdev->rowbuf_offset;
-					unsigned char *last_row = g_slist_nth_data (sdev->rows, 0);
+					unsigned char *last_row = fpi_line_store_get(sdev->rows, sdev->num_rows - 1);
 
 					if (row_left >= 62) {
 						memcpy(dummy_data, last_row + sdev->rowbuf_offset, 62);
@@ -514,7 +508,7 @@ static void img_data_cb(struct libusb_transfer *transfer)
 	}
 
 	if (is_capturing(sdev)) {
-		int r = libusb_submit_transfer(transfer);
+		int r = fpi_usb_submit_transfer(transfer);
 		if (r < 0) {
 			fp_warn("failed resubmit, error %d", r);
 			sdev->killing_transfers = IMG_SESSION_ERROR;
@@ -567,7 +561,7 @@ static void write_regs_iterate(struct write_regs_data *wrdata)
 	setup->wIndex = regwrite->reg;
 	wrdata->transfer->buffer[LIBUSB_CONTROL_SETUP_SIZE] = regwrite->value;
 
-	r = libusb_submit_transfer(wrdata->transfer);
+	r = fpi_usb_submit_transfer(wrdata->transfer);
 	if (r < 0)
 		write_regs_finished(wrdata, r);
 }
@@ -643,7 +637,7 @@ static void sm_write_reg(struct fpi_ssm *ssm, uint8_t reg, uint8_t value)
 	transfer->flags = LIBUSB_TRANSFER_SHORT_NOT_OK |
 		LIBUSB_TRANSFER_FREE_TRANSFER;
 
-	r = libusb_submit_transfer(transfer);
+	r = fpi_usb_submit_transfer(transfer);
 	if (r < 0) {
 		g_free(data);
 		libusb_free_transfer(transfer);
@@ -688,7 +682,7 @@ static void sm_read_reg(struct fpi_ssm *ssm, uint8_t reg)
 	transfer->flags = LIBUSB_TRANSFER_SHORT_NOT_OK |
 		LIBUSB_TRANSFER_FREE_TRANSFER;
 
-	r = libusb_submit_transfer(transfer);
+	r = fpi_usb_submit_transfer(transfer);
 	if (r < 0) {
 		g_free(data);
 		libusb_free_transfer(transfer);
@@ -737,7 +731,7 @@ static void sm_await_intr(struct fpi_ssm *ssm)
 	transfer->flags = LIBUSB_TRANSFER_SHORT_NOT_OK |
 		LIBUSB_TRANSFER_FREE_TRANSFER;
 
-	r = libusb_submit_transfer(transfer);
+	r = fpi_usb_submit_transfer(transfer);
 	if (r < 0) {
 		libusb_free_transfer(transfer);
 		g_free(data);
@@ -861,7 +855,7 @@ static void capsm_fire_bulk(struct fpi_ssm *ssm)
 	struct sonly_dev *sdev = dev->priv;
 	int i;
 	for (i = 0; i < NUM_BULK_TRANSFERS; i++) {
-		int r = libusb_submit_transfer(sdev->img_transfer[i]);
+		int r = fpi_usb_submit_transfer(sdev->img_transfer[i]);
 		if (r < 0) {
 			if (i == 0) {
 				/* first one failed: easy peasy */
@@ -894,6 +888,7 @@ static void capsm_2016_run_state(struct fpi_ssm *ssm)
 	case CAPSM_2016_INIT:
 		sdev->rowbuf_offset = -1;
 		sdev->num_rows = 0;
+		fpi_line_store_reset(sdev->rows);
 		sdev->wraparounds = -1;
 		sdev->num_blank = 0;
 		sdev->num_nonblank = 0;
@@ -926,6 +921,7 @@ static void capsm_1000_run_state(struct fpi_ssm *ssm)
 	case CAPSM_1000_INIT:
 		sdev->rowbuf_offset = -1;
 		sdev->num_rows = 0;
+		fpi_line_store_reset(sdev->rows);
 		sdev->wraparounds = -1;
 		sdev->num_blank = 0;
 		sdev->num_nonblank = 0;
@@ -952,6 +948,7 @@ static void capsm_1001_run_state(struct fpi_ssm *ssm)
 	case CAPSM_1001_INIT:
 		sdev->rowbuf_offset = -1;
 		sdev->num_rows = 0;
+		fpi_line_store_reset(sdev->rows);
 		sdev->wraparounds = -1;
 		sdev->num_blank = 0;
 		sdev->num_nonblank = 0;
@@ -1229,10 +1226,7 @@ static void deactivate_done(struct fp_img_dev *dev)
 	g_free(sdev->rowbuf);
 	sdev->rowbuf = NULL;
 
-	if (sdev->rows) {
-		g_slist_foreach(sdev->rows, (GFunc) g_free, NULL);
-		sdev->rows = NULL;
-	}
+	fpi_line_store_reset(sdev->rows);
 
 	fpi_imgdev_deactivate_complete(dev);
 }
@@ -1368,13 +1362,17 @@ static int dev_init(struct fp_img_dev *dev, unsigned long driver_data)
 		assembling_ctx.line_width = IMG_WIDTH_2016;
 		break;
 	}
+	sdev->rows = fpi_line_store_new(sdev->img_width, MAX_ROWS);
 	fpi_imgdev_open_complete(dev, 0);
 	return 0;
 }
 
 static void dev_deinit(struct fp_img_dev *dev)
 {
-	g_free(dev->priv);
+	struct sonly_dev *sdev = dev->priv;
+
+	fpi_line_store_free(sdev->rows);
+	g_free(sdev);
 	libusb_release_interface(dev->udev, 0);
 	fpi_imgdev_close_complete(dev);
 }
@@ -49,10 +49,16 @@ static void start_deactivation(struct fp_img_dev *dev);
 struct upektc_img_dev {
 	unsigned char cmd[MAX_CMD_SIZE];
 	unsigned char response[MAX_RESPONSE_SIZE];
-	unsigned char image_bits[IMAGE_SIZE * 2];
+	/* the image being captured, the frames are read straight into it */
+	struct fp_img *img;
 	unsigned char seq;
 	size_t image_size;
 	size_t response_rest;
+	/* where the rest of a response goes: after its first chunk in
+	 * response, or, for the payload of a frame, into img */
+	unsigned char *rest_buf;
+	size_t rest_size;
+	gboolean payload_in_img;
 	gboolean deactivating;
 };
 
@@ -146,18 +152,17 @@ static void upektc_img_submit_req(struct fpi_ssm *ssm,
 	libusb_fill_bulk_transfer(transfer, dev->udev, EP_OUT, upekdev->cmd, buf_size,
 		cb, ssm, BULK_TIMEOUT);
 
-	r = libusb_submit_transfer(transfer);
+	r = fpi_usb_submit_transfer(transfer);
 	if (r < 0) {
 		libusb_free_transfer(transfer);
 		fpi_ssm_mark_aborted(ssm, r);
 	}
 }
 
-static void upektc_img_read_data(struct fpi_ssm *ssm, size_t buf_size, size_t buf_offset, libusb_transfer_cb_fn cb)
+static void upektc_img_read_data(struct fpi_ssm *ssm, unsigned char *buf, size_t buf_size, libusb_transfer_cb_fn cb)
 {
 	struct libusb_transfer *transfer = libusb_alloc_transfer(0);
 	struct fp_img_dev *dev = ssm->priv;
-	struct upektc_img_dev *upekdev = dev->priv;
 	int r;
 
 	if (!transfer) {
@@ -165,14 +170,12 @@ static void upektc_img_read_data(struct fpi_ssm *ssm, size_t buf_size, size_t bu
 		return;
 	}
 
-	BUG_ON(buf_size > MAX_RESPONSE_SIZE);
-
 	transfer->flags |= LIBUSB_TRANSFER_FREE_TRANSFER;
 
-	libusb_fill_bulk_transfer(transfer, dev->udev, EP_IN, upekdev->response + buf_offset, buf_size,
+	libusb_fill_bulk_transfer(transfer, dev->udev, EP_IN, buf, buf_size,
 		cb, ssm, BULK_TIMEOUT);
 
-	r = libusb_submit_transfer(transfer);
+	r = fpi_usb_submit_transfer(transfer);
 	if (r < 0) {
 		libusb_free_transfer(transfer);
 		fpi_ssm_mark_aborted(ssm, r);
@@ -211,24 +214,81 @@ static void capture_reqs_cb(struct libusb_transfer *transfer)
 	}
 }
 
-static int upektc_img_process_image_frame(unsigned char *image_buf, unsigned char *cmd_res)
+static gboolean upektc_img_is_image_frame(unsigned char *cmd_res)
+{
+	return cmd_res[4] == 0x00 && (cmd_res[7] == 0x2c ||
+		cmd_res[7] == 0x24 || cmd_res[7] == 0x20);
+}
+
+/* Where the image bytes of a frame start in the response, and how many
+ * there are */
+static int upektc_img_frame_payload(unsigned char *cmd_res, int *offset)
 {
-	int offset = 8;
 	int len = ((cmd_res[5] & 0x0f) << 8) | (cmd_res[6]);
 
+	*offset = 8;
 	len -= 1;
 	if (cmd_res[7] == 0x2c) {
 		len -= 10;
-		offset += 10;
+		*offset += 10;
 	}
 	if (cmd_res[7] == 0x20) {
 		len -= 4;
 	}
-	memcpy(image_buf, cmd_res + offset, len);
 
 	return len;
 }
 
+/* Chooses where the rest of a response, of which the first chunk of
+ * received bytes is in response, is read to. The rest of a frame goes
+ * straight into the image, its CRC and any trailer landing on the space of
+ * the next frame; unless that would run past the image, as for the last
+ * frame, the rest is then read after the first chunk and copied. */
+static void upektc_img_setup_rest(struct upektc_img_dev *upekdev,
+	size_t received)
+{
+	unsigned char *data = upekdev->response;
+	size_t head;
+	int offset, len;
+
+	upekdev->payload_in_img = FALSE;
+	upekdev->rest_buf = data + SHORT_RESPONSE_SIZE;
+	upekdev->rest_size = MAX_RESPONSE_SIZE - SHORT_RESPONSE_SIZE;
+
+	if (!upektc_img_is_image_frame(data))
+		return;
+	len = upektc_img_frame_payload(data, &offset);
+	if (len < 0 || received < (size_t) offset)
+		return;
+	head = received - offset;
+	if (head > (size_t) len ||
+	    upekdev->image_size + head + upekdev->response_rest > IMAGE_SIZE)
+		return;
+
+	memcpy(upekdev->img->data + upekdev->image_size, data + offset, head);
+	upekdev->rest_buf = upekdev->img->data + upekdev->image_size + head;
+	upekdev->rest_size = upekdev->response_rest;
+	upekdev->payload_in_img = TRUE;
+}
+
+/* Adds the image bytes of a frame, copying them from the response unless
+ * they were read into the image already */
+static int upektc_img_process_image_frame(struct upektc_img_dev *upekdev,
+	unsigned char *cmd_res)
+{
+	int offset;
+	int len = upektc_img_frame_payload(cmd_res, &offset);
+
+	if (len < 0 || upekdev->image_size + len > IMAGE_SIZE)
+		return -EPROTO;
+	if (!upekdev->payload_in_img)
+		memcpy(upekdev->img->data + upekdev->image_size,
+			cmd_res + offset, len);
+	upekdev->image_size += len;
+
+	return 0;
+}
+
 static void capture_read_data_cb(struct libusb_transfer *transfer)
 {
 	struct fpi_ssm *ssm = transfer->user_data;
@@ -263,6 +323,7 @@ static void capture_read_data_cb(struct libusb_transfer *transfer)
 	}
 
 	if (!upekdev->response_rest) {
+		upekdev->payload_in_img = FALSE;
 		response_size = ((data[5] & 0x0f) << 8) + data[6];
 		response_size += 9; /* 7 bytes for header, 2 for CRC */
 		if (response_size > transfer->actual_length) {
@@ -271,9 +332,16 @@ static void capture_read_data_cb(struct libusb_transfer *transfer)
 			fp_dbg("Waiting for rest of transfer");
 			BUG_ON(upekdev->response_rest);
 			upekdev->response_rest = response_size - transfer->actual_length;
+			upektc_img_setup_rest(upekdev, transfer->actual_length);
 			fpi_ssm_jump_to_state(ssm, CAPTURE_READ_DATA);
 			return;
 		}
+	} else if (upekdev->payload_in_img &&
+		   transfer->actual_length != upekdev->rest_size) {
+		fp_err("short frame, %d bytes instead of %zd",
+			transfer->actual_length, upekdev->rest_size);
+		fpi_ssm_mark_aborted(ssm, -EPROTO);
+		return;
 	}
 	upekdev->response_rest = 0;
 
@@ -320,21 +388,25 @@ static void capture_read_data_cb(struct libusb_transfer *transfer)
 				fpi_imgdev_report_finger_status(dev, TRUE);
 			/* Plain image frame */
 			case 0x24:
-				upekdev->image_size +=
-					upektc_img_process_image_frame(upekdev->image_bits + upekdev->image_size,
-						data);
+				if (upektc_img_process_image_frame(upekdev, data) < 0) {
+					fp_err("image frame overflows the image");
+					fpi_ssm_mark_aborted(ssm, -EPROTO);
+					break;
+				}
 				fpi_ssm_jump_to_state(ssm, CAPTURE_ACK_FRAME);
 				break;
 			/* Last image frame */
 			case 0x20:
-				upekdev->image_size +=
-					upektc_img_process_image_frame(upekdev->image_bits + upekdev->image_size,
-						data);
+				if (upektc_img_process_image_frame(upekdev, data) < 0) {
+					fp_err("image frame overflows the image");
+					fpi_ssm_mark_aborted(ssm, -EPROTO);
+					break;
+				}
 				BUG_ON(upekdev->image_size != IMAGE_SIZE);
 				fp_dbg("Image size is %d\n", upekdev->image_size);
-				img = fpi_img_new(IMAGE_SIZE);
+				img = upekdev->img;
+				upekdev->img = NULL;
 				img->flags = FP_IMG_PARTIAL;
-				memcpy(img->data, upekdev->image_bits, IMAGE_SIZE);
 				fpi_imgdev_image_captured(dev, img);
 				fpi_imgdev_report_finger_status(dev, FALSE);
 				fpi_ssm_mark_completed(ssm);
@@ -368,10 +440,11 @@ static void capture_run_state(struct fpi_ssm *ssm)
 	case CAPTURE_READ_DATA:
 	case CAPTURE_READ_DATA_TERM:
 		if (!upekdev->response_rest)
-			upektc_img_read_data(ssm, SHORT_RESPONSE_SIZE, 0, capture_read_data_cb);
+			upektc_img_read_data(ssm, upekdev->response, SHORT_RESPONSE_SIZE,
+				capture_read_data_cb);
 		else
-			upektc_img_read_data(ssm, MAX_RESPONSE_SIZE - SHORT_RESPONSE_SIZE,
-			SHORT_RESPONSE_SIZE, capture_read_data_cb);
+			upektc_img_read_data(ssm, upekdev->rest_buf, upekdev->rest_size,
+				capture_read_data_cb);
 		break;
 	case CAPTURE_ACK_00_28:
 	case CAPTURE_ACK_00_28_TERM:
@@ -400,6 +473,11 @@ static void capture_sm_complete(struct fpi_ssm *ssm)
 	fp_dbg("Capture completed, %d", err);
 	fpi_ssm_free(ssm);
 
+	if (upekdev->img && (upekdev->deactivating || err)) {
+		fp_img_free(upekdev->img);
+		upekdev->img = NULL;
+	}
+
 	if (upekdev->deactivating)
 		start_deactivation(dev);
 	else if (err)
@@ -414,6 +492,8 @@ static void start_capture(struct fp_img_dev *dev)
 	struct fpi_ssm *ssm;
 
 	upekdev->image_size = 0;
+	if (!upekdev->img)
+		upekdev->img = fpi_img_new_for_imgdev(dev);
 
 	ssm = fpi_ssm_new(dev->dev, capture_run_state, CAPTURE_NUM_STATES);
 	ssm->priv = dev;
@@ -464,7 +544,8 @@ static void deactivate_run_state(struct fpi_ssm *ssm)
 		upekdev->seq++;
 		break;
 	case DEACTIVATE_READ_DEINIT_DATA:
-		upektc_img_read_data(ssm, SHORT_RESPONSE_SIZE, 0, deactivate_read_data_cb);
+		upektc_img_read_data(ssm, upekdev->response, SHORT_RESPONSE_SIZE,
+			deactivate_read_data_cb);
 		break;
 	};
 }
@@ -576,7 +657,7 @@ static void activate_run_state(struct fpi_ssm *ssm)
 			LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE, 0x0c, 0x100, 0x0400, 1);
 		libusb_fill_control_transfer(transfer, ssm->dev->udev, data,
 			init_reqs_ctrl_cb, ssm, CTRL_TIMEOUT);
-		r = libusb_submit_transfer(transfer);
+		r = fpi_usb_submit_transfer(transfer);
 		if (r < 0) {
 			g_free(data);
 			libusb_free_transfer(transfer);
@@ -608,7 +689,8 @@ static void activate_run_state(struct fpi_ssm *ssm)
 	case ACTIVATE_READ_INIT_2_RESP:
 	case ACTIVATE_READ_INIT_3_RESP:
 	case ACTIVATE_READ_INIT_4_RESP:
-		upektc_img_read_data(ssm, SHORT_RESPONSE_SIZE, 0, init_read_data_cb);
+		upektc_img_read_data(ssm, upekdev->response, SHORT_RESPONSE_SIZE,
+			init_read_data_cb);
 	break;
 	}
 }
@@ -662,6 +744,10 @@ static int dev_init(struct fp_img_dev *dev, unsigned long driver_data)
 
 static void dev_deinit(struct fp_img_dev *dev)
 {
+	struct upektc_img_dev *upekdev = dev->priv;
+
+	if (upekdev->img)
+		fp_img_free(upekdev->img);
 	g_free(dev->priv);
 	libusb_release_interface(dev->udev, 0);
 	fpi_imgdev_close_complete(dev);
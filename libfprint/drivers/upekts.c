@@ -262,7 +262,7 @@ static int busy_ack_retry_read(struct read_msg_data *udata)
 	if (!transfer)
 		return -ENOMEM;
 
-	r = libusb_submit_transfer(transfer);
+	r = fpi_usb_submit_transfer(transfer);
 	if (r < 0) {
 		g_free(transfer->buffer);
 		libusb_free_transfer(transfer);
@@ -428,7 +428,7 @@ static void read_msg_cb(struct libusb_transfer *transfer)
 			data + MSG_READ_BUF_SIZE, needed, read_msg_extend_cb, udata,
 			TIMEOUT);
 
-		r = libusb_submit_transfer(etransfer);
+		r = fpi_usb_submit_transfer(etransfer);
 		if (r < 0) {
 			fp_err("extended read submission failed");
 			/* FIXME memory leak here? */
@@ -465,7 +465,7 @@ static int __read_msg_async(struct read_msg_data *udata)
 
 	libusb_fill_bulk_transfer(transfer, udata->dev->udev, EP_IN, buf,
 		MSG_READ_BUF_SIZE, read_msg_cb, udata, TIMEOUT);
-	r = libusb_submit_transfer(transfer);
+	r = fpi_usb_submit_transfer(transfer);
 	if (r < 0) {
 		g_free(buf);
 		libusb_free_transfer(transfer);
@@ -688,7 +688,7 @@ static void initsm_send_msg28_handler(struct fpi_ssm *ssm,
 		return;
 	}
 
-	r = libusb_submit_transfer(transfer);
+	r = fpi_usb_submit_transfer(transfer);
 	if (r < 0) {
 		fp_err("urb submission failed error %d in state %d", r, ssm->cur_state);
 		g_free(transfer->buffer);
@@ -720,7 +720,7 @@ static void initsm_run_state(struct fpi_ssm *ssm)
 		libusb_fill_control_transfer(transfer, ssm->dev->udev, data,
 			ctrl400_cb, ssm, TIMEOUT);
 
-		r = libusb_submit_transfer(transfer);
+		r = fpi_usb_submit_transfer(transfer);
 		if (r < 0) {
 			g_free(data);
 			libusb_free_transfer(transfer);
@@ -738,7 +738,7 @@ static void initsm_run_state(struct fpi_ssm *ssm)
 			break;
 		}
 
-		r = libusb_submit_transfer(transfer);
+		r = fpi_usb_submit_transfer(transfer);
 		if (r < 0) {
 			g_free(transfer->buffer);
 			libusb_free_transfer(transfer);
@@ -849,7 +849,7 @@ static void deinitsm_state_handler(struct fpi_ssm *ssm)
 			break;
 		}
 
-		r = libusb_submit_transfer(transfer);
+		r = fpi_usb_submit_transfer(transfer);
 		if (r < 0) {
 			g_free(transfer->buffer);
 			libusb_free_transfer(transfer);
@@ -982,7 +982,7 @@ static void enroll_start_sm_run_state(struct fpi_ssm *ssm)
 			break;
 		}
 
-		r = libusb_submit_transfer(transfer);
+		r = fpi_usb_submit_transfer(transfer);
 		if (r < 0) {
 			g_free(transfer->buffer);
 			libusb_free_transfer(transfer);
@@ -1089,10 +1089,10 @@ static void e_handle_resp02(struct fp_dev *dev, unsigned char *data,
 			data[0], data[1], data[2], data[3], data[4]);
 	} else {
 		fdata = fpi_print_data_new(dev);
-		item = fpi_print_data_item_new(data_len - sizeof(scan_comp));
+		item = fpi_print_data_add_item(fdata,
+			data_len - sizeof(scan_comp));
 		memcpy(item->data, data + sizeof(scan_comp),
 			data_len - sizeof(scan_comp));
-		fdata->prints = g_slist_prepend(fdata->prints, item);
 
 		result = FP_ENROLL_COMPLETE;
 	}
@@ -1147,7 +1147,7 @@ static void enroll_iterate(struct fp_dev *dev)
 		return;
 	}
 
-	r = libusb_submit_transfer(transfer);
+	r = fpi_usb_submit_transfer(transfer);
 	if (r < 0) {
 		g_free(transfer->buffer);
 		libusb_free_transfer(transfer);
@@ -1206,6 +1206,12 @@ static void do_verify_stop(struct fp_dev *dev)
 	fpi_ssm_start(ssm, verify_stop_deinit_cb);
 }
 
+/* Verification uploads a single template, behind this header, with the
+ * 28/03 command, then polls until the device scanned a finger and compared
+ * it on chip. Each 28/03 command waits for a scan of its own, so there is
+ * no identification: verifying the prints of a gallery in turn would take
+ * a swipe per print. That needs a form of this command carrying several
+ * templates, which has not been seen on the wire yet. */
 static const unsigned char verify_hdr[] = {
 	0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
 	0x00, 0xc0, 0xd4, 0x01, 0x00, 0x20, 0x00, 0x00, 0x00, 0x03, 0x00, 0x00,
@@ -1254,7 +1260,8 @@ static void verify_start_sm_run_state(struct fpi_ssm *ssm)
 		break;
 	case VERIFY_INIT: ;
 		struct fp_print_data *print = dev->verify_data;
-		struct fp_print_data_item *item = print->prints->data;
+		struct fp_print_data_item *item =
+			fpi_print_data_get_item(print, 0);
 		size_t data_len = sizeof(verify_hdr) + item->length;
 		unsigned char *data = g_malloc(data_len);
 		struct libusb_transfer *transfer;
@@ -1269,7 +1276,7 @@ static void verify_start_sm_run_state(struct fpi_ssm *ssm)
 			break;
 		}
 
-		r = libusb_submit_transfer(transfer);
+		r = fpi_usb_submit_transfer(transfer);
 		if (r < 0) {
 			g_free(transfer->buffer);
 			libusb_free_transfer(transfer);
@@ -1422,7 +1429,7 @@ static void verify_iterate(struct fp_dev *dev)
 			return;
 		}
 
-		r = libusb_submit_transfer(transfer);
+		r = fpi_usb_submit_transfer(transfer);
 		if (r < 0) {
 			g_free(transfer->buffer);
 			libusb_free_transfer(transfer);
@@ -211,7 +211,7 @@ static int write_regs(struct fp_img_dev *dev, uint16_t first_reg,
 	libusb_fill_control_transfer(transfer, dev->udev, data, write_regs_cb,
 		wrdata, CTRL_TIMEOUT);
 
-	r = libusb_submit_transfer(transfer);
+	r = fpi_usb_submit_transfer(transfer);
 	if (r < 0) {
 		g_free(wrdata);
 		g_free(data);
@@ -277,7 +277,7 @@ static int read_regs(struct fp_img_dev *dev, uint16_t first_reg,
 	libusb_fill_control_transfer(transfer, dev->udev, data, read_regs_cb,
 		rrdata, CTRL_TIMEOUT);
 
-	r = libusb_submit_transfer(transfer);
+	r = fpi_usb_submit_transfer(transfer);
 	if (r < 0) {
 		g_free(rrdata);
 		g_free(data);
@@ -446,7 +446,7 @@ static int start_irq_handler(struct fp_img_dev *dev)
 		irq_handler, dev, 0);
 
 	urudev->irq_transfer = transfer;
-	r = libusb_submit_transfer(transfer);
+	r = fpi_usb_submit_transfer(transfer);
 	if (r < 0) {
 		g_free(data);
 		libusb_free_transfer(transfer);
@@ -460,7 +460,7 @@ static void stop_irq_handler(struct fp_img_dev *dev, irqs_stopped_cb_fn cb)
 	struct uru4k_dev *urudev = dev->priv;
 	struct libusb_transfer *transfer = urudev->irq_transfer;
 	if (transfer) {
-		libusb_cancel_transfer(transfer);
+		fpi_usb_cancel_transfer(transfer);
 		urudev->irqs_stopped_cb = cb;
 	}
 }
@@ -640,21 +640,99 @@ static uint32_t update_key(uint32_t key)
 	return (bit & 0x80000000) | (key >> 1);
 }
 
-static uint32_t do_decode(uint8_t *data, int num_bytes, uint32_t key)
+static uint8_t key_xorbyte(uint32_t key)
 {
 	uint8_t xorbyte;
-	int i;
 
-	for (i = 0; i < num_bytes - 1; i++) {
+	xorbyte  = ((key >>  4) & 1) << 0;
+	xorbyte |= ((key >>  8) & 1) << 1;
+	xorbyte |= ((key >> 11) & 1) << 2;
+	xorbyte |= ((key >> 14) & 1) << 3;
+	xorbyte |= ((key >> 18) & 1) << 4;
+	xorbyte |= ((key >> 21) & 1) << 5;
+	xorbyte |= ((key >> 24) & 1) << 6;
+	xorbyte |= ((key >> 29) & 1) << 7;
+	return xorbyte;
+}
+
+/* Both the xor bytes and the key updates are linear in the key, so the
+ * effect of a key on the next 8 steps is the xor of the effects of each of
+ * its bytes, which are looked up in these tables. */
+#define DECODE_STEPS 8
+
+struct decode_step {
+	/* xor byte of step i in bits 8 * i to 8 * i + 7 */
+	uint64_t xorbytes;
+	/* key after the steps */
+	uint32_t key;
+};
+
+static struct decode_step decode_steps[4][256];
+
+static void init_decode_steps(void)
+{
+	static gsize initialized = 0;
+	int byte, v, i;
+
+	if (!g_once_init_enter(&initialized))
+		return;
+
+	for (byte = 0; byte < 4; byte++) {
+		for (v = 1; v < 256; v++) {
+			struct decode_step *step = &decode_steps[byte][v];
+			uint32_t key = (uint32_t) v << (8 * byte);
+
+			step->xorbytes = 0;
+			for (i = 0; i < DECODE_STEPS; i++) {
+				step->xorbytes |= (uint64_t) key_xorbyte(key) << (8 * i);
+				key = update_key(key);
+			}
+			step->key = key;
+		}
+	}
+	g_once_init_leave(&initialized, 1);
+}
+
+/* Returns the xor bytes of the next DECODE_STEPS steps and the key after
+ * them */
+static uint64_t decode_step(uint32_t *key)
+{
+	const struct decode_step *s0 = &decode_steps[0][*key & 0xff];
+	const struct decode_step *s1 = &decode_steps[1][(*key >> 8) & 0xff];
+	const struct decode_step *s2 = &decode_steps[2][(*key >> 16) & 0xff];
+	const struct decode_step *s3 = &decode_steps[3][*key >> 24];
+
+	*key = s0->key ^ s1->key ^ s2->key ^ s3->key;
+	return s0->xorbytes ^ s1->xorbytes ^ s2->xorbytes ^ s3->xorbytes;
+}
+
+static uint32_t skip_key(uint32_t key, int num_steps)
+{
+	int i = 0;
+
+	for (; i + DECODE_STEPS <= num_steps; i += DECODE_STEPS)
+		decode_step(&key);
+	for (; i < num_steps; i++)
+		key = update_key(key);
+	return key;
+}
+
+static uint32_t do_decode(uint8_t *data, int num_bytes, uint32_t key)
+{
+	int i = 0;
+
+	/* DECODE_STEPS bytes at a time, reading one byte ahead */
+	for (; i + DECODE_STEPS < num_bytes; i += DECODE_STEPS) {
+		uint64_t word;
+
+		memcpy(&word, data + i + 1, sizeof(word));
+		word = GUINT64_TO_LE(GUINT64_FROM_LE(word) ^ decode_step(&key));
+		memcpy(data + i, &word, sizeof(word));
+	}
+
+	for (; i < num_bytes - 1; i++) {
 		/* calculate xor byte and update key */
-		xorbyte  = ((key >>  4) & 1) << 0;
-		xorbyte |= ((key >>  8) & 1) << 1;
-		xorbyte |= ((key >> 11) & 1) << 2;
-		xorbyte |= ((key >> 14) & 1) << 3;
-		xorbyte |= ((key >> 18) & 1) << 4;
-		xorbyte |= ((key >> 21) & 1) << 5;
-		xorbyte |= ((key >> 24) & 1) << 6;
-		xorbyte |= ((key >> 29) & 1) << 7;
+		uint8_t xorbyte = key_xorbyte(key);
 		key = update_key(key);
 
 		/* decrypt data */
@@ -711,7 +789,7 @@ static void imaging_run_state(struct fpi_ssm *ssm)
 		urudev->img_block = 0;
 		libusb_fill_bulk_transfer(urudev->img_transfer, dev->udev, EP_DATA,
 			urudev->img_data, sizeof(struct uru4k_image), image_transfer_cb, ssm, 0);
-		r = libusb_submit_transfer(urudev->img_transfer);
+		r = fpi_usb_submit_transfer(urudev->img_transfer);
 		if (r < 0)
 			fpi_ssm_mark_aborted(ssm, -EIO);
 		break;
@@ -778,8 +856,7 @@ static void imaging_run_state(struct fpi_ssm *ssm)
 				break;
 			case 0:
 				fp_dbg("skipping %d lines", num_lines);
-				for (r = 0; r < IMAGE_WIDTH*num_lines; r++)
-					key = update_key(key);
+				key = skip_key(key, IMAGE_WIDTH*num_lines);
 				break;
 			}
 			if ((flags & BLOCKF_NOT_PRESENT) == 0)
@@ -1263,6 +1340,8 @@ static int dev_init(struct fp_img_dev *dev, unsigned long driver_data)
 	int i;
 	int r;
 
+	init_decode_steps();
+
 	/* Find fingerprint interface */
 	r = libusb_get_config_descriptor(libusb_get_device(dev->udev), 0, &config);
 	if (r < 0) {
@@ -1324,11 +1403,14 @@ static int dev_init(struct fp_img_dev *dev, unsigned long driver_data)
 		goto out;
 	}
 
-	/* Initialise NSS early */
-	rv = NSS_NoDB_Init(".");
-	if (rv != SECSuccess) {
-		fp_err("could not initialise NSS");
-		goto out;
+	/* Initialise NSS early, once: the library does not need it until a
+	 * reader is opened */
+	if (!NSS_IsInitialized()) {
+		rv = NSS_NoDB_Init(".");
+		if (rv != SECSuccess) {
+			fp_err("could not initialise NSS");
+			goto out;
+		}
 	}
 
 	urudev = g_malloc0(sizeof(*urudev));
@@ -51,8 +51,18 @@
 struct v5s_dev {
 	int capture_iteration;
 	struct fp_img *capture_img;
+	/* with partial_scan, the scans are only read up to the detection box
+	 * into detect_buf until one of them saw a finger, see dev_init() */
+	gboolean partial_scan;
+	gboolean finger_on;
+	unsigned char *detect_buf;
 	gboolean loop_running;
 	gboolean deactivating;
+	/* capture loop, restarted on every activation */
+	struct fpi_ssm loop_ssm;
+	/* waiting between the captures of an empty sensor */
+	struct fpi_poll_backoff poll;
+	struct fpi_timeout poll_timeout;
 };
 
 enum v5s_regs {
@@ -111,7 +121,7 @@ static void sm_write_reg(struct fpi_ssm *ssm, unsigned char reg,
 	libusb_fill_control_setup(data, CTRL_OUT, reg, value, 0, 0);
 	libusb_fill_control_transfer(transfer, dev->udev, data, sm_write_reg_cb,
 		ssm, CTRL_TIMEOUT);
-	r = libusb_submit_transfer(transfer);
+	r = fpi_usb_submit_transfer(transfer);
 	if (r < 0) {
 		g_free(data);
 		libusb_free_transfer(transfer);
@@ -150,7 +160,7 @@ static void sm_exec_cmd(struct fpi_ssm *ssm, unsigned char cmd,
 	libusb_fill_control_setup(data, CTRL_IN, cmd, param, 0, 0);
 	libusb_fill_control_transfer(transfer, dev->udev, data, sm_exec_cmd_cb,
 		ssm, CTRL_TIMEOUT);
-	r = libusb_submit_transfer(transfer);
+	r = fpi_usb_submit_transfer(transfer);
 	if (r < 0) {
 		g_free(data);
 		libusb_free_transfer(transfer);
@@ -168,6 +178,8 @@ static void sm_exec_cmd(struct fpi_ssm *ssm, unsigned char cmd,
 #define DETBOX_COLS 64
 #define DETBOX_ROW_END (DETBOX_ROW_START + DETBOX_ROWS)
 #define DETBOX_COL_END (DETBOX_COL_START + DETBOX_COLS)
+/* requests reading the rows down to the end of the detection box */
+#define DETECT_REQS ((DETBOX_ROW_END + ROWS_PER_RQ - 1) / ROWS_PER_RQ)
 #define FINGER_PRESENCE_THRESHOLD 100
 
 static gboolean finger_is_present(unsigned char *data)
@@ -208,15 +220,35 @@ static void capture_cb(struct libusb_transfer *transfer)
 		goto out;
 	}
 
-	if (++vdev->capture_iteration == NR_REQS) {
+	if (!vdev->capture_img && ++vdev->capture_iteration == DETECT_REQS) {
+		/* While the sensor is empty the scans stop after the
+		 * detection box, and a finger is only reported there: the
+		 * next scan is then read whole */
+		if (finger_is_present(vdev->detect_buf)) {
+			vdev->finger_on = TRUE;
+			fpi_poll_backoff_activity(&vdev->poll);
+			fpi_imgdev_report_finger_status(dev, TRUE);
+		}
+		fpi_ssm_next_state(ssm);
+	} else if (vdev->capture_img &&
+		   ++vdev->capture_iteration == NR_REQS) {
 		struct fp_img *img = vdev->capture_img;
 		/* must clear this early, otherwise the call chain takes us into
 		 * loopsm_complete where we would free it, when in fact we are
 		 * supposed to be handing off this image */
 		vdev->capture_img = NULL;
 
-		fpi_imgdev_report_finger_status(dev, finger_is_present(img->data));
-		fpi_imgdev_image_captured(dev, img);
+		if (finger_is_present(img->data)) {
+			fpi_poll_backoff_activity(&vdev->poll);
+			fpi_imgdev_report_finger_status(dev, TRUE);
+			fpi_imgdev_image_captured(dev, img);
+		} else {
+			/* back to reading the detection box only, if
+			 * partial_scan is set */
+			vdev->finger_on = FALSE;
+			fpi_imgdev_report_finger_status(dev, FALSE);
+			fp_img_free(img);
+		}
 		fpi_ssm_next_state(ssm);
 	} else {
 		capture_iterate(ssm);
@@ -240,10 +272,11 @@ static void capture_iterate(struct fpi_ssm *ssm)
 	}
 
 	libusb_fill_bulk_transfer(transfer, dev->udev, EP_IN,
-		vdev->capture_img->data + (RQ_SIZE * iteration), RQ_SIZE,
+		(vdev->capture_img ? vdev->capture_img->data : vdev->detect_buf)
+		+ (RQ_SIZE * iteration), RQ_SIZE,
 		capture_cb, ssm, CTRL_TIMEOUT);
 	transfer->flags = LIBUSB_TRANSFER_SHORT_NOT_OK;
-	r = libusb_submit_transfer(transfer);
+	r = fpi_usb_submit_transfer(transfer);
 	if (r < 0) {
 		libusb_free_transfer(transfer);
 		fpi_ssm_mark_aborted(ssm, r);
@@ -257,7 +290,8 @@ static void sm_do_capture(struct fpi_ssm *ssm)
 	struct v5s_dev *vdev = dev->priv;
 
 	fp_dbg("");
-	vdev->capture_img = fpi_img_new_for_imgdev(dev);
+	if (vdev->finger_on || !vdev->partial_scan)
+		vdev->capture_img = fpi_img_new_for_imgdev(dev);
 	vdev->capture_iteration = 0;
 	capture_iterate(ssm);
 }
@@ -273,6 +307,11 @@ enum loop_states {
 	LOOP_NUM_STATES,
 };
 
+static void loop_poll_cb(void *data)
+{
+	fpi_ssm_jump_to_state(data, LOOP_CMD_SCAN);
+}
+
 static void loop_run_state(struct fpi_ssm *ssm)
 {
 	struct fp_img_dev *dev = ssm->priv;
@@ -296,7 +335,11 @@ static void loop_run_state(struct fpi_ssm *ssm)
 		sm_do_capture(ssm);
 		break;
 	case LOOP_CAPTURE_DONE:
-		fpi_ssm_jump_to_state(ssm, LOOP_CMD_SCAN);
+		/* Scan again right away while there is a finger, and less and
+		 * less often while the sensor stays empty */
+		if (fpi_poll_backoff_start(&vdev->poll, &vdev->poll_timeout,
+				loop_poll_cb, ssm) < 0)
+			fpi_ssm_mark_aborted(ssm, -ETIME);
 		break;
 	}
 }
@@ -322,11 +365,11 @@ static void loopsm_complete(struct fpi_ssm *ssm)
 static int dev_activate(struct fp_img_dev *dev, enum fp_imgdev_state state)
 {
 	struct v5s_dev *vdev = dev->priv;
-	struct fpi_ssm *ssm = fpi_ssm_new(dev->dev, loop_run_state,
-		LOOP_NUM_STATES);
-	ssm->priv = dev;
+
 	vdev->deactivating = FALSE;
-	fpi_ssm_start(ssm, loopsm_complete);
+	vdev->finger_on = FALSE;
+	fpi_poll_backoff_activity(&vdev->poll);
+	fpi_ssm_start(&vdev->loop_ssm, loopsm_complete);
 	vdev->loop_running = TRUE;
 	fpi_imgdev_activate_complete(dev, 0);
 	return 0;
@@ -335,16 +378,37 @@ static int dev_activate(struct fp_img_dev *dev, enum fp_imgdev_state state)
 static void dev_deactivate(struct fp_img_dev *dev)
 {
 	struct v5s_dev *vdev = dev->priv;
-	if (vdev->loop_running)
+	if (vdev->loop_running) {
 		vdev->deactivating = TRUE;
-	else
+		/* the loop ends on its next scan */
+		if (fpi_timeout_pending(&vdev->poll_timeout)) {
+			fpi_timeout_cancel(&vdev->poll_timeout);
+			fpi_ssm_jump_to_state(&vdev->loop_ssm, LOOP_CMD_SCAN);
+		}
+	} else {
 		fpi_imgdev_deactivate_complete(dev);
+	}
 }
 
 static int dev_init(struct fp_img_dev *dev, unsigned long driver_data)
 {
+	struct v5s_dev *vdev;
 	int r;
-	dev->priv = g_malloc0(sizeof(struct v5s_dev));
+
+	vdev = dev->priv = g_malloc0(sizeof(struct v5s_dev));
+	/* Reading only part of a scan relies on the next CMD_SCAN restarting
+	 * the transfer from the first row, which is yet to be confirmed on the
+	 * hardware, e.g. with a LIBFPRINT_USB_RECORD capture. Until then the
+	 * scans are read whole unless LIBFPRINT_VCOM5S_PARTIAL_SCAN is set. */
+	if (g_getenv("LIBFPRINT_VCOM5S_PARTIAL_SCAN")) {
+		vdev->partial_scan = TRUE;
+		vdev->detect_buf = g_malloc(DETECT_REQS * RQ_SIZE);
+	}
+	/* a capture takes a while already, hence no wait while busy */
+	fpi_poll_backoff_init(&vdev->poll, 1, 500);
+	fpi_ssm_init(&vdev->loop_ssm, dev->dev, loop_run_state,
+		LOOP_NUM_STATES);
+	vdev->loop_ssm.priv = dev;
 
 	r = libusb_claim_interface(dev->udev, 0);
 	if (r < 0)
@@ -358,7 +422,10 @@ static int dev_init(struct fp_img_dev *dev, unsigned long driver_data)
 
 static void dev_deinit(struct fp_img_dev *dev)
 {
-	g_free(dev->priv);
+	struct v5s_dev *vdev = dev->priv;
+
+	g_free(vdev->detect_buf);
+	g_free(vdev);
 	libusb_release_interface(dev->udev, 0);
 	fpi_imgdev_close_complete(dev);
 }
@@ -66,7 +66,7 @@ static void async_write(struct fpi_ssm *ssm, void *data, int len)
 	vdev->transfer->flags |= LIBUSB_TRANSFER_FREE_TRANSFER;
 	libusb_fill_bulk_transfer(vdev->transfer, udev, 0x01, data, len,
 				  async_write_callback, ssm, VFS_USB_TIMEOUT);
-	libusb_submit_transfer(vdev->transfer);
+	fpi_usb_submit_transfer(vdev->transfer);
 }
 
 /* Callback for async_read */
@@ -118,7 +118,7 @@ static void async_read(struct fpi_ssm *ssm, int ep, void *data, int len)
 		libusb_fill_bulk_transfer(vdev->transfer, udev, ep, data, len,
 					  async_read_callback, ssm,
 					  VFS_USB_TIMEOUT);
-	libusb_submit_transfer(vdev->transfer);
+	fpi_usb_submit_transfer(vdev->transfer);
 }
 
 /* Callback for async_read */
@@ -176,32 +176,30 @@ static void async_abort(struct fpi_ssm *ssm, int ep)
 		libusb_fill_bulk_transfer(vdev->transfer, udev, ep, data, len,
 					  async_abort_callback, ssm,
 					  VFS_USB_ABORT_TIMEOUT);
-	libusb_submit_transfer(vdev->transfer);
+	fpi_usb_submit_transfer(vdev->transfer);
 }
 
 /* Image processing functions */
 
 /* Pixel getter for fpi_assemble_lines */
 static unsigned char vfs0050_get_pixel(struct fpi_line_asmbl_ctx *ctx,
-				       GSList * line, unsigned int x)
+				       struct fpi_line_store *lines,
+				       size_t line, unsigned int x)
 {
-	return ((struct vfs_line *)line->data)->data[x];
+	return ((struct vfs_line *)fpi_line_store_get(lines, line))->data[x];
 }
 
 /* Deviation getter for fpi_assemble_lines */
 static int vfs0050_get_difference(struct fpi_line_asmbl_ctx *ctx,
-				  GSList * line_list_1, GSList * line_list_2)
+				  struct fpi_line_store *lines,
+				  size_t line_1, size_t line_2)
 {
-	struct vfs_line *line1 = line_list_1->data;
-	struct vfs_line *line2 = line_list_2->data;
+	struct vfs_line *line1 = (struct vfs_line *)fpi_line_store_get(lines, line_1);
+	struct vfs_line *line2 = (struct vfs_line *)fpi_line_store_get(lines, line_2);
 	const int shift = (VFS_IMAGE_WIDTH - VFS_NEXT_LINE_WIDTH) / 2 - 1;
-	int res = 0;
-	for (int i = 0; i < VFS_NEXT_LINE_WIDTH; ++i) {
-		int x =
-		    (int)line1->next_line_part[i] - (int)line2->data[shift + i];
-		res += x * x;
-	}
-	return res;
+
+	return fpi_sq_diff(line1->next_line_part, line2->data + shift,
+			   VFS_NEXT_LINE_WIDTH);
 }
 
 #define VFS_NOISE_THRESHOLD 40
@@ -229,19 +227,24 @@ static struct fpi_line_asmbl_ctx assembling_ctx = {
 	.get_pixel = vfs0050_get_pixel,
 };
 
+/* Noise cleaning, done on the lines as they arrive so that the image is
+   ready as soon as the finger is off. IMHO, it works pretty well
+   I've not detected cases when it doesn't work or cuts a part of the finger
+   Noise arises at the end of scan when some water remains on the scanner */
+static void check_noise(struct vfs_dev_t *vdev)
+{
+	int lines = vdev->bytes / VFS_LINE_SIZE;
+
+	for (; vdev->checked_lines < lines; vdev->checked_lines++)
+		if (!is_noise(vdev->lines_buffer + vdev->checked_lines))
+			vdev->height = vdev->checked_lines + 1;
+}
+
 /* Processes image before submitting */
 static struct fp_img *prepare_image(struct vfs_dev_t *vdev)
 {
-	int height = vdev->bytes / VFS_LINE_SIZE;
+	int height = vdev->height;
 
-	/* Noise cleaning. IMHO, it works pretty well
-	   I've not detected cases when it doesn't work or cuts a part of the finger
-	   Noise arises at the end of scan when some water remains on the scanner */
-	while (height > 0) {
-		if (!is_noise(vdev->lines_buffer + height - 1))
-			break;
-		--height;
-	}
 	if (height > VFS_MAX_HEIGHT)
 		height = VFS_MAX_HEIGHT;
 
@@ -249,16 +252,16 @@ static struct fp_img *prepare_image(struct vfs_dev_t *vdev)
 	if (height < VFS_IMAGE_WIDTH)
 		return NULL;
 
-	/* Building GSList */
-	GSList *lines = NULL;
-	for (int i = height - 1; i >= 0; --i)
-		lines = g_slist_prepend(lines, vdev->lines_buffer + i);
+	/* The received lines are already one after the other */
+	struct fpi_line_store lines = {
+		.line_size = sizeof(struct vfs_line),
+		.max_lines = height,
+		.num_lines = height,
+		.data = (unsigned char *)vdev->lines_buffer,
+	};
 
 	/* Perform line assembling */
-	struct fp_img *img = fpi_assemble_lines(&assembling_ctx, lines, height);
-
-	g_slist_free(lines);
-	return img;
+	return fpi_assemble_lines(&assembling_ctx, &lines);
 }
 
 /* Processes and submits image after fingerprint received */
@@ -406,6 +409,7 @@ static void clear_data(struct vfs_dev_t *vdev)
 	g_free(vdev->lines_buffer);
 	vdev->lines_buffer = NULL;
 	vdev->memory = vdev->bytes = 0;
+	vdev->checked_lines = vdev->height = 0;
 }
 
 /* After receiving interrupt from EP3 */
@@ -490,6 +494,7 @@ static void receive_callback(struct libusb_transfer *transfer)
 		fpi_ssm_next_state(ssm);
 	} else {
 		vdev->bytes += transferred;
+		check_noise(vdev);
 
 		/* We need more data */
 		fpi_ssm_jump_to_state(ssm, ssm->cur_state);
@@ -586,7 +591,7 @@ static void activate_ssm(struct fpi_ssm *ssm)
 					       vdev->interrupt,
 					       VFS_INTERRUPT_SIZE,
 					       interrupt_callback, ssm, 0);
-		libusb_submit_transfer(vdev->transfer);
+		fpi_usb_submit_transfer(vdev->transfer);
 
 		/* This flag could be turned off only in callback function */
 		vdev->wait_interrupt = 1;
@@ -600,7 +605,7 @@ static void activate_ssm(struct fpi_ssm *ssm)
 	case SSM_WAIT_INTERRUPT:
 		/* Check if user had interrupted the process */
 		if (!vdev->active) {
-			libusb_cancel_transfer(vdev->transfer);
+			fpi_usb_cancel_transfer(vdev->transfer);
 			fpi_ssm_jump_to_state(ssm, SSM_CLEAR_EP2);
 			break;
 		}
@@ -616,6 +621,7 @@ static void activate_ssm(struct fpi_ssm *ssm)
 			vdev->memory = VFS_USB_BUFFER_SIZE;
 			vdev->lines_buffer = g_malloc(vdev->memory);
 			vdev->bytes = 0;
+			vdev->checked_lines = vdev->height = 0;
 
 			/* Finger is on the scanner */
 			fpi_imgdev_report_finger_status(idev, 1);
@@ -637,7 +643,7 @@ static void activate_ssm(struct fpi_ssm *ssm)
 					  vdev->bytes, VFS_USB_BUFFER_SIZE,
 					  receive_callback, ssm,
 					  VFS_USB_TIMEOUT);
-		libusb_submit_transfer(vdev->transfer);
+		fpi_usb_submit_transfer(vdev->transfer);
 		break;
 
 	case SSM_SUBMIT_IMAGE:
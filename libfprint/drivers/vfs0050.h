@@ -99,6 +99,10 @@ struct vfs_dev_t {
 	/* Current number of received bytes and current memory used by data */
 	int bytes, memory;
 
+	/* Number of received lines checked for noise, and number of lines up
+	 * to the last one which is not noise */
+	int checked_lines, height;
+
 	/* USB buffer for fingerprint */
 	char *usb_buffer;
 
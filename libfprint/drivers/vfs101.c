@@ -38,6 +38,9 @@
 #define VFS_FRAME_SIZE		292
 #define VFS_BLOCK_SIZE		16 * VFS_FRAME_SIZE
 
+/* Number of blocks read at the same time while loading an image */
+#define VFS_LOAD_TRANSFERS	4
+
 /* Buffer height */
 #define VFS_BUFFER_HEIGHT	5000
 
@@ -102,6 +105,21 @@ struct vfs101_dev
 	/* Usb transfer */
 	struct libusb_transfer *transfer;
 
+	/* Usb transfers of image load, block n is read by transfer n modulo
+	 * VFS_LOAD_TRANSFERS */
+	struct libusb_transfer *load_transfers[VFS_LOAD_TRANSFERS];
+
+	/* Image load state: next block to read, reads submitted, load ended
+	 * and its result */
+	int load_block;
+	int load_flying;
+	int load_done;
+	int load_result;
+
+	/* Sum of byte 5 minus byte 4 of the loaded lines, and lines summed */
+	long int contrast_sum;
+	int contrast_lines;
+
 	/* Buffer for input/output */
 	unsigned char buffer[VFS_BUFFER_SIZE];
 
@@ -111,8 +129,16 @@ struct vfs101_dev
 	/* Ignore usb error */
 	int ignore_error;
 
-	/* Timeout */
-	struct fpi_timeout *timeout;
+	/* Timeout, reused by every asynchronous sleep */
+	struct fpi_timeout timeout;
+
+	/* Interval between the polls of the finger state */
+	struct fpi_poll_backoff poll;
+
+	/* Swap and loop state machines, restarted for every swap and
+	 * activation */
+	struct fpi_ssm swap_ssm;
+	struct fpi_ssm loop_ssm;
 
 	/* Loop counter */
 	int counter;
@@ -274,7 +300,7 @@ static void async_send(struct fpi_ssm *ssm)
 	libusb_fill_bulk_transfer(vdev->transfer, dev->udev, EP_OUT(1), vdev->buffer, vdev->length, async_send_cb, ssm, BULK_TIMEOUT);
 
 	/* Submit transfer */
-	r = libusb_submit_transfer(vdev->transfer);
+	r = fpi_usb_submit_transfer(vdev->transfer);
 	if (r != 0)
 	{
 		/* Submission of transfer failed, return IO error */
@@ -356,7 +382,7 @@ static void async_recv(struct fpi_ssm *ssm)
 	libusb_fill_bulk_transfer(vdev->transfer, dev->udev, EP_IN(1), vdev->buffer, 0x0f, async_recv_cb, ssm, BULK_TIMEOUT);
 
 	/* Submit transfer */
-	r = libusb_submit_transfer(vdev->transfer);
+	r = fpi_usb_submit_transfer(vdev->transfer);
 	if (r != 0)
 	{
 		/* Submission of transfer failed, free transfer and return IO error */
@@ -368,7 +394,63 @@ static void async_recv(struct fpi_ssm *ssm)
 	}
 }
 
-static void async_load(struct fpi_ssm *ssm);
+static void async_load_cb(struct libusb_transfer *transfer);
+
+#define offset(x, y)	((x) + ((y) * VFS_FRAME_SIZE))
+
+/* Add the lines loaded so far to the contrast sum */
+static void load_sum_contrast(struct vfs101_dev *vdev)
+{
+	int y, lines = vdev->length / VFS_FRAME_SIZE;
+
+	for (y = vdev->contrast_lines; y < lines; y++)
+		vdev->contrast_sum += vdev->buffer[offset(5, y)] -
+			vdev->buffer[offset(4, y)];
+	vdev->contrast_lines = lines;
+}
+
+/* Submit reads of the next blocks, up to VFS_LOAD_TRANSFERS at once */
+static int load_submit(struct fpi_ssm *ssm)
+{
+	struct fp_img_dev *dev = ssm->priv;
+	struct vfs101_dev *vdev = dev->priv;
+	struct libusb_transfer *transfer;
+	int r;
+
+	while (vdev->load_flying < VFS_LOAD_TRANSFERS &&
+		(vdev->load_block + 1) * VFS_BLOCK_SIZE <= VFS_BUFFER_SIZE)
+	{
+		transfer = vdev->load_transfers[vdev->load_block % VFS_LOAD_TRANSFERS];
+
+		/* Read the block into its place in the buffer, the timeout
+		 * counting from the completion of the blocks in front of it */
+		libusb_fill_bulk_transfer(transfer, dev->udev, EP_IN(2),
+			vdev->buffer + vdev->load_block * VFS_BLOCK_SIZE,
+			VFS_BLOCK_SIZE, async_load_cb, ssm,
+			BULK_TIMEOUT * (vdev->load_flying + 1));
+
+		r = fpi_usb_submit_transfer(transfer);
+		if (r != 0)
+			return r;
+
+		vdev->load_block++;
+		vdev->load_flying++;
+	}
+
+	return 0;
+}
+
+/* End image load, cancelling the reads submitted after the last block */
+static void load_done(struct vfs101_dev *vdev, int result)
+{
+	int i;
+
+	vdev->load_done = TRUE;
+	vdev->load_result = result;
+
+	for (i = 0; i < VFS_LOAD_TRANSFERS; i++)
+		fpi_usb_cancel_transfer(vdev->load_transfers[i]);
+}
 
 /* Callback of asynchronous load */
 static void async_load_cb(struct libusb_transfer *transfer)
@@ -377,8 +459,11 @@ static void async_load_cb(struct libusb_transfer *transfer)
 	struct fp_img_dev *dev = ssm->priv;
 	struct vfs101_dev *vdev = dev->priv;
 
-	/* Cleanup transfer */
-	vdev->transfer = NULL;
+	vdev->load_flying--;
+
+	/* Reads complete in order, nothing to do after the image end */
+	if (vdev->load_done)
+		goto out;
 
 	/* Skip error check if ignore_error is set */
 	if (!vdev->ignore_error)
@@ -387,8 +472,7 @@ static void async_load_cb(struct libusb_transfer *transfer)
 		{
 			/* Transfer not completed */
 			fp_err("transfer not completed, status = %d, length = %d", transfer->status, vdev->length);
-			fpi_imgdev_session_error(dev, -EIO);
-			fpi_ssm_mark_aborted(ssm, -EIO);
+			load_done(vdev, -EIO);
 			goto out;
 		}
 
@@ -396,14 +480,14 @@ static void async_load_cb(struct libusb_transfer *transfer)
 		{
 			/* Received incomplete frame, return protocol error */
 			fp_err("received incomplete frame");
-			fpi_imgdev_session_error(dev, -EIO);
-			fpi_ssm_mark_aborted(ssm, -EIO);
+			load_done(vdev, -EIO);
 			goto out;
 		}
 	}
 
 	/* Increase image length */
 	vdev->length += transfer->actual_length;
+	load_sum_contrast(vdev);
 
 	if (transfer->actual_length == VFS_BLOCK_SIZE)
 	{
@@ -411,28 +495,38 @@ static void async_load_cb(struct libusb_transfer *transfer)
 		{
 			/* Buffer full, image too large, return no memory error */
 			fp_err("buffer full, image too large");
-			fpi_imgdev_session_error(dev, -ENOMEM);
-			fpi_ssm_mark_aborted(ssm, -ENOMEM);
-			goto out;
+			load_done(vdev, -ENOMEM);
+		}
+		else if (load_submit(ssm) != 0)
+		{
+			/* Submission of transfer failed, return IO error */
+			fp_err("submit of usb transfer failed");
+			load_done(vdev, -EIO);
 		}
-		else
-			/* Image load not completed, submit another asynchronous load */
-			async_load(ssm);
 	}
 	else
-	{
-		/* Reset ignore_error flag */
-		if (vdev->ignore_error)
-			vdev->ignore_error = FALSE;
+		/* Image load completed */
+		load_done(vdev, 0);
+
+out:
+	if (!vdev->load_done || vdev->load_flying > 0)
+		return;
 
-		/* Image load completed, go to next state */
-		vdev->height = vdev->length / VFS_FRAME_SIZE;
-		fp_dbg("image loaded, height = %d", vdev->height);
-		fpi_ssm_next_state(ssm);
+	if (vdev->load_result < 0)
+	{
+		fpi_imgdev_session_error(dev, vdev->load_result);
+		fpi_ssm_mark_aborted(ssm, vdev->load_result);
+		return;
 	}
 
-out:
-	libusb_free_transfer(transfer);
+	/* Reset ignore_error flag */
+	if (vdev->ignore_error)
+		vdev->ignore_error = FALSE;
+
+	/* Image load completed, go to next state */
+	vdev->height = vdev->length / VFS_FRAME_SIZE;
+	fp_dbg("image loaded, height = %d", vdev->height);
+	fpi_ssm_next_state(ssm);
 }
 
 /* Submit asynchronous load */
@@ -440,33 +534,26 @@ static void async_load(struct fpi_ssm *ssm)
 {
 	struct fp_img_dev *dev = ssm->priv;
 	struct vfs101_dev *vdev = dev->priv;
-	unsigned char *buffer;
 	int r;
 
-	/* Allocation of transfer */
-	vdev->transfer = libusb_alloc_transfer(0);
-	if (!vdev->transfer)
-	{
-		/* Allocation transfer failed, return no memory error */
-		fp_err("allocation of usb transfer failed");
-		fpi_imgdev_session_error(dev, -ENOMEM);
-		fpi_ssm_mark_aborted(ssm, -ENOMEM);
-		return;
-	}
-
-	/* Append new data into the buffer */
-	buffer = vdev->buffer + vdev->length;
+	vdev->load_block = 0;
+	vdev->load_done = FALSE;
+	vdev->load_result = 0;
+	vdev->contrast_sum = 0;
+	vdev->contrast_lines = 0;
 
-	/* Prepare bulk transfer */
-	libusb_fill_bulk_transfer(vdev->transfer, dev->udev, EP_IN(2), buffer, VFS_BLOCK_SIZE, async_load_cb, ssm, BULK_TIMEOUT);
-
-	/* Submit transfer */
-	r = libusb_submit_transfer(vdev->transfer);
+	/* Submit transfers */
+	r = load_submit(ssm);
 	if (r != 0)
 	{
 		/* Submission of transfer failed, return IO error */
-		libusb_free_transfer(vdev->transfer);
 		fp_err("submit of usb transfer failed");
+		if (vdev->load_flying > 0)
+		{
+			/* Abort once the submitted reads returned */
+			load_done(vdev, -EIO);
+			return;
+		}
 		fpi_imgdev_session_error(dev, -EIO);
 		fpi_ssm_mark_aborted(ssm, -EIO);
 		return;
@@ -477,11 +564,6 @@ static void async_load(struct fpi_ssm *ssm)
 static void async_sleep_cb(void *data)
 {
 	struct fpi_ssm *ssm = data;
-	struct fp_img_dev *dev = ssm->priv;
-	struct vfs101_dev *vdev = dev->priv;
-
-	/* Cleanup timeout */
-	vdev->timeout = NULL;
 
 	fpi_ssm_next_state(ssm);
 }
@@ -492,10 +574,8 @@ static void async_sleep(unsigned int msec, struct fpi_ssm *ssm)
 	struct fp_img_dev *dev = ssm->priv;
 	struct vfs101_dev *vdev = dev->priv;
 
-	/* Add timeout */
-	vdev->timeout = fpi_timeout_add(msec, async_sleep_cb, ssm);
-
-	if (vdev->timeout == NULL)
+	/* Start timeout */
+	if (fpi_timeout_start(&vdev->timeout, msec, async_sleep_cb, ssm) < 0)
 	{
 		/* Failed to add timeout */
 		fp_err("failed to add timeout");
@@ -534,7 +614,6 @@ static void m_swap(struct fpi_ssm *ssm, unsigned char *data, size_t length)
 {
 	struct fp_img_dev *dev = ssm->priv;
 	struct vfs101_dev *vdev = dev->priv;
-	struct fpi_ssm *subsm;
 
 	/* Prepare data for sending */
 	memcpy(vdev->buffer, data, length);
@@ -542,9 +621,7 @@ static void m_swap(struct fpi_ssm *ssm, unsigned char *data, size_t length)
 	vdev->length = length;
 
 	/* Start swap ssm */
-	subsm = fpi_ssm_new(dev->dev, m_swap_state, M_SWAP_NUM_STATES);
-	subsm->priv = dev;
-	fpi_ssm_start_subsm(ssm, subsm);
+	fpi_ssm_start_subsm(ssm, &vdev->swap_ssm);
 }
 
 /* Retrieve fingerprint image */
@@ -665,8 +742,6 @@ static int action_completed(struct fp_img_dev *dev)
 	return TRUE;
 }
 
-#define offset(x, y)	((x) + ((y) * VFS_FRAME_SIZE))
-
 /* Screen image to remove noise and find bottom line and height od image */
 static void img_screen(struct vfs101_dev *vdev)
 {
@@ -859,13 +934,9 @@ static inline int vfs_finger_state(struct vfs101_dev *vdev)
 /* Check contrast of image */
 static void vfs_check_contrast(struct vfs101_dev *vdev)
 {
-	int y;
-	long int count = 0;
-
-	/* Check difference from byte 4 to byte 5 for verify contrast of image */
-	for (y = 0; y < vdev->height; y++)
-		count = count + vdev->buffer[offset(5, y)] - vdev->buffer[offset(4, y)];
-	count = count / vdev->height;
+	/* Difference from byte 4 to byte 5 verifies contrast of image, summed
+	 * while the image was loaded */
+	long int count = vdev->contrast_sum / vdev->height;
 
 	if (count < 16)
 	{
@@ -939,8 +1010,8 @@ static void m_loop_state(struct fpi_ssm *ssm)
 		break;
 
 	case M_LOOP_0_SLEEP:
-		/* Wait fingerprint scanning */
-		async_sleep(50, ssm);
+		/* Wait fingerprint scanning, longer while the reader is idle */
+		async_sleep(fpi_poll_backoff_next(&vdev->poll), ssm);
 		break;
 
 	case M_LOOP_0_GET_STATE:
@@ -958,6 +1029,8 @@ static void m_loop_state(struct fpi_ssm *ssm)
 			break;
 
 		case VFS_FINGER_PRESENT:
+			fpi_poll_backoff_activity(&vdev->poll);
+
 			/* Load image from reader */
 			vdev->ignore_error = TRUE;
 			vfs_img_load(ssm);
@@ -1427,7 +1500,6 @@ static void m_init_complete(struct fpi_ssm *ssm)
 {
 	struct fp_img_dev *dev = ssm->priv;
 	struct vfs101_dev *vdev = dev->priv;
-	struct fpi_ssm *ssm_loop;
 
 	if (!ssm->error && vdev->active)
 	{
@@ -1435,9 +1507,7 @@ static void m_init_complete(struct fpi_ssm *ssm)
 		fpi_imgdev_activate_complete(dev, 0);
 
 		/* Start loop ssm */
-		ssm_loop = fpi_ssm_new(dev->dev, m_loop_state, M_LOOP_NUM_STATES);
-		ssm_loop->priv = dev;
-		fpi_ssm_start(ssm_loop, m_loop_complete);
+		fpi_ssm_start(&vdev->loop_ssm, m_loop_complete);
 	}
 
 	/* Free sequential state machine */
@@ -1469,6 +1539,9 @@ static int dev_activate(struct fp_img_dev *dev, enum fp_imgdev_state state)
 	vdev->counter = 0;
 	vdev->enroll_stage = 0;
 
+	/* Poll quickly for the finger to come */
+	fpi_poll_backoff_activity(&vdev->poll);
+
 	/* Start init ssm */
 	ssm = fpi_ssm_new(dev->dev, m_init_state, M_INIT_NUM_STATES);
 	ssm->priv = dev;
@@ -1486,7 +1559,8 @@ static void dev_deactivate(struct fp_img_dev *dev)
 	vdev->active = FALSE;
 
 	/* Handle eventualy existing events */
-	while (vdev->transfer || vdev->timeout)
+	while (vdev->transfer || vdev->load_flying ||
+		fpi_timeout_pending(&vdev->timeout))
 		fp_handle_events();
 
 	/* Notify deactivate complete */
@@ -1497,7 +1571,7 @@ static void dev_deactivate(struct fp_img_dev *dev)
 static int dev_open(struct fp_img_dev *dev, unsigned long driver_data)
 {
 	struct vfs101_dev *vdev = NULL;
-	int r;
+	int r, i;
 
 	/* Claim usb interface */
 	r = libusb_claim_interface(dev->udev, 0);
@@ -1511,8 +1585,30 @@ static int dev_open(struct fp_img_dev *dev, unsigned long driver_data)
 	/* Initialize private structure */
 	vdev = g_malloc0(sizeof(struct vfs101_dev));
 	vdev->seqnum = -1;
+	fpi_poll_backoff_init(&vdev->poll, 50, 1000);
 	dev->priv = vdev;
 
+	/* Set up the state machines run over and over */
+	fpi_ssm_init(&vdev->swap_ssm, dev->dev, m_swap_state, M_SWAP_NUM_STATES);
+	vdev->swap_ssm.priv = dev;
+	fpi_ssm_init(&vdev->loop_ssm, dev->dev, m_loop_state, M_LOOP_NUM_STATES);
+	vdev->loop_ssm.priv = dev;
+
+	for (i = 0; i < VFS_LOAD_TRANSFERS; i++)
+	{
+		vdev->load_transfers[i] = libusb_alloc_transfer(0);
+		if (!vdev->load_transfers[i])
+		{
+			/* Allocation transfer failed, return no memory error */
+			fp_err("allocation of usb transfer failed");
+			while (i--)
+				libusb_free_transfer(vdev->load_transfers[i]);
+			g_free(vdev);
+			libusb_release_interface(dev->udev, 0);
+			return -ENOMEM;
+		}
+	}
+
 	/* Notify open complete */
 	fpi_imgdev_open_complete(dev, 0);
 
@@ -1522,8 +1618,15 @@ static int dev_open(struct fp_img_dev *dev, unsigned long driver_data)
 /* Close device */
 static void dev_close(struct fp_img_dev *dev)
 {
+	struct vfs101_dev *vdev = dev->priv;
+	int i;
+
+	/* Release usb transfers of image load */
+	for (i = 0; i < VFS_LOAD_TRANSFERS; i++)
+		libusb_free_transfer(vdev->load_transfers[i]);
+
 	/* Release private structure */
-	g_free(dev->priv);
+	g_free(vdev);
 
 	/* Release usb interface */
 	libusb_release_interface(dev->udev, 0);
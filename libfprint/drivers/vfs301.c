@@ -127,15 +127,17 @@ static void m_loop_state(struct fpi_ssm *ssm)
 		break;
 
 	case M_WAIT_PRINT:
-		/* Wait fingerprint scanning */
-		async_sleep(200, ssm);
+		/* Wait fingerprint scanning, longer while the reader is idle */
+		async_sleep(fpi_poll_backoff_next(vdev->poll), ssm);
 		break;
 
 	case M_CHECK_PRINT:
-		if (!vfs301_proto_peek_event(dev->udev, vdev))
+		if (!vfs301_proto_peek_event(dev->udev, vdev)) {
 			fpi_ssm_jump_to_state(ssm, M_WAIT_PRINT);
-		else
+		} else {
+			fpi_poll_backoff_activity(vdev->poll);
 			fpi_ssm_next_state(ssm);
+		}
 		break;
 
 	case M_READ_PRINT_START:
@@ -215,8 +217,12 @@ static void m_init_complete(struct fpi_ssm *ssm)
 /* Activate device */
 static int dev_activate(struct fp_img_dev *dev, enum fp_imgdev_state state)
 {
+	vfs301_dev_t *vdev = dev->priv;
 	struct fpi_ssm *ssm;
 
+	/* Poll quickly for the finger to come */
+	fpi_poll_backoff_activity(vdev->poll);
+
 	/* Start init ssm */
 	ssm = fpi_ssm_new(dev->dev, m_init_state, 1);
 	ssm->priv = dev;
@@ -250,6 +256,10 @@ static int dev_open(struct fp_img_dev *dev, unsigned long driver_data)
 
 	vdev->scanline_buf = malloc(0);
 	vdev->scanline_count = 0;
+	vdev->scanline_size = 0;
+
+	vdev->poll = g_new(struct fpi_poll_backoff, 1);
+	fpi_poll_backoff_init(vdev->poll, 200, 1000);
 
 	/* Notify open complete */
 	fpi_imgdev_open_complete(dev, 0);
@@ -261,6 +271,7 @@ static void dev_close(struct fp_img_dev *dev)
 {
 	/* Release private structure */
 	free(((vfs301_dev_t*)dev->priv)->scanline_buf);
+	g_free(((vfs301_dev_t*)dev->priv)->poll);
 	g_free(dev->priv);
 
 	/* Release usb interface */
@@ -0,0 +1,99 @@
+/*
+ * vfs301/vfs300 fingerprint reader driver
+ * https://github.com/andree182/vfs301
+ *
+ * Copyright (c) 2011-2012 Andrej Krutak <dev@andree.sk>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Build time helper: prints vfs301_proto_blobs.h, the hex string fragments
+ * of vfs301_proto_fragments.h converted to the bytes sent to the device, so
+ * that the driver does not have to parse them.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#define VFS301_FRAGMENTS_HEX
+#include "vfs301_proto_fragments.h"
+
+#define HEX_TO_INT(c) \
+	(((c) >= '0' && (c) <= '9') ? ((c) - '0') : \
+	 ((c) >= 'A' && (c) <= 'F') ? ((c) - 'A' + 10) : -1)
+
+static int print_blob(const char *name, const char **srcL)
+{
+	int len = 0;
+
+	printf("static const unsigned char %s[] = {", name);
+
+	for (; *srcL != NULL; srcL++) {
+		const char *src;
+
+		for (src = *srcL; *src != '\0'; src += 2) {
+			int hi = HEX_TO_INT(src[0]);
+			int lo = src[1] != '\0' ? HEX_TO_INT(src[1]) : -1;
+
+			if (hi < 0 || lo < 0) {
+				fprintf(stderr, "%s: invalid hex string \"%s\"\n",
+					name, *srcL);
+				return -1;
+			}
+
+			printf("%s0x%02X,", len % 12 ? " " : "\n\t", (hi << 4) | lo);
+			len++;
+		}
+	}
+
+	printf("\n};\n\n");
+	return len;
+}
+
+#define PRINT_BLOB(x) \
+	if (print_blob(#x, x) < 0) \
+		return 1;
+
+int main(void)
+{
+	int len;
+
+	printf("/* Generated by vfs301_gen_blobs from vfs301_proto_fragments.h,"
+	       " do not edit */\n\n");
+	printf("#ifndef __VFS301_PROTO_BLOBS_H\n#define __VFS301_PROTO_BLOBS_H\n\n");
+
+	PRINT_BLOB(vfs301_0220_01);
+	PRINT_BLOB(vfs301_0220_02);
+	PRINT_BLOB(vfs301_0220_03);
+	PRINT_BLOB(vfs301_02D0_01);
+	PRINT_BLOB(vfs301_02D0_02);
+	PRINT_BLOB(vfs301_02D0_03);
+	PRINT_BLOB(vfs301_02D0_04);
+	PRINT_BLOB(vfs301_02D0_05);
+	PRINT_BLOB(vfs301_02D0_06);
+	PRINT_BLOB(vfs301_02D0_07);
+
+	len = print_blob("vfs301_next_scan_template", vfs301_next_scan_template);
+	if (len < 0)
+		return 1;
+
+	/* where the scan type is patched in, the DEADDEAD of S4("DEAD") */
+	printf("#define VFS301_NEXT_SCAN_FIELD %d\n\n",
+	       len - (int)(sizeof(S4_TAIL) - 1) / 2 - 4);
+
+	printf("#endif\n");
+	return 0;
+}
@@ -37,6 +37,7 @@
 
 #include "vfs301_proto.h"
 #include "vfs301_proto_fragments.h"
+#include "vfs301_proto_blobs.h"
 #include <unistd.h>
 
 #define min(a, b) (((a) < (b)) ? (a) : (b))
@@ -136,31 +137,18 @@ static void vfs301_proto_generate_0B(int subtype, unsigned char *data, int *len)
 	}
 }
 
-#define HEX_TO_INT(c) \
-	(((c) >= '0' && (c) <= '9') ? ((c) - '0') : ((c) - 'A' + 10))
+#define RAW_DATA(x) x, sizeof(x)
 
-static void translate_str(const char **srcL, unsigned char *data, int *len)
+static void copy_blob(const unsigned char *blob, size_t blob_len,
+	unsigned char *data, int *len)
 {
-	const char *src;
-	unsigned char *dataOrig = data;
-
-	while (*srcL != NULL) {
-		src = *srcL;
-		while (*src != '\0') {
-			assert(*src != '\0');
-			assert(*(src +1) != '\0');
-			*data = (unsigned char)((HEX_TO_INT(*src) << 4) | (HEX_TO_INT(*(src + 1))));
-
-			data++;
-			src += 2;
-		}
-
-		srcL++;
-	}
-
-	*len = data - dataOrig;
+	memcpy(data, blob, blob_len);
+	*len = blob_len;
 }
 
+#define COPY_BLOB(x, data, len) \
+	copy_blob(x, sizeof(x), data, len)
+
 static void vfs301_proto_generate(int type, int subtype, unsigned char *data, int *len)
 {
 	switch (type) {
@@ -184,35 +172,39 @@ static void vfs301_proto_generate(int type, int subtype, unsigned char *data, in
 		break;
 	case 0x02D0:
 		{
-			const char **dataLs[] = {
-				vfs301_02D0_01,
-				vfs301_02D0_02,
-				vfs301_02D0_03,
-				vfs301_02D0_04,
-				vfs301_02D0_05,
-				vfs301_02D0_06,
-				vfs301_02D0_07,
+			static const struct {
+				const unsigned char *blob;
+				size_t len;
+			} dataLs[] = {
+				{ RAW_DATA(vfs301_02D0_01) },
+				{ RAW_DATA(vfs301_02D0_02) },
+				{ RAW_DATA(vfs301_02D0_03) },
+				{ RAW_DATA(vfs301_02D0_04) },
+				{ RAW_DATA(vfs301_02D0_05) },
+				{ RAW_DATA(vfs301_02D0_06) },
+				{ RAW_DATA(vfs301_02D0_07) },
 			};
 			assert((int)subtype <= (int)(sizeof(dataLs) / sizeof(dataLs[0])));
-			translate_str(dataLs[subtype - 1], data, len);
+			copy_blob(dataLs[subtype - 1].blob, dataLs[subtype - 1].len,
+				data, len);
 		}
 		break;
 	case 0x0220:
 		switch (subtype) {
 		case 1:
-			translate_str(vfs301_0220_01, data, len);
+			COPY_BLOB(vfs301_0220_01, data, len);
 			break;
 		case 2:
-			translate_str(vfs301_0220_02, data, len);
+			COPY_BLOB(vfs301_0220_02, data, len);
 			break;
 		case 3:
-			translate_str(vfs301_0220_03, data, len);
+			COPY_BLOB(vfs301_0220_03, data, len);
 			break;
 		case 0xFA00:
 		case 0x2C01:
 		case 0x5E01:
-			translate_str(vfs301_next_scan_template, data, len);
-			unsigned char *field = data + *len - (sizeof(S4_TAIL) - 1) / 2 - 4;
+			COPY_BLOB(vfs301_next_scan_template, data, len);
+			unsigned char *field = data + VFS301_NEXT_SCAN_FIELD;
 
 			assert(*field == 0xDE);
 			assert(*(field + 1) == 0xAD);
@@ -241,28 +233,22 @@ static void vfs301_proto_generate(int type, int subtype, unsigned char *data, in
 /************************** SCAN IMAGE PROCESSING *****************************/
 
 #ifdef SCAN_FINISH_DETECTION
-static int img_is_finished_scan(fp_line_t *lines, int no_lines)
+static int img_is_empty_line(const vfs301_line_t *line)
 {
-	int i;
 	int j;
-	int rv = 1;
 
-	for (i = no_lines - VFS301_FP_SUM_LINES; i < no_lines; i++) {
-		/* check the line for fingerprint data */
-		for (j = 0; j < sizeof(lines[i].sum2); j++) {
-			if (lines[i].sum2[j] > (VFS301_FP_SUM_MEDIAN + VFS301_FP_SUM_EMPTY_RANGE))
-				rv = 0;
-		}
+	/* check the line for fingerprint data */
+	for (j = 0; j < sizeof(line->sum2); j++) {
+		if (line->sum2[j] > (VFS301_FP_SUM_MEDIAN + VFS301_FP_SUM_EMPTY_RANGE))
+			return 0;
 	}
 
-	return rv;
+	return 1;
 }
 #endif
 
-static int scanline_diff(const unsigned char *scanlines, int prev, int cur)
+static int scanline_diff(const unsigned char *line1, const unsigned char *line2)
 {
-	const unsigned char *line1 = scanlines + prev * VFS301_FP_OUTPUT_WIDTH;
-	const unsigned char *line2 = scanlines + cur * VFS301_FP_OUTPUT_WIDTH;
 	int i;
 	int diff;
 
@@ -292,35 +278,18 @@ void vfs301_extract_image(
 	vfs301_dev_t *vfs, unsigned char *output, int *output_height
 )
 {
-	const unsigned char *scanlines = vfs->scanline_buf;
-	int last_line;
-	int i;
-
 	assert(vfs->scanline_count >= 1);
 
-	*output_height = 1;
-	memcpy(output, scanlines, VFS301_FP_OUTPUT_WIDTH);
-	last_line = 0;
-
-	/* The following algorithm is quite trivial - it just picks lines that
-	 * differ more than VFS301_FP_LINE_DIFF_THRESHOLD.
-	 * TODO: A nicer approach would be to pick those lines and then do some kind 
-	 * of bi/tri-linear resampling to get the output (so that we don't get so
-	 * many false edges etc.).
-	 */
-	for (i = 1; i < vfs->scanline_count; i++) {
-		if (scanline_diff(scanlines, last_line, i)) {
-			memcpy(
-				output + VFS301_FP_OUTPUT_WIDTH * (*output_height),
-				scanlines + VFS301_FP_OUTPUT_WIDTH * i,
-				VFS301_FP_OUTPUT_WIDTH
-			);
-			last_line = i;
-			(*output_height)++;
-		}
-	}
+	/* The lines were picked as they came in, see img_process_data() */
+	memcpy(output, vfs->scanline_buf,
+		vfs->scanline_count * VFS301_FP_OUTPUT_WIDTH);
+	*output_height = vfs->scanline_count;
 }
 
+/* Each block of lines is only looked at once: the lines which make it into
+ * the image are picked as they arrive, and the end of the scan is told
+ * from a count of the empty lines at its end, so that the work done for a
+ * block does not grow with the length of the swipe. */
 static int img_process_data(
 	int first_block, vfs301_dev_t *dev, const unsigned char *buf, int len
 )
@@ -328,39 +297,55 @@ static int img_process_data(
 	vfs301_line_t *lines = (vfs301_line_t*)buf;
 	int no_lines = len / sizeof(vfs301_line_t);
 	int i;
-	/*int no_nonempty;*/
 	unsigned char *cur_line;
-	int last_img_height;
-#ifdef SCAN_FINISH_DETECTION
-	int finished_scan;
-#endif
 
 	if (first_block) {
-		last_img_height = 0;
-		dev->scanline_count = no_lines;
-	} else {
-		last_img_height = dev->scanline_count;
-		dev->scanline_count += no_lines;
+		dev->scanline_count = 0;
+		dev->empty_lines = 0;
 	}
 
-	dev->scanline_buf = realloc(dev->scanline_buf, dev->scanline_count * VFS301_FP_OUTPUT_WIDTH);
-	assert(dev->scanline_buf != NULL);
+	/* At most every line of the block is kept */
+	if ((dev->scanline_count + no_lines) * VFS301_FP_OUTPUT_WIDTH > dev->scanline_size) {
+		dev->scanline_size *= 2;
+		if (dev->scanline_size < (dev->scanline_count + no_lines) * VFS301_FP_OUTPUT_WIDTH)
+			dev->scanline_size = (dev->scanline_count + no_lines) * VFS301_FP_OUTPUT_WIDTH;
+		dev->scanline_buf = realloc(dev->scanline_buf, dev->scanline_size);
+		assert(dev->scanline_buf != NULL);
+	}
 
-	for (cur_line = dev->scanline_buf + last_img_height * VFS301_FP_OUTPUT_WIDTH, i = 0;
-		i < no_lines;
-		i++, cur_line += VFS301_FP_OUTPUT_WIDTH
-	) {
+	cur_line = dev->scanline_buf + dev->scanline_count * VFS301_FP_OUTPUT_WIDTH;
+	for (i = 0; i < no_lines; i++) {
 #ifndef OUTPUT_RAW
-		memcpy(cur_line, lines[i].scan, VFS301_FP_OUTPUT_WIDTH);
+		const unsigned char *line = lines[i].scan;
 #else
-		memcpy(cur_line, &lines[i], VFS301_FP_OUTPUT_WIDTH);
+		const unsigned char *line = (const unsigned char *)&lines[i];
 #endif
-	}
 
 #ifdef SCAN_FINISH_DETECTION
-	finished_scan = img_is_finished_scan(lines, no_lines);
+		if (img_is_empty_line(&lines[i]))
+			dev->empty_lines++;
+		else
+			dev->empty_lines = 0;
+#endif
 
-	return !finished_scan;
+		/* The following algorithm is quite trivial - it just picks lines that
+		 * differ more than VFS301_FP_LINE_DIFF_THRESHOLD from the last one
+		 * picked, the very first line is always taken.
+		 * TODO: A nicer approach would be to pick those lines and then do some kind 
+		 * of bi/tri-linear resampling to get the output (so that we don't get so
+		 * many false edges etc.).
+		 */
+		if (dev->scanline_count > 0 &&
+		    !scanline_diff(cur_line - VFS301_FP_OUTPUT_WIDTH, line))
+			continue;
+
+		memcpy(cur_line, line, VFS301_FP_OUTPUT_WIDTH);
+		cur_line += VFS301_FP_OUTPUT_WIDTH;
+		dev->scanline_count++;
+	}
+
+#ifdef SCAN_FINISH_DETECTION
+	return dev->empty_lines < VFS301_FP_SUM_LINES;
 #else /* SCAN_FINISH_DETECTION */
 	return 1; /* Just continue until data is coming */
 #endif
@@ -380,8 +365,6 @@ static unsigned char usb_send_buf[0x2000];
 		usb_send(devh, usb_send_buf, len); \
 	}
 
-#define RAW_DATA(x) x, sizeof(x)
-
 #define IS_VFS301_FP_SEQ_START(b) ((b[0] == 0x01) && (b[1] == 0xfe))
 
 static int vfs301_proto_process_data(int first_block, vfs301_dev_t *dev)
@@ -20,6 +20,8 @@
  */
 #include <libusb-1.0/libusb.h>
 
+struct fpi_poll_backoff;
+
 enum {
 	VFS301_DEFAULT_WAIT_TIMEOUT = 300,
 
@@ -36,9 +38,17 @@ typedef struct {
 	unsigned char recv_buf[0x20000];
 	int recv_len;
 
-	/* buffer to hold raw scanlines */
+	/* buffer to hold the scanlines picked for the image, and its size in
+	 * bytes */
 	unsigned char *scanline_buf;
 	int scanline_count;
+	int scanline_size;
+
+	/* number of empty lines at the end of the scan so far */
+	int empty_lines;
+
+	/* interval between the polls for a finger, kept by vfs301.c */
+	struct fpi_poll_backoff *poll;
 
 	enum {
 		VFS301_ONGOING = 0,
@@ -1112,6 +1112,10 @@ static const unsigned char vfs301_24[] = { /* 119 B */
 	 * 0x00, 0xF4, 0x01, 0xF4, 0x01, 0x00, 0xB4, */
 };
 
+/* The fragments below are hex strings, only read by vfs301_gen_blobs which
+ * turns them into the byte arrays of vfs301_proto_blobs.h at build time */
+#ifdef VFS301_FRAGMENTS_HEX
+
 #define PACKET(cmd, length, payload)\
 	cmd length payload
 
@@ -2629,3 +2633,5 @@ const char *vfs301_02D0_07[] = {
 
 	NULL
 };
+
+#endif /* VFS301_FRAGMENTS_HEX */
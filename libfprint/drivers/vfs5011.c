@@ -207,7 +207,7 @@ static void usbexchange_loop(struct fpi_ssm *ssm)
 					  action->endpoint, action->data,
 					  action->size, async_send_cb, ssm,
 					  data->timeout);
-		ret = libusb_submit_transfer(transfer);
+		ret = fpi_usb_submit_transfer(transfer);
 		break;
 
 	case ACTION_RECEIVE:
@@ -223,7 +223,7 @@ static void usbexchange_loop(struct fpi_ssm *ssm)
 					  action->endpoint, data->receive_buf,
 					  action->size, async_recv_cb, ssm,
 					  data->timeout);
-		ret = libusb_submit_transfer(transfer);
+		ret = fpi_usb_submit_transfer(transfer);
 		break;
 
 	default:
@@ -253,33 +253,29 @@ static void usb_exchange_async(struct fpi_ssm *ssm,
 /* ====================== utils ======================= */
 
 /* Calculade squared standand deviation of sum of two lines */
-static int vfs5011_get_deviation2(struct fpi_line_asmbl_ctx *ctx, GSList *row1, GSList *row2)
+static int vfs5011_get_deviation2(struct fpi_line_asmbl_ctx *ctx,
+				  struct fpi_line_store *lines,
+				  size_t row1, size_t row2)
 {
-	unsigned char *buf1, *buf2;
-	int res = 0, mean = 0, i;
-	const int size = 64;
-
-	buf1 = row1->data + 56;
-	buf2 = row2->data + 168;
-
-	for (i = 0; i < size; i++)
-		mean += (int)buf1[i] + (int)buf2[i];
-
-	mean /= size;
-
-	for (i = 0; i < size; i++) {
-		int dev = (int)buf1[i] + (int)buf2[i] - mean;
-		res += dev*dev;
-	}
+	return fpi_std_sq_dev_sum(fpi_line_store_get(lines, row1) + 56,
+		fpi_line_store_get(lines, row2) + 168, 64, 1);
+}
 
-	return res / size;
+static void vfs5011_get_deviations2(struct fpi_line_asmbl_ctx *ctx,
+				    struct fpi_line_store *lines, size_t row,
+				    size_t first, size_t last, int *devs)
+{
+	fpi_std_sq_dev_sum_batch(fpi_line_store_get(lines, row) + 56,
+		fpi_line_store_get(lines, first) + 168, lines->line_size,
+		last - first + 1, 64, 1, devs);
 }
 
 static unsigned char vfs5011_get_pixel(struct fpi_line_asmbl_ctx *ctx,
-				   GSList *row,
+				   struct fpi_line_store *lines,
+				   size_t row,
 				   unsigned x)
 {
-	unsigned char *data = row->data + 8;
+	unsigned char *data = fpi_line_store_get(lines, row) + 8;
 
 	return data[x];
 }
@@ -290,6 +286,11 @@ enum {
 	CAPTURE_LINES = 256,
 	MAXLINES = 2000,
 	MAX_CAPTURE_LINES = 100000,
+	/* reads of CAPTURE_LINES kept in flight while capturing, more are
+	 * added as long as the device has a full read ready each time one
+	 * completes */
+	MIN_CAPTURE_TRANSFERS = 2,
+	MAX_CAPTURE_TRANSFERS = 8,
 };
 
 static struct fpi_line_asmbl_ctx assembling_ctx = {
@@ -299,22 +300,26 @@ static struct fpi_line_asmbl_ctx assembling_ctx = {
 	.median_filter_size = 25,
 	.max_search_offset = 30,
 	.get_deviation = vfs5011_get_deviation2,
+	.get_deviations = vfs5011_get_deviations2,
 	.get_pixel = vfs5011_get_pixel,
 };
 
 struct vfs5011_data {
 	unsigned char *total_buffer;
-	unsigned char *capture_buffer;
 	unsigned char *row_buffer;
 	unsigned char *lastline;
-	GSList *rows;
+	struct fpi_line_store *rows;
 	int lines_captured, lines_recorded, empty_lines;
 	int max_lines_captured, max_lines_recorded;
 	int lines_total, lines_total_allocated;
 	gboolean loop_running;
 	gboolean deactivating;
 	struct usbexchange_data init_sequence;
-	struct libusb_transfer *flying_transfer;
+	struct libusb_transfer *capture_transfers[MAX_CAPTURE_TRANSFERS];
+	int num_capture_transfers;
+	int capture_flying;
+	gboolean capture_finished;
+	int capture_error;
 };
 
 enum {
@@ -336,6 +341,7 @@ static void capture_init(struct vfs5011_data *data, int max_captured,
 {
 	fp_dbg("capture_init");
 	data->lastline = NULL;
+	fpi_line_store_reset(data->rows);
 	data->lines_captured = 0;
 	data->lines_recorded = 0;
 	data->empty_lines = 0;
@@ -346,7 +352,8 @@ static void capture_init(struct vfs5011_data *data, int max_captured,
 	data->max_lines_recorded = max_recorded;
 }
 
-static int process_chunk(struct vfs5011_data *data, int transferred)
+static int process_chunk(struct vfs5011_data *data,
+			 unsigned char *buffer, int transferred)
 {
 	enum {
 		DEVIATION_THRESHOLD = 15*15,
@@ -359,8 +366,7 @@ static int process_chunk(struct vfs5011_data *data, int transferred)
 	int i;
 
 	for (i = 0; i < lines_captured; i++) {
-		unsigned char *linebuf = data->capture_buffer
-					 + i * VFS5011_LINE_SIZE;
+		unsigned char *linebuf = buffer + i * VFS5011_LINE_SIZE;
 
 		if (fpi_std_sq_dev(linebuf + 8, VFS5011_IMAGE_WIDTH)
 				< DEVIATION_THRESHOLD) {
@@ -388,9 +394,12 @@ static int process_chunk(struct vfs5011_data *data, int transferred)
 				data->lastline + 8,
 				linebuf + 8,
 				VFS5011_IMAGE_WIDTH) >= DIFFERENCE_THRESHOLD)) {
-			data->lastline = g_malloc(VFS5011_LINE_SIZE);
-			data->rows = g_slist_prepend(data->rows, data->lastline);
-			g_memmove(data->lastline, linebuf, VFS5011_LINE_SIZE);
+			if (!fpi_line_store_append(data->rows, linebuf)) {
+				fp_dbg("process_chunk: line store full, finishing");
+				return 1;
+			}
+			data->lastline = fpi_line_store_get(data->rows,
+				data->rows->num_lines - 1);
 			data->lines_recorded++;
 			if (data->lines_recorded >= data->max_lines_recorded) {
 				fp_dbg("process_chunk: recorded %d lines, finishing",
@@ -407,64 +416,141 @@ void submit_image(struct fpi_ssm *ssm, struct vfs5011_data *data)
 	struct fp_img_dev *dev = (struct fp_img_dev *)ssm->priv;
 	struct fp_img *img;
 
-	data->rows = g_slist_reverse(data->rows);
+	img = fpi_assemble_lines(&assembling_ctx, data->rows);
 
-	img = fpi_assemble_lines(&assembling_ctx, data->rows, data->lines_recorded);
-
-	g_slist_free_full(data->rows, g_free);
-	data->rows = NULL;
+	fpi_line_store_reset(data->rows);
 
 	fp_dbg("Image captured, commiting");
 
 	fpi_imgdev_image_captured(dev, img);
 }
 
+static void chunk_capture_callback(struct libusb_transfer *transfer);
+
+static int capture_transfer_add(struct fp_img_dev *dev)
+{
+	struct vfs5011_data *data = (struct vfs5011_data *)dev->priv;
+	struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+
+	if (!transfer)
+		return -ENOMEM;
+
+	libusb_fill_bulk_transfer(transfer, dev->udev, VFS5011_IN_ENDPOINT_DATA,
+				  g_malloc(CAPTURE_LINES * VFS5011_LINE_SIZE),
+				  CAPTURE_LINES * VFS5011_LINE_SIZE,
+				  chunk_capture_callback, NULL, 0);
+	transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+	data->capture_transfers[data->num_capture_transfers++] = transfer;
+	return 0;
+}
+
+static int capture_transfer_submit(struct vfs5011_data *data,
+				   struct libusb_transfer *transfer,
+				   struct fpi_ssm *ssm)
+{
+	int r;
+
+	transfer->user_data = ssm;
+	r = fpi_usb_submit_transfer(transfer);
+	if (r == 0)
+		data->capture_flying++;
+	return r;
+}
+
+/* stop the reads still in flight, the capture ends once they all returned */
+static void capture_finish(struct vfs5011_data *data, int error)
+{
+	int i;
+
+	data->capture_finished = TRUE;
+	data->capture_error = error;
+	for (i = 0; i < data->num_capture_transfers; i++)
+		fpi_usb_cancel_transfer(data->capture_transfers[i]);
+}
+
+/* reads complete in the order they were submitted, so each chunk is
+ * processed as it arrives and its transfer goes back to the end of the
+ * queue */
 static void chunk_capture_callback(struct libusb_transfer *transfer)
 {
 	struct fpi_ssm *ssm = (struct fpi_ssm *)transfer->user_data;
 	struct fp_img_dev *dev = (struct fp_img_dev *)ssm->priv;
 	struct vfs5011_data *data = (struct vfs5011_data *)dev->priv;
+	int r;
+
+	data->capture_flying--;
 
-	if ((transfer->status == LIBUSB_TRANSFER_COMPLETED) ||
-	    (transfer->status == LIBUSB_TRANSFER_TIMED_OUT)) {
+	if (data->capture_finished) {
+		/* cancelled, or raced with the end of the capture */
+	} else if (data->deactivating) {
+		capture_finish(data, 0);
+	} else if ((transfer->status == LIBUSB_TRANSFER_COMPLETED) ||
+		   (transfer->status == LIBUSB_TRANSFER_TIMED_OUT)) {
 
 		if (transfer->actual_length > 0)
 			fpi_imgdev_report_finger_status(dev, TRUE);
 
-		if (process_chunk(data, transfer->actual_length))
-			fpi_ssm_jump_to_state(ssm, DEV_ACTIVATE_DATA_COMPLETE);
-		else
-			fpi_ssm_jump_to_state(ssm, DEV_ACTIVATE_READ_DATA);
-	} else {
-		if (!data->deactivating) {
-			fp_err("Failed to capture data");
-			fpi_ssm_mark_aborted(ssm, -1);
+		if (process_chunk(data, transfer->buffer,
+				  transfer->actual_length)) {
+			capture_finish(data, 0);
 		} else {
-			fpi_ssm_mark_completed(ssm);
+			/* a full read means the lines were waiting for us */
+			if (transfer->actual_length == transfer->length &&
+			    data->num_capture_transfers < MAX_CAPTURE_TRANSFERS &&
+			    capture_transfer_add(dev) == 0) {
+				fp_dbg("keeping %d reads in flight",
+				       data->num_capture_transfers);
+				capture_transfer_submit(data,
+					data->capture_transfers[data->num_capture_transfers - 1],
+					ssm);
+			}
+			r = capture_transfer_submit(data, transfer, ssm);
+			if (r != 0) {
+				fp_err("Failed to capture data");
+				capture_finish(data, r);
+			}
 		}
+	} else {
+		fp_err("Failed to capture data");
+		capture_finish(data, -1);
 	}
-	libusb_free_transfer(transfer);
-	data->flying_transfer = NULL;
+
+	if (!data->capture_finished || data->capture_flying > 0)
+		return;
+
+	if (data->deactivating)
+		fpi_ssm_mark_completed(ssm);
+	else if (data->capture_error)
+		fpi_ssm_mark_aborted(ssm, data->capture_error);
+	else
+		fpi_ssm_jump_to_state(ssm, DEV_ACTIVATE_DATA_COMPLETE);
 }
 
-static int capture_chunk_async(struct vfs5011_data *data,
-			       libusb_device_handle *handle, int nline,
-			       int timeout, struct fpi_ssm *ssm)
+static int capture_start(struct fp_img_dev *dev, struct fpi_ssm *ssm)
 {
-	fp_dbg("capture_chunk_async: capture %d lines, already have %d",
-		nline, data->lines_recorded);
-	enum {
-		DEVIATION_THRESHOLD = 15*15,
-		DIFFERENCE_THRESHOLD = 600,
-		STOP_CHECK_LINES = 50
-	};
+	struct vfs5011_data *data = (struct vfs5011_data *)dev->priv;
+	int i;
+	int r = 0;
+
+	fp_dbg("capture_start: %d reads of %d lines, already have %d",
+		data->num_capture_transfers, CAPTURE_LINES,
+		data->lines_recorded);
+
+	data->capture_finished = FALSE;
+	data->capture_error = 0;
+	for (i = 0; i < data->num_capture_transfers; i++) {
+		r = capture_transfer_submit(data, data->capture_transfers[i],
+					    ssm);
+		if (r != 0)
+			break;
+	}
 
-	data->flying_transfer = libusb_alloc_transfer(0);
-	libusb_fill_bulk_transfer(data->flying_transfer, handle, VFS5011_IN_ENDPOINT_DATA,
-				  data->capture_buffer,
-				  nline * VFS5011_LINE_SIZE,
-				  chunk_capture_callback, ssm, timeout);
-	return libusb_submit_transfer(data->flying_transfer);
+	if (r != 0 && data->capture_flying > 0) {
+		/* the ssm is aborted once the others returned */
+		capture_finish(data, r);
+		return 0;
+	}
+	return r;
 }
 
 static void async_sleep_cb(void *data)
@@ -664,8 +750,6 @@ struct usb_action vfs5011_initiate_capture[] = {
 
 static void activate_loop(struct fpi_ssm *ssm)
 {
-	enum {READ_TIMEOUT = 0};
-
 	struct fp_img_dev *dev = (struct fp_img_dev *)ssm->priv;
 	struct vfs5011_data *data = (struct vfs5011_data *)dev->priv;
 	int r;
@@ -702,8 +786,7 @@ static void activate_loop(struct fpi_ssm *ssm)
 		break;
 
 	case DEV_ACTIVATE_READ_DATA:
-		r = capture_chunk_async(data, dev->udev, CAPTURE_LINES,
-					READ_TIMEOUT, ssm);
+		r = capture_start(dev, ssm);
 		if (r != 0) {
 			fp_err("Failed to capture data");
 			fpi_imgdev_session_error(dev, r);
@@ -803,10 +886,15 @@ static int dev_open(struct fp_img_dev *dev, unsigned long driver_data)
 	int r;
 
 	data = (struct vfs5011_data *)g_malloc0(sizeof(*data));
-	data->capture_buffer =
-		(unsigned char *)g_malloc0(CAPTURE_LINES * VFS5011_LINE_SIZE);
+	data->rows = fpi_line_store_new(VFS5011_LINE_SIZE, MAXLINES);
 	dev->priv = data;
 
+	while (data->num_capture_transfers < MIN_CAPTURE_TRANSFERS) {
+		r = capture_transfer_add(dev);
+		if (r != 0)
+			return r;
+	}
+
 	r = libusb_reset_device(dev->udev);
 	if (r != 0) {
 		fp_err("Failed to reset the device");
@@ -832,8 +920,11 @@ static void dev_close(struct fp_img_dev *dev)
 	libusb_release_interface(dev->udev, 0);
 	struct vfs5011_data *data = (struct vfs5011_data *)dev->priv;
 	if (data != NULL) {
-		g_free(data->capture_buffer);
-		g_slist_free_full(data->rows, g_free);
+		int i;
+
+		for (i = 0; i < data->num_capture_transfers; i++)
+			libusb_free_transfer(data->capture_transfers[i]);
+		fpi_line_store_free(data->rows);
 		g_free(data);
 	}
 	fpi_imgdev_close_complete(dev);
@@ -871,10 +962,14 @@ static void dev_deactivate(struct fp_img_dev *dev)
 	struct vfs5011_data *data = dev->priv;
 	if (data->loop_running) {
 		data->deactivating = TRUE;
-		if (data->flying_transfer) {
-			r = libusb_cancel_transfer(data->flying_transfer);
-			if (r < 0)
-				fp_dbg("cancel failed error %d", r);
+		if (data->capture_flying > 0) {
+			int i;
+
+			for (i = 0; i < data->num_capture_transfers; i++) {
+				r = fpi_usb_cancel_transfer(data->capture_transfers[i]);
+				if (r < 0 && r != LIBUSB_ERROR_NOT_FOUND)
+					fp_dbg("cancel failed error %d", r);
+			}
 		}
 	} else
 		fpi_imgdev_deactivate_complete(dev);
@@ -0,0 +1,410 @@
+/*
+ * Virtual imaging device for libfprint
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define FP_COMPONENT "virtual_image"
+
+/* A device without any hardware behind it, discovered once a source of
+ * images is set with fp_set_virtual_image_source() or the
+ * LIBFPRINT_VIRTUAL_IMAGE environment variable. The source is either a
+ * directory, whose binary PGM files are loaded when the device is opened
+ * and handed out in turn, or "unix:" followed by the path of a stream
+ * socket, from which one binary PGM is read per capture.
+ *
+ * Each capture is a finger placed, an image and the finger lifted, at the
+ * rate given along with the source, or back to back without one. Enrolment,
+ * verification and identification go through imgdev.c as they would with a
+ * real sensor, which makes it a load generator for the imaging code.
+ *
+ * Reading from a socket blocks the event loop until the whole image came
+ * in, the peer is expected to keep up. */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <glib.h>
+
+#include <fp_internal.h>
+
+#include "driver_ids.h"
+
+#define SOCKET_PREFIX "unix:"
+
+struct virtual_dev {
+	/* images loaded from a directory */
+	GPtrArray *images;
+	guint next_image;
+	/* or the socket they are read from */
+	int fd;
+
+	/* microseconds between captures, and when the next one is due */
+	guint64 interval;
+	guint64 next_due;
+	struct fpi_timeout timeout;
+	gboolean active;
+};
+
+static int pgm_header_value(const char **p, const char *end)
+{
+	int value = 0;
+
+	while (*p < end && g_ascii_isspace(**p))
+		(*p)++;
+	if (*p == end || !g_ascii_isdigit(**p))
+		return -1;
+	while (*p < end && g_ascii_isdigit(**p)) {
+		value = value * 10 + (**p - '0');
+		if (value > 1 << 16)
+			return -1;
+		(*p)++;
+	}
+	return value;
+}
+
+static struct fp_img *load_pgm(const char *path)
+{
+	struct fp_img *img = NULL;
+	const char *p, *end;
+	gchar *contents;
+	gsize length;
+	int width, height, maxval;
+
+	if (!g_file_get_contents(path, &contents, &length, NULL))
+		return NULL;
+
+	p = contents;
+	end = contents + length;
+	if (length < 2 || strncmp(p, "P5", 2) != 0)
+		goto out;
+	p += 2;
+	width = pgm_header_value(&p, end);
+	height = pgm_header_value(&p, end);
+	maxval = pgm_header_value(&p, end);
+	if (width <= 0 || height <= 0 || maxval != 255 || p == end
+			|| !g_ascii_isspace(*p))
+		goto out;
+	p++;
+	if ((gsize) (end - p) < (gsize) width * height)
+		goto out;
+
+	img = fpi_img_new(width * height);
+	img->width = width;
+	img->height = height;
+	memcpy(img->data, p, width * height);
+
+out:
+	g_free(contents);
+	return img;
+}
+
+static int cmp_name(gconstpointer a, gconstpointer b)
+{
+	return strcmp(*(const char * const *) a, *(const char * const *) b);
+}
+
+static int load_directory(struct virtual_dev *vdev, const char *path)
+{
+	GPtrArray *names = g_ptr_array_new_with_free_func(g_free);
+	const gchar *name;
+	GError *error = NULL;
+	GDir *dir;
+	guint i;
+
+	dir = g_dir_open(path, 0, &error);
+	if (!dir) {
+		fp_err("could not open %s: %s", path, error->message);
+		g_error_free(error);
+		g_ptr_array_free(names, TRUE);
+		return -ENOENT;
+	}
+	while ((name = g_dir_read_name(dir)) != NULL)
+		if (g_str_has_suffix(name, ".pgm"))
+			g_ptr_array_add(names, g_build_filename(path, name, NULL));
+	g_dir_close(dir);
+
+	/* handed out in name order, so that runs can be repeated */
+	g_ptr_array_sort(names, cmp_name);
+	vdev->images = g_ptr_array_new_with_free_func(
+		(GDestroyNotify) fp_img_free);
+	for (i = 0; i < names->len; i++) {
+		const char *file = g_ptr_array_index(names, i);
+		struct fp_img *img = load_pgm(file);
+
+		if (img)
+			g_ptr_array_add(vdev->images, img);
+		else
+			fp_warn("skipping %s, not a binary PGM image", file);
+	}
+	g_ptr_array_free(names, TRUE);
+
+	if (vdev->images->len == 0) {
+		fp_err("no images found in %s", path);
+		return -ENOENT;
+	}
+	fp_dbg("loaded %u images from %s", vdev->images->len, path);
+	return 0;
+}
+
+static int connect_socket(struct virtual_dev *vdev, const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int r;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+	strcpy(addr.sun_path, path);
+
+	vdev->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (vdev->fd < 0)
+		return -errno;
+	if (connect(vdev->fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		r = -errno;
+		fp_err("could not connect to %s: %d", path, r);
+		close(vdev->fd);
+		vdev->fd = -1;
+		return r;
+	}
+	return 0;
+}
+
+static int read_full(int fd, void *buf, size_t len)
+{
+	unsigned char *p = buf;
+
+	while (len > 0) {
+		ssize_t r = read(fd, p, len);
+
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			return -errno;
+		if (r == 0)
+			return -EPIPE;
+		p += r;
+		len -= r;
+	}
+	return 0;
+}
+
+/* Reads the "P5 <width> <height> 255" header and the single whitespace
+ * ending it one byte at a time, the pixels then come in one read. */
+static struct fp_img *read_pgm(int fd)
+{
+	struct fp_img *img;
+	char header[64];
+	const char *p;
+	int fields = 0, width, height, maxval;
+	size_t len = 0;
+	gboolean in_field = FALSE;
+
+	while (fields < 4) {
+		char c;
+
+		if (len == sizeof(header) - 1 || read_full(fd, &c, 1) < 0)
+			return NULL;
+		header[len++] = c;
+		if (g_ascii_isspace(c)) {
+			if (in_field)
+				fields++;
+			in_field = FALSE;
+		} else {
+			in_field = TRUE;
+		}
+	}
+	header[len] = '\0';
+
+	if (strncmp(header, "P5", 2) != 0)
+		return NULL;
+	p = header + 2;
+	width = pgm_header_value(&p, header + len);
+	height = pgm_header_value(&p, header + len);
+	maxval = pgm_header_value(&p, header + len);
+	if (width <= 0 || height <= 0 || maxval != 255)
+		return NULL;
+
+	img = fpi_img_new(width * height);
+	img->width = width;
+	img->height = height;
+	if (read_full(fd, img->data, width * height) < 0) {
+		fp_img_free(img);
+		return NULL;
+	}
+	return img;
+}
+
+static struct fp_img *next_image(struct virtual_dev *vdev)
+{
+	struct fp_img *src, *img;
+
+	if (vdev->fd >= 0)
+		return read_pgm(vdev->fd);
+
+	/* the image is freed by the processing, so each capture gets a copy */
+	src = g_ptr_array_index(vdev->images, vdev->next_image);
+	vdev->next_image = (vdev->next_image + 1) % vdev->images->len;
+	img = fpi_img_new(src->length);
+	img->width = src->width;
+	img->height = src->height;
+	memcpy(img->data, src->data, src->length);
+	return img;
+}
+
+static void finger_off(void *data)
+{
+	fpi_imgdev_report_finger_status(data, FALSE);
+}
+
+static void capture(void *data)
+{
+	struct fp_img_dev *dev = data;
+	struct virtual_dev *vdev = dev->priv;
+	struct fp_img *img = next_image(vdev);
+
+	if (!img) {
+		fp_err("could not read the next image");
+		fpi_imgdev_session_error(dev, -EIO);
+		return;
+	}
+	fpi_imgdev_image_captured(dev, img);
+}
+
+static void finger_on(void *data)
+{
+	fpi_imgdev_report_finger_status(data, TRUE);
+}
+
+/* Timers only count milliseconds, so the captures are paced against a
+ * schedule instead: one that is late is started right away, and the rate
+ * holds on average even when it is above a capture per millisecond. */
+static unsigned int until_next_capture(struct virtual_dev *vdev)
+{
+	guint64 now = g_get_monotonic_time();
+
+	if (vdev->next_due < now)
+		vdev->next_due = now;
+	vdev->next_due += vdev->interval;
+	return (vdev->next_due - vdev->interval - now) / 1000;
+}
+
+static int dev_change_state(struct fp_img_dev *dev,
+	enum fp_imgdev_state state)
+{
+	struct virtual_dev *vdev = dev->priv;
+
+	if (!vdev->active)
+		return 0;
+
+	switch (state) {
+	case IMGDEV_STATE_AWAIT_FINGER_ON:
+		return fpi_timeout_start(&vdev->timeout,
+			until_next_capture(vdev), finger_on, dev);
+	case IMGDEV_STATE_CAPTURE:
+		return fpi_timeout_start(&vdev->timeout, 0, capture, dev);
+	case IMGDEV_STATE_AWAIT_FINGER_OFF:
+		return fpi_timeout_start(&vdev->timeout, 0, finger_off, dev);
+	default:
+		return 0;
+	}
+}
+
+static int dev_activate(struct fp_img_dev *dev, enum fp_imgdev_state state)
+{
+	struct virtual_dev *vdev = dev->priv;
+
+	vdev->active = TRUE;
+	vdev->next_due = 0;
+	fpi_imgdev_activate_complete(dev, 0);
+	return 0;
+}
+
+static void dev_deactivate(struct fp_img_dev *dev)
+{
+	struct virtual_dev *vdev = dev->priv;
+
+	vdev->active = FALSE;
+	fpi_timeout_cancel(&vdev->timeout);
+	fpi_imgdev_deactivate_complete(dev);
+}
+
+static int dev_init(struct fp_img_dev *dev, unsigned long driver_data)
+{
+	struct virtual_dev *vdev;
+	const char *source;
+	unsigned int rate;
+	int r;
+
+	source = fpi_get_virtual_image_source(&rate);
+	if (!source)
+		return -ENODEV;
+
+	vdev = dev->priv = g_malloc0(sizeof(struct virtual_dev));
+	vdev->fd = -1;
+	vdev->interval = rate ? G_USEC_PER_SEC / rate : 0;
+
+	if (g_str_has_prefix(source, SOCKET_PREFIX))
+		r = connect_socket(vdev, source + strlen(SOCKET_PREFIX));
+	else
+		r = load_directory(vdev, source);
+	if (r < 0) {
+		if (vdev->images)
+			g_ptr_array_free(vdev->images, TRUE);
+		g_free(vdev);
+		dev->priv = NULL;
+		return r;
+	}
+
+	fpi_imgdev_open_complete(dev, 0);
+	return 0;
+}
+
+static void dev_deinit(struct fp_img_dev *dev)
+{
+	struct virtual_dev *vdev = dev->priv;
+
+	if (vdev->images)
+		g_ptr_array_free(vdev->images, TRUE);
+	if (vdev->fd >= 0)
+		close(vdev->fd);
+	g_free(vdev);
+	fpi_imgdev_close_complete(dev);
+}
+
+static const struct usb_id id_table[] = {
+	{ 0, 0, 0, },
+};
+
+struct fp_img_driver virtual_image_driver = {
+	.driver = {
+		.id = VIRTUAL_IMAGE_ID,
+		.name = FP_COMPONENT,
+		.full_name = "Virtual image device",
+		.id_table = id_table,
+		.scan_type = FP_SCAN_TYPE_PRESS,
+	},
+	.flags = 0,
+	.img_height = -1,
+	.img_width = -1,
+
+	.open = dev_init,
+	.close = dev_deinit,
+	.activate = dev_activate,
+	.deactivate = dev_deactivate,
+	.change_state = dev_change_state,
+};
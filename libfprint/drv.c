@@ -21,6 +21,7 @@
 
 #include <config.h>
 #include <errno.h>
+#include <string.h>
 
 #include "fp_internal.h"
 
@@ -66,27 +67,43 @@
  * Your completion callback should examine ssm->error in order to determine
  * whether the ssm completed or failed. An error code of zero indicates
  * successful completion.
+ *
+ * A completed ssm can be started again, from its first state. Machines which
+ * run over and over, such as capture loops or the sub-machine of a register
+ * access, can be embedded in the driver's private structure and set up once
+ * with fpi_ssm_init() rather than allocated with fpi_ssm_new() every time.
+ * fpi_ssm_free() leaves such machines alone, so completion callbacks do not
+ * need to know which kind they were given.
  */
 
-/* Allocate a new ssm */
-struct fpi_ssm *fpi_ssm_new(struct fp_dev *dev, ssm_handler_fn handler,
-	int nr_states)
+/* Set up a ssm living in memory owned by the caller */
+void fpi_ssm_init(struct fpi_ssm *machine, struct fp_dev *dev,
+	ssm_handler_fn handler, int nr_states)
 {
-	struct fpi_ssm *machine;
 	BUG_ON(nr_states < 1);
 
-	machine = g_malloc0(sizeof(*machine));
+	memset(machine, 0, sizeof(*machine));
 	machine->handler = handler;
 	machine->nr_states = nr_states;
 	machine->dev = dev;
 	machine->completed = TRUE;
+}
+
+/* Allocate a new ssm */
+struct fpi_ssm *fpi_ssm_new(struct fp_dev *dev, ssm_handler_fn handler,
+	int nr_states)
+{
+	struct fpi_ssm *machine = g_malloc(sizeof(*machine));
+
+	fpi_ssm_init(machine, dev, handler, nr_states);
+	machine->allocated = TRUE;
 	return machine;
 }
 
-/* Free a ssm */
+/* Free a ssm allocated by fpi_ssm_new(), embedded ones are left alone */
 void fpi_ssm_free(struct fpi_ssm *machine)
 {
-	if (!machine)
+	if (!machine || !machine->allocated)
 		return;
 	g_free(machine);
 }
@@ -95,6 +112,8 @@ void fpi_ssm_free(struct fpi_ssm *machine)
 static void __ssm_call_handler(struct fpi_ssm *machine)
 {
 	fp_dbg("%p entering state %d", machine, machine->cur_state);
+	fpi_trace(ssm_state, machine, machine->dev, machine->cur_state,
+		machine->nr_states);
 	machine->handler(machine);
 }
 
@@ -123,7 +142,8 @@ static void __subsm_complete(struct fpi_ssm *ssm)
 /* start a SSM as a child of another. if the child completes successfully, the
  * parent will be advanced to the next state. if the child aborts, the parent
  * will be aborted with the same error code. the child will be automatically
- * freed upon completion/abortion. */
+ * freed upon completion/abortion, unless it was set up with fpi_ssm_init(), in
+ * which case it can be started again by the parent's next state. */
 void fpi_ssm_start_subsm(struct fpi_ssm *parent, struct fpi_ssm *child)
 {
 	child->parentsm = parent;
@@ -169,3 +189,76 @@ void fpi_ssm_jump_to_state(struct fpi_ssm *machine, int state)
 	__ssm_call_handler(machine);
 }
 
+#ifdef ENABLE_TRACING
+#define FPI_TRACE_DEFINE(name) \
+	unsigned short FPI_TRACE_SEMAPHORE(name) \
+		__attribute__((section(".probes")))
+
+FPI_TRACE_DEFINE(usb_submit);
+FPI_TRACE_DEFINE(usb_complete);
+FPI_TRACE_DEFINE(ssm_state);
+FPI_TRACE_DEFINE(timeout_fire);
+FPI_TRACE_DEFINE(img_captured);
+FPI_TRACE_DEFINE(extract_start);
+FPI_TRACE_DEFINE(extract_end);
+FPI_TRACE_DEFINE(compare);
+
+/* The callback and user data of a transfer traced to its completion */
+struct usb_trace {
+	libusb_transfer_cb_fn callback;
+	void *user_data;
+};
+
+static void usb_trace_complete(struct libusb_transfer *transfer)
+{
+	struct usb_trace *trace = transfer->user_data;
+
+	transfer->callback = trace->callback;
+	transfer->user_data = trace->user_data;
+	g_slice_free(struct usb_trace, trace);
+
+	fpi_trace(usb_complete, transfer, transfer->dev_handle,
+		transfer->status, transfer->actual_length);
+	transfer->callback(transfer);
+}
+#endif
+
+#if defined(ENABLE_TRACING) || defined(ENABLE_USB_REPLAY)
+/* Drivers submit their transfers through this, which libusb_submit_transfer()
+ * stands for without tracing or replay. Completions are only hooked while a
+ * tool is attached to the usb_complete probe, as it takes an allocation. */
+int fpi_usb_submit_transfer(struct libusb_transfer *transfer)
+{
+#ifdef ENABLE_TRACING
+	struct usb_trace *trace = NULL;
+#endif
+	int r;
+
+	fpi_trace(usb_submit, transfer, transfer->dev_handle,
+		transfer->endpoint, transfer->length);
+
+#ifdef ENABLE_TRACING
+	if (fpi_trace_enabled(usb_complete)) {
+		trace = g_slice_new(struct usb_trace);
+		trace->callback = transfer->callback;
+		trace->user_data = transfer->user_data;
+		transfer->callback = usb_trace_complete;
+		transfer->user_data = trace;
+	}
+#endif
+
+#ifdef ENABLE_USB_REPLAY
+	r = fpi_usb_replay_submit(transfer);
+#else
+	r = libusb_submit_transfer(transfer);
+#endif
+#ifdef ENABLE_TRACING
+	if (r < 0 && trace) {
+		transfer->callback = trace->callback;
+		transfer->user_data = trace->user_data;
+		g_slice_free(struct usb_trace, trace);
+	}
+#endif
+	return r;
+}
+#endif
@@ -21,6 +21,7 @@
 #define __FPRINT_INTERNAL_H__
 
 #include <config.h>
+#include <stdarg.h>
 #include <stdint.h>
 
 #include <glib.h>
@@ -43,6 +44,11 @@ enum fpi_log_level {
 
 void fpi_log(enum fpi_log_level, const char *component, const char *function,
 	const char *format, ...);
+void fpi_log_write(enum fpi_log_level level, const char *component,
+	const char *function, const char *format, ...);
+gboolean fpi_log_record(enum fpi_log_level level, const char *component,
+	const char *function, const char *format, va_list args);
+void fpi_log_exit(void);
 
 #ifndef FP_COMPONENT
 #define FP_COMPONENT NULL
@@ -73,6 +79,71 @@ void fpi_log(enum fpi_log_level, const char *component, const char *function,
 
 #define BUG() BUG_ON(1)
 
+/* Static probes of the "libfprint" provider, for perf and bpftrace. Probes
+ * are a single nop, and each has a semaphore which tools raise while they
+ * are attached, so that work done only for a probe can be skipped
+ * otherwise. Without ENABLE_TRACING they compile to nothing. */
+#ifdef ENABLE_TRACING
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define FPI_TRACE_SEMAPHORE(name) libfprint_##name##_semaphore
+#define fpi_trace(name, args...) STAP_PROBEV(libfprint, name, ##args)
+#define fpi_trace_enabled(name) \
+	G_UNLIKELY(FPI_TRACE_SEMAPHORE(name) != 0)
+
+/* usb_submit(transfer, dev_handle, endpoint, length) */
+extern unsigned short FPI_TRACE_SEMAPHORE(usb_submit);
+/* usb_complete(transfer, dev_handle, status, actual_length) */
+extern unsigned short FPI_TRACE_SEMAPHORE(usb_complete);
+/* ssm_state(ssm, dev, state, nr_states) */
+extern unsigned short FPI_TRACE_SEMAPHORE(ssm_state);
+/* timeout_fire(timeout, callback) */
+extern unsigned short FPI_TRACE_SEMAPHORE(timeout_fire);
+/* img_captured(dev, width, height, length) */
+extern unsigned short FPI_TRACE_SEMAPHORE(img_captured);
+/* extract_start(img, width, height) */
+extern unsigned short FPI_TRACE_SEMAPHORE(extract_start);
+/* extract_end(img, result, usecs) */
+extern unsigned short FPI_TRACE_SEMAPHORE(extract_end);
+/* compare(gallery_item, probe_minutiae, gallery_minutiae, score) */
+extern unsigned short FPI_TRACE_SEMAPHORE(compare);
+
+#else
+#define fpi_trace(name, args...) do { } while (0)
+#define fpi_trace_enabled(name) 0
+#endif
+
+/* Drivers submit and cancel their transfers through these, which stand for
+ * the libusb calls unless transfers are traced or can be recorded and
+ * replayed (see usbreplay.c) */
+#if defined(ENABLE_TRACING) || defined(ENABLE_USB_REPLAY)
+int fpi_usb_submit_transfer(struct libusb_transfer *transfer);
+#else
+#define fpi_usb_submit_transfer(transfer) libusb_submit_transfer(transfer)
+#endif
+
+#ifdef ENABLE_CAPTURE_DUMP
+struct fpi_capture_dump;
+int fpi_capture_dump_new(const char *dir, const char *prefix,
+	guint64 quota, struct fpi_capture_dump **ret);
+void fpi_capture_dump_unref(struct fpi_capture_dump *dump);
+void fpi_capture_dump_add(struct fpi_capture_dump *dump,
+	const struct fp_img *img, const char *tag);
+void fpi_capture_dump_exit(void);
+#endif
+
+#ifdef ENABLE_USB_REPLAY
+int fpi_usb_replay_init(void);
+void fpi_usb_replay_exit(void);
+int fpi_usb_replay_submit(struct libusb_transfer *transfer);
+int fpi_usb_replay_cancel(struct libusb_transfer *transfer);
+
+#define fpi_usb_cancel_transfer(transfer) fpi_usb_replay_cancel(transfer)
+#else
+#define fpi_usb_cancel_transfer(transfer) libusb_cancel_transfer(transfer)
+#endif
+
 enum fp_dev_state {
 	DEV_STATE_INITIAL = 0,
 	DEV_STATE_ERROR,
@@ -133,6 +204,8 @@ struct fp_dev {
 	void *identify_cb_data;
 	fp_identify_stop_cb identify_stop_cb;
 	void *identify_stop_cb_data;
+	fp_identify_topk_cb identify_topk_cb;
+	fp_identify_score_cb identify_score_cb;
 	fp_capture_cb capture_cb;
 	void *capture_cb_data;
 	fp_capture_stop_cb capture_stop_cb;
@@ -140,6 +213,15 @@ struct fp_dev {
 
 	/* FIXME: better place to put this? */
 	struct fp_print_data **identify_gallery;
+
+	/* top-K identification: number of candidates requested (0 for plain
+	 * identification), and the candidates of the pending result */
+	size_t identify_topk;
+	struct fp_identify_match *identify_matches;
+	size_t identify_nr_matches;
+	/* limits of the identification, all 0 but for
+	 * fp_async_identify_budget_start() */
+	struct fp_identify_budget identify_budget;
 };
 
 enum fp_imgdev_state {
@@ -162,11 +244,25 @@ enum fp_imgdev_enroll_state {
 	IMG_ACQUIRE_STATE_ACTIVATING,
 	IMG_ACQUIRE_STATE_AWAIT_FINGER_ON,
 	IMG_ACQUIRE_STATE_AWAIT_IMAGE,
+	/* a capture stream is full, images are ignored until it has room */
+	IMG_ACQUIRE_STATE_STREAM_PAUSED,
+	/* the image is being processed off the event loop */
+	IMG_ACQUIRE_STATE_PROCESSING,
 	IMG_ACQUIRE_STATE_AWAIT_FINGER_OFF,
 	IMG_ACQUIRE_STATE_DONE,
 	IMG_ACQUIRE_STATE_DEACTIVATING,
 };
 
+/* what the sensor does between the operations of a warm session */
+enum fp_imgdev_warm_state {
+	/* deactivated as usual */
+	IMG_WARM_NONE = 0,
+	/* left active, waiting for the next operation */
+	IMG_WARM_IDLE,
+	/* deactivating after being idle for too long */
+	IMG_WARM_COOLING,
+};
+
 enum fp_imgdev_verify_state {
 	IMG_VERIFY_STATE_NONE = 0,
 	IMG_VERIFY_STATE_ACTIVATING
@@ -187,6 +283,50 @@ struct fp_img_dev {
 	/* FIXME: better place to put this? */
 	size_t identify_match_offset;
 
+	/* frames of fp_async_capture_stream_start(), NULL for other captures */
+	struct imgdev_stream *stream;
+
+	/* image being processed by a worker, see fpi_imgdev_image_captured() */
+	struct imgdev_job *processing_job;
+	/* the finger was removed while the image was processed */
+	gboolean finger_off_pending;
+	/* worker thread of the device, created for its first image */
+	GThreadPool *process_pool;
+	GMutex job_lock;
+	GCond job_cond;
+	/* CPU the worker should run on, -1 for any, and the one it was last
+	 * pinned to, only used by the worker */
+	gint processing_cpu;
+	int worker_cpu;
+
+	/* recycles image buffers for fixed size drivers, NULL otherwise */
+	struct fpi_img_pool *img_pool;
+
+	/* latencies for fp_dev_get_stats(), recorded by the event loop and
+	 * the worker, and when the finger was last put on the sensor */
+	GMutex stats_lock;
+	struct fp_dev_stats stats;
+	gint64 finger_on_time;
+
+	/* warm session, see fp_dev_set_warm_session(): how long the sensor
+	 * stays active after an operation, 0 if it does not */
+	unsigned int warm_timeout;
+	enum fp_imgdev_warm_state warm_state;
+	struct fpi_timeout *warm_timer;
+	/* the operation failed, deactivate the sensor when it stops */
+	gboolean warm_failed;
+	/* close was requested while the sensor was still active */
+	gboolean close_pending;
+
+	/* merge the enroll stages, see fp_dev_set_enroll_consolidation() */
+	gboolean consolidate_enroll;
+
+	/* transfers kept by aes_write_regv() for AuthenTec drivers */
+	struct aes_regv_pool *aes_regv_pool;
+
+	/* records the scanned images, see fp_dev_set_capture_dump() */
+	struct fpi_capture_dump *capture_dump;
+
 	void *priv;
 };
 
@@ -239,6 +379,14 @@ struct fp_img_driver {
 	int img_width;
 	int img_height;
 	int bz3_threshold;
+	/* Percentage of image blocks that must show ridge contrast for a
+	 * capture to be worth extracting; 0 picks the default, negative
+	 * disables the check. */
+	int quality_threshold;
+	/* Minutiae kept per print, the most reliable ones; 0 picks the
+	 * Bozorth3 default of 150. Matching time grows with the square of
+	 * the number of minutiae, at some cost in accuracy. */
+	int max_minutiae;
 
 	/* Device operations */
 	int (*open)(struct fp_img_dev *dev, unsigned long driver_data);
@@ -308,16 +456,37 @@ extern struct fp_img_driver vfs0050_driver;
 #ifdef ENABLE_ELAN
 extern struct fp_img_driver elan_driver;
 #endif
+#ifdef ENABLE_VIRTUAL_IMAGE
+extern struct fp_img_driver virtual_image_driver;
+#endif
 
 extern libusb_context *fpi_usb_ctx;
+/* the devices opened, protected by opened_devices_lock */
+extern GMutex opened_devices_lock;
 extern GSList *opened_devices;
 
+unsigned int fpi_get_match_threads(void);
+unsigned int fpi_get_identify_candidates(void);
+enum fp_identify_order fpi_get_identify_order(void);
+enum fp_identify_backend fpi_get_identify_backend(void);
+enum fp_prematch fpi_get_prematch(int *cutoff, unsigned int *audit_interval);
+unsigned int fpi_get_extract_threads(void);
+gboolean fpi_thread_cpu_supported(void);
+int fpi_set_thread_cpu(int cpu);
+int fpi_set_thread_realtime(int priority);
+void fpi_thread_drop_realtime(void);
+GThread *fpi_thread_try_new(const char *name, GThreadFunc func,
+	gpointer data);
+unsigned int fpi_get_assemble_threads(void);
+const char *fpi_get_virtual_image_source(unsigned int *rate);
+
 void fpi_img_driver_setup(struct fp_img_driver *idriver);
 
 #define fpi_driver_to_img_driver(drv) \
 	container_of((drv), struct fp_img_driver, driver)
 
 struct fp_dscv_dev {
+	/* NULL for the virtual image device */
 	struct libusb_device *udev;
 	struct fp_driver *drv;
 	unsigned long driver_data;
@@ -329,6 +498,7 @@ struct fp_dscv_print {
 	uint32_t devtype;
 	enum fp_finger finger;
 	char *path;
+	char *user; /* set instead of path for prints in the packed store */
 };
 
 enum fp_print_data_type {
@@ -336,18 +506,52 @@ enum fp_print_data_type {
 	PRINT_DATA_NBIS_MINUTIAE,
 };
 
+struct bz_gallery;
+struct bz_ctx;
+struct xyt_struct;
+struct fpi_geohash;
+struct fpi_geohash_probe;
+struct fpi_prematch_desc;
+
 struct fp_print_data_item {
 	size_t length;
-	unsigned char data[0];
+	/* Bozorth3 gallery tables for NBIS minutiae, built on first match */
+	struct bz_gallery *bz_gallery;
+	/* candidate index signature for NBIS minutiae, see geohash.c */
+	struct fpi_geohash *geohash;
+	/* pre-match descriptor for NBIS minutiae, see prematch.c */
+	struct fpi_prematch_desc *prematch;
+	/* number of verifications this sample matched since it was loaded */
+	gint hits;
+	/* the store file data points into, or NULL if data is kept with the
+	 * print. Mapped data is read-only. */
+	GMappedFile *map;
+	unsigned char *data;
 };
 
+/* The samples live in a single allocation: an array of items_alloc items,
+ * followed by the data of the samples that aren't mapped, back to back.
+ * Adding a sample may move both, see fpi_print_data_add_item(). */
 struct fp_print_data {
 	uint16_t driver_id;
 	uint32_t devtype;
 	enum fp_print_data_type type;
-	GSList *prints;
+	struct fp_print_data_item *items;
+	unsigned int nr_items;
+	unsigned int items_alloc;
+	size_t samples_len;
+	size_t samples_alloc;
+	/* identifications this print matched since it was loaded, the last
+	 * one in sequence of all matches, and the local hours they were at;
+	 * see fp_set_identify_order() */
+	gint identify_hits;
+	gint identify_seq;
+	gint identify_hours[24];
 };
 
+#define fpi_print_data_get_nr_items(data) ((data)->nr_items)
+#define fpi_print_data_get_item(data, i) (&(data)->items[i])
+
 struct fpi_print_data_fp2 {
 	char prefix[3];
 	uint16_t driver_id;
@@ -361,9 +565,35 @@ struct fpi_print_data_item_fp2 {
 	unsigned char data[0];
 } __attribute__((__packed__));
 
+/* FP3 keeps the FP2 header and follows it with a sequence of sections, all
+ * little endian. Loaders skip the sections they don't know. */
+enum fpi_print_data_fp3_section {
+	/* a new sample, stored as is */
+	FP3_SECTION_RAW = 1,
+	/* a new NBIS sample: u16 nrows, then nrows (x, y, theta) s16 triples */
+	FP3_SECTION_MINUTIAE,
+	/* the Bozorth3 edge table of the preceding minutiae sample: u32 rows,
+	 * then rows of COLS_SIZE_2 s32 columns */
+	FP3_SECTION_EDGES,
+};
+
+struct fpi_print_data_section_fp3 {
+	uint8_t type;
+	uint32_t length;
+	unsigned char data[0];
+} __attribute__((__packed__));
+
 void fpi_data_exit(void);
+int fpi_calibration_load(struct fp_dev *dev, void *data, size_t len);
+int fpi_calibration_save(struct fp_dev *dev, const void *data, size_t len);
+void fpi_calibration_forget(struct fp_dev *dev);
 struct fp_print_data *fpi_print_data_new(struct fp_dev *dev);
-struct fp_print_data_item *fpi_print_data_item_new(size_t length);
+struct fp_print_data_item *fpi_print_data_add_item(struct fp_print_data *data,
+	size_t length);
+struct fp_print_data *fpi_print_data_from_mapped(GMappedFile *map,
+	const unsigned char *buf, size_t buflen);
+size_t fpi_print_data_get_fp2_data(struct fp_print_data *data,
+	unsigned char **ret);
 gboolean fpi_print_data_compatible(uint16_t driver_id1, uint32_t devtype1,
 	enum fp_print_data_type type1, uint16_t driver_id2, uint32_t devtype2,
 	enum fp_print_data_type type2);
@@ -389,36 +619,205 @@ struct fp_img {
 	int height;
 	size_t length;
 	uint16_t flags;
+	/* everything derived from the image is computed once and kept: the
+	 * results of minutiae detection, see fpi_img_detect_minutiae(), and
+	 * the sample made from them for max_minutiae, see
+	 * fpi_img_to_print_data() */
 	struct fp_minutiae *minutiae;
 	unsigned char *binarized;
+	int *direction_map;
+	int *quality_map;
+	int map_width;
+	int map_height;
+	unsigned char *xyt;
+	int xyt_max_minutiae;
+	struct fp_extract_stats stats;
+	/* pool the image goes back to when freed, if any */
+	struct fpi_img_pool *pool;
 	unsigned char data[0];
 };
 
+void fpi_img_exit(void);
+void fpi_img_print_data_item_release(struct fp_print_data_item *item);
+int fpi_img_index_print_data(struct fp_print_data *data);
+int fpi_img_prepare_print_data(struct fp_print_data *data);
 struct fp_img *fpi_img_new(size_t length);
 struct fp_img *fpi_img_new_for_imgdev(struct fp_img_dev *dev);
+struct fpi_img_pool *fpi_img_pool_new(size_t length);
+void fpi_img_pool_unref(struct fpi_img_pool *pool);
 struct fp_img *fpi_img_resize(struct fp_img *img, size_t newsize);
 gboolean fpi_img_is_sane(struct fp_img *img);
 int fpi_img_detect_minutiae(struct fp_img *img);
+void fpi_img_minutiae_to_xyt(struct fp_minutiae *minutiae, int bwidth,
+	int bheight, int max_minutiae, unsigned char *buf);
+int fpi_img_quality(struct fp_img *img);
 int fpi_img_to_print_data(struct fp_img_dev *imgdev, struct fp_img *img,
 	struct fp_print_data **ret);
 int fpi_img_compare_print_data(struct fp_print_data *enrolled_print,
-	struct fp_print_data *new_print);
+	struct fp_print_data *new_print, int match_threshold);
+struct fp_probe *fpi_probe_new(struct fp_print_data *print);
+void fpi_probe_free(struct fp_probe *probe);
+int fpi_img_compare_probe(struct fp_print_data *enrolled_print,
+	struct fp_probe *probe, int match_threshold);
+
+/* Limits of a gallery identification, and a way to follow and cancel it
+ * from another thread. Zeroed fields are not used. */
+struct fpi_identify_ctl {
+	/* set to abandon the identification */
+	gint cancelled;
+	/* monotonic time from which no further print is compared */
+	gint64 deadline;
+	unsigned int max_comparisons;
+	/* for top-K identification, stop like plain identification does */
+	gboolean stop_on_match;
+	/* for top-K identification, called from the matching threads with
+	 * the score of each print compared */
+	void (*score_cb)(const struct fp_identify_match *match, void *data);
+	void *score_cb_data;
+};
+
+int fpi_img_compare_probe_to_gallery(struct fp_probe *probe,
+	struct fp_print_data **gallery, int match_threshold, size_t *match_offset,
+	struct fpi_identify_ctl *ctl);
+int fpi_img_compare_probe_to_gallery_topk(struct fp_probe *probe,
+	struct fp_print_data **gallery, int match_threshold, size_t k,
+	struct fp_identify_match *matches, size_t *nr_matches,
+	struct fpi_identify_ctl *ctl);
+struct fp_print_data *fpi_img_consolidate_print_data(struct fp_dev *dev,
+	struct fp_print_data *enrolled, struct fp_print_data *last,
+	int match_threshold);
 int fpi_img_compare_print_data_to_gallery(struct fp_print_data *print,
-	struct fp_print_data **gallery, int match_threshold, size_t *match_offset);
+	struct fp_print_data **gallery, int match_threshold, size_t *match_offset,
+	struct fpi_identify_ctl *ctl);
+int fpi_img_compare_print_data_to_gallery_topk(struct fp_print_data *print,
+	struct fp_print_data **gallery, int match_threshold, size_t k,
+	struct fp_identify_match *matches, size_t *nr_matches,
+	struct fpi_identify_ctl *ctl);
 struct fp_img *fpi_im_resize(struct fp_img *img, unsigned int w_factor, unsigned int h_factor);
 
+/* geohash.c */
+struct fpi_geohash *fpi_geohash_new(const struct bz_gallery *gallery);
+void fpi_geohash_free(struct fpi_geohash *hash);
+struct fpi_geohash_probe *fpi_geohash_probe_new(
+	const struct bz_gallery *table);
+void fpi_geohash_probe_free(struct fpi_geohash_probe *probe);
+int fpi_geohash_vote(const struct fpi_geohash_probe *probe,
+	const struct fpi_geohash *hash);
+void fpi_geohash_save(struct fp_print_data *data, const char *print_path);
+void fpi_geohash_load(struct fp_print_data *data, const char *print_path);
+void fpi_geohash_delete(const char *print_path);
+
+/* opencl.c */
+int fpi_opencl_rank(const struct bz_gallery *probe,
+	const struct bz_gallery **tables, int nr_tables, int *scores);
+void fpi_opencl_table_freed(const struct bz_gallery *table);
+void fpi_opencl_exit(void);
+
+/* allocstats.c: allocations made between a push and the matching pop are
+ * accounted to the subsystem pushed, on the current thread */
+#if defined(ENABLE_ALLOC_STATS) && defined(__GLIBC__)
+int fpi_alloc_scope_push(enum fp_alloc_subsystem subsystem);
+void fpi_alloc_scope_pop(int prev);
+#else
+#define fpi_alloc_scope_push(subsystem) 0
+#define fpi_alloc_scope_pop(prev) do { (void) (prev); } while (0)
+#endif
+
+/* simd.c: pixel kernels for the instruction set of the CPU, chosen by
+ * fpi_simd_init() */
+struct fpi_simd_ops {
+	const char *name;
+	/* sum of absolute differences */
+	unsigned int (*row_sad)(const unsigned char *p1,
+		const unsigned char *p2, unsigned int width);
+	/* sum of squared differences */
+	guint64 (*sq_diff)(const unsigned char *buf1,
+		const unsigned char *buf2, int size);
+	/* sum of the values and of their squares */
+	void (*sum_sq)(const unsigned char *buf, int size, guint64 *sum,
+		guint64 *sumsq);
+};
+
+extern const struct fpi_simd_ops *fpi_simd;
+void fpi_simd_init(void);
+
+/* prematch.c */
+struct fpi_prematch_desc *fpi_prematch_desc_new(const struct xyt_struct *xyt);
+void fpi_prematch_desc_free(struct fpi_prematch_desc *desc);
+int fpi_prematch_desc_score(const struct fpi_prematch_desc *probe,
+	const struct fpi_prematch_desc *desc);
+
+/* store.c */
+void fpi_store_open(const char *path);
+void fpi_store_exit(void);
+int fpi_store_save(const char *user, uint16_t driver_id, uint32_t devtype,
+	enum fp_finger finger, const unsigned char *data, size_t len,
+	gboolean sync);
+int fpi_store_flush(void);
+int fpi_store_load(const char *user, uint16_t driver_id, uint32_t devtype,
+	enum fp_finger finger, GMappedFile **map, const unsigned char **data,
+	size_t *len);
+int fpi_store_delete(const char *user, uint16_t driver_id, uint32_t devtype,
+	enum fp_finger finger);
+GSList *fpi_store_discover(const char *user, GSList *list);
+
 /* polling and timeouts */
 
 void fpi_poll_init(void);
 void fpi_poll_exit(void);
+gboolean fpi_poll_can_defer(void);
+int fpi_get_event_thread_priority(void);
+gboolean fpi_poll_event_thread_elsewhere(void);
+void fpi_poll_defer(void (*func)(void *data), void *data);
+void fpi_poll_post(void (*func)(void *data), void *data);
 
 typedef void (*fpi_timeout_fn)(void *data);
 
-struct fpi_timeout;
+/* A timer, either allocated by fpi_timeout_add() and freed once it expired
+ * or was cancelled, or embedded in a driver structure and armed with
+ * fpi_timeout_start() */
+struct fpi_timeout {
+	/* monotonic clock expiry, in microseconds */
+	guint64 expiry;
+	guint64 seq;
+	fpi_timeout_fn callback;
+	void *data;
+	/* position in the timer heap plus one, 0 when not pending */
+	guint heap_pos;
+	gboolean allocated;
+	/* an allocated timer taken off the heap to fire, which the thread
+	 * dispatching it frees */
+	gboolean claimed;
+};
+
 struct fpi_timeout *fpi_timeout_add(unsigned int msec, fpi_timeout_fn callback,
 	void *data);
+int fpi_timeout_start(struct fpi_timeout *timeout, unsigned int msec,
+	fpi_timeout_fn callback, void *data);
 void fpi_timeout_cancel(struct fpi_timeout *timeout);
 
+static inline gboolean fpi_timeout_pending(const struct fpi_timeout *timeout)
+{
+	return timeout->heap_pos != 0;
+}
+
+/* The interval between the polls of a device waiting for a finger, see
+ * fpi_poll_backoff_next() */
+struct fpi_poll_backoff {
+	unsigned int min_ms;
+	unsigned int max_ms;
+	unsigned int interval;
+	/* monotonic clock, in microseconds */
+	guint64 last_activity;
+};
+
+void fpi_poll_backoff_init(struct fpi_poll_backoff *backoff,
+	unsigned int min_ms, unsigned int max_ms);
+void fpi_poll_backoff_activity(struct fpi_poll_backoff *backoff);
+unsigned int fpi_poll_backoff_next(struct fpi_poll_backoff *backoff);
+int fpi_poll_backoff_start(struct fpi_poll_backoff *backoff,
+	struct fpi_timeout *timeout, fpi_timeout_fn callback, void *data);
+
 /* async drv <--> lib comms */
 
 struct fpi_ssm;
@@ -438,12 +837,16 @@ struct fpi_ssm {
 	int error;
 	ssm_completed_fn callback;
 	ssm_handler_fn handler;
+	/* from fpi_ssm_new(), rather than embedded by fpi_ssm_init() */
+	gboolean allocated;
 };
 
 
 /* for library and drivers */
 struct fpi_ssm *fpi_ssm_new(struct fp_dev *dev, ssm_handler_fn handler,
 	int nr_states);
+void fpi_ssm_init(struct fpi_ssm *machine, struct fp_dev *dev,
+	ssm_handler_fn handler, int nr_states);
 void fpi_ssm_free(struct fpi_ssm *machine);
 void fpi_ssm_start(struct fpi_ssm *machine, ssm_completed_fn callback);
 void fpi_ssm_start_subsm(struct fpi_ssm *parent, struct fpi_ssm *child);
@@ -471,12 +874,15 @@ void fpi_drvcb_verify_stopped(struct fp_dev *dev);
 void fpi_drvcb_identify_started(struct fp_dev *dev, int status);
 void fpi_drvcb_report_identify_result(struct fp_dev *dev, int result,
 	size_t match_offset, struct fp_img *img);
+void fpi_drvcb_report_identify_score(struct fp_dev *dev,
+	const struct fp_identify_match *match);
 void fpi_drvcb_identify_stopped(struct fp_dev *dev);
 
 void fpi_drvcb_capture_started(struct fp_dev *dev, int status);
 void fpi_drvcb_report_capture_result(struct fp_dev *dev, int result,
 	struct fp_img *img);
 void fpi_drvcb_capture_stopped(struct fp_dev *dev);
+void fpi_drvcb_report_capture_frame(struct fp_dev *dev, struct fp_img *img);
 
 /* for image drivers */
 void fpi_imgdev_open_complete(struct fp_img_dev *imgdev, int status);
@@ -488,10 +894,26 @@ void fpi_imgdev_report_finger_status(struct fp_img_dev *imgdev,
 void fpi_imgdev_image_captured(struct fp_img_dev *imgdev, struct fp_img *img);
 void fpi_imgdev_abort_scan(struct fp_img_dev *imgdev, int result);
 void fpi_imgdev_session_error(struct fp_img_dev *imgdev, int error);
+int fpi_imgdev_set_processing_cpu(struct fp_img_dev *imgdev, int cpu);
+int fpi_imgdev_get_match_threshold(struct fp_img_dev *imgdev);
+void fpi_imgdev_set_warm_session(struct fp_img_dev *imgdev,
+	unsigned int idle_timeout_ms);
+int fpi_imgdev_capture_stream_start(struct fp_img_dev *imgdev,
+	unsigned int max_queued, unsigned int flags);
+int fpi_imgdev_capture_stream_ack(struct fp_img_dev *imgdev);
+void fpi_imgdev_get_stats(struct fp_img_dev *imgdev,
+	struct fp_dev_stats *stats);
 
 /* utils */
 int fpi_std_sq_dev(const unsigned char *buf, int size);
 int fpi_mean_sq_diff_norm(unsigned char *buf1, unsigned char *buf2, int size);
+int fpi_sq_diff(const unsigned char *buf1, const unsigned char *buf2,
+	int size);
+int fpi_std_sq_dev_sum(const unsigned char *buf1, const unsigned char *buf2,
+	int size, int stride);
+void fpi_std_sq_dev_sum_batch(const unsigned char *buf1,
+	const unsigned char *buf2, size_t step, int count, int size,
+	int stride, int *devs);
 
 #endif
 
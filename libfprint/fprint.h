@@ -57,12 +57,32 @@ struct fp_driver;
  */
 struct fp_print_data;
 
+/**
+ * fp_gallery:
+ *
+ * A set of saved prints loaded for identification, see fp_gallery_load().
+ */
+struct fp_gallery;
+
+/**
+ * fp_probe:
+ *
+ * A scanned finger prepared for matching, see fp_probe_new().
+ */
+struct fp_probe;
+
 /**
  * fp_img:
  *
  */
 struct fp_img;
 
+/**
+ * fp_cancellable:
+ *
+ */
+struct fp_cancellable;
+
 /* misc/general stuff */
 
 /**
@@ -129,6 +149,24 @@ struct fp_dscv_dev *fp_dscv_dev_for_print_data(struct fp_dscv_dev **devs,
 struct fp_dscv_dev *fp_dscv_dev_for_dscv_print(struct fp_dscv_dev **devs,
 	struct fp_dscv_print *print);
 
+/**
+ * fp_hotplug_event:
+ * @FP_HOTPLUG_ADDED: a supported device was plugged in, or was already
+ * plugged in when the notifier was set
+ * @FP_HOTPLUG_REMOVED: a device reported as added was unplugged
+ *
+ * The events reported to the notifier of fp_set_hotplug_notifier().
+ */
+enum fp_hotplug_event {
+	FP_HOTPLUG_ADDED = 0,
+	FP_HOTPLUG_REMOVED,
+};
+
+typedef void (*fp_hotplug_cb)(struct fp_dscv_dev *ddev,
+	enum fp_hotplug_event event, void *user_data);
+int fp_set_hotplug_notifier(fp_hotplug_cb callback, void *user_data);
+int fp_set_virtual_image_source(const char *source, unsigned int rate);
+
 /**
  * fp_dscv_dev_get_driver_id:
  * @dev: a discovered fingerprint device
@@ -150,6 +188,8 @@ int fp_dscv_print_delete(struct fp_dscv_print *print);
 
 /* Device handling */
 struct fp_dev *fp_dev_open(struct fp_dscv_dev *ddev);
+int fp_dev_open_timeout(struct fp_dscv_dev *ddev, unsigned int timeout_ms,
+	struct fp_cancellable *cancellable, struct fp_dev **dev);
 void fp_dev_close(struct fp_dev *dev);
 struct fp_driver *fp_dev_get_driver(struct fp_dev *dev);
 int fp_dev_get_nr_enroll_stages(struct fp_dev *dev);
@@ -173,8 +213,76 @@ enum fp_capture_result {
 int fp_dev_supports_imaging(struct fp_dev *dev);
 int fp_dev_img_capture(struct fp_dev *dev, int unconditional,
 	struct fp_img **img);
+int fp_dev_img_capture_timeout(struct fp_dev *dev, int unconditional,
+	struct fp_img **img, unsigned int timeout_ms,
+	struct fp_cancellable *cancellable);
 int fp_dev_get_img_width(struct fp_dev *dev);
 int fp_dev_get_img_height(struct fp_dev *dev);
+int fp_dev_set_processing_cpu(struct fp_dev *dev, int cpu);
+int fp_dev_set_warm_session(struct fp_dev *dev, unsigned int idle_timeout_ms);
+int fp_dev_set_enroll_consolidation(struct fp_dev *dev, int enable);
+int fp_dev_set_capture_dump(struct fp_dev *dev, const char *dir,
+	uint64_t quota);
+
+/**
+ * fp_dev_stage:
+ * @FP_DEV_STAGE_CAPTURE: from the finger touching the sensor to its image
+ * being captured
+ * @FP_DEV_STAGE_EXTRACT: from the image being captured to its minutiae being
+ * extracted
+ * @FP_DEV_STAGE_MATCH: from the minutiae being extracted to the verify or
+ * identify result
+ * @FP_DEV_STAGE_TOTAL: from the finger touching the sensor to the verify or
+ * identify result
+ * @FP_DEV_NUM_STAGES: the number of stages
+ *
+ * The latencies measured for each scan of an imaging device.
+ */
+enum fp_dev_stage {
+	FP_DEV_STAGE_CAPTURE = 0,
+	FP_DEV_STAGE_EXTRACT,
+	FP_DEV_STAGE_MATCH,
+	FP_DEV_STAGE_TOTAL,
+	FP_DEV_NUM_STAGES,
+};
+
+#define FP_DEV_STATS_BUCKETS 32
+
+/**
+ * fp_dev_latency:
+ * @count: the number of measurements
+ * @sum_usecs: their sum, in microseconds
+ * @max_usecs: the longest of them, in microseconds
+ * @buckets: the number of measurements in each bucket. Bucket 0 holds those
+ * under 2 microseconds, and bucket n > 0 those from 2^n to 2^(n+1) - 1
+ * microseconds. The last bucket also holds anything longer.
+ *
+ * A histogram of the latencies of a #fp_dev_stage.
+ */
+struct fp_dev_latency {
+	uint64_t count;
+	uint64_t sum_usecs;
+	uint64_t max_usecs;
+	uint32_t buckets[FP_DEV_STATS_BUCKETS];
+};
+
+/**
+ * fp_dev_stats:
+ * @stages: the latencies of each #fp_dev_stage
+ *
+ * Latencies of the scans of an imaging device.
+ */
+struct fp_dev_stats {
+	struct fp_dev_latency stages[FP_DEV_NUM_STAGES];
+};
+
+int fp_dev_get_stats(struct fp_dev *dev, struct fp_dev_stats *stats);
+
+struct fp_cancellable *fp_cancellable_new(void);
+void fp_cancellable_free(struct fp_cancellable *cancellable);
+void fp_cancellable_cancel(struct fp_cancellable *cancellable);
+void fp_cancellable_reset(struct fp_cancellable *cancellable);
+int fp_cancellable_is_cancelled(struct fp_cancellable *cancellable);
 
 /**
  * fp_enroll_result:
@@ -213,6 +321,9 @@ enum fp_enroll_result {
 
 int fp_enroll_finger_img(struct fp_dev *dev, struct fp_print_data **print_data,
 	struct fp_img **img);
+int fp_enroll_finger_img_timeout(struct fp_dev *dev,
+	struct fp_print_data **print_data, struct fp_img **img,
+	unsigned int timeout_ms, struct fp_cancellable *cancellable);
 
 /**
  * fp_enroll_finger:
@@ -267,6 +378,9 @@ enum fp_verify_result {
 
 int fp_verify_finger_img(struct fp_dev *dev,
 	struct fp_print_data *enrolled_print, struct fp_img **img);
+int fp_verify_finger_img_timeout(struct fp_dev *dev,
+	struct fp_print_data *enrolled_print, struct fp_img **img,
+	unsigned int timeout_ms, struct fp_cancellable *cancellable);
 
 /**
  * fp_verify_finger:
@@ -291,6 +405,10 @@ int fp_dev_supports_identification(struct fp_dev *dev);
 int fp_identify_finger_img(struct fp_dev *dev,
 	struct fp_print_data **print_gallery, size_t *match_offset,
 	struct fp_img **img);
+int fp_identify_finger_img_timeout(struct fp_dev *dev,
+	struct fp_print_data **print_gallery, size_t *match_offset,
+	struct fp_img **img, unsigned int timeout_ms,
+	struct fp_cancellable *cancellable);
 
 /**
  * fp_identify_finger:
@@ -316,20 +434,160 @@ static inline int fp_identify_finger(struct fp_dev *dev,
 	return fp_identify_finger_img(dev, print_gallery, match_offset, NULL);
 }
 
+/* Galleries */
+struct fp_gallery *fp_gallery_load(struct fp_dev *dev);
+void fp_gallery_free(struct fp_gallery *gallery);
+size_t fp_gallery_get_size(struct fp_gallery *gallery);
+struct fp_print_data **fp_gallery_get_prints(struct fp_gallery *gallery);
+enum fp_finger fp_gallery_get_finger(struct fp_gallery *gallery,
+	size_t offset);
+
+/**
+ * fp_identify_finger_gallery_img:
+ * @dev: the device to perform the scan.
+ * @gallery: the gallery to identify against, see fp_gallery_load().
+ * @match_offset: output location to store the offset of the matched print
+ * in the gallery (if any was found). Only valid if FP_VERIFY_MATCH was
+ * returned.
+ * @img: location to store the scan image, as for fp_identify_finger_img().
+ *
+ * A shortcut to calling fp_identify_finger_img() with the prints of
+ * @gallery.
+ *
+ * Returns: negative code on error, otherwise a code from #fp_verify_result
+ */
+static inline int fp_identify_finger_gallery_img(struct fp_dev *dev,
+	struct fp_gallery *gallery, size_t *match_offset, struct fp_img **img)
+{
+	return fp_identify_finger_img(dev, fp_gallery_get_prints(gallery),
+		match_offset, img);
+}
+
+/**
+ * fp_identify_match:
+ * @offset: index of the candidate print in the print gallery
+ * @score: matching score of the candidate; higher scores are better
+ *
+ * A candidate print reported by top-K identification.
+ */
+struct fp_identify_match {
+	size_t offset;
+	int score;
+};
+
+/**
+ * fp_identify_budget:
+ * @time_ms: the time the comparisons may take, counted from when matching
+ * starts, or 0 for no limit
+ * @max_comparisons: the number of gallery prints to compare at most, or 0
+ * for no limit
+ * @stop_on_match: stop comparing once a print reached the matching threshold
+ *
+ * Limits of an identification started with
+ * fp_async_identify_budget_start(). Once they are reached, the best
+ * candidates found so far are reported.
+ */
+struct fp_identify_budget {
+	unsigned int time_ms;
+	unsigned int max_comparisons;
+	int stop_on_match;
+};
+
+int fp_identify_finger_topk_img(struct fp_dev *dev,
+	struct fp_print_data **print_gallery, size_t k,
+	struct fp_identify_match *matches, size_t *nr_matches,
+	struct fp_img **img);
+int fp_identify_finger_topk_img_timeout(struct fp_dev *dev,
+	struct fp_print_data **print_gallery, size_t k,
+	struct fp_identify_match *matches, size_t *nr_matches,
+	struct fp_img **img, unsigned int timeout_ms,
+	struct fp_cancellable *cancellable);
+
+/**
+ * fp_identify_finger_topk:
+ * @dev: the device to perform the scan.
+ * @print_gallery: %NULL-terminated array of pointers to the prints to
+ * identify against.
+ * @k: the maximum number of candidates to report.
+ * @matches: output array of at least @k entries.
+ * @nr_matches: output location for the number of entries stored in @matches.
+ *
+ * Performs a new scan and reports the @k best candidates from the print
+ * gallery. This function is just a shortcut to calling
+ * fp_identify_finger_topk_img() with a %NULL image output parameter.
+ *
+ * Returns: negative code on error, otherwise a code from #fp_verify_result
+ * \sa fp_identify_finger_topk_img()
+ */
+static inline int fp_identify_finger_topk(struct fp_dev *dev,
+	struct fp_print_data **print_gallery, size_t k,
+	struct fp_identify_match *matches, size_t *nr_matches)
+{
+	return fp_identify_finger_topk_img(dev, print_gallery, k, matches,
+		nr_matches, NULL);
+}
+
+struct fp_probe *fp_probe_new(struct fp_dev *dev, struct fp_img *img);
+void fp_probe_free(struct fp_probe *probe);
+int fp_probe_verify(struct fp_probe *probe,
+	struct fp_print_data *enrolled_print);
+int fp_probe_identify(struct fp_probe *probe,
+	struct fp_print_data **print_gallery, size_t *match_offset);
+
 /* Data handling */
 int fp_print_data_load(struct fp_dev *dev, enum fp_finger finger,
 	struct fp_print_data **data);
 int fp_print_data_from_dscv_print(struct fp_dscv_print *print,
 	struct fp_print_data **data);
 int fp_print_data_save(struct fp_print_data *data, enum fp_finger finger);
+
+typedef void (*fp_print_data_save_cb)(struct fp_print_data *data, int result,
+	void *user_data);
+int fp_async_print_data_save(struct fp_print_data *data,
+	enum fp_finger finger, fp_print_data_save_cb callback, void *user_data);
+
 int fp_print_data_delete(struct fp_dev *dev, enum fp_finger finger);
 void fp_print_data_free(struct fp_print_data *data);
 size_t fp_print_data_get_data(struct fp_print_data *data, unsigned char **ret);
+
+/**
+ * fp_print_data_flags:
+ * @FP_PRINT_DATA_EDGES: also store the matcher's edge tables, so that the
+ * loaded print can be matched without building them first. This makes the
+ * data many times larger.
+ *
+ * Flags for fp_print_data_export().
+ */
+enum fp_print_data_flags {
+	FP_PRINT_DATA_EDGES = 1 << 0,
+};
+
+size_t fp_print_data_export(struct fp_print_data *data, unsigned int flags,
+	unsigned char **ret);
+size_t fp_print_data_export_to_buffer(struct fp_print_data *data,
+	unsigned int flags, unsigned char *buf, size_t size);
 struct fp_print_data *fp_print_data_from_data(unsigned char *buf,
 	size_t buflen);
 uint16_t fp_print_data_get_driver_id(struct fp_print_data *data);
 uint32_t fp_print_data_get_devtype(struct fp_print_data *data);
 
+/**
+ * fp_print_store:
+ * @FP_PRINT_STORE_DIRECTORY: one file per print below the user's home
+ * directory, the default
+ * @FP_PRINT_STORE_PACKED: all prints in a single indexed file, shared by
+ * any number of users
+ *
+ * The on-disk formats that fp_set_print_store() can select for
+ * fp_print_data_save() and friends.
+ */
+enum fp_print_store {
+	FP_PRINT_STORE_DIRECTORY = 0,
+	FP_PRINT_STORE_PACKED,
+};
+
+int fp_set_print_store(enum fp_print_store store, const char *user_key);
+
 /* Image handling */
 
 /**
@@ -359,8 +617,95 @@ int fp_img_save_to_file(struct fp_img *img, char *path);
 void fp_img_standardize(struct fp_img *img);
 struct fp_img *fp_img_binarize(struct fp_img *img);
 struct fp_minutia **fp_img_get_minutiae(struct fp_img *img, int *nr_minutiae);
+const int *fp_img_get_quality_map(struct fp_img *img, int *width,
+	int *height);
+const int *fp_img_get_direction_map(struct fp_img *img, int *width,
+	int *height);
 void fp_img_free(struct fp_img *img);
 
+/**
+ * fp_extract_stage:
+ * @FP_EXTRACT_STAGE_SETUP: cropping and padding the image, and looking up
+ * the tables for its size
+ * @FP_EXTRACT_STAGE_INITIAL_MAPS: computing the initial ridge direction and
+ * contrast maps
+ * @FP_EXTRACT_STAGE_INTERPOLATE: cleaning up and interpolating the maps
+ * @FP_EXTRACT_STAGE_BINARIZE: binarizing the image
+ * @FP_EXTRACT_STAGE_DETECT: detecting candidate minutiae
+ * @FP_EXTRACT_STAGE_REMOVE: removing false minutiae
+ * @FP_EXTRACT_STAGE_RIDGE_COUNT: counting ridges between neighbouring
+ * minutiae
+ * @FP_EXTRACT_STAGE_QUALITY: assigning a reliability to each minutia
+ * @FP_EXTRACT_STAGE_XYT: converting the minutiae to print data
+ * @FP_EXTRACT_NUM_STAGES: the number of stages
+ *
+ * The stages of minutiae extraction, in the order they run.
+ */
+enum fp_extract_stage {
+	FP_EXTRACT_STAGE_SETUP = 0,
+	FP_EXTRACT_STAGE_INITIAL_MAPS,
+	FP_EXTRACT_STAGE_INTERPOLATE,
+	FP_EXTRACT_STAGE_BINARIZE,
+	FP_EXTRACT_STAGE_DETECT,
+	FP_EXTRACT_STAGE_REMOVE,
+	FP_EXTRACT_STAGE_RIDGE_COUNT,
+	FP_EXTRACT_STAGE_QUALITY,
+	FP_EXTRACT_STAGE_XYT,
+	FP_EXTRACT_NUM_STAGES,
+};
+
+/**
+ * fp_extract_stats:
+ * @images: the number of images whose minutiae were detected
+ * @usecs: the time spent in each #fp_extract_stage, in microseconds
+ *
+ * Time spent extracting minutiae, broken down by stage.
+ */
+struct fp_extract_stats {
+	uint64_t images;
+	uint64_t usecs[FP_EXTRACT_NUM_STAGES];
+};
+
+void fp_img_get_extract_stats(struct fp_img *img,
+	struct fp_extract_stats *stats);
+
+/**
+ * fp_alloc_subsystem:
+ * @FP_ALLOC_DRIVER: the drivers and the device handling around them,
+ * everything run while libfprint handles its events
+ * @FP_ALLOC_ASSEMBLING: assembling the frames or lines of swipe sensors
+ * into images
+ * @FP_ALLOC_MINDTCT: detecting minutiae
+ * @FP_ALLOC_BOZORTH3: matching prints, and preparing prints for matching
+ * @FP_ALLOC_DATA: converting prints to and from their stored form
+ * @FP_ALLOC_NUM_SUBSYSTEMS: the number of subsystems
+ *
+ * The subsystems allocations are accounted to, see fp_get_alloc_stats().
+ * Each allocation goes to the innermost subsystem running, so detecting
+ * the minutiae of a capture counts as @FP_ALLOC_MINDTCT even when the
+ * driver started it.
+ */
+enum fp_alloc_subsystem {
+	FP_ALLOC_DRIVER = 0,
+	FP_ALLOC_ASSEMBLING,
+	FP_ALLOC_MINDTCT,
+	FP_ALLOC_BOZORTH3,
+	FP_ALLOC_DATA,
+	FP_ALLOC_NUM_SUBSYSTEMS,
+};
+
+/**
+ * fp_alloc_stats:
+ * @allocs: the number of allocations made by each #fp_alloc_subsystem
+ * @bytes: the number of bytes they asked for
+ *
+ * Memory allocations, broken down by subsystem.
+ */
+struct fp_alloc_stats {
+	uint64_t allocs[FP_ALLOC_NUM_SUBSYSTEMS];
+	uint64_t bytes[FP_ALLOC_NUM_SUBSYSTEMS];
+};
+
 /* Polling and timing */
 
 /**
@@ -382,10 +727,107 @@ typedef void (*fp_pollfd_removed_cb)(int fd);
 void fp_set_pollfd_notifiers(fp_pollfd_added_cb added_cb,
 	fp_pollfd_removed_cb removed_cb);
 
+int fp_get_event_fd(void);
+int fp_handle_event_fd(void);
+
+int fp_event_thread_set_realtime(int priority);
+int fp_event_thread_start(void);
+int fp_event_thread_post(void (*func)(void *data), void *data);
+void fp_event_thread_stop(void);
+
 /* Library */
 int fp_init(void);
 void fp_exit(void);
 void fp_set_debug(int level);
+int fp_set_log_buffer(unsigned int records);
+void fp_flush_log(void);
+void fp_set_match_threads(unsigned int nr_threads);
+void fp_set_identify_candidates(unsigned int nr_candidates);
+
+/**
+ * fp_identify_order:
+ * @FP_IDENTIFY_ORDER_GALLERY: in gallery order
+ * @FP_IDENTIFY_ORDER_RECENT: most recently matched prints first
+ * @FP_IDENTIFY_ORDER_FREQUENT: most often matched prints first
+ * @FP_IDENTIFY_ORDER_TIME_OF_DAY: prints most often matched at the current
+ * hour of the day first
+ *
+ * Orders in which identification matches gallery prints, see
+ * fp_set_identify_order().
+ */
+enum fp_identify_order {
+	FP_IDENTIFY_ORDER_GALLERY = 0,
+	FP_IDENTIFY_ORDER_RECENT,
+	FP_IDENTIFY_ORDER_FREQUENT,
+	FP_IDENTIFY_ORDER_TIME_OF_DAY,
+};
+
+void fp_set_identify_order(enum fp_identify_order order);
+
+/**
+ * fp_identify_backend:
+ * @FP_IDENTIFY_BACKEND_CPU: rank candidates by their minutia-pair
+ * signatures, on the CPU
+ * @FP_IDENTIFY_BACKEND_OPENCL: rank candidates by an approximate match
+ * score, on an OpenCL device
+ *
+ * Where the candidate index ranks a gallery, see fp_set_identify_backend().
+ */
+enum fp_identify_backend {
+	FP_IDENTIFY_BACKEND_CPU = 0,
+	FP_IDENTIFY_BACKEND_OPENCL,
+};
+
+int fp_set_identify_backend(enum fp_identify_backend backend);
+
+/**
+ * fp_prematch:
+ * @FP_PREMATCH_NONE: no pre-match stage
+ * @FP_PREMATCH_DIRECTIONS: histograms of the distances and relative
+ * directions of minutia pairs
+ * @FP_PREMATCH_PAIRS: the minutia-pair signatures of the candidate index,
+ * see fp_set_identify_candidates()
+ *
+ * Descriptors the pre-match stage of identification compares, see
+ * fp_set_prematch().
+ */
+enum fp_prematch {
+	FP_PREMATCH_NONE = 0,
+	FP_PREMATCH_DIRECTIONS,
+	FP_PREMATCH_PAIRS,
+};
+
+void fp_set_prematch(enum fp_prematch method, int cutoff,
+	unsigned int audit_interval);
+
+/**
+ * fp_identify_stats:
+ * @identifications: the number of gallery identifications
+ * @candidates: the number of gallery prints the pre-match stage scored
+ * @pruned: the number of those which scored below the cutoff
+ * @audited: the number of pruned prints matched in full anyway
+ * @audit_matches: the number of audited prints which matched, i.e. would
+ * have been falsely rejected by the pre-match stage
+ *
+ * How much the pre-match stage of identification prunes, see
+ * fp_set_prematch().
+ */
+struct fp_identify_stats {
+	uint64_t identifications;
+	uint64_t candidates;
+	uint64_t pruned;
+	uint64_t audited;
+	uint64_t audit_matches;
+};
+
+void fp_get_identify_stats(struct fp_identify_stats *stats);
+void fp_reset_identify_stats(void);
+void fp_set_extract_threads(unsigned int nr_threads);
+void fp_set_assemble_threads(unsigned int nr_threads);
+void fp_get_extract_stats(struct fp_extract_stats *stats);
+void fp_reset_extract_stats(void);
+int fp_get_alloc_stats(struct fp_alloc_stats *stats);
+void fp_reset_alloc_stats(void);
 
 /* Asynchronous I/O */
 
@@ -420,6 +862,20 @@ typedef void (*fp_identify_cb)(struct fp_dev *dev, int result,
 int fp_async_identify_start(struct fp_dev *dev, struct fp_print_data **gallery,
 	fp_identify_cb callback, void *user_data);
 
+typedef void (*fp_identify_topk_cb)(struct fp_dev *dev, int result,
+	const struct fp_identify_match *matches, size_t nr_matches,
+	struct fp_img *img, void *user_data);
+int fp_async_identify_topk_start(struct fp_dev *dev,
+	struct fp_print_data **gallery, size_t k, fp_identify_topk_cb callback,
+	void *user_data);
+
+typedef void (*fp_identify_score_cb)(struct fp_dev *dev,
+	const struct fp_identify_match *match, void *user_data);
+int fp_async_identify_budget_start(struct fp_dev *dev,
+	struct fp_print_data **gallery, size_t k,
+	const struct fp_identify_budget *budget, fp_identify_score_cb score_cb,
+	fp_identify_topk_cb callback, void *user_data);
+
 typedef void (*fp_identify_stop_cb)(struct fp_dev *dev, void *user_data);
 int fp_async_identify_stop(struct fp_dev *dev, fp_identify_stop_cb callback,
 	void *user_data);
@@ -431,6 +887,21 @@ int fp_async_capture_start(struct fp_dev *dev, int unconditional, fp_capture_cb
 typedef void (*fp_capture_stop_cb)(struct fp_dev *dev, void *user_data);
 int fp_async_capture_stop(struct fp_dev *dev, fp_capture_stop_cb callback, void *user_data);
 
+/**
+ * fp_capture_stream_flags:
+ * @FP_CAPTURE_STREAM_DROP_OLDEST: when the queue of a capture stream is full,
+ * drop its oldest image rather than pausing the capture.
+ *
+ * Options of fp_async_capture_stream_start().
+ */
+enum fp_capture_stream_flags {
+	FP_CAPTURE_STREAM_DROP_OLDEST = 1 << 0,
+};
+
+int fp_async_capture_stream_start(struct fp_dev *dev, unsigned int max_queued,
+	unsigned int flags, fp_capture_cb callback, void *user_data);
+int fp_async_capture_stream_ack(struct fp_dev *dev);
+
 #ifdef __cplusplus
 }
 #endif
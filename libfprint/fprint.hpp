@@ -0,0 +1,274 @@
+/*
+ * C++ binding for libfprint
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __FPRINT_HPP__
+#define __FPRINT_HPP__
+
+/* Thin wrappers around the C API, needing C++11 and nothing but this file.
+ * Each handle owns one libfprint object and frees it with the matching
+ * fp_*_free() call; handles can be moved but not copied. Images and
+ * serialized prints are seen through fp::span views of the memory
+ * libfprint owns, and the gallery is passed to the identify functions as
+ * it is, so nothing is copied on the way. As in the C API, errors are
+ * returned as negative error codes. */
+
+#include <cstddef>
+#include <type_traits>
+#include <vector>
+
+#include "fprint.h"
+
+namespace fp {
+
+/* A view of count contiguous elements, owned elsewhere */
+template <typename T>
+class span {
+public:
+	span() : ptr_(nullptr), count_(0) {}
+	span(T *ptr, std::size_t count) : ptr_(ptr), count_(count) {}
+	template <typename A>
+	span(std::vector<typename std::remove_const<T>::type, A> &v)
+		: ptr_(v.data()), count_(v.size()) {}
+
+	T *data() const { return ptr_; }
+	std::size_t size() const { return count_; }
+	bool empty() const { return count_ == 0; }
+	T &operator[](std::size_t i) const { return ptr_[i]; }
+	T *begin() const { return ptr_; }
+	T *end() const { return ptr_ + count_; }
+	span subspan(std::size_t offset, std::size_t count) const
+	{
+		return span(ptr_ + offset, count);
+	}
+
+private:
+	T *ptr_;
+	std::size_t count_;
+};
+
+namespace detail {
+
+/* The owning handle shared by the wrappers, freeing with Free */
+template <typename T, void (*Free)(T *)>
+class handle {
+public:
+	handle() : ptr_(nullptr) {}
+	explicit handle(T *ptr) : ptr_(ptr) {}
+	handle(const handle &) = delete;
+	handle &operator=(const handle &) = delete;
+	handle(handle &&other) noexcept : ptr_(other.release()) {}
+	handle &operator=(handle &&other) noexcept
+	{
+		reset(other.release());
+		return *this;
+	}
+	~handle() { reset(); }
+
+	T *get() const { return ptr_; }
+	explicit operator bool() const { return ptr_ != nullptr; }
+	T *release()
+	{
+		T *ptr = ptr_;
+
+		ptr_ = nullptr;
+		return ptr;
+	}
+	void reset(T *ptr = nullptr)
+	{
+		if (ptr_)
+			Free(ptr_);
+		ptr_ = ptr;
+	}
+
+	/* For the output parameters of the C API; frees the current object */
+	T **out()
+	{
+		reset();
+		return &ptr_;
+	}
+
+private:
+	T *ptr_;
+};
+
+} /* namespace detail */
+
+class image : public detail::handle<fp_img, fp_img_free> {
+public:
+	using handle::handle;
+
+	int width() const { return fp_img_get_width(get()); }
+	int height() const { return fp_img_get_height(get()); }
+
+	/* The pixels, one byte each, row after row */
+	span<unsigned char> pixels() const
+	{
+		return span<unsigned char>(fp_img_get_data(get()),
+			(std::size_t) width() * height());
+	}
+
+	span<const int> quality_map(int *map_width, int *map_height) const
+	{
+		return map(fp_img_get_quality_map(get(), map_width,
+			map_height), map_width, map_height);
+	}
+
+	span<const int> direction_map(int *map_width, int *map_height) const
+	{
+		return map(fp_img_get_direction_map(get(), map_width,
+			map_height), map_width, map_height);
+	}
+
+	/* The minutiae remain owned by the image */
+	span<fp_minutia *const> minutiae() const
+	{
+		int nr = 0;
+		fp_minutia **m = fp_img_get_minutiae(get(), &nr);
+
+		return span<fp_minutia *const>(m, m ? nr : 0);
+	}
+
+private:
+	static span<const int> map(const int *m, int *w, int *h)
+	{
+		return m ? span<const int>(m, (std::size_t) *w * *h)
+			: span<const int>();
+	}
+};
+
+class print : public detail::handle<fp_print_data, fp_print_data_free> {
+public:
+	using handle::handle;
+
+	/* Loads a print from fp_print_data_get_data() or serialize() output,
+	 * which is left untouched. */
+	static print from_data(span<const unsigned char> data)
+	{
+		return print(fp_print_data_from_data(
+			const_cast<unsigned char *>(data.data()), data.size()));
+	}
+
+	uint16_t driver_id() const
+	{
+		return fp_print_data_get_driver_id(get());
+	}
+
+	uint32_t devtype() const
+	{
+		return fp_print_data_get_devtype(get());
+	}
+
+	/* Writes the print to buf, see fp_print_data_export_to_buffer():
+	 * returns the size of the data, which did not fit if larger than
+	 * buf. */
+	std::size_t serialize(span<unsigned char> buf,
+		unsigned int flags = 0) const
+	{
+		return fp_print_data_export_to_buffer(get(), flags, buf.data(),
+			buf.size());
+	}
+
+	/* Serializes into buf, growing it as needed; reusing the same vector
+	 * allocates only when a print is larger than any before it. */
+	std::size_t serialize(std::vector<unsigned char> &buf,
+		unsigned int flags = 0) const
+	{
+		std::size_t len;
+
+		buf.resize(buf.capacity());
+		while ((len = serialize(span<unsigned char>(buf), flags))
+				> buf.size())
+			buf.resize(len);
+		buf.resize(len);
+		return len;
+	}
+};
+
+class gallery : public detail::handle<fp_gallery, fp_gallery_free> {
+public:
+	using handle::handle;
+
+	std::size_t size() const { return fp_gallery_get_size(get()); }
+
+	/* The prints remain owned by the gallery */
+	span<fp_print_data *const> prints() const
+	{
+		return span<fp_print_data *const>(fp_gallery_get_prints(get()),
+			size());
+	}
+
+	fp_finger finger(std::size_t offset) const
+	{
+		return fp_gallery_get_finger(get(), offset);
+	}
+};
+
+class device : public detail::handle<fp_dev, fp_dev_close> {
+public:
+	using handle::handle;
+
+	static device open(fp_dscv_dev *ddev)
+	{
+		return device(fp_dev_open(ddev));
+	}
+
+	gallery load_gallery() const
+	{
+		return gallery(fp_gallery_load(get()));
+	}
+
+	/* Returns a negative error code or an fp_enroll_result, storing the
+	 * print once enrollment completed. */
+	int enroll(print &enrolled, image *img = nullptr) const
+	{
+		return fp_enroll_finger_img(get(), enrolled.out(),
+			img ? img->out() : nullptr);
+	}
+
+	/* Returns a negative error code or an fp_verify_result */
+	int verify(const print &enrolled, image *img = nullptr) const
+	{
+		return fp_verify_finger_img(get(), enrolled.get(),
+			img ? img->out() : nullptr);
+	}
+
+	/* Returns a negative error code or an fp_verify_result, storing
+	 * the offset of the matching gallery print on a match. */
+	int identify(const gallery &g, std::size_t &match_offset,
+		image *img = nullptr) const
+	{
+		return fp_identify_finger_img(get(),
+			fp_gallery_get_prints(g.get()), &match_offset,
+			img ? img->out() : nullptr);
+	}
+
+	/* Reports up to matches.size() candidates, best first, and returns
+	 * the number stored through nr_matches. */
+	int identify_topk(const gallery &g, span<fp_identify_match> matches,
+		std::size_t &nr_matches, image *img = nullptr) const
+	{
+		return fp_identify_finger_topk_img(get(),
+			fp_gallery_get_prints(g.get()), matches.size(),
+			matches.data(), &nr_matches,
+			img ? img->out() : nullptr);
+	}
+};
+
+} /* namespace fp */
+
+#endif
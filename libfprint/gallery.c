@@ -0,0 +1,218 @@
+/*
+ * Print galleries for libfprint
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+#include <errno.h>
+
+#include <glib.h>
+
+#include "fp_internal.h"
+
+/**
+ * SECTION: gallery
+ * @title: Galleries
+ *
+ * Identifying a finger needs every candidate print in memory. Rather than
+ * discovering the saved prints and loading them one by one, a #fp_gallery
+ * loads all the prints saved with fp_print_data_save() that are compatible
+ * with a device in a single call. The prints are loaded on several threads,
+ * and everything the matcher builds for a gallery print on its first
+ * comparison is built up front.
+ */
+
+struct fp_gallery {
+	/* NULL-terminated, as expected by the identify functions */
+	struct fp_print_data **prints;
+	enum fp_finger *fingers;
+	size_t len;
+};
+
+struct gallery_load {
+	struct fp_dscv_print **dscv;
+	struct fp_print_data **prints;
+	gint len;
+	gint next;
+	gboolean prepare;
+};
+
+static gpointer gallery_load_worker(gpointer data)
+{
+	struct gallery_load *load = data;
+	gint i;
+
+	while ((i = g_atomic_int_add(&load->next, 1)) < load->len) {
+		if (load->prepare) {
+			/* failing leaves the tables to be built on first match */
+			fpi_img_prepare_print_data(load->prints[i]);
+		} else if (fp_print_data_from_dscv_print(load->dscv[i],
+				&load->prints[i]) != 0) {
+			load->prints[i] = NULL;
+		}
+	}
+	return NULL;
+}
+
+static void gallery_load_run(struct gallery_load *load, gboolean prepare)
+{
+	GThread **threads;
+	unsigned int nr_threads;
+	unsigned int i;
+
+	load->next = 0;
+	load->prepare = prepare;
+	nr_threads = fpi_get_match_threads();
+	if (nr_threads > (unsigned int) load->len)
+		nr_threads = load->len;
+
+	/* the calling thread takes part in the load as well */
+	threads = g_alloca(sizeof(*threads) * (nr_threads + 1));
+	for (i = 1; i < nr_threads; i++) {
+		threads[i] = fpi_thread_try_new("fp-gallery",
+			gallery_load_worker, load);
+		if (!threads[i]) {
+			fp_warn("could not create gallery thread %u", i);
+			break;
+		}
+	}
+	nr_threads = i;
+
+	gallery_load_worker(load);
+	for (i = 1; i < nr_threads; i++)
+		g_thread_join(threads[i]);
+}
+
+/**
+ * fp_gallery_load:
+ * @dev: the device to load prints for
+ *
+ * Loads every print previously saved with fp_print_data_save() that is
+ * compatible with @dev. Prints that turn out to be unreadable or
+ * incompatible are left out.
+ *
+ * Returns: the loaded gallery, or %NULL if the saved prints could not be
+ * listed. Must be freed with fp_gallery_free() after use.
+ */
+API_EXPORTED struct fp_gallery *fp_gallery_load(struct fp_dev *dev)
+{
+	struct fp_dscv_print **dscv;
+	struct fp_gallery *gallery;
+	struct gallery_load load;
+	gint i, nr_dscv;
+
+	dscv = fp_discover_prints();
+	if (!dscv)
+		return NULL;
+
+	for (nr_dscv = 0; dscv[nr_dscv]; nr_dscv++);
+	load.dscv = g_new(struct fp_dscv_print *, nr_dscv);
+	load.len = 0;
+	for (i = 0; i < nr_dscv; i++)
+		if (fp_dev_supports_dscv_print(dev, dscv[i]))
+			load.dscv[load.len++] = dscv[i];
+	load.prints = g_new0(struct fp_print_data *, load.len);
+	gallery_load_run(&load, FALSE);
+
+	gallery = g_malloc0(sizeof(*gallery));
+	gallery->prints = g_new(struct fp_print_data *, load.len + 1);
+	gallery->fingers = g_new(enum fp_finger, load.len);
+	for (i = 0; i < load.len; i++) {
+		struct fp_print_data *data = load.prints[i];
+
+		if (!data)
+			continue;
+		if (!fp_dev_supports_print_data(dev, data)) {
+			fp_print_data_free(data);
+			continue;
+		}
+		gallery->fingers[gallery->len] = load.dscv[i]->finger;
+		gallery->prints[gallery->len++] = data;
+	}
+	gallery->prints[gallery->len] = NULL;
+	fp_dbg("loaded %zd of %d prints", gallery->len, load.len);
+
+	load.prints = gallery->prints;
+	load.len = gallery->len;
+	gallery_load_run(&load, TRUE);
+
+	g_free(load.dscv);
+	fp_dscv_prints_free(dscv);
+	return gallery;
+}
+
+/**
+ * fp_gallery_free:
+ * @gallery: the gallery to free. If %NULL, function simply returns.
+ *
+ * Frees a gallery and the prints in it.
+ */
+API_EXPORTED void fp_gallery_free(struct fp_gallery *gallery)
+{
+	size_t i;
+
+	if (!gallery)
+		return;
+
+	for (i = 0; i < gallery->len; i++)
+		fp_print_data_free(gallery->prints[i]);
+	g_free(gallery->prints);
+	g_free(gallery->fingers);
+	g_free(gallery);
+}
+
+/**
+ * fp_gallery_get_size:
+ * @gallery: the gallery
+ *
+ * Returns: the number of prints in @gallery
+ */
+API_EXPORTED size_t fp_gallery_get_size(struct fp_gallery *gallery)
+{
+	return gallery->len;
+}
+
+/**
+ * fp_gallery_get_prints:
+ * @gallery: the gallery
+ *
+ * Gets the prints of a gallery as an array that can be passed to
+ * fp_identify_finger_img(), fp_async_identify_start() and the other
+ * identify functions. The match offsets they report index this array.
+ *
+ * Returns: a %NULL-terminated array of the prints in @gallery. The array
+ * and the prints belong to the gallery and must not be modified or freed.
+ */
+API_EXPORTED struct fp_print_data **fp_gallery_get_prints(
+	struct fp_gallery *gallery)
+{
+	return gallery->prints;
+}
+
+/**
+ * fp_gallery_get_finger:
+ * @gallery: the gallery
+ * @offset: the index of a print in @gallery
+ *
+ * Gets the finger a print of the gallery was saved for.
+ *
+ * Returns: a finger code from #fp_finger
+ */
+API_EXPORTED enum fp_finger fp_gallery_get_finger(struct fp_gallery *gallery,
+	size_t offset)
+{
+	return gallery->fingers[offset];
+}
@@ -0,0 +1,310 @@
+/*
+ * Geometric hash candidate index for identification
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Each NBIS sample is summarised by the set of minutia-pair invariants found
+ * in its Bozorth3 edge table: the pair's distance and the two angles between
+ * the connecting line and each minutia's direction. These do not change when
+ * the finger is moved or rotated on the sensor, so quantizing them into
+ * buckets gives a cheap signature. A probe votes for every gallery sample
+ * sharing buckets with it, and only the best voted candidates are handed to
+ * the full matcher.
+ *
+ * The signatures are kept in a sidecar file next to each stored print, so
+ * loading a gallery does not have to rebuild the edge tables. */
+
+#include <math.h>
+#include <string.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "fp_internal.h"
+#include "nbis/include/bozorth.h"
+
+/* Bucket sizes. Widening the buckets to the matcher's own tolerances (see
+ * bz_match()) fills most of the probe's vote map and ranks poorly, so the
+ * buckets are narrower and a genuine pair only needs to share most of its
+ * edges' buckets rather than all of them. */
+#define GEOHASH_DIST_STEP	6
+#define GEOHASH_DIST_BUCKETS	(DM / GEOHASH_DIST_STEP + 1)
+#define GEOHASH_ANGLE_STEP	9
+#define GEOHASH_ANGLE_BUCKETS	(360 / GEOHASH_ANGLE_STEP)
+#define GEOHASH_KEYS \
+	(GEOHASH_DIST_BUCKETS * GEOHASH_ANGLE_BUCKETS * GEOHASH_ANGLE_BUCKETS)
+
+/* votes are normalized by signature size, damped for small signatures which
+ * would otherwise score highly by chance */
+#define GEOHASH_VOTE_PRIOR	16
+
+#define GEOHASH_FILE_PREFIX	"FPH1"
+#define GEOHASH_FILE_SUFFIX	".idx"
+
+struct fpi_geohash {
+	guint32 nr_keys;
+	guint16 keys[0];
+};
+
+struct fpi_geohash_probe {
+	guint8 bitmap[(GEOHASH_KEYS + 7) / 8];
+};
+
+static int dist_bucket(double dist)
+{
+	int b = (int) (dist / GEOHASH_DIST_STEP);
+	return CLAMP(b, 0, GEOHASH_DIST_BUCKETS - 1);
+}
+
+static int angle_bucket(int deg)
+{
+	int b = (deg + 180) / GEOHASH_ANGLE_STEP;
+	return ((b % GEOHASH_ANGLE_BUCKETS) + GEOHASH_ANGLE_BUCKETS)
+		% GEOHASH_ANGLE_BUCKETS;
+}
+
+static guint16 make_key(int d, int b1, int b2)
+{
+	return (d * GEOHASH_ANGLE_BUCKETS + b1) * GEOHASH_ANGLE_BUCKETS + b2;
+}
+
+static int cmp_key(const void *a, const void *b)
+{
+	return (int) *(const guint16 *) a - (int) *(const guint16 *) b;
+}
+
+/* Builds the signature of a gallery sample from its prepared edge table. */
+struct fpi_geohash *fpi_geohash_new(const struct bz_gallery *gallery)
+{
+	struct fpi_geohash *hash;
+	guint32 i, n;
+
+	hash = g_malloc(sizeof(*hash) + gallery->len * sizeof(guint16));
+	for (i = 0; i < (guint32) gallery->len; i++) {
+		const int *row = gallery->cols[i];
+		hash->keys[i] = make_key(dist_bucket(sqrt(row[0])),
+			angle_bucket(row[1]), angle_bucket(row[2]));
+	}
+
+	/* keep each bucket once, sorted */
+	qsort(hash->keys, gallery->len, sizeof(guint16), cmp_key);
+	for (i = 0, n = 0; i < (guint32) gallery->len; i++)
+		if (n == 0 || hash->keys[n - 1] != hash->keys[i])
+			hash->keys[n++] = hash->keys[i];
+	hash->nr_keys = n;
+
+	return hash;
+}
+
+void fpi_geohash_free(struct fpi_geohash *hash)
+{
+	g_free(hash);
+}
+
+static void probe_set(struct fpi_geohash_probe *probe, guint16 key)
+{
+	probe->bitmap[key >> 3] |= 1 << (key & 7);
+}
+
+/* Builds the probe's vote map from its prepared edge table, see
+ * bozorth_probe_prepare_ctx(). The two angles of an edge are stored
+ * smallest first, which small errors can swap when they are close, so both
+ * orders are entered. */
+struct fpi_geohash_probe *fpi_geohash_probe_new(const struct bz_gallery *table)
+{
+	struct fpi_geohash_probe *probe = g_malloc0(sizeof(*probe));
+	int i;
+
+	for (i = 0; i < table->len; i++) {
+		const int *row = table->colpt[i];
+		int d = dist_bucket(sqrt(row[0]));
+		int b1 = angle_bucket(row[1]);
+		int b2 = angle_bucket(row[2]);
+
+		probe_set(probe, make_key(d, b1, b2));
+		probe_set(probe, make_key(d, b2, b1));
+	}
+
+	return probe;
+}
+
+void fpi_geohash_probe_free(struct fpi_geohash_probe *probe)
+{
+	g_free(probe);
+}
+
+/* Returns the probe's vote for a gallery sample; higher is better. */
+int fpi_geohash_vote(const struct fpi_geohash_probe *probe,
+	const struct fpi_geohash *hash)
+{
+	guint32 i;
+	int hits = 0;
+
+	for (i = 0; i < hash->nr_keys; i++) {
+		guint16 key = hash->keys[i];
+		if (probe->bitmap[key >> 3] & (1 << (key & 7)))
+			hits++;
+	}
+
+	return hits * 1024 / (int) (hash->nr_keys + GEOHASH_VOTE_PRIOR);
+}
+
+/* FNV-1a over the sample data, used to tie a sidecar entry to the exact
+ * sample it was computed from */
+static guint32 item_checksum(struct fp_print_data_item *item)
+{
+	guint32 h = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < item->length; i++) {
+		h ^= item->data[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static char *sidecar_path(const char *print_path)
+{
+	return g_strconcat(print_path, GEOHASH_FILE_SUFFIX, NULL);
+}
+
+/* Sidecar layout, little endian: "FPH1", number of samples, then for each
+ * sample its checksum, its number of keys and the keys themselves. The index
+ * is only an accelerator: when it cannot be saved, the print is still usable
+ * and its index is rebuilt once loaded, so failures are only logged. */
+void fpi_geohash_save(struct fp_print_data *data, const char *print_path)
+{
+	GError *err = NULL;
+	GByteArray *buf;
+	guint32 n;
+	char *path;
+	guint32 v;
+	int r;
+
+	if (data->type != PRINT_DATA_NBIS_MINUTIAE)
+		return;
+	r = fpi_img_index_print_data(data);
+	if (r < 0) {
+		fp_err("could not index print, error %d", r);
+		return;
+	}
+
+	buf = g_byte_array_new();
+	g_byte_array_append(buf, (const guint8 *) GEOHASH_FILE_PREFIX, 4);
+	v = GUINT32_TO_LE(data->nr_items);
+	g_byte_array_append(buf, (const guint8 *) &v, sizeof(v));
+	for (n = 0; n < data->nr_items; n++) {
+		struct fp_print_data_item *item = &data->items[n];
+		guint32 i;
+
+		v = GUINT32_TO_LE(item_checksum(item));
+		g_byte_array_append(buf, (const guint8 *) &v, sizeof(v));
+		v = GUINT32_TO_LE(item->geohash->nr_keys);
+		g_byte_array_append(buf, (const guint8 *) &v, sizeof(v));
+		for (i = 0; i < item->geohash->nr_keys; i++) {
+			guint16 k = GUINT16_TO_LE(item->geohash->keys[i]);
+			g_byte_array_append(buf, (const guint8 *) &k, sizeof(k));
+		}
+	}
+
+	path = sidecar_path(print_path);
+	fp_dbg("saving index to %s", path);
+	g_file_set_contents(path, (const gchar *) buf->data, buf->len, &err);
+	if (err) {
+		fp_err("index save failed: %s", err->message);
+		g_error_free(err);
+	}
+	g_free(path);
+	g_byte_array_free(buf, TRUE);
+}
+
+/* Attaches the signatures stored next to print_path to data. A missing or
+ * stale sidecar is not an error: the signatures are rebuilt instead, as
+ * they are when print_path is NULL. */
+void fpi_geohash_load(struct fp_print_data *data, const char *print_path)
+{
+	gchar *contents = NULL;
+	gsize length;
+	const guint8 *p, *end;
+	guint32 n;
+	char *path = NULL;
+	guint32 v;
+
+	if (data->type != PRINT_DATA_NBIS_MINUTIAE)
+		return;
+	if (!print_path)
+		goto rebuild;
+
+	path = sidecar_path(print_path);
+	if (!g_file_get_contents(path, &contents, &length, NULL)) {
+		fp_dbg("no index at %s", path);
+		goto rebuild;
+	}
+
+	p = (const guint8 *) contents;
+	end = p + length;
+	if (length < 8 || memcmp(p, GEOHASH_FILE_PREFIX, 4) != 0)
+		goto stale;
+	memcpy(&v, p + 4, sizeof(v));
+	if (GUINT32_FROM_LE(v) != data->nr_items)
+		goto stale;
+	p += 8;
+
+	for (n = 0; n < data->nr_items; n++) {
+		struct fp_print_data_item *item = &data->items[n];
+		struct fpi_geohash *hash;
+		guint32 nr_keys, i;
+
+		if (end - p < 8)
+			goto stale;
+		memcpy(&v, p, sizeof(v));
+		if (GUINT32_FROM_LE(v) != item_checksum(item))
+			goto stale;
+		memcpy(&v, p + 4, sizeof(v));
+		nr_keys = GUINT32_FROM_LE(v);
+		p += 8;
+		if ((gsize) (end - p) < nr_keys * sizeof(guint16))
+			goto stale;
+
+		hash = g_malloc(sizeof(*hash) + nr_keys * sizeof(guint16));
+		hash->nr_keys = nr_keys;
+		for (i = 0; i < nr_keys; i++, p += 2) {
+			guint16 k;
+			memcpy(&k, p, sizeof(k));
+			hash->keys[i] = GUINT16_FROM_LE(k);
+		}
+		fpi_geohash_free(item->geohash);
+		item->geohash = hash;
+	}
+
+	g_free(contents);
+	g_free(path);
+	return;
+
+stale:
+	fp_dbg("ignoring stale index %s", path);
+	g_free(contents);
+rebuild:
+	g_free(path);
+	fpi_img_index_print_data(data);
+}
+
+void fpi_geohash_delete(const char *print_path)
+{
+	char *path = sidecar_path(print_path);
+	g_unlink(path);
+	g_free(path);
+}
@@ -17,10 +17,17 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#include <config.h>
 #include <sys/types.h>
 #include <errno.h>
+#include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#ifdef HAVE_MLOCK
+#include <sys/mman.h>
+#endif
 
 #include <glib.h>
 
@@ -56,12 +63,149 @@ struct fp_img *fpi_img_new(size_t length)
 	return img;
 }
 
+/* Number of freed images a pool keeps for reuse */
+#define IMG_POOL_MAX_FREE 4
+
+/* Number of images a locked pool makes up front */
+#define IMG_POOL_PREALLOC 2
+
+/* Images of one size, kept when freed so that a fixed size device does not
+ * allocate a new image for every capture. The device holds a reference and
+ * so does every image taken from the pool, as images can outlive the
+ * device.
+ *
+ * With a real-time event thread, see fp_event_thread_set_realtime(), the
+ * images of a pool are locked in memory, page aligned so that unlocking one
+ * leaves the memory around it alone. */
+struct fpi_img_pool {
+	size_t length;
+	gint refcount;
+	GMutex lock;
+	GSList *free_imgs;
+	unsigned int num_free;
+	gboolean locked;
+};
+
+static struct fp_img *img_pool_alloc(struct fpi_img_pool *pool)
+{
+	size_t size = sizeof(struct fp_img) + pool->length;
+	void *mem;
+
+	if (!pool->locked)
+		return g_malloc0(size);
+
+	if (posix_memalign(&mem, sysconf(_SC_PAGESIZE), size) != 0)
+		g_error("failed to allocate %zu bytes", size);
+	/* faults every page in, whether locking works or not */
+	memset(mem, 0, size);
+#ifdef HAVE_MLOCK
+	if (mlock(mem, size) < 0)
+		fp_dbg("failed to lock image memory, errno=%d", errno);
+#endif
+	return mem;
+}
+
+static void img_pool_unlock(struct fpi_img_pool *pool, struct fp_img *img)
+{
+#ifdef HAVE_MLOCK
+	if (pool->locked)
+		munlock(img, sizeof(*img) + pool->length);
+#endif
+}
+
+static void img_pool_free(struct fpi_img_pool *pool, struct fp_img *img)
+{
+	if (!pool->locked) {
+		g_free(img);
+		return;
+	}
+	img_pool_unlock(pool, img);
+	free(img);
+}
+
+struct fpi_img_pool *fpi_img_pool_new(size_t length)
+{
+	struct fpi_img_pool *pool = g_malloc0(sizeof(*pool));
+	unsigned int i;
+
+	pool->length = length;
+	pool->refcount = 1;
+	g_mutex_init(&pool->lock);
+
+	if (fpi_get_event_thread_priority()) {
+		pool->locked = TRUE;
+		for (i = 0; i < IMG_POOL_PREALLOC; i++)
+			pool->free_imgs = g_slist_prepend(pool->free_imgs,
+				img_pool_alloc(pool));
+		pool->num_free = IMG_POOL_PREALLOC;
+	}
+	return pool;
+}
+
+void fpi_img_pool_unref(struct fpi_img_pool *pool)
+{
+	GSList *l;
+
+	if (!pool || !g_atomic_int_dec_and_test(&pool->refcount))
+		return;
+
+	for (l = pool->free_imgs; l; l = l->next)
+		img_pool_free(pool, l->data);
+	g_slist_free(pool->free_imgs);
+	g_mutex_clear(&pool->lock);
+	g_free(pool);
+}
+
+static struct fp_img *img_pool_get(struct fpi_img_pool *pool)
+{
+	struct fp_img *img = NULL;
+
+	g_mutex_lock(&pool->lock);
+	if (pool->free_imgs) {
+		img = pool->free_imgs->data;
+		pool->free_imgs = g_slist_delete_link(pool->free_imgs,
+						      pool->free_imgs);
+		pool->num_free--;
+	}
+	g_mutex_unlock(&pool->lock);
+
+	/* same state as a new image from fpi_img_new() */
+	if (img)
+		memset(img, 0, sizeof(*img) + pool->length);
+	else
+		img = img_pool_alloc(pool);
+	img->length = pool->length;
+	img->pool = pool;
+	g_atomic_int_inc(&pool->refcount);
+	return img;
+}
+
+static void img_pool_release(struct fpi_img_pool *pool, struct fp_img *img)
+{
+	g_mutex_lock(&pool->lock);
+	if (pool->num_free < IMG_POOL_MAX_FREE) {
+		pool->free_imgs = g_slist_prepend(pool->free_imgs, img);
+		pool->num_free++;
+		img = NULL;
+	}
+	g_mutex_unlock(&pool->lock);
+
+	if (img)
+		img_pool_free(pool, img);
+	fpi_img_pool_unref(pool);
+}
+
 struct fp_img *fpi_img_new_for_imgdev(struct fp_img_dev *imgdev)
 {
 	struct fp_img_driver *imgdrv = fpi_driver_to_img_driver(imgdev->dev->drv);
 	int width = imgdrv->img_width;
 	int height = imgdrv->img_height;
-	struct fp_img *img = fpi_img_new(width * height);
+	struct fp_img *img;
+
+	if (imgdev->img_pool && imgdev->img_pool->length == width * height)
+		img = img_pool_get(imgdev->img_pool);
+	else
+		img = fpi_img_new(width * height);
 	img->width = width;
 	img->height = height;
 	return img;
@@ -82,6 +226,12 @@ gboolean fpi_img_is_sane(struct fp_img *img)
 
 struct fp_img *fpi_img_resize(struct fp_img *img, size_t newsize)
 {
+	/* a resized image no longer fits its pool */
+	if (img->pool) {
+		img_pool_unlock(img->pool, img);
+		fpi_img_pool_unref(img->pool);
+		img->pool = NULL;
+	}
 	return g_realloc(img, sizeof(*img) + newsize);
 }
 
@@ -98,9 +248,14 @@ API_EXPORTED void fp_img_free(struct fp_img *img)
 
 	if (img->minutiae)
 		free_minutiae(img->minutiae);
-	if (img->binarized)
-		free(img->binarized);
-	g_free(img);
+	free(img->binarized);
+	free(img->direction_map);
+	free(img->quality_map);
+	free(img->xyt);
+	if (img->pool)
+		img_pool_release(img->pool, img);
+	else
+		g_free(img);
 }
 
 /**
@@ -181,51 +336,49 @@ API_EXPORTED int fp_img_save_to_file(struct fp_img *img, char *path)
 	return 0;
 }
 
-static void vflip(struct fp_img *img)
+/* Writes row b transformed into row a and row a transformed into row b, a
+ * and b can be the same row. Eight pixels are moved at a time as one word,
+ * byte swapping the word reverses them and xoring it inverts them. */
+static void standardize_rows(unsigned char *a, unsigned char *b, int width,
+			     gboolean reverse, gboolean invert)
 {
-	int width = img->width;
-	int data_len = img->width * img->height;
-	unsigned char rowbuf[width];
-	int i;
-
-	for (i = 0; i < img->height / 2; i++) {
-		int offset = i * width;
-		int swap_offset = data_len - (width * (i + 1));
+	guint64 mask = invert ? G_GUINT64_CONSTANT(0xffffffffffffffff) : 0;
+	unsigned char pixel_mask = invert ? 0xff : 0;
+	int block = sizeof(guint64);
+	int vector_end = width, end = width;
+	int i, j;
 
-		/* copy top row into buffer */
-		memcpy(rowbuf, img->data + offset, width);
+	if (reverse && a == b) {
+		/* stop in the middle, each pixel swaps with its mirror */
+		vector_end = width / 2;
+		end = (width + 1) / 2;
+	}
 
-		/* copy lower row over upper row */
-		memcpy(img->data + offset, img->data + swap_offset, width);
+	for (i = 0; i + block <= vector_end; i += block) {
+		guint64 wa, wb;
 
-		/* copy buffer over lower row */
-		memcpy(img->data + swap_offset, rowbuf, width);
+		j = reverse ? width - block - i : i;
+		memcpy(&wa, a + i, block);
+		memcpy(&wb, b + j, block);
+		if (reverse) {
+			wa = GUINT64_SWAP_LE_BE(wa);
+			wb = GUINT64_SWAP_LE_BE(wb);
+		}
+		wa ^= mask;
+		wb ^= mask;
+		memcpy(a + i, &wb, block);
+		memcpy(b + j, &wa, block);
 	}
-}
-
-static void hflip(struct fp_img *img)
-{
-	int width = img->width;
-	unsigned char rowbuf[width];
-	int i, j;
 
-	for (i = 0; i < img->height; i++) {
-		int offset = i * width;
+	for (; i < end; i++) {
+		unsigned char pixel = a[i];
 
-		memcpy(rowbuf, img->data + offset, width);
-		for (j = 0; j < width; j++)
-			img->data[offset + j] = rowbuf[width - j - 1];
+		j = reverse ? width - 1 - i : i;
+		a[i] = b[j] ^ pixel_mask;
+		b[j] = pixel ^ pixel_mask;
 	}
 }
 
-static void invert_colors(struct fp_img *img)
-{
-	int data_len = img->width * img->height;
-	int i;
-	for (i = 0; i < data_len; i++)
-		img->data[i] = 0xff - img->data[i];
-}
-
 /**
  * fp_img_standardize:
  * @img: the image to standardize
@@ -237,33 +390,45 @@ static void invert_colors(struct fp_img *img)
  */
 API_EXPORTED void fp_img_standardize(struct fp_img *img)
 {
-	if (img->flags & FP_IMG_V_FLIPPED) {
-		vflip(img);
-		img->flags &= ~FP_IMG_V_FLIPPED;
-	}
-	if (img->flags & FP_IMG_H_FLIPPED) {
-		hflip(img);
-		img->flags &= ~FP_IMG_H_FLIPPED;
-	}
-	if (img->flags & FP_IMG_COLORS_INVERTED) {
-		invert_colors(img);
-		img->flags &= ~FP_IMG_COLORS_INVERTED;
+	gboolean vflip = !!(img->flags & FP_IMG_V_FLIPPED);
+	gboolean hflip = !!(img->flags & FP_IMG_H_FLIPPED);
+	gboolean invert = !!(img->flags & FP_IMG_COLORS_INVERTED);
+	int rows, i;
+
+	if (!vflip && !hflip && !invert)
+		return;
+
+	/* all flags are undone in one pass, swapping a row with its mirror
+	 * when flipped vertically */
+	rows = vflip ? (img->height + 1) / 2 : img->height;
+	for (i = 0; i < rows; i++) {
+		unsigned char *row = img->data + i * img->width;
+		unsigned char *other = vflip ?
+			img->data + (img->height - 1 - i) * img->width : row;
+
+		standardize_rows(row, other, img->width, hflip, invert);
 	}
+
+	img->flags &= ~(FP_IMG_V_FLIPPED | FP_IMG_H_FLIPPED |
+			FP_IMG_COLORS_INVERTED);
 }
 
-/* Based on write_minutiae_XYTQ and bz_load */
-static void minutiae_to_xyt(struct fp_minutiae *minutiae, int bwidth,
-	int bheight, unsigned char *buf)
+/* Based on write_minutiae_XYTQ and bz_load: like bz_load, only the
+ * max_minutiae most reliable minutiae are kept, as the cost of a match grows
+ * with the square of their number. 0 keeps as many as bz_load does. */
+void fpi_img_minutiae_to_xyt(struct fp_minutiae *minutiae, int bwidth,
+	int bheight, int max_minutiae, unsigned char *buf)
 {
 	int i;
 	struct fp_minutia *minutia;
 	struct minutiae_struct c[MAX_FILE_MINUTIAE];
 	struct xyt_struct *xyt = (struct xyt_struct *) buf;
-
-	/* FIXME: only considers first 150 minutiae (MAX_FILE_MINUTIAE) */
-	/* nist does weird stuff with 150 vs 1000 limits */
 	int nmin = min(minutiae->num, MAX_FILE_MINUTIAE);
 
+	if (max_minutiae <= 0)
+		max_minutiae = DEFAULT_BOZORTH_MINUTIAE;
+	max_minutiae = min(max_minutiae, MAX_BOZORTH_MINUTIAE);
+
 	for (i = 0; i < nmin; i++){
 		minutia = minutiae->list[i];
 
@@ -275,6 +440,11 @@ static void minutiae_to_xyt(struct fp_minutiae *minutiae, int bwidth,
 			c[i].col[2] -= 360;
 	}
 
+	if (nmin > max_minutiae) {
+		qsort((void *) &c, (size_t) nmin, sizeof(struct minutiae_struct),
+				sort_quality_decreasing);
+		nmin = max_minutiae;
+	}
 	qsort((void *) &c, (size_t) nmin, sizeof(struct minutiae_struct),
 			sort_x_y);
 
@@ -286,7 +456,86 @@ static void minutiae_to_xyt(struct fp_minutiae *minutiae, int bwidth,
 	xyt->nrows = nmin;
 }
 
-int fpi_img_detect_minutiae(struct fp_img *img)
+/* Minutiae detection takes all of its scratch memory from an arena, which
+ * is emptied in one go once the results have been copied out. Arenas keep
+ * their memory between captures, and like matcher contexts they are pooled,
+ * one per concurrent detection. */
+static GMutex lfs_arena_pool_lock;
+static GSList *lfs_arena_pool = NULL;
+
+/* Stage timings summed over every extraction in the process. */
+static GMutex extract_stats_lock;
+static struct fp_extract_stats extract_stats;
+
+G_STATIC_ASSERT(LFS_NUM_STAGES == FP_EXTRACT_STAGE_XYT);
+
+static void add_extract_stats(uint64_t images, enum fp_extract_stage first,
+	enum fp_extract_stage last, const uint64_t *usecs)
+{
+	int i;
+
+	g_mutex_lock(&extract_stats_lock);
+	extract_stats.images += images;
+	for (i = first; i <= last; i++)
+		extract_stats.usecs[i] += usecs[i];
+	g_mutex_unlock(&extract_stats_lock);
+}
+
+/**
+ * fp_get_extract_stats:
+ * @stats: an output location for the statistics
+ *
+ * Get the time spent in each stage of minutiae extraction, summed over every
+ * image processed since libfprint was loaded or since the last call to
+ * fp_reset_extract_stats(). This can be polled at any time and from any
+ * thread, for example by a monitoring agent.
+ */
+API_EXPORTED void fp_get_extract_stats(struct fp_extract_stats *stats)
+{
+	g_mutex_lock(&extract_stats_lock);
+	*stats = extract_stats;
+	g_mutex_unlock(&extract_stats_lock);
+}
+
+/**
+ * fp_reset_extract_stats:
+ *
+ * Reset the statistics returned by fp_get_extract_stats() to zero.
+ */
+API_EXPORTED void fp_reset_extract_stats(void)
+{
+	g_mutex_lock(&extract_stats_lock);
+	memset(&extract_stats, 0, sizeof(extract_stats));
+	g_mutex_unlock(&extract_stats_lock);
+}
+
+static LFSARENA *lfs_arena_acquire(void)
+{
+	LFSARENA *arena = NULL;
+
+	g_mutex_lock(&lfs_arena_pool_lock);
+	if (lfs_arena_pool) {
+		arena = lfs_arena_pool->data;
+		lfs_arena_pool = g_slist_delete_link(lfs_arena_pool, lfs_arena_pool);
+	}
+	g_mutex_unlock(&lfs_arena_pool_lock);
+
+	if (!arena)
+		arena = lfs_arena_new();
+	if (!arena)
+		fp_err("could not allocate minutiae detection arena");
+	return arena;
+}
+
+static void lfs_arena_release(LFSARENA *arena)
+{
+	lfs_arena_reset(arena);
+	g_mutex_lock(&lfs_arena_pool_lock);
+	lfs_arena_pool = g_slist_prepend(lfs_arena_pool, arena);
+	g_mutex_unlock(&lfs_arena_pool_lock);
+}
+
+static int detect_minutiae(struct fp_img *img)
 {
 	struct fp_minutiae *minutiae;
 	int r;
@@ -295,7 +544,12 @@ int fpi_img_detect_minutiae(struct fp_img *img)
 	int map_w, map_h;
 	unsigned char *bdata;
 	int bw, bh, bd;
+	int i;
 	GTimer *timer;
+	LFSARENA *arena, *prev_arena;
+	/* per-call copy, so that several images can be processed at once */
+	LFSPARMS lfsparms = g_lfsparms_V2;
+	LFSSTATS lfsstats = { { 0 } };
 
 	if (img->flags & FP_IMG_STANDARDIZATION_FLAGS) {
 		fp_err("cant detect minutiae for non-standardized image");
@@ -303,39 +557,98 @@ int fpi_img_detect_minutiae(struct fp_img *img)
 	}
 
 	/* Remove perimeter points from partial image */
-	g_lfsparms_V2.remove_perimeter_pts = img->flags & FP_IMG_PARTIAL ? TRUE : FALSE;
+	lfsparms.remove_perimeter_pts = img->flags & FP_IMG_PARTIAL ? TRUE : FALSE;
+	lfsparms.num_threads = fpi_get_extract_threads();
+	lfsparms.stats = &lfsstats;
+
+	arena = lfs_arena_acquire();
+	if (!arena)
+		return -ENOMEM;
 
 	/* 25.4 mm per inch */
+	fpi_trace(extract_start, img, img->width, img->height);
 	timer = g_timer_new();
+	prev_arena = lfs_set_arena(arena);
 	r = get_minutiae(&minutiae, &quality_map, &direction_map,
                          &low_contrast_map, &low_flow_map, &high_curve_map,
                          &map_w, &map_h, &bdata, &bw, &bh, &bd,
                          img->data, img->width, img->height, 8,
-						 DEFAULT_PPI / (double)25.4, &g_lfsparms_V2);
+						 DEFAULT_PPI / (double)25.4, &lfsparms);
+	lfs_set_arena(prev_arena);
 	g_timer_stop(timer);
+	fpi_trace(extract_end, img, r,
+		(long) (g_timer_elapsed(timer, NULL) * G_USEC_PER_SEC));
 	fp_dbg("minutiae scan completed in %f secs", g_timer_elapsed(timer, NULL));
 	g_timer_destroy(timer);
 	if (r) {
 		fp_err("get minutiae failed, code %d", r);
+		lfs_arena_release(arena);
 		return r;
 	}
 	fp_dbg("detected %d minutiae", minutiae->num);
-	img->minutiae = minutiae;
-	img->binarized = bdata;
 
-	free(quality_map);
-	free(direction_map);
-	free(low_contrast_map);
-	free(low_flow_map);
-	free(high_curve_map);
-	return minutiae->num;
+	img->stats.images = 1;
+	for (i = 0; i < LFS_NUM_STAGES; i++)
+		img->stats.usecs[i] = lfsstats.usecs[i];
+	add_extract_stats(1, FP_EXTRACT_STAGE_SETUP, FP_EXTRACT_STAGE_QUALITY,
+		img->stats.usecs);
+
+	/* Only the minutiae, the binarized image and the direction and
+	 * quality maps outlive the arena; the other maps go away with it. */
+	r = copy_minutiae(&img->minutiae, minutiae);
+	if (r == 0) {
+		size_t map_size = map_w * map_h * sizeof(int);
+
+		img->binarized = malloc(bw * bh);
+		img->direction_map = malloc(map_size);
+		img->quality_map = malloc(map_size);
+		if (img->binarized && img->direction_map && img->quality_map) {
+			memcpy(img->binarized, bdata, bw * bh);
+			memcpy(img->direction_map, direction_map, map_size);
+			memcpy(img->quality_map, quality_map, map_size);
+			img->map_width = map_w;
+			img->map_height = map_h;
+		} else {
+			free_minutiae(img->minutiae);
+			img->minutiae = NULL;
+			free(img->binarized);
+			free(img->direction_map);
+			free(img->quality_map);
+			img->binarized = NULL;
+			img->direction_map = NULL;
+			img->quality_map = NULL;
+			r = -ENOMEM;
+		}
+	}
+	lfs_arena_release(arena);
+	if (r)
+		return r;
+	return img->minutiae->num;
+}
+
+/* Detects the minutiae of an image, unless that was already done: the
+ * getters of the image and fpi_img_to_print_data() share one detection. */
+int fpi_img_detect_minutiae(struct fp_img *img)
+{
+	int scope;
+	int r;
+
+	if (img->minutiae)
+		return img->minutiae->num;
+
+	scope = fpi_alloc_scope_push(FP_ALLOC_MINDTCT);
+	r = detect_minutiae(img);
+	fpi_alloc_scope_pop(scope);
+	return r;
 }
 
 int fpi_img_to_print_data(struct fp_img_dev *imgdev, struct fp_img *img,
 	struct fp_print_data **ret)
 {
+	struct fp_img_driver *imgdrv = fpi_driver_to_img_driver(imgdev->dev->drv);
 	struct fp_print_data *print;
 	struct fp_print_data_item *item;
+	gint64 start;
 	int r;
 
 	if (!img->minutiae) {
@@ -348,13 +661,29 @@ int fpi_img_to_print_data(struct fp_img_dev *imgdev, struct fp_img *img,
 		}
 	}
 
+	/* the sample is kept for the next print made from the image, such as
+	 * by fp_probe_new() for an image an operation returned */
+	if (!img->xyt || img->xyt_max_minutiae != imgdrv->max_minutiae) {
+		if (!img->xyt)
+			img->xyt = malloc(sizeof(struct xyt_struct));
+		if (!img->xyt)
+			return -ENOMEM;
+		start = g_get_monotonic_time();
+		fpi_img_minutiae_to_xyt(img->minutiae, img->width, img->height,
+			imgdrv->max_minutiae, img->xyt);
+		img->xyt_max_minutiae = imgdrv->max_minutiae;
+		img->stats.usecs[FP_EXTRACT_STAGE_XYT] =
+			g_get_monotonic_time() - start;
+		add_extract_stats(0, FP_EXTRACT_STAGE_XYT, FP_EXTRACT_STAGE_XYT,
+			img->stats.usecs);
+	}
+
 	/* FIXME: space is wasted if we dont hit the max minutiae count. would
 	 * be good to make this dynamic. */
 	print = fpi_print_data_new(imgdev->dev);
-	item = fpi_print_data_item_new(sizeof(struct xyt_struct));
+	item = fpi_print_data_add_item(print, sizeof(struct xyt_struct));
 	print->type = PRINT_DATA_NBIS_MINUTIAE;
-	minutiae_to_xyt(img->minutiae, img->width, img->height, item->data);
-	print->prints = g_slist_prepend(print->prints, item);
+	memcpy(item->data, img->xyt, sizeof(struct xyt_struct));
 
 	/* FIXME: the print buffer at this point is endian-specific, and will
 	 * only work when loaded onto machines with identical endianness. not good!
@@ -364,207 +693,1923 @@ int fpi_img_to_print_data(struct fp_img_dev *imgdev, struct fp_img *img,
 	return 0;
 }
 
-int fpi_img_compare_print_data(struct fp_print_data *enrolled_print,
-	struct fp_print_data *new_print)
+/* Bozorth3 matcher contexts hold several megabytes of working tables, so
+ * rather than allocating one per comparison they are kept around and
+ * recycled. Every thread running a match needs its own context.
+ *
+ * They are only allocated by the first match, and only the pages of the
+ * tables a match reaches are ever backed by memory. With bozorth_compact,
+ * contexts are freed after each match instead of recycled, which gives
+ * that memory back to the system at the price of faulting it in again on
+ * the next match. */
+static GMutex bz_ctx_pool_lock;
+static GSList *bz_ctx_pool = NULL;
+
+/* Everything between acquiring a matcher context and releasing it is
+ * accounted to Bozorth3, see fpi_alloc_scope_push() */
+static struct bz_ctx *bz_ctx_acquire(void)
 {
-	int score, max_score = 0, probe_len;
-	struct xyt_struct *pstruct = NULL;
-	struct xyt_struct *gstruct = NULL;
-	struct fp_print_data_item *data_item;
-	GSList *list_item;
+	struct bz_ctx *ctx = NULL;
+	int scope = fpi_alloc_scope_push(FP_ALLOC_BOZORTH3);
 
-	if (enrolled_print->type != PRINT_DATA_NBIS_MINUTIAE ||
-	     new_print->type != PRINT_DATA_NBIS_MINUTIAE) {
-		fp_err("invalid print format");
-		return -EINVAL;
+	g_mutex_lock(&bz_ctx_pool_lock);
+	if (bz_ctx_pool) {
+		ctx = bz_ctx_pool->data;
+		bz_ctx_pool = g_slist_delete_link(bz_ctx_pool, bz_ctx_pool);
 	}
+	g_mutex_unlock(&bz_ctx_pool_lock);
 
-	if (g_slist_length(new_print->prints) != 1) {
-		fp_err("new_print contains more than one sample, is it enrolled print?");
-		return -EINVAL;
+	if (!ctx)
+		ctx = bz_ctx_new();
+	if (!ctx) {
+		fp_err("could not allocate matcher context");
+		fpi_alloc_scope_pop(scope);
+		return NULL;
 	}
+	ctx->alloc_scope = scope;
+	return ctx;
+}
 
-	data_item = new_print->prints->data;
-	pstruct = (struct xyt_struct *)data_item->data;
-
-	probe_len = bozorth_probe_init(pstruct);
-	list_item = enrolled_print->prints;
-	do {
-		data_item = list_item->data;
-		gstruct = (struct xyt_struct *)data_item->data;
-		score = bozorth_to_gallery(probe_len, pstruct, gstruct);
-		fp_dbg("score %d", score);
-		max_score = max(score, max_score);
-		list_item = g_slist_next(list_item);
-	} while (list_item);
+static void bz_ctx_release(struct bz_ctx *ctx)
+{
+	int scope = ctx->alloc_scope;
+
+#ifdef ENABLE_BOZORTH_COMPACT
+	bz_ctx_free(ctx);
+#else
+	g_mutex_lock(&bz_ctx_pool_lock);
+	bz_ctx_pool = g_slist_prepend(bz_ctx_pool, ctx);
+	g_mutex_unlock(&bz_ctx_pool_lock);
+#endif
+	fpi_alloc_scope_pop(scope);
+}
 
-	return max_score;
+void fpi_img_exit(void)
+{
+	g_mutex_lock(&bz_ctx_pool_lock);
+	g_slist_free_full(bz_ctx_pool, (GDestroyNotify) bz_ctx_free);
+	bz_ctx_pool = NULL;
+	g_mutex_unlock(&bz_ctx_pool_lock);
+	bz_default_ctx_free();
+
+	g_mutex_lock(&lfs_arena_pool_lock);
+	g_slist_free_full(lfs_arena_pool, (GDestroyNotify) lfs_arena_free);
+	lfs_arena_pool = NULL;
+	g_mutex_unlock(&lfs_arena_pool_lock);
+
+	free_lfstables_cache();
+#ifdef HAVE_OPENCL
+	fpi_opencl_exit();
+#endif
 }
 
-int fpi_img_compare_print_data_to_gallery(struct fp_print_data *print,
-	struct fp_print_data **gallery, int match_threshold, size_t *match_offset)
-{
-	struct xyt_struct *pstruct;
-	struct xyt_struct *gstruct;
-	struct fp_print_data *gallery_print;
-	struct fp_print_data_item *data_item;
-	int probe_len;
-	size_t i = 0;
-	int r;
-	GSList *list_item;
+/* The edge tables built for a gallery print depend only on that print, so
+ * they are built the first time it is matched and cached alongside it.
+ * Workers may race to build the same tables; the loser frees its copy. */
+static struct bz_gallery *get_prepared_gallery(struct bz_ctx *ctx,
+	struct fp_print_data_item *item)
+{
+	struct bz_gallery *gallery = g_atomic_pointer_get(&item->bz_gallery);
 
-	if (g_slist_length(print->prints) != 1) {
-		fp_err("new_print contains more than one sample, is it enrolled print?");
-		return -EINVAL;
-	}
+	if (gallery)
+		return gallery;
 
-	data_item = print->prints->data;
-	pstruct = (struct xyt_struct *)data_item->data;
+	gallery = bozorth_gallery_prepare_ctx(ctx,
+		(struct xyt_struct *)item->data);
+	if (!gallery)
+		return NULL;
 
-	probe_len = bozorth_probe_init(pstruct);
-	while ((gallery_print = gallery[i++])) {
-		list_item = gallery_print->prints;
-		do {
-			data_item = list_item->data;
-			gstruct = (struct xyt_struct *)data_item->data;
-			r = bozorth_to_gallery(probe_len, pstruct, gstruct);
-			if (r >= match_threshold) {
-				*match_offset = i - 1;
-				return FP_VERIFY_MATCH;
-			}
-			list_item = g_slist_next(list_item);
-		} while (list_item);
+	if (!g_atomic_pointer_compare_and_exchange(&item->bz_gallery, NULL,
+			gallery)) {
+		bozorth_gallery_free(gallery);
+		gallery = g_atomic_pointer_get(&item->bz_gallery);
 	}
-	return FP_VERIFY_NO_MATCH;
+	return gallery;
 }
 
-/**
- * fp_img_binarize:
- * @img: a standardized image
- *
- * Get a binarized form of a standardized scanned image. This is where the
- * fingerprint image has been "enhanced" and is a set of pure black ridges
- * on a pure white background. Internally, image processing happens on top
- * of the binarized image.
- *
- * The image must have been [standardized](libfprint-Image-operations.html#img_std)
- * otherwise this function will fail.
- *
- * It is safe to binarize an image and free the original while continuing
- * to use the binarized version.
- *
- * You cannot binarize an image twice.
- *
- * Returns: a new image representing the binarized form of the original, or
- * %NULL on error. Must be freed with fp_img_free() after use.
- */
-API_EXPORTED struct fp_img *fp_img_binarize(struct fp_img *img)
+static struct fpi_geohash *get_geohash(struct bz_ctx *ctx,
+	struct fp_print_data_item *item)
 {
-	struct fp_img *ret;
-	int height = img->height;
-	int width = img->width;
-	int imgsize = height * width;
+	struct fpi_geohash *hash = g_atomic_pointer_get(&item->geohash);
+	struct bz_gallery *gallery;
 
-	if (img->flags & FP_IMG_BINARIZED_FORM) {
-		fp_err("image already binarized");
+	if (hash)
+		return hash;
+
+	gallery = get_prepared_gallery(ctx, item);
+	if (!gallery)
 		return NULL;
+
+	hash = fpi_geohash_new(gallery);
+	if (!g_atomic_pointer_compare_and_exchange(&item->geohash, NULL, hash)) {
+		fpi_geohash_free(hash);
+		hash = g_atomic_pointer_get(&item->geohash);
 	}
+	return hash;
+}
 
-	if (!img->binarized) {
-		int r = fpi_img_detect_minutiae(img);
-		if (r < 0)
-			return NULL;
-		if (!img->binarized) {
-			fp_err("no minutiae after successful detection?");
-			return NULL;
-		}
+static struct fpi_prematch_desc *get_prematch_desc(
+	struct fp_print_data_item *item)
+{
+	struct fpi_prematch_desc *desc = g_atomic_pointer_get(&item->prematch);
+
+	if (desc)
+		return desc;
+
+	desc = fpi_prematch_desc_new((struct xyt_struct *) item->data);
+	if (!g_atomic_pointer_compare_and_exchange(&item->prematch, NULL,
+			desc)) {
+		fpi_prematch_desc_free(desc);
+		desc = g_atomic_pointer_get(&item->prematch);
 	}
+	return desc;
+}
 
-	ret = fpi_img_new(imgsize);
-	ret->flags |= FP_IMG_BINARIZED_FORM;
-	ret->width = width;
-	ret->height = height;
-	memcpy(ret->data, img->binarized, imgsize);
-	return ret;
+void fpi_img_print_data_item_release(struct fp_print_data_item *item)
+{
+#ifdef HAVE_OPENCL
+	if (item->bz_gallery)
+		fpi_opencl_table_freed(item->bz_gallery);
+#endif
+	bozorth_gallery_free(item->bz_gallery);
+	item->bz_gallery = NULL;
+	fpi_geohash_free(item->geohash);
+	item->geohash = NULL;
+	fpi_prematch_desc_free(item->prematch);
+	item->prematch = NULL;
 }
 
-/**
- * fp_img_get_minutiae:
- * @img: a standardized image
- * @nr_minutiae: an output location to store minutiae list length
- *
- * Get a list of minutiae detected in an image. A minutia point is a feature
- * detected on a fingerprint, typically where ridges end or split.
- * libfprint's image processing code relies upon comparing sets of minutiae,
- * so accurate placement of minutia points is critical for good imaging
- * performance.
- *
- * The image must have been [standardized](libfprint-Image-operations.html#img_std)
- * otherwise this function will fail.
- *
- * You cannot pass a binarized image to this function. Instead, pass the
- * original image.
- *
- * Returns a list of pointers to minutiae, where the list is of length
- * indicated in the nr_minutiae output parameter. The returned list is only
- * valid while the parent image has not been freed, and the minutiae data
- * must not be modified or freed.
- *
- * Returns: a list of minutiae points. Must not be modified or freed.
- */
-API_EXPORTED struct fp_minutia **fp_img_get_minutiae(struct fp_img *img,
-	int *nr_minutiae)
+/* Makes sure every sample of an NBIS print carries its candidate index
+ * signature. */
+int fpi_img_index_print_data(struct fp_print_data *data)
 {
-	if (img->flags & FP_IMG_BINARIZED_FORM) {
-		fp_err("image is binarized");
-		return NULL;
-	}
+	struct bz_ctx *ctx;
+	unsigned int i;
+	int r = 0;
 
-	if (!img->minutiae) {
-		int r = fpi_img_detect_minutiae(img);
-		if (r < 0)
-			return NULL;
-		if (!img->minutiae) {
-			fp_err("no minutiae after successful detection?");
-			return NULL;
+	if (data->type != PRINT_DATA_NBIS_MINUTIAE)
+		return 0;
+
+	ctx = bz_ctx_acquire();
+	if (!ctx)
+		return -ENOMEM;
+
+	for (i = 0; i < data->nr_items; i++)
+		if (!get_geohash(ctx, &data->items[i])) {
+			r = -ENOMEM;
+			break;
+		}
+
+	bz_ctx_release(ctx);
+	return r;
+}
+
+/* Builds the edge tables and pre-match descriptor of every sample of an
+ * NBIS print ahead of its first match. */
+int fpi_img_prepare_print_data(struct fp_print_data *data)
+{
+	struct bz_ctx *ctx;
+	unsigned int i;
+	int r = 0;
+
+	if (data->type != PRINT_DATA_NBIS_MINUTIAE)
+		return 0;
+
+	ctx = bz_ctx_acquire();
+	if (!ctx)
+		return -ENOMEM;
+
+	for (i = 0; i < data->nr_items; i++) {
+		if (!get_prepared_gallery(ctx, &data->items[i])) {
+			r = -ENOMEM;
+			break;
 		}
+		get_prematch_desc(&data->items[i]);
 	}
 
-	*nr_minutiae = img->minutiae->num;
-	return img->minutiae->list;
+	bz_ctx_release(ctx);
+	return r;
 }
 
-/* Calculate squared standand deviation */
-int fpi_std_sq_dev(const unsigned char *buf, int size)
+/* With a positive threshold, the score is only exact enough to tell whether
+ * it reaches the threshold; see bz_match_score_bounded(). */
+static int compare_to_print_data_item(struct bz_ctx *ctx,
+	const struct bz_gallery *probe, struct fp_print_data_item *item,
+	int threshold)
 {
-	int res = 0, mean = 0, i;
+	struct bz_gallery *gallery = get_prepared_gallery(ctx, item);
+	int score;
+
+	/* if the tables could not be cached, build them in the context */
+	if (!gallery)
+		score = bozorth_prepared_to_gallery_bounded_ctx(ctx, probe,
+			(struct xyt_struct *)item->data, threshold);
+	else
+		score = bozorth_prepared_to_prepared_gallery_bounded_ctx(ctx,
+			probe, gallery, threshold);
+
+	fpi_trace(compare, item, probe->gstruct->nrows,
+		((struct xyt_struct *)item->data)->nrows, score);
+	return score;
+}
 
-	if (size > (INT_MAX / 65536)) {
-		fp_err("%s: we might get an overflow!", __func__);
-		return -EOVERFLOW;
+/* A captured print with its matcher tables, built once however many
+ * prints and galleries it is compared to. */
+struct fp_probe {
+	struct fp_print_data *print;
+	gboolean own_print;
+	struct bz_gallery *table;
+	/* candidate index signature, built on first identification */
+	struct fpi_geohash_probe *geohash;
+	/* pre-match descriptor, built on first identification */
+	struct fpi_prematch_desc *prematch;
+	/* for the public functions, see fp_probe_new() */
+	int match_threshold;
+};
+
+static gboolean probe_print_valid(struct fp_print_data *print)
+{
+	if (print->type != PRINT_DATA_NBIS_MINUTIAE) {
+		fp_err("invalid print format");
+		return FALSE;
 	}
+	if (print->nr_items != 1) {
+		fp_err("new_print contains more than one sample, is it enrolled print?");
+		return FALSE;
+	}
+	return TRUE;
+}
 
-	for (i = 0; i < size; i++)
-		mean += buf[i];
+/* Prepares a probe for a single sample NBIS print, which must outlive it.
+ * Returns NULL if out of memory. */
+struct fp_probe *fpi_probe_new(struct fp_print_data *print)
+{
+	struct fp_probe *probe;
+	struct bz_ctx *ctx;
 
-	mean /= size;
+	ctx = bz_ctx_acquire();
+	if (!ctx)
+		return NULL;
 
-	for (i = 0; i < size; i++) {
-		int dev = (int)buf[i] - mean;
-		res += dev*dev;
+	probe = g_malloc0(sizeof(*probe));
+	probe->print = print;
+	probe->table = bozorth_probe_prepare_ctx(ctx,
+		(struct xyt_struct *) print->items[0].data);
+	bz_ctx_release(ctx);
+	if (!probe->table) {
+		g_free(probe);
+		return NULL;
 	}
+	return probe;
+}
 
-	return res / size;
+void fpi_probe_free(struct fp_probe *probe)
+{
+	if (!probe)
+		return;
+
+	bozorth_gallery_free(probe->table);
+	fpi_geohash_probe_free(probe->geohash);
+	fpi_prematch_desc_free(probe->prematch);
+	if (probe->own_print)
+		fp_print_data_free(probe->print);
+	g_free(probe);
 }
 
-/* Calculate normalized mean square difference of two lines */
-int fpi_mean_sq_diff_norm(unsigned char *buf1, unsigned char *buf2, int size)
+static struct fpi_geohash_probe *get_probe_geohash(struct fp_probe *probe)
 {
-	int res = 0, i;
-	for (i = 0; i < size; i++) {
-		int dev = (int)buf1[i] - (int)buf2[i];
-		res += dev * dev;
-	}
+	struct fpi_geohash_probe *geohash = g_atomic_pointer_get(&probe->geohash);
+
+	if (geohash)
+		return geohash;
+
+	geohash = fpi_geohash_probe_new(probe->table);
+	if (!g_atomic_pointer_compare_and_exchange(&probe->geohash, NULL,
+			geohash)) {
+		fpi_geohash_probe_free(geohash);
+		geohash = g_atomic_pointer_get(&probe->geohash);
+	}
+	return geohash;
+}
+
+static struct fpi_prematch_desc *get_probe_prematch_desc(
+	struct fp_probe *probe)
+{
+	struct fpi_prematch_desc *desc = g_atomic_pointer_get(&probe->prematch);
+
+	if (desc)
+		return desc;
+
+	desc = fpi_prematch_desc_new(
+		(struct xyt_struct *) probe->print->items[0].data);
+	if (!g_atomic_pointer_compare_and_exchange(&probe->prematch, NULL,
+			desc)) {
+		fpi_prematch_desc_free(desc);
+		desc = g_atomic_pointer_get(&probe->prematch);
+	}
+	return desc;
+}
+
+/* Whether enrolled sample a is more likely to match than b: it matched more
+ * often so far, or as often but has more minutiae. */
+static gboolean sample_is_likelier(struct fp_print_data_item *a,
+	struct fp_print_data_item *b)
+{
+	gint ha = g_atomic_int_get(&a->hits);
+	gint hb = g_atomic_int_get(&b->hits);
+
+	if (ha != hb)
+		return ha > hb;
+	return ((struct xyt_struct *) a->data)->nrows >
+		((struct xyt_struct *) b->data)->nrows;
+}
+
+/* Fills samples with the samples of print, likeliest first. There are only a
+ * handful, so a stable insertion sort keeps equally likely samples in their
+ * stored order. */
+static guint get_sample_order(struct fp_print_data *print,
+	struct fp_print_data_item **samples)
+{
+	guint n;
+
+	for (n = 0; n < print->nr_items; n++) {
+		struct fp_print_data_item *item = &print->items[n];
+		guint i = n;
+
+		while (i > 0 && sample_is_likelier(item, samples[i - 1])) {
+			samples[i] = samples[i - 1];
+			i--;
+		}
+		samples[i] = item;
+	}
+	return n;
+}
+
+/* Returns the best score of new_print against the samples of
+ * enrolled_print, trying the likeliest samples first. If match_threshold
+ * is positive, scoring stops at the first sample that reaches it, and the
+ * result is only meaningful compared to it; pass 0 for the full score. */
+int fpi_img_compare_print_data(struct fp_print_data *enrolled_print,
+	struct fp_print_data *new_print, int match_threshold)
+{
+	struct fp_probe *probe;
+	int r;
+
+	if (!probe_print_valid(new_print))
+		return -EINVAL;
+
+	probe = fpi_probe_new(new_print);
+	if (!probe)
+		return -ENOMEM;
+	r = fpi_img_compare_probe(enrolled_print, probe, match_threshold);
+	fpi_probe_free(probe);
+	return r;
+}
+
+/* As fpi_img_compare_print_data(), with a prepared probe. */
+int fpi_img_compare_probe(struct fp_print_data *enrolled_print,
+	struct fp_probe *probe, int match_threshold)
+{
+	int score, max_score = 0;
+	struct fp_print_data_item **samples;
+	struct bz_ctx *ctx;
+	guint i, nr_samples;
+
+	if (enrolled_print->type != PRINT_DATA_NBIS_MINUTIAE) {
+		fp_err("invalid print format");
+		return -EINVAL;
+	}
+
+	samples = g_alloca(enrolled_print->nr_items * sizeof(*samples));
+	nr_samples = get_sample_order(enrolled_print, samples);
+
+	ctx = bz_ctx_acquire();
+	if (!ctx)
+		return -ENOMEM;
+
+	for (i = 0; i < nr_samples; i++) {
+		score = compare_to_print_data_item(ctx, probe->table,
+			samples[i], match_threshold);
+		fp_dbg("score %d", score);
+		max_score = max(score, max_score);
+		if (match_threshold > 0 && score >= match_threshold) {
+			g_atomic_int_inc(&samples[i]->hits);
+			break;
+		}
+	}
+
+	bz_ctx_release(ctx);
+	return max_score;
+}
+
+/* Enrollment consolidation: the stage samples that match each other are
+ * aligned onto the one matching most of them, and merged into a single
+ * template. A verification then runs Bozorth3 once per template rather than
+ * once per stage. Samples matching none of the others are kept as they are,
+ * so nothing the separate samples would have matched is lost. */
+
+#define CONSOLIDATE_MAX_TEMPLATES 2
+/* bins of the alignment votes, in degrees and pixels */
+#define ALIGN_ANGLE_BIN 10
+#define ALIGN_SHIFT_BIN 16
+#define ALIGN_MIN_VOTES 3
+/* how close aligned minutiae must be to be taken for the same one */
+#define MERGE_DISTANCE 12
+#define MERGE_ANGLE 20
+
+struct xyt_transform {
+	int rotation;
+	double cos, sin;
+	double dx, dy;
+};
+
+struct merged_minutia {
+	double x, y;
+	int theta;
+	int support;
+	int last_sample;
+	gboolean base;
+};
+
+static int angle_diff(int a, int b)
+{
+	int d = (a - b) % 360;
+
+	if (d > 180)
+		d -= 360;
+	else if (d <= -180)
+		d += 360;
+	return d;
+}
+
+static void xyt_transform_set_rotation(struct xyt_transform *t, int rotation)
+{
+	t->rotation = rotation;
+	t->cos = cos(rotation * G_PI / 180);
+	t->sin = sin(rotation * G_PI / 180);
+}
+
+/* The rotation and shift that superimpose minutia i of from onto minutia j
+ * of to, and the bin it votes for. */
+static guint xyt_pair_vote(const struct xyt_struct *from, int i,
+	const struct xyt_struct *to, int j, struct xyt_transform *t)
+{
+	int x = from->xcol[i], y = from->ycol[i];
+	guint rbin, xbin, ybin;
+
+	xyt_transform_set_rotation(t, angle_diff(to->thetacol[j],
+		from->thetacol[i]));
+	t->dx = to->xcol[j] - (x * t->cos - y * t->sin);
+	t->dy = to->ycol[j] - (x * t->sin + y * t->cos);
+
+	rbin = (t->rotation + 180) % 360 / ALIGN_ANGLE_BIN;
+	xbin = CLAMP((int) floor(t->dx / ALIGN_SHIFT_BIN) + 512, 0, 1023);
+	ybin = CLAMP((int) floor(t->dy / ALIGN_SHIFT_BIN) + 512, 0, 1023);
+	return rbin << 20 | xbin << 10 | ybin;
+}
+
+/* Finds the transform mapping most minutiae of from onto those of to: each
+ * pair of minutiae votes for the transform superimposing them, and the
+ * votes of the winning bin are averaged. */
+static gboolean xyt_align(const struct xyt_struct *from,
+	const struct xyt_struct *to, struct xyt_transform *t)
+{
+	GHashTable *votes = g_hash_table_new(g_direct_hash, g_direct_equal);
+	struct xyt_transform pair;
+	guint best = 0, best_votes = 0;
+	int i, j, rotation = 0, ref = 0;
+	double dx = 0, dy = 0;
+
+	for (i = 0; i < from->nrows; i++)
+		for (j = 0; j < to->nrows; j++) {
+			guint key = xyt_pair_vote(from, i, to, j, &pair);
+			guint n = GPOINTER_TO_UINT(g_hash_table_lookup(votes,
+				GUINT_TO_POINTER(key))) + 1;
+
+			g_hash_table_insert(votes, GUINT_TO_POINTER(key),
+				GUINT_TO_POINTER(n));
+			if (n > best_votes) {
+				best_votes = n;
+				best = key;
+			}
+		}
+	g_hash_table_destroy(votes);
+	if (best_votes < ALIGN_MIN_VOTES)
+		return FALSE;
+
+	/* rotations are averaged around the bin, which may wrap at 180 */
+	ref = (best >> 20) * ALIGN_ANGLE_BIN + ALIGN_ANGLE_BIN / 2 - 180;
+	for (i = 0; i < from->nrows; i++)
+		for (j = 0; j < to->nrows; j++) {
+			if (xyt_pair_vote(from, i, to, j, &pair) != best)
+				continue;
+			rotation += angle_diff(pair.rotation, ref);
+			dx += pair.dx;
+			dy += pair.dy;
+		}
+
+	xyt_transform_set_rotation(t, angle_diff(ref + rotation / (int) best_votes,
+		0));
+	t->dx = dx / best_votes;
+	t->dy = dy / best_votes;
+	return TRUE;
+}
+
+static int merged_find(struct merged_minutia *merged, int nr_merged,
+	double x, double y, int theta)
+{
+	double best_dist = MERGE_DISTANCE * MERGE_DISTANCE;
+	int i, best = -1;
+
+	for (i = 0; i < nr_merged; i++) {
+		double dist = (merged[i].x - x) * (merged[i].x - x)
+			+ (merged[i].y - y) * (merged[i].y - y);
+
+		if (dist <= best_dist
+				&& ABS(angle_diff(merged[i].theta, theta)) <= MERGE_ANGLE) {
+			best_dist = dist;
+			best = i;
+		}
+	}
+	return best;
+}
+
+/* Merges the samples of a cluster into out, in the frame of the first one.
+ * Minutiae found on several samples are kept, with their positions
+ * averaged, as are the remaining ones of the first sample, which the
+ * others may have missed; minutiae seen once outside of it are dropped. */
+static void consolidate_samples(struct xyt_struct **samples, int nr_samples,
+	struct xyt_struct *out)
+{
+	struct xyt_struct *base = samples[0];
+	struct merged_minutia *merged;
+	struct minutiae_struct *kept;
+	int nr_merged = 0, nr_kept = 0;
+	int i, k;
+
+	merged = g_new(struct merged_minutia,
+		MAX_BOZORTH_MINUTIAE * nr_samples);
+	for (i = 0; i < base->nrows; i++) {
+		merged[nr_merged].x = base->xcol[i];
+		merged[nr_merged].y = base->ycol[i];
+		merged[nr_merged].theta = base->thetacol[i];
+		merged[nr_merged].support = 1;
+		merged[nr_merged].last_sample = 0;
+		merged[nr_merged++].base = TRUE;
+	}
+
+	for (k = 1; k < nr_samples; k++) {
+		struct xyt_struct *sample = samples[k];
+		struct xyt_transform t;
+
+		if (!xyt_align(sample, base, &t)) {
+			fp_dbg("could not align sample %d", k);
+			continue;
+		}
+		fp_dbg("sample %d aligned with rotation %d, shift %.1f,%.1f", k,
+			t.rotation, t.dx, t.dy);
+
+		for (i = 0; i < sample->nrows; i++) {
+			int x0 = sample->xcol[i], y0 = sample->ycol[i];
+			double x = x0 * t.cos - y0 * t.sin + t.dx;
+			double y = x0 * t.sin + y0 * t.cos + t.dy;
+			int theta = angle_diff(sample->thetacol[i] + t.rotation, 0);
+			int m = merged_find(merged, nr_merged, x, y, theta);
+
+			if (m >= 0 && merged[m].last_sample != k) {
+				struct merged_minutia *mm = &merged[m];
+
+				mm->x += (x - mm->x) / (mm->support + 1);
+				mm->y += (y - mm->y) / (mm->support + 1);
+				mm->support++;
+				mm->last_sample = k;
+			} else if (m < 0) {
+				merged[nr_merged].x = x;
+				merged[nr_merged].y = y;
+				merged[nr_merged].theta = theta;
+				merged[nr_merged].support = 1;
+				merged[nr_merged].last_sample = k;
+				merged[nr_merged++].base = FALSE;
+			}
+		}
+	}
+
+	/* best supported first, in order of appearance among equals */
+	kept = g_new(struct minutiae_struct, nr_merged);
+	for (i = 0; i < nr_merged; i++) {
+		if (merged[i].support < 2 && !merged[i].base)
+			continue;
+		kept[nr_kept].col[0] = sround(merged[i].x);
+		kept[nr_kept].col[1] = sround(merged[i].y);
+		kept[nr_kept].col[2] = merged[i].theta;
+		kept[nr_kept++].col[3] = merged[i].support * 1024
+			+ 1023 - MIN(i, 1023);
+	}
+	qsort(kept, nr_kept, sizeof(*kept), sort_quality_decreasing);
+	nr_kept = MIN(nr_kept, MAX_BOZORTH_MINUTIAE);
+	qsort(kept, nr_kept, sizeof(*kept), sort_x_y);
+
+	for (i = 0; i < nr_kept; i++) {
+		out->xcol[i] = kept[i].col[0];
+		out->ycol[i] = kept[i].col[1];
+		out->thetacol[i] = kept[i].col[2];
+	}
+	out->nrows = nr_kept;
+	fp_dbg("merged %d samples into %d minutiae", nr_samples, nr_kept);
+
+	g_free(kept);
+	g_free(merged);
+}
+
+/* Consolidates the samples of enrolled, followed by the one of last, into a
+ * new print of at most CONSOLIDATE_MAX_TEMPLATES templates plus the samples
+ * which matched no other. Returns NULL if no two samples match, leaving
+ * nothing to merge. */
+struct fp_print_data *fpi_img_consolidate_print_data(struct fp_dev *dev,
+	struct fp_print_data *enrolled, struct fp_print_data *last,
+	int match_threshold)
+{
+	struct fp_print_data *print = NULL;
+	struct xyt_struct **samples, **cluster;
+	struct bz_ctx *ctx;
+	gboolean *used;
+	int *scores;
+	int nr_samples, nr_templates = 0;
+	int i, j;
+
+	if ((enrolled && enrolled->type != PRINT_DATA_NBIS_MINUTIAE)
+			|| last->type != PRINT_DATA_NBIS_MINUTIAE)
+		return NULL;
+
+	nr_samples = (enrolled ? enrolled->nr_items : 0) + last->nr_items;
+	if (nr_samples < 2)
+		return NULL;
+	samples = g_new(struct xyt_struct *, nr_samples);
+	for (i = 0; enrolled && i < (int) enrolled->nr_items; i++)
+		samples[i] = (struct xyt_struct *) enrolled->items[i].data;
+	for (j = 0; j < (int) last->nr_items; j++)
+		samples[i + j] = (struct xyt_struct *) last->items[j].data;
+
+	ctx = bz_ctx_acquire();
+	if (!ctx) {
+		g_free(samples);
+		return NULL;
+	}
+
+	/* a handful of samples, so every pair is scored once */
+	scores = g_new0(int, nr_samples * nr_samples);
+	for (i = 0; i < nr_samples; i++) {
+		int probe_len = bozorth_probe_init_ctx(ctx, samples[i]);
+
+		for (j = i + 1; j < nr_samples; j++) {
+			int score = bozorth_to_gallery_ctx(ctx, probe_len,
+				samples[i], samples[j]);
+
+			scores[i * nr_samples + j] = score;
+			scores[j * nr_samples + i] = score;
+		}
+	}
+	bz_ctx_release(ctx);
+
+	used = g_new0(gboolean, nr_samples);
+	cluster = g_new(struct xyt_struct *, nr_samples);
+	while (nr_templates < CONSOLIDATE_MAX_TEMPLATES) {
+		int best = -1, best_matches = 0, best_sum = 0;
+		int nr_cluster = 0;
+
+		/* the sample matching most of the remaining ones */
+		for (i = 0; i < nr_samples; i++) {
+			int matches = 0, sum = 0;
+
+			if (used[i])
+				continue;
+			for (j = 0; j < nr_samples; j++) {
+				int score = scores[i * nr_samples + j];
+
+				if (j == i || used[j] || score < match_threshold)
+					continue;
+				matches++;
+				sum += score;
+			}
+			if (matches > best_matches
+					|| (matches == best_matches && sum > best_sum)) {
+				best = i;
+				best_matches = matches;
+				best_sum = sum;
+			}
+		}
+		if (best_matches == 0)
+			break;
+
+		cluster[nr_cluster++] = samples[best];
+		used[best] = TRUE;
+		for (j = 0; j < nr_samples; j++)
+			if (!used[j]
+					&& scores[best * nr_samples + j] >= match_threshold) {
+				cluster[nr_cluster++] = samples[j];
+				used[j] = TRUE;
+			}
+
+		if (!print) {
+			print = fpi_print_data_new(dev);
+			print->type = PRINT_DATA_NBIS_MINUTIAE;
+		}
+		consolidate_samples(cluster, nr_cluster, (struct xyt_struct *)
+			fpi_print_data_add_item(print,
+				sizeof(struct xyt_struct))->data);
+		nr_templates++;
+	}
+
+	/* the outliers stay separate samples */
+	for (i = 0; print && i < nr_samples; i++)
+		if (!used[i])
+			memcpy(fpi_print_data_add_item(print,
+				sizeof(struct xyt_struct))->data, samples[i],
+				sizeof(struct xyt_struct));
+
+	if (print)
+		fp_dbg("consolidated %d samples into %u", nr_samples,
+			print->nr_items);
+
+	g_free(cluster);
+	g_free(used);
+	g_free(scores);
+	g_free(samples);
+	return print;
+}
+
+/* State shared by the threads of one gallery identification. Gallery
+ * offsets are handed out in increasing order; match holds the lowest
+ * offset found to match so far (or gallery_len), so that the reported
+ * offset is the same one a sequential scan would have found.
+ *
+ * In top-K mode (k > 0) the whole gallery is scanned instead, and the k
+ * best candidates seen so far are kept in topk as a min-heap: its root is
+ * the weakest candidate kept, i.e. the one the next better score evicts. */
+struct identify_job {
+	struct fp_probe *probe;
+	struct fp_print_data **gallery;
+	gint gallery_len;
+	int match_threshold;
+	gint next;
+	gint match;
+	gint error;
+	/* if the candidate index is used, the gallery offsets to scan in
+	 * order; next and match are then positions in this array */
+	gint *order;
+
+	/* pre-match stage, see fp_set_prematch(), and what it did */
+	enum fp_prematch prematch;
+	int prematch_cutoff;
+	unsigned int audit_interval;
+	gint candidates;
+	gint pruned;
+	gint audited;
+	gint audit_matches;
+
+	size_t k;
+	struct fp_identify_match *topk;
+	size_t topk_len;
+	GMutex topk_lock;
+
+	/* limits of the scan, or NULL, and whether it ran into them */
+	struct fpi_identify_ctl *ctl;
+	gint out_of_budget;
+};
+
+static void identify_job_report_match(struct identify_job *job, gint offset)
+{
+	gint cur;
+
+	do {
+		cur = g_atomic_int_get(&job->match);
+		if (offset >= cur)
+			return;
+	} while (!g_atomic_int_compare_and_exchange(&job->match, cur, offset));
+}
+
+/* Orders candidates by score, preferring the lower gallery offset when two
+ * scores are equal, so that the result does not depend on thread timing. */
+static gboolean topk_is_weaker(const struct fp_identify_match *a,
+	const struct fp_identify_match *b)
+{
+	if (a->score != b->score)
+		return a->score < b->score;
+	return a->offset > b->offset;
+}
+
+static void topk_sift_down(struct fp_identify_match *heap, size_t len,
+	size_t i)
+{
+	while (TRUE) {
+		size_t weakest = i;
+		size_t l = 2 * i + 1;
+		size_t r = l + 1;
+		struct fp_identify_match tmp;
+
+		if (l < len && topk_is_weaker(&heap[l], &heap[weakest]))
+			weakest = l;
+		if (r < len && topk_is_weaker(&heap[r], &heap[weakest]))
+			weakest = r;
+		if (weakest == i)
+			return;
+
+		tmp = heap[i];
+		heap[i] = heap[weakest];
+		heap[weakest] = tmp;
+		i = weakest;
+	}
+}
+
+static void identify_job_report_score(struct identify_job *job, gint offset,
+	int score)
+{
+	struct fp_identify_match m = { offset, score };
+	struct fp_identify_match *heap = job->topk;
+	size_t i;
+
+	g_mutex_lock(&job->topk_lock);
+	if (job->topk_len < job->k) {
+		/* heap not full yet: append and sift up */
+		i = job->topk_len++;
+		while (i > 0 && topk_is_weaker(&m, &heap[(i - 1) / 2])) {
+			heap[i] = heap[(i - 1) / 2];
+			i = (i - 1) / 2;
+		}
+		heap[i] = m;
+	} else if (topk_is_weaker(&heap[0], &m)) {
+		heap[0] = m;
+		topk_sift_down(heap, job->topk_len, 0);
+	}
+	g_mutex_unlock(&job->topk_lock);
+}
+
+static int topk_cmp(const void *a, const void *b)
+{
+	const struct fp_identify_match *ma = a;
+	const struct fp_identify_match *mb = b;
+
+	if (topk_is_weaker(ma, mb))
+		return 1;
+	if (topk_is_weaker(mb, ma))
+		return -1;
+	return 0;
+}
+
+/* Scores a gallery print from 0 to 100 with the pre-match descriptors of
+ * its best scoring sample. Samples whose descriptor can not be built get
+ * the best possible score, so they are never pruned. */
+static int identify_job_prematch_score(struct identify_job *job,
+	struct bz_ctx *ctx, struct fp_print_data *print)
+{
+	int best = 0;
+	unsigned int n;
+
+	for (n = 0; n < print->nr_items && best < 100; n++) {
+		struct fp_print_data_item *item = &print->items[n];
+		int score = 100;
+
+		if (job->prematch == FP_PREMATCH_PAIRS) {
+			struct fpi_geohash *hash = get_geohash(ctx, item);
+
+			if (hash)
+				score = fpi_geohash_vote(
+					get_probe_geohash(job->probe), hash)
+					* 100 / 1024;
+		} else {
+			score = fpi_prematch_desc_score(
+				get_probe_prematch_desc(job->probe),
+				get_prematch_desc(item));
+		}
+		best = max(score, best);
+	}
+	return best;
+}
+
+/* Counts a pruned print, and returns whether it is to be audited, i.e.
+ * matched in full anyway. */
+static gboolean identify_job_prune(struct identify_job *job)
+{
+	gint pruned = g_atomic_int_add(&job->pruned, 1) + 1;
+
+	if (job->audit_interval == 0 || pruned % job->audit_interval != 0)
+		return FALSE;
+	g_atomic_int_inc(&job->audited);
+	return TRUE;
+}
+
+static gboolean identify_job_cancelled(struct identify_job *job)
+{
+	return job->ctl && g_atomic_int_get(&job->ctl->cancelled);
+}
+
+/* Whether the print at position i is out of the limits of the scan. The
+ * deadline is only checked between prints, as a comparison can not be
+ * interrupted. */
+static gboolean identify_job_out_of_budget(struct identify_job *job, gint i)
+{
+	struct fpi_identify_ctl *ctl = job->ctl;
+
+	if (!ctl)
+		return FALSE;
+	if ((ctl->max_comparisons && i >= (gint) ctl->max_comparisons) ||
+	    (ctl->deadline && g_get_monotonic_time() >= ctl->deadline)) {
+		g_atomic_int_set(&job->out_of_budget, 1);
+		return TRUE;
+	}
+	return FALSE;
+}
+
+static gpointer identify_worker(gpointer data)
+{
+	struct identify_job *job = data;
+	struct bz_ctx *ctx;
+
+	ctx = bz_ctx_acquire();
+	if (!ctx) {
+		g_atomic_int_set(&job->error, -ENOMEM);
+		return NULL;
+	}
+
+	while (TRUE) {
+		gint i = g_atomic_int_add(&job->next, 1);
+		struct fp_print_data *print;
+		unsigned int n;
+		gint offset;
+		int max_score = 0;
+		gboolean audit = FALSE;
+
+		/* stop once the gallery is exhausted, or an earlier print
+		 * has already been found to match */
+		if (i >= job->gallery_len || i >= g_atomic_int_get(&job->match))
+			break;
+		if (identify_job_cancelled(job) ||
+		    identify_job_out_of_budget(job, i))
+			break;
+
+		offset = job->order ? job->order[i] : i;
+		print = job->gallery[offset];
+
+		if (job->prematch != FP_PREMATCH_NONE) {
+			g_atomic_int_inc(&job->candidates);
+			if (identify_job_prematch_score(job, ctx, print) <
+					job->prematch_cutoff) {
+				audit = identify_job_prune(job);
+				if (!audit) {
+					if (job->k)
+						identify_job_report_score(job,
+							offset, 0);
+					continue;
+				}
+			}
+		}
+
+		for (n = 0; n < print->nr_items; n++) {
+			struct fp_print_data_item *data_item = &print->items[n];
+			/* top-K needs exact scores to rank candidates */
+			int r = compare_to_print_data_item(ctx, job->probe->table,
+				data_item,
+				job->k ? 0 : job->match_threshold);
+			if (job->k) {
+				max_score = max(r, max_score);
+				if (job->ctl && job->ctl->stop_on_match &&
+				    r >= job->match_threshold) {
+					identify_job_report_match(job, i);
+					break;
+				}
+			} else if (r >= job->match_threshold) {
+				max_score = r;
+				identify_job_report_match(job, i);
+				break;
+			}
+			if (i >= g_atomic_int_get(&job->match) ||
+			    identify_job_cancelled(job))
+				break;
+		}
+
+		/* the score of a print left half way is of no use */
+		if (identify_job_cancelled(job))
+			break;
+		if (audit && max_score >= job->match_threshold)
+			g_atomic_int_inc(&job->audit_matches);
+		if (job->k) {
+			identify_job_report_score(job, offset, max_score);
+			if (job->ctl && job->ctl->score_cb) {
+				struct fp_identify_match m = { offset, max_score };
+
+				job->ctl->score_cb(&m, job->ctl->score_cb_data);
+			}
+		}
+	}
+
+	bz_ctx_release(ctx);
+	return NULL;
+}
+
+static void identify_job_run(struct identify_job *job)
+{
+	GThread **threads;
+	unsigned int nr_threads;
+	unsigned int i;
+
+	nr_threads = fpi_get_match_threads();
+	if (nr_threads > job->gallery_len)
+		nr_threads = job->gallery_len;
+
+	/* the calling thread takes part in the scan as well */
+	threads = g_alloca(sizeof(*threads) * (nr_threads + 1));
+	for (i = 1; i < nr_threads; i++) {
+		threads[i] = fpi_thread_try_new("fp-identify",
+			identify_worker, job);
+		if (!threads[i]) {
+			fp_warn("could not create identify thread %u", i);
+			break;
+		}
+	}
+	nr_threads = i;
+	fp_dbg("identifying against %d prints with %u threads",
+		job->gallery_len, nr_threads);
+
+	identify_worker(job);
+	for (i = 1; i < nr_threads; i++)
+		g_thread_join(threads[i]);
+}
+
+static void identify_job_init(struct identify_job *job,
+	struct fp_probe *probe, struct fp_print_data **gallery,
+	int match_threshold, struct fpi_identify_ctl *ctl)
+{
+	job->probe = probe;
+	job->gallery = gallery;
+	job->match_threshold = match_threshold;
+	job->next = 0;
+	job->error = 0;
+	for (job->gallery_len = 0; gallery[job->gallery_len]; job->gallery_len++);
+	job->match = job->gallery_len;
+	job->order = NULL;
+	job->prematch = fpi_get_prematch(&job->prematch_cutoff,
+		&job->audit_interval);
+	job->candidates = 0;
+	job->pruned = 0;
+	job->audited = 0;
+	job->audit_matches = 0;
+	job->k = 0;
+	job->topk = NULL;
+	job->topk_len = 0;
+	job->ctl = ctl;
+	job->out_of_budget = 0;
+}
+
+/* Scores each gallery print by the candidate index votes of its best
+ * sample. Samples whose signature can not be built get the best possible
+ * vote, so they are never left out. */
+static void identify_job_rank_index(struct identify_job *job,
+	struct bz_ctx *ctx, struct fp_identify_match *ranks)
+{
+	struct fpi_geohash_probe *probe = get_probe_geohash(job->probe);
+	gint i;
+
+	for (i = 0; i < job->gallery_len; i++) {
+		struct fp_print_data *print = job->gallery[i];
+		unsigned int n;
+
+		ranks[i].offset = i;
+		ranks[i].score = 0;
+		for (n = 0; n < print->nr_items; n++) {
+			struct fpi_geohash *hash = get_geohash(ctx,
+				&print->items[n]);
+			int vote = hash ? fpi_geohash_vote(probe, hash) : G_MAXINT;
+			ranks[i].score = max(vote, ranks[i].score);
+		}
+	}
+}
+
+#ifdef HAVE_OPENCL
+/* Scores each gallery print by the approximate match score of its best
+ * sample, computed on the OpenCL device, see opencl.c. */
+static int identify_job_rank_opencl(struct identify_job *job,
+	struct bz_ctx *ctx, struct fp_identify_match *ranks)
+{
+	const struct bz_gallery **tables;
+	int *scores;
+	gint i, nr_tables = 0;
+	unsigned int n;
+	int r;
+
+	for (i = 0; i < job->gallery_len; i++)
+		nr_tables += job->gallery[i]->nr_items;
+	tables = g_new(const struct bz_gallery *, nr_tables);
+	scores = g_new(int, nr_tables);
+	nr_tables = 0;
+	for (i = 0; i < job->gallery_len; i++)
+		for (n = 0; n < job->gallery[i]->nr_items; n++)
+			tables[nr_tables++] = get_prepared_gallery(ctx,
+				&job->gallery[i]->items[n]);
+
+	r = fpi_opencl_rank(job->probe->table, tables, nr_tables, scores);
+	if (r == 0) {
+		nr_tables = 0;
+		for (i = 0; i < job->gallery_len; i++) {
+			ranks[i].offset = i;
+			ranks[i].score = 0;
+			for (n = 0; n < job->gallery[i]->nr_items; n++)
+				ranks[i].score = max(scores[nr_tables++],
+					ranks[i].score);
+		}
+	}
+
+	g_free(tables);
+	g_free(scores);
+	return r;
+}
+#endif
+
+/* Ranks the gallery and restricts the job to the best nr_candidates
+ * prints, best first. */
+static int identify_job_select_candidates(struct identify_job *job,
+	unsigned int nr_candidates)
+{
+	struct fp_identify_match *ranks;
+	struct bz_ctx *ctx;
+	gint i;
+
+	if (nr_candidates == 0 || nr_candidates >= job->gallery_len)
+		return 0;
+
+	ctx = bz_ctx_acquire();
+	if (!ctx)
+		return -ENOMEM;
+
+	ranks = g_new(struct fp_identify_match, job->gallery_len);
+#ifdef HAVE_OPENCL
+	if (fpi_get_identify_backend() != FP_IDENTIFY_BACKEND_OPENCL ||
+	    identify_job_rank_opencl(job, ctx, ranks) < 0)
+#endif
+		identify_job_rank_index(job, ctx, ranks);
+	bz_ctx_release(ctx);
+
+	qsort(ranks, job->gallery_len, sizeof(*ranks), topk_cmp);
+	job->order = g_new(gint, nr_candidates);
+	for (i = 0; i < nr_candidates; i++)
+		job->order[i] = ranks[i].offset;
+	fp_dbg("index kept %u of %d prints, votes %d..%d", nr_candidates,
+		job->gallery_len, ranks[0].score, ranks[nr_candidates - 1].score);
+	job->gallery_len = nr_candidates;
+	job->match = nr_candidates;
+	g_free(ranks);
+	return 0;
+}
+
+/* Ranks the prints to scan by the statistics the order is based on, see
+ * fp_set_identify_order(). Positions in the current order break ties. */
+static void identify_job_adapt_order(struct identify_job *job,
+	enum fp_identify_order order)
+{
+	struct fp_identify_match *ranks;
+	gint *new_order;
+	int hour = 0;
+	gint i;
+
+	if (order == FP_IDENTIFY_ORDER_GALLERY || job->gallery_len < 2)
+		return;
+
+	if (order == FP_IDENTIFY_ORDER_TIME_OF_DAY) {
+		GDateTime *now = g_date_time_new_now_local();
+
+		hour = g_date_time_get_hour(now);
+		g_date_time_unref(now);
+	}
+
+	ranks = g_new(struct fp_identify_match, job->gallery_len);
+	for (i = 0; i < job->gallery_len; i++) {
+		struct fp_print_data *print =
+			job->gallery[job->order ? job->order[i] : i];
+
+		ranks[i].offset = i;
+		switch (order) {
+		case FP_IDENTIFY_ORDER_RECENT:
+			ranks[i].score = g_atomic_int_get(&print->identify_seq);
+			break;
+		case FP_IDENTIFY_ORDER_FREQUENT:
+			ranks[i].score = g_atomic_int_get(&print->identify_hits);
+			break;
+		case FP_IDENTIFY_ORDER_TIME_OF_DAY:
+			ranks[i].score =
+				g_atomic_int_get(&print->identify_hours[hour]);
+			break;
+		default:
+			ranks[i].score = 0;
+			break;
+		}
+	}
+	qsort(ranks, job->gallery_len, sizeof(*ranks), topk_cmp);
+
+	new_order = g_new(gint, job->gallery_len);
+	for (i = 0; i < job->gallery_len; i++)
+		new_order[i] = job->order ? job->order[ranks[i].offset]
+			: (gint) ranks[i].offset;
+	g_free(job->order);
+	job->order = new_order;
+	g_free(ranks);
+}
+
+/* Match sequence number of the latest identification, for
+ * FP_IDENTIFY_ORDER_RECENT. */
+static gint identify_seq = 0;
+
+static void identify_record_match(struct fp_print_data *print)
+{
+	GDateTime *now = g_date_time_new_now_local();
+
+	g_atomic_int_inc(&print->identify_hits);
+	g_atomic_int_set(&print->identify_seq,
+		g_atomic_int_add(&identify_seq, 1) + 1);
+	g_atomic_int_inc(&print->identify_hours[g_date_time_get_hour(now)]);
+	g_date_time_unref(now);
+}
+
+/* Pre-match results summed over every identification in the process. */
+static GMutex identify_stats_lock;
+static struct fp_identify_stats identify_stats;
+
+static void identify_job_add_stats(struct identify_job *job)
+{
+	g_mutex_lock(&identify_stats_lock);
+	identify_stats.identifications++;
+	identify_stats.candidates += job->candidates;
+	identify_stats.pruned += job->pruned;
+	identify_stats.audited += job->audited;
+	identify_stats.audit_matches += job->audit_matches;
+	g_mutex_unlock(&identify_stats_lock);
+	if (job->candidates)
+		fp_dbg("pre-match pruned %d of %d prints", job->pruned,
+			job->candidates);
+}
+
+/**
+ * fp_get_identify_stats:
+ * @stats: an output location for the statistics
+ *
+ * Get how many gallery prints the pre-match stage scored and pruned, see
+ * fp_set_prematch(), summed over every identification since libfprint was
+ * loaded or since the last call to fp_reset_identify_stats(). This can be
+ * polled at any time and from any thread.
+ */
+API_EXPORTED void fp_get_identify_stats(struct fp_identify_stats *stats)
+{
+	g_mutex_lock(&identify_stats_lock);
+	*stats = identify_stats;
+	g_mutex_unlock(&identify_stats_lock);
+}
+
+/**
+ * fp_reset_identify_stats:
+ *
+ * Reset the statistics returned by fp_get_identify_stats() to zero.
+ */
+API_EXPORTED void fp_reset_identify_stats(void)
+{
+	g_mutex_lock(&identify_stats_lock);
+	memset(&identify_stats, 0, sizeof(identify_stats));
+	g_mutex_unlock(&identify_stats_lock);
+}
+
+int fpi_img_compare_print_data_to_gallery(struct fp_print_data *print,
+	struct fp_print_data **gallery, int match_threshold, size_t *match_offset,
+	struct fpi_identify_ctl *ctl)
+{
+	struct fp_probe *probe;
+	int r;
+
+	if (!probe_print_valid(print))
+		return -EINVAL;
+
+	probe = fpi_probe_new(print);
+	if (!probe)
+		return -ENOMEM;
+	r = fpi_img_compare_probe_to_gallery(probe, gallery, match_threshold,
+		match_offset, ctl);
+	fpi_probe_free(probe);
+	return r;
+}
+
+int fpi_img_compare_probe_to_gallery(struct fp_probe *probe,
+	struct fp_print_data **gallery, int match_threshold, size_t *match_offset,
+	struct fpi_identify_ctl *ctl)
+{
+	struct identify_job job;
+	int r;
+
+	identify_job_init(&job, probe, gallery, match_threshold, ctl);
+	r = identify_job_select_candidates(&job, fpi_get_identify_candidates());
+	if (r < 0)
+		return r;
+	identify_job_adapt_order(&job, fpi_get_identify_order());
+
+	identify_job_run(&job);
+	identify_job_add_stats(&job);
+
+	if (job.match < job.gallery_len) {
+		*match_offset = job.order ? job.order[job.match] : job.match;
+		identify_record_match(gallery[*match_offset]);
+		r = FP_VERIFY_MATCH;
+	} else if (job.error) {
+		r = job.error;
+	} else {
+		r = FP_VERIFY_NO_MATCH;
+	}
+	g_free(job.order);
+	return r;
+}
+
+/* Like fpi_img_compare_print_data_to_gallery(), but scans the whole gallery
+ * and stores the (up to) k best scoring prints in matches, best first. With
+ * limits in ctl, they are the best of the prints compared within them. */
+int fpi_img_compare_print_data_to_gallery_topk(struct fp_print_data *print,
+	struct fp_print_data **gallery, int match_threshold, size_t k,
+	struct fp_identify_match *matches, size_t *nr_matches,
+	struct fpi_identify_ctl *ctl)
+{
+	struct fp_probe *probe;
+	int r;
+
+	*nr_matches = 0;
+	if (!probe_print_valid(print))
+		return -EINVAL;
+
+	probe = fpi_probe_new(print);
+	if (!probe)
+		return -ENOMEM;
+	r = fpi_img_compare_probe_to_gallery_topk(probe, gallery,
+		match_threshold, k, matches, nr_matches, ctl);
+	fpi_probe_free(probe);
+	return r;
+}
+
+int fpi_img_compare_probe_to_gallery_topk(struct fp_probe *probe,
+	struct fp_print_data **gallery, int match_threshold, size_t k,
+	struct fp_identify_match *matches, size_t *nr_matches,
+	struct fpi_identify_ctl *ctl)
+{
+	struct identify_job job;
+	int r;
+
+	*nr_matches = 0;
+	identify_job_init(&job, probe, gallery, match_threshold, ctl);
+	r = identify_job_select_candidates(&job, fpi_get_identify_candidates());
+	if (r < 0)
+		return r;
+
+	job.k = k;
+	job.topk = matches;
+	g_mutex_init(&job.topk_lock);
+	identify_job_run(&job);
+	identify_job_add_stats(&job);
+	g_mutex_clear(&job.topk_lock);
+	g_free(job.order);
+	if (job.out_of_budget)
+		fp_dbg("budget exhausted, reporting the best %zd prints compared",
+			job.topk_len);
+
+	if (job.error && job.topk_len == 0)
+		return job.error;
+
+	qsort(matches, job.topk_len, sizeof(*matches), topk_cmp);
+	*nr_matches = job.topk_len;
+	if (job.topk_len > 0 && matches[0].score >= match_threshold) {
+		identify_record_match(gallery[matches[0].offset]);
+		return FP_VERIFY_MATCH;
+	}
+	return FP_VERIFY_NO_MATCH;
+}
+
+/**
+ * fp_img_binarize:
+ * @img: a standardized image
+ *
+ * Get a binarized form of a standardized scanned image. This is where the
+ * fingerprint image has been "enhanced" and is a set of pure black ridges
+ * on a pure white background. Internally, image processing happens on top
+ * of the binarized image.
+ *
+ * The image must have been [standardized](libfprint-Image-operations.html#img_std)
+ * otherwise this function will fail.
+ *
+ * It is safe to binarize an image and free the original while continuing
+ * to use the binarized version.
+ *
+ * You cannot binarize an image twice.
+ *
+ * Returns: a new image representing the binarized form of the original, or
+ * %NULL on error. Must be freed with fp_img_free() after use.
+ */
+API_EXPORTED struct fp_img *fp_img_binarize(struct fp_img *img)
+{
+	struct fp_img *ret;
+	int height = img->height;
+	int width = img->width;
+	int imgsize = height * width;
+
+	if (img->flags & FP_IMG_BINARIZED_FORM) {
+		fp_err("image already binarized");
+		return NULL;
+	}
+
+	if (!img->binarized) {
+		int r = fpi_img_detect_minutiae(img);
+		if (r < 0)
+			return NULL;
+		if (!img->binarized) {
+			fp_err("no minutiae after successful detection?");
+			return NULL;
+		}
+	}
+
+	ret = fpi_img_new(imgsize);
+	ret->flags |= FP_IMG_BINARIZED_FORM;
+	ret->width = width;
+	ret->height = height;
+	memcpy(ret->data, img->binarized, imgsize);
+	return ret;
+}
+
+/**
+ * fp_img_get_extract_stats:
+ * @img: an image
+ * @stats: an output location for the statistics
+ *
+ * Get the time spent in each stage of extracting the minutiae of an image.
+ * The conversion stage is only timed once print data has been made from the
+ * image. If no minutiae have been detected in the image yet, the
+ * @images member of @stats is 0 and every stage time is 0.
+ */
+API_EXPORTED void fp_img_get_extract_stats(struct fp_img *img,
+	struct fp_extract_stats *stats)
+{
+	*stats = img->stats;
+}
+
+/**
+ * fp_img_get_minutiae:
+ * @img: a standardized image
+ * @nr_minutiae: an output location to store minutiae list length
+ *
+ * Get a list of minutiae detected in an image. A minutia point is a feature
+ * detected on a fingerprint, typically where ridges end or split.
+ * libfprint's image processing code relies upon comparing sets of minutiae,
+ * so accurate placement of minutia points is critical for good imaging
+ * performance.
+ *
+ * The image must have been [standardized](libfprint-Image-operations.html#img_std)
+ * otherwise this function will fail.
+ *
+ * You cannot pass a binarized image to this function. Instead, pass the
+ * original image.
+ *
+ * Returns a list of pointers to minutiae, where the list is of length
+ * indicated in the nr_minutiae output parameter. The returned list is only
+ * valid while the parent image has not been freed, and the minutiae data
+ * must not be modified or freed.
+ *
+ * Returns: a list of minutiae points. Must not be modified or freed.
+ */
+API_EXPORTED struct fp_minutia **fp_img_get_minutiae(struct fp_img *img,
+	int *nr_minutiae)
+{
+	if (img->flags & FP_IMG_BINARIZED_FORM) {
+		fp_err("image is binarized");
+		return NULL;
+	}
+
+	if (!img->minutiae) {
+		int r = fpi_img_detect_minutiae(img);
+		if (r < 0)
+			return NULL;
+		if (!img->minutiae) {
+			fp_err("no minutiae after successful detection?");
+			return NULL;
+		}
+	}
+
+	*nr_minutiae = img->minutiae->num;
+	return img->minutiae->list;
+}
+
+static const int *get_map(struct fp_img *img, int **map, int *width,
+	int *height)
+{
+	if (img->flags & FP_IMG_BINARIZED_FORM) {
+		fp_err("image is binarized");
+		return NULL;
+	}
+
+	if (fpi_img_detect_minutiae(img) < 0)
+		return NULL;
+	if (!*map) {
+		fp_err("no maps after successful detection?");
+		return NULL;
+	}
+
+	*width = img->map_width;
+	*height = img->map_height;
+	return *map;
+}
+
+/**
+ * fp_img_get_quality_map:
+ * @img: a standardized image
+ * @width: output location for the number of blocks across the map
+ * @height: output location for the number of blocks down the map
+ *
+ * Get the quality minutiae detection found in each block of 8 by 8 pixels
+ * of an image, from 0 where it could not make out ridges to 4 where they
+ * are the clearest. The minutiae are detected if that was not done yet:
+ * the minutiae, the binarized form and the maps of an image all come from
+ * a single detection.
+ *
+ * Returns: the map, row by row, or %NULL on error. It is only valid while
+ * the image has not been freed, and must not be modified or freed.
+ */
+API_EXPORTED const int *fp_img_get_quality_map(struct fp_img *img,
+	int *width, int *height)
+{
+	return get_map(img, &img->quality_map, width, height);
+}
+
+/**
+ * fp_img_get_direction_map:
+ * @img: a standardized image
+ * @width: output location for the number of blocks across the map
+ * @height: output location for the number of blocks down the map
+ *
+ * Get the direction of the ridges minutiae detection found in each block
+ * of 8 by 8 pixels of an image, as one of 16 directions spanning half a
+ * circle, or -1 where it found none. As for fp_img_get_quality_map(), the
+ * minutiae are detected if that was not done yet.
+ *
+ * Returns: the map, row by row, or %NULL on error. It is only valid while
+ * the image has not been freed, and must not be modified or freed.
+ */
+API_EXPORTED const int *fp_img_get_direction_map(struct fp_img *img,
+	int *width, int *height)
+{
+	return get_map(img, &img->direction_map, width, height);
+}
+
+/**
+ * fp_probe_new:
+ * @dev: the imaging device which scanned @img
+ * @img: a scan of a finger, such as one from fp_dev_img_capture()
+ *
+ * Extracts the print of a scanned finger and prepares it for matching.
+ * Comparing a print to the prints of a gallery starts by building a table
+ * of the relations between its minutiae, which fp_verify_finger() and
+ * fp_identify_finger() redo for every scan. A probe builds it once, so that
+ * the same scan can for instance be verified against a claimed identity with
+ * fp_probe_verify(), then identified with fp_probe_identify() if that
+ * failed, without extracting or preparing it again.
+ *
+ * Returns: the probe, or %NULL if @dev is not an imaging device or no print
+ * could be extracted from @img. Must be freed with fp_probe_free() after
+ * use.
+ */
+API_EXPORTED struct fp_probe *fp_probe_new(struct fp_dev *dev,
+	struct fp_img *img)
+{
+	struct fp_img_dev *imgdev;
+	struct fp_print_data *print;
+	struct fp_probe *probe;
+
+	if (dev->drv->type != DRIVER_IMAGING)
+		return NULL;
+	imgdev = dev->priv;
+
+	fp_img_standardize(img);
+	if (fpi_img_to_print_data(imgdev, img, &print) < 0)
+		return NULL;
+
+	probe = fpi_probe_new(print);
+	if (!probe) {
+		fp_print_data_free(print);
+		return NULL;
+	}
+	probe->own_print = TRUE;
+	probe->match_threshold = fpi_imgdev_get_match_threshold(imgdev);
+	return probe;
+}
+
+/**
+ * fp_probe_free:
+ * @probe: the probe to free. If %NULL, function simply returns.
+ *
+ * Frees a probe.
+ */
+API_EXPORTED void fp_probe_free(struct fp_probe *probe)
+{
+	fpi_probe_free(probe);
+}
+
+/**
+ * fp_probe_verify:
+ * @probe: the scanned finger
+ * @enrolled_print: the print to verify against, enrolled with a device
+ * compatible with the one which scanned @probe
+ *
+ * Verifies a scanned finger against an enrolled print, like
+ * fp_verify_finger() does for a new scan.
+ *
+ * Returns: negative code on error, otherwise %FP_VERIFY_MATCH or
+ * %FP_VERIFY_NO_MATCH
+ */
+API_EXPORTED int fp_probe_verify(struct fp_probe *probe,
+	struct fp_print_data *enrolled_print)
+{
+	int r;
+
+	if (!fpi_print_data_compatible(probe->print->driver_id,
+			probe->print->devtype, probe->print->type,
+			enrolled_print->driver_id, enrolled_print->devtype,
+			enrolled_print->type))
+		return -EINVAL;
+
+	r = fpi_img_compare_probe(enrolled_print, probe,
+		probe->match_threshold);
+	if (r < 0)
+		return r;
+	return r >= probe->match_threshold ? FP_VERIFY_MATCH : FP_VERIFY_NO_MATCH;
+}
+
+/**
+ * fp_probe_identify:
+ * @probe: the scanned finger
+ * @print_gallery: %NULL-terminated array of pointers to the prints to
+ * identify against, enrolled with a device compatible with the one which
+ * scanned @probe
+ * @match_offset: output location to store the array index of the matched
+ * gallery print (if any was found). Only valid if FP_VERIFY_MATCH was
+ * returned.
+ *
+ * Identifies a scanned finger among a gallery of prints, like
+ * fp_identify_finger() does for a new scan.
+ *
+ * Returns: negative code on error, otherwise %FP_VERIFY_MATCH or
+ * %FP_VERIFY_NO_MATCH
+ */
+API_EXPORTED int fp_probe_identify(struct fp_probe *probe,
+	struct fp_print_data **print_gallery, size_t *match_offset)
+{
+	return fpi_img_compare_probe_to_gallery(probe, print_gallery,
+		probe->match_threshold, match_offset, NULL);
+}
+
+/* Side (in pixels) of the blocks the capture quality estimate looks at. */
+#define QUALITY_BLOCKSIZE	16
+
+/* Tell whether a block holds ridge contrast, the way low_contrast_block()
+ * does: the pixels at the lower and upper PERCENTILE_MIN_MAX percentiles
+ * must be at least MIN_CONTRAST_DELTA apart in 6-bit terms. Those
+ * percentiles being delta apart puts the block's variance at no less than
+ * thresh * delta^2 / (2 * numpix), which rules out flat blocks without
+ * building their histogram. */
+static gboolean quality_block_has_contrast(const unsigned char *data,
+	int width, int bw, int bh)
+{
+	int hist[256] = { 0 };
+	int numpix = bw * bh;
+	int thresh = (PERCENTILE_MIN_MAX * (numpix - 1) + 50) / 100;
+	int delta = MIN_CONTRAST_DELTA << 2;
+	long long sum = 0, sqsum = 0;
+	int x, y, lo, hi, n;
+
+	if (thresh <= 0)
+		thresh = 1;
+
+	for (y = 0; y < bh; y++) {
+		const unsigned char *row = data + y * width;
+		for (x = 0; x < bw; x++) {
+			sum += row[x];
+			sqsum += row[x] * row[x];
+		}
+	}
+	if (2 * (numpix * sqsum - sum * sum) < (long long)thresh * delta * delta * numpix)
+		return FALSE;
+
+	for (y = 0; y < bh; y++) {
+		const unsigned char *row = data + y * width;
+		for (x = 0; x < bw; x++)
+			hist[row[x]]++;
+	}
+	for (lo = 0, n = 0; lo < 255; lo++)
+		if ((n += hist[lo]) >= thresh)
+			break;
+	for (hi = 255, n = 0; hi > 0; hi--)
+		if ((n += hist[hi]) >= thresh)
+			break;
+
+	return hi - lo >= delta;
+}
+
+/* Cheap estimate of how usable a capture is, taken before minutiae
+ * detection: the percentage of the image's blocks that hold ridge
+ * contrast. A capture with hardly any such blocks cannot yield enough
+ * minutiae, so it can be turned away without a full mindtct run. */
+int fpi_img_quality(struct fp_img *img)
+{
+	int bx, by, bw, bh, blocks = 0, ridged = 0;
+
+	for (by = 0; by < img->height; by += QUALITY_BLOCKSIZE) {
+		bh = MIN(QUALITY_BLOCKSIZE, img->height - by);
+		for (bx = 0; bx < img->width; bx += QUALITY_BLOCKSIZE) {
+			bw = MIN(QUALITY_BLOCKSIZE, img->width - bx);
+			blocks++;
+			if (quality_block_has_contrast(img->data + by * img->width + bx,
+					img->width, bw, bh))
+				ridged++;
+		}
+	}
+
+	if (blocks == 0)
+		return 0;
+	return ridged * 100 / blocks;
+}
+
+#if defined(__GNUC__) && !defined(LINE_STATS_SCALAR)
+#define LINE_STATS_VECTOR_SIZE 16
+typedef unsigned char stats_u8v __attribute__((vector_size(LINE_STATS_VECTOR_SIZE)));
+typedef guint16 stats_u16v __attribute__((vector_size(LINE_STATS_VECTOR_SIZE)));
+typedef guint32 stats_u32v __attribute__((vector_size(LINE_STATS_VECTOR_SIZE)));
+
+/* A 32-bit lane of the sum of squares gains at most 2 * 510 * 510 from
+ * each vector of values */
+#define LINE_STATS_VECTORS_PER_FLUSH 1024
+#endif
+
+/* Sums of the values of a line and of their squares, for the line
+ * statistics below */
+struct line_stats {
+	guint64 sum;
+	guint64 sumsq;
+#ifdef LINE_STATS_VECTOR_SIZE
+	stats_u32v vsum;
+	stats_u32v vsumsq;
+	int pending;
+#endif
+};
+
+#ifdef LINE_STATS_VECTOR_SIZE
+static void line_stats_flush(struct line_stats *stats)
+{
+	static const stats_u32v zero;
+	unsigned int k;
+
+	for (k = 0; k < LINE_STATS_VECTOR_SIZE / sizeof(guint32); k++) {
+		stats->sum += stats->vsum[k];
+		stats->sumsq += stats->vsumsq[k];
+	}
+	stats->vsum = zero;
+	stats->vsumsq = zero;
+	stats->pending = 0;
+}
+
+/* Adds a vector of values up to 510 */
+static inline void line_stats_add_vector(struct line_stats *stats,
+					 stats_u16v x)
+{
+	stats_u32v lo = (stats_u32v) x & 0xffff;
+	stats_u32v hi = (stats_u32v) x >> 16;
+
+	stats->vsum += lo + hi;
+	stats->vsumsq += lo * lo + hi * hi;
+	if (++stats->pending == LINE_STATS_VECTORS_PER_FLUSH)
+		line_stats_flush(stats);
+}
+
+/* Splits the elements buf[k * stride] the vector code can load into
+ * vectors of 16-bit values, the same way for any buffer. Returns the
+ * number of elements split, filling at most size / 8 + 1 vectors. */
+static int split_line(const unsigned char *buf, int size, int stride,
+		      stats_u16v *out)
+{
+	stats_u8v v;
+	stats_u16v pairs;
+	int k = 0, n = 0;
+
+	if (stride == 1) {
+		for (; k + LINE_STATS_VECTOR_SIZE <= size;
+		     k += LINE_STATS_VECTOR_SIZE) {
+			memcpy(&v, buf + k, sizeof(v));
+			pairs = (stats_u16v) v;
+			out[n++] = pairs & 0xff;
+			out[n++] = pairs >> 8;
+		}
+	}
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	else if (stride == 2) {
+		/* the last load also reads the byte after an element */
+		for (; k + LINE_STATS_VECTOR_SIZE / 2 < size;
+		     k += LINE_STATS_VECTOR_SIZE / 2) {
+			memcpy(&v, buf + 2 * k, sizeof(v));
+			pairs = (stats_u16v) v;
+			out[n++] = pairs & 0xff;
+		}
+	}
+#endif
+	return k;
+}
+#endif
+
+static void line_stats_init(struct line_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+}
+
+static inline void line_stats_add(struct line_stats *stats, int x)
+{
+	stats->sum += x;
+	stats->sumsq += x * x;
+}
+
+/* Squared standard deviation of the values added, with the mean rounded
+ * down first as the scalar loops always did */
+static int line_stats_sq_dev(struct line_stats *stats, int size)
+{
+	gint64 mean, res;
+
+#ifdef LINE_STATS_VECTOR_SIZE
+	line_stats_flush(stats);
+#endif
+	mean = stats->sum / size;
+	res = stats->sumsq - 2 * mean * stats->sum + size * mean * mean;
 
 	return res / size;
 }
+
+/* Calculate squared standand deviation */
+int fpi_std_sq_dev(const unsigned char *buf, int size)
+{
+	struct line_stats stats;
+
+	if (size > (INT_MAX / 65536)) {
+		fp_err("%s: we might get an overflow!", __func__);
+		return -EOVERFLOW;
+	}
+
+	line_stats_init(&stats);
+	fpi_simd->sum_sq(buf, size, &stats.sum, &stats.sumsq);
+	return line_stats_sq_dev(&stats, size);
+}
+
+/* Calculate the sum of squared differences of two lines */
+int fpi_sq_diff(const unsigned char *buf1, const unsigned char *buf2,
+		int size)
+{
+	return fpi_simd->sq_diff(buf1, buf2, size);
+}
+
+/* Calculate normalized mean square difference of two lines */
+int fpi_mean_sq_diff_norm(unsigned char *buf1, unsigned char *buf2, int size)
+{
+	return fpi_sq_diff(buf1, buf2, size) / size;
+}
+
+/* Calculate squared standard deviation of the sum of two lines, taking
+ * every stride-th pixel of each. Line 1 is added in turn to count lines
+ * starting at buf2, step bytes apart, and the results stored in devs. */
+void fpi_std_sq_dev_sum_batch(const unsigned char *buf1,
+			      const unsigned char *buf2, size_t step,
+			      int count, int size, int stride, int *devs)
+{
+	struct line_stats stats;
+	int i, j, k, split = 0;
+#ifdef LINE_STATS_VECTOR_SIZE
+	int nvec = size / 8 + 1;
+	stats_u16v *vec1 = g_alloca(nvec * sizeof(*vec1));
+	stats_u16v *vec2 = g_alloca(nvec * sizeof(*vec2));
+
+	/* line 1 is split only once */
+	split = split_line(buf1, size, stride, vec1);
+	nvec = split / (LINE_STATS_VECTOR_SIZE / sizeof(guint16));
+#endif
+
+	for (j = 0; j < count; j++, buf2 += step) {
+		line_stats_init(&stats);
+		k = split * stride;
+#ifdef LINE_STATS_VECTOR_SIZE
+		split_line(buf2, size, stride, vec2);
+		for (i = 0; i < nvec; i++)
+			line_stats_add_vector(&stats, vec1[i] + vec2[i]);
+#endif
+		for (i = split; i < size; i++, k += stride)
+			line_stats_add(&stats, (int)buf1[k] + (int)buf2[k]);
+		devs[j] = line_stats_sq_dev(&stats, size);
+	}
+}
+
+int fpi_std_sq_dev_sum(const unsigned char *buf1, const unsigned char *buf2,
+		       int size, int stride)
+{
+	int dev;
+
+	fpi_std_sq_dev_sum_batch(buf1, buf2, 0, 1, size, stride, &dev);
+	return dev;
+}
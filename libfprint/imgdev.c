@@ -18,6 +18,7 @@
  */
 
 #include <errno.h>
+#include <string.h>
 
 #include <glib.h>
 
@@ -25,8 +26,13 @@
 
 #define MIN_ACCEPTABLE_MINUTIAE 10
 #define BOZORTH3_DEFAULT_THRESHOLD 40
+#define QUALITY_DEFAULT_THRESHOLD 5
 #define IMG_ENROLL_STAGES 5
 
+static void imgdev_cancel_job(struct fp_img_dev *imgdev);
+static void warm_cool_down(struct fp_img_dev *imgdev);
+static int stream_capture_state(struct fp_img_dev *imgdev);
+
 static int img_dev_open(struct fp_dev *dev, unsigned long driver_data)
 {
 	struct fp_img_dev *imgdev = g_malloc0(sizeof(*imgdev));
@@ -35,12 +41,21 @@ static int img_dev_open(struct fp_dev *dev, unsigned long driver_data)
 
 	imgdev->dev = dev;
 	imgdev->enroll_stage = 0;
+	imgdev->processing_cpu = -1;
+	imgdev->worker_cpu = -1;
+	g_mutex_init(&imgdev->job_lock);
+	g_cond_init(&imgdev->job_cond);
+	g_mutex_init(&imgdev->stats_lock);
 	dev->priv = imgdev;
 	dev->nr_enroll_stages = IMG_ENROLL_STAGES;
 
 	/* for consistency in driver code, allow udev access through imgdev */
 	imgdev->udev = dev->udev;
 
+	if (imgdrv->img_width > 0 && imgdrv->img_height > 0)
+		imgdev->img_pool = fpi_img_pool_new(imgdrv->img_width *
+						    imgdrv->img_height);
+
 	if (imgdrv->open) {
 		r = imgdrv->open(imgdev, driver_data);
 		if (r)
@@ -51,6 +66,10 @@ static int img_dev_open(struct fp_dev *dev, unsigned long driver_data)
 
 	return 0;
 err:
+	fpi_img_pool_unref(imgdev->img_pool);
+	g_mutex_clear(&imgdev->job_lock);
+	g_cond_clear(&imgdev->job_cond);
+	g_mutex_clear(&imgdev->stats_lock);
 	g_free(imgdev);
 	return r;
 }
@@ -60,23 +79,82 @@ void fpi_imgdev_open_complete(struct fp_img_dev *imgdev, int status)
 	fpi_drvcb_open_complete(imgdev->dev, status);
 }
 
-static void img_dev_close(struct fp_dev *dev)
+static void do_close(struct fp_img_dev *imgdev)
 {
-	struct fp_img_dev *imgdev = dev->priv;
-	struct fp_img_driver *imgdrv = fpi_driver_to_img_driver(dev->drv);
+	struct fp_img_driver *imgdrv = fpi_driver_to_img_driver(imgdev->dev->drv);
 
 	if (imgdrv->close)
 		imgdrv->close(imgdev);
 	else
-		fpi_drvcb_close_complete(dev);
+		fpi_drvcb_close_complete(imgdev->dev);
+}
+
+static void img_dev_close(struct fp_dev *dev)
+{
+	struct fp_img_dev *imgdev = dev->priv;
+
+	imgdev_cancel_job(imgdev);
+
+	/* a sensor kept warm is deactivated first, see warm_cooled() */
+	if (imgdev->warm_state != IMG_WARM_NONE) {
+		imgdev->close_pending = TRUE;
+		if (imgdev->warm_state == IMG_WARM_IDLE)
+			warm_cool_down(imgdev);
+		return;
+	}
+
+	do_close(imgdev);
 }
 
 void fpi_imgdev_close_complete(struct fp_img_dev *imgdev)
 {
 	fpi_drvcb_close_complete(imgdev->dev);
+	if (imgdev->process_pool)
+		g_thread_pool_free(imgdev->process_pool, FALSE, TRUE);
+	fpi_img_pool_unref(imgdev->img_pool);
+#ifdef ENABLE_CAPTURE_DUMP
+	fpi_capture_dump_unref(imgdev->capture_dump);
+#endif
+	g_mutex_clear(&imgdev->job_lock);
+	g_cond_clear(&imgdev->job_cond);
+	g_mutex_clear(&imgdev->stats_lock);
 	g_free(imgdev);
 }
 
+/* Add a latency to its histogram. A start of 0 was never recorded. */
+static void stats_add(struct fp_img_dev *imgdev, enum fp_dev_stage stage,
+	gint64 start, gint64 end)
+{
+	struct fp_dev_latency *latency = &imgdev->stats.stages[stage];
+	guint64 usecs;
+	guint bucket;
+
+	if (start == 0)
+		return;
+
+	usecs = end > start ? end - start : 0;
+	bucket = usecs ? g_bit_storage(usecs) - 1 : 0;
+	if (bucket >= FP_DEV_STATS_BUCKETS)
+		bucket = FP_DEV_STATS_BUCKETS - 1;
+
+	g_mutex_lock(&imgdev->stats_lock);
+	latency->count++;
+	latency->sum_usecs += usecs;
+	if (usecs > latency->max_usecs)
+		latency->max_usecs = usecs;
+	latency->buckets[bucket]++;
+	g_mutex_unlock(&imgdev->stats_lock);
+}
+
+void fpi_imgdev_get_stats(struct fp_img_dev *imgdev,
+	struct fp_dev_stats *stats)
+{
+	g_mutex_lock(&imgdev->stats_lock);
+	*stats = imgdev->stats;
+	memset(&imgdev->stats, 0, sizeof(imgdev->stats));
+	g_mutex_unlock(&imgdev->stats_lock);
+}
+
 static int dev_change_state(struct fp_img_dev *imgdev,
 	enum fp_imgdev_state state)
 {
@@ -128,8 +206,21 @@ void fpi_imgdev_report_finger_status(struct fp_img_dev *imgdev,
 	fp_dbg(present ? "finger on sensor" : "finger removed");
 
 	if (present && imgdev->action_state == IMG_ACQUIRE_STATE_AWAIT_FINGER_ON) {
+		imgdev->finger_on_time = g_get_monotonic_time();
 		dev_change_state(imgdev, IMGDEV_STATE_CAPTURE);
-		imgdev->action_state = IMG_ACQUIRE_STATE_AWAIT_IMAGE;
+		imgdev->action_state = stream_capture_state(imgdev);
+		return;
+	} else if (!present && imgdev->stream
+			&& (imgdev->action_state == IMG_ACQUIRE_STATE_AWAIT_IMAGE
+			|| imgdev->action_state == IMG_ACQUIRE_STATE_STREAM_PAUSED)) {
+		/* a stream goes on with the next finger */
+		imgdev->action_state = IMG_ACQUIRE_STATE_AWAIT_FINGER_ON;
+		dev_change_state(imgdev, IMGDEV_STATE_AWAIT_FINGER_ON);
+		return;
+	} else if (!present
+			&& imgdev->action_state == IMG_ACQUIRE_STATE_PROCESSING) {
+		fp_dbg("reporting once the image is processed");
+		imgdev->finger_off_pending = TRUE;
 		return;
 	} else if (present
 			|| imgdev->action_state != IMG_ACQUIRE_STATE_AWAIT_FINGER_OFF) {
@@ -183,63 +274,600 @@ void fpi_imgdev_report_finger_status(struct fp_img_dev *imgdev,
 	}
 }
 
-static void verify_process_img(struct fp_img_dev *imgdev)
+/* An image handed to the processing worker of its device by
+ * fpi_imgdev_image_captured(),
+ * so that the event loop is not held up by minutiae detection and matching.
+ * Everything the worker produces lives here until the event loop takes it in
+ * job_complete(). */
+struct imgdev_job {
+	struct fp_img_dev *imgdev;
+	enum fp_imgdev_action action;
+	struct fp_img *img;
+	struct fp_print_data *print;
+	int result;
+	/* for the last enroll stage, the merged samples of all stages */
+	gboolean consolidate;
+	struct fp_print_data *consolidated;
+	size_t match_offset;
+	struct fp_identify_match *matches;
+	size_t nr_matches;
+	/* when the finger was put on the sensor and the image captured */
+	gint64 finger_on_time;
+	gint64 captured_time;
+	/* limits of an identification, and how to abandon it */
+	struct fpi_identify_ctl ctl;
+	/* whether it went to the worker, which can post to the event loop */
+	gboolean deferred;
+	/* the worker holds one reference, and each posted job_scores() one */
+	gint refs;
+	/* all protected by the job_lock of the device */
+	gboolean done;
+	gboolean cancelled;
+	/* scores of gallery prints the event loop did not report yet, and
+	 * whether job_scores() was posted to report them */
+	GArray *scores;
+	gboolean scores_posted;
+};
+
+static void job_unref(struct imgdev_job *job)
+{
+	if (!g_atomic_int_dec_and_test(&job->refs))
+		return;
+
+	fp_img_free(job->img);
+	fp_print_data_free(job->print);
+	fp_print_data_free(job->consolidated);
+	g_free(job->matches);
+	if (job->scores)
+		g_array_free(job->scores, TRUE);
+	g_free(job);
+}
+
+/* Report the scores queued by job_post_score(), on the event loop. The
+ * callbacks can stop the identification, which cancels the job. */
+static void job_report_scores(struct imgdev_job *job)
+{
+	struct fp_img_dev *imgdev = job->imgdev;
+	GArray *scores;
+	guint i;
+
+	if (!job->scores)
+		return;
+
+	g_mutex_lock(&imgdev->job_lock);
+	scores = job->scores;
+	job->scores = g_array_new(FALSE, FALSE,
+		sizeof(struct fp_identify_match));
+	job->scores_posted = FALSE;
+	g_mutex_unlock(&imgdev->job_lock);
+
+	for (i = 0; i < scores->len && !job->cancelled; i++)
+		fpi_drvcb_report_identify_score(imgdev->dev,
+			&g_array_index(scores, struct fp_identify_match, i));
+	g_array_free(scores, TRUE);
+}
+
+/* runs on the event loop, once posted by job_post_score() */
+static void job_scores(void *data)
+{
+	struct imgdev_job *job = data;
+
+	/* the device may be gone once the job was cancelled */
+	if (!job->cancelled)
+		job_report_scores(job);
+	job_unref(job);
+}
+
+/* Called from the matching threads with the score of each gallery print.
+ * The scores are queued for a single job_scores() run; a job processed
+ * on the event loop itself reports them in finish_processing(). */
+static void job_post_score(const struct fp_identify_match *match,
+	void *data)
+{
+	struct imgdev_job *job = data;
+	struct fp_img_dev *imgdev = job->imgdev;
+
+	g_mutex_lock(&imgdev->job_lock);
+	if (!job->cancelled) {
+		g_array_append_val(job->scores, *match);
+		if (job->deferred && !job->scores_posted) {
+			job->scores_posted = TRUE;
+			g_atomic_int_inc(&job->refs);
+			fpi_poll_defer(job_scores, job);
+		}
+	}
+	g_mutex_unlock(&imgdev->job_lock);
+}
+
+/* The Bozorth3 score from which the prints of the device match. */
+int fpi_imgdev_get_match_threshold(struct fp_img_dev *imgdev)
 {
 	struct fp_img_driver *imgdrv = fpi_driver_to_img_driver(imgdev->dev->drv);
-	int match_score = imgdrv->bz3_threshold;
-	int r;
 
-	if (match_score == 0)
-		match_score = BOZORTH3_DEFAULT_THRESHOLD;
+	if (imgdrv->bz3_threshold == 0)
+		return BOZORTH3_DEFAULT_THRESHOLD;
+	return imgdrv->bz3_threshold;
+}
 
-	r = fpi_img_compare_print_data(imgdev->dev->verify_data,
-		imgdev->acquire_data);
+static int verify_process_img(struct fp_img_dev *imgdev,
+	struct fp_print_data *print)
+{
+	int match_score = fpi_imgdev_get_match_threshold(imgdev);
+	int r;
+
+	r = fpi_img_compare_print_data(imgdev->dev->verify_data, print,
+		match_score);
 
 	if (r >= match_score)
 		r = FP_VERIFY_MATCH;
 	else if (r >= 0)
 		r = FP_VERIFY_NO_MATCH;
 
-	imgdev->action_result = r;
+	return r;
+}
+
+/* The samples of the previous stages stay put while the last one is
+ * processed, as only finish_processing() adds to them. */
+static struct fp_print_data *enroll_consolidate(struct fp_img_dev *imgdev,
+	struct fp_print_data *print)
+{
+	return fpi_img_consolidate_print_data(imgdev->dev, imgdev->enroll_data,
+		print, fpi_imgdev_get_match_threshold(imgdev));
 }
 
-static void identify_process_img(struct fp_img_dev *imgdev)
+static int identify_process_img(struct imgdev_job *job)
 {
-	struct fp_img_driver *imgdrv = fpi_driver_to_img_driver(imgdev->dev->drv);
-	int match_score = imgdrv->bz3_threshold;
-	size_t match_offset;
+	struct fp_dev *dev = job->imgdev->dev;
+	struct fp_identify_budget *budget = &dev->identify_budget;
+	int match_score = fpi_imgdev_get_match_threshold(job->imgdev);
 	int r;
 
-	if (match_score == 0)
-		match_score = BOZORTH3_DEFAULT_THRESHOLD;
+	if (budget->time_ms)
+		job->ctl.deadline = g_get_monotonic_time()
+			+ (gint64) budget->time_ms * 1000;
+	job->ctl.max_comparisons = budget->max_comparisons;
+	job->ctl.stop_on_match = budget->stop_on_match;
+	if (dev->identify_score_cb) {
+		job->scores = g_array_new(FALSE, FALSE,
+			sizeof(struct fp_identify_match));
+		job->ctl.score_cb = job_post_score;
+		job->ctl.score_cb_data = job;
+	}
 
-	r = fpi_img_compare_print_data_to_gallery(imgdev->acquire_data,
-		imgdev->dev->identify_gallery, match_score, &match_offset);
+	if (dev->identify_topk) {
+		job->matches = g_new(struct fp_identify_match,
+			dev->identify_topk);
+		r = fpi_img_compare_print_data_to_gallery_topk(job->print,
+			dev->identify_gallery, match_score, dev->identify_topk,
+			job->matches, &job->nr_matches, &job->ctl);
+		if (r == FP_VERIFY_MATCH)
+			job->match_offset = job->matches[0].offset;
+	} else {
+		r = fpi_img_compare_print_data_to_gallery(job->print,
+			dev->identify_gallery, match_score, &job->match_offset,
+			&job->ctl);
+	}
 
-	imgdev->action_result = r;
-	imgdev->identify_match_offset = match_offset;
+	return r;
 }
 
 void fpi_imgdev_abort_scan(struct fp_img_dev *imgdev, int result)
 {
+	imgdev_cancel_job(imgdev);
 	imgdev->action_result = result;
 	imgdev->action_state = IMG_ACQUIRE_STATE_AWAIT_FINGER_OFF;
 	dev_change_state(imgdev, IMGDEV_STATE_AWAIT_FINGER_OFF);
 }
 
+/* Turn away captures that are clearly too poor to extract a print from,
+ * before paying for minutiae detection. */
+static gboolean image_quality_acceptable(struct fp_img_dev *imgdev,
+	struct fp_img *img)
+{
+	struct fp_img_driver *imgdrv = fpi_driver_to_img_driver(imgdev->dev->drv);
+	int threshold = imgdrv->quality_threshold;
+	int quality;
+
+	if (threshold < 0)
+		return TRUE;
+	if (threshold == 0)
+		threshold = QUALITY_DEFAULT_THRESHOLD;
+
+	quality = fpi_img_quality(img);
+	if (quality < threshold) {
+		fp_dbg("image quality too low, %d/%d", quality, threshold);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/* The expensive part of handling a captured image. It only reads the device
+ * and the action parameters, which stay put until the job is done, as
+ * stopping the action waits for it in imgdev_cancel_job(). */
+static void process_img(struct imgdev_job *job)
+{
+	struct fp_img_dev *imgdev = job->imgdev;
+	struct fp_img *img = job->img;
+	gint64 extracted_time, now;
+	int r;
+
+	fp_img_standardize(img);
+	if (job->action == IMG_ACTION_CAPTURE) {
+		job->result = FP_CAPTURE_COMPLETE;
+		return;
+	}
+
+	if (!image_quality_acceptable(imgdev, img)) {
+		/* depends on FP_ENROLL_RETRY == FP_VERIFY_RETRY */
+		job->result = FP_ENROLL_RETRY;
+		return;
+	}
+
+	r = fpi_img_to_print_data(imgdev, img, &job->print);
+	if (r < 0) {
+		fp_dbg("image to print data conversion error: %d", r);
+		job->print = NULL;
+		job->result = FP_ENROLL_RETRY;
+		return;
+	}
+
+	extracted_time = g_get_monotonic_time();
+	stats_add(imgdev, FP_DEV_STAGE_EXTRACT, job->captured_time,
+		extracted_time);
+
+	if (img->minutiae->num < MIN_ACCEPTABLE_MINUTIAE) {
+		fp_dbg("not enough minutiae, %d/%d", img->minutiae->num,
+			MIN_ACCEPTABLE_MINUTIAE);
+		fp_print_data_free(job->print);
+		job->print = NULL;
+		/* depends on FP_ENROLL_RETRY == FP_VERIFY_RETRY */
+		job->result = FP_ENROLL_RETRY;
+		return;
+	}
+
+	switch (job->action) {
+	case IMG_ACTION_ENROLL:
+		if (job->consolidate)
+			job->consolidated = enroll_consolidate(imgdev, job->print);
+		return;
+	case IMG_ACTION_VERIFY:
+		job->result = verify_process_img(imgdev, job->print);
+		break;
+	case IMG_ACTION_IDENTIFY:
+		job->result = identify_process_img(job);
+		break;
+	default:
+		return;
+	}
+
+	now = g_get_monotonic_time();
+	stats_add(imgdev, FP_DEV_STAGE_MATCH, extracted_time, now);
+	stats_add(imgdev, FP_DEV_STAGE_TOTAL, job->finger_on_time, now);
+}
+
+#ifdef ENABLE_CAPTURE_DUMP
+/* Record the image of a job, tagged with the operation and its result, see
+ * fp_dev_set_capture_dump() */
+static void dump_job_img(struct imgdev_job *job)
+{
+	static const char * const action_names[] = {
+		[IMG_ACTION_NONE] = "none",
+		[IMG_ACTION_ENROLL] = "enroll",
+		[IMG_ACTION_VERIFY] = "verify",
+		[IMG_ACTION_IDENTIFY] = "identify",
+		[IMG_ACTION_CAPTURE] = "capture",
+	};
+	char tag[32];
+
+	g_snprintf(tag, sizeof(tag), "%s-%d", action_names[job->action],
+		job->result);
+	fpi_capture_dump_add(job->imgdev->capture_dump, job->img, tag);
+}
+#endif
+
+/* Take the outcome of a processed image into the device, on the event loop,
+ * and move on to waiting for the finger to be removed. */
+static void finish_processing(struct imgdev_job *job)
+{
+	struct fp_img_dev *imgdev = job->imgdev;
+	struct fp_dev *dev = imgdev->dev;
+	struct fp_print_data *print = job->print;
+	struct fp_print_data_item *sample, *item;
+	gboolean told_driver =
+		imgdev->action_state == IMG_ACQUIRE_STATE_PROCESSING;
+
+#ifdef ENABLE_CAPTURE_DUMP
+	if (imgdev->capture_dump)
+		dump_job_img(job);
+#endif
+	imgdev->acquire_img = job->img;
+	job->img = NULL;
+	imgdev->action_result = job->result;
+	if (print) {
+		switch (job->action) {
+		case IMG_ACTION_ENROLL:
+			if (!imgdev->enroll_data)
+				imgdev->enroll_data = fpi_print_data_new(dev);
+			BUG_ON(fpi_print_data_get_nr_items(print) != 1);
+			/* Copy print data from acquire data into enroll_data */
+			sample = fpi_print_data_get_item(print, 0);
+			item = fpi_print_data_add_item(imgdev->enroll_data,
+				sample->length);
+			memcpy(item->data, sample->data, sample->length);
+
+			fp_print_data_free(print);
+			if (job->consolidated) {
+				fp_print_data_free(imgdev->enroll_data);
+				imgdev->enroll_data = job->consolidated;
+				job->consolidated = NULL;
+			}
+			imgdev->enroll_stage++;
+			if (imgdev->enroll_stage == dev->nr_enroll_stages)
+				imgdev->action_result = FP_ENROLL_COMPLETE;
+			else
+				imgdev->action_result = FP_ENROLL_PASS;
+			break;
+		case IMG_ACTION_VERIFY:
+			imgdev->acquire_data = print;
+			break;
+		case IMG_ACTION_IDENTIFY:
+			imgdev->acquire_data = print;
+			imgdev->identify_match_offset = job->match_offset;
+			if (job->matches) {
+				g_free(dev->identify_matches);
+				dev->identify_matches = job->matches;
+				dev->identify_nr_matches = job->nr_matches;
+			}
+			break;
+		default:
+			BUG();
+			break;
+		}
+	} else {
+		g_free(job->matches);
+	}
+	job->print = NULL;
+	job->matches = NULL;
+	job_unref(job);
+
+	imgdev->action_state = IMG_ACQUIRE_STATE_AWAIT_FINGER_OFF;
+	/* a deferred job already told the driver when it was queued */
+	if (!told_driver)
+		dev_change_state(imgdev, IMGDEV_STATE_AWAIT_FINGER_OFF);
+
+	if (imgdev->finger_off_pending) {
+		imgdev->finger_off_pending = FALSE;
+		fpi_imgdev_report_finger_status(imgdev, FALSE);
+	}
+}
+
+/* Report the scores still queued before the result, while the job is
+ * current, so that stopping the identification from their callback
+ * cancels it. Returns FALSE if it did, the job is then freed. */
+static gboolean job_report_last_scores(struct imgdev_job *job)
+{
+	job_report_scores(job);
+	if (job->cancelled) {
+		job_unref(job);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/* runs on the event loop, once a worker is done with the job */
+static void job_complete(void *data)
+{
+	struct imgdev_job *job = data;
+
+	/* only the event loop sets it once the worker is done, and the device
+	 * may be gone by now */
+	if (job->cancelled) {
+		job_unref(job);
+		return;
+	}
+	if (!job_report_last_scores(job))
+		return;
+
+	job->imgdev->processing_job = NULL;
+	finish_processing(job);
+}
+
+static void process_pool_func(gpointer data, gpointer user_data)
+{
+	struct imgdev_job *job = data;
+	struct fp_img_dev *imgdev = user_data;
+	int cpu = g_atomic_int_get(&imgdev->processing_cpu);
+	gboolean cancelled;
+
+	if (cpu != imgdev->worker_cpu && fpi_set_thread_cpu(cpu) == 0)
+		imgdev->worker_cpu = cpu;
+	fpi_thread_drop_realtime();
+
+	process_img(job);
+
+	g_mutex_lock(&imgdev->job_lock);
+	job->done = TRUE;
+	cancelled = job->cancelled;
+	g_cond_broadcast(&imgdev->job_cond);
+	g_mutex_unlock(&imgdev->job_lock);
+
+	/* a job cancelled in the meantime belongs to imgdev_cancel_job() */
+	if (!cancelled)
+		fpi_poll_defer(job_complete, job);
+}
+
+/* Every device has its own worker thread, so that devices used at the same
+ * time do not wait for each other, and it can be pinned to a CPU with
+ * fp_dev_set_processing_cpu(). */
+static gboolean process_pool_push(struct imgdev_job *job)
+{
+	struct fp_img_dev *imgdev = job->imgdev;
+
+	if (!fpi_poll_can_defer())
+		return FALSE;
+
+	if (!imgdev->process_pool) {
+		imgdev->process_pool = g_thread_pool_new(process_pool_func,
+			imgdev, 1, TRUE, NULL);
+		if (!imgdev->process_pool)
+			return FALSE;
+	}
+
+	return g_thread_pool_push(imgdev->process_pool, job, NULL);
+}
+
+/* Drop the image being processed, if any, once the worker no longer uses
+ * the device. An identification is abandoned at the next gallery print,
+ * otherwise the worker is bounded by a single extraction and match. */
+static void imgdev_cancel_job(struct fp_img_dev *imgdev)
+{
+	struct imgdev_job *job = imgdev->processing_job;
+	gboolean done;
+
+	imgdev->finger_off_pending = FALSE;
+	if (!job)
+		return;
+	imgdev->processing_job = NULL;
+
+	g_mutex_lock(&imgdev->job_lock);
+	job->cancelled = TRUE;
+	g_atomic_int_set(&job->ctl.cancelled, 1);
+	done = job->done;
+	while (!job->done)
+		g_cond_wait(&imgdev->job_cond, &imgdev->job_lock);
+	g_mutex_unlock(&imgdev->job_lock);
+
+	/* otherwise job_complete() is already on its way and frees it */
+	if (!done)
+		job_unref(job);
+}
+
+/* Frames of a capture stream, waiting for the application to take them. They
+ * skip the processing worker as they only need to be standardized. */
+struct imgdev_stream {
+	GQueue frames;
+	unsigned int max_queued;
+	unsigned int flags;
+	/* a frame was passed to the application, which did not ack it yet */
+	gboolean delivered;
+	unsigned int dropped;
+};
+
+static void stream_free(struct fp_img_dev *imgdev)
+{
+	struct imgdev_stream *stream = imgdev->stream;
+	struct fp_img *img;
+
+	if (!stream)
+		return;
+
+	if (stream->dropped)
+		fp_dbg("%u frames dropped", stream->dropped);
+	while ((img = g_queue_pop_head(&stream->frames)))
+		fp_img_free(img);
+	g_free(stream);
+	imgdev->stream = NULL;
+}
+
+static gboolean stream_full(struct imgdev_stream *stream)
+{
+	return stream->delivered
+		&& g_queue_get_length(&stream->frames) >= stream->max_queued;
+}
+
+/* what to do with the images of a finger on the sensor */
+static int stream_capture_state(struct fp_img_dev *imgdev)
+{
+	struct imgdev_stream *stream = imgdev->stream;
+
+	if (stream && stream_full(stream)
+			&& !(stream->flags & FP_CAPTURE_STREAM_DROP_OLDEST))
+		return IMG_ACQUIRE_STATE_STREAM_PAUSED;
+	return IMG_ACQUIRE_STATE_AWAIT_IMAGE;
+}
+
+/* Hand the oldest frame to the application, unless it still has one. This
+ * may call back into the stream or stop it, so nothing can be touched
+ * afterwards. */
+static void stream_deliver(struct fp_img_dev *imgdev)
+{
+	struct imgdev_stream *stream = imgdev->stream;
+	struct fp_img *img;
+
+	if (stream->delivered || g_queue_is_empty(&stream->frames))
+		return;
+
+	img = g_queue_pop_head(&stream->frames);
+	stream->delivered = TRUE;
+	if (imgdev->action_state == IMG_ACQUIRE_STATE_STREAM_PAUSED) {
+		fp_dbg("resuming stream");
+		imgdev->action_state = IMG_ACQUIRE_STATE_AWAIT_IMAGE;
+	}
+
+	fpi_drvcb_report_capture_frame(imgdev->dev, img);
+}
+
+/* The driver stays in its capture state, so that drivers which capture for as
+ * long as the finger is present go on with the next frame. */
+static void stream_frame(struct fp_img_dev *imgdev, struct fp_img *img)
+{
+	struct imgdev_stream *stream = imgdev->stream;
+
+	if (sanitize_image(imgdev, &img) < 0) {
+		fp_img_free(img);
+		return;
+	}
+	fp_img_standardize(img);
+
+	if (g_queue_get_length(&stream->frames) >= stream->max_queued) {
+		fp_img_free(g_queue_pop_head(&stream->frames));
+		stream->dropped++;
+	}
+	g_queue_push_tail(&stream->frames, img);
+
+	imgdev->action_state = stream_capture_state(imgdev);
+	if (imgdev->action_state == IMG_ACQUIRE_STATE_STREAM_PAUSED)
+		fp_dbg("pausing stream");
+
+	stream_deliver(imgdev);
+}
+
+int fpi_imgdev_capture_stream_ack(struct fp_img_dev *imgdev)
+{
+	struct imgdev_stream *stream = imgdev->stream;
+
+	if (!stream || !stream->delivered)
+		return -EINVAL;
+
+	stream->delivered = FALSE;
+	stream_deliver(imgdev);
+	return 0;
+}
+
 void fpi_imgdev_image_captured(struct fp_img_dev *imgdev, struct fp_img *img)
 {
-	struct fp_print_data *print;
+	struct imgdev_job *job;
 	int r;
 	fp_dbg("");
+	fpi_trace(img_captured, imgdev->dev, img->width, img->height,
+		img->length);
 
+	/* the image is ours either way: warm sensors capture while idle, and
+	 * paused streams drop their frames until the application acks one */
 	if (imgdev->action_state != IMG_ACQUIRE_STATE_AWAIT_IMAGE) {
 		fp_dbg("ignoring due to current state %d", imgdev->action_state);
+		fp_img_free(img);
+		return;
+	}
+
+	if (imgdev->stream) {
+		stream_frame(imgdev, img);
 		return;
 	}
 
 	if (imgdev->action_result) {
 		fp_dbg("not overwriting existing action result");
+		fp_img_free(img);
 		return;
 	}
 
@@ -247,70 +875,68 @@ void fpi_imgdev_image_captured(struct fp_img_dev *imgdev, struct fp_img *img)
 	if (r < 0) {
 		imgdev->action_result = r;
 		fp_img_free(img);
-		goto next_state;
+		imgdev->action_state = IMG_ACQUIRE_STATE_AWAIT_FINGER_OFF;
+		dev_change_state(imgdev, IMGDEV_STATE_AWAIT_FINGER_OFF);
+		return;
 	}
 
-	fp_img_standardize(img);
-	imgdev->acquire_img = img;
-	if (imgdev->action != IMG_ACTION_CAPTURE) {
-		r = fpi_img_to_print_data(imgdev, img, &print);
-		if (r < 0) {
-			fp_dbg("image to print data conversion error: %d", r);
-			imgdev->action_result = FP_ENROLL_RETRY;
-			goto next_state;
-		} else if (img->minutiae->num < MIN_ACCEPTABLE_MINUTIAE) {
-			fp_dbg("not enough minutiae, %d/%d", img->minutiae->num,
-				MIN_ACCEPTABLE_MINUTIAE);
-			fp_print_data_free(print);
-			/* depends on FP_ENROLL_RETRY == FP_VERIFY_RETRY */
-			imgdev->action_result = FP_ENROLL_RETRY;
-			goto next_state;
-		}
+	job = g_malloc0(sizeof(*job));
+	job->refs = 1;
+	job->imgdev = imgdev;
+	job->action = imgdev->action;
+	job->img = img;
+	job->consolidate = imgdev->action == IMG_ACTION_ENROLL
+		&& imgdev->consolidate_enroll
+		&& imgdev->enroll_stage + 1 == imgdev->dev->nr_enroll_stages;
+	job->finger_on_time = imgdev->finger_on_time;
+	job->captured_time = g_get_monotonic_time();
+	stats_add(imgdev, FP_DEV_STAGE_CAPTURE, job->finger_on_time,
+		job->captured_time);
+	imgdev->finger_on_time = 0;
+
+	job->deferred = TRUE;
+	if (process_pool_push(job)) {
+		imgdev->processing_job = job;
+		imgdev->action_state = IMG_ACQUIRE_STATE_PROCESSING;
+		/* the driver can look for the finger leaving meanwhile */
+		dev_change_state(imgdev, IMGDEV_STATE_AWAIT_FINGER_OFF);
+		return;
 	}
 
-	imgdev->acquire_data = print;
-	switch (imgdev->action) {
-	case IMG_ACTION_ENROLL:
-		if (!imgdev->enroll_data) {
-			imgdev->enroll_data = fpi_print_data_new(imgdev->dev);
-		}
-		BUG_ON(g_slist_length(print->prints) != 1);
-		/* Move print data from acquire data into enroll_data */
-		imgdev->enroll_data->prints =
-			g_slist_prepend(imgdev->enroll_data->prints, print->prints->data);
-		print->prints = g_slist_remove(print->prints, print->prints->data);
-
-		fp_print_data_free(imgdev->acquire_data);
-		imgdev->acquire_data = NULL;
-		imgdev->enroll_stage++;
-		if (imgdev->enroll_stage == imgdev->dev->nr_enroll_stages)
-			imgdev->action_result = FP_ENROLL_COMPLETE;
-		else
-			imgdev->action_result = FP_ENROLL_PASS;
-		break;
-	case IMG_ACTION_VERIFY:
-		verify_process_img(imgdev);
-		break;
-	case IMG_ACTION_IDENTIFY:
-		identify_process_img(imgdev);
-		break;
-	case IMG_ACTION_CAPTURE:
-		imgdev->action_result = FP_CAPTURE_COMPLETE;
-		break;
-	default:
-		BUG();
-		break;
-	}
+	/* nothing can wake the event loop up, so process it right here */
+	job->deferred = FALSE;
+	process_img(job);
+	job->done = TRUE;
+	imgdev->processing_job = job;
+	if (!job_report_last_scores(job))
+		return;
+	imgdev->processing_job = NULL;
+	finish_processing(job);
+}
 
-next_state:
-	imgdev->action_state = IMG_ACQUIRE_STATE_AWAIT_FINGER_OFF;
-	dev_change_state(imgdev, IMGDEV_STATE_AWAIT_FINGER_OFF);
+int fpi_imgdev_set_processing_cpu(struct fp_img_dev *imgdev, int cpu)
+{
+	if (!fpi_thread_cpu_supported())
+		return -ENOTSUP;
+
+	/* the worker picks it up before its next image */
+	g_atomic_int_set(&imgdev->processing_cpu, cpu);
+	return 0;
 }
 
 void fpi_imgdev_session_error(struct fp_img_dev *imgdev, int error)
 {
 	fp_dbg("error %d", error);
 	BUG_ON(error == 0);
+
+	/* no operation to report to, stop relying on the sensor */
+	if (imgdev->warm_state != IMG_WARM_NONE) {
+		if (imgdev->warm_state == IMG_WARM_IDLE)
+			warm_cool_down(imgdev);
+		return;
+	}
+
+	imgdev->warm_failed = TRUE;
 	switch (imgdev->action) {
 	case IMG_ACTION_ENROLL:
 		fpi_drvcb_enroll_stage_completed(imgdev->dev, error, NULL, NULL);
@@ -355,14 +981,19 @@ void fpi_imgdev_activate_complete(struct fp_img_dev *imgdev, int status)
 	if (status == 0) {
 		imgdev->action_state = IMG_ACQUIRE_STATE_AWAIT_FINGER_ON;
 		dev_change_state(imgdev, IMGDEV_STATE_AWAIT_FINGER_ON);
+	} else {
+		imgdev->warm_failed = TRUE;
 	}
 }
 
-void fpi_imgdev_deactivate_complete(struct fp_img_dev *imgdev)
+static void report_stopped(struct fp_img_dev *imgdev)
 {
-	fp_dbg("");
+	enum fp_imgdev_action action = imgdev->action;
 
-	switch (imgdev->action) {
+	/* cleared first, the callbacks may start the next operation */
+	imgdev->action = IMG_ACTION_NONE;
+
+	switch (action) {
 	case IMG_ACTION_ENROLL:
 		fpi_drvcb_enroll_stopped(imgdev->dev);
 		break;
@@ -376,12 +1007,52 @@ void fpi_imgdev_deactivate_complete(struct fp_img_dev *imgdev)
 		fpi_drvcb_capture_stopped(imgdev->dev);
 		break;
 	default:
-		fp_err("unhandled action %d", imgdev->action);
+		fp_err("unhandled action %d", action);
 		break;
 	}
+}
+
+static int dev_activate(struct fp_img_dev *imgdev, enum fp_imgdev_state state);
+
+/* the sensor of a warm session was deactivated, either because it was idle
+ * for too long or because the device is being closed */
+static void warm_cooled(struct fp_img_dev *imgdev)
+{
+	int r;
+
+	fp_dbg("");
+	imgdev->warm_state = IMG_WARM_NONE;
+	imgdev->action_state = 0;
+
+	if (imgdev->close_pending) {
+		imgdev->close_pending = FALSE;
+		do_close(imgdev);
+		return;
+	}
+
+	/* an operation started while the sensor was deactivating */
+	if (imgdev->action == IMG_ACTION_NONE)
+		return;
+
+	imgdev->action_state = IMG_ACQUIRE_STATE_ACTIVATING;
+	r = dev_activate(imgdev, IMGDEV_STATE_AWAIT_FINGER_ON);
+	if (r < 0) {
+		fp_err("activation failed with error %d", r);
+		fpi_imgdev_activate_complete(imgdev, r);
+	}
+}
+
+void fpi_imgdev_deactivate_complete(struct fp_img_dev *imgdev)
+{
+	fp_dbg("");
+
+	if (imgdev->warm_state == IMG_WARM_COOLING) {
+		warm_cooled(imgdev);
+		return;
+	}
 
-	imgdev->action = IMG_ACTION_NONE;
 	imgdev->action_state = 0;
+	report_stopped(imgdev);
 }
 
 int fpi_imgdev_get_img_width(struct fp_img_dev *imgdev)
@@ -428,15 +1099,80 @@ static void dev_deactivate(struct fp_img_dev *imgdev)
 	return imgdrv->deactivate(imgdev);
 }
 
+static void warm_timer_cancel(struct fp_img_dev *imgdev)
+{
+	if (!imgdev->warm_timer)
+		return;
+	fpi_timeout_cancel(imgdev->warm_timer);
+	imgdev->warm_timer = NULL;
+}
+
+/* deactivate a sensor left active by a warm session */
+static void warm_cool_down(struct fp_img_dev *imgdev)
+{
+	fp_dbg("");
+	warm_timer_cancel(imgdev);
+	imgdev->warm_state = IMG_WARM_COOLING;
+	imgdev->action_state = IMG_ACQUIRE_STATE_DEACTIVATING;
+	dev_deactivate(imgdev);
+}
+
+static void warm_timer_expired(void *data)
+{
+	struct fp_img_dev *imgdev = data;
+
+	fp_dbg("idle for %ums", imgdev->warm_timeout);
+	imgdev->warm_timer = NULL;
+	warm_cool_down(imgdev);
+}
+
+static gboolean warm_timer_start(struct fp_img_dev *imgdev)
+{
+	warm_timer_cancel(imgdev);
+	imgdev->warm_timer = fpi_timeout_add(imgdev->warm_timeout,
+		warm_timer_expired, imgdev);
+	return imgdev->warm_timer != NULL;
+}
+
+void fpi_imgdev_set_warm_session(struct fp_img_dev *imgdev,
+	unsigned int idle_timeout_ms)
+{
+	imgdev->warm_timeout = idle_timeout_ms;
+	if (imgdev->warm_state != IMG_WARM_IDLE)
+		return;
+
+	/* an idle sensor gets the new timeout from now on */
+	if (idle_timeout_ms == 0 || !warm_timer_start(imgdev))
+		warm_cool_down(imgdev);
+}
+
 static int generic_acquire_start(struct fp_dev *dev, int action)
 {
 	struct fp_img_dev *imgdev = dev->priv;
 	int r;
 	fp_dbg("action %d", action);
 	imgdev->action = action;
-	imgdev->action_state = IMG_ACQUIRE_STATE_ACTIVATING;
 	imgdev->enroll_stage = 0;
+	imgdev->finger_off_pending = FALSE;
+	imgdev->warm_failed = FALSE;
+
+	switch (imgdev->warm_state) {
+	case IMG_WARM_IDLE:
+		/* the sensor is still active, go straight to finger detection */
+		fp_dbg("resuming warm sensor");
+		warm_timer_cancel(imgdev);
+		imgdev->warm_state = IMG_WARM_NONE;
+		imgdev->action_state = IMG_ACQUIRE_STATE_ACTIVATING;
+		fpi_imgdev_activate_complete(imgdev, 0);
+		return 0;
+	case IMG_WARM_COOLING:
+		fp_dbg("activating once the sensor is deactivated");
+		return 0;
+	default:
+		break;
+	}
 
+	imgdev->action_state = IMG_ACQUIRE_STATE_ACTIVATING;
 	r = dev_activate(imgdev, IMGDEV_STATE_AWAIT_FINGER_ON);
 	if (r < 0)
 		fp_err("activation failed with error %d", r);
@@ -447,8 +1183,7 @@ static int generic_acquire_start(struct fp_dev *dev, int action)
 
 static void generic_acquire_stop(struct fp_img_dev *imgdev)
 {
-	imgdev->action_state = IMG_ACQUIRE_STATE_DEACTIVATING;
-	dev_deactivate(imgdev);
+	imgdev_cancel_job(imgdev);
 
 	fp_print_data_free(imgdev->acquire_data);
 	fp_print_data_free(imgdev->enroll_data);
@@ -457,6 +1192,46 @@ static void generic_acquire_stop(struct fp_img_dev *imgdev)
 	imgdev->enroll_data = NULL;
 	imgdev->acquire_img = NULL;
 	imgdev->action_result = 0;
+	stream_free(imgdev);
+
+	/* the operation never got to activate the sensor, which is still
+	 * deactivating: warm_cooled() will see there is nothing to resume */
+	if (imgdev->warm_state == IMG_WARM_COOLING) {
+		report_stopped(imgdev);
+		return;
+	}
+
+	/* in a warm session the sensor is left active, the next operation
+	 * only sends it back to finger detection */
+	if (imgdev->warm_timeout && !imgdev->warm_failed
+			&& imgdev->action_state != IMG_ACQUIRE_STATE_ACTIVATING
+			&& warm_timer_start(imgdev)) {
+		fp_dbg("keeping sensor warm for %ums", imgdev->warm_timeout);
+		imgdev->warm_state = IMG_WARM_IDLE;
+		imgdev->action_state = IMG_ACQUIRE_STATE_NONE;
+		report_stopped(imgdev);
+		return;
+	}
+
+	imgdev->action_state = IMG_ACQUIRE_STATE_DEACTIVATING;
+	dev_deactivate(imgdev);
+}
+
+int fpi_imgdev_capture_stream_start(struct fp_img_dev *imgdev,
+	unsigned int max_queued, unsigned int flags)
+{
+	struct imgdev_stream *stream = g_malloc0(sizeof(*stream));
+	int r;
+
+	g_queue_init(&stream->frames);
+	stream->max_queued = max_queued;
+	stream->flags = flags;
+	imgdev->stream = stream;
+
+	r = generic_acquire_start(imgdev->dev, IMG_ACTION_CAPTURE);
+	if (r < 0)
+		stream_free(imgdev);
+	return r;
 }
 
 static int img_dev_enroll_start(struct fp_dev *dev)
@@ -502,8 +1277,8 @@ static int img_dev_identify_stop(struct fp_dev *dev, gboolean iterating)
 {
 	struct fp_img_dev *imgdev = dev->priv;
 	BUG_ON(imgdev->action != IMG_ACTION_IDENTIFY);
-	generic_acquire_stop(imgdev);
 	imgdev->identify_match_offset = 0;
+	generic_acquire_stop(imgdev);
 	return 0;
 }
 
@@ -0,0 +1,513 @@
+/*
+ * Buffered message logging for libfprint
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include <glib.h>
+
+#include "fp_internal.h"
+
+/*
+ * Formatting a message costs far more than the code logging it on the hot
+ * paths of debug builds. Once fp_set_log_buffer() was called, fpi_log() only
+ * records the format string and the raw arguments of each message in a ring
+ * owned by the calling thread, without taking any lock. The messages are
+ * formatted later, by a background thread or fp_flush_log(), and written to
+ * the usual stdio output in the order they were logged.
+ *
+ * Format strings are kept by pointer, which holds as every caller passes a
+ * literal. String arguments are copied, up to LOG_STRINGS bytes per message.
+ */
+
+#define LOG_MAX_ARGS 8
+#define LOG_STRINGS 96
+#define LOG_FLUSH_INTERVAL_USEC (100 * 1000)
+
+enum log_arg_type {
+	LOG_ARG_INT,
+	LOG_ARG_UINT,
+	LOG_ARG_DOUBLE,
+	LOG_ARG_POINTER,
+	LOG_ARG_STRING,
+};
+
+union log_arg {
+	long long i;
+	unsigned long long u;
+	double d;
+	const void *p;
+	/* offset of a copied string in the strings of the record, -1 if it
+	 * did not fit */
+	int str;
+};
+
+struct log_record {
+	gint64 time;
+	enum fpi_log_level level;
+	const char *component;
+	const char *function;
+	/* NULL when the message was formatted right away into strings, as
+	 * its arguments could not be recorded */
+	const char *format;
+	union log_arg args[LOG_MAX_ARGS];
+	char strings[LOG_STRINGS];
+};
+
+/* A single producer, single consumer ring. Only its thread advances head
+ * and only the flush advances tail. */
+struct log_ring {
+	struct log_record *records;
+	guint size;
+	gint head;
+	gint tail;
+	gint dropped;
+	/* the thread is gone, the ring is freed once drained */
+	gint orphaned;
+};
+
+/* records per ring for new rings, 0 when logging straight to stdio */
+static gint ring_size = 0;
+
+/* every ring, only changed under the lock, which also serializes flushes */
+static GMutex rings_lock;
+static GSList *rings = NULL;
+
+static void ring_orphan(gpointer data)
+{
+	struct log_ring *ring = data;
+	g_atomic_int_set(&ring->orphaned, 1);
+}
+
+static GPrivate thread_ring = G_PRIVATE_INIT(ring_orphan);
+
+static GThread *flush_thread = NULL;
+static GMutex flush_thread_lock;
+static GCond flush_thread_cond;
+static gboolean flush_thread_stop;
+
+static struct log_ring *get_ring(void)
+{
+	struct log_ring *ring = g_private_get(&thread_ring);
+	guint size;
+
+	if (ring)
+		return ring;
+
+	/* buffering may have been turned off meanwhile */
+	size = g_atomic_int_get(&ring_size);
+	if (size == 0)
+		return NULL;
+
+	ring = g_new0(struct log_ring, 1);
+	ring->records = g_new(struct log_record, size);
+	ring->size = size;
+	g_private_set(&thread_ring, ring);
+
+	g_mutex_lock(&rings_lock);
+	rings = g_slist_prepend(rings, ring);
+	g_mutex_unlock(&rings_lock);
+	return ring;
+}
+
+/* Walks a conversion specification, returning the conversion character and
+ * the length modifier, or 0 if it cannot be recorded. */
+static char parse_spec(const char **format, char *length)
+{
+	const char *f = *format;
+
+	while (*f && strchr("-+ #0", *f))
+		f++;
+	while (g_ascii_isdigit(*f))
+		f++;
+	if (*f == '.') {
+		f++;
+		while (g_ascii_isdigit(*f))
+			f++;
+	}
+
+	*length = 0;
+	if (*f && strchr("hlLzjt", *f)) {
+		*length = *f++;
+		/* hh and ll */
+		if ((*length == 'h' || *length == 'l') && *f == *length) {
+			*length = g_ascii_toupper(*length);
+			f++;
+		}
+	}
+
+	*format = f + 1;
+	if (*f && strchr("diouxXcpsfFeEgGaA%", *f))
+		return *f;
+	return 0;
+}
+
+static enum log_arg_type arg_type(char conv)
+{
+	switch (conv) {
+	case 'd':
+	case 'i':
+		return LOG_ARG_INT;
+	case 'p':
+		return LOG_ARG_POINTER;
+	case 's':
+		return LOG_ARG_STRING;
+	case 'f':
+	case 'F':
+	case 'e':
+	case 'E':
+	case 'g':
+	case 'G':
+	case 'a':
+	case 'A':
+		return LOG_ARG_DOUBLE;
+	default:
+		return LOG_ARG_UINT;
+	}
+}
+
+/* Copies the arguments of the format into the record, FALSE if it has too
+ * many of them or an unsupported conversion. */
+static gboolean record_args(struct log_record *record, va_list args)
+{
+	const char *f = record->format;
+	size_t strings_used = 0;
+	int n = 0;
+	char conv, length;
+
+	while ((f = strchr(f, '%'))) {
+		f++;
+		conv = parse_spec(&f, &length);
+		if (conv == '%')
+			continue;
+		if (conv == 0 || n == LOG_MAX_ARGS)
+			return FALSE;
+
+		switch (arg_type(conv)) {
+		case LOG_ARG_INT:
+			if (length == 'L' || length == 'j')
+				record->args[n].i = va_arg(args, long long);
+			else if (length == 'l')
+				record->args[n].i = va_arg(args, long);
+			else if (length == 'z' || length == 't')
+				record->args[n].i = va_arg(args, ssize_t);
+			else
+				record->args[n].i = va_arg(args, int);
+			break;
+		case LOG_ARG_UINT:
+			if (length == 'L' || length == 'j')
+				record->args[n].u = va_arg(args,
+					unsigned long long);
+			else if (length == 'l')
+				record->args[n].u = va_arg(args, unsigned long);
+			else if (length == 'z' || length == 't')
+				record->args[n].u = va_arg(args, size_t);
+			else
+				record->args[n].u = va_arg(args, unsigned int);
+			break;
+		case LOG_ARG_DOUBLE:
+			if (length == 'L')
+				record->args[n].d = va_arg(args, long double);
+			else
+				record->args[n].d = va_arg(args, double);
+			break;
+		case LOG_ARG_POINTER:
+			record->args[n].p = va_arg(args, void *);
+			break;
+		case LOG_ARG_STRING: {
+			const char *s = va_arg(args, const char *);
+			size_t len;
+
+			if (!s)
+				s = "(null)";
+			len = strlen(s) + 1;
+			if (strings_used + len > LOG_STRINGS) {
+				record->args[n].str = -1;
+				break;
+			}
+			memcpy(record->strings + strings_used, s, len);
+			record->args[n].str = strings_used;
+			strings_used += len;
+			break;
+		}
+		}
+		n++;
+	}
+
+	return TRUE;
+}
+
+gboolean fpi_log_record(enum fpi_log_level level, const char *component,
+	const char *function, const char *format, va_list args)
+{
+	struct log_ring *ring;
+	struct log_record *record;
+	guint head, tail;
+	va_list copy;
+
+	if (g_atomic_int_get(&ring_size) == 0)
+		return FALSE;
+	ring = get_ring();
+	if (!ring)
+		return FALSE;
+
+	head = ring->head;
+	tail = g_atomic_int_get(&ring->tail);
+	if (head - tail == ring->size) {
+		g_atomic_int_inc(&ring->dropped);
+		return TRUE;
+	}
+
+	record = &ring->records[head % ring->size];
+	record->time = g_get_monotonic_time();
+	record->level = level;
+	record->component = component;
+	record->function = function;
+	record->format = format;
+
+	va_copy(copy, args);
+	if (!record_args(record, copy)) {
+		record->format = NULL;
+		g_vsnprintf(record->strings, LOG_STRINGS, format, args);
+	}
+	va_end(copy);
+
+	/* publishes the record to the flush */
+	g_atomic_int_set(&ring->head, head + 1);
+	return TRUE;
+}
+
+static void append_arg(GString *out, const char *spec, char conv,
+	char length, const struct log_record *record, int n)
+{
+	const union log_arg *arg = &record->args[n];
+
+	switch (arg_type(conv)) {
+	case LOG_ARG_INT:
+		if (length == 'L' || length == 'j')
+			g_string_append_printf(out, spec, arg->i);
+		else if (length == 'l')
+			g_string_append_printf(out, spec, (long) arg->i);
+		else if (length == 'z' || length == 't')
+			g_string_append_printf(out, spec, (ssize_t) arg->i);
+		else
+			g_string_append_printf(out, spec, (int) arg->i);
+		break;
+	case LOG_ARG_UINT:
+		if (length == 'L' || length == 'j')
+			g_string_append_printf(out, spec, arg->u);
+		else if (length == 'l')
+			g_string_append_printf(out, spec, (unsigned long) arg->u);
+		else if (length == 'z' || length == 't')
+			g_string_append_printf(out, spec, (size_t) arg->u);
+		else
+			g_string_append_printf(out, spec, (unsigned int) arg->u);
+		break;
+	case LOG_ARG_DOUBLE:
+		if (length == 'L')
+			g_string_append_printf(out, spec, (long double) arg->d);
+		else
+			g_string_append_printf(out, spec, arg->d);
+		break;
+	case LOG_ARG_POINTER:
+		g_string_append_printf(out, spec, arg->p);
+		break;
+	case LOG_ARG_STRING:
+		g_string_append_printf(out, spec, arg->str < 0 ? "(truncated)" :
+			record->strings + arg->str);
+		break;
+	}
+}
+
+static void format_record(GString *out, const struct log_record *record)
+{
+	const char *f = record->format;
+	const char *conv_start;
+	char spec[32];
+	char conv, length;
+	int n = 0;
+
+	g_string_truncate(out, 0);
+	if (!f) {
+		g_string_append(out, record->strings);
+		return;
+	}
+
+	while ((conv_start = strchr(f, '%'))) {
+		g_string_append_len(out, f, conv_start - f);
+		f = conv_start + 1;
+		conv = parse_spec(&f, &length);
+		if (conv == '%') {
+			g_string_append_c(out, '%');
+			continue;
+		}
+		g_strlcpy(spec, conv_start, MIN(sizeof(spec),
+			(size_t) (f - conv_start) + 1));
+		append_arg(out, spec, conv, length, record, n++);
+	}
+	g_string_append(out, f);
+}
+
+static void write_record(GString *out, const struct log_record *record)
+{
+	format_record(out, record);
+	fpi_log_write(record->level, record->component, record->function,
+		"%s", out->str);
+}
+
+/* Formats every record so far, merging the rings in logging order. */
+static void flush_rings(void)
+{
+	GString *out = g_string_new(NULL);
+	GSList *elem, *next;
+
+	g_mutex_lock(&rings_lock);
+
+	for (;;) {
+		struct log_ring *oldest = NULL;
+		struct log_record *record = NULL;
+
+		for (elem = rings; elem; elem = g_slist_next(elem)) {
+			struct log_ring *ring = elem->data;
+			guint tail = ring->tail;
+			struct log_record *r;
+
+			if (g_atomic_int_get(&ring->head) == (gint) tail)
+				continue;
+			r = &ring->records[tail % ring->size];
+			if (!record || r->time < record->time) {
+				oldest = ring;
+				record = r;
+			}
+		}
+		if (!oldest)
+			break;
+
+		write_record(out, record);
+		/* hands the slot back to the thread */
+		g_atomic_int_set(&oldest->tail, oldest->tail + 1);
+	}
+
+	for (elem = rings; elem; elem = next) {
+		struct log_ring *ring = elem->data;
+		int dropped = g_atomic_int_and(&ring->dropped, 0);
+
+		next = g_slist_next(elem);
+		if (dropped)
+			fpi_log_write(FPRINT_LOG_LEVEL_WARNING, "log", __func__,
+				"%d messages dropped", dropped);
+
+		if (g_atomic_int_get(&ring->orphaned)
+				&& g_atomic_int_get(&ring->head) == ring->tail) {
+			rings = g_slist_delete_link(rings, elem);
+			g_free(ring->records);
+			g_free(ring);
+		}
+	}
+
+	g_mutex_unlock(&rings_lock);
+	g_string_free(out, TRUE);
+}
+
+static gpointer flush_thread_func(gpointer data)
+{
+	gint64 deadline;
+
+	fpi_thread_drop_realtime();
+	g_mutex_lock(&flush_thread_lock);
+	while (!flush_thread_stop) {
+		deadline = g_get_monotonic_time() + LOG_FLUSH_INTERVAL_USEC;
+		g_cond_wait_until(&flush_thread_cond, &flush_thread_lock,
+			deadline);
+		g_mutex_unlock(&flush_thread_lock);
+		flush_rings();
+		g_mutex_lock(&flush_thread_lock);
+	}
+	g_mutex_unlock(&flush_thread_lock);
+	return NULL;
+}
+
+static void stop_flush_thread(void)
+{
+	if (!flush_thread)
+		return;
+
+	g_mutex_lock(&flush_thread_lock);
+	flush_thread_stop = TRUE;
+	g_cond_signal(&flush_thread_cond);
+	g_mutex_unlock(&flush_thread_lock);
+	g_thread_join(flush_thread);
+	flush_thread = NULL;
+}
+
+/**
+ * fp_set_log_buffer:
+ * @records: how many messages each thread can buffer, or 0 to print them
+ * right away
+ *
+ * Defer the formatting of the messages logged by libfprint, see
+ * fp_set_debug(). Logging a message then only copies its arguments into a
+ * buffer owned by the calling thread, which is much cheaper than printing
+ * it, and a background thread prints the buffered messages every 100
+ * milliseconds, in the order they were logged. A thread logging more than
+ * @records messages in between loses the excess, and a warning tells how
+ * many were dropped.
+ *
+ * Threads which already logged a message keep their buffer size. Turning
+ * buffering off prints the messages still buffered.
+ *
+ * Returns: 0 on success, or -EINVAL if @records is too large.
+ */
+API_EXPORTED int fp_set_log_buffer(unsigned int records)
+{
+	if (records > G_MAXINT / sizeof(struct log_record))
+		return -EINVAL;
+
+	g_atomic_int_set(&ring_size, records);
+	if (records == 0) {
+		stop_flush_thread();
+		flush_rings();
+		return 0;
+	}
+
+	if (!flush_thread) {
+		flush_thread_stop = FALSE;
+		flush_thread = g_thread_new("fp-log", flush_thread_func, NULL);
+	}
+	return 0;
+}
+
+/**
+ * fp_flush_log:
+ *
+ * Print the messages buffered since fp_set_log_buffer() was called, without
+ * waiting for the background thread. This can be called from any thread,
+ * for example before inspecting a failure.
+ */
+API_EXPORTED void fp_flush_log(void)
+{
+	flush_rings();
+}
+
+void fpi_log_exit(void)
+{
+	fp_set_log_buffer(0);
+}
@@ -83,15 +83,86 @@ identified are necessarily the best available for the purpose.
 #cat: bz_final_loop - (declared static) a final postprocess after
 #cat:            the main match table traversal which looks to combine
 #cat:            clusters of compatible paths
+#cat: bz_match_score_bounded - as bz_match_score, but only decides
+#cat:            whether the score reaches a given threshold, stopping
+#cat:            as soon as that is known
+#cat:
+#cat: bz_match_gallery_ctx - bz_match against an explicitly supplied
+#cat:            gallery pointer list rather than the context's own
+#cat: bz_match_tables_ctx - bz_match against explicitly supplied probe
+#cat:            and gallery pointer lists
+#cat:
+#cat: bz_match, bz_match_score, bz_match_score_bounded and bz_sift each
+#cat: have a reentrant *_ctx()
+#cat: variant operating on an explicit matcher context; the plain
+#cat: routines use the default context.
 
 ***********************************************************************/
 
 #include <stdio.h>
+#include <string.h>
 #include <bozorth.h>
 
 static const int verbose_bozorth = 0;
 static const int m1_xyt = 0;
 
+/***********************************************************************/
+/* Most minutia pairs bz_comp() looks at are rejected on their distance */
+/* or opposing directions alone.  With GCC vector extensions those      */
+/* tests are done for BZ_COMP_LANES pairs at a time, and pairs that     */
+/* would be rejected are skipped without running the scalar code.  The  */
+/* scalar code still runs, unchanged and in the same order, for every   */
+/* other pair, so the table built is identical.  Define BZ_COMP_SCALAR  */
+/* to build without the screening.                                      */
+/***********************************************************************/
+#if defined( __GNUC__ ) && !defined( BZ_COMP_SCALAR )
+#define BZ_COMP_VECTOR
+#define BZ_COMP_LANES	8
+
+typedef int bz_vint __attribute__ (( vector_size( BZ_COMP_LANES * sizeof( int ) ) ));
+
+/* Returns a bitmask of the pairs ( k, j ) ... ( k, j + BZ_COMP_LANES - 1 ) */
+/* which bz_comp() must look at: anything not simply skipped by "continue" */
+static int bz_comp_screen(
+	int k,
+	int j,
+	const int * xcol,
+	const int * ycol,
+	const int * thetacol
+	)
+{
+bz_vint xj, yj, tj;
+bz_vint dx, dy, distance;
+bz_vint opposite, skip;
+int i;
+int live = 0;
+
+memcpy( &xj, &xcol[j],     sizeof( xj ) );
+memcpy( &yj, &ycol[j],     sizeof( yj ) );
+memcpy( &tj, &thetacol[j], sizeof( tj ) );
+
+dx = xj - xcol[k];
+dy = yj - ycol[k];
+distance = dx * dx + dy * dy;
+
+opposite = ( ( tj >  0 ) & ( thetacol[k] == tj - 180 ) )
+	 | ( ( tj <= 0 ) & ( thetacol[k] == tj + 180 ) );
+skip = opposite | ( ( distance > SQUARED(DM) ) & ( dx <= DM ) );
+
+for ( i = 0; i < BZ_COMP_LANES; i++ )
+	if ( ! skip[i] )
+		live |= 1 << i;
+
+return live;
+}
+#endif
+
+/***********************************************************************/
+/* The rows are sorted with bz_sort_rows() once the table is complete.  */
+/* Define BZ_LEGACY_SORT to keep colptrs[] sorted by binary insertion   */
+/* as each row is made instead, as NIST's code did; both give the same  */
+/* order.  Likewise the edge angles come from bz_atan_deg() unless      */
+/* BZ_LIBM_TRIG is defined, and are the same either way.              */
 /***********************************************************************/
 void bz_comp(
 	int npoints,				/* INPUT: # of points */
@@ -104,12 +175,15 @@ void bz_comp(
 	int * colptrs[]				/* INPUT and OUTPUT: sorted list of pointers to rows in cols[] */
 	)
 {
-int i, j, k;
+int j, k;
 
+#ifdef BZ_LEGACY_SORT
+int i;
 int b;
 int t;
 int n;
 int l;
+#endif
 
 int table_index;
 
@@ -123,14 +197,44 @@ int beta_k;
 
 int * c;
 
+#ifdef BZ_COMP_VECTOR
+int block;	/* First pair of the last screened block */
+int live;	/* Pairs of that block which need a look */
+#endif
+
 
 
 c = &cols[0][0];
 
 table_index = 0;
 for ( k = 0; k < npoints - 1; k++ ) {
+#ifdef BZ_COMP_VECTOR
+	block = -BZ_COMP_LANES;
+	live = 0;
+#endif
 	for ( j = k + 1; j < npoints; j++ ) {
 
+#ifdef BZ_COMP_VECTOR
+		if ( j >= block + BZ_COMP_LANES ) {	/* Screen the next block of pairs */
+			if ( j + BZ_COMP_LANES <= npoints ) {
+				block = j;
+				live = bz_comp_screen( k, j, xcol, ycol, thetacol );
+			} else {
+				block = npoints;	/* Tail: scalar only */
+				live = 0;
+			}
+		}
+		if ( j >= block ) {
+			int pending = live >> ( j - block );
+
+			if ( pending == 0 ) {
+				j = block + BZ_COMP_LANES - 1;
+				continue;
+			}
+			j += __builtin_ctz( pending );	/* Next pair that needs a look */
+		}
+#endif
+
 
 		if ( thetacol[j] > 0 ) {
 
@@ -158,6 +262,9 @@ for ( k = 0; k < npoints - 1; k++ ) {
 		if ( dx == 0 )
 			theta_kj = 90;
 		else {
+#ifndef BZ_LIBM_TRIG
+			theta_kj = bz_atan_deg( m1_xyt ? -dy : dy, dx );	/* Same result, integer math only */
+#else
 			double dz;
 
 			if ( m1_xyt )
@@ -169,6 +276,7 @@ for ( k = 0; k < npoints - 1; k++ ) {
 			else
 				dz += 0.5F;
 			theta_kj = (int) dz;
+#endif
 		}
 
 
@@ -201,6 +309,7 @@ for ( k = 0; k < npoints - 1; k++ ) {
 
 
 
+#ifdef BZ_LEGACY_SORT
 		b = 0;
 		t = table_index + 1;
 		l = 1;
@@ -256,6 +365,7 @@ for ( k = 0; k < npoints - 1; k++ ) {
 
 
 		colptrs[l-1] = &cols[table_index][0];
+#endif
 		++table_index;
 
 
@@ -274,6 +384,10 @@ for ( k = 0; k < npoints - 1; k++ ) {
 COMP_END:
 	*ncomparisons = table_index;
 
+#ifndef BZ_LEGACY_SORT
+	bz_sort_rows( table_index, cols, colptrs );
+#endif
+
 }
 
 /***********************************************************************/
@@ -352,11 +466,43 @@ while ( shiftcount-- > 0 ) {
 /*	and lastly on Subject's J point index.              */
 /* Return value is the # of compatible edge pairs           */
 /***********************************************************************/
-int bz_match(
+int bz_match_ctx(
+	struct bz_ctx * ctx,		/* INPUT:  matcher context holding the working tables */
 	int probe_ptrlist_len,		/* INPUT:  pruned length of Subject's pointer list */
 	int gallery_ptrlist_len		/* INPUT:  pruned length of On-File Record's pointer list */
 	)
 {
+return bz_match_gallery_ctx( ctx, probe_ptrlist_len, gallery_ptrlist_len, ctx->fcolpt );
+}
+
+/***********************************************************************/
+/* As bz_match_ctx(), but takes the On-File Record's sorted pointer    */
+/* list explicitly, so that a table built by bozorth_gallery_prepare() */
+/* can be matched without copying it into the context.                 */
+/***********************************************************************/
+int bz_match_gallery_ctx(
+	struct bz_ctx * ctx,		/* INPUT:  matcher context holding the working tables */
+	int probe_ptrlist_len,		/* INPUT:  pruned length of Subject's pointer list */
+	int gallery_ptrlist_len,	/* INPUT:  pruned length of On-File Record's pointer list */
+	int ** fcolpt			/* INPUT:  On-File Record's sorted pointer list */
+	)
+{
+return bz_match_tables_ctx( ctx, probe_ptrlist_len, ctx->scolpt, gallery_ptrlist_len, fcolpt );
+}
+
+/***********************************************************************/
+/* As bz_match_gallery_ctx(), but takes the Subject's sorted pointer   */
+/* list explicitly as well, so that a probe table built once by        */
+/* bozorth_probe_prepare() can be matched against any gallery.         */
+/***********************************************************************/
+int bz_match_tables_ctx(
+	struct bz_ctx * ctx,		/* INPUT:  matcher context holding the working tables */
+	int probe_ptrlist_len,		/* INPUT:  pruned length of Subject's pointer list */
+	int ** scolpt,			/* INPUT:  Subject's sorted pointer list */
+	int gallery_ptrlist_len,	/* INPUT:  pruned length of On-File Record's pointer list */
+	int ** fcolpt			/* INPUT:  On-File Record's sorted pointer list */
+	)
+{
 int i;			/* Temp index */
 int ii;			/* Temp index */
 int edge_pair_index;	/* Compatible edge pair index */
@@ -376,22 +522,10 @@ int t;			/* Top of search range */
 
 register int * rotptr;
 
-
-#define ROT_SIZE_1 20000
-#define ROT_SIZE_2 5
-
-static int rot[ ROT_SIZE_1 ][ ROT_SIZE_2 ];
-
-
-static int * rtp[ ROT_SIZE_1 ];
-
-
-
-
-/* These now externally defined in bozorth.h */
-/* extern int * scolpt[ SCOLPT_SIZE ];			 INPUT */
-/* extern int * fcolpt[ FCOLPT_SIZE ];			 INPUT */
-/* extern int   colp[ COLP_SIZE_1 ][ COLP_SIZE_2 ];	 OUTPUT */
+/* Working tables, owned by the matcher context */
+int (* rot)[ ROT_SIZE_2 ] = ctx->rot;
+int ** rtp = ctx->rtp;
+int (* colp)[ COLP_SIZE_2 ] = ctx->colp;	/* OUTPUT */
 /* extern int verbose_bozorth; */
 /* extern FILE * stderr; */
 /* extern char * get_progname( void ); */
@@ -603,21 +737,42 @@ return edge_pair_index;			/* Return the number of compatible edge pairs stored i
 /* These global arrays are declared "static" as they are only used        */
 /* between bz_match_score() & bz_final_loop()                             */
 /**************************************************************************/
-static int ct[ CT_SIZE ];
-static int gct[ GCT_SIZE ];
-static int ctt[ CTT_SIZE ];
-static int ctp[ CTP_SIZE_1 ][ CTP_SIZE_2 ];
-static int yy[ YY_SIZE_1 ][ YY_SIZE_2 ][ YY_SIZE_3 ];
+/* (ct[], gct[], ctt[], ctp[][] and yy[][][] now live in struct bz_ctx) */
 
-static int    bz_final_loop( int );
+static int    bz_final_loop( struct bz_ctx *, int, int );
 
 /**************************************************************************/
-int bz_match_score(
+int bz_match_score_ctx(
+	struct bz_ctx * ctx,
 	int np,
 	struct xyt_struct * pstruct,
 	struct xyt_struct * gstruct
 	)
 {
+return bz_match_score_bounded_ctx( ctx, np, pstruct, gstruct, 0 );
+}
+
+/**************************************************************************/
+/* Scores the match table like bz_match_score(), for callers which only  */
+/* need to know whether the score reaches THRESHOLD.  If it does, some   */
+/* value >= THRESHOLD is returned, which may be less than the full       */
+/* score; otherwise some value < THRESHOLD, which may be more than the   */
+/* full score.  A THRESHOLD of 0 or less gives the full score.           */
+/*                                                                        */
+/* The clusters combined into a score share no minutiae, so never hold   */
+/* more than the NP edge pairs in total, and a combination is never      */
+/* worth more than the GCT[] total of its first cluster.  These bounds   */
+/* let hopeless matches stop early; a match stops as soon as one         */
+/* cluster, or one combination, reaches THRESHOLD.                       */
+/**************************************************************************/
+int bz_match_score_bounded_ctx(
+	struct bz_ctx * ctx,
+	int np,
+	struct xyt_struct * pstruct,
+	struct xyt_struct * gstruct,
+	int threshold
+	)
+{
 int kx, kq;
 int ftt;
 int tot;
@@ -638,6 +793,29 @@ int rr[ RR_SIZE ];
 int avn[ AVN_SIZE ];
 int avv[ AVV_SIZE_1 ][ AVV_SIZE_2 ];
 
+/* Working tables, owned by the matcher context */
+int (* colp)[ COLP_SIZE_2 ] = ctx->colp;
+int (* yl)[ YL_SIZE_2 ] = ctx->yl;
+int (* yy)[ YY_SIZE_2 ][ YY_SIZE_3 ] = ctx->yy;
+int (* ctp)[ CTP_SIZE_2 ] = ctx->ctp;
+int (* rf)[ RF_SIZE_2 ] = ctx->rf;
+int (* cf)[ CF_SIZE_2 ] = ctx->cf;
+int * sc = ctx->sc;
+int * cp = ctx->cp;
+int * rp = ctx->rp;
+int * tq = ctx->tq;
+int * rq = ctx->rq;
+int * zz = ctx->zz;
+int * qq = ctx->qq;
+int * rk = ctx->rk;
+int * rx = ctx->rx;
+int * mm = ctx->mm;
+int * nn = ctx->nn;
+int * y = ctx->y;
+int * ct = ctx->ct;
+int * gct = ctx->gct;
+int * ctt = ctx->ctt;
+
 /* These now externally defined in bozorth.h */
 /* extern FILE * stderr; */
 /* extern char * get_progname( void ); */
@@ -683,6 +861,8 @@ if ( gstruct->nrows < MIN_COMPUTABLE_BOZORTH_MINUTIAE ) {
 
 
 
+if ( threshold > 0 && np < threshold )	/* Not enough edge pairs to ever reach THRESHOLD */
+	return np;
 
 
 
@@ -690,16 +870,16 @@ if ( gstruct->nrows < MIN_COMPUTABLE_BOZORTH_MINUTIAE ) {
 
 
 								/* initialize tables to 0's */
-INT_SET( (int *) &yl, YL_SIZE_1 * YL_SIZE_2, 0 );
+INT_SET( (int *) yl, YL_SIZE_1 * YL_SIZE_2, 0 );
 
 
 
-INT_SET( (int *) &sc, SC_SIZE, 0 );
-INT_SET( (int *) &cp, CP_SIZE, 0 );
-INT_SET( (int *) &rp, RP_SIZE, 0 );
-INT_SET( (int *) &tq, TQ_SIZE, 0 );
-INT_SET( (int *) &rq, RQ_SIZE, 0 );
-INT_SET( (int *) &zz, ZZ_SIZE, 1000 );				/* zz[] initialized to 1000's */
+INT_SET( sc, SC_SIZE, 0 );
+INT_SET( cp, CP_SIZE, 0 );
+INT_SET( rp, RP_SIZE, 0 );
+INT_SET( tq, TQ_SIZE, 0 );
+INT_SET( rq, RQ_SIZE, 0 );
+INT_SET( zz, ZZ_SIZE, 1000 );				/* zz[] initialized to 1000's */
 
 INT_SET( (int *) &avn, AVN_SIZE, 0 );				/* avn[0...4] <== 0; */
 
@@ -757,7 +937,7 @@ for ( k = 0; k < np - 1; k++ ) {
 			kz = colp[kx][2];
 			l  = colp[kx][4];
 			kx++;
-			bz_sift( &ww, kz, &qh, l, kx, ftt, &tot, &qq_overflow );
+			bz_sift_ctx( ctx, &ww, kz, &qh, l, kx, ftt, &tot, &qq_overflow );
 			if ( qq_overflow ) {
 				fprintf( stderr, "%s: WARNING: bz_match_score(): qq[] overflow from bz_sift() #1 [p=%s; g=%s]\n",
 							get_progname(), get_probe_filename(), get_gallery_filename() );
@@ -809,7 +989,7 @@ for ( k = 0; k < np - 1; k++ ) {
 
 					if ( z != colp[k][1] && l != colp[k][3] ) {
 						kx = i + 1;
-						bz_sift( &ww, z, &qh, l, kx, ftt, &tot, &qq_overflow );
+						bz_sift_ctx( ctx, &ww, z, &qh, l, kx, ftt, &tot, &qq_overflow );
 						if ( qq_overflow ) {
 							fprintf( stderr, "%s: WARNING: bz_match_score(): qq[] overflow from bz_sift() #2 [p=%s; g=%s]\n",
 								get_progname(), get_probe_filename(), get_gallery_filename() );
@@ -881,7 +1061,7 @@ for ( k = 0; k < np - 1; k++ ) {
 						kz = colp[kx][2];
 						l  = colp[kx][4];
 						kx++;
-						bz_sift( &ww, kz, &qh, l, kx, ftt, &tot, &qq_overflow );
+						bz_sift_ctx( ctx, &ww, kz, &qh, l, kx, ftt, &tot, &qq_overflow );
 						if ( qq_overflow ) {
 							fprintf( stderr, "%s: WARNING: bz_match_score(): qq[] overflow from bz_sift() #3 [p=%s; g=%s]\n",
 								get_progname(), get_probe_filename(), get_gallery_filename() );
@@ -1113,6 +1293,9 @@ for ( k = 0; k < np - 1; k++ ) {
 			ct[tp]  = tot;
 			gct[tp] = tot;
 
+			if ( threshold > 0 && tot >= threshold )	/* This cluster alone is enough */
+				return tot;
+
 			if ( tot > match_score )		/* If current TOT > match_score ... */
 				match_score = tot;		/*	Keep track of max TOT in match_score */
 
@@ -1467,14 +1650,17 @@ if ( match_score < MMSTR ) {
 	return match_score;
 }
 
-match_score = bz_final_loop( tp );
+if ( match_score < threshold )	/* No GCT total, hence no combination, reaches THRESHOLD */
+	return match_score;
+
+match_score = bz_final_loop( ctx, tp, threshold );
 return match_score;
 }
 
 
 /***********************************************************************/
-/* These globals signficantly used by bz_sift () */
-/* Now externally defined in bozorth.h */
+/* These tables signficantly used by bz_sift () */
+/* Now members of struct bz_ctx */
 /* extern int sc[ SC_SIZE ]; */
 /* extern int rq[ RQ_SIZE ]; */
 /* extern int tq[ TQ_SIZE ]; */
@@ -1490,7 +1676,8 @@ return match_score;
 /* extern int rp[ RP_SIZE ]; */
 /* extern int y[ Y_SIZE ]; */
 
-void bz_sift(
+void bz_sift_ctx(
+	struct bz_ctx * ctx,	/* INPUT only;       matcher context holding the working tables */
 	int * ww,		/* INPUT and OUTPUT; endpoint groups index; *ww may be bumped by one or by two */
 	int   kz,		/* INPUT only;       endpoint of lookahead Subject edge */
 	int * qh,		/* INPUT and OUTPUT; the value is an index into qq[] and is stored in zz[]; *qh may be bumped by one */
@@ -1504,6 +1691,22 @@ void bz_sift(
 int n;
 int t;
 
+/* Working tables, owned by the matcher context */
+int (* rf)[ RF_SIZE_2 ] = ctx->rf;
+int (* cf)[ CF_SIZE_2 ] = ctx->cf;
+int * sc = ctx->sc;
+int * rq = ctx->rq;
+int * tq = ctx->tq;
+int * zz = ctx->zz;
+int * rx = ctx->rx;
+int * mm = ctx->mm;
+int * nn = ctx->nn;
+int * qq = ctx->qq;
+int * rk = ctx->rk;
+int * cp = ctx->cp;
+int * rp = ctx->rp;
+int * y = ctx->y;
+
 /* These now externally defined in bozorth.h */
 /* extern FILE * stderr; */
 /* extern char * get_progname( void ); */
@@ -1685,17 +1888,27 @@ if ( t ) {
 
 /**************************************************************************/
 
-static int bz_final_loop( int tp )
+static int bz_final_loop( struct bz_ctx * ctx, int tp, int threshold )
 {
 int ii, i, t, b, n, k, j, kk, jj;
 int lim;
 int match_score;
 
-/* This array originally declared global, but moved here */
-/* locally because it is only used herein.  The use of   */
-/* "static" is required as the array will exceed the     */
-/* stack allocation on our local systems otherwise.      */
-static int sct[ SCT_SIZE_1 ][ SCT_SIZE_2 ];
+/* This array originally declared global, then moved here */
+/* as a function static because it is only used herein.   */
+/* It is now part of the matcher context, as it would     */
+/* exceed the stack allocation on our local systems.      */
+int (* sct)[ SCT_SIZE_2 ] = ctx->sct;
+
+/* Working tables, owned by the matcher context */
+int (* ctp)[ CTP_SIZE_2 ] = ctx->ctp;
+int * ct = ctx->ct;
+int * gct = ctx->gct;
+int * ctt = ctx->ctt;
+int * cp = ctx->cp;
+int * rp = ctx->rp;
+int * rk = ctx->rk;
+int * y = ctx->y;
 
 match_score = 0;
 for ( ii = 0; ii < tp; ii++ ) {				/* For each index up to the current value of TP ... */
@@ -1703,6 +1916,9 @@ for ( ii = 0; ii < tp; ii++ ) {				/* For each index up to the current value of
 		if ( match_score >= gct[ii] )		/* if next group total not bigger than current match_score.. */
 			continue;			/*		skip to next TP index */
 
+		if ( gct[ii] < threshold )		/* if no combination starting here can reach THRESHOLD.. */
+			continue;			/*		skip to next TP index */
+
 		lim = ctt[ii] + 1;
 		for ( i = 0; i < lim; i++ ) {
 			sct[i][0] = ctp[ii][i];
@@ -1754,6 +1970,9 @@ for ( ii = 0; ii < tp; ii++ ) {				/* For each index up to the current value of
 					tot += ct[ sct[0][i] ];
 				}
 
+				if ( threshold > 0 && tot >= threshold )	/* If the current total is enough ... */
+					return tot;			/*	then stop here */
+
 				if ( tot > match_score ) {		/* If the current total is larger than the running total ... */
 					match_score = tot;		/*	then set match_score to the new total */
 					for ( i = 0; i < b; i++ ) {
@@ -1783,3 +2002,51 @@ for ( ii = 0; ii < tp; ii++ ) {				/* For each index up to the current value of
 return match_score;
 
 } /* END bz_final_loop() */
+
+/**************************************************************************/
+/* Legacy entry points, operating on the default context                  */
+/**************************************************************************/
+
+int bz_match( int probe_ptrlist_len, int gallery_ptrlist_len )
+{
+return bz_match_ctx( bz_default_ctx(), probe_ptrlist_len, gallery_ptrlist_len );
+}
+
+/**************************************************************************/
+
+int bz_match_score(
+	int np,
+	struct xyt_struct * pstruct,
+	struct xyt_struct * gstruct
+	)
+{
+return bz_match_score_ctx( bz_default_ctx(), np, pstruct, gstruct );
+}
+
+/**************************************************************************/
+
+int bz_match_score_bounded(
+	int np,
+	struct xyt_struct * pstruct,
+	struct xyt_struct * gstruct,
+	int threshold
+	)
+{
+return bz_match_score_bounded_ctx( bz_default_ctx(), np, pstruct, gstruct, threshold );
+}
+
+/**************************************************************************/
+
+void bz_sift(
+	int * ww,
+	int   kz,
+	int * qh,
+	int   l,
+	int   kx,
+	int   ftt,
+	int * tot,
+	int * qq_overflow
+	)
+{
+bz_sift_ctx( bz_default_ctx(), ww, kz, qh, l, kx, ftt, tot, qq_overflow );
+}
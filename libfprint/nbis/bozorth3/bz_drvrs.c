@@ -76,6 +76,30 @@ identified are necessarily the best available for the purpose.
 #cat:                        single probe fingerprint is to be matched
 #cat:                        to a single gallery fingerprint as in
 #cat:                        verificaiton mode
+#cat: bozorth_gallery_prepare - builds and keeps a copy of the gallery
+#cat:                        fingerprint's comparison table, so that it
+#cat:                        can be matched repeatedly without rebuilding
+#cat: bozorth_gallery_free -  releases a prepared gallery table
+#cat: bozorth_to_prepared_gallery - as bozorth_to_gallery, but against
+#cat:                        a prepared gallery table
+#cat: bozorth_to_gallery_bounded - as bozorth_to_gallery, but only decides
+#cat:                        whether the score reaches a threshold (see
+#cat:                        bz_match_score_bounded)
+#cat: bozorth_to_prepared_gallery_bounded - the same against a prepared
+#cat:                        gallery table
+#cat: bozorth_probe_prepare - builds and keeps a copy of the probe
+#cat:                        fingerprint's comparison table, so that it
+#cat:                        can be matched to any number of galleries
+#cat: bozorth_prepared_to_gallery_bounded - bounded match of a prepared
+#cat:                        probe table to a gallery fingerprint
+#cat: bozorth_prepared_to_prepared_gallery_bounded - bounded match of a
+#cat:                        prepared probe table to a prepared gallery
+#cat:                        table
+#cat:
+#cat: Each of the above has a reentrant *_ctx() variant taking an explicit
+#cat: matcher context; the plain routines use the default context.  The
+#cat: prepared gallery and bounded routines only come in the reentrant
+#cat: form.
 
 ***********************************************************************/
 
@@ -86,7 +110,7 @@ identified are necessarily the best available for the purpose.
 
 /**************************************************************************/
 
-int bozorth_probe_init( struct xyt_struct * pstruct )
+int bozorth_probe_init_ctx( struct bz_ctx * ctx, struct xyt_struct * pstruct )
 {
 int sim;	/* number of pointwise comparisons for Subject's record*/
 int msim;	/* Pruned length of Subject's comparison pointer list */
@@ -101,14 +125,14 @@ bz_comp(
 	pstruct->ycol,
 	pstruct->thetacol,
 	&sim,
-	scols,
-	scolpt );
+	ctx->scols,
+	ctx->scolpt );
 
 msim = sim;	/* Init search to end of Subject's pointwise comparison table (last edge in Web) */
 
 
 
-bz_find( &msim, scolpt );
+bz_find( &msim, ctx->scolpt );
 
 
 
@@ -124,7 +148,7 @@ return msim;
 
 /**************************************************************************/
 
-int bozorth_gallery_init( struct xyt_struct * gstruct )
+int bozorth_gallery_init_ctx( struct bz_ctx * ctx, struct xyt_struct * gstruct )
 {
 int fim;	/* number of pointwise comparisons for On-File record*/
 int mfim;	/* Pruned length of On-File Record's pointer list */
@@ -138,14 +162,14 @@ bz_comp(
 	gstruct->ycol,
 	gstruct->thetacol,
 	&fim,
-	fcols,
-	fcolpt );
+	ctx->fcols,
+	ctx->fcolpt );
 
 mfim = fim;	/* Init search to end of On-File Record's pointwise comparison table (last edge in Web) */
 
 
 
-bz_find( &mfim, fcolpt );
+bz_find( &mfim, ctx->fcolpt );
 
 
 
@@ -161,23 +185,185 @@ return mfim;
 
 /**************************************************************************/
 
-int bozorth_to_gallery(
+int bozorth_to_gallery_ctx(
+		struct bz_ctx * ctx,
 		int probe_len,
 		struct xyt_struct * pstruct,
 		struct xyt_struct * gstruct
 		)
 {
+return bozorth_to_gallery_bounded_ctx( ctx, probe_len, pstruct, gstruct, 0 );
+}
+
+/**************************************************************************/
+
+int bozorth_to_gallery_bounded_ctx(
+		struct bz_ctx * ctx,
+		int probe_len,
+		struct xyt_struct * pstruct,
+		struct xyt_struct * gstruct,
+		int threshold
+		)
+{
 int np;
 int gallery_len;
 
-gallery_len = bozorth_gallery_init( gstruct );
-np = bz_match( probe_len, gallery_len );
-return bz_match_score( np, pstruct, gstruct );
+gallery_len = bozorth_gallery_init_ctx( ctx, gstruct );
+np = bz_match_ctx( ctx, probe_len, gallery_len );
+return bz_match_score_bounded_ctx( ctx, np, pstruct, gstruct, threshold );
 }
 
+/**************************************************************************/
+/* Builds the On-File Record's pruned, sorted pairwise comparison table   */
+/* once and keeps a private copy of it, so that the gallery print can be  */
+/* matched against any number of probes without redoing bz_comp() and    */
+/* bz_find() each time.  Returns NULL if out of memory.                   */
 /**************************************************************************/
 
-int bozorth_main(
+struct bz_gallery * bozorth_gallery_prepare_ctx(
+		struct bz_ctx * ctx,
+		struct xyt_struct * gstruct
+		)
+{
+struct bz_gallery * gallery;
+int mfim;
+int i;
+
+
+
+mfim = bozorth_gallery_init_ctx( ctx, gstruct );
+
+gallery = bozorth_gallery_new( gstruct, mfim );
+if ( gallery == NULL )
+	return NULL;
+
+/* Copy the rows in sorted order, so the copy is laid out sequentially */
+for ( i = 0; i < mfim; i++ )
+	memcpy( gallery->cols[i], ctx->fcolpt[i], sizeof( gallery->cols[0] ) );
+
+return gallery;
+}
+
+/**************************************************************************/
+/* Allocates an empty table of len rows for gstruct, for callers that     */
+/* fill it in themselves, e.g. from a saved copy of a prepared gallery.   */
+/* Returns NULL if out of memory.                                         */
+/**************************************************************************/
+
+struct bz_gallery * bozorth_gallery_new(
+		struct xyt_struct * gstruct,
+		int len
+		)
+{
+struct bz_gallery * gallery;
+int i;
+
+gallery = (struct bz_gallery *) malloc( sizeof( struct bz_gallery )
+		+ len * sizeof( gallery->cols[0] ) );
+if ( gallery == NULL )
+	return NULL;
+gallery->colpt = (int **) malloc( ( len > 0 ? len : 1 ) * sizeof( int * ) );
+if ( gallery->colpt == NULL ) {
+	free( gallery );
+	return NULL;
+}
+
+for ( i = 0; i < len; i++ )
+	gallery->colpt[i] = gallery->cols[i];
+gallery->len = len;
+gallery->gstruct = gstruct;
+
+return gallery;
+}
+
+/**************************************************************************/
+
+void bozorth_gallery_free( struct bz_gallery * gallery )
+{
+if ( gallery == NULL )
+	return;
+free( gallery->colpt );
+free( gallery );
+}
+
+/**************************************************************************/
+
+int bozorth_to_prepared_gallery_ctx(
+		struct bz_ctx * ctx,
+		int probe_len,
+		struct xyt_struct * pstruct,
+		const struct bz_gallery * gallery
+		)
+{
+return bozorth_to_prepared_gallery_bounded_ctx( ctx, probe_len, pstruct, gallery, 0 );
+}
+
+/**************************************************************************/
+
+int bozorth_to_prepared_gallery_bounded_ctx(
+		struct bz_ctx * ctx,
+		int probe_len,
+		struct xyt_struct * pstruct,
+		const struct bz_gallery * gallery,
+		int threshold
+		)
+{
+int np;
+
+np = bz_match_gallery_ctx( ctx, probe_len, gallery->len, gallery->colpt );
+return bz_match_score_bounded_ctx( ctx, np, pstruct, gallery->gstruct, threshold );
+}
+
+/**************************************************************************/
+/* The probe's table is built exactly like a gallery's, so a prepared     */
+/* probe is a struct bz_gallery as well, whose gstruct is the probe.      */
+/* Returns NULL if out of memory.                                         */
+/**************************************************************************/
+
+struct bz_gallery * bozorth_probe_prepare_ctx(
+		struct bz_ctx * ctx,
+		struct xyt_struct * pstruct
+		)
+{
+return bozorth_gallery_prepare_ctx( ctx, pstruct );
+}
+
+/**************************************************************************/
+
+int bozorth_prepared_to_gallery_bounded_ctx(
+		struct bz_ctx * ctx,
+		const struct bz_gallery * probe,
+		struct xyt_struct * gstruct,
+		int threshold
+		)
+{
+int np;
+int gallery_len;
+
+gallery_len = bozorth_gallery_init_ctx( ctx, gstruct );
+np = bz_match_tables_ctx( ctx, probe->len, probe->colpt, gallery_len, ctx->fcolpt );
+return bz_match_score_bounded_ctx( ctx, np, probe->gstruct, gstruct, threshold );
+}
+
+/**************************************************************************/
+
+int bozorth_prepared_to_prepared_gallery_bounded_ctx(
+		struct bz_ctx * ctx,
+		const struct bz_gallery * probe,
+		const struct bz_gallery * gallery,
+		int threshold
+		)
+{
+int np;
+
+np = bz_match_tables_ctx( ctx, probe->len, probe->colpt, gallery->len, gallery->colpt );
+return bz_match_score_bounded_ctx( ctx, np, probe->gstruct, gallery->gstruct, threshold );
+}
+
+/**************************************************************************/
+
+int bozorth_main_ctx(
+		struct bz_ctx * ctx,
 		struct xyt_struct * pstruct,
 		struct xyt_struct * gstruct
 		)
@@ -192,26 +378,26 @@ int gallery_len;
 #ifdef DEBUG
 	printf( "PROBE_INIT() called\n" );
 #endif
-probe_len   = bozorth_probe_init( pstruct );
+probe_len   = bozorth_probe_init_ctx( ctx, pstruct );
 
 
 #ifdef DEBUG
 	printf( "GALLERY_INIT() called\n" );
 #endif
-gallery_len = bozorth_gallery_init( gstruct );
+gallery_len = bozorth_gallery_init_ctx( ctx, gstruct );
 
 
 #ifdef DEBUG
 	printf( "BZ_MATCH() called\n" );
 #endif
-np = bz_match( probe_len, gallery_len );
+np = bz_match_ctx( ctx, probe_len, gallery_len );
 
 
 #ifdef DEBUG
 	printf( "BZ_MATCH() returned %d edge pairs\n", np );
 	printf( "COMPUTE() called\n" );
 #endif
-ms = bz_match_score( np, pstruct, gstruct );
+ms = bz_match_score_ctx( ctx, np, pstruct, gstruct );
 
 
 #ifdef DEBUG
@@ -221,3 +407,40 @@ ms = bz_match_score( np, pstruct, gstruct );
 
 return ms;
 }
+
+/**************************************************************************/
+/* Legacy entry points, operating on the default context                  */
+/**************************************************************************/
+
+int bozorth_probe_init( struct xyt_struct * pstruct )
+{
+return bozorth_probe_init_ctx( bz_default_ctx(), pstruct );
+}
+
+/**************************************************************************/
+
+int bozorth_gallery_init( struct xyt_struct * gstruct )
+{
+return bozorth_gallery_init_ctx( bz_default_ctx(), gstruct );
+}
+
+/**************************************************************************/
+
+int bozorth_to_gallery(
+		int probe_len,
+		struct xyt_struct * pstruct,
+		struct xyt_struct * gstruct
+		)
+{
+return bozorth_to_gallery_ctx( bz_default_ctx(), probe_len, pstruct, gstruct );
+}
+
+/**************************************************************************/
+
+int bozorth_main(
+		struct xyt_struct * pstruct,
+		struct xyt_struct * gstruct
+		)
+{
+return bozorth_main_ctx( bz_default_ctx(), pstruct, gstruct );
+}
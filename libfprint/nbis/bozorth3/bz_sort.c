@@ -71,10 +71,15 @@ identified are necessarily the best available for the purpose.
 #cat:            then on y
 #cat: sort_order_decreasing - calls a custom quicksort that sorts
 #cat:            a list of integers in decreasing order
+#cat: bz_sort_rows - sorts the row pointers of a pairwise comparison
+#cat:            table on distance, then min beta, then max beta, keeping
+#cat:            rows with equal keys in table order
 
 ***********************************************************************/
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <bozorth.h>
 
 /* These are now externally defined in bozorth.h */
@@ -123,29 +128,32 @@ qsort_decreasing() - quicksort an array of integers in decreasing
                      order [based on multisort.c, by Michael Garris
                      and Ted Zwiesler, 1986]
 ********************************************************/
-/* Used by custom quicksort code below */
-static int   stack[BZ_STACKSIZE];
-static int * stack_pointer = stack;
+/* Used by custom quicksort code below; kept per call rather than */
+/* as file statics so that concurrent sorts do not share a stack.  */
+struct bz_stack {
+	int   stack[BZ_STACKSIZE];
+	int * stack_pointer;
+};
 
 /***********************************************************************/
 /* return values: 0 == successful, 1 == error */
-static int popstack( int *popval )
+static int popstack( struct bz_stack *st, int *popval )
 {
-if ( --stack_pointer < stack ) {
+if ( --st->stack_pointer < st->stack ) {
 	fprintf( stderr, "%s: ERROR: popstack(): stack underflow\n", get_progname() );
 	return 1;
 }
 
-*popval = *stack_pointer;
+*popval = *st->stack_pointer;
 return 0;
 }
 
 /***********************************************************************/
 /* return values: 0 == successful, 1 == error */
-static int pushstack( int position )
+static int pushstack( struct bz_stack *st, int position )
 {
-*stack_pointer++ = position;
-if ( stack_pointer > ( stack + BZ_STACKSIZE ) ) {
+*st->stack_pointer++ = position;
+if ( st->stack_pointer > ( st->stack + BZ_STACKSIZE ) ) {
 	fprintf( stderr, "%s: ERROR: pushstack(): stack overflow\n", get_progname() );
 	return 1;
 }
@@ -241,37 +249,38 @@ static int qsort_decreasing( struct cell v[], int left, int right )
 int pivot;
 int llen, rlen;
 int lleft, lright, rleft, rright;
+struct bz_stack st;
 
-
-if ( pushstack( left  ))
+st.stack_pointer = st.stack;
+if ( pushstack( &st, left  ))
 	return 1;
-if ( pushstack( right ))
+if ( pushstack( &st, right ))
 	return 2;
-while ( stack_pointer != stack ) {
-	if (popstack(&right))
+while ( st.stack_pointer != st.stack ) {
+	if (popstack(&st, &right))
 		return 3;
-	if (popstack(&left ))
+	if (popstack(&st, &left ))
 		return 4;
 	if ( right - left > 0 ) {
 		pivot = select_pivot( v, left, right );
 		partition_dec( v, &llen, &rlen, &lleft, &lright, &rleft, &rright, pivot, left, right );
 		if ( llen > rlen ) {
-			if ( pushstack( lleft  ))
+			if ( pushstack( &st, lleft  ))
 				return 5;
-			if ( pushstack( lright ))
+			if ( pushstack( &st, lright ))
 				return 6;
-			if ( pushstack( rleft  ))
+			if ( pushstack( &st, rleft  ))
 				return 7;
-			if ( pushstack( rright ))
+			if ( pushstack( &st, rright ))
 				return 8;
 		} else{
-			if ( pushstack( rleft  ))
+			if ( pushstack( &st, rleft  ))
 				return 9;
-			if ( pushstack( rright ))
+			if ( pushstack( &st, rright ))
 				return 10;
-			if ( pushstack( lleft  ))
+			if ( pushstack( &st, lleft  ))
 				return 11;
-			if ( pushstack( lright ))
+			if ( pushstack( &st, lright ))
 				return 12;
 		}
 	}
@@ -313,3 +322,99 @@ free( (void *) cells );
 
 return 0;
 }
+
+/***********************************************************************/
+/* bz_comp() used to keep its row pointers sorted by binary insertion  */
+/* as each row was made, which costs O(n^2) pointer moves.  The keys   */
+/* are small bounded integers -- the squared distance is at most DM^2  */
+/* and the betas are in (-180,180] -- so an LSD radix sort does the    */
+/* same job in four passes.  Each pass is stable, so rows with equal   */
+/* keys stay in table order, as they did with the insertion.           */
+/***********************************************************************/
+#define BZ_RADIX_BETA_BIAS	180
+#define BZ_RADIX_BETA_BUCKETS	361
+#define BZ_RADIX_DIST_BITS	7
+#define BZ_RADIX_DIST_BUCKETS	( 1 << BZ_RADIX_DIST_BITS )
+
+#if SQUARED(DM) >= ( 1 << ( 2 * BZ_RADIX_DIST_BITS ) )
+#error "squared distances do not fit in two radix passes"
+#endif
+
+/* One stable counting pass: sorts SRC into DST on column COL of each    */
+/* row, shifted right by SHIFT and masked by MASK, after adding BIAS     */
+static void bz_radix_pass(
+		int n,
+		int * src[],
+		int * dst[],
+		int col,
+		int bias,
+		int shift,
+		int mask,
+		int buckets
+		)
+{
+int count[ BZ_RADIX_BETA_BUCKETS ];
+int i, sum;
+
+memset( count, 0, buckets * sizeof( int ) );
+for ( i = 0; i < n; i++ )
+	count[ ( ( src[i][col] + bias ) >> shift ) & mask ]++;
+
+sum = 0;
+for ( i = 0; i < buckets; i++ ) {
+	int c = count[i];
+	count[i] = sum;
+	sum += c;
+}
+
+for ( i = 0; i < n; i++ )
+	dst[ count[ ( ( src[i][col] + bias ) >> shift ) & mask ]++ ] = src[i];
+}
+
+/* Returns nonzero if row A sorts after row B */
+static int bz_row_after( const int * a, const int * b )
+{
+int i;
+
+for ( i = 0; i < 3; i++ )
+	if ( a[i] != b[i] )
+		return a[i] > b[i];
+return 0;
+}
+
+/***********************************************************************/
+void bz_sort_rows(
+		int n,				/* INPUT:  number of rows in the table */
+		int cols[][ COLS_SIZE_2 ],	/* INPUT:  pairwise comparison table */
+		int * colptrs[]			/* OUTPUT: sorted list of pointers to rows in cols[] */
+		)
+{
+int ** tmp;
+int i;
+
+
+tmp = (int **) malloc( ( n > 0 ? n : 1 ) * sizeof( int * ) );
+if ( tmp == (int **) NULL ) {
+	/* Fall back on a stable insertion sort */
+	for ( i = 0; i < n; i++ ) {
+		int j = i;
+		while ( j > 0 && bz_row_after( colptrs[j-1], cols[i] ) ) {
+			colptrs[j] = colptrs[j-1];
+			j--;
+		}
+		colptrs[j] = cols[i];
+	}
+	return;
+}
+
+for ( i = 0; i < n; i++ )
+	colptrs[i] = cols[i];
+
+/* Least significant key first: max beta, min beta, then distance */
+bz_radix_pass( n, colptrs, tmp, 2, BZ_RADIX_BETA_BIAS, 0, ~0, BZ_RADIX_BETA_BUCKETS );
+bz_radix_pass( n, tmp, colptrs, 1, BZ_RADIX_BETA_BIAS, 0, ~0, BZ_RADIX_BETA_BUCKETS );
+bz_radix_pass( n, colptrs, tmp, 0, 0, 0, BZ_RADIX_DIST_BUCKETS - 1, BZ_RADIX_DIST_BUCKETS );
+bz_radix_pass( n, tmp, colptrs, 0, 0, BZ_RADIX_DIST_BITS, BZ_RADIX_DIST_BUCKETS - 1, BZ_RADIX_DIST_BUCKETS );
+
+free( (void *) tmp );
+}
@@ -0,0 +1,82 @@
+/***********************************************************************
+      LIBRARY: FING - NIST Fingerprint Systems Utilities
+
+      FILE:           BZ_TRIG.C
+
+      Contains integer geometry routines used in place of the floating
+      point math in the Bozorth3 edge table construction.
+
+***********************************************************************
+
+      ROUTINES:
+#cat: bz_atan_deg - the direction of a short minutia-to-minutia
+#cat:            vector, in whole degrees, computed with integer math
+#cat:            only
+
+***********************************************************************/
+
+#include <stdlib.h>
+#include <bozorth.h>
+
+/***********************************************************************/
+/* tan( k + 0.5 degrees ) for k = 0 ... 89, scaled by 2^24.             */
+/*                                                                      */
+/* ROUND( atan( a / b ) ) is the number of these half-degree boundaries */
+/* that a / b lies above.  Over the vectors bz_comp() looks at, with    */
+/* both components at most DM, no a / b comes closer to a boundary than */
+/* 1.7e-4 degrees, whereas the scaled table is good to better than      */
+/* 2e-6 degrees.  The results therefore match the single precision      */
+/* atanf() code exactly; this was checked for every vector in that      */
+/* range, and against the double precision atan() as well.              */
+/***********************************************************************/
+#define BZ_TAN_SHIFT	24
+
+static const int bz_tan_half_deg[ 90 ] = {
+	146413, 439327, 732509, 1026138, 1320396,
+	1615462, 1911522, 2208762, 2507372, 2807543,
+	3109473, 3413363, 3719419, 4027853, 4338883,
+	4652734, 4969638, 5289836, 5613578, 5941124,
+	6272744, 6608721, 6949350, 7294941, 7645818,
+	8002322, 8364811, 8733666, 9109285, 9492092,
+	9882535, 10281091, 10688265, 11104597, 11530661,
+	11967072, 12414487, 12873611, 13345200, 13830070,
+	14329096, 14843227, 15373486, 15920984, 16486924,
+	17072619, 17679497, 18309118, 18963193, 19643596,
+	20352390, 21091851, 21864494, 22673106, 23520789,
+	24411001, 25347608, 26334954, 27377928, 28482061,
+	29653629, 30899788, 32228732, 33649889, 35174165,
+	36814241, 38584955, 40503782, 42591444, 44872703,
+	47377396, 50141813, 53210531, 56638932, 60496686,
+	64872681, 69882134, 75677131, 82462651, 90521757,
+	100256690, 112258973, 127435607, 147251735, 174238050,
+	213174741, 274305057, 384261422, 640696030, 1922478534
+};
+
+/***********************************************************************/
+/* Returns atan( dy / dx ) in degrees, rounded half away from zero,     */
+/* in [ -90, 90 ].  DX must not be 0, and both |DX| and |DY| must be    */
+/* at most DM.                                                          */
+/***********************************************************************/
+int bz_atan_deg( int dy, int dx )
+{
+long long a, b;
+int lo, hi;
+
+a = (long long) abs( dy ) << BZ_TAN_SHIFT;
+b = abs( dx );
+
+lo = 0;
+hi = 90;
+while ( lo < hi ) {		/* Count the boundaries below a / b */
+	int mid = ( lo + hi ) / 2;
+
+	if ( a > b * bz_tan_half_deg[ mid ] )
+		lo = mid + 1;
+	else
+		hi = mid;
+}
+
+if ( ( dy < 0 ) != ( dx < 0 ) )
+	return -lo;
+return lo;
+}
@@ -0,0 +1,45 @@
+/*******************************************************************************
+
+License: 
+This software was developed at the National Institute of Standards and 
+Technology (NIST) by employees of the Federal Government in the course 
+of their official duties. Pursuant to title 17 Section 105 of the 
+United States Code, this software is not subject to copyright protection 
+and is in the public domain. NIST assumes no responsibility  whatsoever for 
+its use by other parties, and makes no guarantees, expressed or implied, 
+about its quality, reliability, or any other characteristic. 
+
+Disclaimer: 
+This software was developed to promote biometric standards and biometric
+technology testing for the Federal Government in accordance with the USA
+PATRIOT Act and the Enhanced Border Security and Visa Entry Reform Act.
+Specific hardware and software products identified in this software were used
+in order to perform the software development.  In no case does such
+identification imply recommendation or endorsement by the National Institute
+of Standards and Technology, nor does it imply that the products and equipment
+identified are necessarily the best available for the purpose.  
+
+*******************************************************************************/
+
+#ifndef _ARENA_H
+#define _ARENA_H
+
+/* Routes the memory allocations of the LFS sources through the */
+/* arena allocator in arena.c.  Include it after the system     */
+/* headers, and only from the LFS sources: blocks allocated     */
+/* here must be released with lfs_free().                       */
+
+#include <stdlib.h>
+#include <lfs.h>
+
+#undef malloc
+#undef calloc
+#undef realloc
+#undef free
+
+#define malloc(size)          lfs_malloc(size)
+#define calloc(nmemb, size)   lfs_calloc(nmemb, size)
+#define realloc(ptr, size)    lfs_realloc(ptr, size)
+#define free(ptr)             lfs_free(ptr)
+
+#endif /* !_ARENA_H */
@@ -191,35 +191,91 @@ extern int verbose_threshold;
 /**************************************************************************/
 /* In: BZ_GBLS.C */
 /**************************************************************************/
-/* Global arrays supporting "core" bozorth algorithm */
-extern int colp[ COLP_SIZE_1 ][ COLP_SIZE_2 ];
-extern int scols[ SCOLS_SIZE_1 ][ COLS_SIZE_2 ];
-extern int fcols[ FCOLS_SIZE_1 ][ COLS_SIZE_2 ];
-extern int * scolpt[ SCOLPT_SIZE ];
-extern int * fcolpt[ FCOLPT_SIZE ];
-extern int sc[ SC_SIZE ];
-extern int yl[ YL_SIZE_1 ][ YL_SIZE_2 ];
-/* Global arrays supporting "core" bozorth algorithm continued: */
-/*    Globals used significantly by sift() */
-extern int rq[ RQ_SIZE ];
-extern int tq[ TQ_SIZE ];
-extern int zz[ ZZ_SIZE ];
-extern int rx[ RX_SIZE ];
-extern int mm[ MM_SIZE ];
-extern int nn[ NN_SIZE ];
-extern int qq[ QQ_SIZE ];
-extern int rk[ RK_SIZE ];
-extern int cp[ CP_SIZE ];
-extern int rp[ RP_SIZE ];
-extern int rf[RF_SIZE_1][RF_SIZE_2];
-extern int cf[CF_SIZE_1][CF_SIZE_2];
-extern int y[20000];
+/* Working tables supporting the "core" bozorth algorithm.  These used to */
+/* be process-wide globals; they now live in a matcher context so that    */
+/* several matches can run concurrently, each with its own context.       */
+struct bz_ctx {
+	/* Arrays supporting "core" bozorth algorithm */
+	int colp[ COLP_SIZE_1 ][ COLP_SIZE_2 ];
+	int scols[ SCOLS_SIZE_1 ][ COLS_SIZE_2 ];
+	int fcols[ FCOLS_SIZE_1 ][ COLS_SIZE_2 ];
+	int * scolpt[ SCOLPT_SIZE ];
+	int * fcolpt[ FCOLPT_SIZE ];
+	int sc[ SC_SIZE ];
+	int yl[ YL_SIZE_1 ][ YL_SIZE_2 ];
+	/* Arrays used significantly by sift() */
+	int rq[ RQ_SIZE ];
+	int tq[ TQ_SIZE ];
+	int zz[ ZZ_SIZE ];
+	int rx[ RX_SIZE ];
+	int mm[ MM_SIZE ];
+	int nn[ NN_SIZE ];
+	int qq[ QQ_SIZE ];
+	int rk[ RK_SIZE ];
+	int cp[ CP_SIZE ];
+	int rp[ RP_SIZE ];
+	int rf[ RF_SIZE_1 ][ RF_SIZE_2 ];
+	int cf[ CF_SIZE_1 ][ CF_SIZE_2 ];
+	int y[ Y_SIZE ];
+	/* Formerly function statics in bz_match() */
+	int rot[ ROT_SIZE_1 ][ ROT_SIZE_2 ];
+	int * rtp[ ROT_SIZE_1 ];
+	/* Formerly file statics shared by bz_match_score() & bz_final_loop() */
+	int ct[ CT_SIZE ];
+	int gct[ GCT_SIZE ];
+	int ctt[ CTT_SIZE ];
+	int ctp[ CTP_SIZE_1 ][ CTP_SIZE_2 ];
+	int yy[ YY_SIZE_1 ][ YY_SIZE_2 ][ YY_SIZE_3 ];
+	int sct[ SCT_SIZE_1 ][ SCT_SIZE_2 ];
+	/* Allocation scope of the caller, restored on release by libfprint */
+	int alloc_scope;
+};
+
+/* A gallery fingerprint's pruned, sorted pairwise comparison table,     */
+/* kept so that it need not be rebuilt for every probe it is matched to. */
+/* gstruct is referenced, not copied, and must outlive the table.        */
+/* Probe tables are built the same way, and kept in the same structure.  */
+struct bz_gallery {
+	struct xyt_struct * gstruct;
+	int len;
+	int ** colpt;
+	int cols[][ COLS_SIZE_2 ];
+};
+
+/* Context used by the legacy, non-reentrant entry points, see bz_gbls.c */
 
 /**************************************************************************/
 /**************************************************************************/
 /* ROUTINE PROTOTYPES */
 /**************************************************************************/
+/* In: BZ_GBLS.C */
+extern struct bz_ctx *bz_ctx_new(void);
+extern void bz_ctx_free(struct bz_ctx *);
+extern struct bz_ctx *bz_default_ctx(void);
+extern void bz_default_ctx_free(void);
 /* In: BZ_DRVRS.C */
+extern int bozorth_probe_init_ctx(struct bz_ctx *, struct xyt_struct *);
+extern int bozorth_gallery_init_ctx(struct bz_ctx *, struct xyt_struct *);
+extern int bozorth_to_gallery_ctx(struct bz_ctx *, int, struct xyt_struct *,
+                    struct xyt_struct *);
+extern int bozorth_main_ctx(struct bz_ctx *, struct xyt_struct *,
+                    struct xyt_struct *);
+extern struct bz_gallery *bozorth_gallery_prepare_ctx(struct bz_ctx *,
+                    struct xyt_struct *);
+extern struct bz_gallery *bozorth_gallery_new(struct xyt_struct *, int);
+extern void bozorth_gallery_free(struct bz_gallery *);
+extern int bozorth_to_prepared_gallery_ctx(struct bz_ctx *, int,
+                    struct xyt_struct *, const struct bz_gallery *);
+extern int bozorth_to_gallery_bounded_ctx(struct bz_ctx *, int,
+                    struct xyt_struct *, struct xyt_struct *, int);
+extern int bozorth_to_prepared_gallery_bounded_ctx(struct bz_ctx *, int,
+                    struct xyt_struct *, const struct bz_gallery *, int);
+extern struct bz_gallery *bozorth_probe_prepare_ctx(struct bz_ctx *,
+                    struct xyt_struct *);
+extern int bozorth_prepared_to_gallery_bounded_ctx(struct bz_ctx *,
+                    const struct bz_gallery *, struct xyt_struct *, int);
+extern int bozorth_prepared_to_prepared_gallery_bounded_ctx(struct bz_ctx *,
+                    const struct bz_gallery *, const struct bz_gallery *, int);
 extern int bozorth_probe_init( struct xyt_struct *);
 extern int bozorth_gallery_init( struct xyt_struct *);
 extern int bozorth_to_gallery(int, struct xyt_struct *, struct xyt_struct *);
@@ -228,8 +284,19 @@ extern int bozorth_main(struct xyt_struct *, struct xyt_struct *);
 extern void bz_comp(int, int [], int [], int [], int *, int [][COLS_SIZE_2],
                     int *[]);
 extern void bz_find(int *, int *[]);
+extern int bz_match_ctx(struct bz_ctx *, int, int);
+extern int bz_match_gallery_ctx(struct bz_ctx *, int, int, int **);
+extern int bz_match_tables_ctx(struct bz_ctx *, int, int **, int, int **);
+extern int bz_match_score_ctx(struct bz_ctx *, int, struct xyt_struct *,
+                    struct xyt_struct *);
+extern int bz_match_score_bounded_ctx(struct bz_ctx *, int,
+                    struct xyt_struct *, struct xyt_struct *, int);
+extern void bz_sift_ctx(struct bz_ctx *, int *, int, int *, int, int, int,
+                    int *, int *);
 extern int bz_match(int, int);
 extern int bz_match_score(int, struct xyt_struct *, struct xyt_struct *);
+extern int bz_match_score_bounded(int, struct xyt_struct *,
+                    struct xyt_struct *, int);
 extern void bz_sift(int *, int, int *, int, int, int, int *, int *);
 /* In: BZ_ALLOC.C */
 extern char *malloc_or_exit(int, const char *);
@@ -252,5 +319,8 @@ extern int fd_readable(int);
 extern int sort_quality_decreasing(const void *, const void *);
 extern int sort_x_y(const void *, const void *);
 extern int sort_order_decreasing(int [], int, int []);
+extern void bz_sort_rows(int, int [][COLS_SIZE_2], int *[]);
+/* In: BZ_TRIG.C */
+extern int bz_atan_deg(int, int);
 
 #endif /* !_BOZORTH_H */
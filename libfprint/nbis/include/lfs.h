@@ -91,11 +91,22 @@ typedef struct dir2rad{
    double *sin;
 } DIR2RAD;
 
+/* Precision of the DFT wave forms and of the DFT powers derived from   */
+/* them.  Building with LFS_SINGLE_PRECISION stores and accumulates them */
+/* as floats, which halves their memory traffic and doubles the width   */
+/* of the vectorized DFT loops, at the cost of results that no longer   */
+/* match the reference NIST implementation bit for bit.                 */
+#ifdef LFS_SINGLE_PRECISION
+typedef float DFTREAL;
+#else
+typedef double DFTREAL;
+#endif
+
 /* DFT wave form structure containing both cosine and   */
 /* sine components for a specific frequency.            */
 typedef struct dftwave{
-   double *cos;
-   double *sin;
+   DFTREAL *cos;
+   DFTREAL *sin;
 } DFTWAVE;
 
 /* DFT wave forms structure containing all wave forms  */
@@ -121,6 +132,34 @@ typedef struct rotgrids{
    int **grids;
 } ROTGRIDS;
 
+/* Memory arena the LFS routines may allocate from (see arena.c). */
+typedef struct lfsarena LFSARENA;
+
+/* The lookup tables built for a given set of LFS parameters and image  */
+/* width.  They are kept in a process-wide cache and shared by all the  */
+/* detections that use the same key, so they must not be modified.      */
+/* The rotated grids depend on the padded row pitch but not the height, */
+/* so images cropped to different heights share one set of tables.      */
+typedef struct lfstables{
+   /* Key */
+   int iw;
+   int pad;
+   int num_directions;
+   double start_dir_angle;
+   int num_dft_waves;
+   int windowsize;
+   int dirbin_grid_w;
+   int dirbin_grid_h;
+   /* Tables */
+   DIR2RAD *dir2rad;
+   DFTWAVES *dftwaves;
+   ROTGRIDS *dftgrids;
+   ROTGRIDS *dirbingrids;
+   /* Cache bookkeeping */
+   int refs;
+   struct lfstables *next;
+} LFSTABLES;
+
 /*************************************************************************/
 /* 10, 2X3 pixel pair feature patterns used to define ridge endings      */
 /* and bifurcations.                                                     */
@@ -134,6 +173,18 @@ typedef struct rotgrids{
 typedef struct fp_minutia MINUTIA;
 typedef struct fp_minutiae MINUTIAE;
 
+/* Uniform grid of square cells over an image, bucketing a list of  */
+/* minutiae by position so that neighborhood queries only look at   */
+/* the cells they overlap.  The indices of the minutiae in cell c   */
+/* are index[start[c]] through index[start[c+1]-1], in list order.  */
+typedef struct minutiae_grid{
+   int cell;      /* Width and height (in pixels) of a cell.  */
+   int gw;        /* Number of columns of cells.               */
+   int gh;        /* Number of rows of cells.                  */
+   int *start;    /* gw*gh+1 offsets into index.               */
+   int *index;    /* Minutia indices sorted by cell.           */
+} MINUTIAE_GRID;
+
 typedef struct feature_pattern{
    int type;
    int appearing;
@@ -158,6 +209,22 @@ typedef struct shape{
    int nrows;     /* Number of rows assigned to shape.          */
 } SHAPE;
 
+/* Stages of minutiae detection whose run times are kept in LFSSTATS. */
+#define LFS_STAGE_SETUP         0  /* cropping, padding, lookup tables  */
+#define LFS_STAGE_INITIAL_MAPS  1  /* DFT direction and contrast maps   */
+#define LFS_STAGE_INTERPOLATE   2  /* map cleanup and interpolation     */
+#define LFS_STAGE_BINARIZE      3
+#define LFS_STAGE_DETECT        4
+#define LFS_STAGE_REMOVE        5  /* false minutia removal             */
+#define LFS_STAGE_RIDGE_COUNT   6
+#define LFS_STAGE_QUALITY       7  /* quality map and reliabilities     */
+#define LFS_NUM_STAGES          8
+
+/* Time (in microseconds) spent in each stage of a detection. */
+typedef struct lfsstats{
+   gint64 usecs[LFS_NUM_STAGES];
+} LFSSTATS;
+
 /* Parameters used by LFS for setting thresholds and  */
 /* defining testing criterion.                        */
 typedef struct lfsparms{
@@ -242,6 +309,13 @@ typedef struct lfsparms{
    /* Ridge Counting Controls */
    int    max_nbrs;
    int    max_ridge_steps;
+
+   /* Threading Controls */
+   int    num_threads;  /* threads for the initial maps and the minutia */
+                        /* scans, 0 or 1 for none                        */
+
+   /* Instrumentation Controls */
+   LFSSTATS *stats;     /* stage timings are added here, NULL for none */
 } LFSPARMS;
 
 /*************************************************************************/
@@ -366,6 +440,10 @@ typedef struct lfsparms{
 /* this value is in terms of 6-bit pixels.)                           */
 #define MIN_CONTRAST_DELTA       5
 
+/* Number of block rows of background kept above and below the rows */
+/* that may hold ridges when an image is cropped before analysis.   */
+#define FOREGROUND_MARGIN_V2     4
+
 
 /***** DFT CONSTANTS *****/
 
@@ -688,6 +766,16 @@ typedef struct lfsparms{
 /*        EXTERNAL FUNCTION DEFINITIONS                                  */
 /*************************************************************************/
 
+/* arena.c */
+extern LFSARENA *lfs_arena_new(void);
+extern void lfs_arena_reset(LFSARENA *);
+extern void lfs_arena_free(LFSARENA *);
+extern LFSARENA *lfs_set_arena(LFSARENA *);
+extern void *lfs_malloc(const size_t);
+extern void *lfs_calloc(const size_t, const size_t);
+extern void *lfs_realloc(void *, const size_t);
+extern void lfs_free(void *);
+
 /* binar.c */
 extern int binarize_V2(unsigned char **, int *, int *,
                      unsigned char *, const int, const int,
@@ -704,6 +792,8 @@ extern int block_offsets(int **, int *, int *, const int, const int,
                      const int, const int);
 extern int low_contrast_block(const int, const int,
                      unsigned char *, const int, const int, const LFSPARMS *);
+extern int foreground_rows(int *, int *, unsigned char *, const int,
+                     const int, const LFSPARMS *);
 extern int find_valid_block(int *, int *, int *, int *, int *,
                      const int, const int, const int, const int,
                      const int, const int);
@@ -741,17 +831,17 @@ extern int get_minutiae(MINUTIAE **, int **, int **, int **,
                  const int, const double, const LFSPARMS *);
 
 /* dft.c */
-extern int dft_dir_powers(double **, unsigned char *, const int,
+extern int dft_dir_powers(DFTREAL **, unsigned char *, const int,
                      const int, const int, const DFTWAVES *,
                      const ROTGRIDS *);
-extern int dft_power_stats(int *, double *, int *, double *, double **,
+extern int dft_power_stats(int *, DFTREAL *, int *, DFTREAL *, DFTREAL **,
                      const int, const int, const int);
 
 /* free.c */
 extern void free_dir2rad(DIR2RAD *);
 extern void free_dftwaves(DFTWAVES *);
 extern void free_rotgrids(ROTGRIDS *);
-extern void free_dir_powers(double **, const int);
+extern void free_dir_powers(DFTREAL **, const int);
 
 /* imgutil.c */
 extern void bits_6to8(unsigned char *, const int, const int);
@@ -761,6 +851,9 @@ extern void gray2bin(const int, const int, const int,
 extern int pad_uchar_image(unsigned char **, int *, int *,
                      unsigned char *, const int, const int, const int,
                      const int);
+extern int pad_uchar_rows(unsigned char **, int *, int *,
+                     unsigned char *, const int, const int, const int,
+                     const int, const int, const int);
 extern void fill_holes(unsigned char *, const int, const int);
 extern int free_path(const int, const int, const int, const int,
                      unsigned char *, const int, const int, const LFSPARMS *);
@@ -774,8 +867,9 @@ extern int init_dftwaves(DFTWAVES **, const double *, const int, const int);
 extern int get_max_padding_V2(const int, const int, const int, const int);
 extern int init_rotgrids(ROTGRIDS **, const int, const int, const int,
                      const double, const int, const int, const int, const int);
-extern int alloc_dir_powers(double ***, const int, const int);
-extern int alloc_power_stats(int **, double **, int **, double **, const int);
+extern int alloc_dir_powers(DFTREAL ***, const int, const int);
+extern int alloc_power_stats(int **, DFTREAL **, int **, DFTREAL **,
+                     const int);
 
 /* line.c */
 extern int line_points(int **, int **, int *,
@@ -823,11 +917,11 @@ extern int gen_high_curve_map(int **, int *, const int, const int,
 extern int gen_initial_imap(int **, int *, const int, const int,
                      unsigned char *, const int, const int,
                      const DFTWAVES *, const ROTGRIDS *, const LFSPARMS *);
-extern int primary_dir_test(double **, const int *, const double *,
-                     const int *, const double *, const int,
+extern int primary_dir_test(DFTREAL **, const int *, const DFTREAL *,
+                     const int *, const DFTREAL *, const int,
                      const LFSPARMS *);
-extern int secondary_fork_test(double **, const int *, const double *,
-                     const int *, const double *, const int,
+extern int secondary_fork_test(DFTREAL **, const int *, const DFTREAL *,
+                     const int *, const DFTREAL *, const int,
                      const LFSPARMS *);
 extern void remove_incon_dirs(int *, const int, const int,
                      const DIR2RAD *, const LFSPARMS *);
@@ -889,6 +983,11 @@ extern int create_minutia(MINUTIA **, const int, const int,
                      const int, const int, const int);
 extern void free_minutiae(MINUTIAE *);
 extern void free_minutia(MINUTIA *);
+extern int copy_minutiae(MINUTIAE **, const MINUTIAE *);
+extern int minutiae_grid_cell(const MINUTIAE_GRID *, const int, const int);
+extern int build_minutiae_grid(MINUTIAE_GRID **, const MINUTIAE *,
+                     const int, const int, const int);
+extern void free_minutiae_grid(MINUTIAE_GRID *);
 extern int remove_minutia(const int, MINUTIAE *);
 extern int join_minutia(const MINUTIA *, const MINUTIA *, unsigned char *,
                      const int, const int, const int, const int);
@@ -1008,6 +1107,12 @@ extern void bubble_sort_double_inc_2(double *, int *, const int);
 extern void bubble_sort_double_dec_2(double *, int *,  const int);
 extern void bubble_sort_int_inc(int *, const int);
 
+/* tables.c */
+extern int get_lfstables(LFSTABLES **, const int, const int, const int,
+                     const LFSPARMS *);
+extern void release_lfstables(LFSTABLES *);
+extern void free_lfstables_cache(void);
+
 /* util.c */
 extern int maxv(const int *, const int);
 extern int minv(const int *, const int);
@@ -1022,11 +1127,13 @@ extern double angle2line(const int, const int, const int, const int);
 extern int line2direction(const int, const int, const int, const int,
                      const int);
 extern int closest_dir_dist(const int, const int, const int);
+extern gint64 start_stage_timer(const LFSPARMS *);
+extern void stop_stage_timer(gint64 *, const int, const LFSPARMS *);
 
 /*************************************************************************/
 /*        EXTERNAL GLOBAL VARIABLE DEFINITIONS                           */
 /*************************************************************************/
-extern double g_dft_coefs[];
+extern const double g_dft_coefs[];
 extern LFSPARMS g_lfsparms;
 extern LFSPARMS g_lfsparms_V2;
 extern int g_nbr8_dx[];
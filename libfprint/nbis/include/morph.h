@@ -36,4 +36,18 @@ extern char get_north8_2(char *, const int, const int, const int);
 extern char get_east8_2(char *, const int, const int, const int);
 extern char get_west8_2(char *, const int, const int);
 
+/* 1-bit packed binary images.  Each row starts on a new word. */
+typedef unsigned long BITWORD;
+#define BITIMAGE_WORD_BITS     ((int)(sizeof(BITWORD)*8))
+#define BITIMAGE_ROW_WORDS(iw) (((iw)+BITIMAGE_WORD_BITS-1)/BITIMAGE_WORD_BITS)
+
+extern void pack_charimage_bits(const unsigned char *, BITWORD *,
+                     const int, const int);
+extern void unpack_charimage_bits(const BITWORD *, unsigned char *,
+                     const int, const int);
+extern void erode_bitimage(const BITWORD *, BITWORD *,
+                     const int, const int);
+extern void dilate_bitimage(const BITWORD *, BITWORD *,
+                     const int, const int);
+
 #endif /* !__MORPH_H__ */
@@ -0,0 +1,416 @@
+/*******************************************************************************
+
+License:
+This software was developed at the National Institute of Standards and
+Technology (NIST) by employees of the Federal Government in the course
+of their official duties. Pursuant to title 17 Section 105 of the
+United States Code, this software is not subject to copyright protection
+and is in the public domain. NIST assumes no responsibility  whatsoever for
+its use by other parties, and makes no guarantees, expressed or implied,
+about its quality, reliability, or any other characteristic.
+
+Disclaimer:
+This software was developed to promote biometric standards and biometric
+technology testing for the Federal Government in accordance with the USA
+PATRIOT Act and the Enhanced Border Security and Visa Entry Reform Act.
+Specific hardware and software products identified in this software were used
+in order to perform the software development.  In no case does such
+identification imply recommendation or endorsement by the National Institute
+of Standards and Technology, nor does it imply that the products and equipment
+identified are necessarily the best available for the purpose.
+
+*******************************************************************************/
+
+/***********************************************************************
+      LIBRARY: LFS - NIST Latent Fingerprint System
+
+      FILE:    ARENA.C
+
+      Contains the memory allocator used by the NIST Latent Fingerprint
+      System (LFS).  The LFS sources reach it through the macros in
+      arena.h.  While a thread has an arena set, its allocations are
+      carved out of the arena and freeing them does nothing; the whole
+      arena is emptied at once when the caller is done with a detection.
+      Otherwise allocations go to the C library as before.
+
+      Every block is preceded by a small header recording where it came
+      from, so a block may be freed or reallocated from any thread,
+      whether or not an arena is set there.
+
+***********************************************************************
+               ROUTINES:
+                        lfs_arena_new()
+                        lfs_arena_reset()
+                        lfs_arena_free()
+                        lfs_set_arena()
+                        lfs_malloc()
+                        lfs_calloc()
+                        lfs_realloc()
+                        lfs_free()
+
+***********************************************************************/
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lfs.h>
+
+/* Size of the first chunk of an arena.  An arena that needed more   */
+/* chunks is rebuilt as one chunk of its high-water mark when reset. */
+#define LFS_ARENA_CHUNK  (1 << 20)
+
+/* Header preceding every block handed out.  Its size keeps the block */
+/* aligned for any type the LFS sources store.                        */
+typedef union lfsblock{
+   struct{
+      size_t size;
+      int in_arena;
+   } h;
+   double align_d;
+   void *align_p;
+   long long align_l;
+} LFSBLOCK;
+
+typedef struct lfschunk{
+   struct lfschunk *next;
+   size_t size;
+   size_t used;
+   LFSBLOCK data[1];
+} LFSCHUNK;
+
+struct lfsarena{
+   /* Chunk currently allocated from, followed by the full ones. */
+   LFSCHUNK *chunks;
+   /* Most recent block, which may still grow or shrink in place. */
+   LFSBLOCK *last;
+};
+
+static GPrivate lfs_current_arena;
+
+/*************************************************************************
+**************************************************************************
+#cat: new_lfschunk - Allocates an empty arena chunk able to hold at least
+#cat:                the given number of bytes.
+
+   Input:
+      size    - number of bytes the chunk must hold
+   Return Code:
+      Non-NULL - the new chunk
+      NULL     - system error
+**************************************************************************/
+static LFSCHUNK *new_lfschunk(const size_t size)
+{
+   LFSCHUNK *chunk;
+
+   chunk = (LFSCHUNK *)malloc(offsetof(LFSCHUNK, data) + size);
+   if(chunk == (LFSCHUNK *)NULL)
+      return((LFSCHUNK *)NULL);
+   chunk->next = (LFSCHUNK *)NULL;
+   chunk->size = size;
+   chunk->used = 0;
+   return(chunk);
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: lfs_arena_new - Allocates an empty arena.  Its first chunk is
+#cat:                 allocated on first use.
+
+   Return Code:
+      Non-NULL - the new arena
+      NULL     - system error
+**************************************************************************/
+LFSARENA *lfs_arena_new(void)
+{
+   LFSARENA *arena;
+
+   arena = (LFSARENA *)malloc(sizeof(LFSARENA));
+   if(arena == (LFSARENA *)NULL){
+      fprintf(stderr, "ERROR : lfs_arena_new : malloc : arena\n");
+      return((LFSARENA *)NULL);
+   }
+   arena->chunks = (LFSCHUNK *)NULL;
+   arena->last = (LFSBLOCK *)NULL;
+   return(arena);
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: lfs_arena_reset - Releases every block allocated from an arena at
+#cat:             once.  The memory is kept for the next detection; if
+#cat:             the arena had to grow, its chunks are merged into one
+#cat:             large enough for the whole of the last detection.
+
+   Input:
+      arena   - the arena to be emptied
+**************************************************************************/
+void lfs_arena_reset(LFSARENA *arena)
+{
+   LFSCHUNK *chunk, *next, *merged;
+   size_t total;
+
+   arena->last = (LFSBLOCK *)NULL;
+   if(arena->chunks == (LFSCHUNK *)NULL)
+      return;
+
+   /* Usual case: everything fit in a single chunk. */
+   if(arena->chunks->next == (LFSCHUNK *)NULL){
+      arena->chunks->used = 0;
+      return;
+   }
+
+   total = 0;
+   for(chunk = arena->chunks; chunk != (LFSCHUNK *)NULL; chunk = chunk->next)
+      total += chunk->size;
+
+   /* If the merged chunk cannot be had, keep the current one. */
+   merged = new_lfschunk(total);
+   if(merged == (LFSCHUNK *)NULL){
+      merged = arena->chunks;
+      merged->used = 0;
+      chunk = merged->next;
+      merged->next = (LFSCHUNK *)NULL;
+   }
+   else
+      chunk = arena->chunks;
+
+   for(; chunk != (LFSCHUNK *)NULL; chunk = next){
+      next = chunk->next;
+      free(chunk);
+   }
+   arena->chunks = merged;
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: lfs_arena_free - Deallocates an arena and all the memory obtained
+#cat:                  from it.
+
+   Input:
+      arena   - the arena to be freed
+**************************************************************************/
+void lfs_arena_free(LFSARENA *arena)
+{
+   LFSCHUNK *chunk, *next;
+
+   for(chunk = arena->chunks; chunk != (LFSCHUNK *)NULL; chunk = next){
+      next = chunk->next;
+      free(chunk);
+   }
+   free(arena);
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: lfs_set_arena - Sets the arena the calling thread allocates LFS
+#cat:                 memory from, or none when NULL.
+
+   Input:
+      arena   - the arena to be used, or NULL
+   Return Code:
+      The arena previously set on the calling thread, or NULL
+**************************************************************************/
+LFSARENA *lfs_set_arena(LFSARENA *arena)
+{
+   LFSARENA *prev;
+
+   prev = (LFSARENA *)g_private_get(&lfs_current_arena);
+   g_private_set(&lfs_current_arena, arena);
+   return(prev);
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: block_units - Returns the number of header-sized units needed for a
+#cat:               block of the given size, including its header.
+**************************************************************************/
+static size_t block_units(const size_t size)
+{
+   return(1 + (size + sizeof(LFSBLOCK) - 1) / sizeof(LFSBLOCK));
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: arena_alloc - Carves a block out of an arena, adding a chunk when
+#cat:               the current one is full.
+
+   Input:
+      arena   - the arena to allocate from
+      size    - requested size in bytes
+   Return Code:
+      Non-NULL - header of the new block
+      NULL     - system error
+**************************************************************************/
+static LFSBLOCK *arena_alloc(LFSARENA *arena, const size_t size)
+{
+   LFSCHUNK *chunk;
+   LFSBLOCK *block;
+   size_t units, chunk_size;
+
+   units = block_units(size);
+   chunk = arena->chunks;
+   if(chunk == (LFSCHUNK *)NULL ||
+      chunk->size / sizeof(LFSBLOCK) - chunk->used < units){
+      chunk_size = (chunk == (LFSCHUNK *)NULL) ? LFS_ARENA_CHUNK :
+                   2 * chunk->size;
+      if(chunk_size < units * sizeof(LFSBLOCK))
+         chunk_size = units * sizeof(LFSBLOCK);
+      chunk = new_lfschunk(chunk_size);
+      if(chunk == (LFSCHUNK *)NULL)
+         return((LFSBLOCK *)NULL);
+      chunk->next = arena->chunks;
+      arena->chunks = chunk;
+   }
+
+   block = chunk->data + chunk->used;
+   chunk->used += units;
+   block->h.size = size;
+   block->h.in_arena = TRUE;
+   arena->last = block;
+   return(block);
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: lfs_malloc - Allocates a block of memory for the LFS routines.
+
+   Input:
+      size    - requested size in bytes
+   Return Code:
+      Non-NULL - the new block
+      NULL     - system error
+**************************************************************************/
+void *lfs_malloc(const size_t size)
+{
+   LFSARENA *arena;
+   LFSBLOCK *block;
+
+   if(size > (size_t)-1 - 2 * sizeof(LFSBLOCK))
+      return(NULL);
+
+   arena = (LFSARENA *)g_private_get(&lfs_current_arena);
+   if(arena != (LFSARENA *)NULL)
+      block = arena_alloc(arena, size);
+   else{
+      block = (LFSBLOCK *)malloc(sizeof(LFSBLOCK) + size);
+      if(block != (LFSBLOCK *)NULL){
+         block->h.size = size;
+         block->h.in_arena = FALSE;
+      }
+   }
+
+   if(block == (LFSBLOCK *)NULL)
+      return(NULL);
+   return(block + 1);
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: lfs_calloc - Allocates a zeroed array for the LFS routines.
+
+   Input:
+      nmemb   - number of elements
+      size    - size in bytes of each element
+   Return Code:
+      Non-NULL - the new block
+      NULL     - system error
+**************************************************************************/
+void *lfs_calloc(const size_t nmemb, const size_t size)
+{
+   void *ptr;
+
+   if(size != 0 && nmemb > (size_t)-1 / size)
+      return(NULL);
+
+   ptr = lfs_malloc(nmemb * size);
+   if(ptr != NULL)
+      memset(ptr, 0, nmemb * size);
+   return(ptr);
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: lfs_realloc - Resizes a block allocated by the LFS routines.  The
+#cat:             most recent block of the calling thread's arena is
+#cat:             resized in place when its chunk has room.
+
+   Input:
+      ptr     - the block to be resized, or NULL
+      size    - new size in bytes
+   Return Code:
+      Non-NULL - the resized block
+      NULL     - system error, in which case ptr is left untouched
+**************************************************************************/
+void *lfs_realloc(void *ptr, const size_t size)
+{
+   LFSARENA *arena;
+   LFSBLOCK *block;
+   LFSCHUNK *chunk;
+   size_t units;
+   void *nptr;
+
+   if(ptr == NULL)
+      return(lfs_malloc(size));
+   if(size > (size_t)-1 - 2 * sizeof(LFSBLOCK))
+      return(NULL);
+
+   block = (LFSBLOCK *)ptr - 1;
+   if(!block->h.in_arena){
+      block = (LFSBLOCK *)realloc(block, sizeof(LFSBLOCK) + size);
+      if(block == (LFSBLOCK *)NULL)
+         return(NULL);
+      block->h.size = size;
+      return(block + 1);
+   }
+
+   arena = (LFSARENA *)g_private_get(&lfs_current_arena);
+   if(arena != (LFSARENA *)NULL && arena->last == block){
+      chunk = arena->chunks;
+      units = block_units(size);
+      if((size_t)(block - chunk->data) + units <=
+         chunk->size / sizeof(LFSBLOCK)){
+         chunk->used = (block - chunk->data) + units;
+         block->h.size = size;
+         return(ptr);
+      }
+   }
+
+   nptr = lfs_malloc(size);
+   if(nptr == NULL)
+      return(NULL);
+   memcpy(nptr, ptr, (block->h.size < size) ? block->h.size : size);
+   lfs_free(ptr);
+   return(nptr);
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: lfs_free - Deallocates a block allocated by the LFS routines.
+#cat:             Arena blocks are only reclaimed when the arena is
+#cat:             reset, except for the most recent one of the calling
+#cat:             thread's arena, which is given back at once.
+
+   Input:
+      ptr     - the block to be freed, or NULL
+**************************************************************************/
+void lfs_free(void *ptr)
+{
+   LFSARENA *arena;
+   LFSBLOCK *block;
+
+   if(ptr == NULL)
+      return;
+
+   block = (LFSBLOCK *)ptr - 1;
+   if(!block->h.in_arena){
+      free(block);
+      return;
+   }
+
+   arena = (LFSARENA *)g_private_get(&lfs_current_arena);
+   if(arena != (LFSARENA *)NULL && arena->last == block){
+      arena->chunks->used = block - arena->chunks->data;
+      arena->last = (LFSBLOCK *)NULL;
+   }
+}
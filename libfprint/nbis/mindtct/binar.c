@@ -38,13 +38,16 @@ identified are necessarily the best available for the purpose.
                ROUTINES:
                         binarize_V2()
 			binarize_image_V2()
+                        dirbinarize_run()
                         dirbinarize()
 
 ***********************************************************************/
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <lfs.h>
+#include <arena.h>
 
 /*************************************************************************
 **************************************************************************
@@ -101,6 +104,87 @@ int binarize_V2(unsigned char **odata, int *ow, int *oh,
    return(0);
 }
 
+#ifndef DIRBIN_SCALAR
+/* Pixels are binarized in strips of DIRBIN_LANES consecutive pixels, */
+/* and up to DIRBIN_RUN pixels at a time.                             */
+#define DIRBIN_LANES   8
+#define DIRBIN_RUN    32
+
+/*************************************************************************
+**************************************************************************
+#cat: dirbinarize_run - Binarizes a run of consecutive grayscale pixels
+#cat:               that lie in blocks of the same VALID IMAP direction.
+#cat:               Each offset of the rotated grid addresses a strip of
+#cat:               consecutive pixels, so the row sums of a whole strip
+#cat:               are accumulated together.  The result is the same as
+#cat:               calling dirbinarize() on each pixel.
+
+   CAUTION: The image to which the input pixels point must be appropriately
+            padded to account for the radius of the rotated grid.
+
+   Input:
+      pptr        - pointer to the first grayscale pixel of the run
+      npix        - number of pixels in the run, a multiple of DIRBIN_LANES
+                    no larger than DIRBIN_RUN
+      idir        - IMAP integer direction associated with the run's blocks
+      dirbingrids - set of precomputed rotated grid offsets
+   Output:
+      bptr        - the binarized pixels of the run
+**************************************************************************/
+static void dirbinarize_run(unsigned char *bptr,
+                const unsigned char *pptr, const int npix, const int idir,
+                const ROTGRIDS *dirbingrids)
+{
+   int gx, gy, gi, cy, sx, i;
+   int rsum[DIRBIN_RUN], gsum[DIRBIN_RUN], csum[DIRBIN_RUN];
+   const unsigned char *strip;
+   int *grid;
+   double dcy;
+
+   /* Assign nickname pointer. */
+   grid = dirbingrids->grids[idir];
+   /* Calculate center (0-oriented) row in grid, as dirbinarize() does. */
+   dcy = (dirbingrids->grid_h-1)/(double)2.0;
+   dcy = trunc_dbl_precision(dcy, TRUNC_SCALE);
+   cy = sround(dcy);
+
+   /* Foreach strip of pixels in the run ... */
+   for(sx = 0; sx < npix; sx += DIRBIN_LANES){
+      for(i = 0; i < DIRBIN_LANES; i++){
+         gsum[sx+i] = 0;
+         csum[sx+i] = 0;
+      }
+
+      gi = 0;
+      /* Foreach row in grid ... */
+      for(gy = 0; gy < dirbingrids->grid_h; gy++){
+         for(i = 0; i < DIRBIN_LANES; i++)
+            rsum[sx+i] = 0;
+         /* Foreach column in grid, accumulate the strip of pixels */
+         /* found at this grid offset.                             */
+         for(gx = 0; gx < dirbingrids->grid_w; gx++){
+            strip = pptr + sx + grid[gi++];
+            for(i = 0; i < DIRBIN_LANES; i++)
+               rsum[sx+i] += strip[i];
+         }
+         for(i = 0; i < DIRBIN_LANES; i++)
+            gsum[sx+i] += rsum[sx+i];
+         /* If current row is center row, then save row sums separately. */
+         if(gy == cy){
+            for(i = 0; i < DIRBIN_LANES; i++)
+               csum[sx+i] = rsum[sx+i];
+         }
+      }
+   }
+
+   /* Compare each center row sum treated as an average against the */
+   /* total pixel sum in its rotated grid.                          */
+   for(i = 0; i < npix; i++)
+      bptr[i] = ((csum[i] * dirbingrids->grid_h) < gsum[i]) ?
+                BLACK_PIXEL : WHITE_PIXEL;
+}
+#endif
+
 /*************************************************************************
 **************************************************************************
 #cat: binarize_image_V2 - Takes a grayscale input image and its associated
@@ -131,7 +215,8 @@ int binarize_image_V2(unsigned char **odata, int *ow, int *oh,
                    const int *direction_map, const int mw, const int mh,
                    const int blocksize, const ROTGRIDS *dirbingrids)
 {
-   int ix, iy, bw, bh, bx, by, mapval;
+   int ix, iy, bw, bh, mapval, npix;
+   const int *mapptr;
    unsigned char *bdata, *bptr;
    unsigned char *pptr, *spptr;
 
@@ -150,25 +235,42 @@ int binarize_image_V2(unsigned char **odata, int *ow, int *oh,
    for(iy = 0; iy < bh; iy++){
       /* Set pixel pointer to start of next row in grid. */
       pptr = spptr;
-      for(ix = 0; ix < bw; ix++){
-
-         /* Compute which block the current pixel is in. */
-         bx = (int)(ix/blocksize);
-         by = (int)(iy/blocksize);
-         /* Get corresponding value in Direction Map. */
-         mapval = *(direction_map + (by*mw) + bx);
+      /* Get the row of the Direction Map the current row is in. */
+      mapptr = direction_map + ((int)(iy/blocksize) * mw);
+      ix = 0;
+      while(ix < bw){
+         /* Get the value in Direction Map of the current pixel's block. */
+         mapval = mapptr[(int)(ix/blocksize)];
+#ifdef DIRBIN_SCALAR
+         npix = 1;
+#else
+         /* Following pixels in blocks of the same direction share the */
+         /* same rotated grid, so they are binarized together.         */
+         for(npix = 1; npix < DIRBIN_RUN && ix + npix < bw &&
+                       mapptr[(int)((ix+npix)/blocksize)] == mapval; npix++);
+         /* Whole strips are binarized together, the rest one by one. */
+         if(npix >= DIRBIN_LANES)
+            npix -= npix % DIRBIN_LANES;
+         else if(mapval != INVALID_DIR)
+            npix = 1;
+#endif
          /* If current block has has INVALID direction ... */
          if(mapval == INVALID_DIR)
-            /* Set binary pixel to white (255). */
-            *bptr = WHITE_PIXEL;
+            /* Set binary pixels to white (255). */
+            memset(bptr, WHITE_PIXEL, npix);
          /* Otherwise, if block has a valid direction ... */
-         else /*if(mapval >= 0)*/
+#ifndef DIRBIN_SCALAR
+         else if(npix >= DIRBIN_LANES)
+            dirbinarize_run(bptr, pptr, npix, mapval, dirbingrids);
+#endif
+         else
             /* Use directional binarization based on block's direction. */
             *bptr = dirbinarize(pptr, mapval, dirbingrids);
 
          /* Bump input and output pixel pointers. */
-         pptr++;
-         bptr++;
+         ix += npix;
+         pptr += npix;
+         bptr += npix;
       }
       /* Bump pointer to the next row in padded input image. */
       spptr += pw;
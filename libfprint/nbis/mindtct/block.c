@@ -38,6 +38,7 @@ identified are necessarily the best available for the purpose.
                ROUTINES:
                         block_offsets()
                         low_contrast_block()
+                        foreground_rows()
                         find_valid_block()
                         set_margin_blocks()
 
@@ -47,6 +48,7 @@ identified are necessarily the best available for the purpose.
 #include <stdlib.h>
 #include <string.h>
 #include <lfs.h>
+#include <arena.h>
 
 /*************************************************************************
 **************************************************************************
@@ -274,6 +276,195 @@ int low_contrast_block(const int blkoffset, const int blocksize,
       return(FALSE);
 }
 
+/*************************************************************************
+**************************************************************************
+#cat: low_variance_row - Tests whether every block window starting on the
+#cat:            given pixel row of an image has too little variance to pass
+#cat:            low_contrast_block().  Window sums are taken from integral
+#cat:            images of the 6-bit pixel values and of their squares.
+
+   Input:
+      isum      - integral image of the 6-bit pixel values
+      isqr      - integral image of the squared 6-bit pixel values
+      iw        - width (in pixels) of the image
+      wy        - pixel row the windows start on
+      lowvar    - bound below which a window is surely low contrast
+      lfsparms  - parameters and thresholds for controlling LFS
+   Return Code:
+      TRUE      - every window in the row is low contrast
+      FALSE     - otherwise
+**************************************************************************/
+static int low_variance_row(const unsigned int *isum, const unsigned int *isqr,
+                     const int iw, const int wy, const long long lowvar,
+                     const LFSPARMS *lfsparms)
+{
+   int bs, ws, wo, stride, mw, bx, px, wx;
+   int tl, tr, bl, br;
+   unsigned int sum, sqr;
+   long long numpix, var;
+
+   bs = lfsparms->blocksize;
+   ws = lfsparms->windowsize;
+   wo = lfsparms->windowoffset;
+   stride = iw + 1;
+   numpix = ws * ws;
+   mw = (int)ceil(iw / (double)bs);
+
+   for(bx = 0; bx < mw; bx++){
+      /* Take the window low_contrast_block() would be given, */
+      /* including the shift of the last column of blocks.     */
+      px = (bx < mw-1) ? bx*bs : iw-bs;
+      wx = max(0, px - wo);
+      wx = min(iw - ws - 1, wx);
+
+      tl = (wy * stride) + wx;
+      tr = tl + ws;
+      bl = tl + (ws * stride);
+      br = bl + ws;
+      /* Unsigned wrap-around cancels out in the differences. */
+      sum = isum[br] - isum[bl] - isum[tr] + isum[tl];
+      sqr = isqr[br] - isqr[bl] - isqr[tr] + isqr[tl];
+
+      /* Twice the window variance, scaled by numpix^2. */
+      var = ((numpix * (long long)sqr) - ((long long)sum * sum)) << 1;
+      if(var >= lowvar * numpix)
+         return(FALSE);
+   }
+
+   return(TRUE);
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: foreground_rows - Finds the band of block rows in a grayscale image
+#cat:            that may hold fingerprint ridges, so the empty background
+#cat:            above and below a finger, as left by swipe sensors, need
+#cat:            not be analyzed.  A window whose 10th and 90th percentile
+#cat:            pixels are at least min_contrast_delta apart has a variance
+#cat:            of no less than p * delta^2 / 2, p being the fraction of
+#cat:            pixels beyond each percentile.  Rows are left out only
+#cat:            when every window in them falls below that bound, so all
+#cat:            the blocks cropped away would have been found low contrast.
+
+   Input:
+      idata     - 8-bit grayscale input image
+      iw        - width (in pixels) of the image
+      ih        - height (in pixels) of the image
+      lfsparms  - parameters and thresholds for controlling LFS
+   Output:
+      oy0       - first pixel row of the band, a multiple of the blocksize
+      oy1       - pixel row just past the band, a multiple of the blocksize
+                  unless it is ih
+   Return Code:
+      Zero      - successful completion
+      Negative  - system error
+**************************************************************************/
+int foreground_rows(int *oy0, int *oy1, unsigned char *idata,
+                    const int iw, const int ih, const LFSPARMS *lfsparms)
+{
+   unsigned int *isum, *isqr, *sptr, *qptr;
+   unsigned int rowsum, rowsqr, pix;
+   int bs, ws, wo, mh, by, py, wy, x, y, stride;
+   int first, last, y0, y1, prctthresh;
+   long long lowvar;
+   double tdbl;
+   unsigned char *iptr;
+
+   /* Default to analyzing the whole image. */
+   *oy0 = 0;
+   *oy1 = ih;
+
+   bs = lfsparms->blocksize;
+   ws = lfsparms->windowsize;
+   wo = lfsparms->windowoffset;
+   if((iw <= ws) || (ih <= ws) || (iw < bs) || (ih < bs))
+      return(0);
+
+   /* Number of pixels beyond each percentile, as in low_contrast_block(). */
+   tdbl = (lfsparms->percentile_min_max/100.0) * (double)((ws*ws)-1);
+   tdbl = trunc_dbl_precision(tdbl, TRUNC_SCALE);
+   prctthresh = sround(tdbl);
+   if(prctthresh <= 0)
+      return(0);
+   lowvar = (long long)prctthresh *
+            lfsparms->min_contrast_delta * lfsparms->min_contrast_delta;
+
+   /* Build integral images with a leading row and column of zeros. */
+   stride = iw + 1;
+   isum = (unsigned int *)calloc(stride * (ih+1), sizeof(unsigned int));
+   if(isum == (unsigned int *)NULL){
+      fprintf(stderr, "ERROR : foreground_rows : calloc : isum\n");
+      return(-82);
+   }
+   isqr = (unsigned int *)calloc(stride * (ih+1), sizeof(unsigned int));
+   if(isqr == (unsigned int *)NULL){
+      free(isum);
+      fprintf(stderr, "ERROR : foreground_rows : calloc : isqr\n");
+      return(-83);
+   }
+
+   iptr = idata;
+   for(y = 0; y < ih; y++){
+      sptr = isum + ((y+1) * stride) + 1;
+      qptr = isqr + ((y+1) * stride) + 1;
+      rowsum = 0;
+      rowsqr = 0;
+      for(x = 0; x < iw; x++){
+         /* Same 6-bit scaling as bits_8to6(). */
+         pix = *iptr++ >> 2;
+         rowsum += pix;
+         rowsqr += pix * pix;
+         sptr[x] = sptr[x - stride] + rowsum;
+         qptr[x] = qptr[x - stride] + rowsqr;
+      }
+   }
+
+   /* Find the first and last block rows with a window that might */
+   /* not be low contrast.                                         */
+   mh = (int)ceil(ih / (double)bs);
+   first = -1;
+   last = -1;
+   for(by = 0; by < mh; by++){
+      py = (by < mh-1) ? by*bs : ih-bs;
+      wy = max(0, py - wo);
+      wy = min(ih - ws - 1, wy);
+      if(!low_variance_row(isum, isqr, iw, wy, lowvar, lfsparms)){
+         if(first < 0)
+            first = by;
+         last = by;
+      }
+   }
+
+   /* Nothing but background, so skip no work and let the normal */
+   /* analysis report an empty image.                            */
+   if(first < 0){
+      free(isum);
+      free(isqr);
+      return(0);
+   }
+
+   y0 = max(0, (first - FOREGROUND_MARGIN_V2) * bs);
+   y1 = min(ih, (last + 1 + FOREGROUND_MARGIN_V2) * bs);
+
+   /* Inside the band, windows are kept from reaching past its edges, so */
+   /* those of its first and last block rows move in.  Widen the band    */
+   /* until these moved windows are low contrast as well.                */
+   while((y0 > 0) && !low_variance_row(isum, isqr, iw, y0, lowvar, lfsparms))
+      y0 = max(0, y0 - bs);
+   while((y1 < ih) && !low_variance_row(isum, isqr, iw, y1 - ws - 1,
+                                        lowvar, lfsparms))
+      y1 = min(ih, y1 + bs);
+
+   free(isum);
+   free(isqr);
+
+   if((y1 - y0) > ws){
+      *oy0 = y0;
+      *oy1 = y1;
+   }
+   return(0);
+}
+
 /*************************************************************************
 **************************************************************************
 #cat: find_valid_block - Take a Direction Map, Low Contrast Map,
@@ -52,6 +52,7 @@ identified are necessarily the best available for the purpose.
 #include <stdio.h>
 #include <stdlib.h>
 #include <lfs.h>
+#include <arena.h>
 
 /*************************************************************************
 **************************************************************************
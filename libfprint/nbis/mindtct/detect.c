@@ -35,6 +35,8 @@ identified are necessarily the best available for the purpose.
 
 ***********************************************************************
                ROUTINES:
+                        uncrop_map()
+                        uncrop_detection()
                         lfs_detect_minutiae_V2()
                         get_minutiae()
 
@@ -43,8 +45,137 @@ identified are necessarily the best available for the purpose.
 #include <stdio.h>
 #include <string.h>
 #include <lfs.h>
+#include <arena.h>
 #include <log.h>
 
+/*************************************************************************
+**************************************************************************
+#cat: uncrop_map - Embeds an image map computed for a band of block rows
+#cat:              into a map of the whole image, setting the blocks outside
+#cat:              the band to a constant value.
+
+   Input:
+      map       - map of the band
+      mw        - width (in blocks) of the maps
+      bmh       - height (in blocks) of the band's map
+      mh        - height (in blocks) of the whole image map
+      by0       - block row of the whole image where the band starts
+      value     - value of the blocks outside the band
+   Output:
+      omap      - points to the map of the whole image
+   Return Code:
+      Zero      - successful completion
+      Negative  - system error
+**************************************************************************/
+static int uncrop_map(int **omap, const int *map, const int mw,
+                      const int bmh, const int mh, const int by0,
+                      const int value)
+{
+   int *full;
+   int i;
+
+   full = (int *)malloc(mw * mh * sizeof(int));
+   if(full == (int *)NULL){
+      fprintf(stderr, "ERROR : uncrop_map : malloc : full\n");
+      return(-582);
+   }
+
+   for(i = 0; i < mw * mh; i++)
+      full[i] = value;
+   memcpy(full + (by0 * mw), map, mw * bmh * sizeof(int));
+
+   *omap = full;
+   return(0);
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: uncrop_detection - Takes the results of detecting minutiae in a band
+#cat:              of rows found by foreground_rows() and places them in
+#cat:              the whole image.  Blocks outside the band are given the
+#cat:              values of low contrast background, and pixels outside
+#cat:              the band are made white, as the full analysis would have
+#cat:              left them.  The band's maps and binary image are replaced.
+
+   Input:
+      minutiae  - minutiae detected in the band
+      dmap      - Direction Map of the band
+      lcmap     - Low Contrast Map of the band
+      lfmap     - Low Ridge Flow Map of the band
+      hcmap     - High Curvature Map of the band
+      mw        - width (in blocks) of the maps
+      mh        - height (in blocks) of the band's maps
+      bdata     - binarized band
+      iw        - width (in pixels) of the image
+      y0        - first row of the band
+      y1        - row just past the band
+      ih        - height (in pixels) of the image
+      blocksize - size (in pixels) of image blocks
+   Output:
+      minutiae  - minutiae moved to whole image coordinates
+      dmap      - Direction Map of the whole image
+      lcmap     - Low Contrast Map of the whole image
+      lfmap     - Low Ridge Flow Map of the whole image
+      hcmap     - High Curvature Map of the whole image
+      mh        - height (in blocks) of the whole image maps
+      bdata     - binarized whole image
+   Return Code:
+      Zero      - successful completion
+      Negative  - system error
+**************************************************************************/
+static int uncrop_detection(MINUTIAE *minutiae,
+                      int **dmap, int **lcmap, int **lfmap, int **hcmap,
+                      const int mw, int *mh, unsigned char **bdata,
+                      const int iw, const int y0, const int y1, const int ih,
+                      const int blocksize)
+{
+   int *maps[4], **mapptrs[4];
+   int values[4] = {INVALID_DIR, TRUE, FALSE, FALSE};
+   int i, fmh, by0, ret;
+   unsigned char *full;
+
+   fmh = (int)ceil(ih / (double)blocksize);
+   by0 = y0 / blocksize;
+
+   mapptrs[0] = dmap;
+   mapptrs[1] = lcmap;
+   mapptrs[2] = lfmap;
+   mapptrs[3] = hcmap;
+   for(i = 0; i < 4; i++){
+      if((ret = uncrop_map(&(maps[i]), *(mapptrs[i]), mw, *mh, fmh, by0,
+                           values[i]))){
+         while(--i >= 0)
+            free(maps[i]);
+         return(ret);
+      }
+   }
+
+   full = (unsigned char *)malloc(iw * ih);
+   if(full == (unsigned char *)NULL){
+      for(i = 0; i < 4; i++)
+         free(maps[i]);
+      fprintf(stderr, "ERROR : uncrop_detection : malloc : full\n");
+      return(-583);
+   }
+   memset(full, WHITE_PIXEL, iw * ih);
+   memcpy(full + (y0 * iw), *bdata, iw * (y1 - y0));
+
+   for(i = 0; i < 4; i++){
+      free(*(mapptrs[i]));
+      *(mapptrs[i]) = maps[i];
+   }
+   free(*bdata);
+   *bdata = full;
+   *mh = fmh;
+
+   for(i = 0; i < minutiae->num; i++){
+      minutiae->list[i]->y += y0;
+      minutiae->list[i]->ey += y0;
+   }
+
+   return(0);
+}
+
 /*************************************************************************
 #cat: lfs_detect_minutiae_V2 - Takes a grayscale fingerprint image (of
 #cat:          arbitrary size), and returns a set of image block maps,
@@ -53,7 +184,8 @@ identified are necessarily the best available for the purpose.
 #cat:          type, direction, neighbors, and ridge counts to neighbors).
 #cat:          The image maps include a ridge flow directional map,
 #cat:          a map of low contrast blocks, a map of low ridge flow blocks.
-#cat:          and a map of high-curvature blocks.
+#cat:          and a map of high-curvature blocks.  Only the band of rows
+#cat:          found by foreground_rows() is analyzed.
 
    Input:
       idata     - input 8-bit grayscale fingerprint image data
@@ -94,10 +226,13 @@ static int lfs_detect_minutiae_V2(MINUTIAE **ominutiae,
    DFTWAVES *dftwaves;
    ROTGRIDS *dftgrids;
    ROTGRIDS *dirbingrids;
+   LFSTABLES *tables;
    int *direction_map, *low_contrast_map, *low_flow_map, *high_curve_map;
    int mw, mh;
    int ret, maxpad;
+   int y0, y1, ch;
    MINUTIAE *minutiae;
+   gint64 mark;
 
    /******************/
    /* INITIALIZATION */
@@ -108,64 +243,55 @@ static int lfs_detect_minutiae_V2(MINUTIAE **ominutiae,
       /* If system error, exit with error code. */
       return(ret);
 
+   mark = start_stage_timer(lfsparms);
+
    /* Determine the maximum amount of image padding required to support */
    /* LFS processes.                                                    */
    maxpad = get_max_padding_V2(lfsparms->windowsize, lfsparms->windowoffset,
                           lfsparms->dirbin_grid_w, lfsparms->dirbin_grid_h);
 
-   /* Initialize lookup table for converting integer directions */
-   /* to angles in radians.                                     */
-   if((ret = init_dir2rad(&dir2rad, lfsparms->num_directions))){
-      /* Free memory allocated to this point. */
-      return(ret);
-   }
-
-   /* Initialize wave form lookup tables for DFT analyses. */
-   /* used for direction binarization.                             */
-   if((ret = init_dftwaves(&dftwaves, g_dft_coefs, lfsparms->num_dft_waves,
-                        lfsparms->windowsize))){
-      /* Free memory allocated to this point. */
-      free_dir2rad(dir2rad);
+   /* Find the band of rows that may hold ridges.  The rows above and */
+   /* below it would all be found low contrast, so they are left out  */
+   /* of the analysis and restored once it is done.  The band is      */
+   /* analyzed as an image of its own: a few minutiae may come out    */
+   /* differently, as some map and contour steps depend on the image  */
+   /* size and origin, but no ridge area is lost.                     */
+   if((ret = foreground_rows(&y0, &y1, idata, iw, ih, lfsparms)))
       return(ret);
-   }
+   ch = y1 - y0;
 
-   /* Initialize lookup table for pixel offsets to rotated grids */
-   /* used for DFT analyses.                                     */
-   if((ret = init_rotgrids(&dftgrids, iw, ih, maxpad,
-                        lfsparms->start_dir_angle, lfsparms->num_directions,
-                        lfsparms->windowsize, lfsparms->windowsize,
-                        RELATIVE2ORIGIN))){
+   /* Look up the tables for this image size and these parameters, */
+   /* building them if no earlier detection already has.            */
+   if((ret = get_lfstables(&tables, iw, ch, maxpad, lfsparms))){
       /* Free memory allocated to this point. */
-      free_dir2rad(dir2rad);
-      free_dftwaves(dftwaves);
       return(ret);
    }
+   dir2rad = tables->dir2rad;
+   dftwaves = tables->dftwaves;
+   dftgrids = tables->dftgrids;
+   dirbingrids = tables->dirbingrids;
 
    /* Pad input image based on max padding. */
    if(maxpad > 0){   /* May not need to pad at all */
-      if((ret = pad_uchar_image(&pdata, &pw, &ph, idata, iw, ih,
+      if((ret = pad_uchar_rows(&pdata, &pw, &ph, idata, iw, ih, y0, y1,
                              maxpad, lfsparms->pad_value))){
          /* Free memory allocated to this point. */
-         free_dir2rad(dir2rad);
-         free_dftwaves(dftwaves);
-         free_rotgrids(dftgrids);
+         release_lfstables(tables);
          return(ret);
       }
    }
    else{
       /* If padding is unnecessary, then copy the input image. */
-      pdata = (unsigned char *)malloc(iw*ih);
+      pdata = (unsigned char *)malloc(iw*ch);
       if(pdata == (unsigned char *)NULL){
          /* Free memory allocated to this point. */
-         free_dir2rad(dir2rad);
-         free_dftwaves(dftwaves);
-         free_rotgrids(dftgrids);
+         release_lfstables(tables);
          fprintf(stderr, "ERROR : lfs_detect_minutiae_V2 : malloc : pdata\n");
          return(-580);
       }
-      memcpy(pdata, idata, iw*ih);
+      memcpy(pdata, idata + (y0*iw), iw*ch);
       pw = iw;
-      ph = ih;
+      ph = ch;
    }
 
    /* Scale input image to 6 bits [0..63] */
@@ -175,6 +301,7 @@ static int lfs_detect_minutiae_V2(MINUTIAE **ominutiae,
    /* careful, I think accumulated power magnitudes may overflow */
    /* doubles.                                                   */
    bits_8to6(pdata, pw, ph);
+   stop_stage_timer(&mark, LFS_STAGE_SETUP, lfsparms);
 
    print2log("\nINITIALIZATION AND PADDING DONE\n");
 
@@ -187,38 +314,18 @@ static int lfs_detect_minutiae_V2(MINUTIAE **ominutiae,
                     &low_flow_map, &high_curve_map, &mw, &mh,
                     pdata, pw, ph, dir2rad, dftwaves, dftgrids, lfsparms))){
       /* Free memory allocated to this point. */
-      free_dir2rad(dir2rad);
-      free_dftwaves(dftwaves);
-      free_rotgrids(dftgrids);
+      release_lfstables(tables);
       free(pdata);
       return(ret);
    }
-   /* Deallocate working memories. */
-   free_dir2rad(dir2rad);
-   free_dftwaves(dftwaves);
-   free_rotgrids(dftgrids);
-
+   /* gen_image_maps() times its own stages. */
+   mark = start_stage_timer(lfsparms);
    print2log("\nMAPS DONE\n");
 
    /******************/
    /* BINARIZARION   */
    /******************/
 
-   /* Initialize lookup table for pixel offsets to rotated grids */
-   /* used for directional binarization.                         */
-   if((ret = init_rotgrids(&dirbingrids, iw, ih, maxpad,
-                        lfsparms->start_dir_angle, lfsparms->num_directions,
-                        lfsparms->dirbin_grid_w, lfsparms->dirbin_grid_h,
-                        RELATIVE2CENTER))){
-      /* Free memory allocated to this point. */
-      free(pdata);
-      free(direction_map);
-      free(low_contrast_map);
-      free(low_flow_map);
-      free(high_curve_map);
-      return(ret);
-   }
-
    /* Binarize input image based on NMAP information. */
    if((ret = binarize_V2(&bdata, &bw, &bh,
                       pdata, pw, ph, direction_map, mw, mh,
@@ -229,16 +336,17 @@ static int lfs_detect_minutiae_V2(MINUTIAE **ominutiae,
       free(low_contrast_map);
       free(low_flow_map);
       free(high_curve_map);
-      free_rotgrids(dirbingrids);
+      release_lfstables(tables);
       return(ret);
    }
 
-   /* Deallocate working memory. */
-   free_rotgrids(dirbingrids);
+   /* The lookup tables are no longer needed. */
+   release_lfstables(tables);
+   stop_stage_timer(&mark, LFS_STAGE_BINARIZE, lfsparms);
 
    /* Check dimension of binary image.  If they are different from */
    /* the input image, then ERROR.                                 */
-   if((iw != bw) || (ih != bh)){
+   if((iw != bw) || (ch != bh)){
       /* Free memory allocated to this point. */
       free(pdata);
       free(direction_map);
@@ -260,7 +368,7 @@ static int lfs_detect_minutiae_V2(MINUTIAE **ominutiae,
 
    /* Convert 8-bit grayscale binary image [0,255] to */
    /* 8-bit binary image [0,1].                       */
-   gray2bin(1, 1, 0, bdata, iw, ih);
+   gray2bin(1, 1, 0, bdata, iw, ch);
 
    /* Allocate initial list of minutia pointers. */
    if((ret = alloc_minutiae(&minutiae, MAX_MINUTIAE))){
@@ -268,7 +376,7 @@ static int lfs_detect_minutiae_V2(MINUTIAE **ominutiae,
    }
 
    /* Detect the minutiae in the binarized image. */
-   if((ret = detect_minutiae_V2(minutiae, bdata, iw, ih,
+   if((ret = detect_minutiae_V2(minutiae, bdata, iw, ch,
                              direction_map, low_flow_map, high_curve_map,
                              mw, mh, lfsparms))){
       /* Free memory allocated to this point. */
@@ -280,8 +388,9 @@ static int lfs_detect_minutiae_V2(MINUTIAE **ominutiae,
       free(bdata);
       return(ret);
    }
+   stop_stage_timer(&mark, LFS_STAGE_DETECT, lfsparms);
 
-   if((ret = remove_false_minutia_V2(minutiae, bdata, iw, ih,
+   if((ret = remove_false_minutia_V2(minutiae, bdata, iw, ch,
                        direction_map, low_flow_map, high_curve_map, mw, mh,
                        lfsparms))){
       /* Free memory allocated to this point. */
@@ -295,12 +404,14 @@ static int lfs_detect_minutiae_V2(MINUTIAE **ominutiae,
       return(ret);
    }
 
+   stop_stage_timer(&mark, LFS_STAGE_REMOVE, lfsparms);
+
    print2log("\nMINUTIA DETECTION DONE\n");
 
    /******************/
    /*  RIDGE COUNTS  */
    /******************/
-   if((ret = count_minutiae_ridges(minutiae, bdata, iw, ih, lfsparms))){
+   if((ret = count_minutiae_ridges(minutiae, bdata, iw, ch, lfsparms))){
       /* Free memory allocated to this point. */
       free(pdata);
       free(direction_map);
@@ -312,6 +423,8 @@ static int lfs_detect_minutiae_V2(MINUTIAE **ominutiae,
    }
 
 
+   stop_stage_timer(&mark, LFS_STAGE_RIDGE_COUNT, lfsparms);
+
    print2log("\nNEIGHBOR RIDGE COUNT DONE\n");
 
    /******************/
@@ -320,11 +433,29 @@ static int lfs_detect_minutiae_V2(MINUTIAE **ominutiae,
 
    /* Convert 8-bit binary image [0,1] to 8-bit */
    /* grayscale binary image [0,255].           */
-   gray2bin(1, 255, 0, bdata, iw, ih);
+   gray2bin(1, 255, 0, bdata, iw, ch);
 
    /* Deallocate working memory. */
    free(pdata);
 
+   /* Place the results for the band back in the whole image. */
+   if(ch != ih){
+      if((ret = uncrop_detection(minutiae, &direction_map, &low_contrast_map,
+                              &low_flow_map, &high_curve_map, mw, &mh, &bdata,
+                              iw, y0, y1, ih, lfsparms->blocksize))){
+         /* Free memory allocated to this point. */
+         free(direction_map);
+         free(low_contrast_map);
+         free(low_flow_map);
+         free(high_curve_map);
+         free(bdata);
+         free_minutiae(minutiae);
+         return(ret);
+      }
+      bh = ih;
+   }
+   stop_stage_timer(&mark, LFS_STAGE_SETUP, lfsparms);
+
    /* Assign results to output pointers. */
    *odmap = direction_map;
    *olcmap = low_contrast_map;
@@ -391,6 +522,7 @@ int get_minutiae(MINUTIAE **ominutiae, int **oquality_map,
    int map_w = 0, map_h = 0;
    unsigned char *bdata = NULL;
    int bw = 0, bh = 0;
+   gint64 mark;
 
    /* If input image is not 8-bit grayscale ... */
    if(id != 8){
@@ -409,6 +541,8 @@ int get_minutiae(MINUTIAE **ominutiae, int **oquality_map,
       return(ret);
    }
 
+   mark = start_stage_timer(lfsparms);
+
    /* Build integrated quality map. */
    if((ret = gen_quality_map(&quality_map,
                             direction_map, low_contrast_map,
@@ -435,6 +569,7 @@ int get_minutiae(MINUTIAE **ominutiae, int **oquality_map,
       free(bdata);
       return(ret);
    }
+   stop_stage_timer(&mark, LFS_STAGE_QUALITY, lfsparms);
 
    /* Set output pointers. */
    *ominutiae = minutiae;
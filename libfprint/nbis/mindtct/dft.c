@@ -38,6 +38,7 @@ identified are necessarily the best available for the purpose.
                         dft_dir_powers()
                         sum_rot_block_rows()
                         dft_power()
+                        dft_powers_vector()
                         dft_power_stats()
                         get_max_norm()
                         sort_dft_waves()
@@ -46,6 +47,7 @@ identified are necessarily the best available for the purpose.
 #include <stdio.h>
 #include <stdlib.h>
 #include <lfs.h>
+#include <arena.h>
 
 /*************************************************************************
 **************************************************************************
@@ -67,22 +69,31 @@ identified are necessarily the best available for the purpose.
 static void sum_rot_block_rows(int *rowsums, const unsigned char *blkptr,
                         const int *grid_offsets, const int blocksize)
 {
-   int ix, iy, gi;
+   int ix, iy;
+   int s0, s1, s2, s3;
+   const int *gptr;
 
-   /* Initialize rotation offset index. */
-   gi = 0;
+   /* Initialize rotation offset pointer. */
+   gptr = grid_offsets;
 
    /* For each row in block ... */
    for(iy = 0; iy < blocksize; iy++){
-      /* The sums are accumlated along the rotated rows of the grid, */
-      /* so initialize row sum to 0.                                 */
-      rowsums[iy] = 0;
+      /* The sums are accumlated along the rotated rows of the grid.  */
+      /* The gathered pixels are spread over four partial sums so the */
+      /* loads do not wait on a single chain of additions.            */
+      s0 = s1 = s2 = s3 = 0;
       /* Foreach column in block ... */
-      for(ix = 0; ix < blocksize; ix++){
+      for(ix = 0; ix + 4 <= blocksize; ix += 4){
          /* Accumulate pixel value at rotated grid position in image */
-         rowsums[iy] += *(blkptr + grid_offsets[gi]);
-         gi++;
+         s0 += blkptr[gptr[0]];
+         s1 += blkptr[gptr[1]];
+         s2 += blkptr[gptr[2]];
+         s3 += blkptr[gptr[3]];
+         gptr += 4;
       }
+      for(; ix < blocksize; ix++)
+         s0 += blkptr[*gptr++];
+      rowsums[iy] = (s0 + s1) + (s2 + s3);
    }
 }
 
@@ -103,11 +114,11 @@ static void sum_rot_block_rows(int *rowsums, const unsigned char *blkptr,
       power   - the computed DFT power for the given wave form at the
                 given orientation within the image block
 **************************************************************************/
-static void dft_power(double *power, const int *rowsums,
+static void dft_power(DFTREAL *power, const int *rowsums,
                const DFTWAVE *wave, const int wavelen)
 {
    int i;
-   double cospart, sinpart;
+   DFTREAL cospart, sinpart;
 
    /* Initialize accumulators */
    cospart = 0.0;
@@ -125,6 +136,53 @@ static void dft_power(double *power, const int *rowsums,
    *power = (cospart * cospart) + (sinpart * sinpart);
 }
 
+#if defined(__GNUC__) && !defined(DFT_SCALAR)
+/* Number of wave forms handled by one vector, and the longest wave */
+/* form the vector path keeps its coefficients for on the stack.    */
+#define DFT_VECTOR_WAVES   4
+#define DFT_VECTOR_MAXLEN  64
+
+typedef DFTREAL DFT_VEC __attribute__((vector_size(DFT_VECTOR_WAVES *
+                                                   sizeof(DFTREAL))));
+
+/*************************************************************************
+**************************************************************************
+#cat: dft_powers_vector - Computes the DFT powers of all the wave forms
+#cat:             at one orientation of the block image at once.  Each
+#cat:             lane of the vectors accumulates one wave form, in the
+#cat:             same order as dft_power(), so the powers are identical.
+
+   Input:
+      dir     - the orientation the row sums were computed at
+      rowsums - accumulated rows of pixels from within a rotated grid
+                overlaying an input image block
+      coefs   - the cosine (even entries) and sine (odd entries) points
+                of every wave form, one vector per row
+      wavelen - the length of the wave forms
+   Output:
+      powers  - the DFT power of each wave form stored at [w][dir]
+**************************************************************************/
+static void dft_powers_vector(DFTREAL **powers, const int dir,
+               const int *rowsums, const DFT_VEC *coefs, const int wavelen)
+{
+   int i, w;
+   DFT_VEC cospart, sinpart;
+   DFTREAL rowsum;
+
+   cospart = sinpart = (DFT_VEC){0.0, 0.0, 0.0, 0.0};
+
+   for(i = 0; i < wavelen; i++){
+      rowsum = rowsums[i];
+      cospart += rowsum * coefs[2*i];
+      sinpart += rowsum * coefs[2*i+1];
+   }
+
+   /* Squares are summed per wave as in dft_power(). */
+   for(w = 0; w < DFT_VECTOR_WAVES; w++)
+      powers[w][dir] = (cospart[w] * cospart[w]) + (sinpart[w] * sinpart[w]);
+}
+#endif
+
 /*************************************************************************
 **************************************************************************
 #cat: dft_dir_powers - Conducts the DFT analysis on a block of image data.
@@ -157,11 +215,14 @@ static void dft_power(double *power, const int *rowsums,
       Zero     - successful completion
       Negative - system error
 **************************************************************************/
-int dft_dir_powers(double **powers, unsigned char *pdata,
+int dft_dir_powers(DFTREAL **powers, unsigned char *pdata,
                const int blkoffset, const int pw, const int ph,
                const DFTWAVES *dftwaves, const ROTGRIDS *dftgrids)
 {
    int w, dir;
+#ifdef DFT_VECTOR_WAVES
+   int i;
+#endif
    int *rowsums;
    unsigned char *blkptr;
 
@@ -177,6 +238,30 @@ int dft_dir_powers(double **powers, unsigned char *pdata,
       return(-91);
    }
 
+#ifdef DFT_VECTOR_WAVES
+   /* The vector path applies all the wave forms in one pass over the */
+   /* row sums, which needs their coefficients interleaved by row.    */
+   if(dftwaves->nwaves == DFT_VECTOR_WAVES &&
+      dftwaves->wavelen <= DFT_VECTOR_MAXLEN){
+      DFT_VEC coefs[2 * DFT_VECTOR_MAXLEN];
+
+      for(i = 0; i < dftwaves->wavelen; i++){
+         for(w = 0; w < DFT_VECTOR_WAVES; w++){
+            coefs[2*i][w] = dftwaves->waves[w]->cos[i];
+            coefs[2*i+1][w] = dftwaves->waves[w]->sin[i];
+         }
+      }
+      for(dir = 0; dir < dftgrids->ngrids; dir++){
+         blkptr = pdata + blkoffset;
+         sum_rot_block_rows(rowsums, blkptr,
+                            dftgrids->grids[dir], dftgrids->grid_w);
+         dft_powers_vector(powers, dir, rowsums, coefs, dftwaves->wavelen);
+      }
+      free(rowsums);
+      return(0);
+   }
+#endif
+
    /* Foreach direction ... */
    for(dir = 0; dir < dftgrids->ngrids; dir++){
       /* Compute vector of line sums from rotated grid */
@@ -218,13 +303,13 @@ int dft_dir_powers(double **powers, unsigned char *pdata,
       powmax_dir - the direciton at which the maximum power value occured
       pownorm    - the normalized power corresponding to the maximum power
 **************************************************************************/
-static void get_max_norm(double *powmax, int *powmax_dir,
-               double *pownorm, const double *power_vector, const int ndirs)
+static void get_max_norm(DFTREAL *powmax, int *powmax_dir,
+               DFTREAL *pownorm, const DFTREAL *power_vector, const int ndirs)
 {
    int dir;
-   double max_v, powsum;
+   DFTREAL max_v, powsum;
    int max_i;
-   double powmean;
+   DFTREAL powmean;
 
    /* Find max power value and store corresponding direction */
    max_v = power_vector[0];
@@ -271,8 +356,8 @@ static void get_max_norm(double *powmax, int *powmax_dir,
       Zero     - successful completion
       Negative - system error
 **************************************************************************/
-static int sort_dft_waves(int *wis, const double *powmaxs, const double *pownorms,
-                   const int nstats)
+static int sort_dft_waves(int *wis, const DFTREAL *powmaxs,
+                   const DFTREAL *pownorms, const int nstats)
 {
    int i;
    double *pownorms2;
@@ -337,8 +422,8 @@ static int sort_dft_waves(int *wis, const double *powmaxs, const double *pownorm
       Zero     - successful completion
       Negative - system error
 **************************************************************************/
-int dft_power_stats(int *wis, double *powmaxs, int *powmax_dirs,
-                     double *pownorms, double **powers,
+int dft_power_stats(int *wis, DFTREAL *powmaxs, int *powmax_dirs,
+                     DFTREAL *pownorms, DFTREAL **powers,
                      const int fw, const int tw, const int ndirs)
 {
    int w, i;
@@ -42,6 +42,7 @@ identified are necessarily the best available for the purpose.
 #include <stdio.h>
 #include <stdlib.h>
 #include <lfs.h>
+#include <arena.h>
 
 /*************************************************************************
 **************************************************************************
@@ -104,7 +105,7 @@ void free_rotgrids(ROTGRIDS *rotgrids)
       powers - vectors of DFT power values (N Waves X M Directions)
       nwaves - number of DFT wave forms used
 **************************************************************************/
-void free_dir_powers(double **powers, const int nwaves)
+void free_dir_powers(DFTREAL **powers, const int nwaves)
 {
    int w;
 
@@ -50,7 +50,7 @@ FILE *g_logfp;
 /*      2 = twice the frequency in range X.             */
 /*      3 = three times the frequency in reange X.      */
 /*      4 = four times the frequency in ranage X.       */
-double g_dft_coefs[NUM_DFT_WAVES] = { 1,2,3,4 };
+const double g_dft_coefs[NUM_DFT_WAVES] = { 1,2,3,4 };
 
 /* Allocate and initialize a global LFS parameters structure. */
 LFSPARMS g_lfsparms = {
@@ -134,7 +134,10 @@ LFSPARMS g_lfsparms = {
 
    /* Ridge Counting Controls */
    MAX_NBRS,
-   MAX_RIDGE_STEPS
+   MAX_RIDGE_STEPS,
+
+   /* Threading Controls */
+   1
 };
 
 
@@ -220,7 +223,10 @@ LFSPARMS g_lfsparms_V2 = {
 
    /* Ridge Counting Controls */
    MAX_NBRS,
-   MAX_RIDGE_STEPS
+   MAX_RIDGE_STEPS,
+
+   /* Threading Controls */
+   1
 };
 
 /* Variables for conducting 8-connected neighbor analyses. */
@@ -38,6 +38,7 @@ identified are necessarily the best available for the purpose.
                         bits_8to6()
                         gray2bin()
                         pad_uchar_image()
+                        pad_uchar_rows()
                         fill_holes()
                         free_path()
                         search_in_direction()
@@ -48,6 +49,7 @@ identified are necessarily the best available for the purpose.
 #include <stdlib.h>
 #include <memory.h>
 #include <lfs.h>
+#include <arena.h>
 
 /*************************************************************************
 **************************************************************************
@@ -207,6 +209,75 @@ int pad_uchar_image(unsigned char **optr, int *ow, int *oh,
    return(0);
 }
 
+/*************************************************************************
+**************************************************************************
+#cat: pad_uchar_rows - Copies a band of rows out of an image into a new,
+#cat:            padded image.  Padding that falls within the input image
+#cat:            is filled with the image's own pixels, so the band looks
+#cat:            just as it does inside the padded whole image.  Padding
+#cat:            beyond the input image is set to the constant pad value.
+
+   Input:
+      idata     - input image data
+      iw        - width (in pixels) of the input image
+      ih        - height (in pixels) of the input image
+      y0        - first row of the band
+      y1        - row just past the band
+      pad       - size of padding (in pixels) to be added
+      pad_value - intensity value of pad pixels
+   Output:
+      optr      - points to the newly padded band
+      ow        - width (in pixels) of the padded band
+      oh        - height (in pixels) of the padded band
+   Return Code:
+      Zero      - successful completion
+      Negative  - system error
+**************************************************************************/
+int pad_uchar_rows(unsigned char **optr, int *ow, int *oh,
+                   unsigned char *idata, const int iw, const int ih,
+                   const int y0, const int y1,
+                   const int pad, const int pad_value)
+{
+   unsigned char *pdata, *pptr, *iptr;
+   int i, pw, ph, py0, py1;
+   int pad2, psize;
+
+   /* Account for pad on both sides of image */
+   pad2 = pad<<1;
+
+   /* Compute new pad sizes */
+   pw = iw + pad2;
+   ph = (y1 - y0) + pad2;
+   psize = pw * ph;
+
+   /* Allocate padded image */
+   pdata = (unsigned char *)malloc(psize * sizeof(unsigned char));
+   if(pdata == (unsigned char *)NULL){
+      fprintf(stderr, "ERROR : pad_uchar_rows : malloc : pdata\n");
+      return(-161);
+   }
+
+   /* Initialize values to a constant PAD value */
+   memset(pdata, pad_value, psize);
+
+   /* Copy the band and whatever image rows surround it within */
+   /* the padding one scanline at a time.                      */
+   py0 = max(0, y0 - pad);
+   py1 = min(ih, y1 + pad);
+   iptr = idata + (py0 * iw);
+   pptr = pdata + ((py0 - y0 + pad) * pw) + pad;
+   for(i = py0; i < py1; i++){
+      memcpy(pptr, iptr, iw);
+      iptr += iw;
+      pptr += pw;
+   }
+
+   *optr = pdata;
+   *ow = pw;
+   *oh = ph;
+   return(0);
+}
+
 /*************************************************************************
 **************************************************************************
 #cat: fill_holes - Takes an input image and analyzes triplets of horizontal
@@ -46,6 +46,7 @@ identified are necessarily the best available for the purpose.
 #include <stdio.h>
 #include <stdlib.h>
 #include <lfs.h>
+#include <arena.h>
 
 /*************************************************************************
 **************************************************************************
@@ -142,7 +143,7 @@ int init_dftwaves(DFTWAVES **optr, const double *dft_coefs,
    DFTWAVES *dftwaves;
    int i, j;
    double pi_factor, freq, x;
-   double *cptr, *sptr;
+   DFTREAL *cptr, *sptr;
 
    /* Allocate structure */
    dftwaves = (DFTWAVES *)malloc(sizeof(DFTWAVES));
@@ -188,8 +189,8 @@ int init_dftwaves(DFTWAVES **optr, const double *dft_coefs,
          return(-22);
       }
       /* Allocate cosine vector */
-      dftwaves->waves[i]->cos = (double *)malloc(blocksize * sizeof(double));
-      if(dftwaves->waves[i]->cos == (double *)NULL){
+      dftwaves->waves[i]->cos = (DFTREAL *)malloc(blocksize*sizeof(DFTREAL));
+      if(dftwaves->waves[i]->cos == (DFTREAL *)NULL){
          /* Free memory allocated to this point. */
          { int _j; for(_j = 0; _j < i; _j++){
             free(dftwaves->waves[_j]->cos);
@@ -204,8 +205,8 @@ int init_dftwaves(DFTWAVES **optr, const double *dft_coefs,
          return(-23);
       }
       /* Allocate sine vector */
-      dftwaves->waves[i]->sin = (double *)malloc(blocksize * sizeof(double));
-      if(dftwaves->waves[i]->sin == (double *)NULL){
+      dftwaves->waves[i]->sin = (DFTREAL *)malloc(blocksize*sizeof(DFTREAL));
+      if(dftwaves->waves[i]->sin == (DFTREAL *)NULL){
          /* Free memory allocated to this point. */
          { int _j; for(_j = 0; _j < i; _j++){
             free(dftwaves->waves[_j]->cos);
@@ -581,22 +582,22 @@ int init_rotgrids(ROTGRIDS **optr, const int iw, const int ih, const int ipad,
       Zero     - successful completion
       Negative - system error
 **************************************************************************/
-int alloc_dir_powers(double ***opowers, const int nwaves, const int ndirs)
+int alloc_dir_powers(DFTREAL ***opowers, const int nwaves, const int ndirs)
 {
    int w;
-   double **powers;
+   DFTREAL **powers;
 
-   /* Allocate list of double pointers to hold power vectors */
-   powers = (double **)malloc(nwaves * sizeof(double*));
-   if(powers == (double **)NULL){
+   /* Allocate list of pointers to hold power vectors */
+   powers = (DFTREAL **)malloc(nwaves * sizeof(DFTREAL*));
+   if(powers == (DFTREAL **)NULL){
       fprintf(stderr, "ERROR : alloc_dir_powers : malloc : powers\n");
       return(-40);
    }
    /* Foreach DFT wave ... */
    for(w = 0; w < nwaves; w++){
       /* Allocate power vector for all directions */
-      powers[w] = (double *)malloc(ndirs * sizeof(double));
-      if(powers[w] == (double *)NULL){
+      powers[w] = (DFTREAL *)malloc(ndirs * sizeof(DFTREAL));
+      if(powers[w] == (DFTREAL *)NULL){
          /* Free memory allocated to this point. */
          { int _j; for(_j = 0; _j < w; _j++){
             free(powers[_j]);
@@ -639,11 +640,11 @@ int alloc_dir_powers(double ***opowers, const int nwaves, const int ndirs)
       Zero     - successful completion
       Negative - system error
 **************************************************************************/
-int alloc_power_stats(int **owis, double **opowmaxs, int **opowmax_dirs,
-                      double **opownorms, const int nstats)
+int alloc_power_stats(int **owis, DFTREAL **opowmaxs, int **opowmax_dirs,
+                      DFTREAL **opownorms, const int nstats)
 {
    int *wis, *powmax_dirs;
-   double *powmaxs, *pownorms;
+   DFTREAL *powmaxs, *pownorms;
 
    /* Allocate DFT wave index vector */
    wis = (int *)malloc(nstats * sizeof(int));
@@ -653,8 +654,8 @@ int alloc_power_stats(int **owis, double **opowmaxs, int **opowmax_dirs,
    }
 
    /* Allocate max power vector */
-   powmaxs = (double *)malloc(nstats * sizeof(double));
-   if(powmaxs == (double *)NULL){
+   powmaxs = (DFTREAL *)malloc(nstats * sizeof(DFTREAL));
+   if(powmaxs == (DFTREAL *)NULL){
       /* Free memory allocated to this point. */
       free(wis);
       fprintf(stderr, "ERROR : alloc_power_stats : malloc : powmaxs\n");
@@ -672,8 +673,8 @@ int alloc_power_stats(int **owis, double **opowmaxs, int **opowmax_dirs,
    }
 
    /* Allocate normalized power vector */
-   pownorms = (double *)malloc(nstats * sizeof(double));
-   if(pownorms == (double *)NULL){
+   pownorms = (DFTREAL *)malloc(nstats * sizeof(DFTREAL));
+   if(pownorms == (DFTREAL *)NULL){
       /* Free memory allocated to this point. */
       free(wis);
       free(powmaxs);
@@ -68,6 +68,7 @@ identified are necessarily the best available for the purpose.
 #include <stdlib.h>
 #include <string.h>
 #include <lfs.h>
+#include <arena.h>
 #include <morph.h>
 #include <log.h>
 
@@ -112,6 +113,9 @@ int gen_image_maps(int **odmap, int **olcmap, int **olfmap, int **ohcmap,
    int mw, mh, iw, ih;
    int *blkoffs;
    int ret; /* return code */
+   gint64 mark;
+
+   mark = start_stage_timer(lfsparms);
 
    /* 1. Compute block offsets for the entire image, accounting for pad */
    /* Block_offsets() assumes square block (grid), so ERROR otherwise. */
@@ -136,6 +140,7 @@ int gen_image_maps(int **odmap, int **olcmap, int **olfmap, int **ohcmap,
       free(blkoffs);
       return(ret);
    }
+   stop_stage_timer(&mark, LFS_STAGE_INITIAL_MAPS, lfsparms);
 
    if((ret = morph_TF_map(low_flow_map, mw, mh, lfsparms))){
       return(ret);
@@ -176,6 +181,7 @@ int gen_image_maps(int **odmap, int **olcmap, int **olfmap, int **ohcmap,
 
    /* Deallocate working memory. */
    free(blkoffs);
+   stop_stage_timer(&mark, LFS_STAGE_INTERPOLATE, lfsparms);
 
    *odmap = direction_map;
    *olcmap = low_contrast_map;
@@ -186,6 +192,189 @@ int gen_image_maps(int **odmap, int **olcmap, int **olfmap, int **ohcmap,
    return(0);
 }
 
+/* State shared by the threads working on one call to gen_initial_maps(). */
+/* Rows of blocks are handed out in order through next_row; each block   */
+/* only writes its own map entries, so the maps do not depend on how the */
+/* rows end up spread over the threads.                                   */
+typedef struct initial_maps_job{
+   int *direction_map, *low_contrast_map, *low_flow_map;
+   int *blkoffs;
+   int mw, mh;
+   unsigned char *pdata;
+   int pw, ph;
+   const DFTWAVES *dftwaves;
+   const ROTGRIDS *dftgrids;
+   const LFSPARMS *lfsparms;
+   int xminlimit, xmaxlimit, yminlimit, ymaxlimit;
+   gint next_row;
+   /* Lowest row which failed and its return code, so that the error     */
+   /* reported is the one a single thread would have run into first.     */
+   GMutex lock;
+   int error_row;
+   int error;
+} INITIAL_MAPS_JOB;
+
+static void initial_maps_fail(INITIAL_MAPS_JOB *job, const int row,
+                              const int ret)
+{
+   g_mutex_lock(&job->lock);
+   if(row < job->error_row){
+      job->error_row = row;
+      job->error = ret;
+   }
+   g_mutex_unlock(&job->lock);
+}
+
+/* Computes the maps' entries for block bi, using the caller's DFT power */
+/* and statistics buffers.                                              */
+static int initial_maps_block(INITIAL_MAPS_JOB *job, const int bi,
+                DFTREAL **powers, int *wis, DFTREAL *powmaxs,
+                int *powmax_dirs, DFTREAL *pownorms, const int nstats)
+{
+   const LFSPARMS *lfsparms = job->lfsparms;
+   const int pw = job->pw;
+   int blkdir;
+   int ret; /* return code */
+   int dft_offset;
+   int win_x, win_y, low_contrast_offset;
+
+   /* Adjust block offset from pointing to block origin to pointing */
+   /* to surrounding window origin.                                 */
+   dft_offset = job->blkoffs[bi] - (lfsparms->windowoffset * pw) -
+                   lfsparms->windowoffset;
+
+   /* Compute pixel coords of window origin. */
+   win_x = dft_offset % pw;
+   win_y = (int)(dft_offset / pw);
+
+   /* Make sure the current window does not access padded image pixels */
+   /* for analyzing low contrast.                                      */
+   win_x = max(job->xminlimit, win_x);
+   win_x = min(job->xmaxlimit, win_x);
+   win_y = max(job->yminlimit, win_y);
+   win_y = min(job->ymaxlimit, win_y);
+   low_contrast_offset = (win_y * pw) + win_x;
+
+   print2log("   BLOCK %2d (%2d, %2d) ", bi, bi%job->mw, bi/job->mw);
+
+   /* If block is low contrast ... */
+   if((ret = low_contrast_block(low_contrast_offset, lfsparms->windowsize,
+                               job->pdata, pw, job->ph, lfsparms))){
+      /* If system error ... */
+      if(ret < 0)
+         return(ret);
+
+      /* Otherwise, block is low contrast ... */
+      print2log("LOW CONTRAST\n");
+      job->low_contrast_map[bi] = TRUE;
+      /* Direction Map's block is already set to INVALID. */
+      return(0);
+   }
+
+   /* Otherwise, sufficient contrast for DFT processing ... */
+   print2log("\n");
+
+   /* Compute DFT powers */
+   if((ret = dft_dir_powers(powers, job->pdata, low_contrast_offset, pw,
+                            job->ph, job->dftwaves, job->dftgrids)))
+      return(ret);
+
+   /* Compute DFT power statistics, skipping first applied DFT  */
+   /* wave.  This is dependent on how the primary and secondary */
+   /* direction tests work below.                               */
+   if((ret = dft_power_stats(wis, powmaxs, powmax_dirs, pownorms, powers,
+                          1, job->dftwaves->nwaves, job->dftgrids->ngrids)))
+      return(ret);
+
+#ifdef LOG_REPORT /*vvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvv*/
+   {  int _w;
+      fprintf(logfp, "      Power\n");
+      for(_w = 0; _w < nstats; _w++){
+         /* Add 1 to wis[w] to create index to original dft_coefs[] */
+         fprintf(logfp, "         wis[%d] %d %12.3f %2d %9.3f %12.3f\n",
+              _w, wis[_w]+1, 
+              powmaxs[wis[_w]], powmax_dirs[wis[_w]], pownorms[wis[_w]],
+              powers[0][powmax_dirs[wis[_w]]]);
+      }
+   }
+#endif /*^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^*/
+
+   /* Conduct primary direction test */
+   blkdir = primary_dir_test(powers, wis, powmaxs, powmax_dirs,
+                            pownorms, nstats, lfsparms);
+
+   if(blkdir != INVALID_DIR)
+      job->direction_map[bi] = blkdir;
+   else{
+      /* Conduct secondary (fork) direction test */
+      blkdir = secondary_fork_test(powers, wis, powmaxs, powmax_dirs,
+                            pownorms, nstats, lfsparms);
+      if(blkdir != INVALID_DIR)
+         job->direction_map[bi] = blkdir;
+      /* Otherwise current direction in Direction Map remains INVALID */
+      else
+         /* Flag the block as having LOW RIDGE FLOW. */
+         job->low_flow_map[bi] = TRUE;
+   }
+
+   return(0);
+}
+
+/* Processes rows of blocks until there are none left, or until only rows */
+/* after one which failed are left.                                      */
+static gpointer initial_maps_worker(gpointer data)
+{
+   INITIAL_MAPS_JOB *job = (INITIAL_MAPS_JOB *)data;
+   int *wis, *powmax_dirs;
+   DFTREAL **powers, *powmaxs, *pownorms;
+   int nstats;
+   int row, bi;
+   int ret; /* return code */
+
+   /* Allocate DFT directional power vectors */
+   if((ret = alloc_dir_powers(&powers, job->dftwaves->nwaves,
+                              job->dftgrids->ngrids))){
+      initial_maps_fail(job, -1, ret);
+      return(NULL);
+   }
+
+   /* Allocate DFT power statistic arrays */
+   /* Compute length of statistics arrays.  Statistics not needed   */
+   /* for the first DFT wave, so the length is number of waves - 1. */
+   nstats = job->dftwaves->nwaves - 1;
+   if((ret = alloc_power_stats(&wis, &powmaxs, &powmax_dirs,
+                            &pownorms, nstats))){
+      free_dir_powers(powers, job->dftwaves->nwaves);
+      initial_maps_fail(job, -1, ret);
+      return(NULL);
+   }
+
+   while((row = g_atomic_int_add(&job->next_row, 1)) < job->mh){
+      g_mutex_lock(&job->lock);
+      ret = (row > job->error_row);
+      g_mutex_unlock(&job->lock);
+      if(ret)
+         break;
+
+      /* Foreach block in the row ... */
+      for(bi = row * job->mw; bi < (row + 1) * job->mw; bi++){
+         if((ret = initial_maps_block(job, bi, powers, wis, powmaxs,
+                                     powmax_dirs, pownorms, nstats))){
+            initial_maps_fail(job, row, ret);
+            break;
+         }
+      }
+   }
+
+   /* Deallocate working memory */
+   free_dir_powers(powers, job->dftwaves->nwaves);
+   free(wis);
+   free(powmaxs);
+   free(powmax_dirs);
+   free(pownorms);
+   return(NULL);
+}
+
 /*************************************************************************
 **************************************************************************
 #cat: gen_initial_maps - Creates an initial Direction Map from the given
@@ -230,14 +419,10 @@ int gen_initial_maps(int **odmap, int **olcmap, int **olfmap,
                 const LFSPARMS *lfsparms)
 {
    int *direction_map, *low_contrast_map, *low_flow_map;
-   int bi, bsize, blkdir;
-   int *wis, *powmax_dirs;
-   double **powers, *powmaxs, *pownorms;
-   int nstats;
-   int ret; /* return code */
-   int dft_offset;
-   int xminlimit, xmaxlimit, yminlimit, ymaxlimit;
-   int win_x, win_y, low_contrast_offset;
+   int bsize;
+   INITIAL_MAPS_JOB job;
+   GThread **threads;
+   int nthreads, i;
 
    print2log("INITIAL MAP\n");
 
@@ -277,158 +462,62 @@ int gen_initial_maps(int **odmap, int **olcmap, int **olfmap,
    /* Initialize the Low Flow Map to FALSE (0). */
    memset(low_flow_map, 0, bsize * sizeof(int));
 
-   /* Allocate DFT directional power vectors */
-   if((ret = alloc_dir_powers(&powers, dftwaves->nwaves, dftgrids->ngrids))){
-      /* Free memory allocated to this point. */
-      free(direction_map);
-      free(low_contrast_map);
-      free(low_flow_map);
-      return(ret);
-   }
-
-   /* Allocate DFT power statistic arrays */
-   /* Compute length of statistics arrays.  Statistics not needed   */
-   /* for the first DFT wave, so the length is number of waves - 1. */
-   nstats = dftwaves->nwaves - 1;
-   if((ret = alloc_power_stats(&wis, &powmaxs, &powmax_dirs,
-                            &pownorms, nstats))){
-      /* Free memory allocated to this point. */
-      free(direction_map);
-      free(low_contrast_map);
-      free(low_flow_map);
-      free_dir_powers(powers, dftwaves->nwaves);
-      return(ret);
-   }
+   job.direction_map = direction_map;
+   job.low_contrast_map = low_contrast_map;
+   job.low_flow_map = low_flow_map;
+   job.blkoffs = blkoffs;
+   job.mw = mw;
+   job.mh = mh;
+   job.pdata = pdata;
+   job.pw = pw;
+   job.ph = ph;
+   job.dftwaves = dftwaves;
+   job.dftgrids = dftgrids;
+   job.lfsparms = lfsparms;
+   job.next_row = 0;
+   g_mutex_init(&job.lock);
+   job.error_row = mh;
+   job.error = 0;
 
    /* Compute special window origin limits for determining low contrast.  */
    /* These pixel limits avoid analyzing the padded borders of the image. */
-   xminlimit = dftgrids->pad;
-   yminlimit = dftgrids->pad;
-   xmaxlimit = pw - dftgrids->pad - lfsparms->windowsize - 1;
-   ymaxlimit = ph - dftgrids->pad - lfsparms->windowsize - 1;
+   job.xminlimit = dftgrids->pad;
+   job.yminlimit = dftgrids->pad;
+   job.xmaxlimit = pw - dftgrids->pad - lfsparms->windowsize - 1;
+   job.ymaxlimit = ph - dftgrids->pad - lfsparms->windowsize - 1;
 
    /* max limits should not be negative */
-   xmaxlimit = MAX(xmaxlimit, 0);
-   ymaxlimit = MAX(ymaxlimit, 0);
+   job.xmaxlimit = MAX(job.xmaxlimit, 0);
+   job.ymaxlimit = MAX(job.ymaxlimit, 0);
 
-   /* Foreach block in image ... */
-   for(bi = 0; bi < bsize; bi++){
-      /* Adjust block offset from pointing to block origin to pointing */
-      /* to surrounding window origin.                                 */
-      dft_offset = blkoffs[bi] - (lfsparms->windowoffset * pw) -
-                      lfsparms->windowoffset;
-
-      /* Compute pixel coords of window origin. */
-      win_x = dft_offset % pw;
-      win_y = (int)(dft_offset / pw);
-
-      /* Make sure the current window does not access padded image pixels */
-      /* for analyzing low contrast.                                      */
-      win_x = max(xminlimit, win_x);
-      win_x = min(xmaxlimit, win_x);
-      win_y = max(yminlimit, win_y);
-      win_y = min(ymaxlimit, win_y);
-      low_contrast_offset = (win_y * pw) + win_x;
-
-      print2log("   BLOCK %2d (%2d, %2d) ", bi, bi%mw, bi/mw);
-
-      /* If block is low contrast ... */
-      if((ret = low_contrast_block(low_contrast_offset, lfsparms->windowsize,
-                                  pdata, pw, ph, lfsparms))){
-         /* If system error ... */
-         if(ret < 0){
-            free(direction_map);
-            free(low_contrast_map);
-            free(low_flow_map);
-            free_dir_powers(powers, dftwaves->nwaves);
-            free(wis);
-            free(powmaxs);
-            free(powmax_dirs);
-            free(pownorms);
-            return(ret);
-         }
-
-         /* Otherwise, block is low contrast ... */
-         print2log("LOW CONTRAST\n");
-         low_contrast_map[bi] = TRUE;
-         /* Direction Map's block is already set to INVALID. */
-      }
-      /* Otherwise, sufficient contrast for DFT processing ... */
-      else {
-         print2log("\n");
-
-         /* Compute DFT powers */
-         if((ret = dft_dir_powers(powers, pdata, low_contrast_offset, pw, ph,
-                               dftwaves, dftgrids))){
-            /* Free memory allocated to this point. */
-            free(direction_map);
-            free(low_contrast_map);
-            free(low_flow_map);
-            free_dir_powers(powers, dftwaves->nwaves);
-            free(wis);
-            free(powmaxs);
-            free(powmax_dirs);
-            free(pownorms);
-            return(ret);
-         }
-
-         /* Compute DFT power statistics, skipping first applied DFT  */
-         /* wave.  This is dependent on how the primary and secondary */
-         /* direction tests work below.                               */
-         if((ret = dft_power_stats(wis, powmaxs, powmax_dirs, pownorms, powers,
-                                1, dftwaves->nwaves, dftgrids->ngrids))){
-            /* Free memory allocated to this point. */
-            free(direction_map);
-            free(low_contrast_map);
-            free(low_flow_map);
-            free_dir_powers(powers, dftwaves->nwaves);
-            free(wis);
-            free(powmaxs);
-            free(powmax_dirs);
-            free(pownorms);
-            return(ret);
-         }
-
-#ifdef LOG_REPORT /*vvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvv*/
-         {  int _w;
-            fprintf(logfp, "      Power\n");
-            for(_w = 0; _w < nstats; _w++){
-               /* Add 1 to wis[w] to create index to original dft_coefs[] */
-               fprintf(logfp, "         wis[%d] %d %12.3f %2d %9.3f %12.3f\n",
-                    _w, wis[_w]+1, 
-                    powmaxs[wis[_w]], powmax_dirs[wis[_w]], pownorms[wis[_w]],
-                    powers[0][powmax_dirs[wis[_w]]]);
-            }
-         }
-#endif /*^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^*/
-
-         /* Conduct primary direction test */
-         blkdir = primary_dir_test(powers, wis, powmaxs, powmax_dirs,
-                                  pownorms, nstats, lfsparms);
-
-         if(blkdir != INVALID_DIR)
-            direction_map[bi] = blkdir;
-         else{
-            /* Conduct secondary (fork) direction test */
-            blkdir = secondary_fork_test(powers, wis, powmaxs, powmax_dirs,
-                                  pownorms, nstats, lfsparms);
-            if(blkdir != INVALID_DIR)
-               direction_map[bi] = blkdir;
-            /* Otherwise current direction in Direction Map remains INVALID */
-            else
-               /* Flag the block as having LOW RIDGE FLOW. */
-               low_flow_map[bi] = TRUE;
-         }
+   /* The calling thread takes part as well.  The log must come out in */
+   /* block order, so logging builds do not use threads.               */
+#ifdef LOG_REPORT
+   nthreads = 1;
+#else
+   nthreads = min(max(lfsparms->num_threads, 1), mh);
+#endif
+   threads = (GThread **)g_alloca(nthreads * sizeof(GThread *));
+   for(i = 1; i < nthreads; i++){
+      threads[i] = fpi_thread_try_new("lfs-maps", initial_maps_worker,
+                                      &job);
+      if(threads[i] == (GThread *)NULL)
+         break;
+   }
+   nthreads = i;
 
-      } /* End DFT */
-   } /* bi */
+   initial_maps_worker(&job);
+   for(i = 1; i < nthreads; i++)
+      g_thread_join(threads[i]);
+   g_mutex_clear(&job.lock);
 
-   /* Deallocate working memory */
-   free_dir_powers(powers, dftwaves->nwaves);
-   free(wis);
-   free(powmaxs);
-   free(powmax_dirs);
-   free(pownorms);
+   if(job.error){
+      /* Free memory allocated to this point. */
+      free(direction_map);
+      free(low_contrast_map);
+      free(low_flow_map);
+      return(job.error);
+   }
 
    *odmap = direction_map;
    *olcmap = low_contrast_map;
@@ -644,9 +733,10 @@ int interpolate_direction_map(int *direction_map, int *low_contrast_map,
 int morph_TF_map(int *tfmap, const int mw, const int mh,
                  const LFSPARMS *lfsparms)
 {
-   unsigned char *cimage, *mimage, *cptr;
+   unsigned char *cimage, *cptr;
+   BITWORD *bimage, *mimage;
    int *mptr;
-   int i;
+   int i, nwords;
    
 
    /* Convert TRUE/FALSE map into a binary byte image. */
@@ -656,11 +746,15 @@ int morph_TF_map(int *tfmap, const int mw, const int mh,
       return(-660);
    }
 
-   mimage = (unsigned char *)malloc(mw*mh);
-   if(mimage == (unsigned char *)NULL){
-      fprintf(stderr, "ERROR : morph_TF_map : malloc : mimage\n");
+   /* The map is morphed as a 1-bit image, a word of blocks at a time. */
+   nwords = BITIMAGE_ROW_WORDS(mw) * mh;
+   bimage = (BITWORD *)malloc(2 * nwords * sizeof(BITWORD));
+   if(bimage == (BITWORD *)NULL){
+      free(cimage);
+      fprintf(stderr, "ERROR : morph_TF_map : malloc : bimage\n");
       return(-661);
    }
+   mimage = bimage + nwords;
 
    cptr = cimage;
    mptr = tfmap;
@@ -668,10 +762,12 @@ int morph_TF_map(int *tfmap, const int mw, const int mh,
       *cptr++ = *mptr++;
    }
 
-   dilate_charimage_2(cimage, mimage, mw, mh);
-   dilate_charimage_2(mimage, cimage, mw, mh);
-   erode_charimage_2(cimage, mimage, mw, mh);
-   erode_charimage_2(mimage, cimage, mw, mh);
+   pack_charimage_bits(cimage, bimage, mw, mh);
+   dilate_bitimage(bimage, mimage, mw, mh);
+   dilate_bitimage(mimage, bimage, mw, mh);
+   erode_bitimage(bimage, mimage, mw, mh);
+   erode_bitimage(mimage, bimage, mw, mh);
+   unpack_charimage_bits(bimage, cimage, mw, mh);
 
    cptr = cimage;
    mptr = tfmap;
@@ -680,7 +776,7 @@ int morph_TF_map(int *tfmap, const int mw, const int mh,
    }
 
    free(cimage);
-   free(mimage);
+   free(bimage);
 
    return(0);
 }
@@ -967,7 +1063,7 @@ int gen_initial_imap(int **optr, int *blkoffs, const int mw, const int mh,
    int *imap;
    int bi, bsize, blkdir;
    int *wis, *powmax_dirs;
-   double **powers, *powmaxs, *pownorms;
+   DFTREAL **powers, *powmaxs, *pownorms;
    int nstats;
    int ret; /* return code */
 
@@ -1099,9 +1195,9 @@ int gen_initial_imap(int **optr, int *blkoffs, const int mw, const int mh,
       Zero or Positive - The selected IMAP integer direction
       INVALID_DIR - IMAP Integer direction could not be determined
 **************************************************************************/
-int primary_dir_test(double **powers, const int *wis,
-            const double *powmaxs, const int *powmax_dirs,
-            const double *pownorms, const int nstats,
+int primary_dir_test(DFTREAL **powers, const int *wis,
+            const DFTREAL *powmaxs, const int *powmax_dirs,
+            const DFTREAL *pownorms, const int nstats,
             const LFSPARMS *lfsparms)
 {
    int w;
@@ -1183,9 +1279,9 @@ int primary_dir_test(double **powers, const int *wis,
       Zero or Positive - The selected IMAP integer direction
       INVALID_DIR - IMAP Integer direction could not be determined
 **************************************************************************/
-int secondary_fork_test(double **powers, const int *wis,
-            const double *powmaxs, const int *powmax_dirs,
-            const double *pownorms, const int nstats,
+int secondary_fork_test(DFTREAL **powers, const int *wis,
+            const DFTREAL *powmaxs, const int *powmax_dirs,
+            const DFTREAL *pownorms, const int nstats,
             const LFSPARMS *lfsparms)
 {
    int ldir, rdir;
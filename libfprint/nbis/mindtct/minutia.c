@@ -49,6 +49,10 @@ identified are necessarily the best available for the purpose.
                         create_minutia()
                         free_minutiae()
                         free_minutia()
+                        copy_minutiae()
+                        minutiae_grid_cell()
+                        build_minutiae_grid()
+                        free_minutiae_grid()
                         remove_minutia()
                         join_minutia()
                         minutia_type()
@@ -56,9 +60,13 @@ identified are necessarily the best available for the purpose.
                         choose_scan_direction()
                         scan4minutiae()
                         scan4minutiae_horizontally()
+                        process_scan_site()
+                        scan_row_horizontally_V2()
                         scan4minutiae_horizontally_V2()
                         scan4minutiae_vertically()
+                        scan_column_vertically_V2()
                         scan4minutiae_vertically_V2()
+                        scan4minutiae_threaded_V2()
                         rescan4minutiae_horizontally()
                         rescan4minutiae_vertically()
                         rescan_partial_horizontally()
@@ -79,7 +87,40 @@ identified are necessarily the best available for the purpose.
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <lfs.h>
+#include <arena.h>
+
+/* What the V2 scans work on, besides the position being scanned. */
+typedef struct minutiae_scan{
+   MINUTIAE *minutiae;
+   unsigned char *bdata;
+   int iw, ih;
+   int *pdirection_map, *plow_flow_map, *phigh_curve_map;
+   const LFSPARMS *lfsparms;
+   /* If not NULL, the scan lines (rows for the horizontal scan, columns */
+   /* for the vertical one) of the pixels which processing a minutia    */
+   /* changed are flagged here, see process_scan_site().                */
+   unsigned char *dirty;
+   unsigned char *window;
+} MINUTIAE_SCAN;
+
+/* A minutia found by a scan and not processed yet: the position of its */
+/* third pixel pair, the position along the scan line of its second    */
+/* one, and the feature matched.                                       */
+typedef struct scan_site{
+   int cx, cy;
+   int c2;
+   int feature_id;
+} SCAN_SITE;
+
+static void init_minutiae_scan(MINUTIAE_SCAN *, MINUTIAE *,
+                unsigned char *, const int, const int, int *, int *, int *,
+                const LFSPARMS *);
+static int process_scan_site(MINUTIAE_SCAN *, const int, const int,
+                const int, const int, const int);
+static int scan4minutiae_threaded_V2(MINUTIAE_SCAN *, const int,
+                const int);
 
 
 
@@ -177,6 +218,7 @@ int detect_minutiae_V2(MINUTIAE *minutiae,
 {
    int ret;
    int *pdirection_map, *plow_flow_map, *phigh_curve_map;
+   MINUTIAE_SCAN scan;
 
    /* Pixelize the maps by assigning block values to individual pixels. */
    if((ret = pixelize_map(&pdirection_map, iw, ih, direction_map, mw, mh,
@@ -197,29 +239,26 @@ int detect_minutiae_V2(MINUTIAE *minutiae,
       return(ret);
    }
 
-   if((ret = scan4minutiae_horizontally_V2(minutiae, bdata, iw, ih,
-                 pdirection_map, plow_flow_map, phigh_curve_map, lfsparms))){
-      free(pdirection_map);
-      free(plow_flow_map);
-      free(phigh_curve_map);
-      return(ret);
-   }
-
-   if((ret = scan4minutiae_vertically_V2(minutiae, bdata, iw, ih,
-                 pdirection_map, plow_flow_map, phigh_curve_map, lfsparms))){
-      free(pdirection_map);
-      free(plow_flow_map);
-      free(phigh_curve_map);
-      return(ret);
+   /* Look for the minutiae on several threads if asked to. */
+   if(lfsparms->num_threads > 1){
+      init_minutiae_scan(&scan, minutiae, bdata, iw, ih, pdirection_map,
+                         plow_flow_map, phigh_curve_map, lfsparms);
+      if(!(ret = scan4minutiae_threaded_V2(&scan, SCAN_HORIZONTAL,
+                                           lfsparms->num_threads)))
+         ret = scan4minutiae_threaded_V2(&scan, SCAN_VERTICAL,
+                                         lfsparms->num_threads);
    }
+   else if(!(ret = scan4minutiae_horizontally_V2(minutiae, bdata, iw, ih,
+                 pdirection_map, plow_flow_map, phigh_curve_map, lfsparms)))
+      ret = scan4minutiae_vertically_V2(minutiae, bdata, iw, ih,
+                 pdirection_map, plow_flow_map, phigh_curve_map, lfsparms);
 
    /* Deallocate working memories. */
    free(pdirection_map);
    free(plow_flow_map);
    free(phigh_curve_map);
 
-   /* Return normally. */
-   return(0);
+   return(ret);
 }
 
 /*************************************************************************
@@ -866,6 +905,188 @@ void free_minutia(MINUTIA *minutia)
    free(minutia);
 }
 
+/*************************************************************************
+**************************************************************************
+#cat: copy_minutiae - Takes a minutiae list and makes a deep copy of it,
+#cat:                 allocated with the arena of the calling thread.  Used
+#cat:                 to keep the detected minutiae once the arena they
+#cat:                 were detected in is reset.
+
+   Input:
+      minutiae  - list of minutia structures to be copied
+   Output:
+      ominutiae - points to the copied list
+   Return Code:
+      Zero      - successful completion
+      Negative  - system error
+**************************************************************************/
+int copy_minutiae(MINUTIAE **ominutiae, const MINUTIAE *minutiae)
+{
+   MINUTIAE *copy;
+   MINUTIA *minutia;
+   int i, n;
+
+   copy = (MINUTIAE *)malloc(sizeof(MINUTIAE));
+   if(copy == (MINUTIAE *)NULL){
+      fprintf(stderr, "ERROR : copy_minutiae : malloc : copy\n");
+      return(-233);
+   }
+   /* Only the detected minutiae are kept. */
+   copy->alloc = (minutiae->num > 0) ? minutiae->num : 1;
+   copy->num = 0;
+   copy->list = (MINUTIA **)malloc(copy->alloc * sizeof(MINUTIA *));
+   if(copy->list == (MINUTIA **)NULL){
+      free(copy);
+      fprintf(stderr, "ERROR : copy_minutiae : malloc : copy->list\n");
+      return(-234);
+   }
+
+   for(i = 0; i < minutiae->num; i++){
+      minutia = (MINUTIA *)malloc(sizeof(MINUTIA));
+      if(minutia == (MINUTIA *)NULL){
+         free_minutiae(copy);
+         fprintf(stderr, "ERROR : copy_minutiae : malloc : minutia\n");
+         return(-235);
+      }
+      *minutia = *minutiae->list[i];
+      minutia->nbrs = (int *)NULL;
+      minutia->ridge_counts = (int *)NULL;
+      copy->list[copy->num++] = minutia;
+
+      /* Copy the neighbor lists when ridges were counted. */
+      n = minutia->num_nbrs;
+      if(n > 0 && minutiae->list[i]->nbrs != (int *)NULL){
+         minutia->nbrs = (int *)malloc(n * sizeof(int));
+         minutia->ridge_counts = (int *)malloc(n * sizeof(int));
+         if(minutia->nbrs == (int *)NULL ||
+            minutia->ridge_counts == (int *)NULL){
+            free_minutiae(copy);
+            fprintf(stderr, "ERROR : copy_minutiae : malloc : nbrs\n");
+            return(-236);
+         }
+         memcpy(minutia->nbrs, minutiae->list[i]->nbrs, n * sizeof(int));
+         memcpy(minutia->ridge_counts, minutiae->list[i]->ridge_counts,
+                n * sizeof(int));
+      }
+   }
+
+   *ominutiae = copy;
+   return(0);
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: minutiae_grid_cell - Returns the index of the grid cell holding the
+#cat:                  given pixel, clipping pixels off the image to the
+#cat:                  nearest cell.
+
+   Input:
+      grid       - grid of cells
+      x          - x-pixel coord
+      y          - y-pixel coord
+   Return Code:
+      Cell index
+**************************************************************************/
+int minutiae_grid_cell(const MINUTIAE_GRID *grid, const int x, const int y)
+{
+   int cx, cy;
+
+   cx = min(max(x / grid->cell, 0), grid->gw - 1);
+   cy = min(max(y / grid->cell, 0), grid->gh - 1);
+   return((cy * grid->gw) + cx);
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: build_minutiae_grid - Buckets a list of minutiae into a uniform grid
+#cat:                  of square cells covering the image, so that the
+#cat:                  minutiae near a point can be found without walking
+#cat:                  the whole list.  The grid is a snapshot: it must be
+#cat:                  rebuilt once minutiae are added to or removed from
+#cat:                  the list.
+
+   Input:
+      minutiae   - list of minutiae to be bucketed
+      iw         - width (in pixels) of the image
+      ih         - height (in pixels) of the image
+      cell       - width and height (in pixels) of a grid cell
+   Output:
+      ogrid      - points to the allocated grid
+   Return Code:
+      Zero      - successful completion
+      Negative  - system error
+**************************************************************************/
+int build_minutiae_grid(MINUTIAE_GRID **ogrid, const MINUTIAE *minutiae,
+                        const int iw, const int ih, const int cell)
+{
+   MINUTIAE_GRID *grid;
+   int i, c, ncells;
+   int *fill;
+
+   grid = (MINUTIAE_GRID *)malloc(sizeof(MINUTIAE_GRID));
+   if(grid == (MINUTIAE_GRID *)NULL){
+      fprintf(stderr, "ERROR : build_minutiae_grid : malloc : grid\n");
+      return(-237);
+   }
+   grid->cell = max(cell, 1);
+   grid->gw = (max(iw, 1) + grid->cell - 1) / grid->cell;
+   grid->gh = (max(ih, 1) + grid->cell - 1) / grid->cell;
+   ncells = grid->gw * grid->gh;
+
+   /* One extra offset marks the end of the last cell, and the fill */
+   /* cursors share the allocation.                                 */
+   grid->start = (int *)calloc((ncells<<1) + 1, sizeof(int));
+   if(grid->start == (int *)NULL){
+      free(grid);
+      fprintf(stderr, "ERROR : build_minutiae_grid : calloc : start\n");
+      return(-238);
+   }
+   fill = grid->start + ncells + 1;
+
+   grid->index = (int *)malloc(max(minutiae->num, 1) * sizeof(int));
+   if(grid->index == (int *)NULL){
+      free(grid->start);
+      free(grid);
+      fprintf(stderr, "ERROR : build_minutiae_grid : malloc : index\n");
+      return(-239);
+   }
+
+   /* Count the minutiae in each cell ... */
+   for(i = 0; i < minutiae->num; i++){
+      c = minutiae_grid_cell(grid, minutiae->list[i]->x,
+                             minutiae->list[i]->y);
+      grid->start[c+1]++;
+   }
+   /* ... turn the counts into offsets ... */
+   for(c = 0; c < ncells; c++){
+      grid->start[c+1] += grid->start[c];
+      fill[c] = grid->start[c];
+   }
+   /* ... and drop each minutia into its cell, keeping list order. */
+   for(i = 0; i < minutiae->num; i++){
+      c = minutiae_grid_cell(grid, minutiae->list[i]->x,
+                             minutiae->list[i]->y);
+      grid->index[fill[c]++] = i;
+   }
+
+   *ogrid = grid;
+   return(0);
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: free_minutiae_grid - Deallocates a grid built by build_minutiae_grid().
+
+   Input:
+      grid       - grid to be deallocated
+**************************************************************************/
+void free_minutiae_grid(MINUTIAE_GRID *grid)
+{
+   free(grid->start);
+   free(grid->index);
+   free(grid);
+}
+
 /*************************************************************************
 **************************************************************************
 #cat: remove_minutia - Removes the specified minutia point from the input
@@ -1373,6 +1594,214 @@ int scan4minutiae_horizontally(MINUTIAE *minutiae,
    return(0);
 }
 
+static void init_minutiae_scan(MINUTIAE_SCAN *scan, MINUTIAE *minutiae,
+                unsigned char *bdata, const int iw, const int ih,
+                int *pdirection_map, int *plow_flow_map, int *phigh_curve_map,
+                const LFSPARMS *lfsparms)
+{
+   scan->minutiae = minutiae;
+   scan->bdata = bdata;
+   scan->iw = iw;
+   scan->ih = ih;
+   scan->pdirection_map = pdirection_map;
+   scan->plow_flow_map = plow_flow_map;
+   scan->phigh_curve_map = phigh_curve_map;
+   scan->lfsparms = lfsparms;
+   scan->dirty = (unsigned char *)NULL;
+   scan->window = (unsigned char *)NULL;
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: process_scan_site - Processes a minutia found by the horizontal or
+#cat:                vertical V2 scan, and flags the scan lines whose pixels
+#cat:                this changed if the scan asks for it.
+
+   Input:
+      scan      - the image, its pixelized maps and the minutiae list
+      scan_dir  - orientation of the scan the minutia was found by
+      cx        - x-pixel coord where 3rd pattern pair of mintuia was detected
+      cy        - y-pixel coord where 3rd pattern pair of mintuia was detected
+      c2        - coord along the scan where 2nd pattern pair was detected
+      feature_id - type of minutia (ex. index into feature_patterns[] list)
+   Output:
+      scan      - the minutiae list updated, and the changed lines flagged
+   Return Code:
+      Zero      - successful completion (minutia added or ignored)
+      Negative  - system error
+**************************************************************************/
+static int process_scan_site(MINUTIAE_SCAN *scan, const int scan_dir,
+                const int cx, const int cy, const int c2,
+                const int feature_id)
+{
+   int x_loc, y_loc, half, wx, wy, ww, wh, x, y;
+   unsigned char *wptr, *bptr;
+   int check, ret;
+
+   /* Locate the minutia as process_*_scan_minutia_V2() do. */
+   if(scan_dir == SCAN_HORIZONTAL){
+      x_loc = (cx + c2)>>1;
+      y_loc = g_feature_patterns[feature_id].appearing ? cy+1 : cy;
+   }
+   else{
+      x_loc = g_feature_patterns[feature_id].appearing ? cx+1 : cx;
+      y_loc = (cy + c2)>>1;
+   }
+
+   /* Only minutiae in HIGH CURVATURE blocks change the image: tracing  */
+   /* their contour may find a small loop, which gets filled in.  The  */
+   /* contour is at most high_curve_half_contour steps away from the   */
+   /* minutia, so comparing the pixels around it tells what changed.   */
+   check = scan->dirty != (unsigned char *)NULL &&
+           *(scan->phigh_curve_map+(y_loc*scan->iw)+x_loc);
+   wx = wy = ww = wh = 0;
+   if(check){
+      half = scan->lfsparms->high_curve_half_contour + 1;
+      wx = max(0, x_loc-half);
+      wy = max(0, y_loc-half);
+      ww = min(scan->iw, x_loc+half+1) - wx;
+      wh = min(scan->ih, y_loc+half+1) - wy;
+      for(y = 0; y < wh; y++)
+         memcpy(scan->window+(y*ww), scan->bdata+((wy+y)*scan->iw)+wx, ww);
+   }
+
+   if(scan_dir == SCAN_HORIZONTAL)
+      ret = process_horizontal_scan_minutia_V2(scan->minutiae,
+                      cx, cy, c2, feature_id,
+                      scan->bdata, scan->iw, scan->ih, scan->pdirection_map,
+                      scan->plow_flow_map, scan->phigh_curve_map,
+                      scan->lfsparms);
+   else
+      ret = process_vertical_scan_minutia_V2(scan->minutiae,
+                      cx, cy, c2, feature_id,
+                      scan->bdata, scan->iw, scan->ih, scan->pdirection_map,
+                      scan->plow_flow_map, scan->phigh_curve_map,
+                      scan->lfsparms);
+   /* Return code may be:                       */
+   /* 1.  ret< 0 (implying system error)        */
+   /* 2. ret==IGNORE (ignore current feature)   */
+   if(ret < 0)
+      return(ret);
+
+   if(check){
+      for(y = 0; y < wh; y++){
+         wptr = scan->window+(y*ww);
+         bptr = scan->bdata+((wy+y)*scan->iw)+wx;
+         for(x = 0; x < ww; x++){
+            if(wptr[x] != bptr[x]){
+               if(scan_dir == SCAN_HORIZONTAL)
+                  scan->dirty[wy+y] = TRUE;
+               else
+                  scan->dirty[wx+x] = TRUE;
+            }
+         }
+      }
+   }
+
+   return(0);
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: scan_row_horizontally_V2 - Scans the pixel pairs of one row of a
+#cat:                binary image and the row below it, from a given column
+#cat:                on.  Minutiae found are either processed right away or,
+#cat:                if a list of sites is given, only recorded there.
+
+   Input:
+      scan      - the image, its pixelized maps and the minutiae list
+      cx        - x-pixel coord to start scanning from
+      cy        - y-pixel coord of the first scan row
+   Output:
+      sites     - if not NULL, the minutiae found, in scan order
+   Return Code:
+      Zero      - successful completion
+      Negative  - system error
+**************************************************************************/
+static int scan_row_horizontally_V2(MINUTIAE_SCAN *scan, GArray *sites,
+                int cx, const int cy)
+{
+   int ex, x2;
+   unsigned char *p1ptr, *p2ptr;
+   int possible[NFEATURES], nposs;
+   int ret;
+
+   ex = scan->iw;
+
+   /* While not at end of region's current scan row. */
+   while(cx < ex){
+      /* Get pixel pair from current x position in current and next */
+      /* scan rows. */
+      p1ptr = scan->bdata+(cy*scan->iw)+cx;
+      p2ptr = scan->bdata+((cy+1)*scan->iw)+cx;
+      /* If scan pixel pair matches first pixel pair of */
+      /* 1 or more features... */
+      if(match_1st_pair(*p1ptr, *p2ptr, possible, &nposs)){
+         /* Bump forward to next scan pixel pair. */
+         cx++;
+         p1ptr++;
+         p2ptr++;
+         /* If not at end of region's current scan row... */
+         if(cx < ex){
+            /* If scan pixel pair matches second pixel pair of */
+            /* 1 or more features... */
+            if(match_2nd_pair(*p1ptr, *p2ptr, possible, &nposs)){
+               /* Store current x location. */
+               x2 = cx;
+               /* Skip repeated pixel pairs. */
+               skip_repeated_horizontal_pair(&cx, ex, &p1ptr, &p2ptr,
+                                                 scan->iw, scan->ih);
+               /* If not at end of region's current scan row... */
+               if(cx < ex){
+                  /* If scan pixel pair matches third pixel pair of */
+                  /* a single feature... */
+                  if(match_3rd_pair(*p1ptr, *p2ptr, possible, &nposs)){
+                     if(sites != (GArray *)NULL){
+                        /* Leave the minutia to be processed later. */
+                        SCAN_SITE site = { cx, cy, x2, possible[0] };
+                        g_array_append_val(sites, site);
+                     }
+                     /* Process detected minutia point. */
+                     else if((ret = process_scan_site(scan, SCAN_HORIZONTAL,
+                                         cx, cy, x2, possible[0]))){
+                        /* Return system error. */
+                        return(ret);
+                     }
+                  }
+
+                  /* Set up to resume scan. */
+                  /* Test to see if 3rd pair can slide into 2nd pair. */
+                  /* The values of the 2nd pair MUST be different.    */
+                  /* If 3rd pair values are different ... */
+                  if(*p1ptr != *p2ptr){
+                     /* Set next first pair to last of repeated */
+                     /* 2nd pairs, ie. back up one pair.        */
+                     cx--;
+                  }
+
+                  /* Otherwise, 3rd pair can't be a 2nd pair, so  */
+                  /* keep pointing to 3rd pair so that it is used */
+                  /* in the next first pair test.                 */
+
+               } /* Else, at end of current scan row. */
+            }
+
+            /* Otherwise, 2nd pair failed, so keep pointing to it */
+            /* so that it is used in the next first pair test.    */
+
+         } /* Else, at end of current scan row. */
+      }
+      /* Otherwise, 1st pair failed... */
+      else{
+         /* Bump forward to next pixel pair. */
+         cx++;
+      }
+   } /* While not at end of current scan row. */
+
+   /* Return normally. */
+   return(0);
+}
+
 /*************************************************************************
 **************************************************************************
 #cat: scan4minutiae_horizontally_V2 - Scans an entire binary image
@@ -1399,97 +1828,17 @@ int scan4minutiae_horizontally_V2(MINUTIAE *minutiae,
                 int *pdirection_map, int *plow_flow_map, int *phigh_curve_map,
                 const LFSPARMS *lfsparms)
 {
-   int sx, sy, ex, ey, cx, cy, x2;
-   unsigned char *p1ptr, *p2ptr;
-   int possible[NFEATURES], nposs;
-   int ret;
-
-   /* Set scan region to entire image. */
-   sx = 0;
-   ex = iw;
-   sy = 0;
-   ey = ih;
-
-   /* Start at first row in region. */
-   cy = sy;
-   /* While second scan row not outside the bottom of the scan region... */
-   while(cy+1 < ey){
-      /* Start at beginning of new scan row in region. */
-      cx = sx;
-      /* While not at end of region's current scan row. */
-      while(cx < ex){
-         /* Get pixel pair from current x position in current and next */
-         /* scan rows. */
-         p1ptr = bdata+(cy*iw)+cx;
-         p2ptr = bdata+((cy+1)*iw)+cx;
-         /* If scan pixel pair matches first pixel pair of */
-         /* 1 or more features... */
-         if(match_1st_pair(*p1ptr, *p2ptr, possible, &nposs)){
-            /* Bump forward to next scan pixel pair. */
-            cx++;
-            p1ptr++;
-            p2ptr++;
-            /* If not at end of region's current scan row... */
-            if(cx < ex){
-               /* If scan pixel pair matches second pixel pair of */
-               /* 1 or more features... */
-               if(match_2nd_pair(*p1ptr, *p2ptr, possible, &nposs)){
-                  /* Store current x location. */
-                  x2 = cx;
-                  /* Skip repeated pixel pairs. */
-                  skip_repeated_horizontal_pair(&cx, ex, &p1ptr, &p2ptr,
-                                                    iw, ih);
-                  /* If not at end of region's current scan row... */
-                  if(cx < ex){
-                     /* If scan pixel pair matches third pixel pair of */
-                     /* a single feature... */
-                     if(match_3rd_pair(*p1ptr, *p2ptr, possible, &nposs)){
-                        /* Process detected minutia point. */
-                        if((ret = process_horizontal_scan_minutia_V2(minutiae,
-                                         cx, cy, x2, possible[0],
-                                         bdata, iw, ih, pdirection_map,
-                                         plow_flow_map, phigh_curve_map,
-                                         lfsparms))){
-                           /* Return code may be:                       */
-                           /* 1.  ret< 0 (implying system error)        */
-                           /* 2. ret==IGNORE (ignore current feature)   */
-                           if(ret < 0)
-                              return(ret);
-                           /* Otherwise, IGNORE and continue. */
-                        }
-                     }
-
-                     /* Set up to resume scan. */
-                     /* Test to see if 3rd pair can slide into 2nd pair. */
-                     /* The values of the 2nd pair MUST be different.    */
-                     /* If 3rd pair values are different ... */
-                     if(*p1ptr != *p2ptr){
-                        /* Set next first pair to last of repeated */
-                        /* 2nd pairs, ie. back up one pair.        */
-                        cx--;
-                     }
+   MINUTIAE_SCAN scan;
+   int cy, ret;
 
-                     /* Otherwise, 3rd pair can't be a 2nd pair, so  */
-                     /* keep pointing to 3rd pair so that it is used */
-                     /* in the next first pair test.                 */
-
-                  } /* Else, at end of current scan row. */
-               }
+   init_minutiae_scan(&scan, minutiae, bdata, iw, ih, pdirection_map,
+                      plow_flow_map, phigh_curve_map, lfsparms);
 
-               /* Otherwise, 2nd pair failed, so keep pointing to it */
-               /* so that it is used in the next first pair test.    */
-
-            } /* Else, at end of current scan row. */
-         }
-         /* Otherwise, 1st pair failed... */
-         else{
-            /* Bump forward to next pixel pair. */
-            cx++;
-         }
-      } /* While not at end of current scan row. */
-      /* Bump forward to next scan row. */
-      cy++;
-   } /* While not out of scan rows. */
+   /* While second scan row not outside the bottom of the image... */
+   for(cy = 0; cy+1 < ih; cy++){
+      if((ret = scan_row_horizontally_V2(&scan, (GArray *)NULL, 0, cy)))
+         return(ret);
+   }
 
    /* Return normally. */
    return(0);
@@ -1634,6 +1983,107 @@ int scan4minutiae_vertically(MINUTIAE *minutiae,
    return(0);
 }
 
+/*************************************************************************
+**************************************************************************
+#cat: scan_column_vertically_V2 - Scans the pixel pairs of one column of a
+#cat:                binary image and the column to its right, from a given
+#cat:                row on.  Minutiae found are either processed right away
+#cat:                or, if a list of sites is given, only recorded there.
+
+   Input:
+      scan      - the image, its pixelized maps and the minutiae list
+      cx        - x-pixel coord of the first scan column
+      cy        - y-pixel coord to start scanning from
+   Output:
+      sites     - if not NULL, the minutiae found, in scan order
+   Return Code:
+      Zero      - successful completion
+      Negative  - system error
+**************************************************************************/
+static int scan_column_vertically_V2(MINUTIAE_SCAN *scan, GArray *sites,
+                const int cx, int cy)
+{
+   int ey, y2;
+   unsigned char *p1ptr, *p2ptr;
+   int possible[NFEATURES], nposs;
+   int ret;
+
+   ey = scan->ih;
+
+   /* While not at end of region's current scan column. */
+   while(cy < ey){
+      /* Get pixel pair from current y position in current and next */
+      /* scan columns. */
+      p1ptr = scan->bdata+(cy*scan->iw)+cx;
+      p2ptr = p1ptr+1;
+      /* If scan pixel pair matches first pixel pair of */
+      /* 1 or more features... */
+      if(match_1st_pair(*p1ptr, *p2ptr, possible, &nposs)){
+         /* Bump forward to next scan pixel pair. */
+         cy++;
+         p1ptr+=scan->iw;
+         p2ptr+=scan->iw;
+         /* If not at end of region's current scan column... */
+         if(cy < ey){
+            /* If scan pixel pair matches second pixel pair of */
+            /* 1 or more features... */
+            if(match_2nd_pair(*p1ptr, *p2ptr, possible, &nposs)){
+               /* Store current y location. */
+               y2 = cy;
+               /* Skip repeated pixel pairs. */
+               skip_repeated_vertical_pair(&cy, ey, &p1ptr, &p2ptr,
+                                               scan->iw, scan->ih);
+               /* If not at end of region's current scan column... */
+               if(cy < ey){
+                  /* If scan pixel pair matches third pixel pair of */
+                  /* a single feature... */
+                  if(match_3rd_pair(*p1ptr, *p2ptr, possible, &nposs)){
+                     if(sites != (GArray *)NULL){
+                        /* Leave the minutia to be processed later. */
+                        SCAN_SITE site = { cx, cy, y2, possible[0] };
+                        g_array_append_val(sites, site);
+                     }
+                     /* Process detected minutia point. */
+                     else if((ret = process_scan_site(scan, SCAN_VERTICAL,
+                                         cx, cy, y2, possible[0]))){
+                        /* Return system error. */
+                        return(ret);
+                     }
+                  }
+
+                  /* Set up to resume scan. */
+                  /* Test to see if 3rd pair can slide into 2nd pair. */
+                  /* The values of the 2nd pair MUST be different.    */
+                  /* If 3rd pair values are different ... */
+                  if(*p1ptr != *p2ptr){
+                     /* Set next first pair to last of repeated */
+                     /* 2nd pairs, ie. back up one pair.        */
+                     cy--;
+                  }
+
+                  /* Otherwise, 3rd pair can't be a 2nd pair, so  */
+                  /* keep pointing to 3rd pair so that it is used */
+                  /* in the next first pair test.                 */
+
+               } /* Else, at end of current scan column. */
+            }
+
+            /* Otherwise, 2nd pair failed, so keep pointing to it */
+            /* so that it is used in the next first pair test.    */
+
+         } /* Else, at end of current scan column. */
+      }
+      /* Otherwise, 1st pair failed... */
+      else{
+         /* Bump forward to next pixel pair. */
+         cy++;
+      }
+   } /* While not at end of current scan column. */
+
+   /* Return normally. */
+   return(0);
+}
+
 /*************************************************************************
 **************************************************************************
 #cat: scan4minutiae_vertically_V2 - Scans an entire binary image
@@ -1660,100 +2110,174 @@ int scan4minutiae_vertically_V2(MINUTIAE *minutiae,
                 int *pdirection_map, int *plow_flow_map, int *phigh_curve_map,
                 const LFSPARMS *lfsparms)
 {
-   int sx, sy, ex, ey, cx, cy, y2;
-   unsigned char *p1ptr, *p2ptr;
-   int possible[NFEATURES], nposs;
-   int ret;
+   MINUTIAE_SCAN scan;
+   int cx, ret;
 
-   /* Set scan region to entire image. */
-   sx = 0;
-   ex = iw;
-   sy = 0;
-   ey = ih;
+   init_minutiae_scan(&scan, minutiae, bdata, iw, ih, pdirection_map,
+                      plow_flow_map, phigh_curve_map, lfsparms);
 
-   /* Start at first column in region. */
-   cx = sx;
-   /* While second scan column not outside the right of the region ... */
-   while(cx+1 < ex){
-      /* Start at beginning of new scan column in region. */
-      cy = sy;
-      /* While not at end of region's current scan column. */
-      while(cy < ey){
-         /* Get pixel pair from current y position in current and next */
-         /* scan columns. */
-         p1ptr = bdata+(cy*iw)+cx;
-         p2ptr = p1ptr+1;
-         /* If scan pixel pair matches first pixel pair of */
-         /* 1 or more features... */
-         if(match_1st_pair(*p1ptr, *p2ptr, possible, &nposs)){
-            /* Bump forward to next scan pixel pair. */
-            cy++;
-            p1ptr+=iw;
-            p2ptr+=iw;
-            /* If not at end of region's current scan column... */
-            if(cy < ey){
-               /* If scan pixel pair matches second pixel pair of */
-               /* 1 or more features... */
-               if(match_2nd_pair(*p1ptr, *p2ptr, possible, &nposs)){
-                  /* Store current y location. */
-                  y2 = cy;
-                  /* Skip repeated pixel pairs. */
-                  skip_repeated_vertical_pair(&cy, ey, &p1ptr, &p2ptr,
-                                                  iw, ih);
-                  /* If not at end of region's current scan column... */
-                  if(cy < ey){
-                     /* If scan pixel pair matches third pixel pair of */
-                     /* a single feature... */
-                     if(match_3rd_pair(*p1ptr, *p2ptr, possible, &nposs)){
-                        /* Process detected minutia point. */
-                        if((ret = process_vertical_scan_minutia_V2(minutiae,
-                                         cx, cy, y2, possible[0],
-                                         bdata, iw, ih, pdirection_map,
-                                         plow_flow_map, phigh_curve_map,
-                                         lfsparms))){
-                           /* Return code may be:                       */
-                           /* 1.  ret< 0 (implying system error)        */
-                           /* 2. ret==IGNORE (ignore current feature)   */
-                           if(ret < 0)
-                              return(ret);
-                           /* Otherwise, IGNORE and continue. */
-                        }
-                     }
+   /* While second scan column not outside the right of the image... */
+   for(cx = 0; cx+1 < iw; cx++){
+      if((ret = scan_column_vertically_V2(&scan, (GArray *)NULL, cx, 0)))
+         return(ret);
+   }
 
-                     /* Set up to resume scan. */
-                     /* Test to see if 3rd pair can slide into 2nd pair. */
-                     /* The values of the 2nd pair MUST be different.    */
-                     /* If 3rd pair values are different ... */
-                     if(*p1ptr != *p2ptr){
-                        /* Set next first pair to last of repeated */
-                        /* 2nd pairs, ie. back up one pair.        */
-                        cy--;
-                     }
+   /* Return normally. */
+   return(0);
+}
 
-                     /* Otherwise, 3rd pair can't be a 2nd pair, so  */
-                     /* keep pointing to 3rd pair so that it is used */
-                     /* in the next first pair test.                 */
+/* State shared by the threads looking for the minutiae of one V2 scan.  */
+/* The scan lines, pairs of rows or of columns, are cut into stripes     */
+/* handed out in order through next_stripe, each with its own list of    */
+/* sites.  Only looking at the pixels, the threads do not change a thing. */
+typedef struct scan_sites_job{
+   MINUTIAE_SCAN *scan;
+   int scan_dir;
+   int nlines;
+   int stripe_lines;
+   int nstripes;
+   GArray **sites;
+   gint next_stripe;
+} SCAN_SITES_JOB;
+
+static int scan_line_V2(MINUTIAE_SCAN *scan, const int scan_dir,
+                GArray *sites, const int line, const int start)
+{
+   if(scan_dir == SCAN_HORIZONTAL)
+      return(scan_row_horizontally_V2(scan, sites, start, line));
+   return(scan_column_vertically_V2(scan, sites, line, start));
+}
 
-                  } /* Else, at end of current scan row. */
-               }
+static gpointer scan_sites_worker(gpointer data)
+{
+   SCAN_SITES_JOB *job = (SCAN_SITES_JOB *)data;
+   int stripe, line, end;
+
+   while((stripe = g_atomic_int_add(&job->next_stripe, 1)) < job->nstripes){
+      end = min((stripe+1) * job->stripe_lines, job->nlines);
+      /* Recording sites cannot fail. */
+      for(line = stripe * job->stripe_lines; line < end; line++)
+         scan_line_V2(job->scan, job->scan_dir, job->sites[stripe], line, 0);
+   }
 
-               /* Otherwise, 2nd pair failed, so keep pointing to it */
-               /* so that it is used in the next first pair test.    */
+   return(NULL);
+}
 
-            } /* Else, at end of current scan column. */
-         }
-         /* Otherwise, 1st pair failed... */
-         else{
-            /* Bump forward to next pixel pair. */
-            cy++;
+/*************************************************************************
+**************************************************************************
+#cat: scan4minutiae_threaded_V2 - Scans an entire binary image horizontally
+#cat:                or vertically as scan4minutiae_horizontally_V2() and
+#cat:                scan4minutiae_vertically_V2() do, looking for the
+#cat:                minutiae of stripes of the image on several threads.
+#cat:                The minutiae found are then processed in the order of
+#cat:                the single threaded scan, so that the minutiae list
+#cat:                comes out the same.  Processing a minutia may fill a
+#cat:                loop into the image, after which the lines of the
+#cat:                stripes it changed are scanned again as they are
+#cat:                reached.
+
+   Input:
+      scan      - the image, its pixelized maps and the minutiae list
+      scan_dir  - SCAN_HORIZONTAL or SCAN_VERTICAL
+      nthreads  - the number of threads to look for minutiae on
+   Output:
+      scan      - the minutiae list updated
+   Return Code:
+      Zero      - successful completion
+      Negative  - system error
+**************************************************************************/
+static int scan4minutiae_threaded_V2(MINUTIAE_SCAN *scan, const int scan_dir,
+                const int nthreads)
+{
+   SCAN_SITES_JOB job;
+   GThread **threads;
+   GArray *sites;
+   SCAN_SITE *site;
+   unsigned char *p1ptr, *p2ptr;
+   int half, n, i, s, line, end, start;
+   guint j;
+   int ret = 0;
+
+   job.scan = scan;
+   job.scan_dir = scan_dir;
+   job.nlines = (scan_dir == SCAN_HORIZONTAL ? scan->ih : scan->iw) - 1;
+   if(job.nlines <= 0)
+      return(0);
+   /* A few stripes per thread, for the threads done first to pick up. */
+   job.nstripes = min(nthreads * 4, job.nlines);
+   job.stripe_lines = (job.nlines + job.nstripes - 1) / job.nstripes;
+   job.nstripes = (job.nlines + job.stripe_lines - 1) / job.stripe_lines;
+   job.sites = g_new(GArray *, job.nstripes);
+   for(s = 0; s < job.nstripes; s++)
+      job.sites[s] = g_array_new(FALSE, FALSE, sizeof(SCAN_SITE));
+   job.next_stripe = 0;
+
+   /* The calling thread takes part as well. */
+   n = min(nthreads, job.nstripes);
+   threads = (GThread **)g_alloca(n * sizeof(GThread *));
+   for(i = 1; i < n; i++){
+      threads[i] = fpi_thread_try_new("lfs-scan", scan_sites_worker,
+                                      &job);
+      if(threads[i] == (GThread *)NULL)
+         break;
+   }
+   n = i;
+
+   scan_sites_worker(&job);
+   for(i = 1; i < n; i++)
+      g_thread_join(threads[i]);
+
+   half = scan->lfsparms->high_curve_half_contour + 1;
+   scan->window = (unsigned char *)g_malloc((2*half+1) * (2*half+1));
+   scan->dirty = (unsigned char *)g_malloc0(job.nlines + 1);
+
+   for(s = 0; s < job.nstripes && !ret; s++){
+      sites = job.sites[s];
+      j = 0;
+      end = min((s+1) * job.stripe_lines, job.nlines);
+      for(line = s * job.stripe_lines; line < end && !ret; line++){
+         /* Where to scan the line again from, if it changed. */
+         start = (scan->dirty[line] || scan->dirty[line+1]) ? 0 : -1;
+
+         for(; j < sites->len; j++){
+            site = &g_array_index(sites, SCAN_SITE, j);
+            if((scan_dir == SCAN_HORIZONTAL ? site->cy : site->cx) != line)
+               break;
+            /* Sites found in the line before it changed are stale. */
+            if(start >= 0)
+               continue;
+            if((ret = process_scan_site(scan, scan_dir, site->cx, site->cy,
+                                        site->c2, site->feature_id)))
+               break;
+            if(scan->dirty[line] || scan->dirty[line+1]){
+               /* Resume from the 3rd pixel pair, as the single threaded */
+               /* scan does, now looking at the changed pixels.          */
+               p1ptr = scan->bdata+(site->cy*scan->iw)+site->cx;
+               if(scan_dir == SCAN_HORIZONTAL){
+                  p2ptr = p1ptr+scan->iw;
+                  start = site->cx - (*p1ptr != *p2ptr);
+               }
+               else{
+                  p2ptr = p1ptr+1;
+                  start = site->cy - (*p1ptr != *p2ptr);
+               }
+            }
          }
-      } /* While not at end of current scan column. */
-      /* Bump forward to next scan column. */
-      cx++;
-   } /* While not out of scan columns. */
 
-   /* Return normally. */
-   return(0);
+         if(!ret && start >= 0)
+            ret = scan_line_V2(scan, scan_dir, (GArray *)NULL, line, start);
+      }
+   }
+
+   g_free(scan->dirty);
+   g_free(scan->window);
+   scan->dirty = (unsigned char *)NULL;
+   scan->window = (unsigned char *)NULL;
+   for(s = 0; s < job.nstripes; s++)
+      g_array_free(job.sites[s], TRUE);
+   g_free(job.sites);
+
+   return(ret);
 }
 
 /*************************************************************************
@@ -3483,7 +4007,6 @@ void lfs2nist_minutia_XYT(int *ox, int *oy, int *ot,
                           const MINUTIA *minutia, const int iw, const int ih)
 {
    int x, y, t;
-   float degrees_per_unit;
 
    /*       XYT's according to NIST internal rep:           */
     /*      1. pixel coordinates with origin bottom-left    */
@@ -3497,9 +4020,10 @@ void lfs2nist_minutia_XYT(int *ox, int *oy, int *ot,
    x = minutia->x;
    y = ih - minutia->y;
 
-   degrees_per_unit = 180 / (float)NUM_DIRECTIONS;
-
-   t = (270 - sround(minutia->direction * degrees_per_unit)) % 360;
+   /* sround(direction * 180 / NUM_DIRECTIONS), in integer math; */
+   /* directions are never negative.                            */
+   t = (270 - (minutia->direction * 360 + NUM_DIRECTIONS)
+              / (2 * NUM_DIRECTIONS)) % 360;
    if(t < 0){
       t += 360;
    }
@@ -43,6 +43,10 @@ identified are necessarily the best available for the purpose.
                         get_north8_2()
                         get_east8_2()
                         get_west8_2()
+                        pack_charimage_bits()
+                        unpack_charimage_bits()
+                        erode_bitimage()
+                        dilate_bitimage()
 
 ***********************************************************************/
 
@@ -224,3 +228,172 @@ char get_west8_2(char *ptr, const int col, const int failcode)
    else
       return *(ptr- 1);
 }
+
+/*************************************************************************
+**************************************************************************
+#cat: pack_charimage_bits - Packs an 8-bit binary image into a 1-bit image
+#cat:             with BITIMAGE_WORD_BITS pixels per word.  Each row starts
+#cat:             on a new word and bit i of a word holds the i-th pixel it
+#cat:             covers.  Unused bits at the end of a row are left zero.
+
+   Input:
+      inp       - input 8-bit image, any non-zero pixel is true
+      iw        - width (in pixels) of image
+      ih        - height (in pixels) of image
+   Output:
+      out       - ih*BITIMAGE_ROW_WORDS(iw) words of packed pixels
+**************************************************************************/
+void pack_charimage_bits(const unsigned char *inp, BITWORD *out,
+                     const int iw, const int ih)
+{
+   int row, col, bw;
+   BITWORD *optr;
+
+   bw = BITIMAGE_ROW_WORDS(iw);
+   memset(out, 0, bw*ih*sizeof(BITWORD));
+
+   for(row = 0; row < ih; row++){
+      optr = out + (row*bw);
+      for(col = 0; col < iw; col++){
+         if(*inp++)
+            optr[col/BITIMAGE_WORD_BITS] |=
+                                 (BITWORD)1 << (col%BITIMAGE_WORD_BITS);
+      }
+   }
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: unpack_charimage_bits - Expands a 1-bit image built by
+#cat:             pack_charimage_bits() back into an 8-bit image of
+#cat:             zero and one pixels.
+
+   Input:
+      inp       - input 1-bit image
+      iw        - width (in pixels) of image
+      ih        - height (in pixels) of image
+   Output:
+      out       - the resulting 8-bit image
+**************************************************************************/
+void unpack_charimage_bits(const BITWORD *inp, unsigned char *out,
+                     const int iw, const int ih)
+{
+   int row, col, bw;
+   const BITWORD *iptr;
+
+   bw = BITIMAGE_ROW_WORDS(iw);
+
+   for(row = 0; row < ih; row++){
+      iptr = inp + (row*bw);
+      for(col = 0; col < iw; col++)
+         *out++ = (iptr[col/BITIMAGE_WORD_BITS] >>
+                   (col%BITIMAGE_WORD_BITS)) & 1;
+   }
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: morph_bitimage_row - Combines one row of a 1-bit image with its
+#cat:             4 neighbors a word at a time.  Neighbors outside the
+#cat:             image take the value of failcode, as in get_west8_2()
+#cat:             and friends.
+
+   Input:
+      north     - the row above, or NULL on the first row
+      cur       - the row being morphed
+      south     - the row below, or NULL on the last row
+      iw        - width (in pixels) of image
+      failcode  - value of neighbors outside the image (0 or 1)
+   Output:
+      out       - the resulting row
+**************************************************************************/
+static void morph_bitimage_row(const BITWORD *north, const BITWORD *cur,
+                     const BITWORD *south, BITWORD *out, const int iw,
+                     const int failcode)
+{
+   BITWORD fill, west, east, nbr_n, nbr_s, lastmask, lastbit;
+   int i, bw;
+
+   bw = BITIMAGE_ROW_WORDS(iw);
+   fill = failcode ? ~(BITWORD)0 : 0;
+   lastbit = (BITWORD)1 << ((iw-1)%BITIMAGE_WORD_BITS);
+   lastmask = lastbit | (lastbit-1);
+
+   for(i = 0; i < bw; i++){
+      /* Pixel x gets its west neighbor from bit x-1, carried in from */
+      /* the previous word, and its east neighbor from bit x+1.       */
+      west = (cur[i] << 1) |
+             ((i > 0 ? cur[i-1] : fill) >> (BITIMAGE_WORD_BITS-1));
+      east = cur[i] >> 1;
+      if(i < bw-1)
+         east |= cur[i+1] << (BITIMAGE_WORD_BITS-1);
+      else if(failcode)
+         east |= lastbit;
+      nbr_n = north ? north[i] : fill;
+      nbr_s = south ? south[i] : fill;
+
+      if(failcode)
+         out[i] = cur[i] & west & east & nbr_n & nbr_s;
+      else
+         out[i] = cur[i] | west | east | nbr_n | nbr_s;
+   }
+
+   /* Keep the unused bits past the end of the row zero. */
+   out[bw-1] &= lastmask;
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: erode_bitimage - Erodes a 1-bit image by setting true pixels to zero
+#cat:             if any of their 4 neighbors is zero, a word of pixels at
+#cat:             a time.  Gives the same result as erode_charimage_2(),
+#cat:             including along the image border.  Allocation of the
+#cat:             output image is the responsibility of the caller.
+
+   Input:
+      inp       - input 1-bit image to be eroded
+      iw        - width (in pixels) of image
+      ih        - height (in pixels) of image
+   Output:
+      out       - contains the resulting eroded image
+**************************************************************************/
+void erode_bitimage(const BITWORD *inp, BITWORD *out,
+                     const int iw, const int ih)
+{
+   int row, bw;
+
+   bw = BITIMAGE_ROW_WORDS(iw);
+   for(row = 0; row < ih; row++)
+      morph_bitimage_row(row > 0 ? inp+(row-1)*bw : (BITWORD *)NULL,
+                         inp+row*bw,
+                         row < ih-1 ? inp+(row+1)*bw : (BITWORD *)NULL,
+                         out+row*bw, iw, 1);
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: dilate_bitimage - Dilates a 1-bit image by setting false pixels to
+#cat:             one if any of their 4 neighbors is non-zero, a word of
+#cat:             pixels at a time.  Gives the same result as
+#cat:             dilate_charimage_2().  Allocation of the output image is
+#cat:             the responsibility of the caller.
+
+   Input:
+      inp       - input 1-bit image to be dilated
+      iw        - width (in pixels) of image
+      ih        - height (in pixels) of image
+   Output:
+      out       - contains the resulting dilated image
+**************************************************************************/
+void dilate_bitimage(const BITWORD *inp, BITWORD *out,
+                     const int iw, const int ih)
+{
+   int row, bw;
+
+   bw = BITIMAGE_ROW_WORDS(iw);
+   for(row = 0; row < ih; row++)
+      morph_bitimage_row(row > 0 ? inp+(row-1)*bw : (BITWORD *)NULL,
+                         inp+row*bw,
+                         row < ih-1 ? inp+(row+1)*bw : (BITWORD *)NULL,
+                         out+row*bw, iw, 0);
+}
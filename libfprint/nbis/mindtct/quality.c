@@ -39,6 +39,7 @@ identified are necessarily the best available for the purpose.
                         combined_minutia_quality()
                         grayscale_reliability()
                         get_neighborhood_stats()
+                        build_neighborhood_sums()
 
 ***********************************************************************/
 
@@ -47,6 +48,7 @@ identified are necessarily the best available for the purpose.
 #include <string.h>
 #include <math.h>
 #include <lfs.h>
+#include <arena.h>
 
 /***********************************************************************
 ************************************************************************
@@ -187,21 +189,21 @@ int gen_quality_map(int **oqmap, int *direction_map, int *low_contrast_map,
       iw         - width (in pixels) of the image
       ih         - height (in pixels) of the image
       radius_pix - pixel radius of surrounding neighborhood
+      isum       - integral image of idata, or NULL
+      isqr       - integral image of squared idata, or NULL
    Output:
       mean       - mean of neighboring pixels
       stdev      - standard deviation of neighboring pixels
 ************************************************************************/
 static void get_neighborhood_stats(double *mean, double *stdev, MINUTIA *minutia,
                      unsigned char *idata, const int iw, const int ih,
-                     const int radius_pix)
+                     const int radius_pix,
+                     const unsigned int *isum, const unsigned int *isqr)
 {
-   int i, x, y, rows, cols;
+   int i, x, y, rows, cols, x0, y0, x1, y1;
    int n = 0, sumX = 0, sumXX = 0;
    int histogram[256];
 
-   /* Zero out histogram. */
-   memset(histogram, 0, 256 * sizeof(int));
-
    /* Set minutia's coordinate variables. */
    x = minutia->x;
    y = minutia->y;
@@ -217,28 +219,46 @@ static void get_neighborhood_stats(double *mean, double *stdev, MINUTIA *minutia
       
    }
 
-   /* Foreach row in neighborhood ... */
-   for(rows = y - radius_pix;
-       rows <= y + radius_pix;
-       rows++){
-      /* Foreach column in neighborhood ... */
-      for(cols = x - radius_pix;
-          cols <= x + radius_pix;
-          cols++){
-         /* Bump neighbor's pixel value bin in histogram. */
-         histogram[*(idata+(rows * iw)+cols)]++;
-      }
+   if(isum != (unsigned int *)NULL){
+      /* Read the window sums off the integral images.  They are kept */
+      /* modulo 2^32, which is exact since no window sum exceeds it.  */
+      x0 = x - radius_pix;
+      y0 = y - radius_pix;
+      x1 = x + radius_pix + 1;
+      y1 = y + radius_pix + 1;
+      n = (x1 - x0) * (y1 - y0);
+      sumX = (int)(isum[y1*(iw+1)+x1] - isum[y0*(iw+1)+x1] -
+                   isum[y1*(iw+1)+x0] + isum[y0*(iw+1)+x0]);
+      sumXX = (int)(isqr[y1*(iw+1)+x1] - isqr[y0*(iw+1)+x1] -
+                    isqr[y1*(iw+1)+x0] + isqr[y0*(iw+1)+x0]);
    }
+   else{
+      /* Zero out histogram. */
+      memset(histogram, 0, 256 * sizeof(int));
+
+      /* Foreach row in neighborhood ... */
+      for(rows = y - radius_pix;
+          rows <= y + radius_pix;
+          rows++){
+         /* Foreach column in neighborhood ... */
+         for(cols = x - radius_pix;
+             cols <= x + radius_pix;
+             cols++){
+            /* Bump neighbor's pixel value bin in histogram. */
+            histogram[*(idata+(rows * iw)+cols)]++;
+         }
+      }
 
-   /* Foreach grayscale pixel bin ... */
-   for(i = 0; i < 256; i++){
-      if(histogram[i]){
-         /* Accumulate Sum(X[i]) */
-         sumX += (i * histogram[i]);
-         /* Accumulate Sum(X[i]^2) */
-         sumXX += (i * i * histogram[i]);
-         /* Accumulate N samples */
-         n += histogram[i];
+      /* Foreach grayscale pixel bin ... */
+      for(i = 0; i < 256; i++){
+         if(histogram[i]){
+            /* Accumulate Sum(X[i]) */
+            sumX += (i * histogram[i]);
+            /* Accumulate Sum(X[i]^2) */
+            sumXX += (i * i * histogram[i]);
+            /* Accumulate N samples */
+            n += histogram[i];
+         }
       }
    }
 
@@ -248,6 +268,60 @@ static void get_neighborhood_stats(double *mean, double *stdev, MINUTIA *minutia
    *stdev = sqrt((sumXX/(double)n) - ((*mean)*(*mean)));
 }
 
+/***********************************************************************
+************************************************************************
+#cat: build_neighborhood_sums - Builds integral images of the pixel values
+#cat:              and of their squares, so that get_neighborhood_stats()
+#cat:              can sum any window with 4 lookups.  Both images are
+#cat:              (iw+1) x (ih+1) with a leading row and column of zeros,
+#cat:              and their entries wrap modulo 2^32.
+
+   Input:
+      idata      - 8-bit grayscale fingerprint image
+      iw         - width (in pixels) of the image
+      ih         - height (in pixels) of the image
+   Output:
+      oisum      - points to the integral image of idata
+      oisqr      - points to the integral image of squared idata
+   Return Code:
+      Zero       - successful completion
+      Negative   - system error
+************************************************************************/
+static int build_neighborhood_sums(unsigned int **oisum, unsigned int **oisqr,
+                     unsigned char *idata, const int iw, const int ih)
+{
+   unsigned int *isum, *isqr, rsum, rsqr;
+   int x, y, sw;
+
+   sw = iw + 1;
+   isum = (unsigned int *)malloc(2 * sw * (ih+1) * sizeof(unsigned int));
+   if(isum == (unsigned int *)NULL){
+      fprintf(stderr, "ERROR : build_neighborhood_sums : malloc : isum\n");
+      return(-4);
+   }
+   isqr = isum + (sw * (ih+1));
+
+   memset(isum, 0, sw * sizeof(unsigned int));
+   memset(isqr, 0, sw * sizeof(unsigned int));
+   for(y = 0; y < ih; y++){
+      isum[(y+1)*sw] = 0;
+      isqr[(y+1)*sw] = 0;
+      rsum = 0;
+      rsqr = 0;
+      for(x = 0; x < iw; x++){
+         rsum += idata[x];
+         rsqr += idata[x] * idata[x];
+         isum[(y+1)*sw+x+1] = isum[y*sw+x+1] + rsum;
+         isqr[(y+1)*sw+x+1] = isqr[y*sw+x+1] + rsqr;
+      }
+      idata += iw;
+   }
+
+   *oisum = isum;
+   *oisqr = isqr;
+   return(0);
+}
+
 /***********************************************************************
 ************************************************************************
 #cat: grayscale_reliability - Given a minutia point, computes a reliability
@@ -269,16 +343,20 @@ static void get_neighborhood_stats(double *mean, double *stdev, MINUTIA *minutia
       iw         - width (in pixels) of the image
       ih         - height (in pixels) of the image
       radius_pix - pixel radius of surrounding neighborhood
+      isum       - integral image of idata, or NULL
+      isqr       - integral image of squared idata, or NULL
    Return Value:
       reliability - computed reliability measure
 ************************************************************************/
 static double grayscale_reliability(MINUTIA *minutia, unsigned char *idata,
-                             const int iw, const int ih, const int radius_pix)
+                             const int iw, const int ih, const int radius_pix,
+                             const unsigned int *isum, const unsigned int *isqr)
 {
    double mean, stdev;
    double reliability;
 
-   get_neighborhood_stats(&mean, &stdev, minutia, idata, iw, ih, radius_pix);
+   get_neighborhood_stats(&mean, &stdev, minutia, idata, iw, ih, radius_pix,
+                          isum, isqr);
 
    reliability = min((stdev>IDEALSTDEV ? 1.0 : stdev/(double)IDEALSTDEV),
                          (1.0-(fabs(mean-IDEALMEAN)/(double)IDEALMEAN)));
@@ -314,8 +392,9 @@ int combined_minutia_quality(MINUTIAE *minutiae,
              unsigned char *idata, const int iw, const int ih, const int id,
              const double ppmm)
 {
-   int ret, i, index, radius_pix;
+   int ret, i, index, radius_pix, wsize;
    int *pquality_map, qmap_value;
+   unsigned int *isum, *isqr;
    MINUTIA *minutia;
    double gs_reliability, reliability;
 
@@ -336,6 +415,20 @@ int combined_minutia_quality(MINUTIAE *minutiae,
       return(ret);
    }
 
+   /* Summing each neighborhood costs about a window of pixels plus   */
+   /* a pass over the histogram, and the integral images cost about  */
+   /* a pass over the image.  Only build them when there are enough  */
+   /* minutiae to pay for it.                                        */
+   isum = (unsigned int *)NULL;
+   isqr = (unsigned int *)NULL;
+   wsize = (2*radius_pix) + 1;
+   if((double)minutiae->num * ((wsize*wsize) + 256) > (double)iw * ih){
+      if((ret = build_neighborhood_sums(&isum, &isqr, idata, iw, ih))){
+         free(pquality_map);
+         return(ret);
+      }
+   }
+
    /* Foreach minutiae detected ... */
    for(i = 0; i < minutiae->num; i++){
       /* Assign minutia pointer. */
@@ -343,7 +436,8 @@ int combined_minutia_quality(MINUTIAE *minutiae,
 
       /* Compute reliability from stdev and mean of pixel neighborhood. */
       gs_reliability = grayscale_reliability(minutia,
-                                             idata, iw, ih, radius_pix);
+                                             idata, iw, ih, radius_pix,
+                                             isum, isqr);
 
       /* Lookup quality map value. */
       /* Compute minutia pixel index. */
@@ -379,6 +473,8 @@ int combined_minutia_quality(MINUTIAE *minutiae,
             fprintf(stderr, "unexpected quality map value %d ", qmap_value);
             fprintf(stderr, "not in range [0..4]\n");
             free(pquality_map);
+            if(isum != (unsigned int *)NULL)
+               free(isum);
             return(-3);
       }
       minutia->reliability = reliability;
@@ -386,6 +482,8 @@ int combined_minutia_quality(MINUTIAE *minutiae,
 
    /* NEW 05-08-2002 */
    free(pquality_map);
+   if(isum != (unsigned int *)NULL)
+      free(isum);
 
    /* Return normally. */
    return(0);
@@ -50,6 +50,7 @@ identified are necessarily the best available for the purpose.
 
 #include <stdio.h>
 #include <lfs.h>
+#include <arena.h>
 #include <log.h>
 
 /*************************************************************************
@@ -1350,17 +1351,31 @@ static int remove_overlaps(MINUTIAE *minutiae,
    return(0);
 }
 
-static void mark_minutiae_in_range(MINUTIAE *minutiae, int *to_remove, int x, int y,
+static void mark_minutiae_in_range(MINUTIAE *minutiae,
+                                   const MINUTIAE_GRID *grid,
+                                   int *to_remove, int x, int y,
                                    const LFSPARMS *lfsparms)
 {
-    int i, dist;
-    for (i = 0; i < minutiae->num; i++) {
-        if (to_remove[i])
-            continue;
-        dist = (int)sqrt((x - minutiae->list[i]->x) * (x - minutiae->list[i]->x) +
-                         (y - minutiae->list[i]->y) * (y - minutiae->list[i]->y));
-        if (dist < lfsparms->min_pp_distance) {
-            to_remove[i] = 1;
+    int i, k, c, c0, c1, cx, cy, dist;
+    int d = lfsparms->min_pp_distance;
+
+    /* Only the cells overlapping the square around (x, y) can hold */
+    /* minutiae within range.                                        */
+    c0 = minutiae_grid_cell(grid, x - d, y - d);
+    c1 = minutiae_grid_cell(grid, x + d, y + d);
+    for (cy = c0 / grid->gw; cy <= c1 / grid->gw; cy++) {
+        for (cx = c0 % grid->gw; cx <= c1 % grid->gw; cx++) {
+            c = (cy * grid->gw) + cx;
+            for (k = grid->start[c]; k < grid->start[c + 1]; k++) {
+                i = grid->index[k];
+                if (to_remove[i])
+                    continue;
+                dist = (int)sqrt((x - minutiae->list[i]->x) * (x - minutiae->list[i]->x) +
+                                 (y - minutiae->list[i]->y) * (y - minutiae->list[i]->y));
+                if (dist < d) {
+                    to_remove[i] = 1;
+                }
+            }
         }
     }
 }
@@ -1392,6 +1407,7 @@ static int remove_perimeter_pts(MINUTIAE *minutiae,
     int *right, *right_up, *right_down;
     int removed = 0;
     int left_min, right_max;
+    MINUTIAE_GRID *grid;
 
     if (!lfsparms->remove_perimeter_pts)
         return(0);
@@ -1475,14 +1491,25 @@ static int remove_perimeter_pts(MINUTIAE *minutiae,
     free(right_up);
     free(right_down);
 
+    /* Bucket the minutiae so each edge point only looks at those */
+    /* close to it.                                                 */
+    if ((ret = build_minutiae_grid(&grid, minutiae, iw, ih,
+                                   lfsparms->min_pp_distance))) {
+        free(left);
+        free(right);
+        free(to_remove);
+        return(ret);
+    }
+
     /* Mark minitiae close to the edge */
     for (i = 0; i < ih; i++) {
         if (left[i] != -1)
-            mark_minutiae_in_range(minutiae, to_remove, left[i], i, lfsparms);
+            mark_minutiae_in_range(minutiae, grid, to_remove, left[i], i, lfsparms);
         if (right[i] != -1)
-            mark_minutiae_in_range(minutiae, to_remove, right[i], i, lfsparms);
+            mark_minutiae_in_range(minutiae, grid, to_remove, right[i], i, lfsparms);
     }
 
+    free_minutiae_grid(grid);
     free(left);
     free(right);
 
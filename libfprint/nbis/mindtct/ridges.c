@@ -48,6 +48,7 @@ identified are necessarily the best available for the purpose.
 
 #include <stdio.h>
 #include <lfs.h>
+#include <arena.h>
 #include <log.h>
 
 /*************************************************************************
@@ -336,7 +337,7 @@ static int sort_neighbors(int *nbr_list, const int nnbrs, const int first,
 {
    double *join_thetas, theta;
    int i;
-   static double pi2 = M_PI*2.0;
+   static const double pi2 = M_PI*2.0;
 
    /* List of angles of lines joining the current primary to each */
    /* of the secondary neighbors.                                 */
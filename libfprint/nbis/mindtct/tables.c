@@ -0,0 +1,296 @@
+/*******************************************************************************
+
+License:
+This software was developed at the National Institute of Standards and
+Technology (NIST) by employees of the Federal Government in the course
+of their official duties. Pursuant to title 17 Section 105 of the
+United States Code, this software is not subject to copyright protection
+and is in the public domain. NIST assumes no responsibility  whatsoever for
+its use by other parties, and makes no guarantees, expressed or implied,
+about its quality, reliability, or any other characteristic.
+
+Disclaimer:
+This software was developed to promote biometric standards and biometric
+technology testing for the Federal Government in accordance with the USA
+PATRIOT Act and the Enhanced Border Security and Visa Entry Reform Act.
+Specific hardware and software products identified in this software were used
+in order to perform the software development.  In no case does such
+identification imply recommendation or endorsement by the National Institute
+of Standards and Technology, nor does it imply that the products and equipment
+identified are necessarily the best available for the purpose.
+
+*******************************************************************************/
+
+/***********************************************************************
+      LIBRARY: LFS - NIST Latent Fingerprint System
+
+      FILE:    TABLES.C
+
+      Contains routines responsible for caching the lookup tables used
+      by the NIST Latent Fingerprint System (LFS).  The tables depend
+      only on the LFS parameters and the image width, which a device
+      keeps from one capture to the next, so they are built once and
+      shared by every detection with the same key.
+
+***********************************************************************
+               ROUTINES:
+                        get_lfstables()
+                        release_lfstables()
+                        free_lfstables_cache()
+
+***********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <lfs.h>
+#include <arena.h>
+
+/* Number of table sets kept once no detection is using them. */
+#define MAX_UNUSED_LFSTABLES  4
+
+static GMutex lfstables_lock;
+static LFSTABLES *lfstables_cache;
+
+/*************************************************************************
+**************************************************************************
+#cat: free_lfstables - Deallocates a set of lookup tables and the memory
+#cat:                  of the structure itself.
+
+   Input:
+      tables - pointer to memory to be freed
+**************************************************************************/
+static void free_lfstables(LFSTABLES *tables)
+{
+   if(tables->dir2rad != (DIR2RAD *)NULL)
+      free_dir2rad(tables->dir2rad);
+   if(tables->dftwaves != (DFTWAVES *)NULL)
+      free_dftwaves(tables->dftwaves);
+   if(tables->dftgrids != (ROTGRIDS *)NULL)
+      free_rotgrids(tables->dftgrids);
+   if(tables->dirbingrids != (ROTGRIDS *)NULL)
+      free_rotgrids(tables->dirbingrids);
+   free(tables);
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: same_lfstables_key - Returns whether a cached set of lookup tables
+#cat:                      was built for the given image and parameters.
+
+   Input:
+      tables    - the cached lookup tables
+      iw        - width (in pixels) of the image
+      pad       - padding (in pixels) of the image
+      lfsparms  - parameters and thresholds for controlling LFS
+   Return Code:
+      TRUE      - the tables match the key
+      FALSE     - otherwise
+**************************************************************************/
+static int same_lfstables_key(const LFSTABLES *tables,
+                        const int iw, const int pad, const LFSPARMS *lfsparms)
+{
+   return(tables->iw == iw && tables->pad == pad &&
+          tables->num_directions == lfsparms->num_directions &&
+          tables->start_dir_angle == lfsparms->start_dir_angle &&
+          tables->num_dft_waves == lfsparms->num_dft_waves &&
+          tables->windowsize == lfsparms->windowsize &&
+          tables->dirbin_grid_w == lfsparms->dirbin_grid_w &&
+          tables->dirbin_grid_h == lfsparms->dirbin_grid_h);
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: build_lfstables - Allocates and initializes the lookup tables for
+#cat:                   the given image and parameters.
+
+   Input:
+      iw        - width (in pixels) of the image
+      ih        - height (in pixels) of the image
+      pad       - padding (in pixels) of the image
+      lfsparms  - parameters and thresholds for controlling LFS
+   Output:
+      otables   - points to the allocated/initialized lookup tables
+   Return Code:
+      Zero      - successful completion
+      Negative  - system error
+**************************************************************************/
+static int build_lfstables(LFSTABLES **otables,
+                        const int iw, const int ih, const int pad,
+                        const LFSPARMS *lfsparms)
+{
+   LFSTABLES *tables;
+   int ret;
+
+   tables = (LFSTABLES *)calloc(1, sizeof(LFSTABLES));
+   if(tables == (LFSTABLES *)NULL){
+      fprintf(stderr, "ERROR : build_lfstables : calloc : tables\n");
+      return(-670);
+   }
+
+   tables->iw = iw;
+   tables->pad = pad;
+   tables->num_directions = lfsparms->num_directions;
+   tables->start_dir_angle = lfsparms->start_dir_angle;
+   tables->num_dft_waves = lfsparms->num_dft_waves;
+   tables->windowsize = lfsparms->windowsize;
+   tables->dirbin_grid_w = lfsparms->dirbin_grid_w;
+   tables->dirbin_grid_h = lfsparms->dirbin_grid_h;
+
+   /* Initialize lookup table for converting integer directions */
+   /* to angles in radians.                                     */
+   if((ret = init_dir2rad(&(tables->dir2rad), lfsparms->num_directions))){
+      free_lfstables(tables);
+      return(ret);
+   }
+
+   /* Initialize wave form lookup tables for DFT analyses. */
+   if((ret = init_dftwaves(&(tables->dftwaves), g_dft_coefs,
+                        lfsparms->num_dft_waves, lfsparms->windowsize))){
+      free_lfstables(tables);
+      return(ret);
+   }
+
+   /* Initialize lookup table for pixel offsets to rotated grids */
+   /* used for DFT analyses.                                     */
+   if((ret = init_rotgrids(&(tables->dftgrids), iw, ih, pad,
+                        lfsparms->start_dir_angle, lfsparms->num_directions,
+                        lfsparms->windowsize, lfsparms->windowsize,
+                        RELATIVE2ORIGIN))){
+      free_lfstables(tables);
+      return(ret);
+   }
+
+   /* Initialize lookup table for pixel offsets to rotated grids */
+   /* used for directional binarization.                         */
+   if((ret = init_rotgrids(&(tables->dirbingrids), iw, ih, pad,
+                        lfsparms->start_dir_angle, lfsparms->num_directions,
+                        lfsparms->dirbin_grid_w, lfsparms->dirbin_grid_h,
+                        RELATIVE2CENTER))){
+      free_lfstables(tables);
+      return(ret);
+   }
+
+   *otables = tables;
+   return(0);
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: trim_lfstables_cache - Deallocates the least recently used sets of
+#cat:             lookup tables nobody holds, keeping at most keep of them.
+#cat:             Must be called with lfstables_lock held.
+
+   Input:
+      keep      - the number of unused table sets to keep
+**************************************************************************/
+static void trim_lfstables_cache(const int keep)
+{
+   LFSTABLES **link, *tables;
+   int nunused;
+
+   nunused = 0;
+   link = &lfstables_cache;
+   while((tables = *link) != (LFSTABLES *)NULL){
+      if(tables->refs == 0 && ++nunused > keep){
+         *link = tables->next;
+         free_lfstables(tables);
+      }
+      else
+         link = &(tables->next);
+   }
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: get_lfstables - Returns the lookup tables needed to detect minutiae
+#cat:             in an image of the given width, building them if
+#cat:             no cached set matches.  The tables are held until passed
+#cat:             to release_lfstables().
+
+   Input:
+      iw        - width (in pixels) of the image
+      ih        - height (in pixels) of the image
+      pad       - padding (in pixels) of the image
+      lfsparms  - parameters and thresholds for controlling LFS
+   Output:
+      otables   - points to the shared lookup tables
+   Return Code:
+      Zero      - successful completion
+      Negative  - system error
+**************************************************************************/
+int get_lfstables(LFSTABLES **otables, const int iw, const int ih,
+                  const int pad, const LFSPARMS *lfsparms)
+{
+   LFSTABLES **link, *tables, *built;
+   LFSARENA *arena;
+   int ret;
+
+   /* Tables are built outside the lock, so two detections may race */
+   /* to build the same key; the loser frees its copy.              */
+   built = (LFSTABLES *)NULL;
+   while(1){
+      g_mutex_lock(&lfstables_lock);
+      for(link = &lfstables_cache; (tables = *link) != (LFSTABLES *)NULL;
+          link = &(tables->next)){
+         if(same_lfstables_key(tables, iw, pad, lfsparms)){
+            /* Move the hit to the front so the list is kept */
+            /* in order of most recent use.                  */
+            *link = tables->next;
+            tables->next = lfstables_cache;
+            lfstables_cache = tables;
+            tables->refs++;
+            g_mutex_unlock(&lfstables_lock);
+            if(built != (LFSTABLES *)NULL)
+               free_lfstables(built);
+            *otables = tables;
+            return(0);
+         }
+      }
+
+      if(built != (LFSTABLES *)NULL){
+         built->refs = 1;
+         built->next = lfstables_cache;
+         lfstables_cache = built;
+         g_mutex_unlock(&lfstables_lock);
+         *otables = built;
+         return(0);
+      }
+      g_mutex_unlock(&lfstables_lock);
+
+      /* Cached tables outlive any one detection, so they are never */
+      /* taken from the arena of the calling thread.                 */
+      arena = lfs_set_arena((LFSARENA *)NULL);
+      ret = build_lfstables(&built, iw, ih, pad, lfsparms);
+      lfs_set_arena(arena);
+      if(ret)
+         return(ret);
+   }
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: release_lfstables - Gives back lookup tables returned by
+#cat:             get_lfstables().  They stay cached for later detections.
+
+   Input:
+      tables    - the lookup tables being released
+**************************************************************************/
+void release_lfstables(LFSTABLES *tables)
+{
+   g_mutex_lock(&lfstables_lock);
+   if(--tables->refs == 0)
+      trim_lfstables_cache(MAX_UNUSED_LFSTABLES);
+   g_mutex_unlock(&lfstables_lock);
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: free_lfstables_cache - Deallocates every cached set of lookup tables
+#cat:             that no detection currently holds.
+**************************************************************************/
+void free_lfstables_cache(void)
+{
+   g_mutex_lock(&lfstables_lock);
+   trim_lfstables_cache(0);
+   g_mutex_unlock(&lfstables_lock);
+}
@@ -44,11 +44,14 @@ identified are necessarily the best available for the purpose.
                         angle2line()
                         line2direction()
                         closest_dir_dist()
+                        start_stage_timer()
+                        stop_stage_timer()
 ***********************************************************************/
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <lfs.h>
+#include <arena.h>
 
 /*************************************************************************
 **************************************************************************
@@ -534,7 +537,7 @@ int line2direction(const int fx, const int fy,
 {
    double theta, pi_factor;
    int idir, full_ndirs;
-   static double pi2 = M_PI*2.0;
+   static const double pi2 = M_PI*2.0;
 
    /* Compute angle to line connecting the 2 points.             */
    /* Coordinates are swapped and order of points reversed to    */
@@ -603,3 +606,45 @@ int closest_dir_dist(const int dir1, const int dir2, const int ndirs)
    return(dist);
 }
 
+
+/*************************************************************************
+**************************************************************************
+#cat: start_stage_timer - Returns the time a stage of detection starts at,
+#cat:              for passing to stop_stage_timer().  The clock is not
+#cat:              read when no stage timings are being kept.
+
+   Input:
+      lfsparms - parameters and thresholds for controlling LFS
+   Return Code:
+      Time     - monotonic time (in microseconds), or 0
+**************************************************************************/
+gint64 start_stage_timer(const LFSPARMS *lfsparms)
+{
+   if(lfsparms->stats == (LFSSTATS *)NULL)
+      return(0);
+   return(g_get_monotonic_time());
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: stop_stage_timer - Adds the time since the mark to the given stage
+#cat:              of the stage timings, if any are being kept, then moves
+#cat:              the mark to now so the next stage can be timed from it.
+
+   Input:
+      mark     - time returned by start_stage_timer() or the last stop
+      stage    - the LFS_STAGE_* being stopped
+      lfsparms - parameters and thresholds for controlling LFS
+   Output:
+      mark     - the current time
+**************************************************************************/
+void stop_stage_timer(gint64 *mark, const int stage, const LFSPARMS *lfsparms)
+{
+   gint64 now;
+
+   if(lfsparms->stats == (LFSSTATS *)NULL)
+      return;
+   now = g_get_monotonic_time();
+   lfsparms->stats->usecs[stage] += now - *mark;
+   *mark = now;
+}
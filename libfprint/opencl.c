@@ -0,0 +1,377 @@
+/*
+ * OpenCL ranking of identification candidates
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* The GPU runs the compatible edge search of bz_match_tables_ctx() for one
+ * probe against every sample of a gallery at once, one sample per work
+ * item. Rather than building and walking the web of compatible pairs, each
+ * work item bins the pairs it finds by the rotation between the two
+ * prints, and scores the sample by its most populated rotation: genuine
+ * pairs agree on it, chance ones do not. This only ranks the gallery; the
+ * best ranked samples are then scored exactly by the CPU matcher.
+ *
+ * The gallery edge tables are uploaded the first time a gallery is ranked,
+ * and kept on the device for as long as the same tables are ranked again.
+ * Freeing any of them drops the upload, see fpi_opencl_table_freed(). */
+
+#define CL_TARGET_OPENCL_VERSION 120
+#include <errno.h>
+#include <string.h>
+
+#include <CL/cl.h>
+#include <glib.h>
+
+#include "fp_internal.h"
+#include "nbis/include/bozorth.h"
+
+/* rotations are binned 10 degrees apart, and a sample scores the pairs of
+ * its best two neighbouring bins, so that a rotation straddling two bins
+ * is not split */
+#define RANK_ROT_BINS	36
+
+static const char rank_kernel_source[] =
+"__kernel void rank(__global const int4 *probe, int probe_len,\n"
+"		   __global const int4 *rows, __global const int2 *samples,\n"
+"		   __global int *scores)\n"
+"{\n"
+"	int s = get_global_id(0);\n"
+"	int2 sample = samples[s];\n"
+"	__global const int4 *g = rows + sample.x;\n"
+"	int hist[ROT_BINS];\n"
+"	int pairs = 0, best = 0, st = 0, j, k;\n"
+"\n"
+"	if (sample.y < 0) {\n"
+"		scores[s] = INT_MAX;\n"
+"		return;\n"
+"	}\n"
+"	for (k = 0; k < ROT_BINS; k++)\n"
+"		hist[k] = 0;\n"
+"\n"
+"	for (k = 0; k < probe_len - 1 && pairs < MAX_PAIRS; k++) {\n"
+"		int4 ss = probe[k];\n"
+"\n"
+"		for (j = st; j < sample.y && pairs < MAX_PAIRS; j++) {\n"
+"			int4 ff = g[j];\n"
+"			float dz = ff.x - ss.x;\n"
+"			float fi = (2.0f * TK) * (ff.x + ss.x);\n"
+"			int p1, p2;\n"
+"\n"
+"			if (dz * dz > fi * fi) {\n"
+"				if (dz < 0) {\n"
+"					st = j + 1;\n"
+"					continue;\n"
+"				}\n"
+"				break;\n"
+"			}\n"
+"			dz = ss.y - ff.y;\n"
+"			if (dz * dz > TXS && dz * dz < CTXS)\n"
+"				continue;\n"
+"			dz = ss.z - ff.z;\n"
+"			if (dz * dz > TXS && dz * dz < CTXS)\n"
+"				continue;\n"
+"\n"
+"			p1 = ss.w >= 220 ? ss.w - 580 : ss.w;\n"
+"			p2 = ff.w >= 220 ? ff.w - 580 : ff.w;\n"
+"			p1 -= p2;\n"
+"			if (p1 > 180)\n"
+"				p1 -= 360;\n"
+"			else if (p1 <= -180)\n"
+"				p1 += 360;\n"
+"			hist[((p1 + 180) * ROT_BINS / 360) % ROT_BINS]++;\n"
+"			pairs++;\n"
+"		}\n"
+"	}\n"
+"\n"
+"	for (k = 0; k < ROT_BINS; k++)\n"
+"		best = max(best, hist[k] + hist[(k + 1) % ROT_BINS]);\n"
+"	scores[s] = best;\n"
+"}\n";
+
+static GMutex opencl_lock;
+static gboolean opencl_failed = FALSE;
+static cl_context opencl_ctx = NULL;
+static cl_command_queue opencl_queue = NULL;
+static cl_program opencl_program = NULL;
+static cl_kernel opencl_kernel = NULL;
+
+/* the gallery tables currently on the device, in upload order */
+static const struct bz_gallery **uploaded_tables = NULL;
+static int nr_uploaded_tables = 0;
+static GHashTable *uploaded_set = NULL;
+static cl_mem uploaded_rows = NULL;
+static cl_mem uploaded_samples = NULL;
+static cl_mem uploaded_scores = NULL;
+
+static void drop_upload(void)
+{
+	if (uploaded_rows)
+		clReleaseMemObject(uploaded_rows);
+	if (uploaded_samples)
+		clReleaseMemObject(uploaded_samples);
+	if (uploaded_scores)
+		clReleaseMemObject(uploaded_scores);
+	uploaded_rows = uploaded_samples = uploaded_scores = NULL;
+	g_free(uploaded_tables);
+	uploaded_tables = NULL;
+	nr_uploaded_tables = 0;
+	if (uploaded_set)
+		g_hash_table_remove_all(uploaded_set);
+}
+
+static void opencl_release(void)
+{
+	drop_upload();
+	if (uploaded_set)
+		g_hash_table_destroy(uploaded_set);
+	uploaded_set = NULL;
+	if (opencl_kernel)
+		clReleaseKernel(opencl_kernel);
+	if (opencl_program)
+		clReleaseProgram(opencl_program);
+	if (opencl_queue)
+		clReleaseCommandQueue(opencl_queue);
+	if (opencl_ctx)
+		clReleaseContext(opencl_ctx);
+	opencl_kernel = NULL;
+	opencl_program = NULL;
+	opencl_queue = NULL;
+	opencl_ctx = NULL;
+}
+
+/* Picks the first GPU, or the first device of any kind if there is no GPU,
+ * and builds the kernel for it. */
+static int opencl_setup(void)
+{
+	const char *source = rank_kernel_source;
+	cl_platform_id platforms[8];
+	cl_uint nr_platforms, i;
+	cl_device_id device = NULL;
+	gchar *options;
+	cl_int err;
+
+	err = clGetPlatformIDs(G_N_ELEMENTS(platforms), platforms,
+		&nr_platforms);
+	if (err != CL_SUCCESS || nr_platforms == 0) {
+		fp_warn("no OpenCL platform");
+		return -ENODEV;
+	}
+	nr_platforms = MIN(nr_platforms, G_N_ELEMENTS(platforms));
+	for (i = 0; i < nr_platforms && !device; i++)
+		if (clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_GPU, 1,
+				&device, NULL) != CL_SUCCESS)
+			device = NULL;
+	for (i = 0; i < nr_platforms && !device; i++)
+		if (clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_ALL, 1,
+				&device, NULL) != CL_SUCCESS)
+			device = NULL;
+	if (!device) {
+		fp_warn("no OpenCL device");
+		return -ENODEV;
+	}
+
+	opencl_ctx = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
+	if (err != CL_SUCCESS)
+		goto err;
+	opencl_queue = clCreateCommandQueue(opencl_ctx, device, 0, &err);
+	if (err != CL_SUCCESS)
+		goto err;
+	opencl_program = clCreateProgramWithSource(opencl_ctx, 1, &source,
+		NULL, &err);
+	if (err != CL_SUCCESS)
+		goto err;
+
+	options = g_strdup_printf("-DROT_BINS=%d -DMAX_PAIRS=%d -DTK=%.2ff "
+		"-DTXS=%d -DCTXS=%d", RANK_ROT_BINS, ROT_SIZE_1 - 1, TK, TXS,
+		CTXS);
+	err = clBuildProgram(opencl_program, 1, &device, options, NULL, NULL);
+	g_free(options);
+	if (err != CL_SUCCESS) {
+		char log[1024] = "";
+
+		clGetProgramBuildInfo(opencl_program, device,
+			CL_PROGRAM_BUILD_LOG, sizeof(log) - 1, log, NULL);
+		fp_err("OpenCL kernel build failed: %s", log);
+		goto err;
+	}
+	opencl_kernel = clCreateKernel(opencl_program, "rank", &err);
+	if (err != CL_SUCCESS)
+		goto err;
+
+	uploaded_set = g_hash_table_new(g_direct_hash, g_direct_equal);
+	return 0;
+
+err:
+	fp_err("OpenCL setup failed: %d", err);
+	opencl_release();
+	return -ENODEV;
+}
+
+static cl_int4 table_row(const struct bz_gallery *table, int i)
+{
+	const int *row = table->colpt[i];
+	cl_int4 v = { { row[0], row[1], row[2], row[5] } };
+
+	return v;
+}
+
+/* Packs the sorted edge rows of every table back to back. A NULL table,
+ * one the CPU could not build, gets a negative length: its sample ranks
+ * first. */
+static int upload_tables(const struct bz_gallery **tables, int nr_tables)
+{
+	cl_int4 *rows;
+	cl_int2 *samples;
+	size_t nr_rows = 0, n = 0;
+	cl_int err;
+	int i, j;
+
+	drop_upload();
+	for (i = 0; i < nr_tables; i++)
+		if (tables[i])
+			nr_rows += tables[i]->len;
+
+	rows = g_new(cl_int4, MAX(nr_rows, 1));
+	samples = g_new(cl_int2, nr_tables);
+	for (i = 0; i < nr_tables; i++) {
+		samples[i].s[0] = n;
+		samples[i].s[1] = tables[i] ? tables[i]->len : -1;
+		for (j = 0; tables[i] && j < tables[i]->len; j++)
+			rows[n++] = table_row(tables[i], j);
+	}
+
+	uploaded_rows = clCreateBuffer(opencl_ctx,
+		CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+		MAX(nr_rows, 1) * sizeof(*rows), rows, &err);
+	if (err == CL_SUCCESS)
+		uploaded_samples = clCreateBuffer(opencl_ctx,
+			CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+			nr_tables * sizeof(*samples), samples, &err);
+	if (err == CL_SUCCESS)
+		uploaded_scores = clCreateBuffer(opencl_ctx,
+			CL_MEM_WRITE_ONLY, nr_tables * sizeof(cl_int), NULL,
+			&err);
+	g_free(rows);
+	g_free(samples);
+	if (err != CL_SUCCESS) {
+		fp_err("could not upload %zd edges: %d", nr_rows, err);
+		drop_upload();
+		return -ENOMEM;
+	}
+
+	uploaded_tables = g_memdup(tables, nr_tables * sizeof(*tables));
+	nr_uploaded_tables = nr_tables;
+	for (i = 0; i < nr_tables; i++)
+		if (tables[i])
+			g_hash_table_add(uploaded_set, (gpointer) tables[i]);
+	fp_dbg("uploaded %d samples, %zd edges", nr_tables, nr_rows);
+	return 0;
+}
+
+static int rank_uploaded(const struct bz_gallery *probe, int *scores)
+{
+	cl_int4 *rows = g_new(cl_int4, MAX(probe->len, 1));
+	size_t global = nr_uploaded_tables;
+	cl_mem probe_rows;
+	cl_int probe_len = probe->len;
+	cl_int err;
+	int i;
+
+	for (i = 0; i < probe->len; i++)
+		rows[i] = table_row(probe, i);
+	probe_rows = clCreateBuffer(opencl_ctx,
+		CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+		MAX(probe->len, 1) * sizeof(*rows), rows, &err);
+	g_free(rows);
+	if (err != CL_SUCCESS)
+		return -ENOMEM;
+
+	err = clSetKernelArg(opencl_kernel, 0, sizeof(cl_mem), &probe_rows);
+	err |= clSetKernelArg(opencl_kernel, 1, sizeof(cl_int), &probe_len);
+	err |= clSetKernelArg(opencl_kernel, 2, sizeof(cl_mem), &uploaded_rows);
+	err |= clSetKernelArg(opencl_kernel, 3, sizeof(cl_mem),
+		&uploaded_samples);
+	err |= clSetKernelArg(opencl_kernel, 4, sizeof(cl_mem),
+		&uploaded_scores);
+	if (err == CL_SUCCESS)
+		err = clEnqueueNDRangeKernel(opencl_queue, opencl_kernel, 1,
+			NULL, &global, NULL, 0, NULL, NULL);
+	if (err == CL_SUCCESS)
+		err = clEnqueueReadBuffer(opencl_queue, uploaded_scores,
+			CL_TRUE, 0, global * sizeof(cl_int), scores, 0, NULL,
+			NULL);
+	clReleaseMemObject(probe_rows);
+	if (err != CL_SUCCESS) {
+		fp_err("OpenCL ranking failed: %d", err);
+		return -EIO;
+	}
+	return 0;
+}
+
+/* Scores every gallery table against the probe table, higher is better.
+ * Returns -ENODEV if there is no usable OpenCL device, in which case the
+ * caller ranks the candidates itself. */
+int fpi_opencl_rank(const struct bz_gallery *probe,
+	const struct bz_gallery **tables, int nr_tables, int *scores)
+{
+	int r = 0;
+
+	if (nr_tables == 0)
+		return 0;
+
+	g_mutex_lock(&opencl_lock);
+	if (opencl_failed) {
+		r = -ENODEV;
+		goto out;
+	}
+	if (!opencl_ctx) {
+		r = opencl_setup();
+		if (r < 0) {
+			opencl_failed = TRUE;
+			goto out;
+		}
+	}
+
+	if (nr_tables != nr_uploaded_tables ||
+	    memcmp(tables, uploaded_tables, nr_tables * sizeof(*tables))) {
+		r = upload_tables(tables, nr_tables);
+		if (r < 0)
+			goto out;
+	}
+	r = rank_uploaded(probe, scores);
+
+out:
+	g_mutex_unlock(&opencl_lock);
+	return r;
+}
+
+/* Called as a gallery table is freed: another table could later be
+ * allocated at the same address, so an upload holding it is dropped. */
+void fpi_opencl_table_freed(const struct bz_gallery *table)
+{
+	g_mutex_lock(&opencl_lock);
+	if (uploaded_set && g_hash_table_contains(uploaded_set, table))
+		drop_upload();
+	g_mutex_unlock(&opencl_lock);
+}
+
+void fpi_opencl_exit(void)
+{
+	g_mutex_lock(&opencl_lock);
+	opencl_release();
+	opencl_failed = FALSE;
+	g_mutex_unlock(&opencl_lock);
+}
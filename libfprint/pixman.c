@@ -23,6 +23,137 @@
 
 #include "fp_internal.h"
 
+#if defined(__GNUC__) && !defined(UPSCALE_SCALAR)
+#define UPSCALE_VECTOR_LANES 4
+typedef guint32 upscale_u32v __attribute__((vector_size(UPSCALE_VECTOR_LANES * sizeof(guint32))));
+#endif
+
+/* Where pixman's bilinear fetcher samples each destination pixel along one
+ * axis: the inverse scale truncated to 16.16 fixed point, the first pixel
+ * centre rounded and the weight reduced to 7 bits. Index is the source
+ * pixel left of (or above) the sample and weight, out of 256, goes to the
+ * one after it. */
+static void upscale_axis(unsigned int factor, int size, int *index,
+			 int *weight)
+{
+	gint64 inverse = 65536 / factor;
+	gint64 start = (inverse * 32768 + 32768) >> 16;
+	int i;
+
+	for (i = 0; i < size; i++) {
+		int pos = start + i * inverse - 32768;
+
+		index[i] = pos >> 16;
+		weight[i] = ((pos >> 9) & 0x7f) << 1;
+	}
+}
+
+/* Horizontally interpolated row, padded holds the source row with a zero
+ * pixel on both sides as pixman reads pixels outside the image as 0 */
+static void upscale_row(const unsigned char *padded, int width,
+			const int *index, const int *weight, guint32 *out)
+{
+	int i;
+
+	for (i = 0; i < width; i++)
+		out[i] = padded[index[i] + 1] * (256 - weight[i]) +
+			 padded[index[i] + 2] * weight[i];
+}
+
+static void upscale_blend(const guint32 *top, const guint32 *bottom,
+			  int width, guint32 weight, unsigned char *out)
+{
+	int i = 0;
+
+#ifdef UPSCALE_VECTOR_LANES
+	for (; i + UPSCALE_VECTOR_LANES <= width; i += UPSCALE_VECTOR_LANES) {
+		upscale_u32v t, b;
+		int k;
+
+		memcpy(&t, top + i, sizeof(t));
+		memcpy(&b, bottom + i, sizeof(b));
+		t = (t * (256 - weight) + b * weight) >> 16;
+		for (k = 0; k < UPSCALE_VECTOR_LANES; k++)
+			out[i + k] = t[k];
+	}
+#endif
+	for (; i < width; i++)
+		out[i] = (top[i] * (256 - weight) + bottom[i] * weight) >> 16;
+}
+
+/* Integer factor upscaling giving the same pixels as pixman's bilinear
+ * filter with PIXMAN_REPEAT_NONE. The weights of a pixel are the product
+ * of its horizontal and vertical weights, so each source row is
+ * interpolated horizontally once and output rows blend two of them. */
+static void upscale(struct fp_img *img, unsigned int w_factor,
+		    unsigned int h_factor, unsigned char *out)
+{
+	int new_width = img->width * w_factor;
+	int new_height = img->height * h_factor;
+	int *x_index = g_malloc(new_width * sizeof(int));
+	int *x_weight = g_malloc(new_width * sizeof(int));
+	int *y_index = g_malloc(new_height * sizeof(int));
+	int *y_weight = g_malloc(new_height * sizeof(int));
+	unsigned char *padded = g_malloc0(img->width + 2);
+	/* interpolated source rows rows[0] and rows[1], -1 for none */
+	guint32 *rows[2], *zero_row;
+	int row_index[2] = { -1, -1 };
+	int y;
+
+	rows[0] = g_malloc(new_width * sizeof(guint32));
+	rows[1] = g_malloc(new_width * sizeof(guint32));
+	zero_row = g_malloc0(new_width * sizeof(guint32));
+
+	upscale_axis(w_factor, new_width, x_index, x_weight);
+	upscale_axis(h_factor, new_height, y_index, y_weight);
+
+	for (y = 0; y < new_height; y++) {
+		int src_y = y_index[y];
+		guint32 *top, *bottom;
+		int k;
+
+		/* source rows only move down, reuse the lower one when the
+		 * sample gets past the upper one */
+		if (row_index[1] == src_y) {
+			guint32 *tmp = rows[0];
+			rows[0] = rows[1];
+			rows[1] = tmp;
+			row_index[0] = row_index[1];
+			row_index[1] = -1;
+		}
+		for (k = 0; k < 2; k++) {
+			int row = src_y + k;
+
+			if (row < 0 || row >= img->height || row_index[k] == row)
+				continue;
+			memcpy(padded + 1, img->data + row * img->width,
+			       img->width);
+			upscale_row(padded, new_width, x_index, x_weight,
+				    rows[k]);
+			row_index[k] = row;
+		}
+
+		top = src_y >= 0 ? rows[0] : zero_row;
+		bottom = src_y + 1 < img->height ? rows[1] : zero_row;
+		upscale_blend(top, bottom, new_width, y_weight[y],
+			      out + y * new_width);
+	}
+
+	g_free(x_index);
+	g_free(x_weight);
+	g_free(y_index);
+	g_free(y_weight);
+	g_free(padded);
+	g_free(rows[0]);
+	g_free(rows[1]);
+	g_free(zero_row);
+}
+
+static gboolean upscale_supported(unsigned int factor)
+{
+	return factor == 2 || factor == 3;
+}
+
 struct fp_img *fpi_im_resize(struct fp_img *img, unsigned int w_factor, unsigned int h_factor)
 {
 	int new_width = img->width * w_factor;
@@ -31,8 +162,19 @@ struct fp_img *fpi_im_resize(struct fp_img *img, unsigned int w_factor, unsigned
 	pixman_transform_t transform;
 	struct fp_img *newimg;
 
+	newimg = fpi_img_new(new_width * new_height);
+	newimg->width = new_width;
+	newimg->height = new_height;
+	newimg->flags = img->flags;
+
+	if (upscale_supported(w_factor) && upscale_supported(h_factor)) {
+		upscale(img, w_factor, h_factor, newimg->data);
+		return newimg;
+	}
+
+	/* pixman renders straight into the new image */
 	orig = pixman_image_create_bits(PIXMAN_a8, img->width, img->height, (uint32_t *)img->data, img->width);
-	resized = pixman_image_create_bits(PIXMAN_a8, new_width, new_height, NULL, new_width);
+	resized = pixman_image_create_bits(PIXMAN_a8, new_width, new_height, (uint32_t *)newimg->data, new_width);
 
 	pixman_transform_init_identity(&transform);
 	pixman_transform_scale(NULL, &transform, pixman_int_to_fixed(w_factor), pixman_int_to_fixed(h_factor));
@@ -48,16 +190,8 @@ struct fp_img *fpi_im_resize(struct fp_img *img, unsigned int w_factor, unsigned
 		new_width, new_height /* width height */
 		);
 
-	newimg = fpi_img_new(new_width * new_height);
-	newimg->width = new_width;
-	newimg->height = new_height;
-	newimg->flags = img->flags;
-
-	memcpy(newimg->data, pixman_image_get_data(resized), new_width * new_height);
-
 	pixman_image_unref(orig);
 	pixman_image_unref(resized);
 
 	return newimg;
 }
-
@@ -21,8 +21,19 @@
 
 #include <config.h>
 #include <errno.h>
+#include <stdlib.h>
 #include <time.h>
+#include <unistd.h>
 #include <sys/time.h>
+#ifdef HAVE_PTHREAD_SETSCHEDPARAM
+#include <sched.h>
+#endif
+#ifdef HAVE_EPOLL
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#endif
 
 #include <glib.h>
 #include <libusb.h>
@@ -55,145 +66,448 @@
  * fp_handle_events_timeout() instead. If you wish to do a non-blocking
  * iteration, call fp_handle_events_timeout() with a zero timeout.
  *
+ * Applications with their own main loop can instead watch the single file
+ * descriptor returned by fp_get_event_fd(), and call fp_handle_event_fd()
+ * whenever it is readable. Or they can let libfprint handle its events on
+ * a thread of its own, see fp_event_thread_start().
+ *
+ * libfprint can be used from several threads. Different devices can be
+ * used concurrently from different threads. The calls made on one device,
+ * and the callbacks of its asynchronous operations, must not run at the
+ * same time: use a device from a single thread, from the callbacks of its
+ * own operations, or through fp_event_thread_post(). Events can be handled
+ * from any thread, and the library timeouts and the file descriptor
+ * notifiers are synchronised internally; the notifiers can be called from
+ * whichever thread opens or closes a device. fp_init() and fp_exit() must
+ * not run concurrently with any other call. fp_event_thread_post() and the
+ * check of the message verbosity made for every message take no lock.
+ *
  * FIXME: document how application is supposed to know when to call these
  * functions.
  */
 
-/* this is a singly-linked list of pending timers, sorted with the timer that
- * is expiring soonest at the head. */
-static GSList *active_timers = NULL;
+/* this is a binary min-heap of pending timers, the timer that is expiring
+ * soonest at index 0. each timer stores its position, plus one, so that it
+ * can be removed without searching. the heap, timer_seq, dispatching and the
+ * arming of timer_fd are protected by timers_lock, which is never held while
+ * a callback runs. */
+static GMutex timers_lock;
+static GPtrArray *active_timers = NULL;
+
+/* orders timers of the same expiry by the time they were added */
+static guint64 timer_seq = 0;
 
-/* notifiers for added or removed poll fds */
+/* notifiers for added or removed poll fds, called by libusb from whichever
+ * thread opens or closes a device. they and the creation of event_fd are
+ * protected by pollfd_lock, the notifiers are called without it. */
+static GMutex pollfd_lock;
 static fp_pollfd_added_cb fd_added_cb = NULL;
 static fp_pollfd_removed_cb fd_removed_cb = NULL;
 
-struct fpi_timeout {
-	struct timeval expiry;
-	fpi_timeout_fn callback;
-	void *data;
-};
+/* the epoll fd of fp_get_event_fd(), watching the libusb fds and timer_fd,
+ * which expires with the first timer of the heap */
+static int event_fd = -1;
+static int timer_fd = -1;
+
+/* nesting of fp_handle_event_fd(), which arms timer_fd once done */
+static int dispatching = 0;
 
-static int timeout_sort_fn(gconstpointer _a, gconstpointer _b)
+static void update_timer_fd(void);
+
+static gboolean timeout_before(struct fpi_timeout *a, struct fpi_timeout *b)
 {
-	struct fpi_timeout *a = (struct fpi_timeout *) _a;
-	struct fpi_timeout *b = (struct fpi_timeout *) _b;
-	struct timeval *tv_a = &a->expiry;
-	struct timeval *tv_b = &b->expiry;
+	if (a->expiry != b->expiry)
+		return a->expiry < b->expiry;
+	return a->seq < b->seq;
+}
 
-	if (timercmp(tv_a, tv_b, <))
-		return -1;
-	else if (timercmp(tv_a, tv_b, >))
-		return 1;
-	else
-		return 0;
+static void heap_set(guint i, struct fpi_timeout *timeout)
+{
+	g_ptr_array_index(active_timers, i) = timeout;
+	timeout->heap_pos = i + 1;
 }
 
-/* A timeout is the asynchronous equivalent of sleeping. You create a timeout
- * saying that you'd like to have a function invoked at a certain time in
- * the future. */
-struct fpi_timeout *fpi_timeout_add(unsigned int msec, fpi_timeout_fn callback,
-	void *data)
+static void heap_sift_up(guint i, struct fpi_timeout *timeout)
+{
+	while (i > 0) {
+		guint parent = (i - 1) / 2;
+		struct fpi_timeout *p = g_ptr_array_index(active_timers, parent);
+
+		if (!timeout_before(timeout, p))
+			break;
+		heap_set(i, p);
+		i = parent;
+	}
+	heap_set(i, timeout);
+}
+
+static void heap_sift_down(guint i, struct fpi_timeout *timeout)
+{
+	guint len = active_timers->len;
+
+	while (2 * i + 1 < len) {
+		guint child = 2 * i + 1;
+		struct fpi_timeout *c = g_ptr_array_index(active_timers, child);
+
+		if (child + 1 < len) {
+			struct fpi_timeout *r = g_ptr_array_index(active_timers,
+				child + 1);
+			if (timeout_before(r, c)) {
+				child++;
+				c = r;
+			}
+		}
+		if (!timeout_before(c, timeout))
+			break;
+		heap_set(i, c);
+		i = child;
+	}
+	heap_set(i, timeout);
+}
+
+static void heap_remove(struct fpi_timeout *timeout)
+{
+	guint i = timeout->heap_pos - 1;
+	struct fpi_timeout *last;
+
+	last = g_ptr_array_remove_index(active_timers, active_timers->len - 1);
+	timeout->heap_pos = 0;
+	if (last != timeout) {
+		/* move the last timer into the hole, then restore the heap
+		 * order */
+		if (i > 0 && timeout_before(last,
+				g_ptr_array_index(active_timers, (i - 1) / 2)))
+			heap_sift_up(i, last);
+		else
+			heap_sift_down(i, last);
+	}
+
+	if (i == 0)
+		update_timer_fd();
+}
+
+/* arm timer_fd for the first timer, if fp_get_event_fd() created it */
+static void update_timer_fd(void)
+{
+#ifdef HAVE_EPOLL
+	struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+
+	if (timer_fd < 0 || dispatching)
+		return;
+
+	if (active_timers && active_timers->len > 0) {
+		struct fpi_timeout *next = g_ptr_array_index(active_timers, 0);
+
+		its.it_value.tv_sec = next->expiry / G_USEC_PER_SEC;
+		its.it_value.tv_nsec = (next->expiry % G_USEC_PER_SEC) * 1000;
+		/* a zero expiry would disarm the timer */
+		if (!its.it_value.tv_sec && !its.it_value.tv_nsec)
+			its.it_value.tv_nsec = 1;
+	}
+
+	if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+		fp_err("failed to arm timer fd, errno=%d", errno);
+#endif
+}
+
+/* read the monotonic clock, in microseconds */
+static int get_monotonic_time(guint64 *now)
 {
 	struct timespec ts;
-	struct timeval add_msec;
-	struct fpi_timeout *timeout;
 	int r;
 
-	fp_dbg("in %dms", msec);
-
 	r = clock_gettime(CLOCK_MONOTONIC, &ts);
 	if (r < 0) {
 		fp_err("failed to read monotonic clock, errno=%d", errno);
-		return NULL;
+		return r;
 	}
 
-	timeout = g_malloc(sizeof(*timeout));
+	*now = (guint64) ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+	return 0;
+}
+
+/* Arms a timer embedded in a driver structure, which does not need to be
+ * allocated. A timer still pending is moved to the new expiry. It stays owned
+ * by the caller; fpi_timeout_pending() tells whether it is still to expire.
+ * Timers can be started and cancelled from any thread, but a timer cancelled
+ * while another thread is about to run its callback still fires: drivers
+ * cancel their timers from the thread handling events, or while none of
+ * their timers can expire. An allocated timer cancelled then is freed by
+ * the dispatcher once its callback returned, never twice.
+ * Returns 0 on success, negative on error. */
+int fpi_timeout_start(struct fpi_timeout *timeout, unsigned int msec,
+	fpi_timeout_fn callback, void *data)
+{
+	guint64 now;
+	int r;
+
+	fp_dbg("in %dms", msec);
+
+	r = get_monotonic_time(&now);
+	if (r < 0)
+		return r;
+
+	g_mutex_lock(&timers_lock);
+	if (!active_timers)
+		active_timers = g_ptr_array_new();
+	else if (fpi_timeout_pending(timeout))
+		heap_remove(timeout);
+
+	/* calculate timeout expiry by adding delay to current monotonic clock */
+	timeout->expiry = now + (guint64) msec * 1000;
+	timeout->seq = timer_seq++;
 	timeout->callback = callback;
 	timeout->data = data;
-	TIMESPEC_TO_TIMEVAL(&timeout->expiry, &ts);
 
-	/* calculate timeout expiry by adding delay to current monotonic clock */
-	timerclear(&add_msec);
-	add_msec.tv_sec = msec / 1000;
-	add_msec.tv_usec = (msec % 1000) * 1000;
-	timeradd(&timeout->expiry, &add_msec, &timeout->expiry);
+	g_ptr_array_add(active_timers, NULL);
+	heap_sift_up(active_timers->len - 1, timeout);
+	if (timeout->heap_pos == 1)
+		update_timer_fd();
+	g_mutex_unlock(&timers_lock);
 
-	active_timers = g_slist_insert_sorted(active_timers, timeout,
-		timeout_sort_fn);
+	return 0;
+}
+
+/* A timeout is the asynchronous equivalent of sleeping. You create a timeout
+ * saying that you'd like to have a function invoked at a certain time in
+ * the future. */
+struct fpi_timeout *fpi_timeout_add(unsigned int msec, fpi_timeout_fn callback,
+	void *data)
+{
+	struct fpi_timeout *timeout = g_malloc0(sizeof(*timeout));
+
+	/* set before the timer is on the heap, where it can fire at once */
+	timeout->allocated = TRUE;
+	if (fpi_timeout_start(timeout, msec, callback, data) < 0) {
+		g_free(timeout);
+		return NULL;
+	}
 
 	return timeout;
 }
 
+/* Cancels a pending timer. An allocated timer is freed here only if it was
+ * still pending; one already claimed by the dispatcher is freed there once
+ * its callback returned. */
 void fpi_timeout_cancel(struct fpi_timeout *timeout)
 {
+	gboolean removed = FALSE;
+
 	fp_dbg("");
-	active_timers = g_slist_remove(active_timers, timeout);
-	g_free(timeout);
+	g_mutex_lock(&timers_lock);
+	if (fpi_timeout_pending(timeout)) {
+		heap_remove(timeout);
+		removed = !timeout->claimed;
+	}
+	g_mutex_unlock(&timers_lock);
+	if (removed && timeout->allocated)
+		g_free(timeout);
 }
 
-/* get the expiry time and optionally the timeout structure for the next
- * timeout. returns 0 if there are no expired timers, or 1 if the
- * timeval/timeout output parameters were populated. if the returned timeval
- * is zero then it means the timeout has already expired and should be handled
- * ASAP. */
-static int get_next_timeout_expiry(struct timeval *out,
-	struct fpi_timeout **out_timeout)
+/* Polls keep their shortest interval this long after the last activity */
+#define POLL_BACKOFF_GRACE_MS	5000
+
+/* Sets up the polling of a device between min_ms and max_ms, starting at
+ * the fast end. max_ms bounds how late a finger is noticed after a long
+ * idle time. */
+void fpi_poll_backoff_init(struct fpi_poll_backoff *backoff,
+	unsigned int min_ms, unsigned int max_ms)
 {
-	struct timespec ts;
-	struct timeval tv;
-	struct fpi_timeout *next_timeout;
-	int r;
+	backoff->min_ms = MAX(min_ms, 1);
+	backoff->max_ms = MAX(max_ms, backoff->min_ms);
+	fpi_poll_backoff_activity(backoff);
+}
 
-	if (active_timers == NULL)
-		return 0;
+/* Tells that something happened on the device, a finger, an activation, so
+ * that it is polled quickly again */
+void fpi_poll_backoff_activity(struct fpi_poll_backoff *backoff)
+{
+	if (get_monotonic_time(&backoff->last_activity) < 0)
+		backoff->last_activity = 0;
+	backoff->interval = backoff->min_ms;
+}
 
-	r = clock_gettime(CLOCK_MONOTONIC, &ts);
-	if (r < 0) {
-		fp_err("failed to read monotonic clock, errno=%d", errno);
+/* Returns the milliseconds to wait before the next poll of an idle device:
+ * min_ms during the first seconds after the last activity, then twice the
+ * previous interval on each poll, up to max_ms. Readers left waiting for
+ * hours are then only polled a few times a second instead of tens. */
+unsigned int fpi_poll_backoff_next(struct fpi_poll_backoff *backoff)
+{
+	guint64 now;
+
+	if (get_monotonic_time(&now) < 0 ||
+	    now < backoff->last_activity + POLL_BACKOFF_GRACE_MS * 1000)
+		return backoff->min_ms;
+
+	backoff->interval = MIN(backoff->interval * 2, backoff->max_ms);
+	return backoff->interval;
+}
+
+/* Arms timeout for the next poll, as fpi_timeout_start() would */
+int fpi_poll_backoff_start(struct fpi_poll_backoff *backoff,
+	struct fpi_timeout *timeout, fpi_timeout_fn callback, void *data)
+{
+	return fpi_timeout_start(timeout, fpi_poll_backoff_next(backoff),
+		callback, data);
+}
+
+/* get the expiry time of the next timeout. returns 0 if there are no
+ * pending timers, or 1 if the timeval output parameter was populated. if the
+ * returned timeval is zero then it means the timeout has already expired and
+ * should be handled ASAP. */
+static int get_next_timeout_expiry(struct timeval *out)
+{
+	guint64 now, expiry;
+	int r;
+
+	r = get_monotonic_time(&now);
+	if (r < 0)
 		return r;
-	}
-	TIMESPEC_TO_TIMEVAL(&tv, &ts);
 
-	next_timeout = active_timers->data;
-	if (out_timeout)
-		*out_timeout = next_timeout;
+	g_mutex_lock(&timers_lock);
+	if (active_timers == NULL || active_timers->len == 0) {
+		g_mutex_unlock(&timers_lock);
+		return 0;
+	}
+	expiry = ((struct fpi_timeout *)
+		g_ptr_array_index(active_timers, 0))->expiry;
+	g_mutex_unlock(&timers_lock);
 
-	if (timercmp(&tv, &next_timeout->expiry, >=)) {
+	if (now >= expiry) {
 		fp_dbg("first timeout already expired");
 		timerclear(out);
 	} else {
-		timersub(&next_timeout->expiry, &tv, out);
+		guint64 left = expiry - now;
+
+		out->tv_sec = left / G_USEC_PER_SEC;
+		out->tv_usec = left % G_USEC_PER_SEC;
 		fp_dbg("next timeout in %d.%06ds", out->tv_sec, out->tv_usec);
 	}
 
 	return 1;
 }
 
-/* handle a timeout that has expired */
-static void handle_timeout(struct fpi_timeout *timeout)
+/* handle the first timeout if it expired by now and was started before
+ * seq_limit. it leaves the heap before its callback runs, so that the
+ * callback can start an embedded timer again. returns whether it ran one. */
+static gboolean handle_timeout(guint64 now, guint64 seq_limit)
 {
+	struct fpi_timeout *timeout;
+	fpi_timeout_fn callback;
+	void *data;
+	gboolean allocated;
+	int scope;
+
+	g_mutex_lock(&timers_lock);
+	if (!active_timers || active_timers->len == 0) {
+		g_mutex_unlock(&timers_lock);
+		return FALSE;
+	}
+	timeout = g_ptr_array_index(active_timers, 0);
+	if (timeout->expiry > now || timeout->seq >= seq_limit) {
+		g_mutex_unlock(&timers_lock);
+		return FALSE;
+	}
+	heap_remove(timeout);
+	/* an embedded timer may be freed or started again by its callback */
+	callback = timeout->callback;
+	data = timeout->data;
+	allocated = timeout->allocated;
+	/* from now on, a cancel leaves freeing it to us */
+	timeout->claimed = allocated;
+	g_mutex_unlock(&timers_lock);
+
 	fp_dbg("");
-	timeout->callback(timeout->data);
-	active_timers = g_slist_remove(active_timers, timeout);
-	g_free(timeout);
+	fpi_trace(timeout_fire, timeout, callback);
+	scope = fpi_alloc_scope_push(FP_ALLOC_DRIVER);
+	callback(data);
+	fpi_alloc_scope_pop(scope);
+	if (allocated) {
+		/* unless the callback started it again */
+		g_mutex_lock(&timers_lock);
+		timeout->claimed = FALSE;
+		allocated = !fpi_timeout_pending(timeout);
+		g_mutex_unlock(&timers_lock);
+		if (allocated)
+			g_free(timeout);
+	}
+	return TRUE;
 }
 
 static int handle_timeouts(void)
 {
-	struct timeval next_timeout_expiry;
-	struct fpi_timeout *next_timeout;
+	guint64 now;
 	int r;
 
-	r = get_next_timeout_expiry(&next_timeout_expiry, &next_timeout);
-	if (r <= 0)
+	r = get_monotonic_time(&now);
+	if (r < 0)
 		return r;
 
-	if (!timerisset(&next_timeout_expiry))
-		handle_timeout(next_timeout);
-
+	handle_timeout(now, G_MAXUINT64);
 	return 0;
 }
 
+/* a function posted to the thread handling events, see
+ * fp_event_thread_post() and fpi_poll_defer() */
+struct event_command {
+	struct event_command *next;
+	void (*func)(void *data);
+	void *data;
+};
+
+static GThread *event_thread = NULL;
+#ifdef HAVE_EPOLL
+static gint event_thread_stopping = 0;
+static int wake_fd = -1;
+#endif
+
+/* SCHED_FIFO priority of the event thread, 0 for the normal policy */
+static gint event_thread_priority = 0;
+
+/* lock-free stack of posted commands; the thread handling events takes all
+ * of them at once, so there is no ABA problem, and runs them in posting
+ * order */
+static struct event_command *posted_commands = NULL;
+
+static void post_command(void (*func)(void *data), void *data)
+{
+	struct event_command *cmd = g_malloc(sizeof(*cmd));
+
+	cmd->func = func;
+	cmd->data = data;
+	do
+		cmd->next = g_atomic_pointer_get(&posted_commands);
+	while (!g_atomic_pointer_compare_and_exchange(&posted_commands,
+		cmd->next, cmd));
+}
+
+static void run_posted_commands(void)
+{
+	struct event_command *cmds, *fifo = NULL;
+	int scope;
+
+	do
+		cmds = g_atomic_pointer_get(&posted_commands);
+	while (!g_atomic_pointer_compare_and_exchange(&posted_commands, cmds,
+		NULL));
+
+	while (cmds) {
+		struct event_command *next = cmds->next;
+		cmds->next = fifo;
+		fifo = cmds;
+		cmds = next;
+	}
+
+	scope = fpi_alloc_scope_push(FP_ALLOC_DRIVER);
+	while (fifo) {
+		struct event_command *next = fifo->next;
+		fifo->func(fifo->data);
+		g_free(fifo);
+		fifo = next;
+	}
+	fpi_alloc_scope_pop(scope);
+}
+
 /**
  * fp_handle_events_timeout:
  * @timeout: Maximum timeout for this blocking function
@@ -209,19 +523,17 @@ API_EXPORTED int fp_handle_events_timeout(struct timeval *timeout)
 {
 	struct timeval next_timeout_expiry;
 	struct timeval select_timeout;
-	struct fpi_timeout *next_timeout;
+	int scope;
 	int r;
 
-	r = get_next_timeout_expiry(&next_timeout_expiry, &next_timeout);
+	r = get_next_timeout_expiry(&next_timeout_expiry);
 	if (r < 0)
 		return r;
 
 	if (r) {
 		/* timer already expired? */
-		if (!timerisset(&next_timeout_expiry)) {
-			handle_timeout(next_timeout);
-			return 0;
-		}
+		if (!timerisset(&next_timeout_expiry))
+			return handle_timeouts();
 
 		/* choose the smallest of next URB timeout or user specified timeout */
 		if (timercmp(&next_timeout_expiry, timeout, <))
@@ -232,11 +544,15 @@ API_EXPORTED int fp_handle_events_timeout(struct timeval *timeout)
 		select_timeout = *timeout;
 	}
 
+	/* the transfer callbacks are driver code */
+	scope = fpi_alloc_scope_push(FP_ALLOC_DRIVER);
 	r = libusb_handle_events_timeout(fpi_usb_ctx, &select_timeout);
+	fpi_alloc_scope_pop(scope);
 	*timeout = select_timeout;
 	if (r < 0)
 		return r;
 
+	run_posted_commands();
 	return handle_timeouts();
 }
 
@@ -272,7 +588,7 @@ API_EXPORTED int fp_get_next_timeout(struct timeval *tv)
 	int r_fprint;
 	int r_libusb;
 
-	r_fprint = get_next_timeout_expiry(&fprint_timeout, NULL);
+	r_fprint = get_next_timeout_expiry(&fprint_timeout);
 	r_libusb = libusb_get_next_timeout(fpi_usb_ctx, &libusb_timeout);
 
 	/* if we have no pending timeouts and the same is true for libusb,
@@ -347,20 +663,443 @@ API_EXPORTED size_t fp_get_pollfds(struct fp_pollfd **pollfds)
 API_EXPORTED void fp_set_pollfd_notifiers(fp_pollfd_added_cb added_cb,
 	fp_pollfd_removed_cb removed_cb)
 {
+	g_mutex_lock(&pollfd_lock);
 	fd_added_cb = added_cb;
 	fd_removed_cb = removed_cb;
+	g_mutex_unlock(&pollfd_lock);
+}
+
+/* add a libusb fd to the set watched by event_fd, with pollfd_lock held */
+static void event_fd_watch(int fd, short events)
+{
+#ifdef HAVE_EPOLL
+	struct epoll_event ev;
+
+	if (event_fd < 0)
+		return;
+
+	ev.events = ((events & POLLIN) ? EPOLLIN : 0) |
+		((events & POLLOUT) ? EPOLLOUT : 0);
+	ev.data.fd = fd;
+	if (epoll_ctl(event_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		fp_err("failed to watch fd %d, errno=%d", fd, errno);
+#endif
+}
+
+static void event_fd_unwatch(int fd)
+{
+#ifdef HAVE_EPOLL
+	if (event_fd >= 0)
+		epoll_ctl(event_fd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+}
+
+/* with pollfd_lock held */
+static void event_fd_close(void)
+{
+	g_mutex_lock(&timers_lock);
+	if (timer_fd >= 0)
+		close(timer_fd);
+	timer_fd = -1;
+	g_mutex_unlock(&timers_lock);
+	if (event_fd >= 0)
+		close(event_fd);
+	event_fd = -1;
+}
+
+/**
+ * fp_get_event_fd:
+ *
+ * Retrieve a single file descriptor which becomes readable whenever
+ * libfprint has events to handle, for applications integrating libfprint
+ * into their own main loop. It replaces fp_get_pollfds(),
+ * fp_set_pollfd_notifiers() and fp_get_next_timeout(): the descriptor
+ * follows the USB file descriptors as they come and go, and the library
+ * timeouts as they are added. When it is readable, call
+ * fp_handle_event_fd().
+ *
+ * The descriptor belongs to libfprint and stays valid until fp_exit().
+ *
+ * Returns: the file descriptor, -ENOTSUP if the platform or libusb do not
+ * allow it, or another negative error code.
+ */
+API_EXPORTED int fp_get_event_fd(void)
+{
+#ifdef HAVE_EPOLL
+	const struct libusb_pollfd **usbfds;
+	struct epoll_event ev;
+	size_t i;
+	int r, tfd = -1;
+
+	g_mutex_lock(&pollfd_lock);
+	if (event_fd >= 0)
+		goto out;
+
+	/* libusb timeouts would need to be polled for */
+	if (!libusb_pollfds_handle_timeouts(fpi_usb_ctx)) {
+		g_mutex_unlock(&pollfd_lock);
+		return -ENOTSUP;
+	}
+
+	event_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (event_fd < 0)
+		goto err;
+
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (tfd < 0)
+		goto err;
+
+	ev.events = EPOLLIN;
+	ev.data.fd = tfd;
+	if (epoll_ctl(event_fd, EPOLL_CTL_ADD, tfd, &ev) < 0)
+		goto err;
+
+	usbfds = libusb_get_pollfds(fpi_usb_ctx);
+	if (!usbfds) {
+		close(tfd);
+		event_fd_close();
+		g_mutex_unlock(&pollfd_lock);
+		return -EIO;
+	}
+	for (i = 0; usbfds[i] != NULL; i++)
+		event_fd_watch(usbfds[i]->fd, usbfds[i]->events);
+	free(usbfds);
+
+	g_mutex_lock(&timers_lock);
+	timer_fd = tfd;
+	update_timer_fd();
+	g_mutex_unlock(&timers_lock);
+
+out:
+	r = event_fd;
+	g_mutex_unlock(&pollfd_lock);
+	return r;
+
+err:
+	r = -errno;
+	fp_err("failed to create event fd, errno=%d", errno);
+	if (tfd >= 0)
+		close(tfd);
+	event_fd_close();
+	g_mutex_unlock(&pollfd_lock);
+	return r;
+#else
+	return -ENOTSUP;
+#endif
+}
+
+/**
+ * fp_handle_event_fd:
+ *
+ * Handle the events pending when the file descriptor of fp_get_event_fd() is
+ * readable: the completed USB transfers and all the expired timeouts. This
+ * function never blocks.
+ *
+ * Returns: 0 on success, non-zero on error.
+ */
+API_EXPORTED int fp_handle_event_fd(void)
+{
+	struct timeval zero_tv = { 0, 0 };
+	guint64 now;
+	guint64 seq_limit;
+	int scope;
+	int r;
+
+	g_mutex_lock(&timers_lock);
+	seq_limit = timer_seq;
+	g_mutex_unlock(&timers_lock);
+
+#ifdef HAVE_EPOLL
+	if (timer_fd >= 0) {
+		uint64_t expirations;
+
+		/* only acknowledges the expiry, the timers are checked below */
+		if (read(timer_fd, &expirations, sizeof(expirations)) < 0 &&
+		    errno != EAGAIN)
+			fp_dbg("failed to read timer fd, errno=%d", errno);
+	}
+#endif
+
+	scope = fpi_alloc_scope_push(FP_ALLOC_DRIVER);
+	r = libusb_handle_events_timeout(fpi_usb_ctx, &zero_tv);
+	fpi_alloc_scope_pop(scope);
+	if (r < 0)
+		return r;
+
+	run_posted_commands();
+	r = get_monotonic_time(&now);
+	if (r < 0)
+		return r;
+
+	/* timers added by the callbacks wait for the next round */
+	g_mutex_lock(&timers_lock);
+	dispatching++;
+	g_mutex_unlock(&timers_lock);
+	while (handle_timeout(now, seq_limit))
+		;
+	g_mutex_lock(&timers_lock);
+	dispatching--;
+	update_timer_fd();
+	g_mutex_unlock(&timers_lock);
+	return 0;
+}
+
+#ifdef HAVE_EPOLL
+static gpointer event_thread_func(gpointer user_data)
+{
+	int fd = GPOINTER_TO_INT(user_data);
+	int priority = g_atomic_int_get(&event_thread_priority);
+
+	if (priority && fpi_set_thread_realtime(priority) < 0)
+		fp_warn("could not run the event thread at real-time priority "
+			"%d", priority);
+
+	while (!g_atomic_int_get(&event_thread_stopping)) {
+		struct pollfd fds[2] = {
+			{ .fd = fd, .events = POLLIN },
+			{ .fd = wake_fd, .events = POLLIN },
+		};
+		uint64_t count;
+
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			fp_err("poll failed, errno=%d", errno);
+			break;
+		}
+
+		if (fds[1].revents & POLLIN) {
+			if (read(wake_fd, &count, sizeof(count)) < 0 &&
+			    errno != EAGAIN)
+				fp_dbg("failed to read wake fd, errno=%d", errno);
+			run_posted_commands();
+		}
+		if (fds[0].revents & POLLIN)
+			fp_handle_event_fd();
+	}
+
+	/* nothing posted before fp_event_thread_stop() is lost */
+	run_posted_commands();
+	return NULL;
+}
+#endif
+
+/**
+ * fp_event_thread_start:
+ *
+ * Start a thread, owned by libfprint, which handles all the library events
+ * so that the application does not need to call fp_handle_events() or to
+ * watch fp_get_event_fd().
+ *
+ * Once it runs, libfprint must only be called from that thread: post the
+ * calls with fp_event_thread_post(), from any thread. The callbacks of the
+ * asynchronous functions are invoked on the event thread too, and can post
+ * their results to the application's own threads or main loop. The
+ * synchronous functions, such as fp_verify_finger(), can still be called
+ * from other threads, one at a time for each device: they post their calls
+ * to the event thread, and sleep until it completes them.
+ *
+ * Returns: 0 on success, -ENOTSUP if the platform does not allow it, or
+ * another negative error code.
+ */
+API_EXPORTED int fp_event_thread_start(void)
+{
+#ifdef HAVE_EPOLL
+	int fd;
+
+	if (event_thread)
+		return 0;
+
+	fd = fp_get_event_fd();
+	if (fd < 0)
+		return fd;
+
+	wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wake_fd < 0) {
+		fp_err("failed to create wake fd, errno=%d", errno);
+		return -errno;
+	}
+
+	g_atomic_int_set(&event_thread_stopping, 0);
+	event_thread = g_thread_try_new("fp-events", event_thread_func,
+		GINT_TO_POINTER(fd), NULL);
+	if (!event_thread) {
+		close(wake_fd);
+		wake_fd = -1;
+		return -EAGAIN;
+	}
+
+	return 0;
+#else
+	return -ENOTSUP;
+#endif
+}
+
+/**
+ * fp_event_thread_set_realtime:
+ * @priority: the SCHED_FIFO priority of the event thread, or 0 for the
+ * normal scheduling policy
+ *
+ * Have the thread started by fp_event_thread_start() run with a real-time
+ * scheduling policy, so that it handles USB transfers without being
+ * preempted by the rest of the system. Line sensors which stream rows
+ * during a swipe, such as the ones of upeksonly and vfs5011, lose rows
+ * when it is held up.
+ *
+ * The images of the devices opened from then on are then also kept in
+ * memory locked with mlock(), touched before their first use so that
+ * capturing does not fault pages in. Extraction and matching always run on
+ * worker threads, which go back to the normal policy.
+ *
+ * Call this before fp_event_thread_start() and before opening devices.
+ * Real-time scheduling usually needs privileges, or an RLIMIT_RTPRIO
+ * limit of at least @priority: if the thread can not get it, it runs with
+ * the normal policy and a warning is logged.
+ *
+ * Returns: 0 on success, -EBUSY if the event thread is already running,
+ * -EINVAL if @priority is out of the SCHED_FIFO range, or -ENOTSUP if the
+ * platform does not allow it.
+ */
+API_EXPORTED int fp_event_thread_set_realtime(int priority)
+{
+#if defined(HAVE_EPOLL) && defined(HAVE_PTHREAD_SETSCHEDPARAM)
+	if (event_thread)
+		return -EBUSY;
+	if (priority != 0 && (priority < sched_get_priority_min(SCHED_FIFO) ||
+			      priority > sched_get_priority_max(SCHED_FIFO)))
+		return -EINVAL;
+
+	g_atomic_int_set(&event_thread_priority, priority);
+	return 0;
+#else
+	return -ENOTSUP;
+#endif
+}
+
+int fpi_get_event_thread_priority(void)
+{
+	return g_atomic_int_get(&event_thread_priority);
+}
+
+static void wake_event_thread(void)
+{
+#ifdef HAVE_EPOLL
+	uint64_t one = 1;
+
+	if (write(wake_fd, &one, sizeof(one)) < 0)
+		fp_err("failed to wake event thread, errno=%d", errno);
+#endif
+}
+
+/**
+ * fp_event_thread_post:
+ * @func: the function to call
+ * @data: the argument of @func
+ *
+ * Have @func called with @data on the event thread started by
+ * fp_event_thread_start(). Functions are called in the order they were
+ * posted. This function can be called from any thread, and does not take
+ * any lock.
+ *
+ * Returns: 0 on success, -ESRCH if the event thread is not running.
+ */
+API_EXPORTED int fp_event_thread_post(void (*func)(void *data), void *data)
+{
+	if (!event_thread)
+		return -ESRCH;
+
+	post_command(func, data);
+	wake_event_thread();
+	return 0;
+}
+
+/* Whether fpi_poll_defer() can wake up the thread handling events. libusb
+ * can be interrupted from any thread since 1.0.21, before that only the
+ * event thread can be woken up. */
+gboolean fpi_poll_can_defer(void)
+{
+#ifdef HAVE_LIBUSB_INTERRUPT_EVENT_HANDLER
+	return TRUE;
+#else
+	return event_thread != NULL;
+#endif
+}
+
+/* Whether an event thread handles the events, and it is not the calling
+ * thread. The synchronous functions then leave the events to it, and post
+ * their calls to the asynchronous API. */
+gboolean fpi_poll_event_thread_elsewhere(void)
+{
+	return event_thread != NULL && g_thread_self() != event_thread;
+}
+
+/* Have func called with data once the events being handled are done, from
+ * the thread handling them, such as from a libusb callback. Unlike
+ * fpi_poll_defer(), nothing needs to be woken up. */
+void fpi_poll_post(void (*func)(void *data), void *data)
+{
+	post_command(func, data);
+}
+
+/* Have func called with data by the thread handling events, as soon as it
+ * finished handling the current events. Can be called from any thread, if
+ * fpi_poll_can_defer() allows it. */
+void fpi_poll_defer(void (*func)(void *data), void *data)
+{
+	post_command(func, data);
+#ifdef HAVE_LIBUSB_INTERRUPT_EVENT_HANDLER
+	/* also wakes up the event thread, through the libusb event fd */
+	libusb_interrupt_event_handler(fpi_usb_ctx);
+#else
+	wake_event_thread();
+#endif
+}
+
+/**
+ * fp_event_thread_stop:
+ *
+ * Stop the thread started by fp_event_thread_start(), after it ran the
+ * functions already posted with fp_event_thread_post(). It must not be
+ * called from the event thread itself. fp_exit() stops the thread too.
+ */
+API_EXPORTED void fp_event_thread_stop(void)
+{
+#ifdef HAVE_EPOLL
+	if (!event_thread)
+		return;
+
+	g_atomic_int_set(&event_thread_stopping, 1);
+	wake_event_thread();
+	g_thread_join(event_thread);
+	event_thread = NULL;
+
+	close(wake_fd);
+	wake_fd = -1;
+#endif
 }
 
 static void add_pollfd(int fd, short events, void *user_data)
 {
-	if (fd_added_cb)
-		fd_added_cb(fd, events);
+	fp_pollfd_added_cb cb;
+
+	g_mutex_lock(&pollfd_lock);
+	event_fd_watch(fd, events);
+	cb = fd_added_cb;
+	g_mutex_unlock(&pollfd_lock);
+	if (cb)
+		cb(fd, events);
 }
 
 static void remove_pollfd(int fd, void *user_data)
 {
-	if (fd_removed_cb)
-		fd_removed_cb(fd);
+	fp_pollfd_removed_cb cb;
+
+	g_mutex_lock(&pollfd_lock);
+	event_fd_unwatch(fd);
+	cb = fd_removed_cb;
+	g_mutex_unlock(&pollfd_lock);
+	if (cb)
+		cb(fd);
 }
 
 void fpi_poll_init(void)
@@ -370,10 +1109,29 @@ void fpi_poll_init(void)
 
 void fpi_poll_exit(void)
 {
-	g_slist_free(active_timers);
-	active_timers = NULL;
+	/* deferred calls only release what they were given by now */
+	run_posted_commands();
+	g_mutex_lock(&timers_lock);
+	if (active_timers) {
+		guint i;
+
+		for (i = 0; i < active_timers->len; i++) {
+			struct fpi_timeout *timeout =
+				g_ptr_array_index(active_timers, i);
+
+			timeout->heap_pos = 0;
+			if (timeout->allocated)
+				g_free(timeout);
+		}
+		g_ptr_array_free(active_timers, TRUE);
+		active_timers = NULL;
+	}
+	g_mutex_unlock(&timers_lock);
+	g_mutex_lock(&pollfd_lock);
+	event_fd_close();
 	fd_added_cb = NULL;
 	fd_removed_cb = NULL;
+	g_mutex_unlock(&pollfd_lock);
 	libusb_set_pollfd_notifiers(fpi_usb_ctx, NULL, NULL, NULL);
 }
 
@@ -0,0 +1,101 @@
+/*
+ * Coarse pre-matching of identification candidates
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* A direction descriptor summarises an NBIS sample by a histogram of its
+ * minutia pairs, binned by the distance between the two minutiae and the
+ * difference between their directions. Neither changes when the finger is
+ * moved or rotated on the sensor, and the histogram is small and quick to
+ * compare, so it can rule out candidates which share too little of the
+ * probe's ridge structure long before the full matcher would. */
+
+#include <math.h>
+#include <stdlib.h>
+
+#include <glib.h>
+
+#include "fp_internal.h"
+#include "nbis/include/bozorth.h"
+
+/* Pairs further apart than the matcher links minutiae are left out, see
+ * DM in bozorth.h */
+#define PREMATCH_DIST_BUCKETS	5
+#define PREMATCH_DIST_STEP	((DM + PREMATCH_DIST_BUCKETS - 1) / \
+	PREMATCH_DIST_BUCKETS)
+#define PREMATCH_ANGLE_BUCKETS	12
+#define PREMATCH_ANGLE_STEP	(180 / PREMATCH_ANGLE_BUCKETS)
+#define PREMATCH_BINS		(PREMATCH_DIST_BUCKETS * PREMATCH_ANGLE_BUCKETS)
+
+struct fpi_prematch_desc {
+	guint32 nr_pairs;
+	guint16 bins[PREMATCH_BINS];
+};
+
+/* Builds the descriptor of a sample from its minutiae. */
+struct fpi_prematch_desc *fpi_prematch_desc_new(const struct xyt_struct *xyt)
+{
+	struct fpi_prematch_desc *desc = g_malloc0(sizeof(*desc));
+	int i, j;
+
+	for (i = 0; i < xyt->nrows; i++) {
+		for (j = i + 1; j < xyt->nrows; j++) {
+			int dx = xyt->xcol[j] - xyt->xcol[i];
+			int dy = xyt->ycol[j] - xyt->ycol[i];
+			int dist_sq = dx * dx + dy * dy;
+			int angle, d, a;
+
+			if (dist_sq > DM * DM)
+				continue;
+
+			angle = abs(xyt->thetacol[j] - xyt->thetacol[i]) % 360;
+			if (angle > 180)
+				angle = 360 - angle;
+			d = MIN((int) sqrt(dist_sq) / PREMATCH_DIST_STEP,
+				PREMATCH_DIST_BUCKETS - 1);
+			a = MIN(angle / PREMATCH_ANGLE_STEP,
+				PREMATCH_ANGLE_BUCKETS - 1);
+			if (desc->bins[d * PREMATCH_ANGLE_BUCKETS + a] < G_MAXUINT16)
+				desc->bins[d * PREMATCH_ANGLE_BUCKETS + a]++;
+			desc->nr_pairs++;
+		}
+	}
+
+	return desc;
+}
+
+void fpi_prematch_desc_free(struct fpi_prematch_desc *desc)
+{
+	g_free(desc);
+}
+
+/* Returns how much of the two histograms overlap, from 0 to 100: their
+ * intersection once both are normalized to the same number of pairs. */
+int fpi_prematch_desc_score(const struct fpi_prematch_desc *probe,
+	const struct fpi_prematch_desc *desc)
+{
+	guint64 overlap = 0;
+	int i;
+
+	if (probe->nr_pairs == 0 || desc->nr_pairs == 0)
+		return 0;
+
+	for (i = 0; i < PREMATCH_BINS; i++)
+		overlap += MIN((guint64) probe->bins[i] * desc->nr_pairs,
+			(guint64) desc->bins[i] * probe->nr_pairs);
+
+	return overlap * 100 / ((guint64) probe->nr_pairs * desc->nr_pairs);
+}
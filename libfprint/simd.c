@@ -0,0 +1,244 @@
+/*
+ * Runtime selection of the vector kernels for libfprint
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define FP_COMPONENT "simd"
+
+/* The pixel kernels used by image assembly and the line statistics are
+ * built several times over, see simd_kernels.h: once for the instruction
+ * set every CPU of the architecture has, which is what fpi_simd points to
+ * until fp_init() ran, and once for each wider one worth having. fp_init()
+ * then picks the widest the CPU supports, after checking that it gives the
+ * same results as the plain C loops on a few buffers. LIBFPRINT_SIMD can
+ * name the variant to use instead, "scalar" to turn them off. */
+
+#include <config.h>
+#include <string.h>
+
+#include <glib.h>
+
+#if defined(__arm__) && defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#include "fp_internal.h"
+
+static unsigned int row_sad_scalar(const unsigned char *p1,
+	const unsigned char *p2, unsigned int width)
+{
+	unsigned int err = 0, j;
+
+	for (j = 0; j < width; j++)
+		err += p1[j] > p2[j] ? p1[j] - p2[j] : p2[j] - p1[j];
+	return err;
+}
+
+static guint64 sq_diff_scalar(const unsigned char *buf1,
+	const unsigned char *buf2, int size)
+{
+	guint64 sumsq = 0;
+	int i;
+
+	for (i = 0; i < size; i++) {
+		int dev = (int) buf1[i] - (int) buf2[i];
+		sumsq += dev * dev;
+	}
+	return sumsq;
+}
+
+static void sum_sq_scalar(const unsigned char *buf, int size,
+	guint64 *sum, guint64 *sumsq)
+{
+	guint64 s = 0, sq = 0;
+	int i;
+
+	for (i = 0; i < size; i++) {
+		s += buf[i];
+		sq += buf[i] * buf[i];
+	}
+	*sum = s;
+	*sumsq = sq;
+}
+
+static const struct fpi_simd_ops simd_scalar = {
+	.name = "scalar",
+	.row_sad = row_sad_scalar,
+	.sq_diff = sq_diff_scalar,
+	.sum_sq = sum_sq_scalar,
+};
+
+#if defined(ENABLE_SIMD) && defined(__GNUC__)
+#define SIMD_SUFFIX base
+#define SIMD_VECTOR_SIZE 16
+#define SIMD_TARGET
+#include "simd_kernels.h"
+
+static const struct fpi_simd_ops simd_base = {
+#if defined(__x86_64__) || defined(__SSE2__)
+	.name = "sse2",
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+	.name = "neon",
+#else
+	.name = "vector",
+#endif
+	.row_sad = row_sad_base,
+	.sq_diff = sq_diff_base,
+	.sum_sq = sum_sq_base,
+};
+#define SIMD_DEFAULT simd_base
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD_SUFFIX avx2
+#define SIMD_VECTOR_SIZE 32
+#define SIMD_TARGET __attribute__((target("avx2")))
+#include "simd_kernels.h"
+
+static const struct fpi_simd_ops simd_avx2 = {
+	.name = "avx2",
+	.row_sad = row_sad_avx2,
+	.sq_diff = sq_diff_avx2,
+	.sum_sq = sum_sq_avx2,
+};
+#define HAVE_SIMD_AVX2 1
+#endif
+
+#if defined(__arm__) && defined(__linux__) && !defined(__ARM_NEON)
+#define SIMD_SUFFIX neon
+#define SIMD_VECTOR_SIZE 16
+#define SIMD_TARGET __attribute__((target("fpu=neon")))
+#include "simd_kernels.h"
+
+static const struct fpi_simd_ops simd_neon = {
+	.name = "neon",
+	.row_sad = row_sad_neon,
+	.sq_diff = sq_diff_neon,
+	.sum_sq = sum_sq_neon,
+};
+#define HAVE_SIMD_NEON 1
+#endif
+#else
+#define SIMD_DEFAULT simd_scalar
+#endif
+
+const struct fpi_simd_ops *fpi_simd = &SIMD_DEFAULT;
+
+/* Candidates, widest first */
+static const struct fpi_simd_ops *simd_variants[] = {
+#ifdef HAVE_SIMD_AVX2
+	&simd_avx2,
+#endif
+#ifdef HAVE_SIMD_NEON
+	&simd_neon,
+#endif
+#if defined(ENABLE_SIMD) && defined(__GNUC__)
+	&simd_base,
+#endif
+	&simd_scalar,
+};
+
+static gboolean cpu_supports(const struct fpi_simd_ops *ops)
+{
+#ifdef HAVE_SIMD_AVX2
+	if (ops == &simd_avx2) {
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2");
+	}
+#endif
+#ifdef HAVE_SIMD_NEON
+	if (ops == &simd_neon)
+		return (getauxval(AT_HWCAP) & HWCAP_NEON) != 0;
+#endif
+	return TRUE;
+}
+
+/* Compares a variant with the scalar loops, on lengths around the vector
+ * widths and the flush intervals of the accumulators, at several
+ * alignments but for the longest one, which only keeps startup short */
+static gboolean self_check(const struct fpi_simd_ops *ops)
+{
+	static const int sizes[] = {
+		0, 1, 15, 16, 17, 31, 32, 33, 63, 64, 100, 2048, 2049, 4111,
+		524288 + 37,
+	};
+	const int max_size = 524288 + 37 + 32;
+	unsigned char *buf1 = g_malloc(max_size);
+	unsigned char *buf2 = g_malloc(max_size);
+	guint32 seed = 0x12345678;
+	gboolean ok = TRUE;
+	unsigned int i, offset;
+
+	for (i = 0; i < (unsigned int) max_size; i++) {
+		seed = seed * 1103515245 + 12345;
+		buf1[i] = seed >> 24;
+		/* the extremes, to catch lanes that overflow */
+		buf2[i] = i & 256 ? 255 - buf1[i] : (i & 1 ? 255 : 0);
+	}
+
+	for (i = 0; i < G_N_ELEMENTS(sizes) && ok; i++) {
+		unsigned int step = sizes[i] > 4111 ? 32 : 3;
+
+		for (offset = 0; offset < 32 && ok; offset += step) {
+			const unsigned char *p1 = buf1 + offset;
+			const unsigned char *p2 = buf2 + 31 - offset;
+			int size = sizes[i];
+			guint64 sum, sumsq, ref_sum, ref_sumsq;
+
+			ok = ops->row_sad(p1, p2, size)
+				== row_sad_scalar(p1, p2, size)
+				&& ops->sq_diff(p1, p2, size)
+				== sq_diff_scalar(p1, p2, size);
+			ops->sum_sq(p2, size, &sum, &sumsq);
+			sum_sq_scalar(p2, size, &ref_sum, &ref_sumsq);
+			ok = ok && sum == ref_sum && sumsq == ref_sumsq;
+			if (!ok)
+				fp_warn("%s kernels disagree with the scalar code "
+					"on %d bytes at offset %u", ops->name, size,
+					offset);
+		}
+	}
+
+	g_free(buf1);
+	g_free(buf2);
+	return ok;
+}
+
+void fpi_simd_init(void)
+{
+	const char *forced = g_getenv("LIBFPRINT_SIMD");
+	unsigned int i;
+
+	for (i = 0; i < G_N_ELEMENTS(simd_variants); i++) {
+		const struct fpi_simd_ops *ops = simd_variants[i];
+
+		if (forced && strcmp(forced, ops->name) != 0)
+			continue;
+		if (!cpu_supports(ops)) {
+			fp_dbg("%s not supported by this CPU", ops->name);
+			continue;
+		}
+		if (ops != &simd_scalar && !self_check(ops))
+			continue;
+		fpi_simd = ops;
+		fp_dbg("using the %s kernels", ops->name);
+		return;
+	}
+
+	if (forced)
+		fp_warn("%s kernels not available, using %s", forced,
+			fpi_simd->name);
+}
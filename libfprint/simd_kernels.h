@@ -0,0 +1,168 @@
+/*
+ * Vector kernels for libfprint, instantiated once per instruction set
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Only included by simd.c, after defining:
+ *   SIMD_SUFFIX       appended to the name of each kernel
+ *   SIMD_VECTOR_SIZE  the vector width in bytes
+ *   SIMD_TARGET       the attributes selecting the instruction set
+ * The kernels are written with the generic vectors of GCC, which the
+ * compiler lowers to whatever the target has. */
+
+#define SIMD_CAT_(a, b) a##_##b
+#define SIMD_CAT(a, b) SIMD_CAT_(a, b)
+#define SIMD_FN(name) SIMD_CAT(name, SIMD_SUFFIX)
+#define SIMD_U8V SIMD_FN(simd_u8v)
+#define SIMD_U16V SIMD_FN(simd_u16v)
+#define SIMD_U32V SIMD_FN(simd_u32v)
+#define SIMD_U16_LANES (SIMD_VECTOR_SIZE / sizeof(guint16))
+#define SIMD_U32_LANES (SIMD_VECTOR_SIZE / sizeof(guint32))
+
+typedef guint8 SIMD_U8V __attribute__((vector_size(SIMD_VECTOR_SIZE)));
+typedef guint16 SIMD_U16V __attribute__((vector_size(SIMD_VECTOR_SIZE)));
+typedef guint32 SIMD_U32V __attribute__((vector_size(SIMD_VECTOR_SIZE)));
+
+/* |v1 - v2|, which cannot wrap */
+static inline SIMD_TARGET SIMD_U8V SIMD_FN(abs_diff)(SIMD_U8V v1, SIMD_U8V v2)
+{
+	SIMD_U8V gt = (SIMD_U8V) (v1 > v2);
+
+	return ((v1 - v2) & gt) | ((v2 - v1) & ~gt);
+}
+
+/* Adds the 16-bit lanes of x to the 32-bit lanes of acc */
+static inline SIMD_TARGET SIMD_U32V SIMD_FN(widen_add)(SIMD_U32V acc,
+	SIMD_U16V x)
+{
+	SIMD_U32V pairs = (SIMD_U32V) x;
+
+	return acc + (pairs & 0xffff) + (pairs >> 16);
+}
+
+static SIMD_TARGET unsigned int SIMD_FN(row_sad)(const unsigned char *p1,
+	const unsigned char *p2, unsigned int width)
+{
+	unsigned int err = 0, j = 0;
+
+	while (j + SIMD_VECTOR_SIZE <= width) {
+		SIMD_U16V acc = { 0 };
+		unsigned int n, k;
+
+		/* a 16-bit lane gains at most 2 * 255 from each vector */
+		for (n = 0; n < 128 && j + SIMD_VECTOR_SIZE <= width;
+		     n++, j += SIMD_VECTOR_SIZE) {
+			SIMD_U8V v1, v2;
+			SIMD_U16V pairs;
+
+			memcpy(&v1, p1 + j, sizeof(v1));
+			memcpy(&v2, p2 + j, sizeof(v2));
+			pairs = (SIMD_U16V) SIMD_FN(abs_diff)(v1, v2);
+			acc += (pairs & 0xff) + (pairs >> 8);
+		}
+		for (k = 0; k < SIMD_U16_LANES; k++)
+			err += acc[k];
+	}
+	for (; j < width; j++)
+		err += p1[j] > p2[j] ? p1[j] - p2[j] : p2[j] - p1[j];
+
+	return err;
+}
+
+static SIMD_TARGET guint64 SIMD_FN(sq_diff)(const unsigned char *buf1,
+	const unsigned char *buf2, int size)
+{
+	guint64 sumsq = 0;
+	int i = 0;
+
+	while (i + SIMD_VECTOR_SIZE <= size) {
+		SIMD_U32V acc = { 0 };
+		unsigned int n, k;
+
+		/* a 32-bit lane gains at most 4 * 255 * 255 from each vector */
+		for (n = 0; n < 16384 && i + SIMD_VECTOR_SIZE <= size;
+		     n++, i += SIMD_VECTOR_SIZE) {
+			SIMD_U8V v1, v2;
+			SIMD_U16V pairs, lo, hi;
+
+			memcpy(&v1, buf1 + i, sizeof(v1));
+			memcpy(&v2, buf2 + i, sizeof(v2));
+			pairs = (SIMD_U16V) SIMD_FN(abs_diff)(v1, v2);
+			lo = pairs & 0xff;
+			hi = pairs >> 8;
+			acc = SIMD_FN(widen_add)(acc, lo * lo);
+			acc = SIMD_FN(widen_add)(acc, hi * hi);
+		}
+		for (k = 0; k < SIMD_U32_LANES; k++)
+			sumsq += acc[k];
+	}
+	for (; i < size; i++) {
+		int dev = (int) buf1[i] - (int) buf2[i];
+		sumsq += dev * dev;
+	}
+
+	return sumsq;
+}
+
+static SIMD_TARGET void SIMD_FN(sum_sq)(const unsigned char *buf, int size,
+	guint64 *sum, guint64 *sumsq)
+{
+	guint64 s = 0, sq = 0;
+	int i = 0;
+
+	while (i + SIMD_VECTOR_SIZE <= size) {
+		SIMD_U32V acc = { 0 };
+		SIMD_U32V accsq = { 0 };
+		unsigned int n, k;
+
+		for (n = 0; n < 16384 && i + SIMD_VECTOR_SIZE <= size;
+		     n++, i += SIMD_VECTOR_SIZE) {
+			SIMD_U8V v;
+			SIMD_U16V pairs, lo, hi;
+
+			memcpy(&v, buf + i, sizeof(v));
+			pairs = (SIMD_U16V) v;
+			lo = pairs & 0xff;
+			hi = pairs >> 8;
+			acc = SIMD_FN(widen_add)(acc, lo + hi);
+			accsq = SIMD_FN(widen_add)(accsq, lo * lo);
+			accsq = SIMD_FN(widen_add)(accsq, hi * hi);
+		}
+		for (k = 0; k < SIMD_U32_LANES; k++) {
+			s += acc[k];
+			sq += accsq[k];
+		}
+	}
+	for (; i < size; i++) {
+		s += buf[i];
+		sq += buf[i] * buf[i];
+	}
+
+	*sum = s;
+	*sumsq = sq;
+}
+
+#undef SIMD_U32_LANES
+#undef SIMD_U16_LANES
+#undef SIMD_U32V
+#undef SIMD_U16V
+#undef SIMD_U8V
+#undef SIMD_FN
+#undef SIMD_CAT
+#undef SIMD_CAT_
+#undef SIMD_TARGET
+#undef SIMD_VECTOR_SIZE
+#undef SIMD_SUFFIX
@@ -0,0 +1,625 @@
+/*
+ * Packed single-file print store for libfprint
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "fp_internal.h"
+
+/*
+ * The packed store keeps every print in one append-only file. After the
+ * "FPS1" magic, the file is a sequence of records, little endian:
+ *
+ *   u32 payload length, u32 devtype, u16 driver id, u8 finger,
+ *   u8 user key length, user key, padding, payload (an FP2 print blob)
+ *
+ * The zero padding, implied by the offset of the payload, aligns the first
+ * sample of the blob so that loaded prints can use samples straight from a
+ * mapping of the file.
+ *
+ * Saving a print appends a record that supersedes any earlier one for the
+ * same (driver id, devtype, finger, user) key, and a record with an empty
+ * payload deletes the key. The index is built by walking the record headers
+ * once and is then kept in a hash table, so lookups never touch the
+ * directory tree. Records appended by other processes are picked up by
+ * scanning from where the index ended, and the file is rewritten once
+ * superseded records take up more space than live ones.
+ */
+
+#define STORE_MAGIC "FPS1"
+#define STORE_MAGIC_LEN 4
+#define STORE_RECORD_HDR_LEN 12
+#define STORE_PERMS 0600
+/* don't bother compacting until there is this much garbage */
+#define STORE_COMPACT_MIN (64 * 1024)
+#define STORE_SAMPLE_ALIGN sizeof(int)
+#define STORE_SAMPLE_OFFSET (sizeof(struct fpi_print_data_fp2) \
+	+ sizeof(struct fpi_print_data_item_fp2))
+
+struct store_entry {
+	char *key;
+	char *user;
+	uint16_t driver_id;
+	uint32_t devtype;
+	enum fp_finger finger;
+	off_t record;
+	off_t offset; /* of the payload */
+	uint32_t length;
+};
+
+static GMutex store_lock;
+static char *store_path = NULL;
+static int store_fd = -1;
+static ino_t store_ino;
+static off_t store_end;
+static off_t store_dead;
+static GHashTable *store_index = NULL;
+/* covers the start of the file, remapped when it is too short */
+static GMappedFile *store_map = NULL;
+
+/* Padding to put between the user key ending at offset and a payload of
+ * length bytes. */
+static size_t payload_padding(off_t offset, size_t length)
+{
+	if (length == 0)
+		return 0;
+	return (STORE_SAMPLE_ALIGN
+		- (offset + STORE_SAMPLE_OFFSET) % STORE_SAMPLE_ALIGN)
+		% STORE_SAMPLE_ALIGN;
+}
+
+static char *entry_key(const char *user, uint16_t driver_id,
+	uint32_t devtype, enum fp_finger finger)
+{
+	return g_strdup_printf("%04x/%08x/%x/%s", driver_id, devtype, finger,
+		user);
+}
+
+static void entry_free(struct store_entry *entry)
+{
+	g_free(entry->key);
+	g_free(entry->user);
+	g_free(entry);
+}
+
+static void store_close(void)
+{
+	if (store_fd >= 0)
+		close(store_fd);
+	store_fd = -1;
+	if (store_map)
+		g_mapped_file_unref(store_map);
+	store_map = NULL;
+	store_end = 0;
+	store_dead = 0;
+	if (store_index)
+		g_hash_table_destroy(store_index);
+	store_index = NULL;
+}
+
+static int full_pread(int fd, void *buf, size_t len, off_t offset)
+{
+	while (len > 0) {
+		ssize_t r = pread(fd, buf, len, offset);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			return -errno;
+		if (r == 0)
+			return -EIO;
+		buf = (char *) buf + r;
+		len -= r;
+		offset += r;
+	}
+	return 0;
+}
+
+static int full_pwrite(int fd, const void *buf, size_t len, off_t offset)
+{
+	while (len > 0) {
+		ssize_t r = pwrite(fd, buf, len, offset);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			return -errno;
+		buf = (const char *) buf + r;
+		len -= r;
+		offset += r;
+	}
+	return 0;
+}
+
+/* Indexes the records between store_end and size. A record that runs past
+ * the end of the file was torn by a crash; scanning stops in front of it so
+ * that the next append overwrites it. */
+static void index_records(off_t size)
+{
+	while (store_end + STORE_RECORD_HDR_LEN <= size) {
+		unsigned char hdr[STORE_RECORD_HDR_LEN];
+		char user[256];
+		struct store_entry *entry, *old;
+		guint32 length, devtype;
+		guint16 driver_id;
+		unsigned int finger, user_len;
+		off_t payload, next;
+
+		if (full_pread(store_fd, hdr, sizeof(hdr), store_end) < 0)
+			break;
+		memcpy(&length, hdr, 4);
+		memcpy(&devtype, hdr + 4, 4);
+		memcpy(&driver_id, hdr + 8, 2);
+		length = GUINT32_FROM_LE(length);
+		devtype = GUINT32_FROM_LE(devtype);
+		driver_id = GUINT16_FROM_LE(driver_id);
+		finger = hdr[10];
+		user_len = hdr[11];
+
+		payload = store_end + STORE_RECORD_HDR_LEN + user_len;
+		payload += payload_padding(payload, length);
+		next = payload + length;
+		if (next > size)
+			break;
+		if (full_pread(store_fd, user, user_len,
+				store_end + STORE_RECORD_HDR_LEN) < 0)
+			break;
+		user[user_len] = '\0';
+
+		entry = g_malloc0(sizeof(*entry));
+		entry->key = entry_key(user, driver_id, devtype, finger);
+		old = g_hash_table_lookup(store_index, entry->key);
+		if (old)
+			store_dead += old->length + old->offset - old->record;
+
+		if (length == 0) {
+			/* deletion marker, dead as soon as it is written */
+			store_dead += STORE_RECORD_HDR_LEN + user_len;
+			g_hash_table_remove(store_index, entry->key);
+			entry_free(entry);
+		} else {
+			entry->user = g_strdup(user);
+			entry->driver_id = driver_id;
+			entry->devtype = devtype;
+			entry->finger = finger;
+			entry->record = store_end;
+			entry->offset = payload;
+			entry->length = length;
+			g_hash_table_replace(store_index, entry->key, entry);
+		}
+		store_end = next;
+	}
+}
+
+/* Brings the index up to date with the file at store_path, reopening it if
+ * it was replaced by a compaction. Must be called with store_lock held. */
+static int store_sync(gboolean create)
+{
+	struct stat st;
+
+	if (!store_path)
+		return -ENOENT;
+
+	if (g_stat(store_path, &st) < 0) {
+		int r = -errno;
+		if (r != -ENOENT || !create) {
+			store_close();
+			return r;
+		}
+	} else if (store_fd >= 0 && st.st_ino == store_ino) {
+		if (st.st_size < store_end) {
+			/* truncated behind our back, start over */
+			g_hash_table_remove_all(store_index);
+			if (store_map)
+				g_mapped_file_unref(store_map);
+			store_map = NULL;
+			store_end = STORE_MAGIC_LEN;
+			store_dead = 0;
+		}
+		index_records(st.st_size);
+		return 0;
+	}
+
+	store_close();
+	store_fd = g_open(store_path,
+		O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), STORE_PERMS);
+	if (store_fd < 0) {
+		int r = -errno;
+		fp_err("couldn't open print store %s", store_path);
+		return r;
+	}
+	if (fstat(store_fd, &st) < 0) {
+		int r = -errno;
+		store_close();
+		return r;
+	}
+
+	if (st.st_size == 0) {
+		int r;
+
+		flock(store_fd, LOCK_EX);
+		r = full_pwrite(store_fd, STORE_MAGIC, STORE_MAGIC_LEN, 0);
+		flock(store_fd, LOCK_UN);
+		if (r < 0) {
+			store_close();
+			return r;
+		}
+		st.st_size = STORE_MAGIC_LEN;
+	} else {
+		char magic[STORE_MAGIC_LEN];
+
+		if (st.st_size < STORE_MAGIC_LEN
+				|| full_pread(store_fd, magic, sizeof(magic), 0) < 0
+				|| memcmp(magic, STORE_MAGIC, STORE_MAGIC_LEN) != 0) {
+			fp_err("%s is not a print store", store_path);
+			store_close();
+			return -EINVAL;
+		}
+	}
+
+	store_ino = st.st_ino;
+	store_end = STORE_MAGIC_LEN;
+	store_dead = 0;
+	store_index = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+		(GDestroyNotify) entry_free);
+	index_records(st.st_size);
+	fp_dbg("indexed %u prints in %s", g_hash_table_size(store_index),
+		store_path);
+	return 0;
+}
+
+/* Takes the write lock on a store file that is still the one at
+ * store_path; a concurrent compaction may have renamed a new file over it
+ * while we were waiting. */
+static int store_lock_file(void)
+{
+	int r;
+
+	while (1) {
+		struct stat st;
+
+		r = store_sync(TRUE);
+		if (r < 0)
+			return r;
+		if (flock(store_fd, LOCK_EX) < 0)
+			return -errno;
+		if (g_stat(store_path, &st) == 0 && st.st_ino == store_ino)
+			break;
+		flock(store_fd, LOCK_UN);
+	}
+
+	/* catch up with appends made before we got the lock */
+	return store_sync(TRUE);
+}
+
+/* Rewrites the store with only its live records. Called with the file
+ * lock held; on failure the old file simply stays in use. */
+static void store_compact(void)
+{
+	GHashTableIter iter;
+	struct store_entry *entry;
+	GByteArray *buf;
+	char *tmp_path;
+	GList *entries = NULL, *elem;
+	struct stat st;
+	off_t offset = STORE_MAGIC_LEN;
+	int fd;
+	int r = 0;
+
+	tmp_path = g_strconcat(store_path, ".new", NULL);
+	fd = g_open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+		STORE_PERMS);
+	if (fd < 0) {
+		fp_err("couldn't create %s", tmp_path);
+		g_free(tmp_path);
+		return;
+	}
+
+	fp_dbg("compacting %s, %ld of %ld bytes are stale", store_path,
+		(long) store_dead, (long) store_end);
+	buf = g_byte_array_new();
+	g_byte_array_append(buf, (const guint8 *) STORE_MAGIC, STORE_MAGIC_LEN);
+
+	g_hash_table_iter_init(&iter, store_index);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *) &entry)) {
+		size_t user_len = strlen(entry->user);
+		guint32 v32;
+		guint16 v16;
+		guint8 v8;
+		guint oldlen;
+		size_t padding;
+
+		v32 = GUINT32_TO_LE(entry->length);
+		g_byte_array_append(buf, (const guint8 *) &v32, 4);
+		v32 = GUINT32_TO_LE(entry->devtype);
+		g_byte_array_append(buf, (const guint8 *) &v32, 4);
+		v16 = GUINT16_TO_LE(entry->driver_id);
+		g_byte_array_append(buf, (const guint8 *) &v16, 2);
+		v8 = entry->finger;
+		g_byte_array_append(buf, &v8, 1);
+		v8 = user_len;
+		g_byte_array_append(buf, &v8, 1);
+		g_byte_array_append(buf, (const guint8 *) entry->user, user_len);
+
+		oldlen = buf->len;
+		padding = payload_padding(oldlen, entry->length);
+		g_byte_array_set_size(buf, oldlen + padding + entry->length);
+		memset(buf->data + oldlen, 0, padding);
+		oldlen += padding;
+		r = full_pread(store_fd, buf->data + oldlen, entry->length,
+			entry->offset);
+		if (r < 0)
+			break;
+		entries = g_list_prepend(entries, entry);
+	}
+
+	if (r == 0)
+		r = full_pwrite(fd, buf->data, buf->len, 0);
+	if (r == 0 && (fsync(fd) < 0 || fstat(fd, &st) < 0))
+		r = -errno;
+	if (r == 0 && g_rename(tmp_path, store_path) < 0)
+		r = -errno;
+	if (r < 0) {
+		fp_err("compaction of %s failed with error %d", store_path, r);
+		close(fd);
+		g_unlink(tmp_path);
+		g_list_free(entries);
+		g_byte_array_free(buf, TRUE);
+		g_free(tmp_path);
+		return;
+	}
+
+	/* the records were written in reverse order of the list */
+	entries = g_list_reverse(entries);
+	for (elem = entries; elem; elem = g_list_next(elem)) {
+		entry = elem->data;
+		entry->record = offset;
+		entry->offset = offset + STORE_RECORD_HDR_LEN
+			+ strlen(entry->user);
+		entry->offset += payload_padding(entry->offset, entry->length);
+		offset = entry->offset + entry->length;
+	}
+	g_list_free(entries);
+
+	/* prints loaded earlier keep their own reference to the old mapping */
+	if (store_map)
+		g_mapped_file_unref(store_map);
+	store_map = NULL;
+
+	/* waiters on the old file notice the rename once it is unlocked */
+	flock(store_fd, LOCK_UN);
+	close(store_fd);
+	flock(fd, LOCK_EX);
+	store_fd = fd;
+	store_ino = st.st_ino;
+	store_end = buf->len;
+	store_dead = 0;
+	g_byte_array_free(buf, TRUE);
+	g_free(tmp_path);
+}
+
+/* Without sync, the record only reaches the disk with the next
+ * fpi_store_flush(); until then a crash may lose it, but never leaves a
+ * partial record behind that would be taken for a print. */
+static int store_append(const char *user, uint16_t driver_id,
+	uint32_t devtype, enum fp_finger finger, const unsigned char *data,
+	size_t len, gboolean sync)
+{
+	unsigned char *record;
+	size_t user_len = strlen(user);
+	size_t padding, record_len;
+	guint32 v32;
+	guint16 v16;
+	int r;
+
+	if (user_len > 255 || len > G_MAXUINT32)
+		return -EINVAL;
+
+	r = store_lock_file();
+	if (r < 0)
+		return r;
+
+	padding = payload_padding(store_end + STORE_RECORD_HDR_LEN + user_len,
+		len);
+	record_len = STORE_RECORD_HDR_LEN + user_len + padding + len;
+	record = g_malloc0(record_len);
+	v32 = GUINT32_TO_LE(len);
+	memcpy(record, &v32, 4);
+	v32 = GUINT32_TO_LE(devtype);
+	memcpy(record + 4, &v32, 4);
+	v16 = GUINT16_TO_LE(driver_id);
+	memcpy(record + 8, &v16, 2);
+	record[10] = finger;
+	record[11] = user_len;
+	memcpy(record + STORE_RECORD_HDR_LEN, user, user_len);
+	if (len)
+		memcpy(record + STORE_RECORD_HDR_LEN + user_len + padding, data,
+			len);
+
+	/* a torn record left by a crash is cut off here */
+	if (ftruncate(store_fd, store_end) < 0
+			|| full_pwrite(store_fd, record, record_len, store_end) < 0
+			|| (sync && fsync(store_fd) < 0)) {
+		r = -errno;
+		fp_err("append to %s failed with error %d", store_path, r);
+	} else {
+		index_records(store_end + record_len);
+		if (store_dead > STORE_COMPACT_MIN
+				&& store_dead > store_end - store_dead)
+			store_compact();
+	}
+
+	flock(store_fd, LOCK_UN);
+	g_free(record);
+	return r;
+}
+
+/* Switches the packed store to the file at path, or closes it if path is
+ * NULL. The file is only opened once a print is accessed. */
+void fpi_store_open(const char *path)
+{
+	g_mutex_lock(&store_lock);
+	store_close();
+	g_free(store_path);
+	store_path = g_strdup(path);
+	g_mutex_unlock(&store_lock);
+}
+
+void fpi_store_exit(void)
+{
+	fpi_store_open(NULL);
+}
+
+int fpi_store_save(const char *user, uint16_t driver_id, uint32_t devtype,
+	enum fp_finger finger, const unsigned char *data, size_t len,
+	gboolean sync)
+{
+	int r;
+
+	if (len == 0)
+		return -EINVAL;
+
+	g_mutex_lock(&store_lock);
+	r = store_append(user, driver_id, devtype, finger, data, len, sync);
+	g_mutex_unlock(&store_lock);
+	return r;
+}
+
+/* Writes the records appended without sync to the disk. A compaction in
+ * the meantime wrote them to the new file and synced it already. */
+int fpi_store_flush(void)
+{
+	int r = 0;
+
+	g_mutex_lock(&store_lock);
+	if (store_fd >= 0 && fsync(store_fd) < 0)
+		r = -errno;
+	g_mutex_unlock(&store_lock);
+	return r;
+}
+
+/* Looks up a print and maps the store. On success, data points to the
+ * print inside map, which the caller must unref when done. */
+int fpi_store_load(const char *user, uint16_t driver_id, uint32_t devtype,
+	enum fp_finger finger, GMappedFile **map, const unsigned char **data,
+	size_t *len)
+{
+	struct store_entry *entry;
+	char *key;
+	int r;
+
+	g_mutex_lock(&store_lock);
+	r = store_sync(FALSE);
+	if (r < 0)
+		goto out;
+
+	key = entry_key(user, driver_id, devtype, finger);
+	entry = g_hash_table_lookup(store_index, key);
+	g_free(key);
+	if (!entry) {
+		r = -ENOENT;
+		goto out;
+	}
+
+	/* records are never modified in place and a compaction writes a new
+	 * file, so mapped records stay valid without the file lock */
+	if (!store_map || g_mapped_file_get_length(store_map)
+			< (gsize) (entry->offset + entry->length)) {
+		GError *err = NULL;
+
+		if (store_map)
+			g_mapped_file_unref(store_map);
+		store_map = g_mapped_file_new_from_fd(store_fd, FALSE, &err);
+		if (!store_map) {
+			fp_err("couldn't map %s: %s", store_path, err->message);
+			g_error_free(err);
+			r = -EIO;
+			goto out;
+		}
+	}
+
+	*map = g_mapped_file_ref(store_map);
+	*data = (const unsigned char *) g_mapped_file_get_contents(store_map)
+		+ entry->offset;
+	*len = entry->length;
+
+out:
+	g_mutex_unlock(&store_lock);
+	return r;
+}
+
+int fpi_store_delete(const char *user, uint16_t driver_id, uint32_t devtype,
+	enum fp_finger finger)
+{
+	char *key;
+	int r;
+
+	g_mutex_lock(&store_lock);
+	r = store_sync(FALSE);
+	if (r < 0)
+		goto out;
+
+	key = entry_key(user, driver_id, devtype, finger);
+	if (!g_hash_table_lookup(store_index, key))
+		r = -ENOENT;
+	g_free(key);
+	if (r == 0)
+		r = store_append(user, driver_id, devtype, finger, NULL, 0,
+			TRUE);
+
+out:
+	g_mutex_unlock(&store_lock);
+	return r;
+}
+
+/* Prepends a discovered print for each print of user to list. */
+GSList *fpi_store_discover(const char *user, GSList *list)
+{
+	GHashTableIter iter;
+	struct store_entry *entry;
+
+	g_mutex_lock(&store_lock);
+	if (store_sync(FALSE) < 0) {
+		g_mutex_unlock(&store_lock);
+		return list;
+	}
+
+	g_hash_table_iter_init(&iter, store_index);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *) &entry)) {
+		struct fp_dscv_print *print;
+
+		if (strcmp(entry->user, user) != 0)
+			continue;
+
+		print = g_malloc0(sizeof(*print));
+		print->driver_id = entry->driver_id;
+		print->devtype = entry->devtype;
+		print->finger = entry->finger;
+		print->user = g_strdup(user);
+		list = g_slist_prepend(list, print);
+	}
+	g_mutex_unlock(&store_lock);
+	return list;
+}
@@ -21,62 +21,355 @@
 
 #include <config.h>
 #include <errno.h>
+#include <string.h>
 
 #include "fp_internal.h"
 
+/* how long to block handling the events while a cancellable cannot
+ * interrupt the loop, see sync_wait() */
+#define SYNC_CANCEL_POLL_USEC (100 * 1000)
+
+/* the synchronous calls all wait on sync_cond, for flags set under sync_lock
+ * by the callbacks of the asynchronous API */
+static GMutex sync_lock;
+static GCond sync_cond;
+
+struct fp_cancellable {
+	gint cancelled;
+};
+
+/**
+ * fp_cancellable_new:
+ *
+ * Creates a cancel handle, to give to the synchronous functions with a
+ * _timeout suffix, such as fp_verify_finger_img_timeout(). Calling
+ * fp_cancellable_cancel() from another thread makes them stop the
+ * operation and return -ECANCELED.
+ *
+ * Returns: the new handle, to be freed with fp_cancellable_free()
+ */
+API_EXPORTED struct fp_cancellable *fp_cancellable_new(void)
+{
+	return g_malloc0(sizeof(struct fp_cancellable));
+}
+
+/**
+ * fp_cancellable_free:
+ * @cancellable: the handle to free. If %NULL, function simply returns.
+ *
+ * Frees a cancel handle. It must not be in use by any function anymore.
+ */
+API_EXPORTED void fp_cancellable_free(struct fp_cancellable *cancellable)
+{
+	g_free(cancellable);
+}
+
+static void sync_nop(void *data)
+{
+}
+
+/**
+ * fp_cancellable_cancel:
+ * @cancellable: the handle
+ *
+ * Cancels the synchronous function waiting with @cancellable, and any
+ * started with it later on, until fp_cancellable_reset() is called. This
+ * function can be called from any thread.
+ */
+API_EXPORTED void fp_cancellable_cancel(struct fp_cancellable *cancellable)
+{
+	g_atomic_int_set(&cancellable->cancelled, 1);
+
+	g_mutex_lock(&sync_lock);
+	g_cond_broadcast(&sync_cond);
+	g_mutex_unlock(&sync_lock);
+
+	/* wakes up a thread blocked handling the events in sync_wait() */
+	if (fpi_poll_can_defer())
+		fpi_poll_defer(sync_nop, NULL);
+}
+
+/**
+ * fp_cancellable_reset:
+ * @cancellable: the handle
+ *
+ * Makes a cancelled handle usable again.
+ */
+API_EXPORTED void fp_cancellable_reset(struct fp_cancellable *cancellable)
+{
+	g_atomic_int_set(&cancellable->cancelled, 0);
+}
+
+/**
+ * fp_cancellable_is_cancelled:
+ * @cancellable: the handle
+ *
+ * Returns: whether fp_cancellable_cancel() was called since the handle was
+ * created or last reset
+ */
+API_EXPORTED int fp_cancellable_is_cancelled(struct fp_cancellable *cancellable)
+{
+	return g_atomic_int_get(&cancellable->cancelled);
+}
+
+/* the g_get_monotonic_time() by which a call must complete, or -1 */
+static gint64 sync_deadline(unsigned int timeout_ms)
+{
+	if (!timeout_ms)
+		return -1;
+	return g_get_monotonic_time() + (gint64) timeout_ms * 1000;
+}
+
+static int sync_check(gint64 deadline, struct fp_cancellable *cancellable)
+{
+	if (cancellable && g_atomic_int_get(&cancellable->cancelled))
+		return -ECANCELED;
+	if (deadline >= 0 && g_get_monotonic_time() >= deadline)
+		return -ETIMEDOUT;
+	return 0;
+}
+
+/* set a flag sync_wait() waits for; callbacks may run on the event thread */
+static void sync_signal(gboolean *flag)
+{
+	g_mutex_lock(&sync_lock);
+	*flag = TRUE;
+	g_cond_broadcast(&sync_cond);
+	g_mutex_unlock(&sync_lock);
+}
+
+/* Wait for a callback to set flag, until deadline (-1 for none) or until
+ * cancellable (optional) is cancelled. If an event thread handles the events,
+ * this only sleeps on sync_cond. Otherwise it handles the events itself, for
+ * no longer than the deadline: cancelling interrupts it, or if libusb cannot
+ * be interrupted, the cancellable is checked every SYNC_CANCEL_POLL_USEC.
+ * Returns 0 once the flag is set, -ETIMEDOUT, -ECANCELED, or the error of
+ * fp_handle_events_timeout(). */
+static int sync_wait(gboolean *flag, gint64 deadline,
+	struct fp_cancellable *cancellable)
+{
+	int r = 0;
+
+	if (fpi_poll_event_thread_elsewhere()) {
+		g_mutex_lock(&sync_lock);
+		while (!*flag) {
+			r = sync_check(deadline, cancellable);
+			if (r < 0)
+				break;
+			if (deadline < 0)
+				g_cond_wait(&sync_cond, &sync_lock);
+			else
+				g_cond_wait_until(&sync_cond, &sync_lock, deadline);
+		}
+		g_mutex_unlock(&sync_lock);
+		return r;
+	}
+
+	/* the callbacks run on this thread, from fp_handle_events_timeout() */
+	while (!*flag) {
+		struct timeval tv;
+		gint64 usec = 60 * G_USEC_PER_SEC;
+
+		r = sync_check(deadline, cancellable);
+		if (r < 0)
+			return r;
+
+		if (deadline >= 0)
+			usec = MIN(usec, deadline - g_get_monotonic_time());
+		if (cancellable && !fpi_poll_can_defer())
+			usec = MIN(usec, SYNC_CANCEL_POLL_USEC);
+		usec = MAX(usec, 0);
+		tv.tv_sec = usec / G_USEC_PER_SEC;
+		tv.tv_usec = usec % G_USEC_PER_SEC;
+
+		r = fp_handle_events_timeout(&tv);
+		if (r < 0)
+			return r;
+	}
+
+	return 0;
+}
+
+struct sync_call {
+	int (*func)(void *data);
+	void *data;
+	int result;
+	gboolean done;
+};
+
+static void sync_call_run(void *data)
+{
+	struct sync_call *call = data;
+
+	call->result = call->func(call->data);
+	sync_signal(&call->done);
+}
+
+/* Call func, which starts or stops an asynchronous operation. While an event
+ * thread is running, the asynchronous API can only be called from there, so
+ * the call is posted to it. Returns what func returned. */
+static int sync_call(int (*func)(void *data), void *data)
+{
+	struct sync_call call = { func, data, 0, FALSE };
+	int r;
+
+	if (!fpi_poll_event_thread_elsewhere())
+		return func(data);
+
+	r = fp_event_thread_post(sync_call_run, &call);
+	if (r < 0)
+		return r;
+	sync_wait(&call.done, -1, NULL);
+	return call.result;
+}
+
+/* the signature shared by fp_async_enroll_stop() and the like */
+typedef int (*sync_stop_fn)(struct fp_dev *dev, fp_dev_close_cb callback,
+	void *user_data);
+
+struct sync_stop_data {
+	struct fp_dev *dev;
+	sync_stop_fn stop;
+	gboolean stopped;
+};
+
+static void sync_stop_cb(struct fp_dev *dev, void *user_data)
+{
+	struct sync_stop_data *sdata = user_data;
+	fp_dbg("");
+	sync_signal(&sdata->stopped);
+}
+
+static int sync_stop_start(void *data)
+{
+	struct sync_stop_data *sdata = data;
+	return sdata->stop(sdata->dev, sync_stop_cb, sdata);
+}
+
+/* Stop the operation running on dev, and wait until it stopped. Stopping
+ * is prompt, and cannot be cancelled nor time out. */
+static void sync_stop(struct fp_dev *dev, sync_stop_fn stop)
+{
+	struct sync_stop_data sdata = { dev, stop, FALSE };
+
+	if (sync_call(sync_stop_start, &sdata) == 0)
+		sync_wait(&sdata.stopped, -1, NULL);
+}
+
 struct sync_open_data {
+	struct fp_dscv_dev *ddev;
 	struct fp_dev *dev;
 	int status;
+	gboolean populated;
+	/* the caller stopped waiting, the callback closes the device */
+	gboolean abandoned;
 };
 
 static void sync_open_cb(struct fp_dev *dev, int status, void *user_data)
 {
 	struct sync_open_data *odata = user_data;
 	fp_dbg("status %d", status);
+
+	g_mutex_lock(&sync_lock);
+	if (odata->abandoned) {
+		g_mutex_unlock(&sync_lock);
+		fp_dbg("closing device opened after the caller gave up");
+		fp_async_dev_close(dev, NULL, NULL);
+		g_free(odata);
+		return;
+	}
 	odata->dev = dev;
 	odata->status = status;
+	odata->populated = TRUE;
+	g_cond_broadcast(&sync_cond);
+	g_mutex_unlock(&sync_lock);
+}
+
+static int sync_open_start(void *data)
+{
+	struct sync_open_data *odata = data;
+	return fp_async_dev_open(odata->ddev, sync_open_cb, odata);
 }
 
 /**
- * fp_dev_open:
+ * fp_dev_open_timeout:
  * @ddev: the discovered device to open
+ * @timeout_ms: how long to wait for the device to be opened, in
+ * milliseconds, or 0 to wait as long as it takes
+ * @cancellable: (allow-none): a handle to cancel the call with
+ * @dev: (out) (transfer none): location to store the opened device handle
  *
- * Opens and initialises a device. This is the function you call in order
- * to convert a #fp_dscv_dev "discovered device" into an actual device handle
- * that you can perform operations with.
+ * Opens and initialises a device, like fp_dev_open(), waiting no longer
+ * than @timeout_ms, and until @cancellable is cancelled. Device
+ * initialisation cannot be interrupted: if it does not complete in time,
+ * the device is closed as soon as it does.
  *
- * Returns: (transfer none): the opened device handle, or %NULL on error
+ * Returns: 0 on success, -ETIMEDOUT, -ECANCELED, or another negative error
+ * code
  */
-API_EXPORTED struct fp_dev *fp_dev_open(struct fp_dscv_dev *ddev)
+API_EXPORTED int fp_dev_open_timeout(struct fp_dscv_dev *ddev,
+	unsigned int timeout_ms, struct fp_cancellable *cancellable,
+	struct fp_dev **dev)
 {
-	struct fp_dev *dev = NULL;
+	gint64 deadline = sync_deadline(timeout_ms);
 	struct sync_open_data *odata = g_malloc0(sizeof(*odata));
 	int r;
 
 	fp_dbg("");
-	r = fp_async_dev_open(ddev, sync_open_cb, odata);
-	if (r)
-		goto out;
+	*dev = NULL;
+	odata->ddev = ddev;
+	r = sync_call(sync_open_start, odata);
+	if (r) {
+		g_free(odata);
+		return r;
+	}
 
-	while (!odata->dev)
-		if (fp_handle_events() < 0)
-			goto out;
+	r = sync_wait(&odata->populated, deadline, cancellable);
+	if (r < 0) {
+		g_mutex_lock(&sync_lock);
+		if (!odata->populated) {
+			odata->abandoned = TRUE;
+			g_mutex_unlock(&sync_lock);
+			return r;
+		}
+		g_mutex_unlock(&sync_lock);
+	}
 
-	if (odata->status == 0)
-		dev = odata->dev;
-	else
+	if (odata->status == 0) {
+		*dev = odata->dev;
+		r = 0;
+	} else {
 		fp_dev_close(odata->dev);
+		r = odata->status < 0 ? odata->status : -EIO;
+	}
 
-out:
 	g_free(odata);
+	return r;
+}
+
+/**
+ * fp_dev_open:
+ * @ddev: the discovered device to open
+ *
+ * Opens and initialises a device. This is the function you call in order
+ * to convert a #fp_dscv_dev "discovered device" into an actual device handle
+ * that you can perform operations with.
+ *
+ * Returns: (transfer none): the opened device handle, or %NULL on error
+ */
+API_EXPORTED struct fp_dev *fp_dev_open(struct fp_dscv_dev *ddev)
+{
+	struct fp_dev *dev;
+
+	fp_dev_open_timeout(ddev, 0, NULL, &dev);
 	return dev;
 }
 
-static void sync_close_cb(struct fp_dev *dev, void *user_data)
+static int sync_dev_close(struct fp_dev *dev, fp_dev_close_cb callback,
+	void *user_data)
 {
-	fp_dbg("");
-	gboolean *closed = user_data;
-	*closed = TRUE;
+	fp_async_dev_close(dev, callback, user_data);
+	return 0;
 }
 
 /**
@@ -88,19 +381,15 @@ static void sync_close_cb(struct fp_dev *dev, void *user_data)
  */
 API_EXPORTED void fp_dev_close(struct fp_dev *dev)
 {
-	gboolean closed = FALSE;
-
 	if (!dev)
 		return;
 
 	fp_dbg("");
-	fp_async_dev_close(dev, sync_close_cb, &closed);
-	while (!closed)
-		if (fp_handle_events() < 0)
-			break;
+	sync_stop(dev, sync_dev_close);
 }
 
 struct sync_enroll_data {
+	struct fp_dev *dev;
 	gboolean populated;
 	int result;
 	struct fp_print_data *data;
@@ -115,79 +404,42 @@ static void sync_enroll_cb(struct fp_dev *dev, int result,
 	edata->result = result;
 	edata->data = data;
 	edata->img = img;
-	edata->populated = TRUE;
+	sync_signal(&edata->populated);
 }
 
-static void enroll_stop_cb(struct fp_dev *dev, void *user_data)
+static int sync_enroll_start(void *data)
 {
-	gboolean *stopped = user_data;
-	fp_dbg("");
-	*stopped = TRUE;
+	struct sync_enroll_data *edata = data;
+	return fp_async_enroll_start(edata->dev, sync_enroll_cb, edata);
 }
 
 /**
- * fp_enroll_finger_img:
+ * fp_enroll_finger_img_timeout:
  * @dev: the device
- * @print_data a location to return the resultant enrollment data from
+ * @print_data: a location to return the resultant enrollment data from
  * the final stage. Must be freed with fp_print_data_free() after use.
  * @img: location to store the scan image. accepts %NULL for no image
- * storage. If an image is returned, it must be freed with fp_img_free() after
- * use.
- *
- * Performs an enroll stage. See [Enrolling](libfprint-Devices-operations.html#enrolling)
- * for an explanation of enroll stages.
- *
- * If no enrollment is in process, this kicks of the process and runs the
- * first stage. If an enrollment is already in progress, calling this
- * function runs the next stage, which may well be the last.
+ * storage.
+ * @timeout_ms: how long to wait for the scan, in milliseconds, or 0 to wait
+ * as long as it takes
+ * @cancellable: (allow-none): a handle to cancel the call with
  *
- * A negative error code may be returned from any stage. When this occurs,
- * further calls to the enroll function will start a new enrollment process,
- * i.e. a negative error code indicates that the enrollment process has been
- * aborted. These error codes only ever indicate unexpected internal errors
- * or I/O problems.
- *
- * The RETRY codes from #fp_enroll_result may be returned from any enroll
- * stage. These codes indicate that the scan was not succesful in that the
- * user did not position their finger correctly or similar. When a RETRY code
- * is returned, the enrollment stage is <emphasis role="strong">not</emphasis> advanced, so the next call
- * into this function will retry the current stage again. The current stage may
- * need to be retried several times.
- *
- * The fp_enroll_result#FP_ENROLL_FAIL code may be returned from any enroll
- * stage. This code indicates that even though the scans themselves have been
- * acceptable, data processing applied to these scans produces incomprehensible
- * results. In other words, the user may have been scanning a different finger
- * for each stage or something like that. Like negative error codes, this
- * return code indicates that the enrollment process has been aborted.
- *
- * The fp_enroll_result#FP_ENROLL_PASS code will only ever be returned for
- * non-final stages. This return code indicates that the scan was acceptable
- * and the next call into this function will advance onto the next enroll
- * stage.
- *
- * The fp_enroll_result#FP_ENROLL_COMPLETE code will only ever be returned
- * from the final enroll stage. It indicates that enrollment completed
- * successfully, and that print_data has been assigned to point to the
- * resultant enrollment data. The print_data parameter will not be modified
- * during any other enrollment stages, hence it is actually legal to pass NULL
- * as this argument for all but the final stage.
- *
- * If the device is an imaging device, it can also return the image from
- * the scan, even when the enroll fails with a RETRY or FAIL code. It is legal
- * to call this function even on non-imaging devices, just don't expect them to
- * provide images.
+ * Performs an enroll stage like fp_enroll_finger_img(), waiting no longer
+ * than @timeout_ms, and until @cancellable is cancelled. Like other negative
+ * error codes, -ETIMEDOUT and -ECANCELED abort the enrollment process.
  *
  * Returns: negative code on error, otherwise a code from #fp_enroll_result
  */
-API_EXPORTED int fp_enroll_finger_img(struct fp_dev *dev,
-	struct fp_print_data **print_data, struct fp_img **img)
+API_EXPORTED int fp_enroll_finger_img_timeout(struct fp_dev *dev,
+	struct fp_print_data **print_data, struct fp_img **img,
+	unsigned int timeout_ms, struct fp_cancellable *cancellable)
 {
 	struct fp_driver *drv = dev->drv;
+	gint64 deadline = sync_deadline(timeout_ms);
 	int stage = dev->__enroll_stage;
-	gboolean final = FALSE;
-	gboolean stopped = FALSE;
-	struct sync_enroll_data *edata = NULL;
+	struct sync_enroll_data *edata;
+	struct fp_print_data *data;
+	struct fp_img *stage_img;
 	int r;
 	fp_dbg("");
 
@@ -197,97 +449,153 @@ API_EXPORTED int fp_enroll_finger_img(struct fp_dev *dev,
 
 	if (stage == -1) {
 		edata = g_malloc0(sizeof(struct sync_enroll_data));
-		r = fp_async_enroll_start(dev, sync_enroll_cb, edata);
+		edata->dev = dev;
+		r = sync_call(sync_enroll_start, edata);
 		if (r < 0) {
 			g_free(edata);
 			return r;
 		}
 
 		dev->__enroll_stage = ++stage;
-	} else if (stage >= dev->nr_enroll_stages) {
+	}
+
+	/* FIXME this isn't very clean */
+	edata = dev->enroll_stage_cb_data;
+
+	if (stage >= dev->nr_enroll_stages) {
 		fp_err("exceeding number of enroll stages for device claimed by "
 			"driver %s (%d stages)", drv->name, dev->nr_enroll_stages);
-		dev->__enroll_stage = -1;
 		r = -EINVAL;
-		final = TRUE;
 		goto out;
 	}
 	fp_dbg("%s will handle enroll stage %d/%d", drv->name, stage,
 		dev->nr_enroll_stages - 1);
 
-	/* FIXME this isn't very clean */
-	edata = dev->enroll_stage_cb_data;
-
-	while (!edata->populated) {
-		r = fp_handle_events();
-		if (r < 0) {
-			g_free(edata);
-			goto err;
-		}
-	}
+	r = sync_wait(&edata->populated, deadline, cancellable);
+	if (r < 0)
+		goto out;
 
+	/* with an event thread, the next stage may already be scanning */
+	g_mutex_lock(&sync_lock);
 	edata->populated = FALSE;
+	r = edata->result;
+	data = edata->data;
+	stage_img = edata->img;
+	g_mutex_unlock(&sync_lock);
 
 	if (img)
-		*img = edata->img;
+		*img = stage_img;
 	else
-		fp_img_free(edata->img);
+		fp_img_free(stage_img);
 
-	r = edata->result;
 	switch (r) {
 	case FP_ENROLL_PASS:
 		fp_dbg("enroll stage passed");
 		dev->__enroll_stage = stage + 1;
-		break;
+		return r;
 	case FP_ENROLL_COMPLETE:
 		fp_dbg("enroll complete");
-		dev->__enroll_stage = -1;
-		*print_data = edata->data;
-		final = TRUE;
+		*print_data = data;
 		break;
 	case FP_ENROLL_RETRY:
 		fp_dbg("enroll should retry");
-		break;
+		return r;
 	case FP_ENROLL_RETRY_TOO_SHORT:
 		fp_dbg("swipe was too short, enroll should retry");
-		break;
+		return r;
 	case FP_ENROLL_RETRY_CENTER_FINGER:
 		fp_dbg("finger was not centered, enroll should retry");
-		break;
+		return r;
 	case FP_ENROLL_RETRY_REMOVE_FINGER:
 		fp_dbg("scan failed, remove finger and retry");
-		break;
+		return r;
 	case FP_ENROLL_FAIL:
 		fp_err("enroll failed");
-		dev->__enroll_stage = -1;
-		final = TRUE;
 		break;
 	default:
 		fp_err("unrecognised return code %d", r);
-		dev->__enroll_stage = -1;
 		r = -EINVAL;
-		final = TRUE;
 		break;
 	}
 
-	if (!final)
-		return r;
-
 out:
-	if (final) {
-		fp_dbg("ending enrollment");
-		g_free(edata);
-	}
+	fp_dbg("ending enrollment");
+	dev->__enroll_stage = -1;
+	sync_stop(dev, fp_async_enroll_stop);
 
-err:
-	if (fp_async_enroll_stop(dev, enroll_stop_cb, &stopped) == 0)
-		while (!stopped)
-			if (fp_handle_events() < 0)
-				break;
+	/* a result which came in while giving up on it */
+	if (r < 0 && edata->populated) {
+		fp_print_data_free(edata->data);
+		fp_img_free(edata->img);
+	}
+	g_free(edata);
 	return r;
 }
 
+/**
+ * fp_enroll_finger_img:
+ * @dev: the device
+ * @print_data a location to return the resultant enrollment data from
+ * the final stage. Must be freed with fp_print_data_free() after use.
+ * @img: location to store the scan image. accepts %NULL for no image
+ * storage. If an image is returned, it must be freed with fp_img_free() after
+ * use.
+ *
+ * Performs an enroll stage. See [Enrolling](libfprint-Devices-operations.html#enrolling)
+ * for an explanation of enroll stages.
+ *
+ * If no enrollment is in process, this kicks of the process and runs the
+ * first stage. If an enrollment is already in progress, calling this
+ * function runs the next stage, which may well be the last.
+ *
+ * A negative error code may be returned from any stage. When this occurs,
+ * further calls to the enroll function will start a new enrollment process,
+ * i.e. a negative error code indicates that the enrollment process has been
+ * aborted. These error codes only ever indicate unexpected internal errors
+ * or I/O problems.
+ *
+ * The RETRY codes from #fp_enroll_result may be returned from any enroll
+ * stage. These codes indicate that the scan was not succesful in that the
+ * user did not position their finger correctly or similar. When a RETRY code
+ * is returned, the enrollment stage is <emphasis role="strong">not</emphasis> advanced, so the next call
+ * into this function will retry the current stage again. The current stage may
+ * need to be retried several times.
+ *
+ * The fp_enroll_result#FP_ENROLL_FAIL code may be returned from any enroll
+ * stage. This code indicates that even though the scans themselves have been
+ * acceptable, data processing applied to these scans produces incomprehensible
+ * results. In other words, the user may have been scanning a different finger
+ * for each stage or something like that. Like negative error codes, this
+ * return code indicates that the enrollment process has been aborted.
+ *
+ * The fp_enroll_result#FP_ENROLL_PASS code will only ever be returned for
+ * non-final stages. This return code indicates that the scan was acceptable
+ * and the next call into this function will advance onto the next enroll
+ * stage.
+ *
+ * The fp_enroll_result#FP_ENROLL_COMPLETE code will only ever be returned
+ * from the final enroll stage. It indicates that enrollment completed
+ * successfully, and that print_data has been assigned to point to the
+ * resultant enrollment data. The print_data parameter will not be modified
+ * during any other enrollment stages, hence it is actually legal to pass NULL
+ * as this argument for all but the final stage.
+ *
+ * If the device is an imaging device, it can also return the image from
+ * the scan, even when the enroll fails with a RETRY or FAIL code. It is legal
+ * to call this function even on non-imaging devices, just don't expect them to
+ * provide images.
+ *
+ * Returns: negative code on error, otherwise a code from #fp_enroll_result
+ */
+API_EXPORTED int fp_enroll_finger_img(struct fp_dev *dev,
+	struct fp_print_data **print_data, struct fp_img **img)
+{
+	return fp_enroll_finger_img_timeout(dev, print_data, img, 0, NULL);
+}
+
 struct sync_verify_data {
+	struct fp_dev *dev;
+	struct fp_print_data *print;
 	gboolean populated;
 	int result;
 	struct fp_img *img;
@@ -299,38 +607,38 @@ static void sync_verify_cb(struct fp_dev *dev, int result, struct fp_img *img,
 	struct sync_verify_data *vdata = user_data;
 	vdata->result = result;
 	vdata->img = img;
-	vdata->populated = TRUE;
+	sync_signal(&vdata->populated);
 }
 
-static void verify_stop_cb(struct fp_dev *dev, void *user_data)
+static int sync_verify_start(void *data)
 {
-	gboolean *stopped = user_data;
-	fp_dbg("");
-	*stopped = TRUE;
+	struct sync_verify_data *vdata = data;
+	return fp_async_verify_start(vdata->dev, vdata->print, sync_verify_cb,
+		vdata);
 }
 
 /**
- * fp_verify_finger_img:
+ * fp_verify_finger_img_timeout:
  * @dev: the device to perform the scan.
- * @enrolled_print: the print to verify against. Must have been previously
- * enrolled with a device compatible to the device selected to perform the scan.
+ * @enrolled_print: the print to verify against.
  * @img: location to store the scan image. accepts %NULL for no image
- * storage. If an image is returned, it must be freed with fp_img_free() after
- * use.
-
- * Performs a new scan and verify it against a previously enrolled print.
- * If the device is an imaging device, it can also return the image from
- * the scan, even when the verify fails with a RETRY code. It is legal to
- * call this function even on non-imaging devices, just don't expect them to
- * provide images.
+ * storage.
+ * @timeout_ms: how long to wait for the scan, in milliseconds, or 0 to wait
+ * as long as it takes
+ * @cancellable: (allow-none): a handle to cancel the call with
  *
- * Returns: negative code on error, otherwise a code from #fp_verify_result
+ * Performs a new scan and verifies it like fp_verify_finger_img(), waiting
+ * no longer than @timeout_ms, and until @cancellable is cancelled.
+ *
+ * Returns: negative code on error, including -ETIMEDOUT and -ECANCELED,
+ * otherwise a code from #fp_verify_result
  */
-API_EXPORTED int fp_verify_finger_img(struct fp_dev *dev,
-	struct fp_print_data *enrolled_print, struct fp_img **img)
+API_EXPORTED int fp_verify_finger_img_timeout(struct fp_dev *dev,
+	struct fp_print_data *enrolled_print, struct fp_img **img,
+	unsigned int timeout_ms, struct fp_cancellable *cancellable)
 {
+	gint64 deadline = sync_deadline(timeout_ms);
 	struct sync_verify_data *vdata;
-	gboolean stopped = FALSE;
 	int r;
 
 	if (!enrolled_print) {
@@ -345,28 +653,25 @@ API_EXPORTED int fp_verify_finger_img(struct fp_dev *dev,
 
 	fp_dbg("to be handled by %s", dev->drv->name);
 	vdata = g_malloc0(sizeof(struct sync_verify_data));
-	r = fp_async_verify_start(dev, enrolled_print, sync_verify_cb, vdata);
+	vdata->dev = dev;
+	vdata->print = enrolled_print;
+	r = sync_call(sync_verify_start, vdata);
 	if (r < 0) {
 		fp_dbg("verify_start error %d", r);
 		g_free(vdata);
 		return r;
 	}
 
-	while (!vdata->populated) {
-		r = fp_handle_events();
-		if (r < 0) {
-			g_free(vdata);
-			goto err;
-		}
-	}
+	r = sync_wait(&vdata->populated, deadline, cancellable);
+	if (r < 0)
+		goto err;
 
-	if (img)
+	if (img) {
 		*img = vdata->img;
-	else
-		fp_img_free(vdata->img);
+		vdata->img = NULL;
+	}
 
 	r = vdata->result;
-	g_free(vdata);
 	switch (r) {
 	case FP_VERIFY_NO_MATCH:
 		fp_dbg("result: no match");
@@ -393,15 +698,39 @@ API_EXPORTED int fp_verify_finger_img(struct fp_dev *dev,
 
 err:
 	fp_dbg("ending verification");
-	if (fp_async_verify_stop(dev, verify_stop_cb, &stopped) == 0)
-		while (!stopped)
-			if (fp_handle_events() < 0)
-				break;
+	sync_stop(dev, fp_async_verify_stop);
 
+	fp_img_free(vdata->img);
+	g_free(vdata);
 	return r;
 }
 
+/**
+ * fp_verify_finger_img:
+ * @dev: the device to perform the scan.
+ * @enrolled_print: the print to verify against. Must have been previously
+ * enrolled with a device compatible to the device selected to perform the scan.
+ * @img: location to store the scan image. accepts %NULL for no image
+ * storage. If an image is returned, it must be freed with fp_img_free() after
+ * use.
+
+ * Performs a new scan and verify it against a previously enrolled print.
+ * If the device is an imaging device, it can also return the image from
+ * the scan, even when the verify fails with a RETRY code. It is legal to
+ * call this function even on non-imaging devices, just don't expect them to
+ * provide images.
+ *
+ * Returns: negative code on error, otherwise a code from #fp_verify_result
+ */
+API_EXPORTED int fp_verify_finger_img(struct fp_dev *dev,
+	struct fp_print_data *enrolled_print, struct fp_img **img)
+{
+	return fp_verify_finger_img_timeout(dev, enrolled_print, img, 0, NULL);
+}
+
 struct sync_identify_data {
+	struct fp_dev *dev;
+	struct fp_print_data **gallery;
 	gboolean populated;
 	int result;
 	size_t match_offset;
@@ -415,14 +744,97 @@ static void sync_identify_cb(struct fp_dev *dev, int result,
 	idata->result = result;
 	idata->match_offset = match_offset;
 	idata->img = img;
-	idata->populated = TRUE;
+	sync_signal(&idata->populated);
 }
 
-static void identify_stop_cb(struct fp_dev *dev, void *user_data)
+static int sync_identify_start(void *data)
 {
-	gboolean *stopped = user_data;
-	fp_dbg("");
-	*stopped = TRUE;
+	struct sync_identify_data *idata = data;
+	return fp_async_identify_start(idata->dev, idata->gallery,
+		sync_identify_cb, idata);
+}
+
+/**
+ * fp_identify_finger_img_timeout:
+ * @dev: the device to perform the scan.
+ * @print_gallery: NULL-terminated array of pointers to the prints to
+ * identify against.
+ * @match_offset: output location to store the array index of the matched
+ * gallery print.
+ * @img: location to store the scan image. accepts %NULL for no image
+ * storage.
+ * @timeout_ms: how long to wait for the scan, in milliseconds, or 0 to wait
+ * as long as it takes
+ * @cancellable: (allow-none): a handle to cancel the call with
+ *
+ * Performs a new scan and identifies it like fp_identify_finger_img(),
+ * waiting no longer than @timeout_ms, and until @cancellable is cancelled.
+ *
+ * Returns: negative code on error, including -ETIMEDOUT and -ECANCELED,
+ * otherwise a code from #fp_verify_result
+ */
+API_EXPORTED int fp_identify_finger_img_timeout(struct fp_dev *dev,
+	struct fp_print_data **print_gallery, size_t *match_offset,
+	struct fp_img **img, unsigned int timeout_ms,
+	struct fp_cancellable *cancellable)
+{
+	gint64 deadline = sync_deadline(timeout_ms);
+	struct sync_identify_data *idata
+		= g_malloc0(sizeof(struct sync_identify_data));
+	int r;
+
+	fp_dbg("to be handled by %s", dev->drv->name);
+
+	idata->dev = dev;
+	idata->gallery = print_gallery;
+	r = sync_call(sync_identify_start, idata);
+	if (r < 0) {
+		fp_err("identify_start error %d", r);
+		goto err;
+	}
+
+	r = sync_wait(&idata->populated, deadline, cancellable);
+	if (r < 0)
+		goto err_stop;
+
+	if (img) {
+		*img = idata->img;
+		idata->img = NULL;
+	}
+
+	r = idata->result;
+	switch (idata->result) {
+	case FP_VERIFY_NO_MATCH:
+		fp_dbg("result: no match");
+		break;
+	case FP_VERIFY_MATCH:
+		fp_dbg("result: match at offset %zd", idata->match_offset);
+		*match_offset = idata->match_offset;
+		break;
+	case FP_VERIFY_RETRY:
+		fp_dbg("verify should retry");
+		break;
+	case FP_VERIFY_RETRY_TOO_SHORT:
+		fp_dbg("swipe was too short, verify should retry");
+		break;
+	case FP_VERIFY_RETRY_CENTER_FINGER:
+		fp_dbg("finger was not centered, verify should retry");
+		break;
+	case FP_VERIFY_RETRY_REMOVE_FINGER:
+		fp_dbg("scan failed, remove finger and retry");
+		break;
+	default:
+		fp_err("unrecognised return code %d", r);
+		r = -EINVAL;
+	}
+
+err_stop:
+	sync_stop(dev, fp_async_identify_stop);
+	fp_img_free(idata->img);
+
+err:
+	g_free(idata);
+	return r;
 }
 
 /**
@@ -462,38 +874,102 @@ API_EXPORTED int fp_identify_finger_img(struct fp_dev *dev,
 	struct fp_print_data **print_gallery, size_t *match_offset,
 	struct fp_img **img)
 {
-	gboolean stopped = FALSE;
-	struct sync_identify_data *idata
-		= g_malloc0(sizeof(struct sync_identify_data));
+	return fp_identify_finger_img_timeout(dev, print_gallery, match_offset,
+		img, 0, NULL);
+}
+
+struct sync_identify_topk_data {
+	struct fp_dev *dev;
+	struct fp_print_data **gallery;
+	size_t k;
+	gboolean populated;
+	int result;
+	struct fp_identify_match *matches;
+	size_t nr_matches;
+	struct fp_img *img;
+};
+
+static void sync_identify_topk_cb(struct fp_dev *dev, int result,
+	const struct fp_identify_match *matches, size_t nr_matches,
+	struct fp_img *img, void *user_data)
+{
+	struct sync_identify_topk_data *idata = user_data;
+	idata->result = result;
+	if (nr_matches)
+		memcpy(idata->matches, matches, nr_matches * sizeof(*matches));
+	idata->nr_matches = nr_matches;
+	idata->img = img;
+	sync_signal(&idata->populated);
+}
+
+static int sync_identify_topk_start(void *data)
+{
+	struct sync_identify_topk_data *idata = data;
+	return fp_async_identify_topk_start(idata->dev, idata->gallery,
+		idata->k, sync_identify_topk_cb, idata);
+}
+
+/**
+ * fp_identify_finger_topk_img_timeout:
+ * @dev: the device to perform the scan.
+ * @print_gallery: %NULL-terminated array of pointers to the prints to
+ * identify against.
+ * @k: the maximum number of candidates to report.
+ * @matches: output array of at least @k entries.
+ * @nr_matches: output location for the number of entries stored in @matches.
+ * @img: location to store the scan image. accepts %NULL for no image
+ * storage.
+ * @timeout_ms: how long to wait for the scan, in milliseconds, or 0 to wait
+ * as long as it takes
+ * @cancellable: (allow-none): a handle to cancel the call with
+ *
+ * Performs a new scan and reports the @k best candidates like
+ * fp_identify_finger_topk_img(), waiting no longer than @timeout_ms, and
+ * until @cancellable is cancelled.
+ *
+ * Returns: negative code on error, including -ETIMEDOUT and -ECANCELED,
+ * otherwise a code from #fp_verify_result
+ */
+API_EXPORTED int fp_identify_finger_topk_img_timeout(struct fp_dev *dev,
+	struct fp_print_data **print_gallery, size_t k,
+	struct fp_identify_match *matches, size_t *nr_matches,
+	struct fp_img **img, unsigned int timeout_ms,
+	struct fp_cancellable *cancellable)
+{
+	gint64 deadline = sync_deadline(timeout_ms);
+	struct sync_identify_topk_data *idata
+		= g_malloc0(sizeof(struct sync_identify_topk_data));
 	int r;
 
 	fp_dbg("to be handled by %s", dev->drv->name);
 
-	r = fp_async_identify_start(dev, print_gallery, sync_identify_cb, idata);
+	*nr_matches = 0;
+	idata->dev = dev;
+	idata->gallery = print_gallery;
+	idata->k = k;
+	idata->matches = matches;
+	r = sync_call(sync_identify_topk_start, idata);
 	if (r < 0) {
 		fp_err("identify_start error %d", r);
 		goto err;
 	}
 
-	while (!idata->populated) {
-		r = fp_handle_events();
-		if (r < 0)
-			goto err_stop;
-	}
+	r = sync_wait(&idata->populated, deadline, cancellable);
+	if (r < 0)
+		goto err_stop;
 
-	if (img)
+	if (img) {
 		*img = idata->img;
-	else
-		fp_img_free(idata->img);
+		idata->img = NULL;
+	}
 
 	r = idata->result;
 	switch (idata->result) {
 	case FP_VERIFY_NO_MATCH:
-		fp_dbg("result: no match");
-		break;
 	case FP_VERIFY_MATCH:
-		fp_dbg("result: match at offset %zd", idata->match_offset);
-		*match_offset = idata->match_offset;
+		fp_dbg("result: %zd candidates, %s", idata->nr_matches,
+			r == FP_VERIFY_MATCH ? "match" : "no match");
+		*nr_matches = idata->nr_matches;
 		break;
 	case FP_VERIFY_RETRY:
 		fp_dbg("verify should retry");
@@ -513,17 +989,57 @@ API_EXPORTED int fp_identify_finger_img(struct fp_dev *dev,
 	}
 
 err_stop:
-	if (fp_async_identify_stop(dev, identify_stop_cb, &stopped) == 0)
-		while (!stopped)
-			if (fp_handle_events() < 0)
-				break;
+	sync_stop(dev, fp_async_identify_stop);
+	fp_img_free(idata->img);
 
 err:
 	g_free(idata);
 	return r;
 }
 
+/**
+ * fp_identify_finger_topk_img:
+ * @dev: the device to perform the scan.
+ * @print_gallery: %NULL-terminated array of pointers to the prints to
+ * identify against. Each one must have been previously enrolled with a device
+ * compatible to the device selected to perform the scan.
+ * @k: the maximum number of candidates to report.
+ * @matches: output array of at least @k entries, to store the best scoring
+ * gallery prints in, best first.
+ * @nr_matches: output location to store the number of entries stored in
+ * @matches, which is less than @k only if the gallery holds fewer prints.
+ * @img: location to store the scan image. accepts %NULL for no image
+ * storage. If an image is returned, it must be freed with fp_img_free() after
+ * use.
+ *
+ * Performs a new scan and compares it against every print in the gallery,
+ * reporting the @k best candidates along with their scores, including any
+ * that fall short of the matching threshold.
+ *
+ * This function returns codes from #fp_verify_result. The return code
+ * fp_verify_result#FP_VERIFY_MATCH indicates that the best candidate
+ * reached the matching threshold, i.e. that fp_identify_finger() would have
+ * found a match. @matches and @nr_matches are only valid if
+ * fp_verify_result#FP_VERIFY_MATCH or fp_verify_result#FP_VERIFY_NO_MATCH
+ * was returned.
+ *
+ * Only imaging devices support top-K identification. -ENOTSUP will be
+ * returned when this is not the case.
+ *
+ * Returns: negative code on error, otherwise a code from #fp_verify_result
+ */
+API_EXPORTED int fp_identify_finger_topk_img(struct fp_dev *dev,
+	struct fp_print_data **print_gallery, size_t k,
+	struct fp_identify_match *matches, size_t *nr_matches,
+	struct fp_img **img)
+{
+	return fp_identify_finger_topk_img_timeout(dev, print_gallery, k,
+		matches, nr_matches, img, 0, NULL);
+}
+
 struct sync_capture_data {
+	struct fp_dev *dev;
+	int unconditional;
 	gboolean populated;
 	int result;
 	struct fp_img *img;
@@ -535,41 +1051,38 @@ static void sync_capture_cb(struct fp_dev *dev, int result, struct fp_img *img,
 	struct sync_capture_data *vdata = user_data;
 	vdata->result = result;
 	vdata->img = img;
-	vdata->populated = TRUE;
+	sync_signal(&vdata->populated);
 }
 
-static void capture_stop_cb(struct fp_dev *dev, void *user_data)
+static int sync_capture_start(void *data)
 {
-	gboolean *stopped = user_data;
-	fp_dbg("");
-	*stopped = TRUE;
+	struct sync_capture_data *vdata = data;
+	return fp_async_capture_start(vdata->dev, vdata->unconditional,
+		sync_capture_cb, vdata);
 }
+
 /**
- * fp_dev_img_capture:
+ * fp_dev_img_capture_timeout:
  * @dev: the device
  * @unconditional: whether to unconditionally capture an image, or to only capture when a finger is detected
  * @img: a location to return the captured image. Must be freed with
  * fp_img_free() after use.
+ * @timeout_ms: how long to wait for the capture, in milliseconds, or 0 to
+ * wait as long as it takes
+ * @cancellable: (allow-none): a handle to cancel the call with
  *
- * Captures a #fp_img "image" from a device. The returned image is the raw
- * image provided by the device, you may wish to [standardize](libfprint-Image-operations.html#img_std) it.
+ * Captures an image like fp_dev_img_capture(), waiting no longer than
+ * @timeout_ms, and until @cancellable is cancelled.
  *
- * If set, the @unconditional flag indicates that the device should
- * capture an image unconditionally, regardless of whether a finger is there
- * or not. If unset, this function will block until a finger is detected on
- * the sensor.
- *
- * See fp_dev_supports_imaging().
- *
- * Returns: 0 on success, non-zero on error. -ENOTSUP indicates that either the
- * @unconditional flag was set but the device does not support this, or that the
- * device does not support imaging.
+ * Returns: 0 on success, non-zero on error, including -ETIMEDOUT and
+ * -ECANCELED.
  */
-API_EXPORTED int fp_dev_img_capture(struct fp_dev *dev, int unconditional,
-	struct fp_img **img)
+API_EXPORTED int fp_dev_img_capture_timeout(struct fp_dev *dev,
+	int unconditional, struct fp_img **img, unsigned int timeout_ms,
+	struct fp_cancellable *cancellable)
 {
+	gint64 deadline = sync_deadline(timeout_ms);
 	struct sync_capture_data *vdata;
-	gboolean stopped = FALSE;
 	int r;
 
 	if (!dev->drv->capture_start) {
@@ -579,28 +1092,25 @@ API_EXPORTED int fp_dev_img_capture(struct fp_dev *dev, int unconditional,
 
 	fp_dbg("to be handled by %s", dev->drv->name);
 	vdata = g_malloc0(sizeof(struct sync_capture_data));
-	r = fp_async_capture_start(dev, unconditional, sync_capture_cb, vdata);
+	vdata->dev = dev;
+	vdata->unconditional = unconditional;
+	r = sync_call(sync_capture_start, vdata);
 	if (r < 0) {
 		fp_dbg("capture_start error %d", r);
 		g_free(vdata);
 		return r;
 	}
 
-	while (!vdata->populated) {
-		r = fp_handle_events();
-		if (r < 0) {
-			g_free(vdata);
-			goto err;
-		}
-	}
+	r = sync_wait(&vdata->populated, deadline, cancellable);
+	if (r < 0)
+		goto err;
 
-	if (img)
+	if (img) {
 		*img = vdata->img;
-	else
-		fp_img_free(vdata->img);
+		vdata->img = NULL;
+	}
 
 	r = vdata->result;
-	g_free(vdata);
 	switch (r) {
 	case FP_CAPTURE_COMPLETE:
 		fp_dbg("result: complete");
@@ -615,11 +1125,36 @@ API_EXPORTED int fp_dev_img_capture(struct fp_dev *dev, int unconditional,
 
 err:
 	fp_dbg("ending capture");
-	if (fp_async_capture_stop(dev, capture_stop_cb, &stopped) == 0)
-		while (!stopped)
-			if (fp_handle_events() < 0)
-				break;
+	sync_stop(dev, fp_async_capture_stop);
 
+	fp_img_free(vdata->img);
+	g_free(vdata);
 	return r;
 }
 
+/**
+ * fp_dev_img_capture:
+ * @dev: the device
+ * @unconditional: whether to unconditionally capture an image, or to only capture when a finger is detected
+ * @img: a location to return the captured image. Must be freed with
+ * fp_img_free() after use.
+ *
+ * Captures a #fp_img "image" from a device. The returned image is the raw
+ * image provided by the device, you may wish to [standardize](libfprint-Image-operations.html#img_std) it.
+ *
+ * If set, the @unconditional flag indicates that the device should
+ * capture an image unconditionally, regardless of whether a finger is there
+ * or not. If unset, this function will block until a finger is detected on
+ * the sensor.
+ *
+ * See fp_dev_supports_imaging().
+ *
+ * Returns: 0 on success, non-zero on error. -ENOTSUP indicates that either the
+ * @unconditional flag was set but the device does not support this, or that the
+ * device does not support imaging.
+ */
+API_EXPORTED int fp_dev_img_capture(struct fp_dev *dev, int unconditional,
+	struct fp_img **img)
+{
+	return fp_dev_img_capture_timeout(dev, unconditional, img, 0, NULL);
+}
@@ -0,0 +1,441 @@
+/*
+ * USB transfer recording and replay
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* With LIBFPRINT_USB_RECORD set to a file name, every transfer submitted
+ * through fpi_usb_submit_transfer() is written to that file once it
+ * completes: its endpoint and type, its status, the data read for IN
+ * transfers, and when it was submitted and completed.
+ *
+ * With LIBFPRINT_USB_REPLAY set to such a file instead, transfers never
+ * reach the device. Each submitted transfer takes the next recorded
+ * transfer of the same endpoint and type, and is completed with its status
+ * and data once the recorded latency has passed, or on the next loop
+ * iteration with LIBFPRINT_USB_REPLAY_SPEED=max. Transfers the recording
+ * has nothing left for stay pending until they are cancelled, like an
+ * interrupt transfer waiting for a finger.
+ *
+ * The driver still opens the device and claims its interfaces, so the
+ * sensor has to be plugged in, but it never sees a transfer: the driver
+ * and everything after it runs on the recorded data at the recorded pace,
+ * which makes their CPU time and latency reproducible.
+ *
+ * Recordings are written in host byte order and are meant to be replayed
+ * on the machine, or at least the architecture, they were made on. */
+
+#define FP_COMPONENT "usbreplay"
+
+#include <config.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+#include <libusb.h>
+
+#include "fp_internal.h"
+
+#define USB_REPLAY_MAGIC "FPUSBRC1"
+
+/* Written before the IN data of each transfer */
+struct usb_replay_header {
+	/* microseconds since the recording started */
+	guint64 submit_us;
+	guint64 complete_us;
+	/* submission order */
+	guint32 seq;
+	gint32 status;
+	guint32 length;
+	guint32 actual_length;
+	guint32 data_len;
+	guint8 endpoint;
+	guint8 type;
+	guint8 pad[2];
+};
+
+struct usb_replay_record {
+	struct usb_replay_header hdr;
+	unsigned char *data;
+};
+
+/* A transfer submitted while recording, until it completes */
+struct usb_record {
+	libusb_transfer_cb_fn callback;
+	void *user_data;
+	guint64 submit_us;
+	guint32 seq;
+};
+
+/* A transfer submitted while replaying, until it completes */
+struct usb_replay {
+	struct libusb_transfer *transfer;
+	struct usb_replay_record *record;
+	struct fpi_timeout timeout;
+};
+
+enum usb_replay_mode {
+	USB_REPLAY_OFF = 0,
+	USB_REPLAY_RECORD,
+	USB_REPLAY_REPLAY,
+};
+
+static enum usb_replay_mode mode;
+static GMutex lock;
+static guint64 start_us;
+
+static FILE *record_file;
+static guint32 record_seq;
+
+static struct usb_replay_record *records;
+static guint32 nr_records;
+static gboolean max_speed;
+/* (endpoint, type) to a GQueue of the records left, in submission order */
+static GHashTable *queues;
+/* struct libusb_transfer to its struct usb_replay */
+static GHashTable *pending;
+
+static guint64 now_us(void)
+{
+	return g_get_monotonic_time() - start_us;
+}
+
+static gboolean transfer_is_in(struct libusb_transfer *transfer)
+{
+	if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL)
+		return libusb_control_transfer_get_setup(transfer)->bmRequestType
+			& LIBUSB_ENDPOINT_IN;
+	return transfer->endpoint & LIBUSB_ENDPOINT_IN;
+}
+
+static gpointer queue_key(guint8 endpoint, guint8 type)
+{
+	return GUINT_TO_POINTER((type << 8 | endpoint) + 1);
+}
+
+static void record_complete(struct libusb_transfer *transfer)
+{
+	struct usb_record *rec = transfer->user_data;
+	struct usb_replay_header hdr = { 0 };
+
+	transfer->callback = rec->callback;
+	transfer->user_data = rec->user_data;
+
+	hdr.submit_us = rec->submit_us;
+	hdr.complete_us = now_us();
+	hdr.seq = rec->seq;
+	hdr.status = transfer->status;
+	hdr.length = transfer->length;
+	hdr.actual_length = transfer->actual_length;
+	hdr.endpoint = transfer->endpoint;
+	hdr.type = transfer->type;
+	if (transfer_is_in(transfer)) {
+		hdr.data_len = transfer->actual_length;
+		if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL)
+			hdr.data_len += LIBUSB_CONTROL_SETUP_SIZE;
+		hdr.data_len = MIN(hdr.data_len, (guint32) transfer->length);
+	}
+	g_slice_free(struct usb_record, rec);
+
+	g_mutex_lock(&lock);
+	if (fwrite(&hdr, sizeof(hdr), 1, record_file) != 1
+			|| (hdr.data_len && fwrite(transfer->buffer, hdr.data_len, 1,
+				record_file) != 1))
+		fp_warn("could not record transfer %u", hdr.seq);
+	g_mutex_unlock(&lock);
+
+	transfer->callback(transfer);
+}
+
+static int record_submit(struct libusb_transfer *transfer)
+{
+	struct usb_record *rec = g_slice_new(struct usb_record);
+	int r;
+
+	rec->callback = transfer->callback;
+	rec->user_data = transfer->user_data;
+	transfer->callback = record_complete;
+	transfer->user_data = rec;
+
+	g_mutex_lock(&lock);
+	rec->seq = record_seq++;
+	rec->submit_us = now_us();
+	g_mutex_unlock(&lock);
+
+	r = libusb_submit_transfer(transfer);
+	if (r < 0) {
+		transfer->callback = rec->callback;
+		transfer->user_data = rec->user_data;
+		g_slice_free(struct usb_record, rec);
+	}
+	return r;
+}
+
+static void replay_complete(void *data)
+{
+	struct usb_replay *replay = data;
+	struct libusb_transfer *transfer = replay->transfer;
+	gboolean free_transfer;
+
+	g_mutex_lock(&lock);
+	g_hash_table_remove(pending, transfer);
+	g_mutex_unlock(&lock);
+
+	if (replay->record) {
+		struct usb_replay_header *hdr = &replay->record->hdr;
+
+		transfer->status = hdr->status;
+		transfer->actual_length = MIN(hdr->actual_length,
+			(guint32) transfer->length);
+		memcpy(transfer->buffer, replay->record->data,
+			MIN(hdr->data_len, (guint32) transfer->length));
+	} else {
+		transfer->status = LIBUSB_TRANSFER_CANCELLED;
+		transfer->actual_length = 0;
+	}
+	g_slice_free(struct usb_replay, replay);
+
+	/* as libusb would, since the transfer never went through it */
+	free_transfer = transfer->flags & LIBUSB_TRANSFER_FREE_TRANSFER;
+	transfer->callback(transfer);
+	if (free_transfer)
+		libusb_free_transfer(transfer);
+}
+
+static int replay_submit(struct libusb_transfer *transfer)
+{
+	struct usb_replay *replay;
+	struct usb_replay_record *record = NULL;
+	GQueue *queue;
+	unsigned int delay = 0;
+
+	g_mutex_lock(&lock);
+	if (g_hash_table_contains(pending, transfer)) {
+		g_mutex_unlock(&lock);
+		return LIBUSB_ERROR_BUSY;
+	}
+
+	queue = g_hash_table_lookup(queues,
+		queue_key(transfer->endpoint, transfer->type));
+	if (queue)
+		record = g_queue_pop_head(queue);
+
+	replay = g_slice_new0(struct usb_replay);
+	replay->transfer = transfer;
+	replay->record = record;
+	g_hash_table_insert(pending, transfer, replay);
+	g_mutex_unlock(&lock);
+
+	if (!record) {
+		fp_dbg("recording ran out for endpoint %02x, holding transfer",
+			transfer->endpoint);
+		return 0;
+	}
+
+	/* A transfer the recording only saw cancelled waits for the same */
+	if (record->hdr.status == LIBUSB_TRANSFER_CANCELLED)
+		return 0;
+
+	if (!max_speed)
+		delay = (record->hdr.complete_us - record->hdr.submit_us) / 1000;
+	fpi_timeout_start(&replay->timeout, delay, replay_complete, replay);
+	return 0;
+}
+
+static int replay_cancel(struct libusb_transfer *transfer)
+{
+	struct usb_replay *replay;
+
+	g_mutex_lock(&lock);
+	replay = g_hash_table_lookup(pending, transfer);
+	g_mutex_unlock(&lock);
+	if (!replay)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	fpi_timeout_cancel(&replay->timeout);
+	replay->record = NULL;
+	fpi_timeout_start(&replay->timeout, 0, replay_complete, replay);
+	return 0;
+}
+
+static int record_sort_seq(const void *a, const void *b)
+{
+	const struct usb_replay_record *ra = a;
+	const struct usb_replay_record *rb = b;
+
+	return (ra->hdr.seq > rb->hdr.seq) - (ra->hdr.seq < rb->hdr.seq);
+}
+
+static void queue_free(gpointer data)
+{
+	g_queue_free(data);
+}
+
+static int replay_load(const char *path)
+{
+	GArray *array = g_array_new(FALSE, FALSE,
+		sizeof(struct usb_replay_record));
+	char magic[sizeof(USB_REPLAY_MAGIC) - 1];
+	struct usb_replay_record record;
+	FILE *file;
+	guint32 i;
+	int r = 0;
+
+	file = fopen(path, "rb");
+	if (!file) {
+		r = -errno;
+		g_array_free(array, TRUE);
+		return r;
+	}
+
+	if (fread(magic, sizeof(magic), 1, file) != 1
+			|| memcmp(magic, USB_REPLAY_MAGIC, sizeof(magic)) != 0) {
+		fp_err("%s is not a USB recording", path);
+		r = -EINVAL;
+		goto out;
+	}
+
+	while (fread(&record.hdr, sizeof(record.hdr), 1, file) == 1) {
+		record.data = g_malloc(record.hdr.data_len);
+		if (record.hdr.data_len && fread(record.data,
+				record.hdr.data_len, 1, file) != 1) {
+			fp_err("%s is truncated", path);
+			g_free(record.data);
+			r = -EINVAL;
+			goto out;
+		}
+		g_array_append_val(array, record);
+	}
+
+out:
+	fclose(file);
+	nr_records = array->len;
+	records = (struct usb_replay_record *) g_array_free(array, FALSE);
+	if (r < 0)
+		return r;
+
+	/* recorded in completion order, replayed in submission order */
+	qsort(records, nr_records, sizeof(*records), record_sort_seq);
+	queues = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+		queue_free);
+	for (i = 0; i < nr_records; i++) {
+		gpointer key = queue_key(records[i].hdr.endpoint,
+			records[i].hdr.type);
+		GQueue *queue = g_hash_table_lookup(queues, key);
+
+		if (!queue) {
+			queue = g_queue_new();
+			g_hash_table_insert(queues, key, queue);
+		}
+		g_queue_push_tail(queue, &records[i]);
+	}
+	pending = g_hash_table_new(g_direct_hash, g_direct_equal);
+	fp_dbg("replaying %u transfers from %s", nr_records, path);
+	return 0;
+}
+
+int fpi_usb_replay_init(void)
+{
+	const char *record_path = g_getenv("LIBFPRINT_USB_RECORD");
+	const char *replay_path = g_getenv("LIBFPRINT_USB_REPLAY");
+	const char *speed = g_getenv("LIBFPRINT_USB_REPLAY_SPEED");
+	int r;
+
+	start_us = g_get_monotonic_time();
+
+	if (replay_path) {
+		r = replay_load(replay_path);
+		if (r < 0) {
+			fp_err("could not load USB recording %s: %d",
+				replay_path, r);
+			fpi_usb_replay_exit();
+			return r;
+		}
+		max_speed = g_strcmp0(speed, "max") == 0;
+		mode = USB_REPLAY_REPLAY;
+	} else if (record_path) {
+		record_file = fopen(record_path, "wb");
+		if (!record_file
+				|| fwrite(USB_REPLAY_MAGIC, strlen(USB_REPLAY_MAGIC),
+					1, record_file) != 1) {
+			r = -errno;
+			fp_err("could not create USB recording %s: %d",
+				record_path, r);
+			fpi_usb_replay_exit();
+			return r;
+		}
+		record_seq = 0;
+		mode = USB_REPLAY_RECORD;
+		fp_dbg("recording USB transfers to %s", record_path);
+	}
+	return 0;
+}
+
+void fpi_usb_replay_exit(void)
+{
+	guint32 i;
+
+	if (pending) {
+		GHashTableIter iter;
+		gpointer value;
+
+		/* nothing will run the timers of these anymore */
+		g_hash_table_iter_init(&iter, pending);
+		while (g_hash_table_iter_next(&iter, NULL, &value)) {
+			struct usb_replay *replay = value;
+
+			fpi_timeout_cancel(&replay->timeout);
+			g_slice_free(struct usb_replay, replay);
+		}
+		g_hash_table_destroy(pending);
+		pending = NULL;
+	}
+	if (queues) {
+		g_hash_table_destroy(queues);
+		queues = NULL;
+	}
+	for (i = 0; i < nr_records; i++)
+		g_free(records[i].data);
+	g_free(records);
+	records = NULL;
+	nr_records = 0;
+
+	if (record_file) {
+		fclose(record_file);
+		record_file = NULL;
+	}
+	mode = USB_REPLAY_OFF;
+}
+
+int fpi_usb_replay_submit(struct libusb_transfer *transfer)
+{
+	switch (mode) {
+	case USB_REPLAY_RECORD:
+		return record_submit(transfer);
+	case USB_REPLAY_REPLAY:
+		return replay_submit(transfer);
+	default:
+		return libusb_submit_transfer(transfer);
+	}
+}
+
+int fpi_usb_replay_cancel(struct libusb_transfer *transfer)
+{
+	if (mode == USB_REPLAY_REPLAY)
+		return replay_cancel(transfer);
+	return libusb_cancel_transfer(transfer);
+}